@@ -0,0 +1,65 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Micro-benchmarks of BallotBox
+
+#include <benchmark/benchmark.h>
+#include <butil/string_printf.h>
+#include "braft/ballot_box.h"
+#include "braft/closure_queue.h"
+#include "braft/configuration.h"
+#include "braft/fsm_caller.h"
+
+namespace {
+
+class DummyCaller : public braft::FSMCaller {
+public:
+    virtual int on_committed(int64_t committed_index) { return 0; }
+};
+
+// Each iteration appends one task and commits it at every peer, as the
+// replicators of a leader do for each entry.
+// Arguments: number of peers
+void BM_BallotBoxCommitAt(benchmark::State& state) {
+    const int num_peers = state.range(0);
+    DummyCaller caller;
+    braft::ClosureQueue cq(false);
+    braft::BallotBoxOptions opt;
+    opt.waiter = &caller;
+    opt.closure_queue = &cq;
+    braft::BallotBox ballot_box;
+    if (ballot_box.init(opt) != 0 || ballot_box.reset_pending_index(1) != 0) {
+        state.SkipWithError("Fail to init BallotBox");
+        return;
+    }
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < num_peers; ++i) {
+        std::string peer_addr;
+        butil::string_printf(&peer_addr, "192.168.1.%d:8888", i + 1);
+        peers.push_back(braft::PeerId(peer_addr));
+    }
+    const braft::Configuration conf(peers);
+    int64_t index = 1;
+    for (auto _ : state) {
+        ballot_box.append_pending_task(conf, NULL, NULL);
+        for (int i = 0; i < num_peers; ++i) {
+            ballot_box.commit_at(index, index, peers[i]);
+        }
+        ++index;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BallotBoxCommitAt)->ArgName("peers")->DenseRange(1, 9);
+
+}  // namespace
@@ -0,0 +1,429 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Throughput and latency benchmark of raft groups driven through
+// Node::apply. See benchmark/README.md for the usage.
+
+#include <gflags/gflags.h>
+#include <butil/atomicops.h>
+#include <butil/file_util.h>
+#include <butil/string_printf.h>
+#include <butil/string_splitter.h>
+#include <butil/time.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+#include <brpc/server.h>
+#include <braft/raft.h>
+#include <braft/util.h>
+
+DEFINE_string(groups, "1", "Comma-separated numbers of groups, each of which "
+              "is benchmarked in one round, e.g. 1,10,100,1000,10000 for a "
+              "multi-group scaling curve");
+DEFINE_int32(replicas, 3, "Number of replicas of each group in the "
+             "in-process mode");
+DEFINE_string(peers, "", "Comma-separated ip:port of the processes hosting "
+              "the replicas in the multi-process mode, which includes this "
+              "process at --port. Each process drives the groups it leads. "
+              "Empty to host all the replicas in this process");
+DEFINE_int32(port, 8500, "Listen port of this process");
+DEFINE_string(storage, "local", "Log storage of the nodes: local, memory or "
+              "shared");
+DEFINE_string(data_path, "./bench_data", "Path of the storages");
+DEFINE_int32(entry_size, 1024, "Bytes of the data of each task");
+DEFINE_string(mode, "closed", "closed: each group keeps --inflight tasks in "
+              "flight; open: tasks are applied at --qps regardless of the "
+              "returned ones");
+DEFINE_int32(inflight, 1, "Tasks in flight per group in the closed-loop mode");
+DEFINE_int32(qps, 10000, "Tasks applied per second in the open-loop mode");
+DEFINE_int32(warmup_s, 2, "Seconds to run before measuring");
+DEFINE_int32(duration_s, 10, "Seconds to measure in each round");
+DEFINE_int32(election_timeout_ms, 1000, "Election timeout of the nodes");
+DEFINE_int32(leader_wait_s, 60, "Max seconds to wait for the leaders of all "
+             "the groups");
+
+namespace bench {
+
+// Set during the measured period of a round
+static butil::atomic<bool> g_recording(false);
+static butil::atomic<bool> g_stopped(false);
+static butil::atomic<int64_t> g_inflight(0);
+static bvar::LatencyRecorder* g_apply_latency = NULL;
+static bvar::LatencyRecorder* g_done_latency = NULL;
+static butil::atomic<int64_t> g_failed(0);
+
+// The first 8 bytes of the data of a task are the time it's applied
+static void make_data(butil::IOBuf* data) {
+    const int64_t now = butil::cpuwide_time_us();
+    data->append(&now, sizeof(now));
+    const size_t padding = FLAGS_entry_size > (int)sizeof(now)
+                           ? FLAGS_entry_size - sizeof(now) : 0;
+    static const std::string s_padding(64 * 1024, 'x');
+    for (size_t left = padding; left > 0;) {
+        const size_t n = std::min(left, s_padding.size());
+        data->append(s_padding.data(), n);
+        left -= n;
+    }
+}
+
+class BenchFsm : public braft::StateMachine {
+public:
+    BenchFsm() : _leader_term(-1) {}
+
+    void on_apply(braft::Iterator& iter) {
+        const int64_t now = butil::cpuwide_time_us();
+        for (; iter.valid(); iter.next()) {
+            if (iter.done() == NULL
+                    || !g_recording.load(butil::memory_order_relaxed)) {
+                continue;
+            }
+            int64_t start_us = 0;
+            if (iter.data().copy_to(&start_us, sizeof(start_us))
+                    == sizeof(start_us)) {
+                *g_apply_latency << now - start_us;
+            }
+        }
+    }
+
+    void on_leader_start(int64_t term) {
+        _leader_term.store(term, butil::memory_order_release);
+    }
+
+    void on_leader_stop(const butil::Status& status) {
+        _leader_term.store(-1, butil::memory_order_release);
+    }
+
+    int64_t leader_term() const {
+        return _leader_term.load(butil::memory_order_acquire);
+    }
+
+private:
+    butil::atomic<int64_t> _leader_term;
+};
+
+struct Replica {
+    Replica() : node(NULL) {}
+    braft::Node* node;
+    BenchFsm fsm;
+};
+
+struct Group {
+    std::vector<Replica*> replicas;
+
+    Replica* leader() const {
+        for (size_t i = 0; i < replicas.size(); ++i) {
+            if (replicas[i]->fsm.leader_term() > 0) {
+                return replicas[i];
+            }
+        }
+        return NULL;
+    }
+};
+
+static void apply_task(Replica* leader, braft::Closure* done) {
+    butil::IOBuf data;
+    make_data(&data);
+    braft::Task task;
+    task.data = &data;
+    task.done = done;
+    task.expected_term = leader->fsm.leader_term();
+    g_inflight.fetch_add(1, butil::memory_order_relaxed);
+    leader->node->apply(task);
+}
+
+// In the closed-loop mode a slot applies the next task of its group as soon
+// as the previous one is done
+class TaskDone : public braft::Closure {
+public:
+    TaskDone(Replica* leader, bool reuse)
+        : _leader(leader), _reuse(reuse), _start_us(0) {}
+
+    void start() {
+        _start_us = butil::cpuwide_time_us();
+        apply_task(_leader, this);
+    }
+
+    void Run() {
+        if (!status().ok()) {
+            g_failed.fetch_add(1, butil::memory_order_relaxed);
+        } else if (g_recording.load(butil::memory_order_relaxed)) {
+            *g_done_latency << butil::cpuwide_time_us() - _start_us;
+        }
+        g_inflight.fetch_sub(1, butil::memory_order_relaxed);
+        if (!_reuse) {
+            delete this;
+            return;
+        }
+        if (!g_stopped.load(butil::memory_order_relaxed)) {
+            status().reset();
+            start();
+        }
+    }
+
+private:
+    Replica* _leader;
+    bool _reuse;
+    int64_t _start_us;
+};
+
+static int parse_peers(std::vector<braft::PeerId>* peers, int* self) {
+    *self = -1;
+    for (butil::StringSplitter sp(FLAGS_peers.c_str(), ','); sp; ++sp) {
+        braft::PeerId peer;
+        if (peer.parse(std::string(sp.field(), sp.length())) != 0) {
+            LOG(ERROR) << "Fail to parse peer `"
+                       << std::string(sp.field(), sp.length()) << '\'';
+            return -1;
+        }
+        if (peer.addr.port == FLAGS_port
+                && (peer.addr.ip == butil::my_ip()
+                    || strcmp(butil::ip2str(peer.addr.ip).c_str(),
+                              "127.0.0.1") == 0)) {
+            *self = peers->size();
+        }
+        peers->push_back(peer);
+    }
+    if (*self < 0) {
+        LOG(ERROR) << "--peers doesn't contain this process at port "
+                   << FLAGS_port;
+        return -1;
+    }
+    return 0;
+}
+
+static int start_replica(const braft::GroupId& group_id,
+                         const braft::PeerId& peer_id,
+                         const braft::Configuration& conf,
+                         Replica* replica) {
+    braft::NodeOptions options;
+    options.initial_conf = conf;
+    options.election_timeout_ms = FLAGS_election_timeout_ms;
+    options.fsm = &replica->fsm;
+    options.node_owns_fsm = false;
+    options.snapshot_interval_s = 0;
+    const std::string path = FLAGS_data_path + "/" + group_id + "/"
+                             + peer_id.to_string();
+    options.log_uri = FLAGS_storage + "://" + path + "/log";
+    options.raft_meta_uri = (FLAGS_storage == "shared" ? "shared://" : "local://")
+                            + path + "/raft_meta";
+    replica->node = new braft::Node(group_id, peer_id);
+    if (replica->node->init(options) != 0) {
+        LOG(ERROR) << "Fail to init node " << group_id << ':' << peer_id;
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_groups(std::vector<Group>* groups) {
+    for (size_t i = 0; i < groups->size(); ++i) {
+        for (size_t j = 0; j < (*groups)[i].replicas.size(); ++j) {
+            Replica* r = (*groups)[i].replicas[j];
+            if (r->node) {
+                r->node->shutdown(NULL);
+            }
+        }
+    }
+    for (size_t i = 0; i < groups->size(); ++i) {
+        for (size_t j = 0; j < (*groups)[i].replicas.size(); ++j) {
+            Replica* r = (*groups)[i].replicas[j];
+            if (r->node) {
+                r->node->join();
+                delete r->node;
+            }
+            delete r;
+        }
+    }
+    groups->clear();
+}
+
+static void sleep_until(int64_t end_us) {
+    const int64_t now = butil::cpuwide_time_us();
+    if (end_us > now) {
+        bthread_usleep(end_us - now);
+    }
+}
+
+static void drive_open_loop(const std::vector<Replica*>& leaders,
+                            int64_t end_us) {
+    // Issue the tasks in ticks of 1ms, round-robin over the groups
+    const double per_tick = FLAGS_qps / 1000.0;
+    double credit = 0;
+    size_t next = 0;
+    int64_t tick_us = butil::cpuwide_time_us();
+    while (tick_us < end_us) {
+        credit += per_tick;
+        for (; credit >= 1; credit -= 1) {
+            (new TaskDone(leaders[next], false))->start();
+            next = (next + 1) % leaders.size();
+        }
+        tick_us += 1000;
+        sleep_until(tick_us);
+    }
+}
+
+static int run_round(int ngroups, const std::vector<braft::PeerId>& peers,
+                     int self) {
+    braft::Configuration conf;
+    for (size_t i = 0; i < peers.size(); ++i) {
+        conf.add_peer(peers[i]);
+    }
+    std::vector<Group> groups(ngroups);
+    for (int i = 0; i < ngroups; ++i) {
+        const braft::GroupId group_id = "bench_" + butil::string_printf("%d", i);
+        for (size_t j = 0; j < peers.size(); ++j) {
+            if (self >= 0 && (int)j != self) {
+                continue;
+            }
+            Replica* r = new Replica;
+            groups[i].replicas.push_back(r);
+            if (start_replica(group_id, peers[j], conf, r) != 0) {
+                stop_groups(&groups);
+                return -1;
+            }
+        }
+    }
+
+    // Wait for the leaders. In the multi-process mode some groups are led by
+    // the other processes and are driven there.
+    std::vector<Replica*> leaders;
+    const int64_t wait_end_ms = butil::gettimeofday_ms()
+                                + FLAGS_leader_wait_s * 1000L;
+    while (true) {
+        leaders.clear();
+        int nleaders = 0;
+        for (int i = 0; i < ngroups; ++i) {
+            Replica* leader = groups[i].leader();
+            if (leader) {
+                leaders.push_back(leader);
+                ++nleaders;
+            } else if (self >= 0
+                    && !groups[i].replicas[0]->node->leader_id().is_empty()) {
+                ++nleaders;
+            }
+        }
+        if (nleaders == ngroups) {
+            break;
+        }
+        if (butil::gettimeofday_ms() > wait_end_ms) {
+            LOG(ERROR) << "Only " << nleaders << " of " << ngroups
+                       << " groups elected leaders in "
+                       << FLAGS_leader_wait_s << "s";
+            stop_groups(&groups);
+            return -1;
+        }
+        bthread_usleep(100 * 1000);
+    }
+
+    bvar::LatencyRecorder apply_latency(FLAGS_duration_s);
+    bvar::LatencyRecorder done_latency(FLAGS_duration_s);
+    g_apply_latency = &apply_latency;
+    g_done_latency = &done_latency;
+    g_failed.store(0, butil::memory_order_relaxed);
+    g_recording.store(false, butil::memory_order_relaxed);
+    g_stopped.store(false, butil::memory_order_relaxed);
+
+    const int64_t start_us = butil::cpuwide_time_us();
+    const int64_t record_us = start_us + FLAGS_warmup_s * 1000000L;
+    const int64_t end_us = record_us + FLAGS_duration_s * 1000000L;
+    std::vector<TaskDone*> slots;
+    if (FLAGS_mode == "closed") {
+        for (size_t i = 0; i < leaders.size(); ++i) {
+            for (int j = 0; j < FLAGS_inflight; ++j) {
+                slots.push_back(new TaskDone(leaders[i], true));
+                slots.back()->start();
+            }
+        }
+        sleep_until(record_us);
+        g_recording.store(true, butil::memory_order_relaxed);
+        sleep_until(end_us);
+    } else if (!leaders.empty()) {
+        drive_open_loop(leaders, record_us);
+        g_recording.store(true, butil::memory_order_relaxed);
+        drive_open_loop(leaders, end_us);
+    }
+    g_recording.store(false, butil::memory_order_relaxed);
+    g_stopped.store(true, butil::memory_order_relaxed);
+    while (g_inflight.load(butil::memory_order_relaxed) > 0) {
+        bthread_usleep(10 * 1000);
+    }
+
+    const int64_t count = done_latency.count();
+    printf("groups=%d leaders=%lu replicas=%lu entry_size=%d storage=%s "
+           "mode=%s throughput=%.0f/s failed=%ld "
+           "apply_latency_us(p50/p99/p999)=%ld/%ld/%ld "
+           "done_latency_us(p50/p99/p999)=%ld/%ld/%ld\n",
+           ngroups, leaders.size(), peers.size(), FLAGS_entry_size,
+           FLAGS_storage.c_str(), FLAGS_mode.c_str(),
+           count / (double)FLAGS_duration_s,
+           g_failed.load(butil::memory_order_relaxed),
+           apply_latency.latency_percentile(0.5),
+           apply_latency.latency_percentile(0.99),
+           apply_latency.latency_percentile(0.999),
+           done_latency.latency_percentile(0.5),
+           done_latency.latency_percentile(0.99),
+           done_latency.latency_percentile(0.999));
+    fflush(stdout);
+
+    for (size_t i = 0; i < slots.size(); ++i) {
+        delete slots[i];
+    }
+    stop_groups(&groups);
+    g_apply_latency = NULL;
+    g_done_latency = NULL;
+    butil::DeleteFile(butil::FilePath(FLAGS_data_path), true);
+    return 0;
+}
+
+}  // namespace bench
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    butil::AtExitManager exit_manager;
+
+    std::vector<braft::PeerId> peers;
+    int self = -1;
+    if (FLAGS_peers.empty()) {
+        butil::EndPoint addr(butil::my_ip(), FLAGS_port);
+        for (int i = 0; i < FLAGS_replicas; ++i) {
+            peers.push_back(braft::PeerId(addr, i));
+        }
+    } else if (bench::parse_peers(&peers, &self) != 0) {
+        return -1;
+    }
+
+    brpc::Server server;
+    if (braft::add_service(&server, FLAGS_port) != 0) {
+        LOG(ERROR) << "Fail to add raft service";
+        return -1;
+    }
+    if (server.Start(FLAGS_port, NULL) != 0) {
+        LOG(ERROR) << "Fail to start Server";
+        return -1;
+    }
+
+    butil::DeleteFile(butil::FilePath(FLAGS_data_path), true);
+    for (butil::StringSplitter sp(FLAGS_groups.c_str(), ','); sp; ++sp) {
+        int ngroups = 0;
+        if (sp.to_int(&ngroups) != 0 || ngroups <= 0) {
+            LOG(ERROR) << "Invalid --groups=" << FLAGS_groups;
+            return -1;
+        }
+        if (bench::run_round(ngroups, peers, self) != 0) {
+            return -1;
+        }
+    }
+
+    server.Stop(0);
+    server.Join();
+    return 0;
+}
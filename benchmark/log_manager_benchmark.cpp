@@ -0,0 +1,94 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Micro-benchmarks of LogManager
+
+#include <benchmark/benchmark.h>
+#include <gflags/gflags.h>
+#include <butil/file_util.h>
+#include <butil/string_printf.h>
+#include <bthread/countdown_event.h>
+#include "braft/log.h"
+#include "braft/log_manager.h"
+#include "braft/configuration_manager.h"
+
+namespace {
+
+const char* const kPath = "./log_manager_benchmark_data";
+
+class CountdownClosure : public braft::LogManager::StableClosure {
+public:
+    explicit CountdownClosure(bthread::CountdownEvent* event)
+        : _event(event) {}
+    void Run() {
+        _event->signal();
+        delete this;
+    }
+private:
+    bthread::CountdownEvent* _event;
+};
+
+// Appends as many single-entry batches as the leader issues for a burst of
+// tasks, so that the disk thread merges them into writes of up to
+// raft_leader_batch entries.
+// Arguments: raft_leader_batch, entries appended in each iteration, whether
+// to sync the log
+void BM_LogManagerAppendEntries(benchmark::State& state) {
+    const int leader_batch = state.range(0);
+    const int burst = state.range(1);
+    const bool sync = state.range(2);
+    GFLAGS_NS::SetCommandLineOption(
+            "raft_leader_batch", butil::string_printf("%d", leader_batch).c_str());
+    GFLAGS_NS::SetCommandLineOption("raft_sync", sync ? "true" : "false");
+    butil::DeleteFile(butil::FilePath(kPath), true);
+    braft::ConfigurationManager cm;
+    braft::SegmentLogStorage storage(kPath);
+    braft::LogManager lm;
+    braft::LogManagerOptions opt;
+    opt.log_storage = &storage;
+    opt.configuration_manager = &cm;
+    if (lm.init(opt) != 0) {
+        state.SkipWithError("Fail to init LogManager");
+        return;
+    }
+    const std::string data(512, 'x');
+    int64_t index = 1;
+    for (auto _ : state) {
+        bthread::CountdownEvent event(burst);
+        for (int i = 0; i < burst; ++i) {
+            braft::LogEntry* entry = new braft::LogEntry;
+            entry->AddRef();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id = braft::LogId(index++, 1);
+            entry->data.append(data);
+            std::vector<braft::LogEntry*> entries;
+            entries.push_back(entry);
+            lm.append_entries(&entries, new CountdownClosure(&event));
+        }
+        event.wait();
+        state.PauseTiming();
+        lm.set_applied_id(braft::LogId(index - 1, 1));
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * burst);
+    lm.stop_disk_thread();
+    butil::DeleteFile(butil::FilePath(kPath), true);
+}
+BENCHMARK(BM_LogManagerAppendEntries)
+    ->ArgNames({"leader_batch", "burst", "sync"})
+    ->Args({1, 1024, 0})->Args({32, 1024, 0})->Args({256, 1024, 0})
+    ->Args({1, 1024, 1})->Args({32, 1024, 1})->Args({256, 1024, 1})
+    ->UseRealTime();
+
+}  // namespace
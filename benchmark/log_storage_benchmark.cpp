@@ -0,0 +1,135 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Micro-benchmarks of MemoryLogStorage against SegmentLogStorage without
+// fsync, i.e. the cost of the storage itself
+
+#include <benchmark/benchmark.h>
+#include <butil/file_util.h>
+#include "braft/log.h"
+#include "braft/memory_log.h"
+#include "braft/log_entry.h"
+#include "braft/storage.h"
+#include "braft/configuration_manager.h"
+
+namespace {
+
+const char* const kPath = "./log_storage_benchmark_data";
+
+enum StorageType {
+    MEMORY = 0,
+    SEGMENT = 1,
+};
+
+braft::LogStorage* new_storage(int type) {
+    butil::DeleteFile(butil::FilePath(kPath), true);
+    braft::FLAGS_raft_sync = false;
+    braft::LogStorage* storage = NULL;
+    if (type == MEMORY) {
+        storage = new braft::MemoryLogStorage(kPath);
+    } else {
+        storage = new braft::SegmentLogStorage(kPath, false);
+    }
+    braft::ConfigurationManager cm;
+    if (storage->init(&cm) != 0) {
+        delete storage;
+        return NULL;
+    }
+    return storage;
+}
+
+void append(braft::LogStorage* storage, int64_t first_index, int count,
+            size_t entry_size) {
+    const std::string data(entry_size, 'x');
+    std::vector<braft::LogEntry*> entries;
+    for (int i = 0; i < count; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id = braft::LogId(first_index + i, 1);
+        entry->data.append(data);
+        entries.push_back(entry);
+    }
+    storage->append_entries(entries);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+}
+
+// Arguments: storage type, entry size. Appends batches of 32 logs and
+// discards the older half once 64K logs are kept, like a snapshot does
+void BM_LogStorageAppend(benchmark::State& state) {
+    const size_t entry_size = state.range(1);
+    const int batch = 32;
+    braft::LogStorage* storage = new_storage(state.range(0));
+    if (storage == NULL) {
+        state.SkipWithError("Fail to init storage");
+        return;
+    }
+    int64_t index = 1;
+    for (auto _ : state) {
+        append(storage, index, batch, entry_size);
+        index += batch;
+        if (index - storage->first_log_index() >= 65536) {
+            storage->truncate_prefix(index - 32768);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * batch);
+    state.SetBytesProcessed(state.iterations() * batch * entry_size);
+    delete storage;
+    butil::DeleteFile(butil::FilePath(kPath), true);
+}
+BENCHMARK(BM_LogStorageAppend)
+    ->ArgNames({"memory0_segment1", "entry_size"})
+    ->Args({MEMORY, 128})->Args({MEMORY, 4096})
+    ->Args({SEGMENT, 128})->Args({SEGMENT, 4096});
+
+// Arguments: storage type. Readers run get_entry concurrently
+void BM_LogStorageGet(benchmark::State& state) {
+    static braft::LogStorage* s_storage = NULL;
+    const int64_t N = 65536;
+    if (state.thread_index() == 0) {
+        s_storage = new_storage(state.range(0));
+        if (s_storage) {
+            for (int64_t i = 1; i <= N; i += 256) {
+                append(s_storage, i, 256, 128);
+            }
+        }
+    }
+    int64_t index = state.thread_index();
+    for (auto _ : state) {
+        if (s_storage == NULL) {
+            state.SkipWithError("Fail to init storage");
+            break;
+        }
+        braft::LogEntry* entry = s_storage->get_entry(index % N + 1);
+        index += 7;
+        if (entry == NULL) {
+            state.SkipWithError("Fail to get");
+            break;
+        }
+        entry->Release();
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        delete s_storage;
+        s_storage = NULL;
+        butil::DeleteFile(butil::FilePath(kPath), true);
+    }
+}
+BENCHMARK(BM_LogStorageGet)
+    ->ArgNames({"memory0_segment1"})->Arg(MEMORY)->Arg(SEGMENT)
+    ->Threads(1)->Threads(8);
+
+}  // namespace
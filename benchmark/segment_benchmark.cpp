@@ -0,0 +1,176 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Micro-benchmarks of Segment and SegmentLogStorage
+
+#include <fcntl.h>
+#include <benchmark/benchmark.h>
+#include <butil/file_util.h>
+#include <butil/files/file_enumerator.h>
+#include "braft/log.h"
+#include "braft/log_entry.h"
+#include "braft/configuration_manager.h"
+
+namespace {
+
+const char* const kPath = "./segment_benchmark_data";
+
+braft::LogEntry* new_entry(int64_t index, size_t size) {
+    braft::LogEntry* entry = new braft::LogEntry;
+    entry->AddRef();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->id = braft::LogId(index, 1);
+    const std::string data(size, 'x');
+    entry->data.append(data);
+    return entry;
+}
+
+void reset_dir() {
+    butil::DeleteFile(butil::FilePath(kPath), true);
+    butil::CreateDirectory(butil::FilePath(kPath));
+}
+
+// Drop the pages of all the files under kPath from the page cache
+void drop_page_cache() {
+    butil::FileEnumerator files(butil::FilePath(kPath), false,
+                                butil::FileEnumerator::FILES);
+    for (butil::FilePath p = files.Next(); !p.empty(); p = files.Next()) {
+        int fd = ::open(p.value().c_str(), O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+    }
+}
+
+// Arguments: entry size, whether to sync after each append
+void BM_SegmentAppend(benchmark::State& state) {
+    const size_t entry_size = state.range(0);
+    const bool sync = state.range(1);
+    reset_dir();
+    scoped_refptr<braft::Segment> seg(new braft::Segment(kPath, 1, 0));
+    if (seg->create() != 0) {
+        state.SkipWithError("Fail to create segment");
+        return;
+    }
+    int64_t index = 1;
+    for (auto _ : state) {
+        braft::LogEntry* entry = new_entry(index++, entry_size);
+        if (seg->append(entry) != 0) {
+            state.SkipWithError("Fail to append");
+        }
+        entry->Release();
+        if (sync) {
+            seg->sync(true);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * entry_size);
+    seg->close(false);
+    seg->unlink();
+}
+BENCHMARK(BM_SegmentAppend)
+    ->ArgNames({"entry_size", "sync"})
+    ->Args({128, 0})->Args({4096, 0})->Args({65536, 0})
+    ->Args({128, 1})->Args({4096, 1})->Args({65536, 1});
+
+// Arguments: entry size, whether the page cache is dropped before each get
+void BM_SegmentGet(benchmark::State& state) {
+    const size_t entry_size = state.range(0);
+    const bool cold = state.range(1);
+    const int64_t N = 1024;
+    reset_dir();
+    scoped_refptr<braft::Segment> seg(new braft::Segment(kPath, 1, 0));
+    if (seg->create() != 0) {
+        state.SkipWithError("Fail to create segment");
+        return;
+    }
+    for (int64_t i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = new_entry(i, entry_size);
+        seg->append(entry);
+        entry->Release();
+    }
+    seg->close(true);
+    int64_t index = 0;
+    for (auto _ : state) {
+        if (cold) {
+            state.PauseTiming();
+            drop_page_cache();
+            state.ResumeTiming();
+        }
+        braft::LogEntry* entry = seg->get(index % N + 1);
+        ++index;
+        if (entry == NULL) {
+            state.SkipWithError("Fail to get");
+            break;
+        }
+        entry->Release();
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * entry_size);
+    seg->unlink();
+}
+BENCHMARK(BM_SegmentGet)
+    ->ArgNames({"entry_size", "cold"})
+    ->Args({128, 0})->Args({4096, 0})->Args({65536, 0})
+    ->Args({128, 1})->Args({4096, 1})->Args({65536, 1});
+
+// Time to load the segments of a log of the given MB, reported in bytes per
+// second so that the time per GB is 1GB divided by the rate
+void BM_LoadSegments(benchmark::State& state) {
+    const int64_t log_bytes = state.range(0) * 1024 * 1024;
+    const size_t entry_size = 4096;
+    reset_dir();
+    {
+        braft::SegmentLogStorage storage(kPath, false);
+        braft::ConfigurationManager cm;
+        if (storage.init(&cm) != 0) {
+            state.SkipWithError("Fail to init storage");
+            return;
+        }
+        std::vector<braft::LogEntry*> entries;
+        int64_t index = 1;
+        for (int64_t bytes = 0; bytes < log_bytes; bytes += entry_size) {
+            entries.push_back(new_entry(index++, entry_size));
+            if (entries.size() == 256 || bytes + (int64_t)entry_size >= log_bytes) {
+                storage.append_entries(entries);
+                for (size_t i = 0; i < entries.size(); ++i) {
+                    entries[i]->Release();
+                }
+                entries.clear();
+            }
+        }
+    }
+    for (auto _ : state) {
+        state.PauseTiming();
+        drop_page_cache();
+        braft::SegmentLogStorage* storage =
+                new braft::SegmentLogStorage(kPath, false);
+        braft::ConfigurationManager cm;
+        state.ResumeTiming();
+        if (storage->init(&cm) != 0) {
+            state.SkipWithError("Fail to load segments");
+        }
+        state.PauseTiming();
+        delete storage;
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * log_bytes);
+    butil::DeleteFile(butil::FilePath(kPath), true);
+}
+BENCHMARK(BM_LoadSegments)
+    ->ArgNames({"log_mb"})->Arg(64)->Arg(256)->Arg(1024)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
@@ -14,6 +14,11 @@
 
 #include <sys/types.h>                  // O_CREAT
 #include <fcntl.h>                      // open
+#if defined(__linux__)
+#include <sys/ioctl.h>                  // ioctl
+#include <linux/fs.h>                   // FICLONE
+#endif
+#include <vector>
 #include <gflags/gflags.h>              // DEFINE_*
 #include <butil/sys_byteorder.h>        // butil::NetToHost32
 #include <brpc/controller.h>            // brpc::Controller
@@ -28,8 +33,12 @@ DEFINE_bool(disable_cli, false, "Don't allow raft_cli access this node");
 DEFINE_bool(log_applied_task, false, "Print notice log when a task is applied");
 DEFINE_int32(election_timeout_ms, 5000, 
             "Start election in such milliseconds if disconnect with the leader");
+DEFINE_int32(max_coalesced_bytes, 4 * 1024 * 1024,
+             "Max bytes of the contiguous writes coalesced into one pwritev");
 DEFINE_int32(port, 8200, "Listen port of this peer");
 DEFINE_int32(snapshot_interval, 30, "Interval between each snapshot");
+DEFINE_bool(reflink_snapshot, true, "Take snapshots by cloning the data file "
+            "on the file systems supporting reflink, e.g. XFS and Btrfs");
 DEFINE_string(conf, "", "Initial configuration of the replication group");
 DEFINE_string(data_path, "./data", "Path of data stored on");
 DEFINE_string(group, "Block", "Id of the replication group");
@@ -249,24 +258,86 @@ friend class BlockClosure;
         }
     }
 
+    // The contiguous writes not written yet
+    struct PendingWrite {
+        PendingWrite() : offset(0), ntask(0) {}
+        off_t offset;
+        butil::IOBuf data;
+        size_t ntask;
+        std::vector<BlockClosure*> dones;
+    };
+
+    // Write |pending| with one pwritev, moving its closures to |written| on
+    // success. On failure the closures are left to raft, which runs them
+    // with the error once the tasks are rolled back.
+    // Returns 0 on success, -1 otherwise
+    int flush(PendingWrite* pending, std::vector<BlockClosure*>* written) {
+        if (pending->ntask == 0) {
+            return 0;
+        }
+        const ssize_t nw = braft::file_pwrite(pending->data, _fd->fd(),
+                                              pending->offset);
+        if (nw < 0) {
+            PLOG(ERROR) << "Fail to write to fd=" << _fd->fd();
+            for (size_t i = 0; i < pending->dones.size(); ++i) {
+                pending->dones[i]->response()->set_success(false);
+            }
+            return -1;
+        }
+        for (size_t i = 0; i < pending->dones.size(); ++i) {
+            pending->dones[i]->response()->set_success(true);
+            written->push_back(pending->dones[i]);
+        }
+        LOG_IF(INFO, FLAGS_log_applied_task)
+                << "Write " << pending->data.size() << " bytes of "
+                << pending->ntask << " tasks from offset=" << pending->offset;
+        pending->data.clear();
+        pending->ntask = 0;
+        pending->dones.clear();
+        return 0;
+    }
+
+    static void* run_closures(void* arg) {
+        std::vector<BlockClosure*>* dones = (std::vector<BlockClosure*>*)arg;
+        for (size_t i = 0; i < dones->size(); ++i) {
+            (*dones)[i]->Run();
+        }
+        delete dones;
+        return NULL;
+    }
+
+    // Respond the writes of a batch together in one bthread to avoid that the
+    // callbacks block the StateMachine
+    static void run_closures_in_bthread(std::vector<BlockClosure*>* dones) {
+        if (dones->empty()) {
+            return;
+        }
+        std::vector<BlockClosure*>* arg = new std::vector<BlockClosure*>;
+        arg->swap(*dones);
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_closures, arg) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            run_closures(arg);
+        }
+    }
+
     // @braft::StateMachine
     void on_apply(braft::Iterator& iter) {
         // A batch of tasks are committed, which must be processed through 
-        // |iter|
+        // |iter|. The writes to contiguous ranges are coalesced into one
+        // pwritev, and their closures are run together after the batch.
+        PendingWrite pending;
+        std::vector<BlockClosure*> written;
         for (; iter.valid(); iter.next()) {
-            BlockResponse* response = NULL;
-            // This guard helps invoke iter.done()->Run() asynchronously to
-            // avoid that callback blocks the StateMachine
-            braft::AsyncClosureGuard closure_guard(iter.done());
             butil::IOBuf data;
             off_t offset = 0;
+            BlockClosure* c = NULL;
             if (iter.done()) {
                 // This task is applied by this node, get value from this
                 // closure to avoid additional parsing.
-                BlockClosure* c = dynamic_cast<BlockClosure*>(iter.done());
+                c = dynamic_cast<BlockClosure*>(iter.done());
                 offset = c->request()->offset();
                 data.swap(*(c->data()));
-                response = c->response();
             } else {
                 // Have to parse BlockRequest from this log.
                 uint32_t meta_size = 0;
@@ -284,36 +355,49 @@ friend class BlockClosure;
                 offset = request.offset();
             }
 
-            const ssize_t nw = braft::file_pwrite(data, _fd->fd(), offset);
-            if (nw < 0) {
-                PLOG(ERROR) << "Fail to write to fd=" << _fd->fd();
-                if (response) {
-                    response->set_success(false);
+            if (pending.ntask > 0 &&
+                    (offset != pending.offset + (off_t)pending.data.size() ||
+                     pending.data.size() + data.size() >
+                            (size_t)FLAGS_max_coalesced_bytes)) {
+                const size_t ntail = pending.ntask + 1;
+                if (flush(&pending, &written) != 0) {
+                    // Only the closures of the tasks written are run here
+                    run_closures_in_bthread(&written);
+                    // Some disk error occurred, notify raft and never apply
+                    // any data ever after. The closures of the tasks rolled
+                    // back, including this one, are run by raft.
+                    return iter.set_error_and_rollback(ntail);
                 }
-                // Let raft run this closure.
-                closure_guard.release();
-                // Some disk error occurred, notify raft and never apply any data
-                // ever after
-                iter.set_error_and_rollback();
-                return;
             }
-
-            if (response) {
-                response->set_success(true);
+            if (pending.ntask == 0) {
+                pending.offset = offset;
+            }
+            pending.data.append(data);
+            ++pending.ntask;
+            if (c) {
+                pending.dones.push_back(c);
             }
 
             // The purpose of following logs is to help you understand the way
             // this StateMachine works.
             // Remove these logs in performance-sensitive servers.
             LOG_IF(INFO, FLAGS_log_applied_task) 
-                    << "Write " << data.size() << " bytes"
+                    << "Apply " << data.size() << " bytes"
                     << " from offset=" << offset
                     << " at log_index=" << iter.index();
         }
+        const size_t ntail = pending.ntask;
+        if (flush(&pending, &written) != 0) {
+            run_closures_in_bthread(&written);
+            return iter.set_error_and_rollback(ntail);
+        }
+        run_closures_in_bthread(&written);
     }
 
     struct SnapshotArg {
         scoped_fd fd;
+        // Whether |fd| is a clone of the data file in the snapshot
+        bool cloned;
         braft::SnapshotWriter* writer;
         braft::Closure* done;
     };
@@ -326,6 +410,33 @@ friend class BlockClosure;
         return ::link(old_path, new_path);
     }
 
+    // Make |dst_path| a copy of |src_fd| sharing the blocks with it, which
+    // only updates the metadata on the file systems supporting reflink.
+    // Returns the fd of |dst_path|, -1 otherwise
+    static int reflink(int src_fd, const char* dst_path) {
+#if defined(FICLONE)
+        // |dst_path| might be linked to a snapshot, don't truncate it
+        if (::unlink(dst_path) < 0 && errno != ENOENT) {
+            return -1;
+        }
+        int fd = ::open(dst_path, O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+        if (::ioctl(fd, FICLONE, src_fd) != 0) {
+            const int saved_errno = errno;
+            ::close(fd);
+            ::unlink(dst_path);
+            errno = saved_errno;
+            return -1;
+        }
+        return fd;
+#else
+        errno = EOPNOTSUPP;
+        return -1;
+#endif
+    }
+
     static void *save_snapshot(void* arg) {
         SnapshotArg* sa = (SnapshotArg*) arg;
         std::unique_ptr<SnapshotArg> arg_guard(sa);
@@ -342,7 +453,11 @@ friend class BlockClosure;
             return NULL;
         }
         std::string data_path = FLAGS_data_path + "/data";
-        if (link_overwrite(data_path.c_str(), snapshot_path.c_str()) != 0) {
+        // Without reflink, the snapshot shares the data file with the state
+        // machine, which is still written by the following tasks. It's fine
+        // as the writes are idempotent and replayed after loading it.
+        if (!sa->cloned &&
+                link_overwrite(data_path.c_str(), snapshot_path.c_str()) != 0) {
             sa->done->status().set_error(EIO, "Fail to link data : %m");
             return NULL;
         }
@@ -362,6 +477,21 @@ friend class BlockClosure;
         // file.
         SnapshotArg* arg = new SnapshotArg;
         arg->fd = _fd;
+        arg->cloned = false;
+        if (FLAGS_reflink_snapshot) {
+            // Clone the data file right here so that the snapshot is exactly
+            // the state machine at this point. Only the clone is synced in
+            // the bthread
+            const std::string snapshot_path = writer->get_path() + "/data";
+            const int fd = reflink(_fd->fd(), snapshot_path.c_str());
+            if (fd >= 0) {
+                arg->fd = new SharedFD(fd);
+                arg->cloned = true;
+            } else {
+                PLOG(WARNING) << "Fail to clone the data to " << snapshot_path
+                              << ", link it instead";
+            }
+        }
         arg->writer = writer;
         arg->done = done;
         bthread_t tid;
@@ -379,15 +509,27 @@ friend class BlockClosure;
         _fd = NULL;
         std::string snapshot_path = reader->get_path() + "/data";
         std::string data_path = FLAGS_data_path + "/data";
-        if (link_overwrite(snapshot_path.c_str(), data_path.c_str()) != 0) {
-            PLOG(ERROR) << "Fail to link data";
-            return -1;
+        int fd = -1;
+        if (FLAGS_reflink_snapshot) {
+            // Clone the snapshot so that it's not modified by the following
+            // tasks
+            const int snapshot_fd = ::open(snapshot_path.c_str(), O_RDONLY);
+            if (snapshot_fd >= 0) {
+                fd = reflink(snapshot_fd, data_path.c_str());
+                ::close(snapshot_fd);
+            }
         }
-        // Reopen this file
-        int fd = ::open(data_path.c_str(), O_RDWR, 0644);
         if (fd < 0) {
-            PLOG(ERROR) << "Fail to open " << data_path;
-            return -1;
+            if (link_overwrite(snapshot_path.c_str(), data_path.c_str()) != 0) {
+                PLOG(ERROR) << "Fail to link data";
+                return -1;
+            }
+            // Reopen this file
+            fd = ::open(data_path.c_str(), O_RDWR, 0644);
+            if (fd < 0) {
+                PLOG(ERROR) << "Fail to open " << data_path;
+                return -1;
+            }
         }
         _fd = new SharedFD(fd);
         return 0;
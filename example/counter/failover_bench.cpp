@@ -0,0 +1,445 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the write unavailability of a counter group on leader failures.
+//
+// The bench starts --server_num counter_servers, keeps writing to the group
+// with --thread_num clients and repeatedly injects --fault into the leader.
+// The unavailability of a fault is from the injection to the first
+// fetch_add sent after the injection which succeeds. Each combination of
+// --election_timeout_ms, --election_heartbeat_factor and --pre_vote is
+// measured in one round of --rounds faults on a fresh group, e.g.
+//
+//   ./counter_failover_bench --fault=kill --election_timeout_ms=500,1000,5000
+//
+// --fault=partition runs --partition_cmd and --heal_cmd with $PORT and $PID
+// replaced by those of the leader. Like the nemesis of jepsen, it's up to the
+// environment how the network of one process is cut, e.g. by the cgroup the
+// server is put in by --server_cmd_prefix.
+
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <gflags/gflags.h>
+#include <butil/atomicops.h>
+#include <butil/file_util.h>
+#include <butil/string_printf.h>
+#include <butil/string_splitter.h>
+#include <butil/strings/string_util.h>
+#include <butil/time.h>
+#include <bthread/bthread.h>
+#include <brpc/channel.h>
+#include <brpc/controller.h>
+#include <brpc/server.h>
+#include <braft/raft.h>
+#include <braft/route_table.h>
+#include "counter.pb.h"
+
+DEFINE_string(server_bin, "./counter_server", "Path of counter_server");
+DEFINE_string(server_cmd_prefix, "", "Prefix of the command starting the i-th "
+              "server, of which $I is replaced by i, e.g. "
+              "\"cgexec -g net_cls:raft$I\"");
+DEFINE_int32(server_num, 3, "Number of servers");
+DEFINE_int32(port, 8100, "Port of the first server");
+DEFINE_string(data_path, "./failover_runtime", "Where the servers run");
+DEFINE_string(group, "Counter", "Id of the replication group");
+DEFINE_string(fault, "kill", "kill: SIGKILL the leader and restart it later; "
+              "pause: SIGSTOP the leader and SIGCONT it later; "
+              "partition: run --partition_cmd and --heal_cmd later");
+DEFINE_string(partition_cmd, "", "Command cutting the network of the leader, "
+              "$PORT and $PID are replaced by those of the leader");
+DEFINE_string(heal_cmd, "", "Command undoing --partition_cmd");
+DEFINE_int32(fault_duration_ms, 10000, "The faulty leader is restarted, "
+             "resumed or healed after this long");
+DEFINE_int32(rounds, 20, "Faults injected with each setting");
+DEFINE_int32(settle_s, 3, "Seconds to wait after the fault is undone before "
+             "the next fault");
+DEFINE_int32(max_unavailable_s, 60, "A fault still unavailable after this "
+             "long is counted as stuck");
+DEFINE_string(election_timeout_ms, "1000", "Comma-separated election "
+              "timeouts to measure");
+DEFINE_string(election_heartbeat_factor, "10", "Comma-separated "
+              "raft_election_heartbeat_factor to measure");
+DEFINE_string(pre_vote, "true", "Comma-separated raft_enable_pre_vote to "
+              "measure");
+DEFINE_int32(thread_num, 4, "Number of clients writing to the group");
+DEFINE_int32(timeout_ms, 200, "Timeout of each fetch_add, which bounds how "
+             "soon a client gives up the faulty leader");
+
+namespace failover {
+
+// Set to the time of the current fault, before which the sent requests don't
+// end the unavailability
+static butil::atomic<int64_t> g_fault_us(0);
+static butil::atomic<int64_t> g_recovered_us(0);
+static butil::atomic<bool> g_stopped(false);
+
+static void* sender(void*) {
+    while (!g_stopped.load(butil::memory_order_relaxed)) {
+        braft::PeerId leader;
+        if (braft::rtb::select_leader(FLAGS_group, &leader) != 0) {
+            butil::Status st = braft::rtb::refresh_leader(
+                        FLAGS_group, FLAGS_timeout_ms);
+            if (!st.ok()) {
+                bthread_usleep(FLAGS_timeout_ms * 1000L / 10);
+            }
+            continue;
+        }
+        brpc::Channel channel;
+        if (channel.Init(leader.addr, NULL) != 0) {
+            bthread_usleep(FLAGS_timeout_ms * 1000L / 10);
+            continue;
+        }
+        example::CounterService_Stub stub(&channel);
+        brpc::Controller cntl;
+        cntl.set_timeout_ms(FLAGS_timeout_ms);
+        cntl.set_max_retry(0);
+        example::FetchAddRequest request;
+        request.set_value(1);
+        example::CounterResponse response;
+        const int64_t start_us = butil::monotonic_time_us();
+        stub.fetch_add(&cntl, &request, &response, NULL);
+        if (cntl.Failed()) {
+            braft::rtb::update_leader(FLAGS_group, braft::PeerId());
+            continue;
+        }
+        if (!response.success()) {
+            braft::rtb::update_leader(FLAGS_group, response.redirect());
+            continue;
+        }
+        if (start_us >= g_fault_us.load(butil::memory_order_acquire)) {
+            int64_t expected = 0;
+            g_recovered_us.compare_exchange_strong(
+                    expected, butil::monotonic_time_us());
+        }
+    }
+    return NULL;
+}
+
+struct Setting {
+    int election_timeout_ms;
+    int heartbeat_factor;
+    bool pre_vote;
+};
+
+class Cluster {
+public:
+    explicit Cluster(const Setting& setting)
+        : _setting(setting), _pids(FLAGS_server_num, -1) {
+        for (int i = 0; i < FLAGS_server_num; ++i) {
+            _conf += butil::string_printf("%s:%d:0,", butil::my_ip_cstr(),
+                                          FLAGS_port + i);
+        }
+    }
+
+    int start() {
+        butil::DeleteFile(butil::FilePath(FLAGS_data_path), true);
+        for (int i = 0; i < FLAGS_server_num; ++i) {
+            if (start_server(i) != 0) {
+                return -1;
+            }
+        }
+        return braft::rtb::update_configuration(FLAGS_group, _conf);
+    }
+
+    void stop() {
+        for (int i = 0; i < FLAGS_server_num; ++i) {
+            if (_pids[i] > 0) {
+                kill(_pids[i], SIGCONT);
+                kill(_pids[i], SIGKILL);
+                waitpid(_pids[i], NULL, 0);
+                _pids[i] = -1;
+            }
+        }
+    }
+
+    int start_server(int i) {
+        const std::string dir = butil::string_printf(
+                "%s/%d", FLAGS_data_path.c_str(), i);
+        if (!butil::CreateDirectory(butil::FilePath(dir))) {
+            LOG(ERROR) << "Fail to create " << dir;
+            return -1;
+        }
+        std::string prefix = FLAGS_server_cmd_prefix;
+        butil::ReplaceSubstringsAfterOffset(&prefix, 0, "$I",
+                                            butil::string_printf("%d", i));
+        const std::string cmd = butil::string_printf(
+                "cd %s && exec %s %s -port=%d -conf=%s -group=%s "
+                "-election_timeout_ms=%d -raft_election_heartbeat_factor=%d "
+                "-raft_enable_pre_vote=%s -raft_sync=true >> std.log 2>&1",
+                dir.c_str(), prefix.c_str(), absolute_server_bin().c_str(),
+                FLAGS_port + i, _conf.c_str(), FLAGS_group.c_str(),
+                _setting.election_timeout_ms, _setting.heartbeat_factor,
+                _setting.pre_vote ? "true" : "false");
+        const pid_t pid = fork();
+        if (pid < 0) {
+            PLOG(ERROR) << "Fail to fork";
+            return -1;
+        }
+        if (pid == 0) {
+            execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*)NULL);
+            _exit(127);
+        }
+        _pids[i] = pid;
+        return 0;
+    }
+
+    // Index of the server leading the group, -1 if unknown
+    int leader() {
+        if (!braft::rtb::refresh_leader(FLAGS_group, FLAGS_timeout_ms).ok()) {
+            return -1;
+        }
+        braft::PeerId leader;
+        if (braft::rtb::select_leader(FLAGS_group, &leader) != 0) {
+            return -1;
+        }
+        const int i = leader.addr.port - FLAGS_port;
+        return i >= 0 && i < FLAGS_server_num ? i : -1;
+    }
+
+    int inject(int i) {
+        if (FLAGS_fault == "kill") {
+            kill(_pids[i], SIGKILL);
+            waitpid(_pids[i], NULL, 0);
+            _pids[i] = -1;
+            return 0;
+        }
+        if (FLAGS_fault == "pause") {
+            return kill(_pids[i], SIGSTOP);
+        }
+        return run_cmd(FLAGS_partition_cmd, i);
+    }
+
+    int undo(int i) {
+        if (FLAGS_fault == "kill") {
+            return start_server(i);
+        }
+        if (FLAGS_fault == "pause") {
+            return kill(_pids[i], SIGCONT);
+        }
+        return run_cmd(FLAGS_heal_cmd, i);
+    }
+
+private:
+    int run_cmd(const std::string& tmpl, int i) {
+        std::string cmd = tmpl;
+        butil::ReplaceSubstringsAfterOffset(
+                &cmd, 0, "$PORT", butil::string_printf("%d", FLAGS_port + i));
+        butil::ReplaceSubstringsAfterOffset(
+                &cmd, 0, "$PID", butil::string_printf("%d", (int)_pids[i]));
+        const int rc = system(cmd.c_str());
+        if (rc != 0) {
+            LOG(ERROR) << "`" << cmd << "' returns " << rc;
+            return -1;
+        }
+        return 0;
+    }
+
+    static std::string absolute_server_bin() {
+        return butil::MakeAbsoluteFilePath(
+                butil::FilePath(FLAGS_server_bin)).value();
+    }
+
+    Setting _setting;
+    std::string _conf;
+    std::vector<pid_t> _pids;
+};
+
+static int64_t percentile(const std::vector<int64_t>& sorted, double ratio) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = sorted.size() * ratio;
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+static void sleep_ms(int64_t ms) {
+    const int64_t deadline_ms = butil::monotonic_time_ms() + ms;
+    while (!brpc::IsAskedToQuit()) {
+        const int64_t left_ms = deadline_ms - butil::monotonic_time_ms();
+        if (left_ms <= 0) {
+            break;
+        }
+        usleep(std::min<int64_t>(left_ms, 100) * 1000L);
+    }
+}
+
+static int wait_leader(Cluster* cluster) {
+    const int64_t deadline_ms = butil::monotonic_time_ms()
+                                + FLAGS_max_unavailable_s * 1000L;
+    while (!brpc::IsAskedToQuit() && butil::monotonic_time_ms() < deadline_ms) {
+        const int leader = cluster->leader();
+        if (leader >= 0) {
+            return leader;
+        }
+        sleep_ms(100);
+    }
+    return -1;
+}
+
+// Returns the unavailable milliseconds of each fault, -1 for the stuck ones
+static int run_setting(const Setting& setting, std::vector<int64_t>* windows) {
+    Cluster cluster(setting);
+    if (cluster.start() != 0) {
+        cluster.stop();
+        return -1;
+    }
+    for (int r = 0; r < FLAGS_rounds && !brpc::IsAskedToQuit(); ++r) {
+        const int leader = wait_leader(&cluster);
+        if (leader < 0) {
+            LOG(ERROR) << "No leader is elected in " << FLAGS_max_unavailable_s
+                       << "s";
+            cluster.stop();
+            return -1;
+        }
+        sleep_ms(FLAGS_settle_s * 1000L);
+        const int64_t fault_us = butil::monotonic_time_us();
+        g_recovered_us.store(0, butil::memory_order_relaxed);
+        g_fault_us.store(fault_us, butil::memory_order_release);
+        if (cluster.inject(leader) != 0) {
+            cluster.stop();
+            return -1;
+        }
+        const int64_t undo_us = fault_us + FLAGS_fault_duration_ms * 1000L;
+        const int64_t give_up_us = fault_us
+                                   + FLAGS_max_unavailable_s * 1000000L;
+        bool undone = false;
+        while (!brpc::IsAskedToQuit()) {
+            const int64_t now_us = butil::monotonic_time_us();
+            if (!undone && now_us >= undo_us) {
+                if (cluster.undo(leader) != 0) {
+                    cluster.stop();
+                    return -1;
+                }
+                undone = true;
+            }
+            const int64_t recovered_us =
+                    g_recovered_us.load(butil::memory_order_relaxed);
+            if (recovered_us != 0 || now_us >= give_up_us) {
+                windows->push_back(recovered_us != 0
+                        ? (recovered_us - fault_us) / 1000 : -1);
+                LOG(INFO) << "Fault " << r << " on server " << leader
+                          << " unavailable_ms=" << windows->back();
+                break;
+            }
+            usleep(1000);
+        }
+        while (!undone && !brpc::IsAskedToQuit()) {
+            if (butil::monotonic_time_us() >= undo_us) {
+                if (cluster.undo(leader) != 0) {
+                    cluster.stop();
+                    return -1;
+                }
+                undone = true;
+            }
+            usleep(1000);
+        }
+    }
+    cluster.stop();
+    return 0;
+}
+
+static void print_result(const Setting& setting,
+                         const std::vector<int64_t>& windows) {
+    std::vector<int64_t> sorted;
+    int stuck = 0;
+    for (size_t i = 0; i < windows.size(); ++i) {
+        if (windows[i] < 0) {
+            ++stuck;
+        } else {
+            sorted.push_back(windows[i]);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end());
+    printf("fault=%s election_timeout_ms=%d heartbeat_factor=%d pre_vote=%d "
+           "faults=%zu stuck=%d unavailable_ms(min/p50/p90/p99/max)="
+           "%" PRId64 "/%" PRId64 "/%" PRId64 "/%" PRId64 "/%" PRId64 "\n",
+           FLAGS_fault.c_str(), setting.election_timeout_ms,
+           setting.heartbeat_factor, setting.pre_vote, windows.size(), stuck,
+           percentile(sorted, 0), percentile(sorted, 0.5),
+           percentile(sorted, 0.9), percentile(sorted, 0.99),
+           sorted.empty() ? 0 : sorted.back());
+    fflush(stdout);
+}
+
+static void split_ints(const std::string& str, std::vector<int>* out) {
+    for (butil::StringSplitter sp(str.c_str(), ','); sp; ++sp) {
+        out->push_back(atoi(std::string(sp.field(), sp.length()).c_str()));
+    }
+}
+
+}  // namespace failover
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    butil::AtExitManager exit_manager;
+    using namespace failover;
+
+    if (FLAGS_fault != "kill" && FLAGS_fault != "pause" &&
+            FLAGS_fault != "partition") {
+        LOG(ERROR) << "Unknown fault " << FLAGS_fault;
+        return -1;
+    }
+    if (FLAGS_fault == "partition" &&
+            (FLAGS_partition_cmd.empty() || FLAGS_heal_cmd.empty())) {
+        LOG(ERROR) << "--partition_cmd and --heal_cmd are required";
+        return -1;
+    }
+    std::vector<int> timeouts;
+    std::vector<int> factors;
+    std::vector<int> pre_votes;
+    split_ints(FLAGS_election_timeout_ms, &timeouts);
+    split_ints(FLAGS_election_heartbeat_factor, &factors);
+    for (butil::StringSplitter sp(FLAGS_pre_vote.c_str(), ','); sp; ++sp) {
+        const std::string v(sp.field(), sp.length());
+        pre_votes.push_back(v == "true" || v == "1");
+    }
+
+    std::vector<bthread_t> tids(FLAGS_thread_num);
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        if (bthread_start_background(&tids[i], NULL, sender, NULL) != 0) {
+            LOG(ERROR) << "Fail to create bthread";
+            return -1;
+        }
+    }
+    int rc = 0;
+    for (size_t t = 0; t < timeouts.size() && rc == 0; ++t) {
+        for (size_t f = 0; f < factors.size() && rc == 0; ++f) {
+            for (size_t p = 0; p < pre_votes.size() && rc == 0; ++p) {
+                if (brpc::IsAskedToQuit()) {
+                    break;
+                }
+                Setting setting;
+                setting.election_timeout_ms = timeouts[t];
+                setting.heartbeat_factor = factors[f];
+                setting.pre_vote = pre_votes[p];
+                std::vector<int64_t> windows;
+                rc = run_setting(setting, &windows);
+                print_result(setting, windows);
+            }
+        }
+    }
+    g_stopped.store(true);
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    return rc;
+}
@@ -0,0 +1,221 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Load generator of the kv example: each thread sends puts, deletes and gets
+// of random keys in a fixed key space and reports qps and latency by type.
+
+#include <inttypes.h>
+#include <gflags/gflags.h>
+#include <bthread/bthread.h>
+#include <brpc/channel.h>
+#include <brpc/controller.h>
+#include <butil/string_printf.h>
+#include <braft/raft.h>
+#include <braft/util.h>
+#include <braft/route_table.h>
+#include "kv.pb.h"
+
+DEFINE_bool(log_each_request, false, "Print log for each request");
+DEFINE_bool(use_bthread, false, "Use bthread to send requests");
+DEFINE_bool(follower_read, false, "Send gets to random peers rather than "
+            "the leader");
+DEFINE_int32(write_percentage, 50, "Percentage of writes");
+DEFINE_int32(delete_percentage, 0, "Percentage of deletes in the writes");
+DEFINE_int32(thread_num, 1, "Number of threads sending requests");
+DEFINE_int32(timeout_ms, 1000, "Timeout for each request");
+DEFINE_int32(value_size, 128, "Bytes of each value");
+DEFINE_int64(key_num, 1000000, "Number of distinct keys");
+DEFINE_string(conf, "", "Configuration of the raft group");
+DEFINE_string(group, "Kv", "Id of the replication group");
+
+bvar::LatencyRecorder g_write_latency("kv_client_write");
+bvar::LatencyRecorder g_get_latency("kv_client_get");
+
+static std::vector<braft::PeerId> g_peers;
+
+static std::string random_key() {
+    return butil::string_printf(
+            "key_%012" PRIu64,
+            (uint64_t)butil::fast_rand_less_than(FLAGS_key_num));
+}
+
+// Returns 0 and the peer answered, 1 if redirected, -1 on failure
+static int send_get(const braft::PeerId& peer, braft::PeerId* redirect) {
+    brpc::Channel channel;
+    if (channel.Init(peer.addr, NULL) != 0) {
+        LOG(ERROR) << "Fail to init channel to " << peer;
+        return -1;
+    }
+    example::KvService_Stub stub(&channel);
+    brpc::Controller cntl;
+    cntl.set_timeout_ms(FLAGS_timeout_ms);
+    example::GetRequest request;
+    request.set_key(random_key());
+    example::GetResponse response;
+    stub.get(&cntl, &request, &response, NULL);
+    if (cntl.Failed()) {
+        LOG(WARNING) << "Fail to send get to " << peer
+                     << " : " << cntl.ErrorText();
+        return -1;
+    }
+    if (!response.success()) {
+        if (response.has_redirect()) {
+            redirect->parse(response.redirect());
+        }
+        return 1;
+    }
+    g_get_latency << cntl.latency_us();
+    LOG_IF(INFO, FLAGS_log_each_request)
+            << "Got " << request.key() << " from " << peer
+            << " found=" << response.found()
+            << " latency=" << cntl.latency_us();
+    return 0;
+}
+
+static int send_write(const braft::PeerId& leader, const std::string& value,
+                      braft::PeerId* redirect) {
+    brpc::Channel channel;
+    if (channel.Init(leader.addr, NULL) != 0) {
+        LOG(ERROR) << "Fail to init channel to " << leader;
+        return -1;
+    }
+    example::KvService_Stub stub(&channel);
+    brpc::Controller cntl;
+    cntl.set_timeout_ms(FLAGS_timeout_ms);
+    example::WriteRequest request;
+    request.set_key(random_key());
+    if (butil::fast_rand_less_than(100) < (size_t)FLAGS_delete_percentage) {
+        request.set_op(example::OP_DELETE);
+    } else {
+        request.set_op(example::OP_PUT);
+        request.set_value(value);
+    }
+    example::WriteResponse response;
+    stub.write(&cntl, &request, &response, NULL);
+    if (cntl.Failed()) {
+        LOG(WARNING) << "Fail to send write to " << leader
+                     << " : " << cntl.ErrorText();
+        return -1;
+    }
+    if (!response.success()) {
+        if (response.has_redirect()) {
+            redirect->parse(response.redirect());
+        }
+        return 1;
+    }
+    g_write_latency << cntl.latency_us();
+    LOG_IF(INFO, FLAGS_log_each_request)
+            << "Wrote " << request.key() << " to " << leader
+            << " latency=" << cntl.latency_us();
+    return 0;
+}
+
+static void* sender(void* arg) {
+    const std::string value(FLAGS_value_size, 'v');
+    while (!brpc::IsAskedToQuit()) {
+        const bool is_write =
+            butil::fast_rand_less_than(100) < (size_t)FLAGS_write_percentage;
+        braft::PeerId peer;
+        if (!is_write && FLAGS_follower_read && !g_peers.empty()) {
+            peer = g_peers[butil::fast_rand_less_than(g_peers.size())];
+        } else if (braft::rtb::select_leader(FLAGS_group, &peer) != 0) {
+            // Leader is unknown in RouteTable. Ask RouteTable to refresh leader
+            // by sending RPCs.
+            butil::Status st = braft::rtb::refresh_leader(
+                        FLAGS_group, FLAGS_timeout_ms);
+            if (!st.ok()) {
+                LOG(WARNING) << "Fail to refresh_leader : " << st;
+                bthread_usleep(FLAGS_timeout_ms * 1000L);
+            }
+            continue;
+        }
+        braft::PeerId redirect;
+        const int rc = is_write ? send_write(peer, value, &redirect)
+                                : send_get(peer, &redirect);
+        if (rc < 0) {
+            // Clear leadership since this RPC failed.
+            braft::rtb::update_leader(FLAGS_group, braft::PeerId());
+            bthread_usleep(FLAGS_timeout_ms * 1000L);
+            continue;
+        }
+        if (rc > 0) {
+            LOG(WARNING) << "Fail to send request to " << peer
+                         << ", redirecting to " << redirect;
+            // Update route table since we have redirect information
+            braft::rtb::update_leader(FLAGS_group, redirect);
+            continue;
+        }
+        if (FLAGS_log_each_request) {
+            bthread_usleep(1000L * 1000L);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    butil::AtExitManager exit_manager;
+
+    // Register configuration of target group to RouteTable
+    if (braft::rtb::update_configuration(FLAGS_group, FLAGS_conf) != 0) {
+        LOG(ERROR) << "Fail to register configuration " << FLAGS_conf
+                   << " of group " << FLAGS_group;
+        return -1;
+    }
+    braft::Configuration conf;
+    conf.parse_from(FLAGS_conf);
+    conf.list_peers(&g_peers);
+
+    std::vector<bthread_t> tids;
+    tids.resize(FLAGS_thread_num);
+    if (!FLAGS_use_bthread) {
+        for (int i = 0; i < FLAGS_thread_num; ++i) {
+            if (pthread_create(&tids[i], NULL, sender, NULL) != 0) {
+                LOG(ERROR) << "Fail to create pthread";
+                return -1;
+            }
+        }
+    } else {
+        for (int i = 0; i < FLAGS_thread_num; ++i) {
+            if (bthread_start_background(&tids[i], NULL, sender, NULL) != 0) {
+                LOG(ERROR) << "Fail to create bthread";
+                return -1;
+            }
+        }
+    }
+
+    while (!brpc::IsAskedToQuit()) {
+        sleep(1);
+        LOG_IF(INFO, !FLAGS_log_each_request)
+                << "Sending Request to " << FLAGS_group
+                << " (" << FLAGS_conf << ')'
+                << " at write_qps=" << g_write_latency.qps(1)
+                << " write_latency=" << g_write_latency.latency(1)
+                << " write_latency_p99=" << g_write_latency.latency_percentile(0.99)
+                << " get_qps=" << g_get_latency.qps(1)
+                << " get_latency=" << g_get_latency.latency(1)
+                << " get_latency_p99=" << g_get_latency.latency_percentile(0.99);
+    }
+
+    LOG(INFO) << "Kv client is going to quit";
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        if (!FLAGS_use_bthread) {
+            pthread_join(tids[i], NULL);
+        } else {
+            bthread_join(tids[i], NULL);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,580 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <fcntl.h>                      // open
+#include <unistd.h>                     // pread, link
+#include <sys/stat.h>                   // stat
+#include <pthread.h>                    // pthread_rwlock_t
+#include <map>
+#include <memory>                       // std::unique_ptr
+#include <gflags/gflags.h>              // DEFINE_*
+#include <butil/crc32c.h>               // butil::crc32c
+#include <butil/file_util.h>            // butil::DeleteFile
+#include <butil/files/file_enumerator.h>  // butil::FileEnumerator
+#include <butil/string_printf.h>        // butil::string_printf
+#include <butil/strings/string_util.h>  // butil::EndsWith
+#include <butil/synchronization/lock.h>  // butil::Mutex
+#include <brpc/controller.h>       // brpc::Controller
+#include <brpc/server.h>           // brpc::Server
+#include <braft/raft.h>                  // braft::Node braft::StateMachine
+#include <braft/storage.h>               // braft::SnapshotWriter
+#include <braft/util.h>                  // braft::AsyncClosureGuard
+#include <braft/local_file_meta.pb.h>    // braft::LocalFileMeta
+#include <rocksdb/db.h>                  // rocksdb::DB
+#include <rocksdb/write_batch.h>         // rocksdb::WriteBatch
+#include <rocksdb/utilities/checkpoint.h>  // rocksdb::Checkpoint
+#include "kv.pb.h"                      // KvService
+
+DEFINE_bool(check_term, true, "Check if the leader changed to another term");
+DEFINE_bool(disable_cli, false, "Don't allow raft_cli access this node");
+DEFINE_bool(enable_leader_lease, true, "Serve reads on the leader without "
+            "heartbeats while it holds the lease");
+DEFINE_bool(filter_before_copy_remote, true, "Copy only the files changed "
+            "since the last snapshot of a follower when installing snapshots");
+DEFINE_int32(election_timeout_ms, 5000,
+            "Start election in such milliseconds if disconnect with the leader");
+DEFINE_int32(port, 8200, "Listen port of this peer");
+DEFINE_int32(snapshot_interval, 30, "Interval between each snapshot");
+DEFINE_string(conf, "", "Initial configuration of the replication group");
+DEFINE_string(data_path, "./data", "Path of data stored on");
+DEFINE_string(group, "Kv", "Id of the replication group");
+
+namespace example {
+class KvStore;
+
+// Implements Closure which encloses RPC stuff
+class WriteClosure : public braft::Closure {
+public:
+    WriteClosure(KvStore* kv,
+                 const WriteRequest* request,
+                 WriteResponse* response,
+                 google::protobuf::Closure* done)
+        : _kv(kv)
+        , _request(request)
+        , _response(response)
+        , _done(done) {}
+    ~WriteClosure() {}
+
+    const WriteRequest* request() const { return _request; }
+    void Run();
+
+private:
+    KvStore* _kv;
+    const WriteRequest* _request;
+    WriteResponse* _response;
+    google::protobuf::Closure* _done;
+};
+
+// Run once the node is able to serve the linearizable read
+class GetClosure : public braft::Closure {
+public:
+    GetClosure(KvStore* kv,
+               const GetRequest* request,
+               GetResponse* response,
+               google::protobuf::Closure* done)
+        : _kv(kv)
+        , _request(request)
+        , _response(response)
+        , _done(done) {}
+    ~GetClosure() {}
+
+    void Run();
+
+private:
+    KvStore* _kv;
+    const GetRequest* _request;
+    GetResponse* _response;
+    google::protobuf::Closure* _done;
+};
+
+// Implementation of example::KvStore as a braft::StateMachine on rocksdb.
+// The raft log serves as the WAL of rocksdb, so that the db is rebuilt from
+// the last snapshot and the logs after it on restart.
+class KvStore : public braft::StateMachine {
+public:
+    KvStore()
+        : _node(NULL)
+        , _db(NULL)
+        , _leader_term(-1)
+    {
+        pthread_rwlock_init(&_db_lock, NULL);
+    }
+    ~KvStore() {
+        delete _node;
+        delete _db;
+        pthread_rwlock_destroy(&_db_lock);
+    }
+
+    // Starts this node
+    int start() {
+        // The state is rebuilt from the snapshot and the logs
+        const std::string db_path = FLAGS_data_path + "/db";
+        butil::DeleteFile(butil::FilePath(db_path), true);
+        if (open_db(db_path) != 0) {
+            return -1;
+        }
+        butil::EndPoint addr(butil::my_ip(), FLAGS_port);
+        braft::NodeOptions node_options;
+        if (node_options.initial_conf.parse_from(FLAGS_conf) != 0) {
+            LOG(ERROR) << "Fail to parse configuration `" << FLAGS_conf << '\'';
+            return -1;
+        }
+        node_options.election_timeout_ms = FLAGS_election_timeout_ms;
+        node_options.fsm = this;
+        node_options.node_owns_fsm = false;
+        node_options.snapshot_interval_s = FLAGS_snapshot_interval;
+        std::string prefix = "local://" + FLAGS_data_path;
+        node_options.log_uri = prefix + "/log";
+        node_options.raft_meta_uri = prefix + "/raft_meta";
+        node_options.snapshot_uri = prefix + "/snapshot";
+        node_options.disable_cli = FLAGS_disable_cli;
+        node_options.enable_leader_lease = FLAGS_enable_leader_lease;
+        node_options.filter_before_copy_remote = FLAGS_filter_before_copy_remote;
+        braft::Node* node = new braft::Node(FLAGS_group, braft::PeerId(addr));
+        if (node->init(node_options) != 0) {
+            LOG(ERROR) << "Fail to init raft node";
+            delete node;
+            return -1;
+        }
+        _node = node;
+        return 0;
+    }
+
+    // Impelements Service methods
+    void write(const WriteRequest* request,
+               WriteResponse* response,
+               google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        const int64_t term = _leader_term.load(butil::memory_order_relaxed);
+        if (term < 0) {
+            return redirect(response);
+        }
+        butil::IOBuf log;
+        butil::IOBufAsZeroCopyOutputStream wrapper(&log);
+        if (!request->SerializeToZeroCopyStream(&wrapper)) {
+            LOG(ERROR) << "Fail to serialize request";
+            response->set_success(false);
+            return;
+        }
+        braft::Task task;
+        task.data = &log;
+        task.done = new WriteClosure(this, request, response,
+                                     done_guard.release());
+        if (FLAGS_check_term) {
+            task.expected_term = term;
+        }
+        return _node->apply(task);
+    }
+
+    void get(const GetRequest* request,
+             GetResponse* response,
+             google::protobuf::Closure* done) {
+        // Both the leader and the followers serve reads through read_index,
+        // which costs no heartbeat while the leader holds the lease, and one
+        // RPC to the leader shared by the concurrent reads on a follower
+        if (_node == NULL) {
+            brpc::ClosureGuard done_guard(done);
+            return redirect(response);
+        }
+        _node->read_index(new GetClosure(this, request, response, done));
+    }
+
+    void read(const std::string& key, GetResponse* response) {
+        std::string value;
+        rocksdb::Status s;
+        {
+            pthread_rwlock_rdlock(&_db_lock);
+            s = _db->Get(rocksdb::ReadOptions(), key, &value);
+            pthread_rwlock_unlock(&_db_lock);
+        }
+        if (s.ok()) {
+            response->set_success(true);
+            response->set_found(true);
+            response->set_value(value);
+        } else if (s.IsNotFound()) {
+            response->set_success(true);
+            response->set_found(false);
+        } else {
+            LOG(ERROR) << "Fail to get from rocksdb: " << s.ToString();
+            response->set_success(false);
+        }
+    }
+
+    bool is_leader() const
+    { return _leader_term.load(butil::memory_order_acquire) > 0; }
+
+    // Shut this node down.
+    void shutdown() {
+        if (_node) {
+            _node->shutdown(NULL);
+        }
+    }
+
+    // Blocking this thread until the node is eventually down.
+    void join() {
+        if (_node) {
+            _node->join();
+        }
+    }
+
+private:
+friend class WriteClosure;
+friend class GetClosure;
+
+    template <typename Response>
+    void redirect(Response* response) {
+        response->set_success(false);
+        if (_node) {
+            braft::PeerId leader = _node->leader_id();
+            if (!leader.is_empty()) {
+                response->set_redirect(leader.to_string());
+            }
+        }
+    }
+
+    int open_db(const std::string& path) {
+        rocksdb::Options options;
+        options.create_if_missing = true;
+        rocksdb::DB* db = NULL;
+        rocksdb::Status s = rocksdb::DB::Open(options, path, &db);
+        if (!s.ok()) {
+            LOG(ERROR) << "Fail to open rocksdb at " << path << ": "
+                       << s.ToString();
+            return -1;
+        }
+        _db = db;
+        return 0;
+    }
+
+    // @braft::StateMachine
+    void on_apply(braft::Iterator& iter) {
+        // All the tasks of this batch go into one WriteBatch, and the RPCs
+        // are responded once it's written.
+        rocksdb::WriteBatch batch;
+        std::vector<braft::Closure*> dones;
+        // The ticket marks the batch as applied after it's written
+        braft::Closure* ticket = iter.ticket();
+        for (; iter.valid(); iter.next()) {
+            WriteRequest parsed;
+            const WriteRequest* request = &parsed;
+            if (iter.done()) {
+                // This task is applied by this node, get the request from
+                // this closure to avoid additional parsing.
+                request = static_cast<WriteClosure*>(iter.done())->request();
+                dones.push_back(iter.done());
+            } else {
+                butil::IOBufAsZeroCopyInputStream wrapper(iter.data());
+                CHECK(parsed.ParseFromZeroCopyStream(&wrapper));
+            }
+            if (request->op() == OP_PUT) {
+                batch.Put(request->key(), request->value());
+            } else {
+                batch.Delete(request->key());
+            }
+        }
+        // The raft log is the WAL
+        rocksdb::WriteOptions options;
+        options.disableWAL = true;
+        rocksdb::Status s = _db->Write(options, &batch);
+        if (!s.ok()) {
+            LOG(ERROR) << "Fail to write rocksdb: " << s.ToString();
+            ticket->status().set_error(EIO, "Fail to write rocksdb");
+        }
+        ticket->Run();
+        // Responding is cheap enough to do in place
+        for (size_t i = 0; i < dones.size(); ++i) {
+            if (!s.ok()) {
+                dones[i]->status().set_error(EIO, "Fail to write rocksdb");
+            }
+            dones[i]->Run();
+        }
+    }
+
+    struct SnapshotArg {
+        KvStore* kv;
+        braft::SnapshotWriter* writer;
+        braft::Closure* done;
+    };
+
+    static void *save_snapshot(void* arg) {
+        SnapshotArg* sa = (SnapshotArg*) arg;
+        std::unique_ptr<SnapshotArg> arg_guard(sa);
+        brpc::ClosureGuard done_guard(sa->done);
+        // Add the files of the checkpoint with their checksums, by which
+        // filter_before_copy_remote finds the unchanged files on the
+        // followers
+        const butil::FilePath db_path(sa->writer->get_path() + "/db");
+        butil::FileEnumerator files(db_path, false,
+                                    butil::FileEnumerator::FILES);
+        for (butil::FilePath path = files.Next(); !path.empty();
+                path = files.Next()) {
+            std::string checksum;
+            if (sa->kv->file_checksum(path.value(), &checksum) != 0) {
+                sa->done->status().set_error(EIO, "Fail to read %s",
+                                             path.value().c_str());
+                return NULL;
+            }
+            braft::LocalFileMeta meta;
+            meta.set_checksum(checksum);
+            if (sa->writer->add_file("db/" + path.BaseName().value(),
+                                     &meta) != 0) {
+                sa->done->status().set_error(EIO, "Fail to add file to writer");
+                return NULL;
+            }
+        }
+        return NULL;
+    }
+
+    void on_snapshot_save(braft::SnapshotWriter* writer, braft::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        // A checkpoint flushes the memtable and hard links the SST files,
+        // which takes little time and matches the applied logs exactly.
+        // Checksumming the files is left to a bthread to avoid blocking
+        // StateMachine.
+        rocksdb::Checkpoint* checkpoint = NULL;
+        rocksdb::Status s = rocksdb::Checkpoint::Create(_db, &checkpoint);
+        if (s.ok()) {
+            s = checkpoint->CreateCheckpoint(writer->get_path() + "/db");
+            delete checkpoint;
+        }
+        if (!s.ok()) {
+            LOG(ERROR) << "Fail to create checkpoint in " << writer->get_path()
+                       << ": " << s.ToString();
+            done->status().set_error(EIO, "Fail to create checkpoint");
+            return;
+        }
+        SnapshotArg* arg = new SnapshotArg;
+        arg->kv = this;
+        arg->writer = writer;
+        arg->done = done_guard.release();
+        bthread_t tid;
+        bthread_start_urgent(&tid, NULL, save_snapshot, arg);
+    }
+
+    int on_snapshot_load(braft::SnapshotReader* reader) {
+        // Load snasphot from reader, replacing the running StateMachine
+        CHECK(!is_leader()) << "Leader is not supposed to load snapshot";
+        const std::string db_path = FLAGS_data_path + "/db";
+        const std::string loading_path = FLAGS_data_path + "/db.loading";
+        butil::DeleteFile(butil::FilePath(loading_path), true);
+        if (!butil::CreateDirectory(butil::FilePath(loading_path))) {
+            LOG(ERROR) << "Fail to create " << loading_path;
+            return -1;
+        }
+        std::vector<std::string> files;
+        reader->list_files(&files);
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (files[i].compare(0, 3, "db/") != 0) {
+                continue;
+            }
+            const std::string name = files[i].substr(3);
+            const std::string from = reader->get_path() + '/' + files[i];
+            const std::string to = loading_path + '/' + name;
+            // The SST files are never modified so they are shared with the
+            // snapshot, while the others like MANIFEST are appended by
+            // rocksdb
+            if (butil::EndsWith(name, ".sst", true) &&
+                    ::link(from.c_str(), to.c_str()) == 0) {
+                continue;
+            }
+            if (!butil::CopyFile(butil::FilePath(from), butil::FilePath(to))) {
+                LOG(ERROR) << "Fail to copy " << from << " to " << to;
+                return -1;
+            }
+        }
+        pthread_rwlock_wrlock(&_db_lock);
+        delete _db;
+        _db = NULL;
+        butil::DeleteFile(butil::FilePath(db_path), true);
+        int rc = -1;
+        if (butil::Move(butil::FilePath(loading_path),
+                        butil::FilePath(db_path))) {
+            rc = open_db(db_path);
+        } else {
+            LOG(ERROR) << "Fail to move " << loading_path << " to " << db_path;
+        }
+        pthread_rwlock_unlock(&_db_lock);
+        return rc;
+    }
+
+    // The SST files are immutable and hard linked into the snapshots, of
+    // which the checksums are computed once
+    int file_checksum(const std::string& path, std::string* checksum) {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0) {
+            PLOG(ERROR) << "Fail to stat " << path;
+            return -1;
+        }
+        const bool immutable = butil::EndsWith(path, ".sst", true);
+        const std::string key = butil::string_printf(
+                "%s:%lu:%ld", butil::FilePath(path).BaseName().value().c_str(),
+                (unsigned long)st.st_ino, (long)st.st_size);
+        if (immutable) {
+            BAIDU_SCOPED_LOCK(_checksum_mutex);
+            std::map<std::string, std::string>::const_iterator
+                    it = _sst_checksums.find(key);
+            if (it != _sst_checksums.end()) {
+                *checksum = it->second;
+                return 0;
+            }
+        }
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            PLOG(ERROR) << "Fail to open " << path;
+            return -1;
+        }
+        uint32_t crc = 0;
+        std::vector<char> buf(1024 * 1024);
+        off_t offset = 0;
+        ssize_t n = 0;
+        while ((n = ::pread(fd, &buf[0], buf.size(), offset)) > 0) {
+            crc = butil::crc32c::Extend(crc, &buf[0], n);
+            offset += n;
+        }
+        ::close(fd);
+        if (n < 0) {
+            PLOG(ERROR) << "Fail to read " << path;
+            return -1;
+        }
+        *checksum = butil::string_printf("%ld:%08x", (long)offset, crc);
+        if (immutable) {
+            BAIDU_SCOPED_LOCK(_checksum_mutex);
+            _sst_checksums[key] = *checksum;
+        }
+        return 0;
+    }
+
+    void on_leader_start(int64_t term) {
+        _leader_term.store(term, butil::memory_order_release);
+        LOG(INFO) << "Node becomes leader";
+    }
+    void on_leader_stop(const butil::Status& status) {
+        _leader_term.store(-1, butil::memory_order_release);
+        LOG(INFO) << "Node stepped down : " << status;
+    }
+
+    void on_shutdown() {
+        LOG(INFO) << "This node is down";
+    }
+    void on_error(const ::braft::Error& e) {
+        LOG(ERROR) << "Met raft error " << e;
+    }
+    void on_configuration_committed(const ::braft::Configuration& conf) {
+        LOG(INFO) << "Configuration of this group is " << conf;
+    }
+    void on_stop_following(const ::braft::LeaderChangeContext& ctx) {
+        LOG(INFO) << "Node stops following " << ctx;
+    }
+    void on_start_following(const ::braft::LeaderChangeContext& ctx) {
+        LOG(INFO) << "Node start following " << ctx;
+    }
+    // end of @braft::StateMachine
+
+private:
+    braft::Node* volatile _node;
+    // Replaced by on_snapshot_load, guarded against the reads by _db_lock
+    rocksdb::DB* _db;
+    pthread_rwlock_t _db_lock;
+    butil::atomic<int64_t> _leader_term;
+    butil::Mutex _checksum_mutex;
+    std::map<std::string, std::string> _sst_checksums;
+};
+
+void WriteClosure::Run() {
+    // Auto delete this after Run()
+    std::unique_ptr<WriteClosure> self_guard(this);
+    // Repsond this RPC.
+    brpc::ClosureGuard done_guard(_done);
+    if (status().ok()) {
+        _response->set_success(true);
+        return;
+    }
+    // Try redirect if this request failed.
+    _kv->redirect(_response);
+}
+
+void GetClosure::Run() {
+    std::unique_ptr<GetClosure> self_guard(this);
+    brpc::ClosureGuard done_guard(_done);
+    if (status().ok()) {
+        return _kv->read(_request->key(), _response);
+    }
+    _kv->redirect(_response);
+}
+
+// Implements example::KvService if you are using brpc.
+class KvServiceImpl : public KvService {
+public:
+    explicit KvServiceImpl(KvStore* kv) : _kv(kv) {}
+    void write(::google::protobuf::RpcController* controller,
+               const ::example::WriteRequest* request,
+               ::example::WriteResponse* response,
+               ::google::protobuf::Closure* done) {
+        return _kv->write(request, response, done);
+    }
+    void get(::google::protobuf::RpcController* controller,
+             const ::example::GetRequest* request,
+             ::example::GetResponse* response,
+             ::google::protobuf::Closure* done) {
+        return _kv->get(request, response, done);
+    }
+private:
+    KvStore* _kv;
+};
+
+}  // namespace example
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    butil::AtExitManager exit_manager;
+
+    brpc::Server server;
+    example::KvStore kv;
+    example::KvServiceImpl service(&kv);
+
+    if (server.AddService(&service,
+                          brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
+        LOG(ERROR) << "Fail to add service";
+        return -1;
+    }
+    if (braft::add_service(&server, FLAGS_port) != 0) {
+        LOG(ERROR) << "Fail to add raft service";
+        return -1;
+    }
+    if (server.Start(FLAGS_port, NULL) != 0) {
+        LOG(ERROR) << "Fail to start Server";
+        return -1;
+    }
+    if (kv.start() != 0) {
+        LOG(ERROR) << "Fail to start KvStore";
+        return -1;
+    }
+
+    LOG(INFO) << "Kv service is running on " << server.listen_address();
+    // Wait until 'CTRL-C' is pressed. then Stop() and Join() the service
+    while (!brpc::IsAskedToQuit()) {
+        sleep(1);
+    }
+
+    LOG(INFO) << "Kv service is going to quit";
+
+    // Stop kv before server
+    kv.shutdown();
+    server.Stop(0);
+
+    // Wait until all the processing tasks are over.
+    kv.join();
+    server.Join();
+    return 0;
+}
@@ -0,0 +1,257 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/append_entries_aggregator.h"
+
+#include <pthread.h>
+#include <butil/time.h>
+#include <bthread/bthread.h>
+#include <bthread/unstable.h>
+#include <bvar/bvar.h>
+#include <brpc/errno.pb.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/transport.h"
+
+namespace braft {
+
+DECLARE_int32(raft_max_body_size);
+
+DEFINE_bool(raft_enable_multi_heartbeat, false,
+            "Send the heartbeats of the groups sharing the same pair of "
+            "leader and follower endpoints in one MultiHeartbeat RPC");
+BRPC_VALIDATE_GFLAG(raft_enable_multi_heartbeat, ::brpc::PassValidate);
+
+DEFINE_int32(raft_multi_heartbeat_window_ms, 10,
+             "Heartbeats issued within this window are sent in one "
+             "MultiHeartbeat RPC");
+BRPC_VALIDATE_GFLAG(raft_multi_heartbeat_window_ms, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_enable_multi_append_entries, false,
+            "Send the AppendEntries requests of the groups sharing the same "
+            "pair of leader and follower endpoints in one MultiAppendEntries "
+            "RPC");
+BRPC_VALIDATE_GFLAG(raft_enable_multi_append_entries, ::brpc::PassValidate);
+
+DEFINE_int32(raft_multi_append_entries_window_us, 200,
+             "AppendEntries requests issued within this window are sent in "
+             "one MultiAppendEntries RPC, which is sent at once when the "
+             "requests reach raft_max_body_size");
+BRPC_VALIDATE_GFLAG(raft_multi_append_entries_window_us,
+                    brpc::NonNegativeInteger);
+
+static bvar::CounterRecorder g_multi_heartbeat_batch_counter(
+        "raft_multi_heartbeat_batch_counter");
+static bvar::CounterRecorder g_multi_append_entries_batch_counter(
+        "raft_multi_append_entries_batch_counter");
+
+static pthread_once_t g_aggregators_once = PTHREAD_ONCE_INIT;
+static AppendEntriesAggregator* g_heartbeat_aggregator = NULL;
+static AppendEntriesAggregator* g_entries_aggregator = NULL;
+
+class AppendEntriesAggregator::MultiAppendEntriesDone
+        : public google::protobuf::Closure {
+public:
+    brpc::Controller cntl;
+    MultiAppendEntriesRequest request;
+    MultiAppendEntriesResponse response;
+    std::vector<Pending> pending;
+
+    void Run() {
+        for (size_t i = 0; i < pending.size(); ++i) {
+            const Pending& p = pending[i];
+            const int index = i;
+            if (cntl.Failed()) {
+                p.cntl->SetFailed(cntl.ErrorCode(), "%s",
+                                  cntl.ErrorText().c_str());
+            } else if (index >= response.responses_size()) {
+                p.cntl->SetFailed(brpc::ERESPONSE,
+                                  "Missing response in the batch");
+            } else if (index < response.error_codes_size() &&
+                            response.error_codes(index) != 0) {
+                p.cntl->SetFailed(response.error_codes(index), "%s",
+                                  index < response.error_texts_size()
+                                  ? response.error_texts(index).c_str()
+                                  : berror(response.error_codes(index)));
+            } else {
+                p.response->Swap(response.mutable_responses(index));
+            }
+            p.done->Run();
+        }
+        delete this;
+    }
+};
+
+AppendEntriesAggregator* AppendEntriesAggregator::heartbeat_aggregator() {
+    struct Creator {
+        static void create() {
+            g_heartbeat_aggregator = new AppendEntriesAggregator(true);
+            g_entries_aggregator = new AppendEntriesAggregator(false);
+        }
+    };
+    pthread_once(&g_aggregators_once, Creator::create);
+    return g_heartbeat_aggregator;
+}
+
+AppendEntriesAggregator* AppendEntriesAggregator::entries_aggregator() {
+    heartbeat_aggregator();
+    return g_entries_aggregator;
+}
+
+AppendEntriesAggregator::~AppendEntriesAggregator() {
+    for (std::map<Key, Batch>::iterator it = _batches.begin();
+            it != _batches.end(); ++it) {
+        delete it->second.channel;
+    }
+}
+
+void AppendEntriesAggregator::send(const butil::EndPoint& local,
+                                   const butil::EndPoint& remote,
+                                   brpc::Controller* cntl,
+                                   const AppendEntriesRequest* request,
+                                   AppendEntriesResponse* response,
+                                   google::protobuf::Closure* done) {
+    const Key key(local, remote);
+    Pending p;
+    p.cntl = cntl;
+    p.request = request;
+    p.response = response;
+    p.done = done;
+    bool need_schedule = false;
+    bool need_flush = false;
+    bool channel_failed = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        Batch& batch = _batches[key];
+        if (batch.channel == NULL) {
+            brpc::Channel* channel = new brpc::Channel;
+            brpc::ChannelOptions channel_opt;
+            channel_opt.timeout_ms = -1;  // Set by the requests
+            if (init_peer_channel(channel, remote, &channel_opt) != 0) {
+                delete channel;
+                channel = NULL;
+            }
+            batch.channel = channel;
+        }
+        if (batch.channel != NULL) {
+            batch.pending.push_back(p);
+            batch.bytes += cntl->request_attachment().size();
+            need_flush = !_heartbeat &&
+                         batch.bytes >= (int64_t)FLAGS_raft_max_body_size;
+            need_schedule = !need_flush && !batch.scheduled;
+            if (need_schedule) {
+                batch.scheduled = true;
+            }
+        } else {
+            channel_failed = true;
+        }
+    }
+    if (channel_failed) {
+        LOG(ERROR) << "Fail to init channel to " << remote;
+        cntl->SetFailed(EINVAL, "Fail to init channel to %s",
+                        butil::endpoint2str(remote).c_str());
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_failed,
+                                     new Pending(p)) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            done->Run();
+        }
+        return;
+    }
+    if (need_flush) {
+        return flush(key);
+    }
+    if (!need_schedule) {
+        return;
+    }
+    FlushArg* arg = new FlushArg;
+    arg->aggregator = this;
+    arg->key = key;
+    const int64_t window_us = _heartbeat
+            ? FLAGS_raft_multi_heartbeat_window_ms * 1000L
+            : FLAGS_raft_multi_append_entries_window_us;
+    bthread_timer_t timer;
+    if (bthread_timer_add(&timer, butil::microseconds_from_now(window_us),
+                          on_timer, arg) != 0) {
+        LOG(ERROR) << "Fail to add timer";
+        run_flush(arg);
+    }
+}
+
+void* AppendEntriesAggregator::run_failed(void* arg) {
+    Pending* p = (Pending*)arg;
+    p->done->Run();
+    delete p;
+    return NULL;
+}
+
+void AppendEntriesAggregator::on_timer(void* arg) {
+    // Don't send RPC in the timer thread
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, run_flush, arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        run_flush(arg);
+    }
+}
+
+void* AppendEntriesAggregator::run_flush(void* arg) {
+    FlushArg* flush_arg = (FlushArg*)arg;
+    flush_arg->aggregator->flush(flush_arg->key);
+    delete flush_arg;
+    return NULL;
+}
+
+void AppendEntriesAggregator::flush(const Key& key) {
+    MultiAppendEntriesDone* done = new MultiAppendEntriesDone;
+    brpc::Channel* channel = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        Batch& batch = _batches[key];
+        batch.scheduled = false;
+        batch.bytes = 0;
+        done->pending.swap(batch.pending);
+        channel = batch.channel;
+    }
+    if (done->pending.empty()) {
+        delete done;
+        return;
+    }
+    // Use the tightest timeout of the requests
+    int64_t timeout_ms = -1;
+    for (size_t i = 0; i < done->pending.size(); ++i) {
+        const Pending& p = done->pending[i];
+        done->request.add_requests()->CopyFrom(*p.request);
+        if (!_heartbeat) {
+            done->request.add_attachment_sizes(
+                    p.cntl->request_attachment().size());
+            done->cntl.request_attachment().append(p.cntl->request_attachment());
+        }
+        if (p.cntl->timeout_ms() > 0 &&
+                (timeout_ms < 0 || p.cntl->timeout_ms() < timeout_ms)) {
+            timeout_ms = p.cntl->timeout_ms();
+        }
+    }
+    done->cntl.set_timeout_ms(timeout_ms);
+    RaftService_Stub stub(channel);
+    if (_heartbeat) {
+        g_multi_heartbeat_batch_counter << done->pending.size();
+        stub.multi_heartbeat(&done->cntl, &done->request,
+                             &done->response, done);
+    } else {
+        g_multi_append_entries_batch_counter << done->pending.size();
+        stub.multi_append_entries(&done->cntl, &done->request,
+                                  &done->response, done);
+    }
+}
+
+}  //  namespace braft
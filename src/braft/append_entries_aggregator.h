@@ -0,0 +1,88 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_APPEND_ENTRIES_AGGREGATOR_H
+#define BRAFT_APPEND_ENTRIES_AGGREGATOR_H
+
+#include <map>
+#include <vector>
+#include <gflags/gflags.h>
+#include <butil/endpoint.h>
+#include <brpc/channel.h>
+#include <brpc/controller.h>
+#include "braft/raft.pb.h"
+#include "braft/macros.h"
+
+namespace braft {
+
+DECLARE_bool(raft_enable_multi_heartbeat);
+DECLARE_bool(raft_enable_multi_append_entries);
+
+// Batches the AppendEntries RPCs of all the groups from the same leader
+// endpoint to the same follower endpoint into one RPC, so that the RPC cost
+// grows with the number of servers rather than the number of groups.
+// Heartbeats are sent in MultiHeartbeat RPCs and the others are sent in
+// MultiAppendEntries RPCs by the two instances respectively.
+class AppendEntriesAggregator {
+public:
+    static AppendEntriesAggregator* heartbeat_aggregator();
+    static AppendEntriesAggregator* entries_aggregator();
+
+    // Send |request| from |local| to |remote| along with the other requests
+    // issued within the window of this aggregator. Like an ordinary
+    // asynchronous RPC, |cntl| and |response| are filled and |done| is called
+    // in another bthread when the request returns, and they are still owned
+    // by the caller.
+    void send(const butil::EndPoint& local, const butil::EndPoint& remote,
+              brpc::Controller* cntl, const AppendEntriesRequest* request,
+              AppendEntriesResponse* response, google::protobuf::Closure* done);
+
+private:
+    explicit AppendEntriesAggregator(bool heartbeat) : _heartbeat(heartbeat) {}
+    ~AppendEntriesAggregator();
+    DISALLOW_COPY_AND_ASSIGN(AppendEntriesAggregator);
+
+    struct Pending {
+        brpc::Controller* cntl;
+        const AppendEntriesRequest* request;
+        AppendEntriesResponse* response;
+        google::protobuf::Closure* done;
+    };
+    typedef std::pair<butil::EndPoint, butil::EndPoint> Key;
+    struct Batch {
+        Batch() : channel(NULL), bytes(0), scheduled(false) {}
+        brpc::Channel* channel;
+        std::vector<Pending> pending;
+        int64_t bytes;
+        bool scheduled;
+    };
+    struct FlushArg {
+        AppendEntriesAggregator* aggregator;
+        Key key;
+    };
+    class MultiAppendEntriesDone;
+
+    static void on_timer(void* arg);
+    static void* run_flush(void* arg);
+    static void* run_failed(void* arg);
+    void flush(const Key& key);
+
+    const bool _heartbeat;
+    raft_mutex_t _mutex;
+    std::map<Key, Batch> _batches;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_APPEND_ENTRIES_AGGREGATOR_H
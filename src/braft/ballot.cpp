@@ -18,63 +18,88 @@
 
 namespace braft {
 
-Ballot::Ballot() : _quorum(0), _old_quorum(0) {}
-Ballot::~Ballot() {}
-
-int Ballot::init(const Configuration& conf, const Configuration* old_conf) {
-    _peers.clear();
-    _old_peers.clear();
-    _quorum = 0;
-    _old_quorum = 0;
-
+Ballot::Layout::Layout(const Configuration& conf,
+                       const Configuration* old_conf)
+    : _quorum(0), _old_quorum(0) {
     _peers.reserve(conf.size());
     for (Configuration::const_iterator
             iter = conf.begin(); iter != conf.end(); ++iter) {
         _peers.push_back(*iter);
+        _flags.push_back(IN_CONF);
     }
-    _quorum = _peers.size() / 2 + 1;
+    _quorum = conf.size() / 2 + 1;
     if (!old_conf) {
-        return 0;
+        return;
     }
-    _old_peers.reserve(old_conf->size());
     for (Configuration::const_iterator
             iter = old_conf->begin(); iter != old_conf->end(); ++iter) {
-        _old_peers.push_back(*iter);
+        const int slot = slot_of(*iter, -1);
+        if (slot >= 0) {
+            _flags[slot] |= IN_OLD_CONF;
+        } else {
+            _peers.push_back(*iter);
+            _flags.push_back(IN_OLD_CONF);
+        }
     }
-    _old_quorum = _old_peers.size() / 2 + 1;
-    return 0;
+    _old_quorum = old_conf->size() / 2 + 1;
 }
 
-Ballot::PosHint Ballot::grant(const PeerId& peer, PosHint hint) {
-    std::vector<UnfoundPeerId>::iterator iter;
-    iter = find_peer(peer, _peers, hint.pos0);
-    if (iter != _peers.end()) {
-        if (!iter->found) {
-            iter->found = true;
-            --_quorum;
+int Ballot::Layout::slot_of(const PeerId& peer, int pos_hint) const {
+    if (pos_hint >= 0 && pos_hint < (int)_peers.size()
+            && _peers[pos_hint] == peer) {
+        return pos_hint;
+    }
+    for (size_t i = 0; i < _peers.size(); ++i) {
+        if (_peers[i] == peer) {
+            return i;
         }
-        hint.pos0 = iter - _peers.begin();
-    } else {
-        hint.pos0 = -1;
     }
+    return -1;
+}
 
-    if (_old_peers.empty()) {
-        hint.pos1 = -1;
-        return hint;
-    }
+Ballot::Ballot() : _quorum(0), _old_quorum(0), _granted(0) {}
+Ballot::~Ballot() {}
 
-    iter = find_peer(peer, _old_peers, hint.pos1);
+int Ballot::init(const Configuration& conf, const Configuration* old_conf) {
+    init(new Layout(conf, old_conf));
+    return 0;
+}
 
-    if (iter != _old_peers.end()) {
-        if (!iter->found) {
-            iter->found = true;
-            --_old_quorum;
-        }
-        hint.pos1 = iter - _old_peers.begin();
-    } else {
-        hint.pos1 = -1;
+void Ballot::init(Layout* layout) {
+    _layout = layout;
+    _quorum = layout->_quorum;
+    _old_quorum = layout->_old_quorum;
+    _granted = 0;
+    _more_granted.clear();
+    if (layout->_peers.size() > 64) {
+        _more_granted.resize((layout->_peers.size() - 1) / 64);
+    }
+}
+
+bool Ballot::test_and_set(int slot) {
+    uint64_t& bits = slot < 64 ? _granted : _more_granted[slot / 64 - 1];
+    const uint64_t mask = (uint64_t)1 << (slot % 64);
+    if (bits & mask) {
+        return true;
     }
+    bits |= mask;
+    return false;
+}
 
+Ballot::PosHint Ballot::grant(const PeerId& peer, PosHint hint) {
+    const int slot = _layout ? _layout->slot_of(peer, hint.pos0) : -1;
+    hint.pos0 = slot;
+    hint.pos1 = -1;
+    if (slot < 0 || test_and_set(slot)) {
+        return hint;
+    }
+    const uint8_t flags = _layout->_flags[slot];
+    if (flags & Layout::IN_CONF) {
+        --_quorum;
+    }
+    if (flags & Layout::IN_OLD_CONF) {
+        --_old_quorum;
+    }
     return hint;
 }
 
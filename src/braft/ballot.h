@@ -17,6 +17,7 @@
 #ifndef  BRAFT_BALLOT_H
 #define  BRAFT_BALLOT_H
 
+#include <butil/memory/ref_counted.h>
 #include "braft/configuration.h"
 
 namespace braft {
@@ -29,46 +30,55 @@ public:
         int pos1;
     };
 
+    // The voters of a configuration (and the old one in joint consensus)
+    // mapped to slots, which is shared by all the ballots of the same
+    // configuration so that each ballot holds only the bitmask of the slots
+    class Layout : public butil::RefCountedThreadSafe<Layout> {
+    public:
+        Layout(const Configuration& conf, const Configuration* old_conf);
+        // Returns -1 if |peer| is not a voter
+        int slot_of(const PeerId& peer, int pos_hint) const;
+    private:
+    friend class Ballot;
+    friend class butil::RefCountedThreadSafe<Layout>;
+        ~Layout() {}
+        enum {
+            IN_CONF = 1,
+            IN_OLD_CONF = 2,
+        };
+        std::vector<PeerId> _peers;
+        std::vector<uint8_t> _flags;
+        int _quorum;
+        int _old_quorum;
+    };
+
     Ballot();
     ~Ballot();
     void swap(Ballot& rhs) {
-        _peers.swap(rhs._peers);
+        _layout.swap(rhs._layout);
         std::swap(_quorum, rhs._quorum);
-        _old_peers.swap(rhs._old_peers);
         std::swap(_old_quorum, rhs._old_quorum);
+        std::swap(_granted, rhs._granted);
+        _more_granted.swap(rhs._more_granted);
     }
 
     int init(const Configuration& conf, const Configuration* old_conf);
+    // Share |layout| with the other ballots, which allocates nothing for
+    // configurations of no more than 64 voters
+    void init(Layout* layout);
     PosHint grant(const PeerId& peer, PosHint hint);
     void grant(const PeerId& peer);
     bool granted() const { return _quorum <= 0 && _old_quorum <= 0; }
 private:
-    struct UnfoundPeerId {
-        UnfoundPeerId(const PeerId& peer_id) : peer_id(peer_id), found(false) {}
-        PeerId peer_id;
-        bool found;
-        bool operator==(const PeerId& id) const {
-            return peer_id == id;
-        }
-    };
-    std::vector<UnfoundPeerId>::iterator find_peer(
-            const PeerId& peer, std::vector<UnfoundPeerId>& peers, int pos_hint) {
-        if (pos_hint < 0 || pos_hint >= (int)peers.size()
-                || peers[pos_hint].peer_id != peer) {
-            for (std::vector<UnfoundPeerId>::iterator
-                    iter = peers.begin(); iter != peers.end(); ++iter) {
-                if (*iter == peer) {
-                    return iter;
-                }
-            }
-            return peers.end();
-        }
-        return peers.begin() + pos_hint;
-    }
-    std::vector<UnfoundPeerId> _peers;
+    // Returns whether |slot| was granted before
+    bool test_and_set(int slot);
+
+    scoped_refptr<Layout> _layout;
     int _quorum;
-    std::vector<UnfoundPeerId> _old_peers;
     int _old_quorum;
+    // Bitmask of the granted slots, and the slots beyond 64 if any
+    uint64_t _granted;
+    std::vector<uint64_t> _more_granted;
 };
 
 };
@@ -14,21 +14,36 @@
 
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
+#include <algorithm>
+#include <functional>
+#include <gflags/gflags.h>
 #include <butil/scoped_lock.h>
 #include <bvar/latency_recorder.h>
 #include <bthread/unstable.h>
+#include <brpc/reloadable_flags.h>
 #include "braft/ballot_box.h"
 #include "braft/util.h"
 #include "braft/fsm_caller.h"
 #include "braft/closure_queue.h"
+#include "braft/replicator.h"
 
 namespace braft {
 
+DEFINE_bool(raft_commit_by_match_index, false,
+            "Leaders elected after this is set derive the committed index from "
+            "the match index of each voter, which makes an ack O(voters) "
+            "without locking instead of granting the ballots of the acked "
+            "logs under a lock");
+BRPC_VALIDATE_GFLAG(raft_commit_by_match_index, ::brpc::PassValidate);
+
 BallotBox::BallotBox()
     : _waiter(NULL)
+    , _replicator_group(NULL)
     , _closure_queue(NULL)
     , _last_committed_index(0)
     , _pending_index(0)
+    , _use_match_index(false)
+    , _last_pending_index(0)
 {
 }
 
@@ -43,14 +58,18 @@ int BallotBox::init(const BallotBoxOptions &options) {
     }
     _waiter = options.waiter;
     _closure_queue = options.closure_queue;
+    _replicator_group = options.replicator_group;
     return 0;
 }
 
 int BallotBox::commit_at(
         int64_t first_log_index, int64_t last_log_index, const PeerId& peer) {
+    if (_use_match_index.load(butil::memory_order_acquire)) {
+        return commit_at_match_index(last_log_index, peer);
+    }
     // FIXME(chenzhangyi01): The cricital section is unacceptable because it 
     // blocks all the other Replicators and LogManagers
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<ballot_box_mutex_t> lck(_mutex);
     if (_pending_index == 0) {
         return EINVAL;
     }
@@ -92,6 +111,83 @@ int BallotBox::commit_at(
     lck.unlock();
     // The order doesn't matter
     _waiter->on_committed(last_committed_index);
+    if (_replicator_group) {
+        _replicator_group->propagate_committed_index();
+    }
+    return 0;
+}
+
+size_t BallotBox::set_quorum_conf(QuorumConf& bg, const QuorumConf& conf) {
+    bg = conf;
+    return 1;
+}
+
+int64_t BallotBox::quorum_match_index(
+        const std::vector<butil::atomic<int64_t>*>& peers) {
+    DEFINE_SMALL_ARRAY(int64_t, match_indexes, peers.size(), 16);
+    for (size_t i = 0; i < peers.size(); ++i) {
+        match_indexes[i] = peers[i]->load(butil::memory_order_relaxed);
+    }
+    // The largest index matched by a quorum
+    const size_t quorum_pos = peers.size() / 2;
+    std::nth_element(match_indexes, match_indexes + quorum_pos,
+                     match_indexes + peers.size(), std::greater<int64_t>());
+    return match_indexes[quorum_pos];
+}
+
+int BallotBox::commit_at_match_index(int64_t last_log_index,
+                                     const PeerId& peer) {
+    int64_t last_committed_index = 0;
+    {
+        butil::DoublyBufferedData<QuorumConf>::ScopedPtr ptr;
+        if (_quorum.Read(&ptr) != 0 || ptr->runs.empty()) {
+            return EINVAL;
+        }
+        const int64_t last_pending_index =
+                _last_pending_index.load(butil::memory_order_acquire);
+        if (last_log_index < ptr->runs.front().first_index) {
+            return 0;
+        }
+        if (last_log_index > last_pending_index) {
+            return ERANGE;
+        }
+        std::map<PeerId, butil::atomic<int64_t>*>::const_iterator
+                it = ptr->match_indexes.find(peer);
+        if (it == ptr->match_indexes.end()) {
+            return 0;
+        }
+        // Acks of a peer might return out of order
+        int64_t match_index = it->second->load(butil::memory_order_relaxed);
+        while (match_index < last_log_index &&
+                !it->second->compare_exchange_weak(match_index, last_log_index)) {}
+        // Committing a log commits all the previous ones, see commit_at
+        for (size_t i = ptr->runs.size(); i > 0; --i) {
+            const QuorumRun& run = ptr->runs[i - 1];
+            int64_t index = i < ptr->runs.size()
+                    ? ptr->runs[i].first_index - 1 : last_pending_index;
+            index = std::min(index, quorum_match_index(run.peers));
+            if (!run.old_peers.empty()) {
+                index = std::min(index, quorum_match_index(run.old_peers));
+            }
+            if (index >= run.first_index) {
+                last_committed_index = index;
+                break;
+            }
+        }
+    }
+    int64_t prev_committed_index =
+            _last_committed_index.load(butil::memory_order_relaxed);
+    do {
+        if (last_committed_index <= prev_committed_index) {
+            return 0;
+        }
+    } while (!_last_committed_index.compare_exchange_weak(
+                    prev_committed_index, last_committed_index));
+    // The order doesn't matter
+    _waiter->on_committed(last_committed_index);
+    if (_replicator_group) {
+        _replicator_group->propagate_committed_index();
+    }
     return 0;
 }
 
@@ -101,6 +197,17 @@ int BallotBox::clear_pending_tasks() {
         BAIDU_SCOPED_LOCK(_mutex);
         saved_meta.swap(_pending_meta_queue);
         _pending_index = 0;
+        if (!_quorum_conf.runs.empty()) {
+            std::map<PeerId, butil::atomic<int64_t>*> match_indexes;
+            match_indexes.swap(_quorum_conf.match_indexes);
+            _quorum_conf.runs.clear();
+            // Wait until no one reads the match indexes
+            _quorum.Modify(set_quorum_conf, _quorum_conf);
+            for (std::map<PeerId, butil::atomic<int64_t>*>::iterator
+                    it = match_indexes.begin(); it != match_indexes.end(); ++it) {
+                delete it->second;
+            }
+        }
     }
     _closure_queue->clear();
     return 0;
@@ -114,29 +221,96 @@ int BallotBox::reset_pending_index(int64_t new_pending_index) {
     CHECK_GT(new_pending_index, _last_committed_index.load(
                                     butil::memory_order_relaxed));
     _pending_index = new_pending_index;
+    _use_match_index.store(FLAGS_raft_commit_by_match_index,
+                           butil::memory_order_release);
+    _ballot_layout = NULL;
+    _last_conf.reset();
+    _last_old_conf.reset();
+    _last_pending_index.store(new_pending_index - 1,
+                              butil::memory_order_relaxed);
     _closure_queue->reset_first_index(new_pending_index);
     return 0;
 }
 
+bool BallotBox::is_last_conf(const Configuration& conf,
+                             const Configuration* old_conf) const {
+    if (!_last_conf.equals(conf)) {
+        return false;
+    }
+    return old_conf ? _last_old_conf.equals(*old_conf)
+                    : _last_old_conf.empty();
+}
+
+void BallotBox::add_run_peers(const Configuration& conf,
+                              std::vector<butil::atomic<int64_t>*>* peers) {
+    for (Configuration::const_iterator
+            iter = conf.begin(); iter != conf.end(); ++iter) {
+        butil::atomic<int64_t>*& match_index =
+                _quorum_conf.match_indexes[*iter];
+        if (match_index == NULL) {
+            match_index = new butil::atomic<int64_t>(0);
+        }
+        peers->push_back(match_index);
+    }
+}
+
+int BallotBox::append_pending_run(const Configuration& conf,
+                                  const Configuration* old_conf,
+                                  Closure* closure) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    CHECK(_pending_index > 0);
+    const int64_t index =
+            _last_pending_index.load(butil::memory_order_relaxed) + 1;
+    if (_quorum_conf.runs.empty() || !is_last_conf(conf, old_conf)) {
+        // Drop the runs which are committed
+        const int64_t committed_index =
+                _last_committed_index.load(butil::memory_order_relaxed);
+        size_t ncommitted = 0;
+        while (ncommitted + 1 < _quorum_conf.runs.size() &&
+                _quorum_conf.runs[ncommitted + 1].first_index
+                    <= committed_index + 1) {
+            ++ncommitted;
+        }
+        _quorum_conf.runs.erase(_quorum_conf.runs.begin(),
+                                _quorum_conf.runs.begin() + ncommitted);
+        QuorumRun run;
+        run.first_index = index;
+        add_run_peers(conf, &run.peers);
+        if (old_conf) {
+            add_run_peers(*old_conf, &run.old_peers);
+        }
+        _quorum_conf.runs.push_back(run);
+        _quorum.Modify(set_quorum_conf, _quorum_conf);
+        _last_conf = conf;
+        _last_old_conf = old_conf ? *old_conf : Configuration();
+    }
+    _closure_queue->append_pending_closure(closure);
+    _last_pending_index.store(index, butil::memory_order_release);
+    return 0;
+}
+
 int BallotBox::append_pending_task(const Configuration& conf, const Configuration* old_conf,
                                    Closure* closure) {
-    Ballot bl;
-    if (bl.init(conf, old_conf) != 0) {
-        CHECK(false) << "Fail to init ballot";
-        return -1;
+    if (_use_match_index.load(butil::memory_order_acquire)) {
+        return append_pending_run(conf, old_conf, closure);
     }
-
     BAIDU_SCOPED_LOCK(_mutex);
     CHECK(_pending_index > 0);
+    // The ballots of the same configuration share the layout
+    if (_ballot_layout == NULL || !is_last_conf(conf, old_conf)) {
+        _ballot_layout = new Ballot::Layout(conf, old_conf);
+        _last_conf = conf;
+        _last_old_conf = old_conf ? *old_conf : Configuration();
+    }
     _pending_meta_queue.push_back(Ballot());
-    _pending_meta_queue.back().swap(bl);
+    _pending_meta_queue.back().init(_ballot_layout.get());
     _closure_queue->append_pending_closure(closure);
     return 0;
 }
 
 int BallotBox::set_last_committed_index(int64_t last_committed_index) {
     // FIXME: it seems that lock is not necessary here
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<ballot_box_mutex_t> lck(_mutex);
     if (_pending_index != 0 || !_pending_meta_queue.empty()) {
         CHECK(last_committed_index < _pending_index)
             << "node changes to leader, pending_index=" << _pending_index
@@ -156,11 +330,16 @@ int BallotBox::set_last_committed_index(int64_t last_committed_index) {
 }
 
 void BallotBox::describe(std::ostream& os, bool use_html) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<ballot_box_mutex_t> lck(_mutex);
     int64_t committed_index = _last_committed_index;
     int64_t pending_index = 0;
     size_t pending_queue_size = 0;
-    if (_pending_index != 0) {
+    if (_pending_index != 0
+            && _use_match_index.load(butil::memory_order_relaxed)) {
+        pending_index = committed_index + 1;
+        pending_queue_size = _last_pending_index.load(
+                butil::memory_order_relaxed) - committed_index;
+    } else if (_pending_index != 0) {
         pending_index = _pending_index;
         pending_queue_size = _pending_meta_queue.size();
     }
@@ -177,9 +356,14 @@ void BallotBox::get_status(BallotBoxStatus* status) {
     if (!status) {
         return;
     }
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<ballot_box_mutex_t> lck(_mutex);
     status->committed_index = _last_committed_index;
-    if (_pending_meta_queue.size() != 0) {
+    if (_pending_index != 0
+            && _use_match_index.load(butil::memory_order_relaxed)) {
+        status->pending_index = status->committed_index + 1;
+        status->pending_queue_size = _last_pending_index.load(
+                butil::memory_order_relaxed) - status->committed_index;
+    } else if (_pending_meta_queue.size() != 0) {
         status->pending_index = _pending_index;
         status->pending_queue_size = _pending_meta_queue.size();
     }
@@ -19,8 +19,10 @@
 
 #include <stdint.h>                             // int64_t
 #include <set>                                  // std::set
+#include <map>
 #include <deque>
 #include <butil/atomicops.h>                     // butil::atomic
+#include <butil/containers/doubly_buffered_data.h>
 #include "braft/raft.h"
 #include "braft/util.h"
 #include "braft/ballot.h"
@@ -29,14 +31,18 @@ namespace braft {
 
 class FSMCaller;
 class ClosureQueue;
+class ReplicatorGroup;
 
 struct BallotBoxOptions {
     BallotBoxOptions() 
         : waiter(NULL)
         , closure_queue(NULL)
+        , replicator_group(NULL)
     {}
     FSMCaller* waiter;
     ClosureQueue* closure_queue;
+    // Told when the leader commits new logs, optional
+    ReplicatorGroup* replicator_group;
 };
 
 struct BallotBoxStatus {
@@ -48,6 +54,11 @@ struct BallotBoxStatus {
     int64_t pending_queue_size;
 };
 
+struct BallotBoxMutexTag {
+    static const char* name() { return "ballot_box"; }
+};
+typedef ProfiledMutex<BallotBoxMutexTag> ballot_box_mutex_t;
+
 class BallotBox {
 public:
     BallotBox();
@@ -91,14 +102,51 @@ public:
     void get_status(BallotBoxStatus* ballot_box_status);
 
 private:
+    // The pending logs from |first_index| until the next run share the same
+    // configuration
+    struct QuorumRun {
+        int64_t first_index;
+        std::vector<butil::atomic<int64_t>*> peers;
+        std::vector<butil::atomic<int64_t>*> old_peers;
+    };
+    struct QuorumConf {
+        // Match index of each voter of the runs
+        std::map<PeerId, butil::atomic<int64_t>*> match_indexes;
+        std::vector<QuorumRun> runs;
+    };
+
+    static size_t set_quorum_conf(QuorumConf& bg, const QuorumConf& conf);
+    static int64_t quorum_match_index(
+            const std::vector<butil::atomic<int64_t>*>& peers);
+    int commit_at_match_index(int64_t last_log_index, const PeerId& peer);
+    bool is_last_conf(const Configuration& conf,
+                      const Configuration* old_conf) const;
+    int append_pending_run(const Configuration& conf,
+                           const Configuration* old_conf, Closure* closure);
+    void add_run_peers(const Configuration& conf,
+                       std::vector<butil::atomic<int64_t>*>* peers);
 
     FSMCaller*                                      _waiter;
+    ReplicatorGroup*                                _replicator_group;
     ClosureQueue*                                   _closure_queue;                            
-    raft_mutex_t                                    _mutex;
+    ballot_box_mutex_t                              _mutex;
     butil::atomic<int64_t>                          _last_committed_index;
     int64_t                                         _pending_index;
+    // Configuration of the last pending log
+    Configuration                                   _last_conf;
+    Configuration                                   _last_old_conf;
     std::deque<Ballot>                              _pending_meta_queue;
-
+    // Shared by the ballots of _last_conf and _last_old_conf
+    scoped_refptr<Ballot::Layout>                   _ballot_layout;
+
+    // Instead of granting the ballot of each log, the voters publish their
+    // match indexes and the committed index is derived from them without
+    // locking, see raft_commit_by_match_index. Written under _mutex and read
+    // without it by the replicators and the disk thread
+    butil::atomic<bool>                             _use_match_index;
+    butil::atomic<int64_t>                          _last_pending_index;
+    QuorumConf                                      _quorum_conf;
+    butil::DoublyBufferedData<QuorumConf>           _quorum;
 };
 
 }  //  namespace braft
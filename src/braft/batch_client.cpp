@@ -0,0 +1,292 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/batch_client.h"
+
+#include <deque>
+#include <butil/unique_ptr.h>
+#include <bthread/bthread.h>
+#include <brpc/channel.h>
+#include <brpc/controller.h>
+#include "braft/batch.pb.h"
+#include "braft/route_table.h"
+
+namespace braft {
+
+BatchClientOptions::BatchClientOptions()
+    : timeout_ms(1000)
+    , max_retry(3)
+    , retry_interval_ms(100)
+    , max_batch_ops(128)
+    , max_batch_bytes(1024 * 1024)
+    , max_inflight_batches(4)
+{}
+
+struct BatchClient::GroupQueue {
+    GroupQueue() : inflight(0) {}
+    raft_mutex_t mutex;
+    std::deque<PendingOp> pending;
+    int inflight;
+};
+
+class BatchClient::BatchCall : public google::protobuf::Closure {
+public:
+    BatchCall(BatchClient* client, const GroupId& group, GroupQueue* q)
+        : client(client), group(group), queue(q), nretry(0) {}
+    void Run() { client->on_batch_returned(this); }
+
+    BatchClient* client;
+    GroupId group;
+    GroupQueue* queue;
+    std::vector<PendingOp> ops;
+    int nretry;
+    PeerId leader;
+    // Kept across the resends to the same leader
+    std::unique_ptr<brpc::Channel> channel;
+    butil::EndPoint channel_addr;
+    brpc::Controller cntl;
+    BatchRequest request;
+    BatchResponse response;
+};
+
+// Parses the result of a protobuf operation before running the user done
+class ParseResultDone : public Closure {
+public:
+    ParseResultDone(google::protobuf::Message* result, Closure* done)
+        : _result(result), _done(done) {}
+    void Run() {
+        if (status().ok()) {
+            butil::IOBufAsZeroCopyInputStream wrapper(buf);
+            if (!_result->ParseFromZeroCopyStream(&wrapper)) {
+                _done->status().set_error(EINVAL, "Fail to parse %s",
+                                          _result->GetTypeName().c_str());
+            }
+        } else {
+            _done->status() = status();
+        }
+        _done->Run();
+        delete this;
+    }
+    butil::IOBuf buf;
+private:
+    google::protobuf::Message* _result;
+    Closure* _done;
+};
+
+BatchClient::BatchClient() {}
+
+BatchClient::~BatchClient() {
+    for (std::map<GroupId, GroupQueue*>::iterator
+            it = _groups.begin(); it != _groups.end(); ++it) {
+        delete it->second;
+    }
+}
+
+int BatchClient::init(const BatchClientOptions& options) {
+    if (options.max_batch_ops <= 0 || options.max_inflight_batches <= 0) {
+        LOG(ERROR) << "Invalid max_batch_ops=" << options.max_batch_ops
+                   << " or max_inflight_batches="
+                   << options.max_inflight_batches;
+        return -1;
+    }
+    _options = options;
+    return 0;
+}
+
+BatchClient::GroupQueue* BatchClient::get_group(const GroupId& group) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    GroupQueue*& q = _groups[group];
+    if (q == NULL) {
+        q = new GroupQueue;
+    }
+    return q;
+}
+
+void BatchClient::submit(const GroupId& group, const butil::IOBuf& op,
+                         butil::IOBuf* result, Closure* done) {
+    GroupQueue* q = get_group(group);
+    BatchCall* call = NULL;
+    {
+        BAIDU_SCOPED_LOCK(q->mutex);
+        q->pending.push_back(PendingOp());
+        PendingOp& pending = q->pending.back();
+        pending.op = op;
+        pending.result = result;
+        pending.done = done;
+        if (q->inflight < _options.max_inflight_batches) {
+            call = take_batch(group, q);
+        }
+    }
+    if (call) {
+        send(call);
+    }
+}
+
+void BatchClient::submit(const GroupId& group,
+                         const google::protobuf::Message& op,
+                         google::protobuf::Message* result, Closure* done) {
+    butil::IOBuf buf;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&buf);
+    if (!op.SerializeToZeroCopyStream(&wrapper)) {
+        done->status().set_error(EINVAL, "Fail to serialize %s",
+                                 op.GetTypeName().c_str());
+        return done->Run();
+    }
+    ParseResultDone* parse_done = new ParseResultDone(result, done);
+    return submit(group, buf, &parse_done->buf, parse_done);
+}
+
+// Called with q->mutex held
+BatchClient::BatchCall* BatchClient::take_batch(const GroupId& group,
+                                                GroupQueue* q) {
+    if (q->pending.empty()) {
+        return NULL;
+    }
+    BatchCall* call = new BatchCall(this, group, q);
+    int64_t bytes = 0;
+    while (!q->pending.empty()
+            && (int)call->ops.size() < _options.max_batch_ops
+            && (call->ops.empty()
+                || bytes + (int64_t)q->pending.front().op.size()
+                        <= _options.max_batch_bytes)) {
+        bytes += q->pending.front().op.size();
+        call->ops.push_back(PendingOp());
+        PendingOp& op = call->ops.back();
+        op.op.swap(q->pending.front().op);
+        op.result = q->pending.front().result;
+        op.done = q->pending.front().done;
+        q->pending.pop_front();
+    }
+    ++q->inflight;
+    return call;
+}
+
+void BatchClient::send(BatchCall* call) {
+    if (rtb::select_leader(call->group, &call->leader) != 0) {
+        return retry(call, butil::Status(EAGAIN, "Unknown leader of group %s",
+                                         call->group.c_str()));
+    }
+    call->cntl.Reset();
+    call->cntl.set_timeout_ms(_options.timeout_ms);
+    call->request.Clear();
+    call->response.Clear();
+    call->request.set_group_id(call->group);
+    call->request.set_peer_id(call->leader.to_string());
+    for (size_t i = 0; i < call->ops.size(); ++i) {
+        call->request.add_op_sizes(call->ops[i].op.size());
+        call->cntl.request_attachment().append(call->ops[i].op);
+    }
+    if (call->channel == NULL || call->channel_addr != call->leader.addr) {
+        call->channel.reset(new brpc::Channel);
+        if (call->channel->Init(call->leader.addr, NULL) != 0) {
+            call->channel.reset();
+            rtb::update_leader(call->group, PeerId());
+            return retry(call, butil::Status(EINVAL,
+                                             "Fail to init channel to %s",
+                                             call->leader.to_string().c_str()));
+        }
+        call->channel_addr = call->leader.addr;
+    }
+    BatchService_Stub stub(call->channel.get());
+    stub.batch(&call->cntl, &call->request, &call->response, call);
+}
+
+void BatchClient::on_batch_returned(BatchCall* call) {
+    if (call->cntl.Failed()) {
+        LOG(WARNING) << "Fail to send batch of group " << call->group
+                     << " to " << call->leader << " : "
+                     << call->cntl.ErrorText();
+        rtb::update_leader(call->group, PeerId());
+        return retry(call, butil::Status(call->cntl.ErrorCode(), "%s",
+                                         call->cntl.ErrorText().c_str()));
+    }
+    const BatchResponse& response = call->response;
+    if (!response.success()) {
+        butil::Status st(response.error_code(), "%s",
+                         response.error_text().c_str());
+        if (response.has_redirect()) {
+            // Resend to the new leader at once
+            rtb::update_leader(call->group, response.redirect());
+            if (++call->nretry > _options.max_retry) {
+                return finish(call, st);
+            }
+            return send(call);
+        }
+        if (response.error_code() != EPERM) {
+            return finish(call, st);
+        }
+        rtb::update_leader(call->group, PeerId());
+        return retry(call, st);
+    }
+    butil::IOBuf& results = call->cntl.response_attachment();
+    for (size_t i = 0; i < call->ops.size(); ++i) {
+        if ((int)i < response.result_sizes_size()
+                && call->ops[i].result != NULL) {
+            call->ops[i].result->clear();
+            results.cutn(call->ops[i].result, response.result_sizes(i));
+        }
+    }
+    finish(call, butil::Status::OK());
+}
+
+void BatchClient::retry(BatchCall* call, const butil::Status& st) {
+    if (++call->nretry > _options.max_retry) {
+        return finish(call, st);
+    }
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, run_retry, call) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        run_retry(call);
+    }
+}
+
+void* BatchClient::run_retry(void* arg) {
+    BatchCall* call = (BatchCall*)arg;
+    BatchClient* client = call->client;
+    bthread_usleep(client->_options.retry_interval_ms * 1000L);
+    PeerId leader;
+    if (rtb::select_leader(call->group, &leader) != 0) {
+        butil::Status st = rtb::refresh_leader(call->group,
+                                               client->_options.timeout_ms);
+        if (!st.ok()) {
+            client->retry(call, st);
+            return NULL;
+        }
+    }
+    client->send(call);
+    return NULL;
+}
+
+void BatchClient::finish(BatchCall* call, const butil::Status& st) {
+    for (size_t i = 0; i < call->ops.size(); ++i) {
+        Closure* done = call->ops[i].done;
+        if (!st.ok()) {
+            done->status() = st;
+        }
+        done->Run();
+    }
+    GroupQueue* q = call->queue;
+    BatchCall* next = NULL;
+    {
+        BAIDU_SCOPED_LOCK(q->mutex);
+        --q->inflight;
+        next = take_batch(call->group, q);
+    }
+    delete call;
+    if (next) {
+        send(next);
+    }
+}
+
+}  // namespace braft
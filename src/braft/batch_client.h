@@ -0,0 +1,111 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRAFT_BATCH_CLIENT_H
+#define  BRAFT_BATCH_CLIENT_H
+
+#include <map>
+#include <butil/iobuf.h>
+#include <google/protobuf/message.h>
+#include "braft/raft.h"                  // Closure
+#include "braft/macros.h"
+
+namespace braft {
+
+struct BatchClientOptions {
+    BatchClientOptions();
+
+    // Timeout of each BatchRequest
+    // Default: 1000
+    int timeout_ms;
+
+    // Times a batch is resent after the leader is unknown, changed or
+    // unreachable before its operations fail
+    // Default: 3
+    int max_retry;
+
+    // Interval before a batch is resent to a refreshed leader
+    // Default: 100
+    int retry_interval_ms;
+
+    // Max number of operations in one BatchRequest
+    // Default: 128
+    int max_batch_ops;
+
+    // Max bytes of the operations in one BatchRequest, unless the first
+    // operation is larger
+    // Default: 1MB
+    int64_t max_batch_bytes;
+
+    // Max number of BatchRequests of a group in flight. The operations
+    // submitted meanwhile are queued and sent in the following batches.
+    // Default: 4
+    int max_inflight_batches;
+};
+
+// Sends the operations of raft groups to their leaders in batches. The
+// operations submitted to the same group while the previous batches are in
+// flight are packed into one BatchRequest, which BatchServiceImpl on the
+// leader applies as one task, so the RPC and the raft cost are paid per
+// batch rather than per operation. The leaders are cached in RouteTable,
+// and a batch is resent to the redirected or refreshed leader when the
+// leader changes, so an operation may be applied more than once if its
+// leader steps down after replicating it. The configurations of the groups
+// must be registered with rtb::update_configuration before.
+class BatchClient {
+public:
+    BatchClient();
+    // Must not be destroyed before all the submitted operations are done
+    ~BatchClient();
+
+    int init(const BatchClientOptions& options);
+
+    // Send |op| to the leader of |group|. |result| is filled with the result
+    // added by BatchClosure::add_result for |op| and |done| is run when |op|
+    // is applied or fails.
+    void submit(const GroupId& group, const butil::IOBuf& op,
+                butil::IOBuf* result, Closure* done);
+
+    // Same as above, with |op| serialized and |result| parsed as protobuf
+    // messages
+    void submit(const GroupId& group, const google::protobuf::Message& op,
+                google::protobuf::Message* result, Closure* done);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(BatchClient);
+
+    struct PendingOp {
+        butil::IOBuf op;
+        butil::IOBuf* result;
+        Closure* done;
+    };
+    struct GroupQueue;
+    class BatchCall;
+
+    GroupQueue* get_group(const GroupId& group);
+    BatchCall* take_batch(const GroupId& group, GroupQueue* q);
+    void send(BatchCall* call);
+    void on_batch_returned(BatchCall* call);
+    void retry(BatchCall* call, const butil::Status& st);
+    void finish(BatchCall* call, const butil::Status& st);
+    static void* run_retry(void* arg);
+
+    BatchClientOptions _options;
+    raft_mutex_t _mutex;
+    std::map<GroupId, GroupQueue*> _groups;
+};
+
+}  // namespace braft
+
+#endif  //BRAFT_BATCH_CLIENT_H
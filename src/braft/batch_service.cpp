@@ -0,0 +1,176 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/batch_service.h"
+
+#include <butil/raw_pack.h>              // butil::RawPacker
+#include <brpc/closure_guard.h>          // brpc::ClosureGuard
+#include "braft/node_manager.h"          // NodeManager
+
+namespace braft {
+
+// Layout of an encoded batch:
+//  | magic (4B) | count (4B) | size of op (4B) * count | ops |
+static const uint32_t BATCH_MAGIC = 0x42415443;  // "BATC"
+static const size_t BATCH_HEADER_SIZE = 8;
+
+void encode_batch(const std::vector<butil::IOBuf>& ops, butil::IOBuf* data) {
+    std::vector<char> header(BATCH_HEADER_SIZE + 4 * ops.size());
+    butil::RawPacker packer(&header[0]);
+    packer.pack32(BATCH_MAGIC).pack32(ops.size());
+    for (size_t i = 0; i < ops.size(); ++i) {
+        packer.pack32(ops[i].size());
+    }
+    data->append(&header[0], header.size());
+    for (size_t i = 0; i < ops.size(); ++i) {
+        data->append(ops[i]);
+    }
+}
+
+int BatchReader::init(const butil::IOBuf& data) {
+    _sizes.clear();
+    _index = 0;
+    _ops.clear();
+    char header[BATCH_HEADER_SIZE];
+    if (data.copy_to(header, sizeof(header)) != sizeof(header)) {
+        return -1;
+    }
+    uint32_t magic = 0;
+    uint32_t count = 0;
+    butil::RawUnpacker(header).unpack32(magic).unpack32(count);
+    if (magic != BATCH_MAGIC
+            || data.size() < BATCH_HEADER_SIZE + 4 * (size_t)count) {
+        return -1;
+    }
+    _ops = data;
+    _ops.pop_front(BATCH_HEADER_SIZE);
+    std::vector<char> sizes(4 * (size_t)count);
+    if (count != 0) {
+        _ops.cutn(&sizes[0], sizes.size());
+    }
+    _sizes.resize(count);
+    size_t total = 0;
+    butil::RawUnpacker unpacker(sizes.empty() ? NULL : &sizes[0]);
+    for (uint32_t i = 0; i < count; ++i) {
+        unpacker.unpack32(_sizes[i]);
+        total += _sizes[i];
+    }
+    if (total != _ops.size()) {
+        _sizes.clear();
+        _ops.clear();
+        return -1;
+    }
+    return 0;
+}
+
+bool BatchReader::next(butil::IOBuf* op) {
+    if (_index >= _sizes.size()) {
+        return false;
+    }
+    op->clear();
+    _ops.cutn(op, _sizes[_index++]);
+    return true;
+}
+
+void BatchClosure::add_result(const butil::IOBuf& result) {
+    _response->add_result_sizes(result.size());
+    _results.append(result);
+}
+
+void BatchClosure::Run() {
+    brpc::ClosureGuard done_guard(_done);
+    if (status().ok()) {
+        _response->set_success(true);
+        _cntl->response_attachment().swap(_results);
+    } else {
+        _response->set_success(false);
+        _response->clear_result_sizes();
+        _response->set_error_code(status().error_code());
+        _response->set_error_text(status().error_str());
+        const PeerId leader = _node->leader_id();
+        if (!leader.is_empty()) {
+            _response->set_redirect(leader.to_string());
+        }
+    }
+    delete this;
+}
+
+void BatchServiceImpl::batch(::google::protobuf::RpcController* controller,
+                             const ::braft::BatchRequest* request,
+                             ::braft::BatchResponse* response,
+                             ::google::protobuf::Closure* done) {
+    brpc::Controller* cntl = (brpc::Controller*)controller;
+    brpc::ClosureGuard done_guard(done);
+    scoped_refptr<NodeImpl> node;
+    butil::Status st = get_node(&node, request->group_id(), request->peer_id());
+    if (!st.ok()) {
+        cntl->SetFailed(st.error_code(), "%s", st.error_cstr());
+        return;
+    }
+    if (!node->is_leader()) {
+        response->set_success(false);
+        response->set_error_code(EPERM);
+        response->set_error_text("Not leader");
+        const PeerId leader = node->leader_id();
+        if (!leader.is_empty()) {
+            response->set_redirect(leader.to_string());
+        }
+        return;
+    }
+    std::vector<butil::IOBuf> ops(request->op_sizes_size());
+    butil::IOBuf& attachment = cntl->request_attachment();
+    for (int i = 0; i < request->op_sizes_size(); ++i) {
+        if (attachment.cutn(&ops[i], request->op_sizes(i))
+                != (size_t)request->op_sizes(i)) {
+            cntl->SetFailed(EINVAL, "Attachment is shorter than the ops");
+            return;
+        }
+    }
+    butil::IOBuf data;
+    encode_batch(ops, &data);
+    Task task;
+    task.data = &data;
+    task.done = new BatchClosure(cntl, response, done_guard.release(), node);
+    return node->apply(task);
+}
+
+butil::Status BatchServiceImpl::get_node(scoped_refptr<NodeImpl>* node,
+                                         const GroupId& group_id,
+                                         const std::string& peer_id) {
+    NodeManager* const nm = NodeManager::GetInstance();
+    if (!peer_id.empty()) {
+        *node = nm->get(group_id, peer_id);
+        if (!(*node)) {
+            return butil::Status(ENOENT, "Fail to find node %s in group %s",
+                                         peer_id.c_str(),
+                                         group_id.c_str());
+        }
+        return butil::Status::OK();
+    }
+    std::vector<scoped_refptr<NodeImpl> > nodes;
+    nm->get_nodes_by_group_id(group_id, &nodes);
+    if (nodes.empty()) {
+        return butil::Status(ENOENT, "Fail to find node in group %s",
+                                     group_id.c_str());
+    }
+    if (nodes.size() > 1) {
+        return butil::Status(EINVAL, "peer must be specified "
+                                    "since there're %lu nodes in group %s",
+                                     nodes.size(), group_id.c_str());
+    }
+    *node = nodes.front();
+    return butil::Status::OK();
+}
+
+}  // namespace braft
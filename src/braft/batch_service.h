@@ -0,0 +1,98 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRAFT_BATCH_SERVICE_H
+#define  BRAFT_BATCH_SERVICE_H
+
+#include <vector>
+#include <butil/iobuf.h>
+#include <brpc/controller.h>
+#include "braft/batch.pb.h"              // BatchService
+#include "braft/node.h"                  // NodeImpl
+
+namespace braft {
+
+// Encode |ops| into the data of one log entry, which could be read by
+// BatchReader
+void encode_batch(const std::vector<butil::IOBuf>& ops, butil::IOBuf* data);
+
+// Reads the operations of a batch from the data of a log entry applied by
+// BatchServiceImpl, e.g. in StateMachine::on_apply:
+//
+//   BatchReader reader;
+//   if (reader.init(iter.data()) == 0) {
+//       butil::IOBuf op;
+//       while (reader.next(&op)) { ... }
+//   }
+class BatchReader {
+public:
+    BatchReader() : _index(0) {}
+
+    // Returns 0 on success, -1 if |data| is not an encoded batch
+    int init(const butil::IOBuf& data);
+
+    // Number of the operations in the batch
+    size_t size() const { return _sizes.size(); }
+
+    // Cut the next operation into |op|. Returns false if all the operations
+    // have been read
+    bool next(butil::IOBuf* op);
+
+private:
+    std::vector<uint32_t> _sizes;
+    size_t _index;
+    butil::IOBuf _ops;
+};
+
+// The done of the task applied by BatchServiceImpl. StateMachine::on_apply
+// on the leader adds one result for each operation in order and the results
+// are sent back in BatchResponse when the done is run.
+class BatchClosure : public Closure {
+public:
+    void add_result(const butil::IOBuf& result);
+    void Run();
+
+private:
+friend class BatchServiceImpl;
+    BatchClosure(brpc::Controller* cntl, BatchResponse* response,
+                 google::protobuf::Closure* done,
+                 const scoped_refptr<NodeImpl>& node)
+        : _cntl(cntl), _response(response), _done(done), _node(node) {}
+    ~BatchClosure() {}
+
+    brpc::Controller* _cntl;
+    BatchResponse* _response;
+    google::protobuf::Closure* _done;
+    scoped_refptr<NodeImpl> _node;
+    butil::IOBuf _results;
+};
+
+// Applies each BatchRequest sent by BatchClient as one task of the node of
+// the group on this server. Add it to the server of the nodes to use
+// BatchClient.
+class BatchServiceImpl : public BatchService {
+public:
+    void batch(::google::protobuf::RpcController* controller,
+               const ::braft::BatchRequest* request,
+               ::braft::BatchResponse* response,
+               ::google::protobuf::Closure* done);
+private:
+    butil::Status get_node(scoped_refptr<NodeImpl>* node,
+                           const GroupId& group_id,
+                           const std::string& peer_id);
+};
+
+}  // namespace braft
+
+#endif  //BRAFT_BATCH_SERVICE_H
@@ -17,6 +17,10 @@
 
 #include "braft/builtin_service_impl.h"
 
+#include <algorithm>
+#include <functional>
+#include <inttypes.h>
+#include <butil/string_printf.h>
 #include <brpc/controller.h>
 #include <brpc/closure_guard.h>
 #include <brpc/http_status_code.h>
@@ -24,6 +28,7 @@
 #include "braft/node.h"
 #include "braft/replicator.h"
 #include "braft/node_manager.h"
+#include "braft/util.h"
 
 namespace braft {
 
@@ -90,4 +95,222 @@ void RaftStatImpl::default_method(::google::protobuf::RpcController* controller,
     os.move_to(cntl->response_attachment());
 }
 
+void RaftLockStatImpl::GetTabInfo(brpc::TabInfoList* info_list) const {
+    brpc::TabInfo* info = info_list->add();
+    info->tab_name = "raft_locks";
+    info->path = "/raft_lock_stat";
+}
+
+void RaftLockStatImpl::default_method(
+                              ::google::protobuf::RpcController* controller,
+                              const ::braft::IndexRequest* /*request*/,
+                              ::braft::IndexResponse* /*response*/,
+                              ::google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    brpc::Controller* cntl = (brpc::Controller*)controller;
+    const bool html = brpc::UseHTML(cntl->http_request());
+    if (html) {
+        cntl->http_response().set_content_type("text/html");
+    } else {
+        cntl->http_response().set_content_type("text/plain");
+    }
+    butil::IOBufBuilder os;
+    if (html) {
+        os << "<!DOCTYPE html><html><head>\n"
+           << "<script language=\"javascript\" type=\"text/javascript\" src=\"/js/jquery_min\"></script>\n"
+           << brpc::TabsHead() << "</head><body>";
+        cntl->server()->PrintTabsBody(os, "raft_locks");
+        os << "<pre>";
+    }
+    if (!FLAGS_raft_profile_locks) {
+        os << "raft_profile_locks is off, turn it on at /flags/raft_profile_locks"
+              "?setvalue=true\n";
+    }
+    std::vector<LockSite*> sites;
+    LockSite::list_sites(&sites);
+    // Order the sites by the microseconds spent waiting for them per second,
+    // see /hotspots/contention for the call stacks of the contention
+    std::vector<std::pair<int64_t, LockSite*> > ordered;
+    ordered.reserve(sites.size());
+    for (size_t i = 0; i < sites.size(); ++i) {
+        bvar::LatencyRecorder& wait = sites[i]->wait();
+        ordered.push_back(std::make_pair(wait.qps() * wait.latency(), sites[i]));
+    }
+    std::sort(ordered.begin(), ordered.end(),
+              std::greater<std::pair<int64_t, LockSite*> >());
+    os << "site                wait_us/s  locks/s    avg_wait  p99_wait  "
+          "max_wait  avg_hold  p99_hold  max_hold\n";
+    for (size_t i = 0; i < ordered.size(); ++i) {
+        LockSite* site = ordered[i].second;
+        bvar::LatencyRecorder& wait = site->wait();
+        bvar::LatencyRecorder& hold = site->hold();
+        os << butil::string_printf(
+                "%-18s  %-9" PRId64 "  %-9" PRId64 "  %-8" PRId64 "  %-8" PRId64
+                "  %-8" PRId64 "  %-8" PRId64 "  %-8" PRId64 "  %-8" PRId64 "\n",
+                site->name().c_str(), ordered[i].first,
+                wait.qps(), wait.latency(), wait.latency_percentile(0.99),
+                wait.max_latency(), hold.latency(),
+                hold.latency_percentile(0.99), hold.max_latency());
+    }
+    if (html) {
+        os << "</pre></body></html>";
+    }
+    os.move_to(cntl->response_attachment());
+}
+
+static bool node_less(const scoped_refptr<NodeImpl>& lhs,
+                      const scoped_refptr<NodeImpl>& rhs) {
+    return lhs->node_id() < rhs->node_id();
+}
+
+static void fill_peer_metrics(const NodeStatus::PeerStatusMap& peers,
+                              bool stable, NodeMetrics* node) {
+    for (NodeStatus::PeerStatusMap::const_iterator
+            it = peers.begin(); it != peers.end(); ++it) {
+        PeerMetrics* peer = node->add_peers();
+        peer->set_peer_id(it->first.to_string());
+        peer->set_next_index(it->second.next_index);
+        peer->set_lag(it->second.lag);
+        peer->set_installing_snapshot(it->second.installing_snapshot);
+        peer->set_consecutive_error_times(it->second.consecutive_error_times);
+        peer->set_since_last_success_ms(it->second.since_last_success_ms);
+        peer->set_stable(stable);
+    }
+}
+
+static void fill_node_metrics(NodeImpl* node, NodeMetrics* metrics) {
+    NodeStatus status;
+    node->get_status(&status);
+    metrics->set_group_id(node->node_id().group_id);
+    metrics->set_peer_id(status.peer_id.to_string());
+    metrics->set_state(state2str(status.state));
+    metrics->set_term(status.term);
+    if (!status.leader_id.is_empty()) {
+        metrics->set_leader_id(status.leader_id.to_string());
+    }
+    metrics->set_committed_index(status.committed_index);
+    metrics->set_applied_index(status.known_applied_index);
+    metrics->set_first_index(status.first_index);
+    metrics->set_last_index(status.last_index);
+    metrics->set_disk_index(status.disk_index);
+    metrics->set_durable_index(status.durable_index);
+    metrics->set_pending_queue_size(status.pending_queue_size);
+    metrics->set_logs_in_memory_bytes(status.logs_in_memory_bytes);
+    metrics->set_snapshot_index(status.snapshot_index);
+    metrics->set_saving_snapshot(status.saving_snapshot);
+    metrics->set_installing_snapshot(status.installing_snapshot);
+    fill_peer_metrics(status.stable_followers, true, metrics);
+    fill_peer_metrics(status.unstable_followers, false, metrics);
+}
+
+static void print_prometheus(const RaftMetricsResponse& response,
+                             butil::IOBufBuilder& os) {
+    for (int i = 0; i < response.nodes_size(); ++i) {
+        const NodeMetrics& n = response.nodes(i);
+        const std::string labels = butil::string_printf(
+                "group=\"%s\",peer=\"%s\"",
+                n.group_id().c_str(), n.peer_id().c_str());
+        os << "braft_node_state{" << labels << ",state=\"" << n.state()
+           << "\"} 1\n"
+           << "braft_node_term{" << labels << "} " << n.term() << '\n'
+           << "braft_node_committed_index{" << labels << "} "
+           << n.committed_index() << '\n'
+           << "braft_node_applied_index{" << labels << "} "
+           << n.applied_index() << '\n'
+           << "braft_node_first_index{" << labels << "} "
+           << n.first_index() << '\n'
+           << "braft_node_last_index{" << labels << "} "
+           << n.last_index() << '\n'
+           << "braft_node_disk_index{" << labels << "} "
+           << n.disk_index() << '\n'
+           << "braft_node_durable_index{" << labels << "} "
+           << n.durable_index() << '\n'
+           << "braft_node_pending_queue_size{" << labels << "} "
+           << n.pending_queue_size() << '\n'
+           << "braft_node_logs_in_memory_bytes{" << labels << "} "
+           << n.logs_in_memory_bytes() << '\n'
+           << "braft_node_snapshot_index{" << labels << "} "
+           << n.snapshot_index() << '\n'
+           << "braft_node_saving_snapshot{" << labels << "} "
+           << n.saving_snapshot() << '\n'
+           << "braft_node_installing_snapshot{" << labels << "} "
+           << n.installing_snapshot() << '\n';
+        for (int j = 0; j < n.peers_size(); ++j) {
+            const PeerMetrics& p = n.peers(j);
+            const std::string peer_labels = labels + butil::string_printf(
+                    ",follower=\"%s\"", p.peer_id().c_str());
+            os << "braft_follower_lag{" << peer_labels << "} "
+               << p.lag() << '\n'
+               << "braft_follower_next_index{" << peer_labels << "} "
+               << p.next_index() << '\n'
+               << "braft_follower_installing_snapshot{" << peer_labels << "} "
+               << p.installing_snapshot() << '\n'
+               << "braft_follower_consecutive_error_times{" << peer_labels
+               << "} " << p.consecutive_error_times() << '\n';
+        }
+    }
+}
+
+void RaftMetricsImpl::default_method(
+        ::google::protobuf::RpcController* controller,
+        const ::braft::RaftMetricsRequest* request,
+        ::braft::RaftMetricsResponse* response,
+        ::google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    brpc::Controller* cntl = (brpc::Controller*)controller;
+    std::string group_prefix = request->group_prefix();
+    int64_t offset = request->offset();
+    int64_t limit = request->has_limit() ? request->limit() : -1;
+    bool prometheus = false;
+    if (cntl->request_protocol() == brpc::PROTOCOL_HTTP) {
+        const brpc::URI& uri = cntl->http_request().uri();
+        const std::string* value = uri.GetQuery("group_prefix");
+        if (value) {
+            group_prefix = *value;
+        }
+        if ((value = uri.GetQuery("offset")) != NULL) {
+            offset = strtoll(value->c_str(), NULL, 10);
+        }
+        if ((value = uri.GetQuery("limit")) != NULL) {
+            limit = strtoll(value->c_str(), NULL, 10);
+        }
+        value = uri.GetQuery("format");
+        prometheus = (value && *value == "prometheus");
+    }
+    if (offset < 0) {
+        offset = 0;
+    }
+
+    // Only the nodes of the page are asked for their status, each of which
+    // takes the mutex of the node briefly
+    std::vector<scoped_refptr<NodeImpl> > nodes;
+    NodeManager::GetInstance()->get_all_nodes(&nodes);
+    std::vector<scoped_refptr<NodeImpl> > matched;
+    matched.reserve(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const GroupId group_id = nodes[i]->node_id().group_id;
+        if (group_id.compare(0, group_prefix.size(), group_prefix) == 0) {
+            matched.push_back(nodes[i]);
+        }
+    }
+    std::sort(matched.begin(), matched.end(), node_less);
+    response->set_total(matched.size());
+    int64_t end = matched.size();
+    if (limit >= 0 && offset + limit < end) {
+        end = offset + limit;
+        response->set_next_offset(end);
+    }
+    for (int64_t i = offset; i < end; ++i) {
+        fill_node_metrics(matched[i].get(), response->add_nodes());
+    }
+
+    if (prometheus) {
+        butil::IOBufBuilder os;
+        print_prometheus(*response, os);
+        response->Clear();
+        cntl->http_response().set_content_type("text/plain; version=0.0.4");
+        os.move_to(cntl->response_attachment());
+    }
+}
+
 }  //  namespace braft
@@ -33,6 +33,24 @@ public:
     void GetTabInfo(brpc::TabInfoList*) const;
 };
 
+class RaftLockStatImpl : public raft_lock_stat, public brpc::Tabbed {
+public:
+    void default_method(::google::protobuf::RpcController* controller,
+                        const ::braft::IndexRequest* request,
+                        ::braft::IndexResponse* response,
+                        ::google::protobuf::Closure* done);
+
+    void GetTabInfo(brpc::TabInfoList*) const;
+};
+
+class RaftMetricsImpl : public raft_metrics {
+public:
+    void default_method(::google::protobuf::RpcController* controller,
+                        const ::braft::RaftMetricsRequest* request,
+                        ::braft::RaftMetricsResponse* response,
+                        ::google::protobuf::Closure* done);
+};
+
 }  //  namespace braft
 
 #endif  //BRAFT_BUILTIN_SERVICE_IMPL_H
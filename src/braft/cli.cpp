@@ -240,6 +240,88 @@ butil::Status change_peers(const GroupId& group_id, const Configuration& conf,
     return butil::Status::OK();
 }
 
+butil::Status add_learners(const GroupId& group_id, const Configuration& conf,
+                           const std::vector<PeerId>& learners,
+                           const CliOptions& options) {
+    PeerId leader_id;
+    butil::Status st = get_leader(group_id, conf, &leader_id);
+    BRAFT_RETURN_IF(!st.ok(), st);
+    brpc::Channel channel;
+    if (channel.Init(leader_id.addr, NULL) != 0) {
+        return butil::Status(-1, "Fail to init channel to %s",
+                                leader_id.to_string().c_str());
+    }
+    AddLearnersRequest request;
+    request.set_group_id(group_id);
+    request.set_leader_id(leader_id.to_string());
+    for (size_t i = 0; i < learners.size(); ++i) {
+        request.add_learners(learners[i].to_string());
+    }
+    LearnersOpResponse response;
+    brpc::Controller cntl;
+    cntl.set_timeout_ms(options.timeout_ms);
+    cntl.set_max_retry(options.max_retry);
+
+    CliService_Stub stub(&channel);
+    stub.add_learners(&cntl, &request, &response, NULL);
+    if (cntl.Failed()) {
+        return butil::Status(cntl.ErrorCode(), cntl.ErrorText());
+    }
+    Configuration old_learners;
+    for (int i = 0; i < response.old_learners_size(); ++i) {
+        old_learners.add_peer(response.old_learners(i));
+    }
+    Configuration new_learners;
+    for (int i = 0; i < response.new_learners_size(); ++i) {
+        new_learners.add_peer(response.new_learners(i));
+    }
+    LOG(INFO) << "Learners of replication group `" << group_id
+              << "' changed from " << old_learners
+              << " to " << new_learners;
+    return butil::Status::OK();
+}
+
+butil::Status remove_learners(const GroupId& group_id, const Configuration& conf,
+                              const std::vector<PeerId>& learners,
+                              const CliOptions& options) {
+    PeerId leader_id;
+    butil::Status st = get_leader(group_id, conf, &leader_id);
+    BRAFT_RETURN_IF(!st.ok(), st);
+    brpc::Channel channel;
+    if (channel.Init(leader_id.addr, NULL) != 0) {
+        return butil::Status(-1, "Fail to init channel to %s",
+                                leader_id.to_string().c_str());
+    }
+    RemoveLearnersRequest request;
+    request.set_group_id(group_id);
+    request.set_leader_id(leader_id.to_string());
+    for (size_t i = 0; i < learners.size(); ++i) {
+        request.add_learners(learners[i].to_string());
+    }
+    LearnersOpResponse response;
+    brpc::Controller cntl;
+    cntl.set_timeout_ms(options.timeout_ms);
+    cntl.set_max_retry(options.max_retry);
+
+    CliService_Stub stub(&channel);
+    stub.remove_learners(&cntl, &request, &response, NULL);
+    if (cntl.Failed()) {
+        return butil::Status(cntl.ErrorCode(), cntl.ErrorText());
+    }
+    Configuration old_learners;
+    for (int i = 0; i < response.old_learners_size(); ++i) {
+        old_learners.add_peer(response.old_learners(i));
+    }
+    Configuration new_learners;
+    for (int i = 0; i < response.new_learners_size(); ++i) {
+        new_learners.add_peer(response.new_learners(i));
+    }
+    LOG(INFO) << "Learners of replication group `" << group_id
+              << "' changed from " << old_learners
+              << " to " << new_learners;
+    return butil::Status::OK();
+}
+
 butil::Status transfer_leader(const GroupId& group_id, const Configuration& conf,
                               const PeerId& peer, const CliOptions& options) {
     PeerId leader_id;
@@ -43,6 +43,18 @@ butil::Status change_peers(const GroupId& group_id, const Configuration& conf,
                            const Configuration& new_peers,
                            const CliOptions& options);
 
+// Add non-voting learners into the replicating group which consists of
+// |conf|. Returns OK on success, error information otherwise.
+butil::Status add_learners(const GroupId& group_id, const Configuration& conf,
+                           const std::vector<PeerId>& learners,
+                           const CliOptions& options);
+
+// Remove learners from the replicating group which consists of |conf|.
+// Returns OK on success, error information otherwise.
+butil::Status remove_learners(const GroupId& group_id, const Configuration& conf,
+                              const std::vector<PeerId>& learners,
+                              const CliOptions& options);
+
 // Transfer the leader of the replication group to the target peer
 butil::Status transfer_leader(const GroupId& group_id, const Configuration& conf,
                               const PeerId& peer, const CliOptions& options);
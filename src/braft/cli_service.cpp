@@ -229,6 +229,33 @@ void CliServiceImpl::get_leader(::google::protobuf::RpcController* controller,
     cntl->SetFailed(EAGAIN, "Unknown leader");
 }
 
+void CliServiceImpl::get_leaders(::google::protobuf::RpcController* controller,
+                                 const ::braft::GetLeadersRequest* request,
+                                 ::braft::GetLeadersResponse* response,
+                                 ::google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    NodeManager* const nm = NodeManager::GetInstance();
+    std::vector<scoped_refptr<NodeImpl> > nodes;
+    for (int i = 0; i < request->group_ids_size(); ++i) {
+        PeerId leader_id;
+        bool self_reported = false;
+        nm->get_nodes_by_group_id(request->group_ids(i), &nodes);
+        for (size_t j = 0; j < nodes.size(); ++j) {
+            if (nodes[j]->is_leader()) {
+                leader_id = nodes[j]->node_id().peer_id;
+                self_reported = true;
+                break;
+            }
+            if (leader_id.is_empty()) {
+                leader_id = nodes[j]->leader_id();
+            }
+        }
+        response->add_leader_ids(leader_id.is_empty()
+                                        ? std::string() : leader_id.to_string());
+        response->add_self_reported(self_reported);
+    }
+}
+
 butil::Status CliServiceImpl::get_node(scoped_refptr<NodeImpl>* node,
                                       const GroupId& group_id,
                                       const std::string& peer_id) {
@@ -346,4 +373,105 @@ void CliServiceImpl::transfer_leader(
     }
 }
 
+static void learners_op_returned(brpc::Controller* cntl,
+                          LearnersOpResponse* response,
+                          std::vector<PeerId> old_learners,
+                          Configuration new_learners,
+                          scoped_refptr<NodeImpl> /*node*/,
+                          ::google::protobuf::Closure* done,
+                          const butil::Status& st) {
+    brpc::ClosureGuard done_guard(done);
+    if (!st.ok()) {
+        cntl->SetFailed(st.error_code(), "%s", st.error_cstr());
+        return;
+    }
+    for (size_t i = 0; i < old_learners.size(); ++i) {
+        response->add_old_learners(old_learners[i].to_string());
+    }
+    for (Configuration::const_iterator
+            iter = new_learners.begin(); iter != new_learners.end(); ++iter) {
+        response->add_new_learners(iter->to_string());
+    }
+}
+
+void CliServiceImpl::add_learners(::google::protobuf::RpcController* controller,
+                                  const ::braft::AddLearnersRequest* request,
+                                  ::braft::LearnersOpResponse* response,
+                                  ::google::protobuf::Closure* done) {
+    brpc::Controller* cntl = (brpc::Controller*)controller;
+    brpc::ClosureGuard done_guard(done);
+    scoped_refptr<NodeImpl> node;
+    butil::Status st = get_node(&node, request->group_id(), request->leader_id());
+    if (!st.ok()) {
+        cntl->SetFailed(st.error_code(), "%s", st.error_cstr());
+        return;
+    }
+    std::vector<PeerId> old_learners;
+    st = node->list_learners(&old_learners);
+    if (!st.ok()) {
+        cntl->SetFailed(st.error_code(), "%s", st.error_cstr());
+        return;
+    }
+    std::vector<PeerId> learners;
+    Configuration new_learners(old_learners);
+    for (int i = 0; i < request->learners_size(); ++i) {
+        PeerId peer;
+        if (peer.parse(request->learners(i)) != 0) {
+            cntl->SetFailed(EINVAL, "Fail to parse %s",
+                                    request->learners(i).c_str());
+            return;
+        }
+        learners.push_back(peer);
+        new_learners.add_peer(peer);
+    }
+    LOG(WARNING) << "Receive AddLearnersRequest to " << node->node_id()
+                 << " from " << cntl->remote_side()
+                 << ", adding " << Configuration(learners);
+    Closure* add_learners_done = NewCallback(
+            learners_op_returned,
+            cntl, response, old_learners, new_learners, node,
+            done_guard.release());
+    return node->add_learners(learners, add_learners_done);
+}
+
+void CliServiceImpl::remove_learners(::google::protobuf::RpcController* controller,
+                                     const ::braft::RemoveLearnersRequest* request,
+                                     ::braft::LearnersOpResponse* response,
+                                     ::google::protobuf::Closure* done) {
+    brpc::Controller* cntl = (brpc::Controller*)controller;
+    brpc::ClosureGuard done_guard(done);
+    scoped_refptr<NodeImpl> node;
+    butil::Status st = get_node(&node, request->group_id(), request->leader_id());
+    if (!st.ok()) {
+        cntl->SetFailed(st.error_code(), "%s", st.error_cstr());
+        return;
+    }
+    std::vector<PeerId> old_learners;
+    st = node->list_learners(&old_learners);
+    if (!st.ok()) {
+        cntl->SetFailed(st.error_code(), "%s", st.error_cstr());
+        return;
+    }
+    std::vector<PeerId> learners;
+    Configuration new_learners(old_learners);
+    for (int i = 0; i < request->learners_size(); ++i) {
+        PeerId peer;
+        if (peer.parse(request->learners(i)) != 0) {
+            cntl->SetFailed(EINVAL, "Fail to parse %s",
+                                    request->learners(i).c_str());
+            return;
+        }
+        learners.push_back(peer);
+        new_learners.remove_peer(peer);
+    }
+    LOG(WARNING) << "Receive RemoveLearnersRequest to " << node->node_id()
+                 << " from " << cntl->remote_side()
+                 << ", removing " << Configuration(learners);
+    Closure* remove_learners_done = NewCallback(
+            learners_op_returned,
+            cntl, response, old_learners, new_learners, node,
+            done_guard.release());
+    return node->remove_learners(learners, remove_learners_done);
+}
+
 }  //  namespace braft
@@ -45,6 +45,10 @@ public:
                     const ::braft::GetLeaderRequest* request,
                     ::braft::GetLeaderResponse* response,
                     ::google::protobuf::Closure* done);
+    void get_leaders(::google::protobuf::RpcController* controller,
+                     const ::braft::GetLeadersRequest* request,
+                     ::braft::GetLeadersResponse* response,
+                     ::google::protobuf::Closure* done);
     void change_peers(::google::protobuf::RpcController* controller,
                       const ::braft::ChangePeersRequest* request,
                       ::braft::ChangePeersResponse* response,
@@ -53,6 +57,14 @@ public:
                          const ::braft::TransferLeaderRequest* request,
                          ::braft::TransferLeaderResponse* response,
                          ::google::protobuf::Closure* done);
+    void add_learners(::google::protobuf::RpcController* controller,
+                      const ::braft::AddLearnersRequest* request,
+                      ::braft::LearnersOpResponse* response,
+                      ::google::protobuf::Closure* done);
+    void remove_learners(::google::protobuf::RpcController* controller,
+                         const ::braft::RemoveLearnersRequest* request,
+                         ::braft::LearnersOpResponse* response,
+                         ::google::protobuf::Closure* done);
 private:
     butil::Status get_node(scoped_refptr<NodeImpl>* node,
                           const GroupId& group_id,
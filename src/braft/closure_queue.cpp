@@ -14,6 +14,7 @@
 
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
+#include <algorithm>
 #include <bthread/unstable.h>
 #include "braft/closure_queue.h"
 #include "braft/raft.h"
@@ -22,6 +23,9 @@ namespace braft {
 
 ClosureQueue::ClosureQueue(bool usercode_in_pthread) 
     : _first_index(0)
+    , _ring(64, NULL)
+    , _head(0)
+    , _size(0)
     , _usercode_in_pthread(usercode_in_pthread)
 {}
 
@@ -30,56 +34,74 @@ ClosureQueue::~ClosureQueue() {
 }
 
 void ClosureQueue::clear() {
-    std::deque<Closure*> saved_queue;
+    std::vector<Closure*> saved;
     {
         BAIDU_SCOPED_LOCK(_mutex);
-        saved_queue.swap(_queue);
-        _first_index = 0;
-    }
-    bool run_bthread = false;
-    for (std::deque<Closure*>::iterator 
-            it = saved_queue.begin(); it != saved_queue.end(); ++it) {
-        if (*it) {
-            (*it)->status().set_error(EPERM, "leader stepped down");
-            run_closure_in_bthread_nosig(*it, _usercode_in_pthread);
-            run_bthread = true;
+        saved.reserve(_size);
+        for (size_t i = 0; i < _size; ++i) {
+            Closure*& c = _ring[(_head + i) & (_ring.size() - 1)];
+            if (c) {
+                saved.push_back(c);
+                c = NULL;
+            }
         }
+        _head = 0;
+        _size = 0;
+        _first_index = 0;
     }
-    if (run_bthread) {
-        bthread_flush();
+    for (size_t i = 0; i < saved.size(); ++i) {
+        saved[i]->status().set_error(EPERM, "leader stepped down");
     }
+    // One bthread for all of them
+    run_closures_in_bthread(&saved, _usercode_in_pthread);
 }
 
 void ClosureQueue::reset_first_index(int64_t first_index) {
     BAIDU_SCOPED_LOCK(_mutex);
-    CHECK(_queue.empty());
+    CHECK_EQ(0u, _size);
     _first_index = first_index;
 }
 
+void ClosureQueue::grow() {
+    std::vector<Closure*> ring(_ring.size() * 2, NULL);
+    for (size_t i = 0; i < _size; ++i) {
+        ring[i] = _ring[(_head + i) & (_ring.size() - 1)];
+    }
+    _ring.swap(ring);
+    _head = 0;
+}
+
 void ClosureQueue::append_pending_closure(Closure* c) {
     BAIDU_SCOPED_LOCK(_mutex);
-    _queue.push_back(c);
+    if (_size == _ring.size()) {
+        grow();
+    }
+    _ring[(_head + _size) & (_ring.size() - 1)] = c;
+    ++_size;
 }
 
 int ClosureQueue::pop_closure_until(int64_t index,
                                     std::vector<Closure*> *out, int64_t *out_first_index) {
     out->clear();
     BAIDU_SCOPED_LOCK(_mutex);
-    if (_queue.empty() || index < _first_index) {
+    if (_size == 0 || index < _first_index) {
         *out_first_index = index + 1;
         return 0;
     }
-    if (index > _first_index + (int64_t)_queue.size() - 1) {
+    if (index > _first_index + (int64_t)_size - 1) {
         CHECK(false) << "Invalid index=" << index
                      << " _first_index=" << _first_index
-                     << " _closure_queue_size=" << _queue.size();
+                     << " _closure_queue_size=" << _size;
         return -1;
     }
     *out_first_index = _first_index;
-    for (int64_t i = _first_index; i <= index; ++i) {
-        out->push_back(_queue.front());
-        _queue.pop_front();
-    }
+    const size_t n = index - _first_index + 1;
+    // At most two ranges as the closures might wrap around the end
+    const size_t first_part = std::min(n, _ring.size() - _head);
+    out->assign(_ring.begin() + _head, _ring.begin() + _head + first_part);
+    out->insert(out->end(), _ring.begin(), _ring.begin() + (n - first_part));
+    _head = (_head + n) & (_ring.size() - 1);
+    _size -= n;
     _first_index = index + 1;
     return 0;
 }
@@ -45,10 +45,21 @@ public:
     int pop_closure_until(int64_t index, 
                           std::vector<Closure*> *out, int64_t *out_first_index);
 private:
-    // TODO: a spsc lock-free queue would help
+    // Grow the ring to twice of the capacity, must be called with _mutex held
+    void grow();
+
+    // The closures are kept in a ring buffer of which the capacity is a power
+    // of 2, so that appending is a store and popping is at most two ranges of
+    // copies without any allocation in the steady state. The critical
+    // sections are short enough for the leader appending with the mutex of
+    // the node and the FSMCaller popping, and clear() and
+    // reset_first_index(), called on leader change, are serialized with
+    // them by _mutex as well.
     raft_mutex_t                                    _mutex;
     int64_t                                         _first_index;
-    std::deque<Closure*>                            _queue;
+    std::vector<Closure*>                           _ring;
+    size_t                                          _head;
+    size_t                                          _size;
     bool                                            _usercode_in_pthread;
 
 };
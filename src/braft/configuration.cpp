@@ -33,6 +33,20 @@ std::ostream& operator<<(std::ostream& os, const Configuration& a) {
     return os;
 }
 
+std::set<PeerId>* Configuration::mutable_peers() {
+    if (!_peers) {
+        _peers.reset(new std::set<PeerId>);
+    } else if (_peers.use_count() > 1) {
+        _peers.reset(new std::set<PeerId>(*_peers));
+    }
+    return _peers.get();
+}
+
+const std::set<PeerId>& Configuration::empty_peers() {
+    static const std::set<PeerId>* s_empty_peers = new std::set<PeerId>;
+    return *s_empty_peers;
+}
+
 int Configuration::parse_from(butil::StringPiece conf) {
     reset();
     std::string peer_str;
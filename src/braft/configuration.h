@@ -24,6 +24,7 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <memory>
 #include <butil/strings/string_piece.h>
 #include <butil/endpoint.h>
 #include <butil/logging.h>
@@ -33,23 +34,38 @@ namespace braft {
 typedef std::string GroupId;
 
 // Represent a participant in a replicating group.
+// A peer is identified by addr and idx, while role tells how it participates,
+// "ip:port:idx:1" stands for a witness.
 struct PeerId {
+    enum Role {
+        REPLICA = 0,
+        // Persists the log entries without data and runs no state machine
+        WITNESS = 1,
+    };
+
     butil::EndPoint addr; // ip+port.
     int idx; // idx in same addr, default 0
-
-    PeerId() : idx(0) {}
-    explicit PeerId(butil::EndPoint addr_) : addr(addr_), idx(0) {}
-    PeerId(butil::EndPoint addr_, int idx_) : addr(addr_), idx(idx_) {}
+    Role role;
+
+    PeerId() : idx(0), role(REPLICA) {}
+    explicit PeerId(butil::EndPoint addr_) : addr(addr_), idx(0), role(REPLICA) {}
+    PeerId(butil::EndPoint addr_, int idx_)
+        : addr(addr_), idx(idx_), role(REPLICA) {}
+    PeerId(butil::EndPoint addr_, int idx_, bool witness)
+        : addr(addr_), idx(idx_), role(witness ? WITNESS : REPLICA) {}
     /*intended implicit*/PeerId(const std::string& str) 
     { CHECK_EQ(0, parse(str)); }
-    PeerId(const PeerId& id) : addr(id.addr), idx(id.idx) {}
+    PeerId(const PeerId& id) : addr(id.addr), idx(id.idx), role(id.role) {}
 
     void reset() {
         addr.ip = butil::IP_ANY;
         addr.port = 0;
         idx = 0;
+        role = REPLICA;
     }
 
+    bool is_witness() const { return role == WITNESS; }
+
     bool is_empty() const {
         return (addr.ip == butil::IP_ANY && addr.port == 0 && idx == 0);
     }
@@ -57,10 +73,17 @@ struct PeerId {
     int parse(const std::string& str) {
         reset();
         char ip_str[64];
-        if (2 > sscanf(str.c_str(), "%[^:]%*[:]%d%*[:]%d", ip_str, &addr.port, &idx)) {
+        int role_value = REPLICA;
+        if (2 > sscanf(str.c_str(), "%[^:]%*[:]%d%*[:]%d%*[:]%d", ip_str,
+                       &addr.port, &idx, &role_value)) {
             reset();
             return -1;
         }
+        if (role_value != REPLICA && role_value != WITNESS) {
+            reset();
+            return -1;
+        }
+        role = (Role)role_value;
         if (0 != butil::str2ip(ip_str, &addr.ip)) {
             reset();
             return -1;
@@ -70,11 +93,17 @@ struct PeerId {
 
     std::string to_string() const {
         char str[128];
-        snprintf(str, sizeof(str), "%s:%d", butil::endpoint2str(addr).c_str(), idx);
+        if (is_witness()) {
+            snprintf(str, sizeof(str), "%s:%d:%d", butil::endpoint2str(addr).c_str(),
+                     idx, (int)role);
+        } else {
+            snprintf(str, sizeof(str), "%s:%d", butil::endpoint2str(addr).c_str(), idx);
+        }
         return std::string(str);
     }
 };
 
+// Role is not a part of the identity of a peer
 inline bool operator<(const PeerId& id1, const PeerId& id2) {
     if (id1.addr < id2.addr) {
         return true;
@@ -92,7 +121,11 @@ inline bool operator!=(const PeerId& id1, const PeerId& id2) {
 }
 
 inline std::ostream& operator << (std::ostream& os, const PeerId& id) {
-    return os << id.addr << ':' << id.idx;
+    os << id.addr << ':' << id.idx;
+    if (id.is_witness()) {
+        os << ':' << (int)id.role;
+    }
+    return os;
 }
 
 struct NodeId {
@@ -133,6 +166,10 @@ inline std::string NodeId::to_string() const {
 }
 
 // A set of peers.
+// The peers are immutable once shared: copying a Configuration only takes a
+// reference, and the modification of a shared one copies the peers first. So
+// the configurations kept by the log entries, ConfigurationManager and the
+// node are cheap to copy around.
 class Configuration {
 public:
     typedef std::set<PeerId>::const_iterator const_iterator;
@@ -141,75 +178,80 @@ public:
 
     // Construct from peers stored in std::vector.
     explicit Configuration(const std::vector<PeerId>& peers) {
-        for (size_t i = 0; i < peers.size(); i++) {
-            _peers.insert(peers[i]);
-        }
+        *this = peers;
     }
 
     // Construct from peers stored in std::set
-    explicit Configuration(const std::set<PeerId>& peers) : _peers(peers) {}
+    explicit Configuration(const std::set<PeerId>& peers)
+        : _peers(peers.empty() ? NULL : new std::set<PeerId>(peers)) {}
 
     // Assign from peers stored in std::vector
     void operator=(const std::vector<PeerId>& peers) {
-        _peers.clear();
-        for (size_t i = 0; i < peers.size(); i++) {
-            _peers.insert(peers[i]);
+        if (peers.empty()) {
+            _peers.reset();
+            return;
         }
+        _peers.reset(new std::set<PeerId>(peers.begin(), peers.end()));
     }
 
     // Assign from peers stored in std::set
     void operator=(const std::set<PeerId>& peers) {
-        _peers = peers;
+        _peers.reset(peers.empty() ? NULL : new std::set<PeerId>(peers));
     }
 
     // Remove all peers.
-    void reset() { _peers.clear(); }
+    void reset() { _peers.reset(); }
 
-    bool empty() const { return _peers.empty(); }
-    size_t size() const { return _peers.size(); }
+    bool empty() const { return peers().empty(); }
+    size_t size() const { return peers().size(); }
 
-    const_iterator begin() const { return _peers.begin(); }
-    const_iterator end() const { return _peers.end(); }
+    const_iterator begin() const { return peers().begin(); }
+    const_iterator end() const { return peers().end(); }
 
     // Clear the container and put peers in. 
     void list_peers(std::set<PeerId>* peers) const {
         peers->clear();
-        *peers = _peers;
+        *peers = this->peers();
     }
     void list_peers(std::vector<PeerId>* peers) const {
         peers->clear();
-        peers->reserve(_peers.size());
-        std::set<PeerId>::iterator it;
-        for (it = _peers.begin(); it != _peers.end(); ++it) {
+        peers->reserve(size());
+        for (const_iterator it = begin(); it != end(); ++it) {
             peers->push_back(*it);
         }
     }
 
     void append_peers(std::set<PeerId>* peers) {
-        peers->insert(_peers.begin(), _peers.end());
+        peers->insert(begin(), end());
     }
 
     // Add a peer.
     // Returns true if the peer is newly added.
     bool add_peer(const PeerId& peer) {
-        return _peers.insert(peer).second;
+        if (contains(peer)) {
+            return false;
+        }
+        return mutable_peers()->insert(peer).second;
     }
 
     // Remove a peer.
     // Returns true if the peer is removed.
     bool remove_peer(const PeerId& peer) {
-        return _peers.erase(peer);
+        if (!contains(peer)) {
+            return false;
+        }
+        return mutable_peers()->erase(peer);
     }
 
     // True if the peer exists.
     bool contains(const PeerId& peer_id) const {
-        return _peers.find(peer_id) != _peers.end();
+        return peers().find(peer_id) != end();
     }
 
     // True if ALL peers exist.
     bool contains(const std::vector<PeerId>& peers) const {
         for (size_t i = 0; i < peers.size(); i++) {
-            if (_peers.find(peers[i]) == _peers.end()) {
+            if (!contains(peers[i])) {
                 return false;
             }
         }
@@ -220,15 +262,18 @@ public:
     bool equals(const std::vector<PeerId>& peers) const {
         std::set<PeerId> peer_set;
         for (size_t i = 0; i < peers.size(); i++) {
-            if (_peers.find(peers[i]) == _peers.end()) {
+            if (!contains(peers[i])) {
                 return false;
             }
             peer_set.insert(peers[i]);
         }
-        return peer_set.size() == _peers.size();
+        return peer_set.size() == size();
     }
 
     bool equals(const Configuration& rhs) const {
+        if (_peers == rhs._peers) {
+            return true;
+        }
         if (size() != rhs.size()) {
             return false;
         }
@@ -250,13 +295,11 @@ public:
                Configuration* excluded) const {
         *included = *this;
         *excluded = rhs;
-        for (std::set<PeerId>::const_iterator 
-                iter = _peers.begin(); iter != _peers.end(); ++iter) {
-            excluded->_peers.erase(*iter);
+        for (const_iterator iter = begin(); iter != end(); ++iter) {
+            excluded->remove_peer(*iter);
         }
-        for (std::set<PeerId>::const_iterator 
-                iter = rhs._peers.begin(); iter != rhs._peers.end(); ++iter) {
-            included->_peers.erase(*iter);
+        for (const_iterator iter = rhs.begin(); iter != rhs.end(); ++iter) {
+            included->remove_peer(*iter);
         }
     }
 
@@ -265,8 +308,14 @@ public:
     int parse_from(butil::StringPiece conf);
     
 private:
-    std::set<PeerId> _peers;
+    const std::set<PeerId>& peers() const {
+        return _peers ? *_peers : empty_peers();
+    }
+    // Copy the peers if they are shared with other configurations
+    std::set<PeerId>* mutable_peers();
+    static const std::set<PeerId>& empty_peers();
 
+    std::shared_ptr<std::set<PeerId> > _peers;
 };
 
 std::ostream& operator<<(std::ostream& os, const Configuration& a);
@@ -15,6 +15,7 @@
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
 #include "braft/configuration_manager.h"
+#include <algorithm>
 
 namespace braft {
 
@@ -27,6 +28,42 @@ int ConfigurationManager::add(const ConfigurationEntry& entry) {
         }
     }
     _configurations.push_back(entry);
+    // Most of the configurations equal to the ones of the previous entry,
+    // e.g. the old_conf of a joint configuration and the conf after it,
+    // share the peers with it
+    if (_configurations.size() > 1) {
+        const ConfigurationEntry& prev =
+                _configurations[_configurations.size() - 2];
+        ConfigurationEntry& last = _configurations.back();
+        share_if_equal(prev, &last.conf);
+        share_if_equal(prev, &last.old_conf);
+        share_if_equal(prev, &last.learners);
+    }
+    return 0;
+}
+
+void ConfigurationManager::share_if_equal(const ConfigurationEntry& prev,
+                                          Configuration* conf) {
+    if (conf->empty()) {
+        return;
+    }
+    if (conf->equals(prev.conf)) {
+        *conf = prev.conf;
+    } else if (conf->equals(prev.old_conf)) {
+        *conf = prev.old_conf;
+    } else if (conf->equals(prev.learners)) {
+        *conf = prev.learners;
+    }
+}
+
+int ConfigurationManager::merge(const ConfigurationManager& other) {
+    for (std::deque<ConfigurationEntry>::const_iterator
+            it = other._configurations.begin();
+            it != other._configurations.end(); ++it) {
+        if (add(*it) != 0) {
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -49,6 +86,10 @@ void ConfigurationManager::set_snapshot(const ConfigurationEntry& entry) {
     _snapshot = entry;
 }
 
+static bool index_less(int64_t index, const ConfigurationEntry& entry) {
+    return index < entry.id.index;
+}
+
 void ConfigurationManager::get(int64_t last_included_index,
                                ConfigurationEntry* conf) {
     if (_configurations.empty()) {
@@ -56,12 +97,10 @@ void ConfigurationManager::get(int64_t last_included_index,
         *conf = _snapshot;
         return;
     }
-    std::deque<ConfigurationEntry>::iterator it;
-    for (it = _configurations.begin(); it != _configurations.end(); ++it) {
-        if (it->id.index > last_included_index) {
-            break;
-        }
-    }
+    // The first configuration after |last_included_index|
+    std::deque<ConfigurationEntry>::iterator it = std::upper_bound(
+            _configurations.begin(), _configurations.end(),
+            last_included_index, index_less);
     if (it == _configurations.begin()) {
         *conf = _snapshot;
         return;
@@ -26,6 +26,9 @@ struct ConfigurationEntry {
     LogId id;
     Configuration conf;
     Configuration old_conf;
+    // Non-voting peers which receive the logs but are counted neither in
+    // the quorum nor in elections
+    Configuration learners;
 
     ConfigurationEntry() {}
     ConfigurationEntry(const LogEntry& entry) {
@@ -34,6 +37,9 @@ struct ConfigurationEntry {
         if (entry.old_peers) {
             old_conf = *(entry.old_peers);
         }
+        if (entry.learners) {
+            learners = *(entry.learners);
+        }
     }
 
     bool stable() const { return old_conf.empty(); }
@@ -56,6 +62,10 @@ public:
     // add new configuration at index
     int add(const ConfigurationEntry& entry);
 
+    // Append all the configurations of |other|, which must be after the
+    // existing ones
+    int merge(const ConfigurationManager& other);
+
     // [1, first_index_kept) are being discarded
     void truncate_prefix(int64_t first_index_kept);
 
@@ -64,11 +74,16 @@ public:
 
     void set_snapshot(const ConfigurationEntry& snapshot);
 
+    // Get the configuration at |last_included_index|, which takes
+    // O(log(#configurations)) and shares the peers with the stored one
     void get(int64_t last_included_index, ConfigurationEntry* entry);
 
     const ConfigurationEntry& last_configuration() const;
 
 private:
+    // Make |conf| share the peers with the equal configuration of |prev|
+    static void share_if_equal(const ConfigurationEntry& prev,
+                               Configuration* conf);
 
     std::deque<ConfigurationEntry> _configurations;
     ConfigurationEntry _snapshot;
@@ -0,0 +1,175 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/entry_tracer.h"
+
+#include <butil/fast_rand.h>
+#include <butil/time.h>
+#include <bvar/latency_recorder.h>
+#include <brpc/reloadable_flags.h>
+
+namespace braft {
+
+DEFINE_double(raft_entry_trace_sample_rate, 0,
+              "Ratio of the tasks applied to leaders whose stages are traced, "
+              "e.g. 0.01 for 1%. 0 to disable the tracing");
+BRPC_VALIDATE_GFLAG(raft_entry_trace_sample_rate, brpc::PassValidate);
+DEFINE_bool(raft_entry_trace_log, false,
+            "Print the stages of each traced task");
+BRPC_VALIDATE_GFLAG(raft_entry_trace_log, brpc::PassValidate);
+
+// Bound the memory of the traces if the logs are never applied, e.g. the
+// disk is stuck
+static const size_t MAX_TRACES = 1024;
+
+static bvar::LatencyRecorder g_apply_queue_latency(
+                                    "raft_entry_trace_apply_queue");
+static bvar::LatencyRecorder g_disk_queue_latency(
+                                    "raft_entry_trace_disk_queue");
+static bvar::LatencyRecorder g_disk_write_latency(
+                                    "raft_entry_trace_disk_write");
+static bvar::LatencyRecorder g_replicate_latency(
+                                    "raft_entry_trace_replicate");
+static bvar::LatencyRecorder g_commit_latency("raft_entry_trace_commit");
+static bvar::LatencyRecorder g_fsm_queue_latency("raft_entry_trace_fsm_queue");
+static bvar::LatencyRecorder g_fsm_apply_latency("raft_entry_trace_fsm_apply");
+static bvar::LatencyRecorder g_total_latency("raft_entry_trace_total");
+
+int64_t EntryTracer::sample() {
+    const double rate = FLAGS_raft_entry_trace_sample_rate;
+    if (rate <= 0 || butil::fast_rand_double() >= rate) {
+        return 0;
+    }
+    return butil::cpuwide_time_us();
+}
+
+void EntryTracer::on_appended(int64_t index, int64_t start_us) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_traces.size() >= MAX_TRACES) {
+        return;
+    }
+    Trace& t = _traces[index];
+    t.start_us = start_us;
+    t.appended_us = butil::cpuwide_time_us();
+    _ntraces.store(_traces.size(), butil::memory_order_relaxed);
+}
+
+void EntryTracer::on_stable(int64_t first_index, int64_t last_index,
+                            int64_t flush_start_us) {
+    if (empty()) {
+        return;
+    }
+    const int64_t now = butil::cpuwide_time_us();
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (TraceMap::iterator it = _traces.lower_bound(first_index);
+            it != _traces.end() && it->first <= last_index; ++it) {
+        it->second.flush_us = flush_start_us;
+        it->second.stable_us = now;
+    }
+}
+
+void EntryTracer::on_replicated(int64_t first_index, int64_t last_index) {
+    if (empty()) {
+        return;
+    }
+    const int64_t now = butil::cpuwide_time_us();
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (TraceMap::iterator it = _traces.lower_bound(first_index);
+            it != _traces.end() && it->first <= last_index; ++it) {
+        if (it->second.replicated_us == 0) {
+            it->second.replicated_us = now;
+        }
+    }
+}
+
+void EntryTracer::on_committed(int64_t committed_index) {
+    if (empty()) {
+        return;
+    }
+    const int64_t now = butil::cpuwide_time_us();
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (TraceMap::iterator it = _traces.begin();
+            it != _traces.end() && it->first <= committed_index; ++it) {
+        if (it->second.committed_us == 0) {
+            it->second.committed_us = now;
+        }
+    }
+}
+
+void EntryTracer::on_applying(int64_t committed_index) {
+    if (empty()) {
+        return;
+    }
+    const int64_t now = butil::cpuwide_time_us();
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (TraceMap::iterator it = _traces.begin();
+            it != _traces.end() && it->first <= committed_index; ++it) {
+        if (it->second.applying_us == 0) {
+            it->second.applying_us = now;
+        }
+    }
+}
+
+void EntryTracer::on_applied(int64_t applied_index) {
+    if (empty()) {
+        return;
+    }
+    const int64_t now = butil::cpuwide_time_us();
+    BAIDU_SCOPED_LOCK(_mutex);
+    TraceMap::iterator end = _traces.upper_bound(applied_index);
+    for (TraceMap::iterator it = _traces.begin(); it != end; ++it) {
+        const Trace& t = it->second;
+        g_apply_queue_latency << t.appended_us - t.start_us;
+        if (t.flush_us) {
+            g_disk_queue_latency << t.flush_us - t.appended_us;
+            g_disk_write_latency << t.stable_us - t.flush_us;
+        }
+        if (t.replicated_us) {
+            g_replicate_latency << t.replicated_us - t.appended_us;
+        }
+        if (t.committed_us) {
+            g_commit_latency << t.committed_us - t.appended_us;
+            if (t.applying_us) {
+                g_fsm_queue_latency << t.applying_us - t.committed_us;
+            }
+        }
+        if (t.applying_us) {
+            g_fsm_apply_latency << now - t.applying_us;
+        }
+        g_total_latency << now - t.start_us;
+        LOG_IF(INFO, FLAGS_raft_entry_trace_log)
+                << "Traced log " << it->first
+                << " apply_queue=" << t.appended_us - t.start_us
+                << " disk_queue=" << (t.flush_us ? t.flush_us - t.appended_us : -1)
+                << " disk_write=" << (t.flush_us ? t.stable_us - t.flush_us : -1)
+                << " replicate=" << (t.replicated_us
+                                     ? t.replicated_us - t.appended_us : -1)
+                << " commit=" << (t.committed_us
+                                  ? t.committed_us - t.appended_us : -1)
+                << " fsm_queue=" << (t.committed_us && t.applying_us
+                                     ? t.applying_us - t.committed_us : -1)
+                << " fsm_apply=" << (t.applying_us ? now - t.applying_us : -1)
+                << " total=" << now - t.start_us;
+    }
+    _traces.erase(_traces.begin(), end);
+    _ntraces.store(_traces.size(), butil::memory_order_relaxed);
+}
+
+void EntryTracer::reset() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _traces.clear();
+    _ntraces.store(0, butil::memory_order_relaxed);
+}
+
+}  // namespace braft
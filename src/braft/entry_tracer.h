@@ -0,0 +1,90 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRAFT_ENTRY_TRACER_H
+#define  BRAFT_ENTRY_TRACER_H
+
+#include <map>
+#include <gflags/gflags.h>
+#include <butil/atomicops.h>
+#include "braft/macros.h"
+
+namespace braft {
+
+DECLARE_double(raft_entry_trace_sample_rate);
+
+// Traces the stages of the sampled tasks applied to a leader, from
+// Node::apply to StateMachine::on_apply. The time of each stage is added to
+// the LatencyRecorder of the stage, named raft_entry_trace_<stage>:
+//   apply_queue: Node::apply -> the index is assigned in the apply queue
+//   disk_queue:  index assigned -> the disk thread starts writing it
+//   disk_write:  writing -> the log is stable locally, including fsync
+//   replicate:   index assigned -> the first follower persisted it
+//   commit:      index assigned -> BallotBox::commit_at commits it
+//   fsm_queue:   committed -> FSMCaller starts applying it
+//   fsm_apply:   applying -> applied by StateMachine::on_apply
+//   total:       Node::apply -> applied
+// The tasks that are not sampled cost a relaxed load at each stage.
+class EntryTracer {
+public:
+    EntryTracer() : _ntraces(0) {}
+
+    // Returns the start time of a task applied now if it's sampled by
+    // raft_entry_trace_sample_rate, 0 otherwise
+    static int64_t sample();
+
+    bool empty() const {
+        return _ntraces.load(butil::memory_order_relaxed) == 0;
+    }
+
+    // The sampled task started at |start_us| is assigned |index|
+    void on_appended(int64_t index, int64_t start_us);
+    // The logs in [first_index, last_index] are stable locally after the
+    // disk thread started writing them at |flush_start_us|
+    void on_stable(int64_t first_index, int64_t last_index,
+                   int64_t flush_start_us);
+    // A follower persisted the logs in [first_index, last_index]
+    void on_replicated(int64_t first_index, int64_t last_index);
+    void on_committed(int64_t committed_index);
+    // FSMCaller starts applying the logs up to |committed_index|
+    void on_applying(int64_t committed_index);
+    // The logs up to |applied_index| are applied
+    void on_applied(int64_t applied_index);
+    // Drop the traces when the leader steps down
+    void reset();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(EntryTracer);
+
+    struct Trace {
+        Trace() : start_us(0), appended_us(0), flush_us(0), stable_us(0)
+                , replicated_us(0), committed_us(0), applying_us(0) {}
+        int64_t start_us;
+        int64_t appended_us;
+        int64_t flush_us;
+        int64_t stable_us;
+        int64_t replicated_us;
+        int64_t committed_us;
+        int64_t applying_us;
+    };
+    typedef std::map<int64_t, Trace> TraceMap;
+
+    raft_mutex_t _mutex;
+    TraceMap _traces;
+    butil::atomic<int64_t> _ntraces;
+};
+
+}  // namespace braft
+
+#endif  //BRAFT_ENTRY_TRACER_H
@@ -17,11 +17,60 @@
 //          Xiong,Kai(xiongkai@baidu.com)
 //          Yang,Guodong(yangguodong01@baidu.com)
 
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <brpc/reloadable_flags.h>
 #include "braft/file_reader.h"
 #include "braft/util.h"
 
 namespace braft {
-    
+
+DEFINE_bool(raft_file_read_mmap, false,
+            "Read the files to serve by mmap, so the data are sent from the "
+            "page cache without being copied. The files must not be truncated "
+            "while they are being served");
+BRPC_VALIDATE_GFLAG(raft_file_read_mmap, ::brpc::PassValidate);
+
+DEFINE_bool(raft_file_read_sequential, false,
+            "Hint the kernel that the served files are read sequentially: "
+            "read ahead the chunk following the one being served in the "
+            "background, and drop the served chunk from the page cache so "
+            "that the snapshots don't evict the pages of the state machine. "
+            "Don't turn it on if the files of the snapshots are shared with "
+            "the running state machine, e.g. hard links");
+BRPC_VALIDATE_GFLAG(raft_file_read_sequential, ::brpc::PassValidate);
+
+int FileReader::read_file_segments(butil::IOBuf* out,
+                                   const std::string &filename,
+                                   off_t offset,
+                                   size_t max_count,
+                                   bool read_partly,
+                                   size_t* read_count,
+                                   bool* is_eof) const {
+    butil::IOBuf buf;
+    const int rc = read_file(&buf, filename, offset, max_count, read_partly,
+                             read_count, is_eof);
+    if (rc != 0) {
+        return rc;
+    }
+    FileSegData seg_data;
+    off_t buf_off = offset;
+    while (!buf.empty()) {
+        butil::StringPiece p = buf.backing_block(0);
+        if (!is_zero(p.data(), p.size())) {
+            butil::IOBuf piece_buf;
+            buf.cutn(&piece_buf, p.size());
+            seg_data.append(piece_buf, buf_off);
+        } else {
+            // skip zero IOBuf block
+            buf.pop_front(p.size());
+        }
+        buf_off += p.size();
+    }
+    out->swap(seg_data.data());
+    return 0;
+}
+
 LocalDirReader::~LocalDirReader() {
     _fs->close_snapshot(_path);
 }
@@ -40,13 +89,91 @@ int LocalDirReader::read_file(butil::IOBuf* out,
     return read_file_with_meta(out, filename, NULL, offset, max_count, read_count, is_eof);
 }
 
+int LocalDirReader::read_file_segments(butil::IOBuf* out,
+                                       const std::string &filename,
+                                       off_t offset,
+                                       size_t max_count,
+                                       bool read_partly,
+                                       size_t* read_count,
+                                       bool* is_eof) const {
+    return read_file_with_meta(out, filename, NULL, offset, max_count,
+                               read_count, is_eof, true);
+}
+
+static ssize_t read_range(FileAdaptor* file, butil::IOBuf* out,
+                          off_t offset, size_t size) {
+    if (FLAGS_raft_file_read_mmap) {
+        return file->read_mapped(out, offset, size);
+    }
+    butil::IOPortal portal;
+    const ssize_t nread = read_and_wait(file, &portal, offset, size);
+    if (nread > 0) {
+        out->append(portal);
+    }
+    return nread;
+}
+
+// Read the data regions within [offset, offset + max_count) of |file| to |out|
+// encoded by FileSegData, the holes between them are skipped.
+// Returns 0 on success, -1 otherwise
+static int read_data_regions(FileAdaptor* file, off_t offset,
+                             size_t max_count, butil::IOBuf* out) {
+    FileSegData seg_data;
+    const off_t end = offset + max_count;
+    off_t pos = offset;
+    while (pos < end) {
+        off_t data_begin = 0;
+        off_t data_end = 0;
+        const int rc = file->seek_data(pos, &data_begin, &data_end);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc > 0 || data_begin >= end) {
+            // The rest is a hole
+            break;
+        }
+        data_end = std::min(data_end, end);
+        butil::IOBuf data;
+        const ssize_t nread = read_range(file, &data, data_begin,
+                                         data_end - data_begin);
+        if (nread < 0) {
+            return -1;
+        }
+        if (nread > 0) {
+            seg_data.append(data, data_begin);
+        }
+        if (nread < data_end - data_begin) {
+            // Reach the end of the file
+            break;
+        }
+        pos = data_end;
+    }
+    out->swap(seg_data.data());
+    return 0;
+}
+
+// Prefetch the chunk following [offset, offset + read_count), which is likely
+// to be requested next, and drop the chunk which is in |out| already. The
+// mapped pages are still referenced by |out| and are left to the kernel
+static void advise_after_read(FileAdaptor* file, off_t offset,
+                              size_t read_count, size_t max_count,
+                              bool is_eof) {
+    if (!is_eof) {
+        file->advise(offset + read_count, max_count, FILE_ADVICE_WILLNEED);
+    }
+    if (!FLAGS_raft_file_read_mmap && read_count > 0) {
+        file->advise(offset, read_count, FILE_ADVICE_DONTNEED);
+    }
+}
+
 int LocalDirReader::read_file_with_meta(butil::IOBuf* out,
                                         const std::string &filename,
                                         google::protobuf::Message* file_meta,
                                         off_t offset,
                                         size_t max_count,
                                         size_t* read_count,
-                                        bool* is_eof) const {
+                                        bool* is_eof,
+                                        bool skip_holes) const {
     out->clear();
     std::string file_path(_path + "/" + filename);
     butil::File::Error e;
@@ -55,8 +182,24 @@ int LocalDirReader::read_file_with_meta(butil::IOBuf* out,
         return file_error_to_os_error(e);
     }
     std::unique_ptr<FileAdaptor, DestroyObj<FileAdaptor> > guard(file);
-    butil::IOPortal buf;
-    ssize_t nread = file->read(&buf, offset, max_count);
+    if (FLAGS_raft_file_read_sequential) {
+        file->advise(offset, 0, FILE_ADVICE_SEQUENTIAL);
+    }
+    if (skip_holes) {
+        const ssize_t size = file->size();
+        if (size < 0 || read_data_regions(file, offset, max_count, out) != 0) {
+            return EIO;
+        }
+        const off_t end = std::min(off_t(offset + max_count), off_t(size));
+        *read_count = end > offset ? end - offset : 0;
+        *is_eof = (end == off_t(size));
+        if (FLAGS_raft_file_read_sequential) {
+            advise_after_read(file, offset, *read_count, max_count, *is_eof);
+        }
+        return 0;
+    }
+    butil::IOBuf buf;
+    ssize_t nread = read_range(file, &buf, offset, max_count);
     if (nread < 0) {
         return EIO;
     }
@@ -73,6 +216,9 @@ int LocalDirReader::read_file_with_meta(butil::IOBuf* out,
             *is_eof = true;
         }
     }
+    if (FLAGS_raft_file_read_sequential) {
+        advise_after_read(file, offset, *read_count, max_count, *is_eof);
+    }
     out->swap(buf);
     return 0;
 }
@@ -46,8 +46,25 @@ public:
                           bool read_partly,
                           size_t* read_count,
                           bool* is_eof) const = 0;
+
+    // Same as read_file(), but |out| is encoded by FileSegData and the holes
+    // of the file are skipped. The default implementation reads the data
+    // with read_file() and skips the zero blocks in memory.
+    // Returns 0 on success, the error otherwise
+    virtual int read_file_segments(butil::IOBuf* out,
+                                   const std::string &filename,
+                                   off_t offset,
+                                   size_t max_count,
+                                   bool read_partly,
+                                   size_t* read_count,
+                                   bool* is_eof) const;
+
     // Get the path of this reader
     virtual const std::string& path() const = 0;
+
+    // Milliseconds to wait before reading again after the reading is
+    // throttled with EAGAIN
+    virtual int64_t throttle_retry_interval_ms() const { return 100; }
 protected:
     FileReader() {}
     virtual ~FileReader() {}
@@ -78,15 +95,27 @@ public:
                           bool read_partly,
                           size_t* read_count,
                           bool* is_eof) const;
+
+    // Skip the holes of the file with FileAdaptor::seek_data() instead of
+    // scanning the data
+    virtual int read_file_segments(butil::IOBuf* out,
+                                   const std::string &filename,
+                                   off_t offset,
+                                   size_t max_count,
+                                   bool read_partly,
+                                   size_t* read_count,
+                                   bool* is_eof) const;
     virtual const std::string& path() const { return _path; }
 protected:
+    // |out| is encoded by FileSegData if |skip_holes| is true
     int read_file_with_meta(butil::IOBuf* out,
                             const std::string &filename,
                             google::protobuf::Message* file_meta,
                             off_t offset,
                             size_t max_count,
                             size_t* read_count,
-                            bool* is_eof) const;
+                            bool* is_eof,
+                            bool skip_holes = false) const;
     const scoped_refptr<FileSystemAdaptor>& file_system() const { return _fs; }
 
 private:
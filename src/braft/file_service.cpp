@@ -21,14 +21,93 @@
 #include <butil/file_util.h>
 #include <butil/files/file_path.h>
 #include <butil/files/file_enumerator.h>
+#include <butil/raw_pack.h>
+#include <bthread/bthread.h>
 #include <brpc/closure_guard.h>
 #include <brpc/controller.h>
+#include <brpc/stream.h>
+#include <brpc/reloadable_flags.h>
 #include "braft/util.h"
 
 namespace braft {
 
 DEFINE_bool(raft_file_check_hole, false, "file service check hole switch, default disable");
 
+DECLARE_int32(raft_max_byte_count_per_rpc);
+
+DEFINE_int32(raft_file_stream_max_buf_size, 8 * 1024 * 1024,
+             "Maximum of the bytes pushed on the stream of a file but not "
+             "consumed by the receiver yet");
+BRPC_VALIDATE_GFLAG(raft_file_stream_max_buf_size, brpc::PositiveInteger);
+
+void FileStreamHeader::append_to(butil::IOBuf* buf) const {
+    char header[SIZE];
+    butil::RawPacker(header)
+            .pack64(offset)
+            .pack32(read_size)
+            .pack32((eof ? 1 : 0) | ((uint32_t)compress_type << 8));
+    buf->append(header, sizeof(header));
+}
+
+int FileStreamHeader::cut_from(butil::IOBuf* buf) {
+    char header[SIZE];
+    if (buf->cutn(header, sizeof(header)) != sizeof(header)) {
+        return -1;
+    }
+    uint64_t offset64 = 0;
+    uint32_t flags = 0;
+    butil::RawUnpacker(header)
+            .unpack64(offset64)
+            .unpack32(read_size)
+            .unpack32(flags);
+    offset = offset64;
+    eof = flags & 1;
+    compress_type = flags >> 8;
+    return 0;
+}
+
+// Read the data of |filename| from |offset|, which skips the holes of the
+// file if raft_file_check_hole is on. |out| is encoded by FileSegData.
+static int read_file_data(FileReader* reader, const std::string& filename,
+                          off_t offset, size_t max_count, bool read_partly,
+                          butil::IOBuf* out, size_t* read_count, bool* is_eof) {
+    if (FLAGS_raft_file_check_hole) {
+        return reader->read_file_segments(out, filename, offset, max_count,
+                                          read_partly, read_count, is_eof);
+    }
+    butil::IOBuf buf;
+    const int rc = reader->read_file(&buf, filename, offset, max_count,
+                                     read_partly, read_count, is_eof);
+    if (rc == 0 && !buf.empty()) {
+        FileSegData seg_data;
+        seg_data.append(buf, offset);
+        out->swap(seg_data.data());
+    }
+    return rc;
+}
+
+// Compress |buf| with |accept_compress_type| to |out|.
+// Returns the compress type of |out|
+static int encode_file_data(butil::IOBuf* buf, int accept_compress_type,
+                            butil::IOBuf* out) {
+    out->swap(*buf);
+    if (accept_compress_type != COMPRESS_NONE) {
+        return compress_replication_data(accept_compress_type, out);
+    }
+    return COMPRESS_NONE;
+}
+
+int FileServiceImpl::find_reader(int64_t reader_id,
+                                 scoped_refptr<FileReader>* reader) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    Map::const_iterator iter = _reader_map.find(reader_id);
+    if (iter == _reader_map.end()) {
+        return -1;
+    }
+    *reader = iter->second;
+    return 0;
+}
+
 void FileServiceImpl::get_file(::google::protobuf::RpcController* controller,
                                const ::braft::GetFileRequest* request,
                                ::braft::GetFileResponse* response,
@@ -36,16 +115,10 @@ void FileServiceImpl::get_file(::google::protobuf::RpcController* controller,
     scoped_refptr<FileReader> reader;
     brpc::ClosureGuard done_gurad(done);
     brpc::Controller* cntl = (brpc::Controller*)controller;
-    std::unique_lock<raft_mutex_t> lck(_mutex);
-    Map::const_iterator iter = _reader_map.find(request->reader_id());
-    if (iter == _reader_map.end()) {
-        lck.unlock();
+    if (find_reader(request->reader_id(), &reader) != 0) {
         cntl->SetFailed(ENOENT, "Fail to find reader=%" PRId64, request->reader_id());
         return;
     }
-    // Don't touch iter ever after
-    reader = iter->second;
-    lck.unlock();
     BRAFT_VLOG << "get_file for " << cntl->remote_side() << " path=" << reader->path()
                << " filename=" << request->filename()
                << " offset=" << request->offset() << " count=" << request->count();
@@ -60,12 +133,11 @@ void FileServiceImpl::get_file(::google::protobuf::RpcController* controller,
     bool is_eof = false;
     size_t read_count = 0;
 
-    const int rc = reader->read_file(
-                            &buf, request->filename(),
-                            request->offset(), request->count(), 
+    const int rc = read_file_data(
+                            reader.get(), request->filename(),
+                            request->offset(), request->count(),
                             request->read_partly(),
-                            &read_count,
-                            &is_eof);
+                            &buf, &read_count, &is_eof);
     if (rc != 0) {
         cntl->SetFailed(rc, "Fail to read from path=%s filename=%s : %s",
                         reader->path().c_str(), request->filename().c_str(), berror(rc));
@@ -79,25 +151,117 @@ void FileServiceImpl::get_file(::google::protobuf::RpcController* controller,
         return;
     }
 
-    FileSegData seg_data;
-    if (!FLAGS_raft_file_check_hole) {
-        seg_data.append(buf, request->offset());
-    } else {
-        off_t buf_off = request->offset();
-        while (!buf.empty()) {
-            butil::StringPiece p = buf.backing_block(0);
-            if (!is_zero(p.data(), p.size())) {
-                butil::IOBuf piece_buf;
-                buf.cutn(&piece_buf, p.size());
-                seg_data.append(piece_buf, buf_off);
-            } else {
-                // skip zero IOBuf block
-                buf.pop_front(p.size());
+    const int compress_type = encode_file_data(
+            &buf, request->accept_compress_type(),
+            &cntl->response_attachment());
+    if (compress_type != COMPRESS_NONE) {
+        response->set_compress_type(compress_type);
+    }
+}
+
+struct FileServiceImpl::StreamArg {
+    scoped_refptr<FileReader> reader;
+    std::string filename;
+    int64_t offset;
+    int accept_compress_type;
+    brpc::StreamId stream;
+};
+
+void FileServiceImpl::stream_file(::google::protobuf::RpcController* controller,
+                                  const ::braft::StreamFileRequest* request,
+                                  ::braft::StreamFileResponse* response,
+                                  ::google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_gurad(done);
+    brpc::Controller* cntl = (brpc::Controller*)controller;
+    scoped_refptr<FileReader> reader;
+    if (find_reader(request->reader_id(), &reader) != 0) {
+        cntl->SetFailed(ENOENT, "Fail to find reader=%" PRId64, request->reader_id());
+        return;
+    }
+    BRAFT_VLOG << "stream_file for " << cntl->remote_side() << " path=" << reader->path()
+               << " filename=" << request->filename()
+               << " offset=" << request->offset();
+    if (request->offset() < 0) {
+        cntl->SetFailed(brpc::EREQUEST, "Invalid request=%s",
+                        request->ShortDebugString().c_str());
+        return;
+    }
+    brpc::StreamId stream;
+    brpc::StreamOptions stream_options;
+    stream_options.max_buf_size = FLAGS_raft_file_stream_max_buf_size;
+    if (brpc::StreamAccept(&stream, *cntl, &stream_options) != 0) {
+        cntl->SetFailed(EINVAL, "Fail to accept stream");
+        return;
+    }
+    StreamArg* arg = new StreamArg;
+    arg->reader = reader;
+    arg->filename = request->filename();
+    arg->offset = request->offset();
+    arg->accept_compress_type = request->accept_compress_type();
+    arg->stream = stream;
+    // The stream is writable after the response is sent
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, send_file_stream, arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        brpc::StreamClose(stream);
+        delete arg;
+    }
+}
+
+void* FileServiceImpl::send_file_stream(void* arg) {
+    StreamArg* a = (StreamArg*)arg;
+    int64_t offset = a->offset;
+    while (true) {
+        butil::IOBuf buf;
+        bool is_eof = false;
+        size_t read_count = 0;
+        const int rc = read_file_data(
+                a->reader.get(), a->filename, offset,
+                FLAGS_raft_max_byte_count_per_rpc, true,
+                &buf, &read_count, &is_eof);
+        if (rc == EAGAIN) {
+            // Throttled. StreamWait returns at once as long as the stream is
+            // writable, so sleep instead, and the write fails if the
+            // receiver has gone meanwhile.
+            bthread_usleep(a->reader->throttle_retry_interval_ms() * 1000L);
+            continue;
+        }
+        if (rc != 0) {
+            LOG(WARNING) << "Fail to read from path=" << a->reader->path()
+                         << " filename=" << a->filename << " : " << berror(rc);
+            break;
+        }
+        FileStreamHeader header;
+        header.offset = offset;
+        header.read_size = read_count;
+        header.eof = is_eof;
+        butil::IOBuf data;
+        header.compress_type = encode_file_data(
+                &buf, a->accept_compress_type, &data);
+        butil::IOBuf message;
+        header.append_to(&message);
+        message.append(data);
+        int wrc = 0;
+        while ((wrc = brpc::StreamWrite(a->stream, message)) == EAGAIN) {
+            // Wait for the receiver to consume the data
+            timespec due_time = butil::seconds_from_now(1);
+            if (brpc::StreamWait(a->stream, &due_time) == EINVAL) {
+                break;
             }
-            buf_off += p.size();
+        }
+        if (wrc != 0) {
+            LOG(WARNING) << "Fail to write stream of filename=" << a->filename
+                         << " : " << berror(wrc);
+            break;
+        }
+        offset += read_count;
+        if (is_eof) {
+            break;
         }
     }
-    cntl->response_attachment().swap(seg_data.data());
+    brpc::StreamClose(a->stream);
+    delete a;
+    return NULL;
 }
 
 FileServiceImpl::FileServiceImpl() {
@@ -24,6 +24,24 @@
 
 namespace braft {
 
+// Header of the messages pushed on the stream of stream_file, which is
+// followed by the data encoded by FileSegData
+struct FileStreamHeader {
+    static const size_t SIZE = 16;
+    FileStreamHeader() : offset(0), read_size(0), eof(false), compress_type(0) {}
+    void append_to(butil::IOBuf* buf) const;
+    // Cut the header from the front of |buf|
+    // Returns 0 on success, -1 otherwise
+    int cut_from(butil::IOBuf* buf);
+
+    // The data are read from |offset| of the file
+    int64_t offset;
+    uint32_t read_size;
+    bool eof;
+    // braft::CompressType of the data
+    int compress_type;
+};
+
 class BAIDU_CACHELINE_ALIGNMENT FileServiceImpl : public FileService {
 public:
     static FileServiceImpl* GetInstance() {
@@ -33,12 +51,21 @@ public:
                   const ::braft::GetFileRequest* request,
                   ::braft::GetFileResponse* response,
                   ::google::protobuf::Closure* done);
+    // Accept the stream of the request and push the file on it in a bthread
+    // at the pace the receiver consumes
+    void stream_file(::google::protobuf::RpcController* controller,
+                     const ::braft::StreamFileRequest* request,
+                     ::braft::StreamFileResponse* response,
+                     ::google::protobuf::Closure* done);
     int add_reader(FileReader* reader, int64_t* reader_id);
     int remove_reader(int64_t reader_id);
 private:
 friend struct DefaultSingletonTraits<FileServiceImpl>;
     FileServiceImpl();
     ~FileServiceImpl() {}
+    struct StreamArg;
+    static void* send_file_stream(void* arg);
+    int find_reader(int64_t reader_id, scoped_refptr<FileReader>* reader);
     typedef std::map<int64_t, scoped_refptr<FileReader> > Map;
     raft_mutex_t _mutex;
     int64_t _next_id;
@@ -14,12 +14,182 @@
 
 // Authors: Zheng,PengFei(zhengpengfei@baidu.com)
 
+#include <sys/mman.h>                                // mmap
+#include <unistd.h>
+#include <pthread.h>
+#include <stdlib.h>                                  // posix_memalign
+#include <algorithm>
+#include <deque>
+#include <map>
 #include <butil/fd_utility.h>                        // butil::make_close_on_exec
 #include <butil/memory/singleton_on_pthread_once.h>  // butil::get_leaky_singleton
+#include <bthread/countdown_event.h>                 // bthread::CountdownEvent
+#include <brpc/reloadable_flags.h>
 #include "braft/file_system_adaptor.h"
 
 namespace braft {
 
+DEFINE_int32(raft_file_io_threads, 0,
+             "Number of the pthreads running the asynchronous reads and writes "
+             "of FileAdaptor, so that the bthread workers are not blocked by "
+             "the disk during the transfer of snapshots, 0 means running them "
+             "in place. Changes of the number take effect after restart");
+BRPC_VALIDATE_GFLAG(raft_file_io_threads, brpc::NonNegativeInteger);
+
+struct FileIOTask {
+    FileAdaptor* file;
+    // Read into |portal| if it's not NULL, write |data| otherwise
+    butil::IOPortal* portal;
+    const butil::IOBuf* data;
+    off_t offset;
+    size_t size;
+    FileIOClosure* done;
+};
+
+static void run_file_io(const FileIOTask& task) {
+    if (task.portal != NULL) {
+        task.done->nbytes = task.file->read(task.portal, task.offset, task.size);
+    } else {
+        task.done->nbytes = task.file->write(*task.data, task.offset);
+    }
+    task.done->error_code = task.done->nbytes < 0 ? errno : 0;
+    task.done->Run();
+}
+
+// Pthreads running the IO of FileAdaptor shared by the process, which are
+// started when the IO is issued asynchronously for the first time
+class FileIOThreads {
+public:
+    static FileIOThreads* get_instance() {
+        pthread_once(&_once, create);
+        return _instance;
+    }
+
+    void submit(const FileIOTask& task) {
+        pthread_mutex_lock(&_mutex);
+        _tasks.push_back(task);
+        pthread_cond_signal(&_cond);
+        pthread_mutex_unlock(&_mutex);
+    }
+
+private:
+    FileIOThreads() {
+        pthread_mutex_init(&_mutex, NULL);
+        pthread_cond_init(&_cond, NULL);
+        const int nthreads = std::max(FLAGS_raft_file_io_threads, 1);
+        for (int i = 0; i < nthreads; ++i) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, run_tasks, this) != 0) {
+                PLOG(FATAL) << "Fail to create the IO thread of FileAdaptor";
+            }
+        }
+    }
+    DISALLOW_COPY_AND_ASSIGN(FileIOThreads);
+
+    static void create() {
+        _instance = new FileIOThreads;
+    }
+
+    static void* run_tasks(void* arg) {
+        FileIOThreads* threads = (FileIOThreads*)arg;
+        while (true) {
+            pthread_mutex_lock(&threads->_mutex);
+            while (threads->_tasks.empty()) {
+                pthread_cond_wait(&threads->_cond, &threads->_mutex);
+            }
+            const FileIOTask task = threads->_tasks.front();
+            threads->_tasks.pop_front();
+            pthread_mutex_unlock(&threads->_mutex);
+            run_file_io(task);
+        }
+        return NULL;
+    }
+
+    static pthread_once_t _once;
+    static FileIOThreads* _instance;
+
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    std::deque<FileIOTask> _tasks;
+};
+
+pthread_once_t FileIOThreads::_once = PTHREAD_ONCE_INIT;
+FileIOThreads* FileIOThreads::_instance = NULL;
+
+static void submit_file_io(const FileIOTask& task) {
+    if (FLAGS_raft_file_io_threads <= 0) {
+        return run_file_io(task);
+    }
+    FileIOThreads::get_instance()->submit(task);
+}
+
+void FileAdaptor::async_read(butil::IOPortal* portal, off_t offset, size_t size,
+                             FileIOClosure* done) {
+    FileIOTask task = { this, portal, NULL, offset, size, done };
+    submit_file_io(task);
+}
+
+void FileAdaptor::async_write(const butil::IOBuf& data, off_t offset,
+                              FileIOClosure* done) {
+    FileIOTask task = { this, NULL, &data, offset, data.size(), done };
+    submit_file_io(task);
+}
+
+class WaitFileIODone : public FileIOClosure {
+public:
+    void Run() {
+        _event.signal();
+    }
+    ssize_t wait() {
+        _event.wait();
+        errno = error_code;
+        return nbytes;
+    }
+private:
+    bthread::CountdownEvent _event;
+};
+
+ssize_t read_and_wait(FileAdaptor* file, butil::IOPortal* portal,
+                      off_t offset, size_t size) {
+    WaitFileIODone done;
+    file->async_read(portal, offset, size, &done);
+    return done.wait();
+}
+
+ssize_t write_and_wait(FileAdaptor* file, const butil::IOBuf& data,
+                       off_t offset) {
+    WaitFileIODone done;
+    file->async_write(data, offset, &done);
+    return done.wait();
+}
+
+ssize_t FileAdaptor::read_mapped(butil::IOBuf* out, off_t offset, size_t size) {
+    butil::IOPortal portal;
+    const ssize_t nread = read(&portal, offset, size);
+    if (nread > 0) {
+        out->append(portal);
+    }
+    return nread;
+}
+
+int FileAdaptor::seek_data(off_t offset, off_t* data_begin, off_t* data_end) {
+    const ssize_t file_size = size();
+    if (file_size < 0) {
+        return -1;
+    }
+    if (offset >= file_size) {
+        return 1;
+    }
+    *data_begin = offset;
+    *data_end = file_size;
+    return 0;
+}
+
+int FileAdaptor::advise(off_t /*offset*/, off_t /*len*/,
+                        FileAdvice /*advice*/) {
+    return 0;
+}
+
 bool PosixDirReader::is_valid() const {
     return _dir_reader.IsValid();
 }
@@ -47,6 +217,131 @@ ssize_t PosixFileAdaptor::read(butil::IOPortal* portal, off_t offset, size_t siz
     return braft::file_pread(portal, _fd, offset, size);
 }
 
+#ifdef BRAFT_WITH_IOBUF_FUNCTION_DELETER
+// Unmaps the user-data block, which carries the length of the mapping
+struct MappedRegionDeleter {
+    explicit MappedRegionDeleter(size_t length_) : length(length_) {}
+    void operator()(void* addr) const {
+        if (munmap(addr, length) != 0) {
+            PLOG(ERROR) << "Fail to munmap addr=" << addr
+                        << " length=" << length;
+        }
+    }
+    size_t length;
+};
+#else
+// The deleter of the user data of IOBuf only gets the address while munmap()
+// needs the length of the mapping as well
+struct MappedRegions {
+    raft_mutex_t mutex;
+    std::map<void*, size_t> lengths;
+};
+
+static void unmap_region(void* addr) {
+    MappedRegions* regions = butil::get_leaky_singleton<MappedRegions>();
+    size_t length = 0;
+    {
+        BAIDU_SCOPED_LOCK(regions->mutex);
+        std::map<void*, size_t>::iterator it = regions->lengths.find(addr);
+        CHECK(it != regions->lengths.end());
+        length = it->second;
+        regions->lengths.erase(it);
+    }
+    if (munmap(addr, length) != 0) {
+        PLOG(ERROR) << "Fail to munmap addr=" << addr << " length=" << length;
+    }
+}
+#endif  // BRAFT_WITH_IOBUF_FUNCTION_DELETER
+
+ssize_t PosixFileAdaptor::read_mapped(butil::IOBuf* out, off_t offset, size_t size) {
+    const ssize_t file_size = this->size();
+    if (file_size < 0) {
+        return -1;
+    }
+    if (offset >= file_size || size == 0) {
+        return 0;
+    }
+    size = std::min(size, size_t(file_size - offset));
+    static const off_t page_size = sysconf(_SC_PAGESIZE);
+    const off_t map_offset = offset & ~(page_size - 1);
+    const size_t map_length = size + (offset - map_offset);
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    void* addr = mmap(NULL, map_length, PROT_READ, flags, _fd, map_offset);
+    if (addr == MAP_FAILED) {
+        PLOG(WARNING) << "Fail to mmap fd=" << _fd << ", fallback to read";
+        return FileAdaptor::read_mapped(out, offset, size);
+    }
+    butil::IOBuf buf;
+#ifdef BRAFT_WITH_IOBUF_FUNCTION_DELETER
+    if (buf.append_user_data(addr, map_length,
+                             MappedRegionDeleter(map_length)) != 0) {
+        munmap(addr, map_length);
+        return FileAdaptor::read_mapped(out, offset, size);
+    }
+#else
+    MappedRegions* regions = butil::get_leaky_singleton<MappedRegions>();
+    {
+        BAIDU_SCOPED_LOCK(regions->mutex);
+        regions->lengths[addr] = map_length;
+    }
+    if (buf.append_user_data(addr, map_length, unmap_region) != 0) {
+        unmap_region(addr);
+        return FileAdaptor::read_mapped(out, offset, size);
+    }
+#endif  // BRAFT_WITH_IOBUF_FUNCTION_DELETER
+    buf.pop_front(offset - map_offset);
+    out->append(buf);
+    return size;
+}
+
+int PosixFileAdaptor::seek_data(off_t offset, off_t* data_begin, off_t* data_end) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    const off_t begin = lseek(_fd, offset, SEEK_DATA);
+    if (begin < 0) {
+        // No data after |offset|
+        return errno == ENXIO ? 1 : -1;
+    }
+    const off_t end = lseek(_fd, begin, SEEK_HOLE);
+    if (end < 0) {
+        return -1;
+    }
+    *data_begin = begin;
+    *data_end = end;
+    return 0;
+#else
+    return FileAdaptor::seek_data(offset, data_begin, data_end);
+#endif
+}
+
+int PosixFileAdaptor::advise(off_t offset, off_t len, FileAdvice advice) {
+#if defined(POSIX_FADV_SEQUENTIAL)
+    int posix_advice = POSIX_FADV_NORMAL;
+    switch (advice) {
+    case FILE_ADVICE_SEQUENTIAL:
+        posix_advice = POSIX_FADV_SEQUENTIAL;
+        break;
+    case FILE_ADVICE_WILLNEED:
+        posix_advice = POSIX_FADV_WILLNEED;
+        break;
+    case FILE_ADVICE_DONTNEED:
+        posix_advice = POSIX_FADV_DONTNEED;
+        break;
+    }
+    // posix_fadvise() returns the error rather than setting errno
+    const int rc = posix_fadvise(_fd, offset, len, posix_advice);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+#else
+    return FileAdaptor::advise(offset, len, advice);
+#endif
+}
+
 ssize_t PosixFileAdaptor::size() {
     off_t sz = lseek(_fd, 0, SEEK_END);
     return ssize_t(sz);
@@ -65,6 +360,171 @@ bool PosixFileAdaptor::close() {
     return true;
 }
 
+const size_t BufferedFileAdaptor::DIRECT_IO_ALIGN;
+
+BufferedFileAdaptor::BufferedFileAdaptor(FileAdaptor* file,
+                                         FileAdaptor* direct_file,
+                                         const BufferedFileOptions& options)
+    : _file(file)
+    , _direct_file(direct_file)
+    , _options(options)
+    , _buf_offset(0)
+    , _failed(false)
+    , _closed(false) {
+}
+
+BufferedFileAdaptor::~BufferedFileAdaptor() {
+    if (!_closed) {
+        close();
+    }
+    delete _direct_file;
+    delete _file;
+}
+
+int BufferedFileAdaptor::flush(bool all) {
+    while (!_failed && !_buf.empty()) {
+        const size_t misalign = _buf_offset % DIRECT_IO_ALIGN;
+        butil::IOBuf piece;
+        FileAdaptor* file = _file;
+        if (_direct_file != NULL && misalign == 0
+                && _buf.size() >= DIRECT_IO_ALIGN) {
+            // O_DIRECT requires the memory to be aligned as well
+            const size_t len = _buf.size() - _buf.size() % DIRECT_IO_ALIGN;
+            void* mem = NULL;
+            if (posix_memalign(&mem, DIRECT_IO_ALIGN, len) != 0) {
+                LOG(ERROR) << "Fail to allocate " << len << " bytes";
+                _failed = true;
+                break;
+            }
+            _buf.copy_to(mem, len);
+            piece.append_user_data(mem, len, free);
+            file = _direct_file;
+        } else if (_direct_file != NULL && misalign == 0 && !all) {
+            // Wait for the following writes to fill the block
+            break;
+        } else if (_direct_file != NULL && misalign != 0) {
+            // Write up to the next aligned offset through the page cache
+            _buf.append_to(&piece, DIRECT_IO_ALIGN - misalign);
+        } else {
+            piece = _buf;
+        }
+        if (file->write(piece, _buf_offset) != (ssize_t)piece.size()) {
+            if (file != _direct_file) {
+                _failed = true;
+                break;
+            }
+            PLOG(WARNING) << "Fail to write with O_DIRECT, fallback to the "
+                             "page cache";
+            _direct_file->close();
+            delete _direct_file;
+            _direct_file = NULL;
+            continue;
+        }
+        _buf.pop_front(piece.size());
+        _buf_offset += piece.size();
+    }
+    if (_failed) {
+        _buf.clear();
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t BufferedFileAdaptor::write(const butil::IOBuf& data, off_t offset) {
+    if (!_buf.empty() && offset != _buf_offset + (off_t)_buf.size()
+            && flush(true) != 0) {
+        return -1;
+    }
+    if (_failed) {
+        return -1;
+    }
+    if (_buf.empty()) {
+        _buf_offset = offset;
+    }
+    _buf.append(data);
+    if (_buf.size() >= _options.buffer_size && flush(false) != 0) {
+        return -1;
+    }
+    return data.size();
+}
+
+ssize_t BufferedFileAdaptor::read(butil::IOPortal* portal, off_t offset,
+                                  size_t size) {
+    if (flush(true) != 0) {
+        return -1;
+    }
+    return _file->read(portal, offset, size);
+}
+
+ssize_t BufferedFileAdaptor::read_mapped(butil::IOBuf* out, off_t offset,
+                                         size_t size) {
+    if (flush(true) != 0) {
+        return -1;
+    }
+    return _file->read_mapped(out, offset, size);
+}
+
+int BufferedFileAdaptor::seek_data(off_t offset, off_t* data_begin,
+                                   off_t* data_end) {
+    if (flush(true) != 0) {
+        return -1;
+    }
+    return _file->seek_data(offset, data_begin, data_end);
+}
+
+int BufferedFileAdaptor::advise(off_t offset, off_t len, FileAdvice advice) {
+    if (flush(true) != 0) {
+        return -1;
+    }
+    return _file->advise(offset, len, advice);
+}
+
+ssize_t BufferedFileAdaptor::size() {
+    if (flush(true) != 0) {
+        return -1;
+    }
+    return _file->size();
+}
+
+bool BufferedFileAdaptor::sync() {
+    // The data written with O_DIRECT may still be in the cache of the device
+    return flush(true) == 0 && _file->sync();
+}
+
+bool BufferedFileAdaptor::close() {
+    bool res = flush(true) == 0;
+    if (_direct_file != NULL && !_direct_file->close()) {
+        res = false;
+    }
+    if (!_file->close()) {
+        res = false;
+    }
+    _closed = true;
+    return res;
+}
+
+FileAdaptor* open_buffered_file(FileSystemAdaptor* fs, const std::string& path,
+                                int oflag,
+                                const ::google::protobuf::Message* file_meta,
+                                const BufferedFileOptions& options,
+                                butil::File::Error* e) {
+    FileAdaptor* file = fs->open(path, oflag, file_meta, e);
+    if (file == NULL) {
+        return NULL;
+    }
+    FileAdaptor* direct_file = NULL;
+#ifdef O_DIRECT
+    if (options.use_direct_io) {
+        // The file has been created and truncated already
+        direct_file = fs->open(path, (oflag & ~(O_CREAT | O_EXCL | O_TRUNC))
+                                     | O_DIRECT, file_meta, NULL);
+        LOG_IF(WARNING, direct_file == NULL)
+                << "Fail to open " << path << " with O_DIRECT";
+    }
+#endif
+    return new BufferedFileAdaptor(file, direct_file, options);
+}
+
 static pthread_once_t s_check_cloexec_once = PTHREAD_ONCE_INIT;
 static bool s_support_cloexec_on_open = false;
 
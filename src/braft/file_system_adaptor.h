@@ -24,6 +24,8 @@
 #include <butil/memory/ref_counted.h>                // butil::RefCountedThreadSafe
 #include <butil/memory/singleton.h>                  // Singleton
 #include <google/protobuf/message.h>                // google::protobuf::Message
+#include <google/protobuf/stubs/callback.h>         // google::protobuf::Closure
+#include <gflags/gflags.h>
 #include "braft/util.h"
 #include "braft/fsync.h"
 
@@ -33,6 +35,8 @@
 
 namespace braft {
 
+DECLARE_int32(raft_file_io_threads);
+
 // DirReader iterates a directory to get sub directories and files, `.' and `..'
 // should be ignored
 class DirReader {
@@ -54,6 +58,27 @@ private:
     DISALLOW_COPY_AND_ASSIGN(DirReader);
 };
 
+// Completion of an asynchronous read or write of FileAdaptor
+class FileIOClosure : public google::protobuf::Closure {
+public:
+    FileIOClosure() : nbytes(-1), error_code(0) {}
+    virtual ~FileIOClosure() {}
+
+    // The return value of read() or write(), and errno if it's -1
+    ssize_t nbytes;
+    int error_code;
+};
+
+// Access patterns hinted to FileAdaptor::advise()
+enum FileAdvice {
+    // The file is read sequentially, so read ahead more
+    FILE_ADVICE_SEQUENTIAL = 0,
+    // The range will be read soon, so start reading it in the background
+    FILE_ADVICE_WILLNEED = 1,
+    // The range won't be read again soon, so drop it from the page cache
+    FILE_ADVICE_DONTNEED = 2,
+};
+
 template <typename T>
 struct DestroyObj {
     void operator()(T* const obj) { obj->close(); delete obj; }
@@ -74,6 +99,34 @@ public:
     // In the case of EOF, the return value is a non-negative integer less than |size|.
     virtual ssize_t read(butil::IOPortal* portal, off_t offset, size_t size) = 0;
 
+    // Asynchronous variants of read() and write(), |done| is run once the IO
+    // is finished, and |portal| or |data| must be valid until then. The
+    // default implementations run read() and write() in the process-wide IO
+    // pthreads of raft_file_io_threads so that the bthread workers are not
+    // blocked by the disk, or in place if there are no IO threads. |done|
+    // may be run in an IO pthread and should not block.
+    virtual void async_read(butil::IOPortal* portal, off_t offset, size_t size,
+                            FileIOClosure* done);
+    virtual void async_write(const butil::IOBuf& data, off_t offset,
+                             FileIOClosure* done);
+
+    // Same as read(), but |out| may reference the pages of the file instead of
+    // copying them if the adaptor supports it. The default implementation
+    // calls read().
+    virtual ssize_t read_mapped(butil::IOBuf* out, off_t offset, size_t size);
+
+    // Find the data region [|data_begin|, |data_end|) of the file which
+    // contains or follows |offset|, the rest of the file is a hole. The
+    // default implementation treats the whole file as data.
+    // Returns 0 on success, 1 if there's no data after |offset|, -1 otherwise.
+    virtual int seek_data(off_t offset, off_t* data_begin, off_t* data_end);
+
+    // Hint |advice| on [offset, offset + len) of the file, where |len| 0
+    // means until the end of the file, like posix_fadvise(). The default
+    // implementation ignores it.
+    // Returns 0 on success, -1 otherwise
+    virtual int advise(off_t offset, off_t len, FileAdvice advice);
+
     // Get the size of the file
     virtual ssize_t size() = 0;
 
@@ -91,6 +144,14 @@ private:
     DISALLOW_COPY_AND_ASSIGN(FileAdaptor);
 };
 
+// Same as file->read() and file->write(), but the IO is issued with
+// async_read() and async_write() and the calling bthread is suspended until
+// it's finished, which doesn't block the worker pthread.
+ssize_t read_and_wait(FileAdaptor* file, butil::IOPortal* portal,
+                      off_t offset, size_t size);
+ssize_t write_and_wait(FileAdaptor* file, const butil::IOBuf& data,
+                       off_t offset);
+
 class FileSystemAdaptor : public butil::RefCountedThreadSafe<FileSystemAdaptor> {
 public:
     FileSystemAdaptor() {}
@@ -175,6 +236,9 @@ public:
 
     virtual ssize_t write(const butil::IOBuf& data, off_t offset);
     virtual ssize_t read(butil::IOPortal* portal, off_t offset, size_t size);
+    virtual ssize_t read_mapped(butil::IOBuf* out, off_t offset, size_t size);
+    virtual int seek_data(off_t offset, off_t* data_begin, off_t* data_end);
+    virtual int advise(off_t offset, off_t len, FileAdvice advice);
     virtual ssize_t size();
     virtual bool sync();
     virtual bool close();
@@ -186,6 +250,69 @@ private:
     int _fd;
 };
 
+struct BufferedFileOptions {
+    BufferedFileOptions() : buffer_size(4 * 1024 * 1024), use_direct_io(false) {}
+
+    // Sequential writes are buffered until they reach this size
+    size_t buffer_size;
+
+    // Write the blocks aligned to DIRECT_IO_ALIGN with O_DIRECT, which
+    // bypasses the page cache. The unaligned head and tail are written
+    // normally
+    bool use_direct_io;
+};
+
+// FileAdaptor which coalesces the sequential writes to |file| in a buffer,
+// so that the small pieces are written in large writes. The buffer is
+// flushed when it's full, before a non-sequential write and before any
+// other operation, a failed flush fails the following operations as well,
+// including sync() and close().
+class BufferedFileAdaptor : public FileAdaptor {
+public:
+    static const size_t DIRECT_IO_ALIGN = 4096;
+
+    // Takes the ownership of |file|, and of |direct_file| opened on the same
+    // path with O_DIRECT, which is NULL if O_DIRECT is not used
+    BufferedFileAdaptor(FileAdaptor* file, FileAdaptor* direct_file,
+                        const BufferedFileOptions& options);
+    virtual ~BufferedFileAdaptor();
+
+    virtual ssize_t write(const butil::IOBuf& data, off_t offset);
+    virtual ssize_t read(butil::IOPortal* portal, off_t offset, size_t size);
+    virtual ssize_t read_mapped(butil::IOBuf* out, off_t offset, size_t size);
+    virtual int seek_data(off_t offset, off_t* data_begin, off_t* data_end);
+    virtual int advise(off_t offset, off_t len, FileAdvice advice);
+    virtual ssize_t size();
+    virtual bool sync();
+    virtual bool close();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(BufferedFileAdaptor);
+
+    // Write the buffer to the file, the unaligned tail is kept for the
+    // following writes if |all| is false and O_DIRECT is used.
+    // Returns 0 on success, -1 otherwise
+    int flush(bool all);
+
+    FileAdaptor* _file;
+    FileAdaptor* _direct_file;
+    BufferedFileOptions _options;
+    butil::IOBuf _buf;
+    off_t _buf_offset;
+    bool _failed;
+    bool _closed;
+};
+
+// Open |path| with |fs| for writing and wrap the file with
+// BufferedFileAdaptor, O_DIRECT is skipped if the file system doesn't
+// support it.
+// Returns NULL on failure with |e| set
+FileAdaptor* open_buffered_file(FileSystemAdaptor* fs, const std::string& path,
+                                int oflag,
+                                const ::google::protobuf::Message* file_meta,
+                                const BufferedFileOptions& options,
+                                butil::File::Error* e);
+
 class PosixFileSystemAdaptor : public FileSystemAdaptor {
 public:
     PosixFileSystemAdaptor() {}
@@ -28,23 +28,50 @@
 
 #include "braft/fsm_caller.h"
 #include <bthread/unstable.h>
+#include <brpc/reloadable_flags.h>
 
 namespace braft {
 
+DEFINE_int32(raft_max_lane_pending_tasks, 1024,
+             "The tasks dispatched to the lanes of ParallelStateMachine are "
+             "applied once there are so many of them pending");
+BRPC_VALIDATE_GFLAG(raft_max_lane_pending_tasks, brpc::PositiveInteger);
+
+DEFINE_int32(raft_fsm_fetch_entries, 256,
+             "Committed logs are fetched in chunks of at most so many logs "
+             "for the state machine, and the next chunk is prefetched in the "
+             "background if it's not in memory");
+BRPC_VALIDATE_GFLAG(raft_fsm_fetch_entries, brpc::PositiveInteger);
+
+DEFINE_int32(raft_fsm_fetch_max_bytes, 4 * 1024 * 1024,
+             "Max data bytes of a chunk of the logs fetched for the state "
+             "machine");
+BRPC_VALIDATE_GFLAG(raft_fsm_fetch_max_bytes, brpc::PositiveInteger);
+
 static bvar::CounterRecorder g_commit_tasks_batch_counter(
         "raft_commit_tasks_batch_counter");
+static bvar::CounterRecorder g_lane_tasks_batch_counter(
+        "raft_lane_tasks_batch_counter");
 
 FSMCaller::FSMCaller()
     : _log_manager(NULL)
     , _fsm(NULL)
+    , _parallel_fsm(NULL)
+    , _lane_pending(0)
+    , _usercode_in_pthread(false)
+    , _bthread_tag(-1)
     , _closure_queue(NULL)
     , _last_applied_index(0)
     , _last_applied_term(0)
+    , _last_iterated_index(0)
+    , _tickets_drained(NULL)
+    , _ticket_failed(false)
     , _after_shutdown(NULL)
     , _node(NULL)
     , _cur_task(IDLE)
     , _applying_index(0)
     , _queue_started(false)
+    , _witness(false)
 {
 }
 
@@ -154,9 +181,20 @@ int FSMCaller::init(const FSMCallerOptions &options) {
     _closure_queue = options.closure_queue;
     _after_shutdown = options.after_shutdown;
     _node = options.node;
+    _witness = options.witness;
+    _usercode_in_pthread = options.usercode_in_pthread;
+    _parallel_fsm = dynamic_cast<ParallelStateMachine*>(_fsm);
+    if (_parallel_fsm) {
+        if (_parallel_fsm->lane_num() <= 0) {
+            LOG(ERROR) << "Invalid lane_num=" << _parallel_fsm->lane_num();
+            return EINVAL;
+        }
+        _lanes.resize(_parallel_fsm->lane_num());
+    }
     _last_applied_index.store(options.bootstrap_id.index,
                               butil::memory_order_relaxed);
     _last_applied_term = options.bootstrap_id.term;
+    _last_iterated_index = options.bootstrap_id.index;
     if (_node) {
         _node->AddRef();
     }
@@ -164,7 +202,9 @@ int FSMCaller::init(const FSMCallerOptions &options) {
     bthread::ExecutionQueueOptions execq_opt;
     execq_opt.bthread_attr = options.usercode_in_pthread 
                              ? BTHREAD_ATTR_PTHREAD
-                             : BTHREAD_ATTR_NORMAL;
+                             : bthread_attr_of_tag(BTHREAD_ATTR_NORMAL,
+                                                   options.bthread_tag);
+    _bthread_tag = options.bthread_tag;
     if (bthread::execution_queue_start(&_queue_id,
                                    &execq_opt,
                                    FSMCaller::run,
@@ -184,6 +224,9 @@ int FSMCaller::shutdown() {
 }
 
 void FSMCaller::do_shutdown() {
+    stop_applied_waiters(butil::Status(EPERM, "FSMCaller is shutting down"));
+    // The tickets refer to this FSMCaller
+    wait_tickets();
     if (_node) {
         _node->Release();
         _node = NULL;
@@ -199,6 +242,9 @@ void FSMCaller::do_shutdown() {
 }
 
 int FSMCaller::on_committed(int64_t committed_index) {
+    if (_node && !_node->entry_tracer()->empty()) {
+        _node->entry_tracer()->on_committed(committed_index);
+    }
     ApplyTask t;
     t.type = COMMITTED;
     t.committed_index = committed_index;
@@ -242,6 +288,12 @@ void FSMCaller::set_error(const Error& e) {
         return;
     }
     _error = e;
+    // The logs after the failed one are never applied
+    butil::Status st = _error.status();
+    if (st.ok()) {
+        st.set_error(EINVAL, "FSMCaller is in error");
+    }
+    stop_applied_waiters(st);
     if (_fsm) {
         _fsm->on_error(_error);
     }
@@ -254,22 +306,34 @@ void FSMCaller::do_committed(int64_t committed_index) {
     if (!_error.status().ok()) {
         return;
     }
-    int64_t last_applied_index = _last_applied_index.load(
-                                        butil::memory_order_relaxed);
+    const int64_t last_applied_index = _last_iterated_index;
 
     // We can tolerate the disorder of committed_index
     if (last_applied_index >= committed_index) {
         return;
     }
+    EntryTracer* tracer = _node ? _node->entry_tracer() : NULL;
+    if (tracer && !tracer->empty()) {
+        tracer->on_applying(committed_index);
+    }
     std::vector<Closure*> closure;
     int64_t first_closure_index = 0;
     CHECK_EQ(0, _closure_queue->pop_closure_until(committed_index, &closure,
                                                   &first_closure_index));
 
-    IteratorImpl iter_impl(_fsm, _log_manager, &closure, first_closure_index,
-                 last_applied_index, committed_index, &_applying_index);
+    IteratorImpl iter_impl(this, _fsm, _log_manager, &closure, first_closure_index,
+                 last_applied_index, committed_index, &_applying_index,
+                 _parallel_fsm != NULL && !_witness);
+    // Pending tasks of the lanes are applied before StateMachine handles any
+    // other log, so the lanes never run concurrently with the interfaces of
+    // StateMachine
+    int64_t lane_failed_index = 0;
     for (; iter_impl.is_good();) {
-        if (iter_impl.entry()->type != ENTRY_TYPE_DATA) {
+        // A witness has no data to apply
+        if (!is_data_entry(iter_impl.entry()->type) || _witness) {
+            if (!flush_lanes(&iter_impl._error, &lane_failed_index)) {
+                break;
+            }
             if (iter_impl.entry()->type == ENTRY_TYPE_CONFIGURATION) {
                 if (iter_impl.entry()->old_peers == NULL) {
                     // Joint stage is not supposed to be noticeable by end users.
@@ -287,25 +351,225 @@ void FSMCaller::do_committed(int64_t committed_index) {
             iter_impl.next();
             continue;
         }
+        if (!iter_impl.is_task()) {
+            // Dispatch the task of this log to its lane
+            LaneTask task;
+            task.entry = iter_impl.entry();
+            task.entry->AddRef();
+            task.data = iter_impl.data();
+            task.partition_key = iter_impl.partition_key();
+            task.done = iter_impl.done();
+            _lanes[task.partition_key % _lanes.size()].push_back(task);
+            iter_impl.next();
+            if (++_lane_pending >= (size_t)FLAGS_raft_max_lane_pending_tasks) {
+                flush_lanes(&iter_impl._error, &lane_failed_index);
+            }
+            continue;
+        }
+        if (!flush_lanes(&iter_impl._error, &lane_failed_index)) {
+            break;
+        }
         Iterator iter(&iter_impl);
         _fsm->on_apply(iter);
         LOG_IF(ERROR, iter.valid())
                 << "Node " << _node->node_id() 
                 << " Iterator is still valid, did you return before iterator "
                    " reached the end?";
+        ApplyTicket* ticket = iter_impl.release_ticket();
+        if (ticket) {
+            ticket->_applied_index = iter_impl.index() - 1;
+            ticket->_applied_id = LogId(ticket->_applied_index,
+                    _log_manager->get_term(ticket->_applied_index));
+            queue_ticket(ticket);
+        }
         // Try move to next in case that we pass the same log twice.
         iter.next();
     }
+    // The tasks dispatched before a failed log are still applied
+    flush_lanes(&iter_impl._error, &lane_failed_index);
     if (iter_impl.has_error()) {
         set_error(iter_impl.error());
         iter_impl.run_the_rest_closure_with_error();
     }
-    const int64_t last_index = iter_impl.index() - 1;
+    int64_t last_index = iter_impl.index() - 1;
+    if (lane_failed_index > 0) {
+        last_index = std::min(last_index, lane_failed_index - 1);
+    }
     const int64_t last_term = _log_manager->get_term(last_index);
     LogId last_applied_id(last_index, last_term);
-    _last_applied_index.store(committed_index, butil::memory_order_release);
-    _last_applied_term = last_term;
-    _log_manager->set_applied_id(last_applied_id);
+    // The logs after the failed one are not applied
+    const int64_t applied_index =
+            iter_impl.has_error() ? last_index : committed_index;
+    _last_iterated_index = committed_index;
+    if (tracer && !tracer->empty()) {
+        tracer->on_applied(last_index);
+    }
+    {
+        BAIDU_SCOPED_LOCK(_tickets_mutex);
+        if (_tickets.empty()) {
+            if (!_ticket_failed) {
+                set_applied(applied_index, last_applied_id);
+            }
+            return;
+        }
+    }
+    // Applied after the tickets before
+    ApplyTicket* ticket = new ApplyTicket(this);
+    ticket->_applied_index = applied_index;
+    ticket->_applied_id = last_applied_id;
+    ticket->_done = true;
+    queue_ticket(ticket);
+}
+
+void FSMCaller::set_applied(int64_t applied_index, const LogId& applied_id) {
+    _last_applied_index.store(applied_index, butil::memory_order_release);
+    _last_applied_term = applied_id.term;
+    _log_manager->set_applied_id(applied_id);
+    notify_applied(applied_index);
+}
+
+void ApplyTicket::Run() {
+    _caller->on_ticket_done(this);
+}
+
+void FSMCaller::queue_ticket(ApplyTicket* ticket) {
+    BAIDU_SCOPED_LOCK(_tickets_mutex);
+    ticket->_queued = true;
+    _tickets.push_back(ticket);
+    pop_done_tickets();
+}
+
+void FSMCaller::on_ticket_done(ApplyTicket* ticket) {
+    butil::Status st;
+    {
+        BAIDU_SCOPED_LOCK(_tickets_mutex);
+        ticket->_done = true;
+        if (!ticket->status().ok() && !_ticket_failed) {
+            _ticket_failed = true;
+            st = ticket->status();
+        }
+        // Otherwise it's run inside on_apply and will be queued after
+        if (ticket->_queued) {
+            pop_done_tickets();
+        }
+    }
+    // |ticket| might have been deleted
+    if (!st.ok()) {
+        Error e;
+        e.set_type(ERROR_TYPE_STATE_MACHINE);
+        e.status().set_error(ESTATEMACHINE,
+                "StateMachine failed to apply the tasks of a ticket, %s",
+                st.error_cstr());
+        on_error(e);
+    }
+}
+
+void FSMCaller::pop_done_tickets() {
+    while (!_tickets.empty() && _tickets.front()->_done) {
+        ApplyTicket* ticket = _tickets.front();
+        _tickets.pop_front();
+        // The logs are never applied after a failed ticket
+        if (!_ticket_failed) {
+            set_applied(ticket->_applied_index, ticket->_applied_id);
+        }
+        delete ticket;
+    }
+    if (_tickets.empty() && _tickets_drained) {
+        _tickets_drained->signal();
+        _tickets_drained = NULL;
+    }
+}
+
+void FSMCaller::wait_tickets() {
+    bthread::CountdownEvent drained(1);
+    {
+        BAIDU_SCOPED_LOCK(_tickets_mutex);
+        if (_tickets.empty()) {
+            return;
+        }
+        _tickets_drained = &drained;
+    }
+    drained.wait();
+}
+
+bool FSMCaller::flush_lanes(Error* error, int64_t* failed_index) {
+    if (_lane_pending == 0) {
+        return true;
+    }
+    g_lane_tasks_batch_counter << _lane_pending;
+    _lane_pending = 0;
+    std::vector<LaneArg> args;
+    for (size_t i = 0; i < _lanes.size(); ++i) {
+        if (!_lanes[i].empty()) {
+            LaneArg arg;
+            arg.caller = this;
+            arg.lane = i;
+            arg.failed_index = 0;
+            args.push_back(arg);
+        }
+    }
+    // The last lane is applied in this thread
+    std::vector<bthread_t> tids(args.size() - 1, INVALID_BTHREAD);
+    bthread_attr_t attr = _usercode_in_pthread
+                          ? BTHREAD_ATTR_PTHREAD
+                          : bthread_attr_of_tag(BTHREAD_ATTR_NORMAL, _bthread_tag);
+    for (size_t i = 0; i < tids.size(); ++i) {
+        if (bthread_start_background(&tids[i], &attr, run_lane, &args[i]) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            tids[i] = INVALID_BTHREAD;
+            apply_lane(&args[i]);
+        }
+    }
+    apply_lane(&args.back());
+    for (size_t i = 0; i < tids.size(); ++i) {
+        if (tids[i] != INVALID_BTHREAD) {
+            bthread_join(tids[i], NULL);
+        }
+    }
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i].failed_index > 0 && (*failed_index == 0
+                    || args[i].failed_index < *failed_index)) {
+            *failed_index = args[i].failed_index;
+            *error = args[i].error;
+        }
+    }
+    return *failed_index == 0;
+}
+
+void* FSMCaller::run_lane(void* arg) {
+    LaneArg* lane_arg = (LaneArg*)arg;
+    lane_arg->caller->apply_lane(lane_arg);
+    return NULL;
+}
+
+void FSMCaller::apply_lane(LaneArg* arg) {
+    std::vector<LaneTask>& tasks = _lanes[arg->lane];
+    IteratorImpl iter_impl(&tasks);
+    while (iter_impl.is_good()) {
+        Iterator iter(&iter_impl);
+        _parallel_fsm->on_apply_lane(arg->lane, iter);
+        LOG_IF(ERROR, iter.valid())
+                << "Node " << _node->node_id()
+                << " Iterator of lane " << arg->lane << " is still valid, did"
+                   " you return before iterator reached the end?";
+        iter.next();
+    }
+    if (iter_impl.has_error()) {
+        arg->error = iter_impl.error();
+        arg->failed_index = iter_impl.index();
+        std::vector<google::protobuf::Closure*> dones;
+        for (size_t i = iter_impl._lane_index; i < tasks.size(); ++i) {
+            if (tasks[i].done) {
+                tasks[i].done->status() = arg->error.status();
+                dones.push_back(tasks[i].done);
+            }
+        }
+        run_closures_in_bthread(&dones, _usercode_in_pthread);
+    }
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        tasks[i].entry->Release();
+    }
+    tasks.clear();
 }
 
 int FSMCaller::on_snapshot_save(SaveSnapshotClosure* done) {
@@ -317,6 +581,8 @@ int FSMCaller::on_snapshot_save(SaveSnapshotClosure* done) {
 
 void FSMCaller::do_snapshot_save(SaveSnapshotClosure* done) {
     CHECK(done);
+    // The snapshot includes the tasks handed over with tickets
+    wait_tickets();
 
     int64_t last_applied_index = _last_applied_index.load(butil::memory_order_relaxed);
 
@@ -335,6 +601,11 @@ void FSMCaller::do_snapshot_save(SaveSnapshotClosure* done) {
             iter != conf_entry.old_conf.end(); ++iter) { 
         *meta.add_old_peers() = iter->to_string();
     }
+    for (Configuration::const_iterator
+            iter = conf_entry.learners.begin();
+            iter != conf_entry.learners.end(); ++iter) { 
+        *meta.add_learners() = iter->to_string();
+    }
 
     SnapshotWriter* writer = done->start(meta);
     if (!writer) {
@@ -343,10 +614,42 @@ void FSMCaller::do_snapshot_save(SaveSnapshotClosure* done) {
         return;
     }
 
+    if (_witness) {
+        // The snapshot of a witness is the meta only
+        done->Run();
+        return;
+    }
+    SnapshotHook* hook = _fsm->on_snapshot_freeze();
+    if (hook) {
+        // Save the frozen view in background and go on applying
+        SaveHookArg* arg = new SaveHookArg;
+        arg->hook = hook;
+        arg->writer = writer;
+        arg->done = done;
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, save_snapshot_hook, arg) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            save_snapshot_hook(arg);
+        }
+        return;
+    }
     _fsm->on_snapshot_save(writer, done);
     return;
 }
 
+void* FSMCaller::save_snapshot_hook(void* arg) {
+    SaveHookArg* a = (SaveHookArg*)arg;
+    const int rc = a->hook->save(a->writer);
+    if (rc != 0) {
+        a->done->status().set_error(rc, "Fail to save the frozen view : %s",
+                                    berror(rc));
+    }
+    delete a->hook;
+    a->done->Run();
+    delete a;
+    return NULL;
+}
+
 int FSMCaller::on_snapshot_load(LoadSnapshotClosure* done) {
     ApplyTask task;
     task.type = SNAPSHOT_LOAD;
@@ -356,6 +659,7 @@ int FSMCaller::on_snapshot_load(LoadSnapshotClosure* done) {
 
 void FSMCaller::do_snapshot_load(LoadSnapshotClosure* done) {
     //TODO done_guard
+    wait_tickets();
     SnapshotReader* reader = done->start();
     if (!reader) {
         done->status().set_error(EINVAL, "open SnapshotReader failed");
@@ -392,7 +696,8 @@ void FSMCaller::do_snapshot_load(LoadSnapshotClosure* done) {
         return done->Run();
     }
 
-    ret = _fsm->on_snapshot_load(reader);
+    // A witness has no state machine to reset
+    ret = _witness ? 0 : _fsm->on_snapshot_load(reader);
     if (ret != 0) {
         done->status().set_error(ret, "StateMachine on_snapshot_load failed");
         done->Run();
@@ -415,9 +720,85 @@ void FSMCaller::do_snapshot_load(LoadSnapshotClosure* done) {
     _last_applied_index.store(meta.last_included_index(),
                               butil::memory_order_release);
     _last_applied_term = meta.last_included_term();
+    _last_iterated_index = meta.last_included_index();
+    notify_applied(meta.last_included_index());
     done->Run();
 }
 
+int FSMCaller::load_applied_index() {
+    if (_witness) {
+        return 0;
+    }
+    const int64_t index = _fsm->on_applied_index_load();
+    if (index <= _last_applied_index.load(butil::memory_order_relaxed)) {
+        return 0;
+    }
+    const int64_t term = _log_manager->get_term(index);
+    if (term == 0) {
+        // The StateMachine is ahead of the logs, which were lost
+        LOG(ERROR) << "Fail to skip to the applied_index=" << index
+                   << " of StateMachine, last_log_index="
+                   << _log_manager->last_log_index();
+        return -1;
+    }
+    LOG(INFO) << "Skip the logs from " << _last_iterated_index + 1 << " to "
+              << index << " which are applied by StateMachine";
+    // Nothing runs in the queue now
+    _last_iterated_index = index;
+    set_applied(index, LogId(index, term));
+    return 0;
+}
+
+void FSMCaller::wait_applied(int64_t index, Closure* done) {
+    {
+        // Pairs with notify_applied, which locks after updating
+        // _last_applied_index
+        BAIDU_SCOPED_LOCK(_applied_waiters_mutex);
+        if (!_applied_waiters_status.ok()) {
+            done->status() = _applied_waiters_status;
+        } else if (_last_applied_index.load(butil::memory_order_acquire)
+                        < index) {
+            _applied_waiters.insert(std::make_pair(index, done));
+            return;
+        }
+    }
+    run_closure_in_bthread(done);
+}
+
+void FSMCaller::notify_applied(int64_t applied_index) {
+    std::vector<google::protobuf::Closure*> dones;
+    {
+        BAIDU_SCOPED_LOCK(_applied_waiters_mutex);
+        std::multimap<int64_t, Closure*>::iterator it = _applied_waiters.begin();
+        while (it != _applied_waiters.end() && it->first <= applied_index) {
+            dones.push_back(it->second);
+            _applied_waiters.erase(it++);
+        }
+    }
+    // Don't block applying the logs with the closures of the users, which
+    // run in one bthread
+    run_closures_in_bthread(&dones, _usercode_in_pthread);
+}
+
+void FSMCaller::stop_applied_waiters(const butil::Status& st) {
+    std::multimap<int64_t, Closure*> applied_waiters;
+    {
+        BAIDU_SCOPED_LOCK(_applied_waiters_mutex);
+        if (!_applied_waiters_status.ok()) {
+            return;
+        }
+        _applied_waiters_status = st;
+        applied_waiters.swap(_applied_waiters);
+    }
+    std::vector<google::protobuf::Closure*> dones;
+    for (std::multimap<int64_t, Closure*>::iterator
+            it = applied_waiters.begin(); it != applied_waiters.end(); ++it) {
+        it->second->status() = st;
+        dones.push_back(it->second);
+    }
+    run_closures_in_bthread(&dones, _usercode_in_pthread);
+}
+
 int FSMCaller::on_leader_stop(const butil::Status& status) {
     ApplyTask task;
     task.type = LEADER_STOP;
@@ -533,23 +914,125 @@ void FSMCaller::join() {
     }
 }
 
-IteratorImpl::IteratorImpl(StateMachine* sm, LogManager* lm,
+IteratorImpl::IteratorImpl(FSMCaller* caller, StateMachine* sm, LogManager* lm,
                           std::vector<Closure*> *closure, 
                           int64_t first_closure_index,
                           int64_t last_applied_index, 
                           int64_t committed_index,
-                          butil::atomic<int64_t>* applying_index)
-        : _sm(sm)
+                          butil::atomic<int64_t>* applying_index,
+                          bool skip_partitioned)
+        : _caller(caller)
+        , _sm(sm)
         , _lm(lm)
         , _closure(closure)
         , _first_closure_index(first_closure_index)
         , _cur_index(last_applied_index)
         , _committed_index(committed_index)
         , _cur_entry(NULL)
+        , _sub_index(0)
+        , _last_batch_index(0)
+        , _partition_key(-1)
+        , _skip_partitioned(skip_partitioned)
+        , _lane_tasks(NULL)
+        , _lane_index(0)
+        , _chunk_pos(0)
+        , _prefetch_tid(INVALID_BTHREAD)
+        , _ticket(NULL)
         , _applying_index(applying_index)
 { next(); }
 
+IteratorImpl::IteratorImpl(std::vector<LaneTask>* lane_tasks)
+        : _caller(NULL)
+        , _sm(NULL)
+        , _lm(NULL)
+        , _closure(NULL)
+        , _first_closure_index(0)
+        , _cur_index(0)
+        , _committed_index(0)
+        , _cur_entry(NULL)
+        , _sub_index(0)
+        , _last_batch_index(0)
+        , _partition_key(-1)
+        , _skip_partitioned(false)
+        , _lane_tasks(lane_tasks)
+        , _lane_index(0)
+        , _chunk_pos(0)
+        , _prefetch_tid(INVALID_BTHREAD)
+        , _ticket(NULL)
+        , _applying_index(NULL)
+{ set_lane_cursor(); }
+
+IteratorImpl::~IteratorImpl() {
+    CHECK(_ticket == NULL);
+    join_prefetch();
+    for (size_t i = 0; i < _prefetch.entries.size(); ++i) {
+        _prefetch.entries[i]->Release();
+    }
+    for (size_t i = _chunk_pos; i < _chunk.size(); ++i) {
+        _chunk[i]->Release();
+    }
+}
+
+void IteratorImpl::set_lane_cursor() {
+    if (_lane_index < _lane_tasks->size()) {
+        // The lane holds the references of the logs
+        _cur_entry = (*_lane_tasks)[_lane_index].entry;
+        _cur_index = _cur_entry->id.index;
+    } else {
+        _cur_entry = NULL;
+    }
+}
+
+void TaskBatchClosure::Run() {
+    std::vector<google::protobuf::Closure*> dones;
+    for (size_t i = _applied; i < _dones.size(); ++i) {
+        if (_dones[i]) {
+            _dones[i]->status() = status();
+            dones.push_back(_dones[i]);
+        }
+    }
+    run_closures_in_bthread(&dones, _usercode_in_pthread);
+    delete this;
+}
+
+TaskBatchClosure* IteratorImpl::batch_closure() const {
+    if (_cur_entry == NULL || _cur_entry->type != ENTRY_TYPE_DATA_BATCH
+            || _cur_index < _first_closure_index) {
+        return NULL;
+    }
+    // Only the leader appending the log has its closure, which is always
+    // a TaskBatchClosure
+    return static_cast<TaskBatchClosure*>(
+            (*_closure)[_cur_index - _first_closure_index]);
+}
+
+bool IteratorImpl::is_task() const {
+    if (!is_good() || !is_data_entry(_cur_entry->type)) {
+        return false;
+    }
+    return !_skip_partitioned
+            || _cur_entry->type != ENTRY_TYPE_PARTITIONED_DATA;
+}
+
 void IteratorImpl::next() {
+    if (_lane_tasks) {
+        ++_lane_index;
+        return set_lane_cursor();
+    }
+    if (_cur_entry && _cur_entry->type == ENTRY_TYPE_DATA_BATCH) {
+        if (++_sub_index < _sub_datas.size()) {
+            return;
+        }
+        // All the tasks are handed over
+        TaskBatchClosure* done = batch_closure();
+        if (done) {
+            done->set_applied(_sub_datas.size());
+            done->Run();
+        }
+        _last_batch_index = _cur_index;
+        _sub_datas.clear();
+        _sub_index = 0;
+    }
     if (_cur_entry) {
         _cur_entry->Release();
         _cur_entry = NULL;
@@ -557,23 +1040,150 @@ void IteratorImpl::next() {
     if (_cur_index <= _committed_index) {
         ++_cur_index;
         if (_cur_index <= _committed_index) {
-            _cur_entry = _lm->get_entry(_cur_index);
+            _cur_entry = fetch_entry(_cur_index);
             if (_cur_entry == NULL) {
                 _error.set_type(ERROR_TYPE_LOG);
                 _error.status().set_error(-1,
                         "Fail to get entry at index=%" PRId64
                         " while committed_index=%" PRId64,
                         _cur_index, _committed_index);
+            } else if (_cur_entry->type == ENTRY_TYPE_DATA_BATCH) {
+                butil::Status st = parse_data_batch(_cur_entry->data,
+                                                    &_sub_datas);
+                if (!st.ok() || _sub_datas.empty()) {
+                    _error.set_type(ERROR_TYPE_LOG);
+                    _error.status().set_error(-1,
+                            "Fail to parse the tasks of entry at index=%"
+                            PRId64 ", %s", _cur_index, st.error_cstr());
+                }
+            } else if (_cur_entry->type == ENTRY_TYPE_PARTITIONED_DATA) {
+                butil::Status st = parse_partitioned_data(
+                        _cur_entry->data, &_partition_key, &_task_data);
+                if (!st.ok()) {
+                    _error.set_type(ERROR_TYPE_LOG);
+                    _error.status().set_error(-1,
+                            "Fail to parse the task of entry at index=%"
+                            PRId64 ", %s", _cur_index, st.error_cstr());
+                }
             }
             _applying_index->store(_cur_index, butil::memory_order_relaxed);
         }
     }
 }
 
+ApplyTicket* IteratorImpl::ticket() {
+    if (_ticket == NULL && _caller != NULL) {
+        _ticket = new ApplyTicket(_caller);
+    }
+    return _ticket;
+}
+
+ApplyTicket* IteratorImpl::release_ticket() {
+    ApplyTicket* ticket = _ticket;
+    _ticket = NULL;
+    return ticket;
+}
+
+LogEntry* IteratorImpl::fetch_entry(int64_t index) {
+    if (_chunk_pos >= _chunk.size()) {
+        fill_chunk(index);
+    }
+    if (_chunk_pos < _chunk.size() && _chunk[_chunk_pos]->id.index == index) {
+        return _chunk[_chunk_pos++];
+    }
+    return _lm->get_entry(index);
+}
+
+void IteratorImpl::fill_chunk(int64_t index) {
+    _chunk.clear();
+    _chunk_pos = 0;
+    if (_prefetch_tid != INVALID_BTHREAD) {
+        join_prefetch();
+        if (_prefetch.first_index == index) {
+            _chunk.swap(_prefetch.entries);
+        }
+        for (size_t i = 0; i < _prefetch.entries.size(); ++i) {
+            _prefetch.entries[i]->Release();
+        }
+        _prefetch.entries.clear();
+    }
+    if (_chunk.empty()) {
+        const size_t count = std::min((int64_t)FLAGS_raft_fsm_fetch_entries,
+                                      _committed_index - index + 1);
+        _lm->get_entries(index, count, FLAGS_raft_fsm_fetch_max_bytes, &_chunk);
+    }
+    // Stay one chunk ahead of the iteration when the logs are read from the
+    // storage, e.g. replaying the logs after restart or catching up with a
+    // backlog, so that the reads overlap with the state machine
+    const int64_t next_index = index + _chunk.size();
+    if (!_chunk.empty() && next_index <= _committed_index
+            && !_lm->in_memory(next_index)) {
+        start_prefetch(next_index);
+    }
+}
+
+void IteratorImpl::start_prefetch(int64_t first_index) {
+    _prefetch.lm = _lm;
+    _prefetch.first_index = first_index;
+    _prefetch.count = std::min((int64_t)FLAGS_raft_fsm_fetch_entries,
+                               _committed_index - first_index + 1);
+    if (bthread_start_background(&_prefetch_tid, NULL,
+                                 run_prefetch, &_prefetch) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        _prefetch_tid = INVALID_BTHREAD;
+    }
+}
+
+void* IteratorImpl::run_prefetch(void* arg) {
+    Prefetch* prefetch = (Prefetch*)arg;
+    prefetch->lm->get_entries(prefetch->first_index, prefetch->count,
+                              FLAGS_raft_fsm_fetch_max_bytes,
+                              &prefetch->entries);
+    return NULL;
+}
+
+void IteratorImpl::join_prefetch() {
+    if (_prefetch_tid == INVALID_BTHREAD) {
+        return;
+    }
+    bthread_join(_prefetch_tid, NULL);
+    _prefetch_tid = INVALID_BTHREAD;
+}
+
+const butil::IOBuf& IteratorImpl::data() const {
+    if (_lane_tasks) {
+        return (*_lane_tasks)[_lane_index].data;
+    }
+    if (_cur_entry->type == ENTRY_TYPE_DATA_BATCH) {
+        return _sub_datas[_sub_index];
+    }
+    if (_cur_entry->type == ENTRY_TYPE_PARTITIONED_DATA) {
+        return _task_data;
+    }
+    return _cur_entry->data;
+}
+
+int64_t IteratorImpl::partition_key() const {
+    if (_lane_tasks) {
+        return (*_lane_tasks)[_lane_index].partition_key;
+    }
+    if (_cur_entry && _cur_entry->type == ENTRY_TYPE_PARTITIONED_DATA) {
+        return _partition_key;
+    }
+    return -1;
+}
+
 Closure* IteratorImpl::done() const {
+    if (_lane_tasks) {
+        return (*_lane_tasks)[_lane_index].done;
+    }
     if (_cur_index < _first_closure_index) {
         return NULL;
     }
+    if (_cur_entry && _cur_entry->type == ENTRY_TYPE_DATA_BATCH) {
+        TaskBatchClosure* done = batch_closure();
+        return done ? done->sub_done(_sub_index) : NULL;
+    }
     return (*_closure)[_cur_index - _first_closure_index];
 }
 
@@ -583,11 +1193,38 @@ void IteratorImpl::set_error_and_rollback(
         CHECK(false) << "Invalid ntail=" << ntail;
         return;
     }
-    if (_cur_entry == NULL || _cur_entry->type != ENTRY_TYPE_DATA) {
+    if (_lane_tasks) {
+        // The tasks of the lane before the first rolled back one are applied
+        _lane_index -= std::min(ntail - 1, _lane_index);
+        set_lane_cursor();
+        _error.set_type(ERROR_TYPE_STATE_MACHINE);
+        _error.status().set_error(ESTATEMACHINE,
+                "StateMachine meet critical error when applying one "
+                " or more tasks of a lane since index=%" PRId64 ", %s",
+                _cur_index, (st ? st->error_cstr() : "none"));
+        return;
+    }
+    if (_cur_entry == NULL || !is_data_entry(_cur_entry->type)) {
         _cur_index -= ntail;
+    } else if (_cur_entry->type == ENTRY_TYPE_DATA_BATCH) {
+        // The tasks before the current one in this log are counted first
+        TaskBatchClosure* done = batch_closure();
+        if (ntail <= _sub_index + 1) {
+            if (done) {
+                done->set_applied(_sub_index + 1 - ntail);
+            }
+        } else {
+            if (done) {
+                done->set_applied(0);
+            }
+            _cur_index -= (ntail - _sub_index - 1);
+        }
+        _sub_datas.clear();
+        _sub_index = 0;
     } else {
         _cur_index -= (ntail - 1);
     }
+    _cur_index = std::max(_cur_index, _last_batch_index + 1);
     if (_cur_entry) {
         _cur_entry->Release();
         _cur_entry = NULL;
@@ -600,14 +1237,16 @@ void IteratorImpl::set_error_and_rollback(
 }
 
 void IteratorImpl::run_the_rest_closure_with_error() {
+    std::vector<google::protobuf::Closure*> dones;
     for (int64_t i = std::max(_cur_index, _first_closure_index);
             i <= _committed_index; ++i) {
         Closure* done = (*_closure)[i - _first_closure_index];
         if (done) {
             done->status() = _error.status();
-            run_closure_in_bthread(done);
+            dones.push_back(done);
         }
     }
+    run_closures_in_bthread(&dones, _caller->_usercode_in_pthread);
 }
 
 }  //  namespace braft
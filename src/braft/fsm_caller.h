@@ -19,9 +19,13 @@
 #ifndef  BRAFT_FSM_CALLER_H
 #define  BRAFT_FSM_CALLER_H
 
+#include <map>
+#include <deque>
+#include <vector>
 #include <butil/macros.h>                        // BAIDU_CACHELINE_ALIGNMENT
 #include <bthread/bthread.h>
 #include <bthread/execution_queue.h>
+#include <bthread/countdown_event.h>
 #include "braft/ballot_box.h"
 #include "braft/closure_queue.h"
 #include "braft/macros.h"
@@ -30,13 +34,69 @@
 namespace braft {
 
 class NodeImpl;
+class FSMCaller;
 class LogManager;
 class StateMachine;
+class ParallelStateMachine;
 class SnapshotMeta;
 class OnErrorClousre;
 struct LogEntry;
 class LeaderChangeContext;
 
+// Closure of an ENTRY_TYPE_DATA_BATCH log, which holds the closures of the
+// tasks packed in the log. Run() fails the closures of the tasks that are not
+// applied with the status of this closure, and deletes this closure.
+class TaskBatchClosure : public Closure {
+public:
+    TaskBatchClosure(std::vector<Closure*>* dones, bool usercode_in_pthread)
+        : _applied(0), _usercode_in_pthread(usercode_in_pthread) {
+        _dones.swap(*dones);
+    }
+    Closure* sub_done(size_t index) const {
+        return index < _dones.size() ? _dones[index] : NULL;
+    }
+    // The first |n| tasks are handed over to StateMachine
+    void set_applied(size_t n) { _applied = n; }
+    void Run();
+
+private:
+    std::vector<Closure*> _dones;
+    size_t _applied;
+    bool _usercode_in_pthread;
+};
+
+// Ticket of the tasks handed over by one StateMachine::on_apply, which is
+// taken by Iterator::ticket(). Run() it once the tasks are applied, and a
+// failed status is reported as an error of the state machine.
+class ApplyTicket : public Closure {
+public:
+    void Run();
+
+private:
+friend class FSMCaller;
+    explicit ApplyTicket(FSMCaller* caller)
+        : _caller(caller), _applied_index(0), _done(false), _queued(false) {}
+    ~ApplyTicket() {}
+
+    FSMCaller* _caller;
+    // Set once on_apply returns
+    int64_t _applied_index;
+    LogId _applied_id;
+    // Protected by the mutex of the tickets in FSMCaller
+    bool _done;
+    bool _queued;
+};
+
+// A task dispatched to an apply lane of ParallelStateMachine
+struct LaneTask {
+    LaneTask() : entry(NULL), partition_key(-1), done(NULL) {}
+    // Holds a reference
+    LogEntry* entry;
+    butil::IOBuf data;
+    int64_t partition_key;
+    Closure* done;
+};
+
 // Backing implementation of Iterator
 class IteratorImpl {
     DISALLOW_COPY_AND_ASSIGN(IteratorImpl);
@@ -44,22 +104,52 @@ public:
     // Move to the next
     void next();
     LogEntry* entry() const { return _cur_entry; }
-    bool is_good() const { return _cur_index <= _committed_index && !has_error(); }
+    bool is_good() const {
+        if (_lane_tasks) {
+            return _lane_index < _lane_tasks->size() && !has_error();
+        }
+        return _cur_index <= _committed_index && !has_error();
+    }
+    // Whether the current log is a task for StateMachine::on_apply, the tasks
+    // with partition keys are left to the lanes if |skip_partitioned| is set
+    bool is_task() const;
+    // Data of the current task, which is one of the tasks packed in the
+    // current log if it's ENTRY_TYPE_DATA_BATCH
+    const butil::IOBuf& data() const;
+    int64_t partition_key() const;
     Closure* done() const;
+    // Ticket of the tasks iterated by the current on_apply, which is created
+    // on the first call. NULL in the lanes of ParallelStateMachine
+    ApplyTicket* ticket();
     void set_error_and_rollback(size_t ntail, const butil::Status* st);
     bool has_error() const { return _error.type() != ERROR_TYPE_NONE; }
     const Error& error() const { return _error; }
     int64_t index() const { return _cur_index; }
     void run_the_rest_closure_with_error();
 private:
-    IteratorImpl(StateMachine* sm, LogManager* lm, 
+    IteratorImpl(FSMCaller* caller, StateMachine* sm, LogManager* lm, 
                  std::vector<Closure*> *closure,
                  int64_t first_closure_index,
                  int64_t last_applied_index,
                  int64_t committed_index,
-                 butil::atomic<int64_t>* applying_index);
-    ~IteratorImpl() {}
+                 butil::atomic<int64_t>* applying_index,
+                 bool skip_partitioned);
+    // Iterates the tasks of an apply lane
+    explicit IteratorImpl(std::vector<LaneTask>* lane_tasks);
+    ~IteratorImpl();
+    // Hand over the ticket taken by the last on_apply, if any
+    ApplyTicket* release_ticket();
+    TaskBatchClosure* batch_closure() const;
+    void set_lane_cursor();
+    // Returns the log at |index| with a reference, which is fetched along
+    // with the following logs in chunks
+    LogEntry* fetch_entry(int64_t index);
+    void fill_chunk(int64_t index);
+    void start_prefetch(int64_t first_index);
+    void join_prefetch();
+    static void* run_prefetch(void* arg);
 friend class FSMCaller;
+    FSMCaller* _caller;
     StateMachine* _sm;
     LogManager* _lm;
     std::vector<Closure*> *_closure;
@@ -67,6 +157,31 @@ friend class FSMCaller;
     int64_t _cur_index;
     int64_t _committed_index;
     LogEntry* _cur_entry;
+    // Tasks packed in _cur_entry
+    std::vector<butil::IOBuf> _sub_datas;
+    size_t _sub_index;
+    // The closures of ENTRY_TYPE_DATA_BATCH logs are released once all the
+    // tasks are iterated, so rollback stops after the last of them
+    int64_t _last_batch_index;
+    // Task in _cur_entry if it's ENTRY_TYPE_PARTITIONED_DATA
+    int64_t _partition_key;
+    butil::IOBuf _task_data;
+    bool _skip_partitioned;
+    std::vector<LaneTask>* _lane_tasks;
+    size_t _lane_index;
+    // Logs fetched but not iterated yet, starting from _chunk[_chunk_pos]
+    std::vector<LogEntry*> _chunk;
+    size_t _chunk_pos;
+    // Chunk being fetched in the background, which is next to _chunk
+    struct Prefetch {
+        LogManager* lm;
+        int64_t first_index;
+        size_t count;
+        std::vector<LogEntry*> entries;
+    };
+    Prefetch _prefetch;
+    bthread_t _prefetch_tid;
+    ApplyTicket* _ticket;
     butil::atomic<int64_t>* _applying_index;
     Error _error;
 };
@@ -79,7 +194,9 @@ struct FSMCallerOptions {
         , closure_queue(NULL)
         , node(NULL)
         , usercode_in_pthread(false)
+        , witness(false)
         , bootstrap_id()
+        , bthread_tag(-1)
     {}
     LogManager *log_manager;
     StateMachine *fsm;
@@ -87,7 +204,11 @@ struct FSMCallerOptions {
     ClosureQueue* closure_queue;
     NodeImpl* node;
     bool usercode_in_pthread;
+    // Don't apply the logs or load the snapshots into |fsm|
+    bool witness;
     LogId bootstrap_id;
+    // Tag of the bthread workers applying the logs, -1 for any
+    int bthread_tag;
 };
 
 class SaveSnapshotClosure : public Closure {
@@ -111,6 +232,10 @@ public:
     BRAFT_MOCK int on_committed(int64_t committed_index);
     BRAFT_MOCK int on_snapshot_load(LoadSnapshotClosure* done);
     BRAFT_MOCK int on_snapshot_save(SaveSnapshotClosure* done);
+    // Skip the logs up to the index reported by
+    // StateMachine::on_applied_index_load, called after the snapshot is loaded
+    // and before any log is committed
+    int load_applied_index();
     int on_leader_stop(const butil::Status& status);
     int on_leader_start(int64_t term);
     int on_start_following(const LeaderChangeContext& start_following_context);
@@ -120,11 +245,15 @@ public:
         return _last_applied_index.load(butil::memory_order_relaxed);
     }
     int64_t applying_index() const;
+    // Run |done| in a bthread once the logs up to |index| are applied, or
+    // with an error if this FSMCaller shuts down or fails before that
+    void wait_applied(int64_t index, Closure* done);
     void describe(std::ostream& os, bool use_html);
     void join();
 private:
 
 friend class IteratorImpl;
+friend class ApplyTicket;
 
     enum TaskType {
         IDLE,
@@ -164,6 +293,12 @@ friend class IteratorImpl;
     void do_committed(int64_t committed_index);
     void do_cleared(int64_t log_index, Closure* done, int error_code);
     void do_snapshot_save(SaveSnapshotClosure* done);
+    struct SaveHookArg {
+        SnapshotHook* hook;
+        SnapshotWriter* writer;
+        SaveSnapshotClosure* done;
+    };
+    static void* save_snapshot_hook(void* arg);
     void do_snapshot_load(LoadSnapshotClosure* done);
     void do_on_error(OnErrorClousre* done);
     void do_leader_stop(const butil::Status& status);
@@ -172,19 +307,60 @@ friend class IteratorImpl;
     void do_stop_following(const LeaderChangeContext& stop_following_context);
     void set_error(const Error& e);
     bool pass_by_status(Closure* done);
+    void notify_applied(int64_t applied_index);
+    // Fail the current and the future waiters of wait_applied with |st|
+    void stop_applied_waiters(const butil::Status& st);
+    // Apply the tasks dispatched to the lanes and wait for all of them.
+    // Returns false and sets |error| and |failed_index| if some lane fails
+    bool flush_lanes(Error* error, int64_t* failed_index);
+    struct LaneArg {
+        FSMCaller* caller;
+        int lane;
+        Error error;
+        int64_t failed_index;
+    };
+    static void* run_lane(void* arg);
+    void apply_lane(LaneArg* arg);
+    // The logs up to |ticket| count as applied once it and all the tickets
+    // before are done
+    void queue_ticket(ApplyTicket* ticket);
+    void on_ticket_done(ApplyTicket* ticket);
+    // Must be called with _tickets_mutex held
+    void pop_done_tickets();
+    // Wait until all the queued tickets are done
+    void wait_tickets();
+    void set_applied(int64_t applied_index, const LogId& applied_id);
 
     bthread::ExecutionQueueId<ApplyTask> _queue_id;
     LogManager *_log_manager;
     StateMachine *_fsm;
+    // Not NULL if _fsm is a ParallelStateMachine
+    ParallelStateMachine* _parallel_fsm;
+    std::vector<std::vector<LaneTask> > _lanes;
+    size_t _lane_pending;
+    bool _usercode_in_pthread;
+    int _bthread_tag;
     ClosureQueue* _closure_queue;
     butil::atomic<int64_t> _last_applied_index;
     int64_t _last_applied_term;
+    // The logs up to this one have been handed over to _fsm, which are
+    // ahead of _last_applied_index when some tickets are not done
+    int64_t _last_iterated_index;
+    raft_mutex_t _tickets_mutex;
+    std::deque<ApplyTicket*> _tickets;
+    bthread::CountdownEvent* _tickets_drained;
+    bool _ticket_failed;
     google::protobuf::Closure* _after_shutdown;
     NodeImpl* _node;
     TaskType _cur_task;
     butil::atomic<int64_t> _applying_index;
     Error _error;
     bool _queue_started;
+    bool _witness;
+    raft_mutex_t _applied_waiters_mutex;
+    std::multimap<int64_t, Closure*> _applied_waiters;
+    // Not OK once no more logs would be applied
+    butil::Status _applied_waiters_status;
 };
 
 };
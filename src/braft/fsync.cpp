@@ -15,7 +15,22 @@
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
 #include "braft/fsync.h"
+#include <pthread.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>                   // major, minor
+#endif
+#include <errno.h>
+#include <map>
+#include <vector>
+#include <bthread/bthread.h>
+#include <bthread/mutex.h>
+#include <bthread/condition_variable.h>
+#include <bvar/bvar.h>
+#include <butil/string_printf.h>
+#include <butil/time.h>
 #include <brpc/reloadable_flags.h>  //BRPC_VALIDATE_GFLAG
+#include "braft/macros.h"
 
 namespace braft {
 
@@ -26,4 +41,271 @@ DEFINE_bool(raft_use_fsync_rather_than_fdatasync,
 BRPC_VALIDATE_GFLAG(raft_use_fsync_rather_than_fdatasync,
                          brpc::PassValidate);
 
+DEFINE_int32(raft_group_commit_window_us, 0,
+             "Syncs of log storages issued in this window are flushed together, "
+             "0 to sync each one at once");
+BRPC_VALIDATE_GFLAG(raft_group_commit_window_us, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_group_commit_use_syncfs, true,
+            "Flush the files of one group commit on the same device with one "
+            "syncfs rather than syncing them one by one");
+BRPC_VALIDATE_GFLAG(raft_group_commit_use_syncfs, brpc::PassValidate);
+
+DEFINE_int64(raft_slow_disk_p99_us, 0,
+             "A disk is regarded as slow if the p99 latency of the syncs on it "
+             "in the last bvar window exceeds this value, 0 to disable");
+BRPC_VALIDATE_GFLAG(raft_slow_disk_p99_us, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_slow_disk_transfer_leader, false,
+            "Transfer the leadership away from the leaders of which the log "
+            "storage is on a slow disk, see raft_slow_disk_p99_us");
+BRPC_VALIDATE_GFLAG(raft_slow_disk_transfer_leader, brpc::PassValidate);
+
+static bvar::IntRecorder g_group_commit_size("raft_group_commit_size");
+static bvar::Adder<int64_t> g_group_commit_syncfs("raft_group_commit_syncfs");
+
+namespace {
+
+// Sync latency of each disk, created on the first sync on it
+struct DiskLatencies {
+    raft_mutex_t mutex;
+    std::map<uint64_t, bvar::LatencyRecorder*> disks;
+};
+
+DiskLatencies* get_disk_latencies() {
+    static DiskLatencies* latencies = new DiskLatencies;
+    return latencies;
+}
+
+bvar::LatencyRecorder* disk_latency(uint64_t disk, bool create) {
+    DiskLatencies* latencies = get_disk_latencies();
+    BAIDU_SCOPED_LOCK(latencies->mutex);
+    std::map<uint64_t, bvar::LatencyRecorder*>::iterator
+            it = latencies->disks.find(disk);
+    if (it != latencies->disks.end()) {
+        return it->second;
+    }
+    if (!create) {
+        return NULL;
+    }
+    bvar::LatencyRecorder* latency = new bvar::LatencyRecorder;
+    latency->expose(butil::string_printf("raft_fsync_disk_%u_%u",
+                                         (unsigned)major(disk),
+                                         (unsigned)minor(disk)));
+    latencies->disks[disk] = latency;
+    return latency;
+}
+
+void record_sync(uint64_t disk, int64_t latency_us) {
+    // Keep the errno of the sync for the callers
+    const int saved_errno = errno;
+    *disk_latency(disk, true) << latency_us;
+    errno = saved_errno;
+}
+
+int do_fsync(int fd) {
+    if (FLAGS_raft_use_fsync_rather_than_fdatasync) {
+        return fsync(fd);
+    } else {
+#ifdef __APPLE__
+        return fcntl(fd, F_FULLFSYNC);
+#else
+        return fdatasync(fd);
+#endif
+    }
+}
+
+struct SyncRequest {
+    int fd;
+    int rc;
+    bool done;
+};
+
+struct GroupCommitter {
+    GroupCommitter() : leader_active(false) {}
+    bthread::Mutex mutex;
+    bthread::ConditionVariable cond;
+    std::vector<SyncRequest*> pending;
+    bool leader_active;
+};
+
+GroupCommitter* get_group_committer() {
+    static GroupCommitter* committer = new GroupCommitter;
+    return committer;
+}
+
+void flush_group(const std::vector<SyncRequest*>& batch) {
+    g_group_commit_size << batch.size();
+    // Group the requests by device and drop the duplicated fds
+    std::map<dev_t, std::map<int, std::vector<SyncRequest*> > > devices;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        struct stat st_buf;
+        if (fstat(batch[i]->fd, &st_buf) != 0) {
+            batch[i]->rc = -1;
+            continue;
+        }
+        devices[st_buf.st_dev][batch[i]->fd].push_back(batch[i]);
+    }
+    for (std::map<dev_t, std::map<int, std::vector<SyncRequest*> > >::iterator
+            it = devices.begin(); it != devices.end(); ++it) {
+        std::map<int, std::vector<SyncRequest*> >& fds = it->second;
+#if defined(__linux__)
+        if (FLAGS_raft_group_commit_use_syncfs && fds.size() > 1) {
+            const int64_t start_us = butil::cpuwide_time_us();
+            const int rc = syncfs(fds.begin()->first);
+            record_sync(it->first, butil::cpuwide_time_us() - start_us);
+            g_group_commit_syncfs << 1;
+            for (std::map<int, std::vector<SyncRequest*> >::iterator
+                    fit = fds.begin(); fit != fds.end(); ++fit) {
+                for (size_t i = 0; i < fit->second.size(); ++i) {
+                    fit->second[i]->rc = rc;
+                }
+            }
+            continue;
+        }
+#endif
+        for (std::map<int, std::vector<SyncRequest*> >::iterator
+                fit = fds.begin(); fit != fds.end(); ++fit) {
+            const int rc = raft_fsync(fit->first);
+            for (size_t i = 0; i < fit->second.size(); ++i) {
+                fit->second[i]->rc = rc;
+            }
+        }
+    }
+}
+
+}  // namespace
+
+int raft_fsync(int fd) {
+    struct stat st_buf;
+    if (fstat(fd, &st_buf) != 0) {
+        return do_fsync(fd);
+    }
+    const int64_t start_us = butil::cpuwide_time_us();
+    const int rc = do_fsync(fd);
+    record_sync(st_buf.st_dev, butil::cpuwide_time_us() - start_us);
+    return rc;
+}
+
+int raft_fsync_dir(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    const int rc = raft_fsync(fd);
+    const int saved_errno = errno;
+    ::close(fd);
+    errno = saved_errno;
+    return rc;
+}
+
+int64_t raft_disk_sync_p99_us(uint64_t disk) {
+    bvar::LatencyRecorder* latency = disk_latency(disk, false);
+    return latency ? latency->latency_percentile(0.99) : 0;
+}
+
+bool raft_disk_is_slow(uint64_t disk) {
+    const int64_t threshold_us = FLAGS_raft_slow_disk_p99_us;
+    return threshold_us > 0 && disk != 0 &&
+           raft_disk_sync_p99_us(disk) > threshold_us;
+}
+
+static bthread_key_t g_deferred_syncs_key;
+static pthread_once_t g_deferred_syncs_once = PTHREAD_ONCE_INIT;
+
+static void create_deferred_syncs_key() {
+    CHECK_EQ(0, bthread_key_create(&g_deferred_syncs_key, NULL));
+}
+
+DeferredSyncs::DeferredSyncs() : _owner(NULL) {
+    pthread_once(&g_deferred_syncs_once, create_deferred_syncs_key);
+    _prev = bthread_getspecific(g_deferred_syncs_key);
+    bthread_setspecific(g_deferred_syncs_key, this);
+}
+
+DeferredSyncs::~DeferredSyncs() {
+    flush();
+    bthread_setspecific(g_deferred_syncs_key, _prev);
+}
+
+int DeferredSyncs::flush(const void* owner) {
+    if (!_fds.empty()) {
+        std::vector<SyncRequest> reqs(_fds.size());
+        std::vector<SyncRequest*> batch(_fds.size());
+        for (size_t i = 0; i < _fds.size(); ++i) {
+            reqs[i].fd = _fds[i].first;
+            reqs[i].rc = 0;
+            reqs[i].done = false;
+            batch[i] = &reqs[i];
+        }
+        flush_group(batch);
+        for (size_t i = 0; i < reqs.size(); ++i) {
+            if (reqs[i].rc != 0) {
+                PLOG(ERROR) << "Fail to sync fd=" << reqs[i].fd;
+                _failed_owners.insert(_fds[i].second);
+            }
+            ::close(_fds[i].first);
+        }
+        _fds.clear();
+    }
+    // Reported once, the next round of the owner starts clean
+    return _failed_owners.erase(owner) == 0 ? 0 : -1;
+}
+
+bool DeferredSyncs::defer(int fd) {
+    pthread_once(&g_deferred_syncs_once, create_deferred_syncs_key);
+    DeferredSyncs* syncs =
+            (DeferredSyncs*)bthread_getspecific(g_deferred_syncs_key);
+    if (syncs == NULL) {
+        return false;
+    }
+    // Keep the file open until it's synced
+    const int dup_fd = dup(fd);
+    if (dup_fd < 0) {
+        return false;
+    }
+    syncs->_fds.push_back(std::make_pair(dup_fd, syncs->_owner));
+    return true;
+}
+
+int raft_group_fsync(int fd) {
+    if (DeferredSyncs::defer(fd)) {
+        return 0;
+    }
+    const int window_us = FLAGS_raft_group_commit_window_us;
+    if (window_us <= 0) {
+        return raft_fsync(fd);
+    }
+    GroupCommitter* gc = get_group_committer();
+    SyncRequest req;
+    req.fd = fd;
+    req.rc = 0;
+    req.done = false;
+    std::unique_lock<bthread::Mutex> lck(gc->mutex);
+    gc->pending.push_back(&req);
+    while (!req.done) {
+        if (gc->leader_active) {
+            gc->cond.wait(lck);
+            continue;
+        }
+        // Become the leader of this window, which flushes all the requests
+        // pending by the end of the window
+        gc->leader_active = true;
+        lck.unlock();
+        bthread_usleep(window_us);
+        lck.lock();
+        std::vector<SyncRequest*> batch;
+        batch.swap(gc->pending);
+        lck.unlock();
+        flush_group(batch);
+        lck.lock();
+        for (size_t i = 0; i < batch.size(); ++i) {
+            batch[i]->done = true;
+        }
+        gc->leader_active = false;
+        gc->cond.notify_all();
+    }
+    return req.rc;
+}
+
 }  //  namespace braft
@@ -20,24 +20,74 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <set>
+#include <vector>
 #include <gflags/gflags.h>
+#include <butil/macros.h>
 #include "braft/storage.h"
 
 namespace braft {
 
 DECLARE_bool(raft_use_fsync_rather_than_fdatasync);
+DECLARE_int32(raft_group_commit_window_us);
+DECLARE_int64(raft_slow_disk_p99_us);
+DECLARE_bool(raft_slow_disk_transfer_leader);
 
-inline int raft_fsync(int fd) {
-    if (FLAGS_raft_use_fsync_rather_than_fdatasync) {
-        return fsync(fd);
-    } else {
-#ifdef __APPLE__
-        return fcntl(fd, F_FULLFSYNC);
-#else
-        return fdatasync(fd);
-#endif
-    }
-}
+// Flush |fd| with fsync, or fdatasync if raft_use_fsync_rather_than_fdatasync
+// is off. The latency is recorded into the bvar raft_fsync_disk_<major>_<minor>
+// of the device where |fd| is.
+int raft_fsync(int fd);
+
+// Sync the directory at |path| so that the files created, renamed or
+// unlinked in it are durable.
+// Returns 0 on success, -1 otherwise
+int raft_fsync_dir(const std::string& path);
+
+// Same as raft_fsync, but waits for raft_group_commit_window_us so that the
+// fds synced by other threads (e.g. disk threads of other raft groups) in the
+// same window are flushed together, files on the same device are flushed
+// with one syncfs if raft_group_commit_use_syncfs is on. Deferred if there's
+// a DeferredSyncs in the scope of the caller.
+int raft_group_fsync(int fd);
+
+// Defers the raft_group_fsync() calls of the current bthread (or pthread)
+// within its scope, the fds are synced together by flush() or when it goes
+// out of scope, with one syncfs per device if raft_group_commit_use_syncfs is
+// on. The deferred calls return 0 at once, so callers must not regard the
+// data as durable before flush() succeeds.
+class DeferredSyncs {
+public:
+    DeferredSyncs();
+    ~DeferredSyncs();
+
+    // Attribute the syncs deferred from now on to |owner|, e.g. the
+    // LogManager writing in a shared disk thread
+    void set_owner(const void* owner) { _owner = owner; }
+
+    // Sync the fds deferred so far, of all the owners.
+    // Returns 0 if all the syncs of |owner| since the last flush(owner) have
+    // succeeded, -1 otherwise
+    int flush(const void* owner = NULL);
+
+    // Called by raft_group_fsync, returns false if |fd| is not deferred
+    static bool defer(int fd);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DeferredSyncs);
+    // The deferred fds and their owners
+    std::vector<std::pair<int, const void*> > _fds;
+    // The owners of the failed syncs not reported by flush() yet
+    std::set<const void*> _failed_owners;
+    const void* _owner;
+    void* _prev;
+};
+
+// The p99 latency in microseconds of the syncs on |disk| (st_dev of the
+// files) in the last bvar window, 0 if nothing was synced on it
+int64_t raft_disk_sync_p99_us(uint64_t disk);
+
+// Whether the p99 sync latency of |disk| exceeds raft_slow_disk_p99_us
+bool raft_disk_is_slow(uint64_t disk);
 
 inline bool raft_sync_meta() {
     return FLAGS_raft_sync || FLAGS_raft_sync_meta;
@@ -0,0 +1,197 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/leader_balancer.h"
+
+#include <pthread.h>
+#include <vector>
+#include <butil/logging.h>
+#include <butil/fast_rand.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/node.h"
+#include "braft/node_manager.h"
+#include "braft/replicator.h"
+
+namespace braft {
+
+DEFINE_bool(raft_enable_leader_balance, false,
+            "Transfer the leaderships from the servers of this process "
+            "holding more leaders than their share to the followers holding "
+            "less, see LeaderBalancer");
+BRPC_VALIDATE_GFLAG(raft_enable_leader_balance, ::brpc::PassValidate);
+
+DEFINE_int32(raft_leader_balance_interval_ms, 10000,
+             "Interval between two rounds of leader balancing");
+BRPC_VALIDATE_GFLAG(raft_leader_balance_interval_ms, brpc::PositiveInteger);
+
+DEFINE_int32(raft_leader_balance_max_transfers, 8,
+             "Maximum of the leaderships transferred by the leader balancer "
+             "in one round");
+BRPC_VALIDATE_GFLAG(raft_leader_balance_max_transfers,
+                    brpc::NonNegativeInteger);
+
+static bvar::Adder<int64_t> g_leader_balance_transfers(
+        "raft_leader_balance_transfers");
+
+static pthread_once_t g_leader_balancer_once = PTHREAD_ONCE_INIT;
+static LeaderBalancer* g_leader_balancer = NULL;
+
+LeaderBalancer* LeaderBalancer::get_instance() {
+    struct Creator {
+        static void create() {
+            g_leader_balancer = new LeaderBalancer;
+            bthread_t tid;
+            if (bthread_start_background(&tid, NULL, run,
+                                         g_leader_balancer) != 0) {
+                PLOG(ERROR) << "Fail to start the leader balancer";
+            }
+        }
+    };
+    pthread_once(&g_leader_balancer_once, Creator::create);
+    return g_leader_balancer;
+}
+
+void LeaderBalancer::set_weight(const butil::EndPoint& addr, int weight) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _weights[addr] = weight;
+    std::map<butil::EndPoint, Load>::iterator it = _loads.find(addr);
+    if (it != _loads.end()) {
+        it->second.weight = weight;
+    }
+}
+
+int LeaderBalancer::get_load(const butil::EndPoint& addr, int* leader_count,
+                             int* weight) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::map<butil::EndPoint, Load>::const_iterator it = _loads.find(addr);
+    if (it == _loads.end()) {
+        return -1;
+    }
+    *leader_count = it->second.leader_count;
+    *weight = it->second.weight;
+    return 0;
+}
+
+void* LeaderBalancer::run(void* arg) {
+    LeaderBalancer* balancer = (LeaderBalancer*)arg;
+    while (true) {
+        bthread_usleep(FLAGS_raft_leader_balance_interval_ms * 1000L);
+        if (FLAGS_raft_enable_leader_balance) {
+            balancer->balance();
+        }
+    }
+    return NULL;
+}
+
+void LeaderBalancer::balance() {
+    std::vector<scoped_refptr<NodeImpl> > nodes;
+    NodeManager::GetInstance()->get_all_nodes(&nodes);
+    std::map<butil::EndPoint, Load> loads;
+    std::vector<scoped_refptr<NodeImpl> > leaders;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        Load& load = loads[nodes[i]->node_id().peer_id.addr];
+        if (nodes[i]->is_leader()) {
+            ++load.leader_count;
+            leaders.push_back(nodes[i]);
+        }
+    }
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        for (std::map<butil::EndPoint, Load>::iterator
+                it = loads.begin(); it != loads.end(); ++it) {
+            std::map<butil::EndPoint, int>::const_iterator
+                    weight_it = _weights.find(it->first);
+            if (weight_it != _weights.end()) {
+                it->second.weight = weight_it->second;
+            }
+        }
+        _loads = loads;
+    }
+
+    // Visit the leaders in random order so that the same groups are not
+    // always the ones to move
+    for (size_t i = leaders.size(); i > 1; --i) {
+        std::swap(leaders[i - 1], leaders[butil::fast_rand_less_than(i)]);
+    }
+    // The leaders moved to the remote servers in this round, which are not
+    // yet reported by them
+    std::map<butil::EndPoint, int> moved;
+    int budget = FLAGS_raft_leader_balance_max_transfers;
+    std::vector<PeerLeaderLoad> peers;
+    for (size_t i = 0; i < leaders.size() && budget > 0; ++i) {
+        NodeImpl* node = leaders[i].get();
+        Load& source = loads[node->node_id().peer_id.addr];
+        if (source.leader_count <= 0 ||
+                node->list_leader_loads(&peers) != 0) {
+            continue;
+        }
+        const PeerLeaderLoad* target = NULL;
+        int target_count = 0;
+        int target_weight = 0;
+        for (size_t j = 0; j < peers.size(); ++j) {
+            const PeerLeaderLoad& peer = peers[j];
+            std::map<butil::EndPoint, Load>::const_iterator
+                    local_it = loads.find(peer.peer_id.addr);
+            const int weight = local_it != loads.end()
+                    ? local_it->second.weight : peer.weight;
+            const int count = local_it != loads.end()
+                    ? local_it->second.leader_count
+                    : peer.leader_count + moved[peer.peer_id.addr];
+            if (weight <= 0) {
+                continue;
+            }
+            // Move only if the source still holds no less than its share
+            // after the move, so that the leaders don't bounce back
+            if ((int64_t)(source.leader_count - 1) * weight <
+                    (int64_t)(count + 1) * source.weight) {
+                continue;
+            }
+            // Pick the peer of the lowest load after the move
+            if (target == NULL ||
+                    (int64_t)(count + 1) * target_weight <
+                        (int64_t)(target_count + 1) * weight) {
+                target = &peer;
+                target_count = count;
+                target_weight = weight;
+            }
+        }
+        if (target == NULL) {
+            continue;
+        }
+        LOG(INFO) << "node " << node->node_id()
+                  << " transfers leadership to " << target->peer_id
+                  << " to balance the leaders, "
+                  << node->node_id().peer_id.addr << " holds "
+                  << source.leader_count << " of weight " << source.weight
+                  << " and " << target->peer_id.addr << " holds "
+                  << target_count;
+        if (node->transfer_leadership_to(target->peer_id) != 0) {
+            continue;
+        }
+        g_leader_balance_transfers << 1;
+        --budget;
+        --source.leader_count;
+        std::map<butil::EndPoint, Load>::iterator
+                local_it = loads.find(target->peer_id.addr);
+        if (local_it != loads.end()) {
+            ++local_it->second.leader_count;
+        } else {
+            ++moved[target->peer_id.addr];
+        }
+    }
+}
+
+}  //  namespace braft
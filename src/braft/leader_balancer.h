@@ -0,0 +1,73 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_LEADER_BALANCER_H
+#define BRAFT_LEADER_BALANCER_H
+
+#include <map>
+#include <gflags/gflags.h>
+#include <butil/macros.h>
+#include <butil/endpoint.h>
+#include "braft/macros.h"
+
+namespace braft {
+
+DECLARE_bool(raft_enable_leader_balance);
+
+// Process-wide balancer of the leaders of the groups in this process. With
+// raft_enable_leader_balance, each server reports the number of leaders it
+// holds to the leaders of its groups in the responses of AppendEntries, and
+// every raft_leader_balance_interval_ms the balancer transfers the
+// leaderships from the servers of this process holding more than their
+// share to the followers holding less, at most
+// raft_leader_balance_max_transfers of them each time.
+//
+// The share of a server is in proportion to its weight, which is 1 by
+// default and gossiped along with its leader count, e.g. the servers far
+// from the clients could be given lower weights. The servers of weight 0
+// hold no leaders if possible.
+class LeaderBalancer {
+public:
+    // Get the instance, which starts balancing on the first call
+    static LeaderBalancer* get_instance();
+
+    // Set the weight of the server at |addr| in this process
+    void set_weight(const butil::EndPoint& addr, int weight);
+
+    // Get the number of the leaders held by the server at |addr| in this
+    // process counted the last time, and its weight.
+    // Returns 0 on success, -1 if it's not counted yet
+    int get_load(const butil::EndPoint& addr, int* leader_count, int* weight);
+
+private:
+    LeaderBalancer() {}
+    DISALLOW_COPY_AND_ASSIGN(LeaderBalancer);
+
+    struct Load {
+        Load() : leader_count(0), weight(1) {}
+        int leader_count;
+        int weight;
+    };
+
+    static void* run(void* arg);
+    void balance();
+
+    raft_mutex_t _mutex;
+    std::map<butil::EndPoint, Load> _loads;
+    std::map<butil::EndPoint, int> _weights;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_LEADER_BALANCER_H
@@ -18,6 +18,9 @@
 
 #include "braft/log.h"
 
+#include <fcntl.h>                                   // O_DIRECT
+#include <sys/mman.h>                                // mmap
+#include <sys/stat.h>                                // fstat
 #include <gflags/gflags.h>
 #include <butil/files/dir_reader_posix.h>            // butil::DirReaderPosix
 #include <butil/file_util.h>                         // butil::CreateDirectory
@@ -25,6 +28,8 @@
 #include <butil/time.h>
 #include <butil/raw_pack.h>                          // butil::RawPacker
 #include <butil/fd_utility.h>                        // butil::make_close_on_exec
+#include <butil/memory/singleton_on_pthread_once.h>  // butil::get_leaky_singleton
+#include <bthread/execution_queue.h>                 // bthread::ExecutionQueue
 #include <brpc/reloadable_flags.h>             // 
 
 #include "braft/local_storage.pb.h"
@@ -37,6 +42,7 @@
 //#define BRAFT_SEGMENT_CLOSED_PATTERN "log_%020ld_%020ld"
 #define BRAFT_SEGMENT_OPEN_PATTERN "log_inprogress_%020" PRId64
 #define BRAFT_SEGMENT_CLOSED_PATTERN "log_%020" PRId64 "_%020" PRId64
+#define BRAFT_SEGMENT_RECYCLED_PATTERN "log_recycled_%020" PRId64
 #define BRAFT_SEGMENT_META_FILE  "log_meta"
 
 namespace braft {
@@ -51,6 +57,84 @@ BRPC_VALIDATE_GFLAG(raft_max_segment_size, brpc::PositiveInteger);
 DEFINE_bool(raft_sync_segments, false, "call fsync when a segment is closed");
 BRPC_VALIDATE_GFLAG(raft_sync_segments, ::brpc::PassValidate);
 
+DEFINE_bool(raft_segment_mmap_read, false,
+            "Read the entries of closed segments through mmap, the data of the "
+            "entries reference the mapped pages without copying");
+BRPC_VALIDATE_GFLAG(raft_segment_mmap_read, ::brpc::PassValidate);
+
+DEFINE_bool(raft_preallocate_segment, false,
+            "Allocate the whole file of the open segment up front and reuse the "
+            "files of the segments dropped by truncate_prefix, so that appending "
+            "doesn't change the size of the file");
+BRPC_VALIDATE_GFLAG(raft_preallocate_segment, ::brpc::PassValidate);
+
+DEFINE_int32(raft_max_recycled_segments, 2,
+             "Max number of segment files kept for reusing when "
+             "raft_preallocate_segment is on");
+BRPC_VALIDATE_GFLAG(raft_max_recycled_segments, ::brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_segment_direct_io, false,
+            "Write the open segment with O_DIRECT, entries appended in one batch "
+            "are written in aligned blocks without going through page cache");
+BRPC_VALIDATE_GFLAG(raft_segment_direct_io, ::brpc::PassValidate);
+
+DEFINE_int32(raft_load_segment_concurrency, 1,
+             "Number of bthreads loading the closed segments concurrently when "
+             "SegmentLogStorage is initialized");
+BRPC_VALIDATE_GFLAG(raft_load_segment_concurrency, brpc::PositiveInteger);
+
+DEFINE_bool(raft_segment_index_footer, true,
+            "Append an index footer to a segment when it's closed, so that the "
+            "segment can be loaded without scanning all the entries. NOTE: "
+            "segments with footers can't be loaded by the older versions");
+BRPC_VALIDATE_GFLAG(raft_segment_index_footer, ::brpc::PassValidate);
+
+DEFINE_int32(raft_segment_reclaim_bytes_per_second, 0,
+             "Max bytes per second of all the unlinked segments to be reclaimed "
+             "by the background reclaimer, which truncates a segment gradually "
+             "before unlinking it. 0 means unlinking directly");
+BRPC_VALIDATE_GFLAG(raft_segment_reclaim_bytes_per_second,
+                    brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_log_hot_segments, 4,
+             "Number of the latest closed segments kept in the primary "
+             "directory, the older ones are moved to the cold path of the log "
+             "storage in the background if it's configured");
+BRPC_VALIDATE_GFLAG(raft_log_hot_segments, brpc::NonNegativeInteger);
+
+static bool validate_log_compress_type(const char*, int32_t value) {
+    return value >= 0 && value <= 2;
+}
+DEFINE_int32(raft_log_compress_type, 0,
+             "Compress the data of entries written to segments, "
+             "0: none, 1: snappy, 2: zlib");
+BRPC_VALIDATE_GFLAG(raft_log_compress_type, validate_log_compress_type);
+
+DEFINE_int32(raft_log_compress_min_size, 1024,
+             "Data of entries shorter than this is written uncompressed");
+BRPC_VALIDATE_GFLAG(raft_log_compress_min_size, brpc::NonNegativeInteger);
+
+static bool validate_log_checksum_type(const char*, int32_t value) {
+    return value >= -1 && value <= 1;
+}
+DEFINE_int32(raft_log_checksum_type, -1,
+             "Checksum type of entries written by new SegmentLogStorages, "
+             "0: murmurhash32, 1: crc32c, -1: crc32c if the CPU supports it "
+             "with hardware instructions, murmurhash32 otherwise");
+BRPC_VALIDATE_GFLAG(raft_log_checksum_type, validate_log_checksum_type);
+
+DEFINE_int32(raft_segment_fd_cache_size, 0,
+             "Max number of fds kept open for the closed segments of all the "
+             "log storages in this process, which are opened on the first read "
+             "and closed in LRU order. 0 keeps the fds of all the closed "
+             "segments open");
+BRPC_VALIDATE_GFLAG(raft_segment_fd_cache_size, brpc::NonNegativeInteger);
+
+static bvar::Adder<int64_t> g_segment_fd_cache_count(
+                                        "raft_segment_fd_cache_count");
+static bvar::Adder<int64_t> g_segment_fd_cache_miss(
+                                        "raft_segment_fd_cache_miss");
+
 int ftruncate_uninterrupted(int fd, off_t length) {
     int rc = 0;
     do {
@@ -66,16 +150,141 @@ enum CheckSumType {
 
 // Format of Header, all fields are in network order
 // | -------------------- term (64bits) -------------------------  |
-// | entry-type (8bits) | checksum_type (8bits) | reserved(16bits) |
+// | entry-type (8bits) | compress_type (4bits) | checksum_type (4bits) |
+// | salt (16bits)                                                 |
 // | ------------------ data len (32bits) -----------------------  |
 // | data_checksum (32bits) | header checksum (32bits)             |
+//
+// Data len and data checksum are of the data stored, which is compressed if
+// compress_type is not COMPRESS_NONE. Segments written before compression was
+// supported always have zero in compress_type.
+//
+// The space after the last entry of a preallocated open segment is either
+// zeros, which reads as an all-zero header marking the end of valid data, or
+// the stale entries of the segment that used the file before. Entries of
+// different uses of a file have different salts, so that the stale ones are
+// never taken as valid.
 
 const static size_t ENTRY_HEADER_SIZE = 24;
 
+// Format of the index footer appended to a closed segment, all fields are in
+// network order
+// | ------------------ offset of entry (64bits) ----------------- | x entry_count
+// | ----------------------- term (64bits) ---------------------- |
+// | -------------------- run length (32bits) ------------------- | x run_count
+// | -------- index of configuration - first_index (32bits) ----- | x conf_count
+// | ----------------------- magic (64bits) --------------------- |
+// | --------------------- data end (64bits) -------------------- |
+// | entry_count (32bits) | run_count (32bits)                     |
+// | conf_count (32bits) | checksum_type (8bits) | reserved (24bits) |
+// | body checksum (32bits) | trailer checksum (32bits)            |
+// Terms are stored as runs since they barely change inside a segment.
+
+const static size_t FOOTER_TRAILER_SIZE = 40;
+const static uint64_t FOOTER_MAGIC = 0x4252414654494458ULL;  // "BRAFTIDX"
+
+int SegmentIndex::push_back(int64_t offset, int64_t term) {
+    if (offset < 0 || offset > MAX_OFFSET) {
+        LOG(ERROR) << "Invalid offset=" << offset << " of segment entry";
+        return -1;
+    }
+    const size_t i = _size;
+    if (i % BLOCK_SIZE == 0) {
+        Block b;
+        b.base = offset;
+        b.wide_pos = NARROW_BLOCK;
+        _blocks.push_back(b);
+    }
+    Block& b = _blocks.back();
+    const uint32_t delta = offset - b.base;
+    if (b.wide_pos == NARROW_BLOCK && delta > 0xFFFF) {
+        // Move the deltas of this block into _wide_deltas
+        b.wide_pos = _wide_deltas.size();
+        _wide_deltas.resize(_wide_deltas.size() + BLOCK_SIZE, 0);
+        for (size_t j = i - i % BLOCK_SIZE; j < i; ++j) {
+            _wide_deltas[b.wide_pos + j % BLOCK_SIZE] = _deltas[j];
+        }
+    }
+    if (b.wide_pos == NARROW_BLOCK) {
+        _deltas.push_back(delta);
+    } else {
+        _deltas.push_back(0);
+        _wide_deltas[b.wide_pos + i % BLOCK_SIZE] = delta;
+    }
+    if (_term_runs.empty() || _term_runs.back().term != term) {
+        TermRun run;
+        run.term = term;
+        run.start = i;
+        _term_runs.push_back(run);
+    }
+    ++_size;
+    return 0;
+}
+
+int64_t SegmentIndex::term(size_t i) const {
+    size_t lo = 0;
+    size_t hi = _term_runs.size();
+    // Find the last run starting at or before i
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (_term_runs[mid].start <= i) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return _term_runs[lo].term;
+}
+
+void SegmentIndex::truncate(size_t n) {
+    if (n >= _size) {
+        return;
+    }
+    const size_t nblocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (size_t j = nblocks; j < _blocks.size(); ++j) {
+        if (_blocks[j].wide_pos != NARROW_BLOCK) {
+            // Wide deltas are allocated in the order of blocks
+            _wide_deltas.resize(_blocks[j].wide_pos);
+            break;
+        }
+    }
+    _blocks.resize(nblocks);
+    _deltas.resize(n);
+    while (!_term_runs.empty() && _term_runs.back().start >= n) {
+        _term_runs.pop_back();
+    }
+    _size = n;
+}
+
+void SegmentIndex::clear() {
+    _blocks.clear();
+    _deltas.clear();
+    _wide_deltas.clear();
+    _term_runs.clear();
+    _size = 0;
+}
+
+void SegmentIndex::swap(SegmentIndex& rhs) {
+    _blocks.swap(rhs._blocks);
+    _deltas.swap(rhs._deltas);
+    _wide_deltas.swap(rhs._wide_deltas);
+    _term_runs.swap(rhs._term_runs);
+    std::swap(_size, rhs._size);
+}
+
+size_t SegmentIndex::memory_usage() const {
+    return _blocks.capacity() * sizeof(Block)
+            + _deltas.capacity() * sizeof(uint16_t)
+            + _wide_deltas.capacity() * sizeof(uint32_t)
+            + _term_runs.capacity() * sizeof(TermRun);
+}
+
 struct Segment::EntryHeader {
     int64_t term;
     int type;
     int checksum_type;
+    int compress_type;
+    uint32_t salt;
     uint32_t data_len;
     uint32_t data_checksum;
 };
@@ -83,10 +292,185 @@ struct Segment::EntryHeader {
 std::ostream& operator<<(std::ostream& os, const Segment::EntryHeader& h) {
     os << "{term=" << h.term << ", type=" << h.type << ", data_len="
        << h.data_len << ", checksum_type=" << h.checksum_type
+       << ", compress_type=" << h.compress_type
        << ", data_checksum=" << h.data_checksum << '}';
     return os;
 }
 
+// LRU of the closed segments with open fds, shared by all the log storages in
+// the process to keep the fds within raft_segment_fd_cache_size. Segments in
+// use are skipped so the budget may be exceeded for a while.
+class SegmentFdCache {
+public:
+    SegmentFdCache() : _count(0) {}
+
+    // Mark |segment| as the most recently used and close the fds of the least
+    // recently used segments beyond the budget
+    void touch(const Segment* segment) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (segment->_in_fd_cache) {
+            _lru.splice(_lru.begin(), _lru, segment->_fd_cache_pos);
+        } else {
+            _lru.push_front(segment);
+            segment->_fd_cache_pos = _lru.begin();
+            segment->_in_fd_cache = true;
+            ++_count;
+            g_segment_fd_cache_count << 1;
+        }
+        const size_t budget = FLAGS_raft_segment_fd_cache_size;
+        std::list<const Segment*>::iterator it = _lru.end();
+        while (budget > 0 && _count > budget && it != _lru.begin()) {
+            --it;
+            const Segment* victim = *it;
+            if (victim == segment || !victim->_close_idle_fd()) {
+                continue;
+            }
+            it = _erase(victim);
+        }
+    }
+
+    // Close the fd of |segment| which is not going to be read soon
+    void evict(const Segment* segment) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (segment->_close_idle_fd() && segment->_in_fd_cache) {
+            _erase(segment);
+        }
+    }
+
+    // Called before |segment| is destroyed
+    void erase(const Segment* segment) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (segment->_in_fd_cache) {
+            _erase(segment);
+        }
+    }
+
+private:
+    std::list<const Segment*>::iterator _erase(const Segment* segment) {
+        segment->_in_fd_cache = false;
+        --_count;
+        g_segment_fd_cache_count << -1;
+        return _lru.erase(segment->_fd_cache_pos);
+    }
+
+    butil::Mutex _mutex;
+    std::list<const Segment*> _lru;
+    // std::list::size() is not O(1) with the old ABI
+    size_t _count;
+};
+
+static SegmentFdCache* segment_fd_cache() {
+    return butil::get_leaky_singleton<SegmentFdCache>();
+}
+
+// Pins the fd of a segment while reading or writing it
+class Segment::FdGuard {
+public:
+    explicit FdGuard(const Segment* segment)
+        : _segment(segment), _fd(segment->_acquire_fd()) {}
+    ~FdGuard() {
+        if (_fd >= 0) {
+            _segment->_release_fd();
+        }
+    }
+    int fd() const { return _fd; }
+private:
+    DISALLOW_COPY_AND_ASSIGN(FdGuard);
+    const Segment* _segment;
+    int _fd;
+};
+
+Segment::~Segment() {
+    segment_fd_cache()->erase(this);
+    _unmap();
+    _close_direct();
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+int Segment::_acquire_fd() const {
+    std::unique_lock<segment_mutex_t> lck(_mutex);
+    if (_fd < 0 && !_is_open) {
+        std::string path(_path);
+        butil::string_appendf(&path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                              _first_index, _last_index.load());
+        lck.unlock();
+        int fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0) {
+            PLOG(ERROR) << "Fail to open " << path;
+            return -1;
+        }
+        butil::make_close_on_exec(fd);
+        g_segment_fd_cache_miss << 1;
+        lck.lock();
+        if (_fd < 0) {
+            std::swap(fd, _fd);
+        }
+        if (fd >= 0) {
+            // Opened by another reader
+            ::close(fd);
+        }
+    }
+    if (_fd < 0) {
+        return -1;
+    }
+    ++_fd_readers;
+    const int fd = _fd;
+    const bool cached = !_is_open && FLAGS_raft_segment_fd_cache_size > 0;
+    lck.unlock();
+    if (cached) {
+        segment_fd_cache()->touch(this);
+    }
+    return fd;
+}
+
+void Segment::_release_fd() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    --_fd_readers;
+}
+
+bool Segment::_close_idle_fd() const {
+    int fd = -1;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_is_open || _fd_readers > 0) {
+            return false;
+        }
+        std::swap(fd, _fd);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    return true;
+}
+
+static int preallocate_file(int fd, off_t length) {
+#ifdef __APPLE__
+    (void)fd;
+    (void)length;
+    errno = ENOTSUP;
+    return -1;
+#else
+    int rc = 0;
+    do {
+        rc = ::fallocate(fd, 0, 0, length);
+    } while (rc == -1 && errno == EINTR);
+    return rc;
+#endif
+}
+
+void Segment::_preallocate() {
+    if (!FLAGS_raft_preallocate_segment) {
+        return;
+    }
+    if (preallocate_file(_fd, FLAGS_raft_max_segment_size) != 0) {
+        PLOG(WARNING) << "Fail to preallocate segment, path: " << _path
+                      << " first_index: " << _first_index;
+    }
+}
+
 int Segment::create() {
     if (!_is_open) {
         CHECK(false) << "Create on a closed segment at first_index=" 
@@ -99,12 +483,78 @@ int Segment::create() {
     _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (_fd >= 0) {
         butil::make_close_on_exec(_fd);
+        _preallocate();
+        _open_direct();
     }
     LOG_IF(INFO, _fd >= 0) << "Created new segment `" << path 
                            << "' with fd=" << _fd ;
     return _fd >= 0 ? 0 : -1;
 }
 
+int Segment::create_from(const std::string& recycled_path) {
+    if (!_is_open) {
+        CHECK(false) << "Create on a closed segment at first_index="
+                     << _first_index << " in " << _path;
+        return -1;
+    }
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
+    int fd = ::open(recycled_path.c_str(), O_RDWR);
+    if (fd < 0) {
+        PLOG(WARNING) << "Fail to open " << recycled_path;
+        return -1;
+    }
+    butil::make_close_on_exec(fd);
+    // Pick a salt different from the one of the stale entries, and wipe the
+    // first header so that the file reads as an empty segment until the
+    // first entry is written.
+    char header_buf[ENTRY_HEADER_SIZE];
+    uint32_t stale_salt = 0;
+    if (::pread(fd, header_buf, ENTRY_HEADER_SIZE, 0) == (ssize_t)ENTRY_HEADER_SIZE) {
+        uint32_t meta_field = 0;
+        RawUnpacker(header_buf + 8).unpack32(meta_field);
+        stale_salt = meta_field & 0xFFFF;
+    }
+    memset(header_buf, 0, sizeof(header_buf));
+    if (::pwrite(fd, header_buf, ENTRY_HEADER_SIZE, 0) != (ssize_t)ENTRY_HEADER_SIZE
+            || raft_fsync(fd) != 0) {
+        PLOG(WARNING) << "Fail to reset " << recycled_path;
+        ::close(fd);
+        return -1;
+    }
+    if (::rename(recycled_path.c_str(), path.c_str()) != 0) {
+        PLOG(WARNING) << "Fail to rename `" << recycled_path << "' to `"
+                      << path << '\'';
+        ::close(fd);
+        return -1;
+    }
+    _fd = fd;
+    _salt = (stale_salt + 1) & 0xFFFF;
+    _preallocate();
+    _open_direct();
+    LOG(INFO) << "Created new segment `" << path << "' from `" << recycled_path
+              << "' with fd=" << _fd;
+    return 0;
+}
+
+int Segment::recycle(const std::string& recycled_path) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_is_open || _mapping != NULL) {
+        // The pages of a mapped segment may be still referenced
+        return -1;
+    }
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                          _first_index, _last_index.load());
+    if (::rename(path.c_str(), recycled_path.c_str()) != 0) {
+        PLOG(WARNING) << "Fail to rename `" << path << "' to `"
+                      << recycled_path << '\'';
+        return -1;
+    }
+    LOG(INFO) << "Recycled segment `" << path << "' to `" << recycled_path << '\'';
+    return 0;
+}
+
 inline bool verify_checksum(int checksum_type,
                             const char* data, size_t len, uint32_t value) {
     switch (checksum_type) {
@@ -157,16 +607,96 @@ inline uint32_t get_checksum(int checksum_type, const butil::IOBuf& data) {
     }
 }
 
-int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
-                         size_t size_hint) const {
-    butil::IOPortal buf;
-    size_t to_read = std::max(size_hint, ENTRY_HEADER_SIZE);
-    const ssize_t n = file_pread(&buf, _fd, offset, to_read);
-    if (n != (ssize_t)to_read) {
-        return n < 0 ? -1 : 1;
+// A read-only mapping of a closed segment, referenced by the segment and by
+// all the IOBufs pointing to its pages. The pages are unmapped when the last
+// reference goes away, which may be after the segment is unlinked.
+struct MappedSegment {
+    void* addr;
+    size_t size;
+    butil::atomic<int64_t> nref;
+    // The unlinked file is reclaimed after the pages are unmapped, as
+    // truncating it gradually makes the mapped pages past the end SIGBUS
+    std::string reclaim_path;
+};
+
+static void reclaim_in_background(const std::string& file_path);
+
+#ifndef BRAFT_WITH_IOBUF_FUNCTION_DELETER
+// Maps the start address of each mapping to the mapping, so that the deleter
+// of the user-data blocks, which is only given the data pointer, is able to
+// find the mapping to release
+struct MappedSegmentRegistry {
+    raft_mutex_t mutex;
+    std::map<uintptr_t, MappedSegment*> mappings;
+};
+
+static MappedSegmentRegistry* mapped_segment_registry() {
+    static MappedSegmentRegistry* registry = new MappedSegmentRegistry;
+    return registry;
+}
+#endif  // BRAFT_WITH_IOBUF_FUNCTION_DELETER
+
+static MappedSegment* map_segment(int fd, size_t size) {
+    void* addr = ::mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        PLOG(WARNING) << "Fail to mmap fd=" << fd << " size=" << size;
+        return NULL;
     }
-    char header_buf[ENTRY_HEADER_SIZE];
-    const char *p = (const char *)buf.fetch(header_buf, ENTRY_HEADER_SIZE);
+    MappedSegment* m = new MappedSegment;
+    m->addr = addr;
+    m->size = size;
+    m->nref.store(1, butil::memory_order_relaxed);
+#ifndef BRAFT_WITH_IOBUF_FUNCTION_DELETER
+    MappedSegmentRegistry* registry = mapped_segment_registry();
+    BAIDU_SCOPED_LOCK(registry->mutex);
+    registry->mappings[(uintptr_t)addr] = m;
+#endif  // BRAFT_WITH_IOBUF_FUNCTION_DELETER
+    return m;
+}
+
+static void release_mapping(MappedSegment* m) {
+    if (m->nref.fetch_sub(1, butil::memory_order_release) != 1) {
+        return;
+    }
+    butil::atomic_thread_fence(butil::memory_order_acquire);
+#ifndef BRAFT_WITH_IOBUF_FUNCTION_DELETER
+    {
+        MappedSegmentRegistry* registry = mapped_segment_registry();
+        BAIDU_SCOPED_LOCK(registry->mutex);
+        registry->mappings.erase((uintptr_t)m->addr);
+    }
+#endif  // BRAFT_WITH_IOBUF_FUNCTION_DELETER
+    ::munmap(m->addr, m->size);
+    if (!m->reclaim_path.empty()) {
+        reclaim_in_background(m->reclaim_path);
+    }
+    delete m;
+}
+
+#ifdef BRAFT_WITH_IOBUF_FUNCTION_DELETER
+// Releases the mapping of the user-data block, which it carries
+struct MappedDataDeleter {
+    explicit MappedDataDeleter(MappedSegment* m) : mapping(m) {}
+    void operator()(void* /*data*/) const { release_mapping(mapping); }
+    MappedSegment* mapping;
+};
+#else
+static void release_mapped_data(void* data) {
+    MappedSegment* m = NULL;
+    {
+        MappedSegmentRegistry* registry = mapped_segment_registry();
+        BAIDU_SCOPED_LOCK(registry->mutex);
+        std::map<uintptr_t, MappedSegment*>::iterator
+                it = registry->mappings.upper_bound((uintptr_t)data);
+        CHECK(it != registry->mappings.begin());
+        --it;
+        m = it->second;
+    }
+    release_mapping(m);
+}
+#endif  // BRAFT_WITH_IOBUF_FUNCTION_DELETER
+
+static uint32_t unpack_entry_header(const char* p, Segment::EntryHeader* header) {
     int64_t term = 0;
     uint32_t meta_field;
     uint32_t data_len = 0;
@@ -177,12 +707,43 @@ int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
                   .unpack32(data_len)
                   .unpack32(data_checksum)
                   .unpack32(header_checksum);
+    header->term = term;
+    header->type = meta_field >> 24;
+    header->checksum_type = (meta_field >> 16) & 0x0F;
+    header->compress_type = (meta_field >> 20) & 0x0F;
+    header->salt = meta_field & 0xFFFF;
+    header->data_len = data_len;
+    header->data_checksum = data_checksum;
+    return header_checksum;
+}
+
+int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
+                         size_t size_hint) const {
+    MappedSegment* mapping = _acquire_mapping();
+    if (mapping) {
+        const int rc = _load_mapped_entry(mapping, offset, head, data);
+        release_mapping(mapping);
+        return rc;
+    }
+    FdGuard guard(this);
+    if (guard.fd() < 0) {
+        return -1;
+    }
+    butil::IOPortal buf;
+    size_t to_read = std::max(size_hint, ENTRY_HEADER_SIZE);
+    const ssize_t n = file_pread(&buf, guard.fd(), offset, to_read);
+    if (n != (ssize_t)to_read) {
+        return n < 0 ? -1 : 1;
+    }
+    char header_buf[ENTRY_HEADER_SIZE];
+    const char *p = (const char *)buf.fetch(header_buf, ENTRY_HEADER_SIZE);
+    if (is_zero(p, ENTRY_HEADER_SIZE)) {
+        // End of valid data of a preallocated segment
+        return 1;
+    }
     EntryHeader tmp;
-    tmp.term = term;
-    tmp.type = meta_field >> 24;
-    tmp.checksum_type = (meta_field << 8) >> 24;
-    tmp.data_len = data_len;
-    tmp.data_checksum = data_checksum;
+    const uint32_t header_checksum = unpack_entry_header(p, &tmp);
+    const uint32_t data_len = tmp.data_len;
     if (!verify_checksum(tmp.checksum_type, 
                         p, ENTRY_HEADER_SIZE - 4, header_checksum)) {
         LOG(ERROR) << "Found corrupted header at offset=" << offset
@@ -195,7 +756,8 @@ int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
     if (data != NULL) {
         if (buf.length() < ENTRY_HEADER_SIZE + data_len) {
             const size_t to_read = ENTRY_HEADER_SIZE + data_len - buf.length();
-            const ssize_t n = file_pread(&buf, _fd, offset + buf.length(), to_read);
+            const ssize_t n = file_pread(&buf, guard.fd(), offset + buf.length(),
+                                         to_read);
             if (n != (ssize_t)to_read) {
                 return n < 0 ? -1 : 1;
             }
@@ -217,6 +779,89 @@ int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
     return 0;
 }
 
+int Segment::_load_mapped_entry(MappedSegment* mapping, off_t offset,
+                                EntryHeader* head, butil::IOBuf* data) const {
+    if ((size_t)offset + ENTRY_HEADER_SIZE > mapping->size) {
+        return 1;
+    }
+    const char* p = (const char*)mapping->addr + offset;
+    if (is_zero(p, ENTRY_HEADER_SIZE)) {
+        return 1;
+    }
+    EntryHeader tmp;
+    const uint32_t header_checksum = unpack_entry_header(p, &tmp);
+    if (!verify_checksum(tmp.checksum_type,
+                         p, ENTRY_HEADER_SIZE - 4, header_checksum)) {
+        LOG(ERROR) << "Found corrupted header at offset=" << offset
+                   << ", header=" << tmp << ", path: " << _path;
+        return -1;
+    }
+    if (head != NULL) {
+        *head = tmp;
+    }
+    if (data != NULL) {
+        if ((size_t)offset + ENTRY_HEADER_SIZE + tmp.data_len > mapping->size) {
+            return 1;
+        }
+        p += ENTRY_HEADER_SIZE;
+        if (!verify_checksum(tmp.checksum_type, p, tmp.data_len,
+                             tmp.data_checksum)) {
+            LOG(ERROR) << "Found corrupted data at offset="
+                       << offset + ENTRY_HEADER_SIZE
+                       << " header=" << tmp
+                       << " path: " << _path;
+            return -1;
+        }
+        data->clear();
+        if (tmp.data_len > 0) {
+            // The block references the mapped pages directly
+            mapping->nref.fetch_add(1, butil::memory_order_relaxed);
+#ifdef BRAFT_WITH_IOBUF_FUNCTION_DELETER
+            if (data->append_user_data((void*)p, tmp.data_len,
+                                       MappedDataDeleter(mapping)) != 0) {
+#else
+            if (data->append_user_data((void*)p, tmp.data_len,
+                                       release_mapped_data) != 0) {
+#endif  // BRAFT_WITH_IOBUF_FUNCTION_DELETER
+                release_mapping(mapping);
+                data->append(p, tmp.data_len);
+            }
+        }
+    }
+    return 0;
+}
+
+MappedSegment* Segment::_acquire_mapping() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_mapping) {
+        _mapping->nref.fetch_add(1, butil::memory_order_relaxed);
+    }
+    return _mapping;
+}
+
+void Segment::_map() {
+    if (!FLAGS_raft_segment_mmap_read || _is_open || _bytes <= 0) {
+        return;
+    }
+    MappedSegment* mapping = map_segment(_fd, _bytes);
+    if (mapping) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        CHECK(_mapping == NULL);
+        _mapping = mapping;
+    }
+}
+
+void Segment::_unmap() {
+    MappedSegment* mapping = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::swap(mapping, _mapping);
+    }
+    if (mapping) {
+        release_mapping(mapping);
+    }
+}
+
 int Segment::_get_meta(int64_t index, LogMeta* meta) const {
     BAIDU_SCOPED_LOCK(_mutex);
     if (index > _last_index.load(butil::memory_order_relaxed) 
@@ -232,16 +877,196 @@ int Segment::_get_meta(int64_t index, LogMeta* meta) const {
         return -1;
     }
     int64_t meta_index = index - _first_index;
-    int64_t entry_cursor = _offset_and_term[meta_index].first;
+    int64_t entry_cursor = _offset_and_term.offset(meta_index);
     int64_t next_cursor = (index < _last_index.load(butil::memory_order_relaxed))
-                          ? _offset_and_term[meta_index + 1].first : _bytes;
+                          ? _offset_and_term.offset(meta_index + 1) : _bytes;
     DCHECK_LT(entry_cursor, next_cursor);
     meta->offset = entry_cursor;
-    meta->term = _offset_and_term[meta_index].second;
+    meta->term = _offset_and_term.term(meta_index);
     meta->length = next_cursor - entry_cursor;
     return 0;
 }
 
+int Segment::_write_footer() {
+    butil::IOBuf footer;
+    char buf[FOOTER_TRAILER_SIZE];
+    uint32_t entry_count = 0;
+    uint32_t run_count = 0;
+    uint32_t conf_count = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        entry_count = _offset_and_term.size();
+        conf_count = _configuration_indexes.size();
+        for (size_t i = 0; i < _offset_and_term.size(); ++i) {
+            RawPacker(buf).pack64(_offset_and_term.offset(i));
+            footer.append(buf, 8);
+        }
+        run_count = _offset_and_term.run_count();
+        for (size_t i = 0; i < run_count; ++i) {
+            RawPacker(buf).pack64(_offset_and_term.run_term(i))
+                          .pack32((uint32_t)_offset_and_term.run_length(i));
+            footer.append(buf, 12);
+        }
+        for (size_t i = 0; i < _configuration_indexes.size(); ++i) {
+            RawPacker(buf).pack32(
+                    (uint32_t)(_configuration_indexes[i] - _first_index));
+            footer.append(buf, 4);
+        }
+    }
+    RawPacker packer(buf);
+    packer.pack64(FOOTER_MAGIC)
+          .pack64(_bytes)
+          .pack32(entry_count)
+          .pack32(run_count)
+          .pack32(conf_count)
+          .pack32(_checksum_type << 24)
+          .pack32(get_checksum(_checksum_type, footer));
+    packer.pack32(get_checksum(_checksum_type, buf, FOOTER_TRAILER_SIZE - 4));
+    footer.append(buf, FOOTER_TRAILER_SIZE);
+    const ssize_t to_write = footer.length();
+    if (file_pwrite(footer, _fd, _bytes) != to_write) {
+        PLOG(WARNING) << "Fail to write index footer, path: " << _path
+                      << " first_index: " << _first_index;
+        // Drop the partial footer, the segment is still valid without it
+        ftruncate_uninterrupted(_fd, _bytes);
+        return -1;
+    }
+    return 0;
+}
+
+int Segment::_load_footer(int64_t file_size,
+                          ConfigurationManager* configuration_manager) {
+    if (file_size < (int64_t)FOOTER_TRAILER_SIZE) {
+        return -1;
+    }
+    butil::IOPortal portal;
+    const int64_t trailer_off = file_size - FOOTER_TRAILER_SIZE;
+    if (file_pread(&portal, _fd, trailer_off, FOOTER_TRAILER_SIZE)
+            != (ssize_t)FOOTER_TRAILER_SIZE) {
+        return -1;
+    }
+    char trailer_buf[FOOTER_TRAILER_SIZE];
+    const char* p = (const char*)portal.fetch(trailer_buf, FOOTER_TRAILER_SIZE);
+    uint64_t magic = 0;
+    uint64_t data_end = 0;
+    uint32_t entry_count = 0;
+    uint32_t run_count = 0;
+    uint32_t conf_count = 0;
+    uint32_t meta_field = 0;
+    uint32_t body_checksum = 0;
+    uint32_t trailer_checksum = 0;
+    RawUnpacker(p).unpack64(magic)
+                  .unpack64(data_end)
+                  .unpack32(entry_count)
+                  .unpack32(run_count)
+                  .unpack32(conf_count)
+                  .unpack32(meta_field)
+                  .unpack32(body_checksum)
+                  .unpack32(trailer_checksum);
+    if (magic != FOOTER_MAGIC) {
+        // Segments closed by the older versions have no footer
+        return -1;
+    }
+    const int checksum_type = meta_field >> 24;
+    if (!verify_checksum(checksum_type, p, FOOTER_TRAILER_SIZE - 4,
+                         trailer_checksum)) {
+        LOG(WARNING) << "Found corrupted index footer, path: " << _path
+                     << " first_index: " << _first_index;
+        return -1;
+    }
+    const int64_t body_len = (int64_t)entry_count * 8 + (int64_t)run_count * 12
+                             + (int64_t)conf_count * 4;
+    if ((int64_t)entry_count != _last_index.load() - _first_index + 1
+            || (int64_t)data_end + body_len != trailer_off) {
+        LOG(WARNING) << "Index footer mismatches, path: " << _path
+                     << " first_index: " << _first_index
+                     << " last_index: " << _last_index.load()
+                     << " entry_count: " << entry_count
+                     << " data_end: " << data_end
+                     << " file_size: " << file_size;
+        return -1;
+    }
+    portal.clear();
+    if (file_pread(&portal, _fd, data_end, body_len) != body_len) {
+        return -1;
+    }
+    if (!verify_checksum(checksum_type, portal, body_checksum)) {
+        LOG(WARNING) << "Found corrupted index footer, path: " << _path
+                     << " first_index: " << _first_index;
+        return -1;
+    }
+    std::string body;
+    portal.copy_to(&body);
+    p = body.data();
+    const char* offsets = p;
+    int64_t last_offset = -1;
+    for (uint32_t i = 0; i < entry_count; ++i, p += 8) {
+        uint64_t offset = 0;
+        RawUnpacker(p).unpack64(offset);
+        if (offset >= data_end || offset > (uint64_t)SegmentIndex::MAX_OFFSET
+                || (i == 0 && offset != 0)
+                || (int64_t)offset <= last_offset) {
+            LOG(WARNING) << "Invalid offset=" << offset << " in index footer"
+                         << ", path: " << _path << " first_index: " << _first_index;
+            return -1;
+        }
+        last_offset = offset;
+    }
+    SegmentIndex offset_and_term;
+    for (uint32_t i = 0; i < run_count; ++i, p += 12) {
+        uint64_t term = 0;
+        uint32_t run_length = 0;
+        RawUnpacker(p).unpack64(term).unpack32(run_length);
+        if (run_length > entry_count - offset_and_term.size()) {
+            return -1;
+        }
+        for (uint32_t j = 0; j < run_length; ++j) {
+            uint64_t offset = 0;
+            RawUnpacker(offsets + 8 * offset_and_term.size()).unpack64(offset);
+            // The offsets are checked above
+            offset_and_term.push_back(offset, term);
+        }
+    }
+    if (offset_and_term.size() != entry_count) {
+        return -1;
+    }
+    std::vector<int64_t> configuration_indexes;
+    std::vector<ConfigurationEntry> conf_entries;
+    for (uint32_t i = 0; i < conf_count; ++i, p += 4) {
+        uint32_t rel_index = 0;
+        RawUnpacker(p).unpack32(rel_index);
+        if (rel_index >= entry_count) {
+            return -1;
+        }
+        const int64_t offset = offset_and_term.offset(rel_index);
+        const int64_t next_offset = (rel_index + 1 < entry_count)
+                ? offset_and_term.offset(rel_index + 1) : (int64_t)data_end;
+        butil::IOBuf data;
+        if (_load_entry(offset, NULL, &data, next_offset - offset) != 0) {
+            return -1;
+        }
+        scoped_refptr<LogEntry> entry = new LogEntry();
+        if (entry == NULL) {
+            return -1;
+        }
+        entry->id.index = _first_index + rel_index;
+        entry->id.term = offset_and_term.term(rel_index);
+        if (!parse_configuration_meta(data, entry).ok()) {
+            return -1;
+        }
+        configuration_indexes.push_back(entry->id.index);
+        conf_entries.push_back(ConfigurationEntry(*entry));
+    }
+    // All checked, apply the footer
+    for (size_t i = 0; i < conf_entries.size(); ++i) {
+        configuration_manager->add(conf_entries[i]);
+    }
+    _offset_and_term.swap(offset_and_term);
+    _configuration_indexes.swap(configuration_indexes);
+    _bytes = data_end;
+    return 0;
+}
+
 int Segment::load(ConfigurationManager* configuration_manager) {
     int ret = 0;
 
@@ -271,9 +1096,24 @@ int Segment::load(ConfigurationManager* configuration_manager) {
 
     // load entry index
     int64_t file_size = st_buf.st_size;
+    if (!_is_open && _load_footer(file_size, configuration_manager) == 0) {
+        BRAFT_VLOG << "Loaded index footer, path: " << path
+                   << " entry_count: " << _offset_and_term.size();
+        _map();
+        if (FLAGS_raft_segment_fd_cache_size > 0) {
+            // Reopened on the first read
+            segment_fd_cache()->evict(this);
+        }
+        return 0;
+    }
     int64_t entry_off = 0;
     int64_t actual_last_index = _first_index - 1;
     for (int64_t i = _first_index; entry_off < file_size; i++) {
+        if (!_is_open && i > _last_index.load()) {
+            // What remains is a corrupted or partial index footer, which
+            // would be truncated below.
+            break;
+        }
         EntryHeader header;
         const int rc = _load_entry(entry_off, &header, NULL, ENTRY_HEADER_SIZE);
         if (rc > 0) {
@@ -281,9 +1121,22 @@ int Segment::load(ConfigurationManager* configuration_manager) {
             break;
         }
         if (rc < 0) {
+            if (_is_open && FLAGS_raft_preallocate_segment) {
+                // A torn write in the preallocated space
+                LOG(WARNING) << "Found corrupted header at the tail of a "
+                                "preallocated segment, path: " << _path
+                             << " offset: " << entry_off;
+                break;
+            }
             ret = rc;
             break;
         }
+        if (i == _first_index) {
+            _salt = header.salt;
+        } else if (_is_open && header.salt != _salt) {
+            // Stale entries from the last use of this file
+            break;
+        }
         // rc == 0
         const int64_t skip_len = ENTRY_HEADER_SIZE + header.data_len;
         if (entry_off + skip_len > file_size) {
@@ -299,18 +1152,28 @@ int Segment::load(ConfigurationManager* configuration_manager) {
                 break;
             }
             scoped_refptr<LogEntry> entry = new LogEntry();
+            if (entry == NULL) {
+                ret = -1;
+                break;
+            }
             entry->id.index = i;
             entry->id.term = header.term;
             butil::Status status = parse_configuration_meta(data, entry);
             if (status.ok()) {
                 ConfigurationEntry conf_entry(*entry);
                 configuration_manager->add(conf_entry); 
+                _configuration_indexes.push_back(i);
             } else {
                 ret = -1;
                 break;
             }
         }
-        _offset_and_term.push_back(std::make_pair(entry_off, header.term));
+        if (_offset_and_term.push_back(entry_off, header.term) != 0) {
+            LOG(ERROR) << "Segment is too large to index, path: " << _path
+                       << " index: " << i << " offset: " << entry_off;
+            ret = -1;
+            break;
+        }
         ++actual_last_index;
         entry_off += skip_len;
     }
@@ -327,7 +1190,26 @@ int Segment::load(ConfigurationManager* configuration_manager) {
     }
 
     // truncate last uncompleted entry
-    if (ret == 0 && entry_off != file_size) {
+    if (ret == 0 && _is_open && FLAGS_raft_preallocate_segment
+            && actual_last_index < _first_index) {
+        // Nothing valid, drop whatever is left by the last use of this file
+        // as the salt of it is unknown
+        ret = ftruncate_uninterrupted(_fd, 0);
+        if (ret == 0) {
+            _preallocate();
+        }
+    } else if (ret == 0 && _is_open && FLAGS_raft_preallocate_segment) {
+        // Keep the preallocated space, the tail is overwritten by the
+        // following appends
+        if (::pwrite(_fd, std::string(ENTRY_HEADER_SIZE, '\0').data(),
+                     ENTRY_HEADER_SIZE, entry_off) != (ssize_t)ENTRY_HEADER_SIZE) {
+            PLOG(ERROR) << "Fail to write end marker, path: " << _path;
+            ret = -1;
+        }
+        if (file_size < FLAGS_raft_max_segment_size) {
+            _preallocate();
+        }
+    } else if (ret == 0 && entry_off != file_size) {
         LOG(INFO) << "truncate last uncompleted write entry, path: " << _path
             << " first_index: " << _first_index
             << " old_size: " << file_size << " new_size: " << entry_off;
@@ -338,31 +1220,29 @@ int Segment::load(ConfigurationManager* configuration_manager) {
     ::lseek(_fd, entry_off, SEEK_SET);
 
     _bytes = entry_off;
+    if (ret == 0) {
+        _map();
+        _open_direct();
+        if (!_is_open && FLAGS_raft_segment_fd_cache_size > 0) {
+            segment_fd_cache()->evict(this);
+        }
+    }
     return ret;
 }
 
-int Segment::append(const LogEntry* entry) {
-
-    if (BAIDU_UNLIKELY(!entry || !_is_open)) {
-        return EINVAL;
-    } else if (entry->id.index != 
-                    _last_index.load(butil::memory_order_consume) + 1) {
-        CHECK(false) << "entry->index=" << entry->id.index
-                  << " _last_index=" << _last_index
-                  << " _first_index=" << _first_index;
-        return ERANGE;
-    }
-
-    butil::IOBuf data;
+int Segment::_serialize_entry(const LogEntry* entry, butil::IOBuf* header,
+                              butil::IOBuf* data) const {
     switch (entry->type) {
     case ENTRY_TYPE_DATA:
-        data.append(entry->data);
+    case ENTRY_TYPE_DATA_BATCH:
+    case ENTRY_TYPE_PARTITIONED_DATA:
+        data->append(entry->data);
         break;
     case ENTRY_TYPE_NO_OP:
         break;
     case ENTRY_TYPE_CONFIGURATION: 
         {
-            butil::Status status = serialize_configuration_meta(entry, data);
+            butil::Status status = serialize_configuration_meta(entry, *data);
             if (!status.ok()) {
                 LOG(ERROR) << "Fail to serialize ConfigurationPBMeta, path: " 
                            << _path;
@@ -375,38 +1255,262 @@ int Segment::append(const LogEntry* entry) {
                    << ", path: " << _path;
         return -1;
     }
-    CHECK_LE(data.length(), 1ul << 56ul);
+    int compress_type = COMPRESS_NONE;
+    if (is_data_entry(entry->type) && FLAGS_raft_log_compress_type != 0
+            && data->length() >= (size_t)FLAGS_raft_log_compress_min_size) {
+        compress_type = FLAGS_raft_log_compress_type;
+        butil::IOBuf compressed;
+        if (compress_data(compress_type, *data, &compressed)
+                && compressed.length() < data->length()) {
+            data->swap(compressed);
+        } else {
+            // Not worth it
+            compress_type = COMPRESS_NONE;
+        }
+    }
+    CHECK_LE(data->length(), 1ul << 56ul);
     char header_buf[ENTRY_HEADER_SIZE];
-    const uint32_t meta_field = (entry->type << 24 ) | (_checksum_type << 16);
+    const uint32_t meta_field = (entry->type << 24 ) | (compress_type << 20)
+                                | (_checksum_type << 16) | _salt;
     RawPacker packer(header_buf);
     packer.pack64(entry->id.term)
           .pack32(meta_field)
-          .pack32((uint32_t)data.length())
-          .pack32(get_checksum(_checksum_type, data));
+          .pack32((uint32_t)data->length())
+          .pack32(get_checksum(_checksum_type, *data));
     packer.pack32(get_checksum(
                   _checksum_type, header_buf, ENTRY_HEADER_SIZE - 4));
-    butil::IOBuf header;
-    header.append(header_buf, ENTRY_HEADER_SIZE);
-    const size_t to_write = header.length() + data.length();
-    butil::IOBuf* pieces[2] = { &header, &data };
-    size_t start = 0;
-    ssize_t written = 0;
-    while (written < (ssize_t)to_write) {
-        const ssize_t n = butil::IOBuf::cut_multiple_into_file_descriptor(
-                _fd, pieces + start, ARRAY_SIZE(pieces) - start);
+    header->append(header_buf, ENTRY_HEADER_SIZE);
+    return 0;
+}
+
+int Segment::append(const LogEntry* entry) {
+
+    if (BAIDU_UNLIKELY(!entry || !_is_open)) {
+        return EINVAL;
+    } else if (entry->id.index != 
+                    _last_index.load(butil::memory_order_consume) + 1) {
+        CHECK(false) << "entry->index=" << entry->id.index
+                  << " _last_index=" << _last_index
+                  << " _first_index=" << _first_index;
+        return ERANGE;
+    }
+    std::vector<LogEntry*> entries(1, const_cast<LogEntry*>(entry));
+    const int n = _direct_fd >= 0 ? _append_direct(entries, 0)
+                                  : _append_batch(entries, 0);
+    return n == 1 ? 0 : -1;
+}
+
+int Segment::append(const std::vector<LogEntry*>& entries, size_t from) {
+    if (BAIDU_UNLIKELY(!_is_open)) {
+        return -1;
+    }
+    if (_direct_fd >= 0) {
+        return _append_direct(entries, from);
+    }
+    return _append_batch(entries, from);
+}
+
+int Segment::_stage_entries(const std::vector<LogEntry*>& entries, size_t from,
+                            StagedEntries* staged) {
+    staged->bytes = _bytes;
+    int64_t expected_index = _last_index.load(butil::memory_order_relaxed) + 1;
+    size_t i = from;
+    for (; i < entries.size(); ++i, ++expected_index) {
+        if (i > from && staged->bytes > FLAGS_raft_max_segment_size) {
+            break;
+        }
+        if (staged->bytes > SegmentIndex::MAX_OFFSET) {
+            LOG(ERROR) << "Segment is too large to index, path: " << _path
+                       << " offset: " << staged->bytes;
+            return -1;
+        }
+        const LogEntry* entry = entries[i];
+        if (entry->id.index != expected_index) {
+            CHECK(false) << "entry->index=" << entry->id.index
+                         << " expected_index=" << expected_index
+                         << " _first_index=" << _first_index;
+            return -1;
+        }
+        butil::IOBuf header;
+        butil::IOBuf data;
+        if (_serialize_entry(entry, &header, &data) != 0) {
+            return -1;
+        }
+        staged->offset_and_term.push_back(
+                std::make_pair(staged->bytes, entry->id.term));
+        if (entry->type == ENTRY_TYPE_CONFIGURATION) {
+            staged->configuration_indexes.push_back(entry->id.index);
+        }
+        staged->bytes += header.length() + data.length();
+        staged->data.append(header);
+        staged->data.append(data);
+    }
+    return i - from;
+}
+
+void Segment::_commit_staged(const StagedEntries& staged, size_t count) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const int64_t last_index =
+            _last_index.load(butil::memory_order_relaxed) + count;
+    // The offsets are checked by _stage_entries
+    for (size_t j = 0; j < count; ++j) {
+        _offset_and_term.push_back(staged.offset_and_term[j].first,
+                                   staged.offset_and_term[j].second);
+    }
+    for (size_t j = 0; j < staged.configuration_indexes.size() &&
+            staged.configuration_indexes[j] <= last_index; ++j) {
+        _configuration_indexes.push_back(staged.configuration_indexes[j]);
+    }
+    _last_index.fetch_add(count, butil::memory_order_relaxed);
+    _bytes = count < staged.offset_and_term.size()
+            ? staged.offset_and_term[count].first : staged.bytes;
+}
+
+int Segment::_append_batch(const std::vector<LogEntry*>& entries, size_t from) {
+    StagedEntries staged;
+    const int n = _stage_entries(entries, from, &staged);
+    if (n <= 0) {
+        return n == 0 ? 0 : -1;
+    }
+    // The headers and the data of all the entries go in as few writev as
+    // possible, each of which takes up to IOBUF_IOV_MAX blocks
+    const int64_t to_write = staged.data.size();
+    int64_t written = 0;
+    while (!staged.data.empty()) {
+        const ssize_t nw = staged.data.cut_into_file_descriptor(
+                _fd, staged.data.size());
+        if (nw < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PLOG(ERROR) << "Fail to write to fd=" << _fd
+                        << ", path: " << _path;
+            break;
+        }
+        written += nw;
+    }
+    if (written < to_write) {
+        // Keep the entries written completely
+        size_t count = 0;
+        const int64_t end = _bytes + written;
+        while (count < (size_t)n && (count + 1 < (size_t)n
+                    ? staged.offset_and_term[count + 1].first
+                    : staged.bytes) <= end) {
+            ++count;
+        }
+        // Drop the partly written entry, so that the next write starts at
+        // the end of the last complete one instead of after the garbage
+        const off_t kept_end = staged.offset_and_term[count].first;
+        if (ftruncate_uninterrupted(_fd, kept_end) != 0 ||
+                ::lseek(_fd, kept_end, SEEK_SET) != kept_end) {
+            PLOG(ERROR) << "Fail to drop the partly written entry at offset="
+                        << kept_end << ", path: " << _path;
+            return -1;
+        }
+        _commit_staged(staged, count);
+        return count == 0 ? -1 : (int)count;
+    }
+    _commit_staged(staged, n);
+    return n;
+}
+
+static const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+inline size_t align_up(size_t n) {
+    return (n + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1);
+}
+
+int Segment::_append_direct(const std::vector<LogEntry*>& entries, size_t from) {
+    StagedEntries staged;
+    const int n = _stage_entries(entries, from, &staged);
+    if (n <= 0) {
+        return n == 0 ? 0 : -1;
+    }
+    // Rewrite the partial block at the tail along with the new entries, the
+    // space after the last entry in the last block is zero-padded, which
+    // reads as the end of valid data.
+    const off_t block_start = _bytes - _direct_tail.size();
+    const size_t len = _direct_tail.size() + staged.data.size();
+    const size_t aligned_len = align_up(len);
+    if (aligned_len > _direct_buf_cap) {
+        free(_direct_buf);
+        _direct_buf = NULL;
+        _direct_buf_cap = 0;
+        void* buf = NULL;
+        if (posix_memalign(&buf, DIRECT_IO_ALIGNMENT, aligned_len) != 0) {
+            LOG(ERROR) << "Fail to allocate " << aligned_len
+                       << " bytes for direct io, path: " << _path;
+            return -1;
+        }
+        _direct_buf = (char*)buf;
+        _direct_buf_cap = aligned_len;
+    }
+    memcpy(_direct_buf, _direct_tail.data(), _direct_tail.size());
+    staged.data.copy_to(_direct_buf + _direct_tail.size());
+    memset(_direct_buf + len, 0, aligned_len - len);
+    size_t written = 0;
+    while (written < aligned_len) {
+        const ssize_t n = ::pwrite(_direct_fd, _direct_buf + written,
+                                   aligned_len - written, block_start + written);
         if (n < 0) {
-            LOG(ERROR) << "Fail to write to fd=" << _fd 
-                       << ", path: " << _path << berror();
+            if (errno == EINTR) {
+                continue;
+            }
+            PLOG(ERROR) << "Fail to write to fd=" << _direct_fd
+                        << ", path: " << _path;
             return -1;
         }
         written += n;
-        for (;start < ARRAY_SIZE(pieces) && pieces[start]->empty(); ++start) {}
     }
-    BAIDU_SCOPED_LOCK(_mutex);
-    _offset_and_term.push_back(std::make_pair(_bytes, entry->id.term));
-    _last_index.fetch_add(1, butil::memory_order_relaxed);
-    _bytes += to_write;
+    const size_t tail_len = len % DIRECT_IO_ALIGNMENT;
+    _direct_tail.assign(_direct_buf + len - tail_len, tail_len);
+    _commit_staged(staged, n);
+    return n;
+}
 
+void Segment::_open_direct() {
+#ifdef O_DIRECT
+    if (!FLAGS_raft_segment_direct_io || !_is_open) {
+        return;
+    }
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
+    _direct_fd = ::open(path.c_str(), O_WRONLY | O_DIRECT);
+    if (_direct_fd < 0) {
+        PLOG(WARNING) << "Fail to open " << path << " with O_DIRECT"
+                      << ", write through page cache";
+        return;
+    }
+    butil::make_close_on_exec(_direct_fd);
+    if (_reset_direct_tail() != 0) {
+        ::close(_direct_fd);
+        _direct_fd = -1;
+    }
+#endif  // O_DIRECT
+}
+
+void Segment::_close_direct() {
+    if (_direct_fd >= 0) {
+        ::close(_direct_fd);
+        _direct_fd = -1;
+    }
+    _direct_tail.clear();
+    free(_direct_buf);
+    _direct_buf = NULL;
+    _direct_buf_cap = 0;
+}
+
+int Segment::_reset_direct_tail() {
+    const size_t tail_len = _bytes % DIRECT_IO_ALIGNMENT;
+    _direct_tail.resize(tail_len);
+    if (tail_len == 0) {
+        return 0;
+    }
+    const ssize_t n = ::pread(_fd, &_direct_tail[0], tail_len, _bytes - tail_len);
+    if (n != (ssize_t)tail_len) {
+        PLOG(ERROR) << "Fail to read the tail block, path: " << _path;
+        return -1;
+    }
     return 0;
 }
 
@@ -414,72 +1518,190 @@ int Segment::sync(bool will_sync) {
     if (_last_index > _first_index) {
         //CHECK(_is_open);
         if (FLAGS_raft_sync && will_sync) {
-            return raft_fsync(_fd);
+            // Closed by now if it's a closed segment in SegmentFdCache
+            FdGuard guard(this);
+            return guard.fd() >= 0 ? raft_group_fsync(guard.fd()) : -1;
         } else {
             return 0;
         }
     } else {
         return 0;
     }
-}
-
-LogEntry* Segment::get(const int64_t index) const {
-
-    LogMeta meta;
-    if (_get_meta(index, &meta) != 0) {
-        return NULL;
+}
+
+LogEntry* Segment::_parse_entry(int64_t index, const EntryHeader& header,
+                                butil::IOBuf* data) const {
+    bool ok = true;
+    LogEntry* entry = new LogEntry();
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->AddRef();
+    switch (header.type) {
+    case ENTRY_TYPE_DATA:
+    case ENTRY_TYPE_DATA_BATCH:
+    case ENTRY_TYPE_PARTITIONED_DATA:
+        if (header.compress_type == COMPRESS_NONE) {
+            entry->data.swap(*data);
+        } else if (!decompress_data(header.compress_type, *data,
+                                    &entry->data)) {
+            LOG(ERROR) << "Fail to decompress entry, index: " << index
+                       << " header=" << header << " path: " << _path;
+            ok = false;
+        }
+        break;
+    case ENTRY_TYPE_NO_OP:
+        CHECK(data->empty()) << "Data of NO_OP must be empty";
+        break;
+    case ENTRY_TYPE_CONFIGURATION:
+        {
+            butil::Status status = parse_configuration_meta(*data, entry); 
+            if (!status.ok()) {
+                LOG(WARNING) << "Fail to parse ConfigurationPBMeta, path: "
+                             << _path;
+                ok = false;
+                break;
+            }
+        }
+        break;
+    default:
+        CHECK(false) << "Unknown entry type, path: " << _path;
+        break;
+    }
+    if (!ok) {
+        entry->Release();
+        return NULL;
+    }
+    entry->id.index = index;
+    entry->id.term = header.term;
+    entry->type = (EntryType)header.type;
+    return entry;
+}
+
+LogEntry* Segment::get(const int64_t index) const {
+
+    LogMeta meta;
+    if (_get_meta(index, &meta) != 0) {
+        return NULL;
+    }
+
+    EntryHeader header;
+    butil::IOBuf data;
+    if (_load_entry(meta.offset, &header, &data, 
+                    meta.length) != 0) {
+        return NULL;
+    }
+    CHECK_EQ(meta.term, header.term);
+    return _parse_entry(index, header, &data);
+}
+
+int Segment::_cut_entry(off_t offset, butil::IOBuf* buf, size_t length,
+                        EntryHeader* head, butil::IOBuf* data) const {
+    if (buf->length() < length || length < ENTRY_HEADER_SIZE) {
+        return -1;
+    }
+    char header_buf[ENTRY_HEADER_SIZE];
+    const char* p = (const char*)buf->fetch(header_buf, ENTRY_HEADER_SIZE);
+    const uint32_t header_checksum = unpack_entry_header(p, head);
+    if (!verify_checksum(head->checksum_type,
+                         p, ENTRY_HEADER_SIZE - 4, header_checksum)) {
+        LOG(ERROR) << "Found corrupted header at offset=" << offset
+                   << ", header=" << *head << ", path: " << _path;
+        return -1;
+    }
+    if (ENTRY_HEADER_SIZE + head->data_len != length) {
+        LOG(ERROR) << "Found mismatched entry length at offset=" << offset
+                   << ", header=" << *head << ", length=" << length
+                   << ", path: " << _path;
+        return -1;
+    }
+    buf->pop_front(ENTRY_HEADER_SIZE);
+    data->clear();
+    buf->cutn(data, head->data_len);
+    if (!verify_checksum(head->checksum_type, *data, head->data_checksum)) {
+        LOG(ERROR) << "Found corrupted data at offset="
+                   << offset + ENTRY_HEADER_SIZE
+                   << " header=" << *head
+                   << " path: " << _path;
+        return -1;
+    }
+    return 0;
+}
+
+int Segment::get_entries(const int64_t first_index, size_t max_count,
+                         size_t max_bytes,
+                         std::vector<LogEntry*>* entries) const {
+    std::vector<LogMeta> metas;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        const int64_t last_index = _last_index.load(butil::memory_order_relaxed);
+        if (first_index < _first_index || first_index > last_index) {
+            return 0;
+        }
+        size_t bytes = 0;
+        for (int64_t index = first_index;
+                index <= last_index && metas.size() < max_count; ++index) {
+            const int64_t meta_index = index - _first_index;
+            LogMeta meta;
+            meta.offset = _offset_and_term.offset(meta_index);
+            meta.length = (index < last_index
+                           ? _offset_and_term.offset(meta_index + 1) : _bytes)
+                          - meta.offset;
+            meta.term = _offset_and_term.term(meta_index);
+            if (!metas.empty() && bytes + meta.length > max_bytes) {
+                break;
+            }
+            bytes += meta.length;
+            metas.push_back(meta);
+        }
+    }
+    if (metas.empty()) {
+        return 0;
+    }
+    MappedSegment* mapping = _acquire_mapping();
+    butil::IOPortal buf;
+    if (mapping == NULL) {
+        // Entries are contiguous in the file, read them with one pread
+        FdGuard guard(this);
+        if (guard.fd() < 0) {
+            return -1;
+        }
+        const size_t to_read = metas.back().offset + metas.back().length
+                               - metas.front().offset;
+        const ssize_t n = file_pread(&buf, guard.fd(), metas.front().offset,
+                                     to_read);
+        if (n != (ssize_t)to_read) {
+            PLOG_IF(ERROR, n < 0) << "Fail to read from " << _path;
+            return -1;
+        }
     }
-
-    bool ok = true;
-    LogEntry* entry = NULL;
-    do {
-        ConfigurationPBMeta configuration_meta;
+    const size_t saved_size = entries->size();
+    int rc = 0;
+    for (size_t i = 0; i < metas.size(); ++i) {
         EntryHeader header;
         butil::IOBuf data;
-        if (_load_entry(meta.offset, &header, &data, 
-                        meta.length) != 0) {
-            ok = false;
-            break;
+        if (mapping) {
+            rc = _load_mapped_entry(mapping, metas[i].offset, &header, &data);
+        } else {
+            rc = _cut_entry(metas[i].offset, &buf, metas[i].length,
+                            &header, &data);
         }
-        CHECK_EQ(meta.term, header.term);
-        entry = new LogEntry();
-        entry->AddRef();
-        switch (header.type) {
-        case ENTRY_TYPE_DATA:
-            entry->data.swap(data);
-            break;
-        case ENTRY_TYPE_NO_OP:
-            CHECK(data.empty()) << "Data of NO_OP must be empty";
-            break;
-        case ENTRY_TYPE_CONFIGURATION:
-            {
-                butil::Status status = parse_configuration_meta(data, entry); 
-                if (!status.ok()) {
-                    LOG(WARNING) << "Fail to parse ConfigurationPBMeta, path: "
-                                 << _path;
-                    ok = false;
-                    break;
-                }
-            }
-            break;
-        default:
-            CHECK(false) << "Unknown entry type, path: " << _path;
+        if (rc != 0) {
             break;
         }
-
-        if (!ok) { 
+        CHECK_EQ(metas[i].term, header.term);
+        LogEntry* entry = _parse_entry(first_index + i, header, &data);
+        if (entry == NULL) {
+            rc = -1;
             break;
         }
-        entry->id.index = index;
-        entry->id.term = header.term;
-        entry->type = (EntryType)header.type;
-    } while (0);
-
-    if (!ok && entry != NULL) {
-        entry->Release();
-        entry = NULL;
+        entries->push_back(entry);
     }
-    return entry;
+    if (mapping) {
+        release_mapping(mapping);
+    }
+    const size_t n = entries->size() - saved_size;
+    return (rc != 0 && n == 0) ? -1 : (int)n;
 }
 
 int64_t Segment::get_term(const int64_t index) const {
@@ -506,6 +1728,18 @@ int Segment::close(bool will_sync) {
               << " raft_sync_segments: " << FLAGS_raft_sync_segments 
               << " will_sync: " << will_sync 
               << " path: " << new_path;
+    if (_salt != 0 || FLAGS_raft_preallocate_segment || _direct_fd >= 0) {
+        _close_direct();
+        // Give back the preallocated space and the padding of direct io
+        if (ftruncate_uninterrupted(_fd, _bytes) != 0) {
+            PLOG(ERROR) << "Fail to truncate segment, path: " << _path;
+            return -1;
+        }
+    }
+    if (FLAGS_raft_segment_index_footer && _last_index >= _first_index) {
+        // Failing to write the footer only slows down the next load
+        _write_footer();
+    }
     int ret = 0;
     if (_last_index > _first_index) {
         if (FLAGS_raft_sync_segments && will_sync) {
@@ -520,6 +1754,10 @@ int Segment::close(bool will_sync) {
         LOG_IF(INFO, rc != 0) << "Fail to rename `" << old_path
                               << "' to `" << new_path <<"\', "
                               << berror();
+        _map();
+        if (FLAGS_raft_segment_fd_cache_size > 0) {
+            segment_fd_cache()->touch(this);
+        }
         return rc;
     }
     return ret;
@@ -533,16 +1771,159 @@ std::string Segment::file_name() {
     }
 }
 
-static void* run_unlink(void* arg) {
-    std::string* file_path = (std::string*) arg;
+static bvar::LatencyRecorder g_segment_reclaim_latency(
+                                        "raft_segment_reclaim");
+static bvar::Adder<int64_t> g_segment_reclaim_pending(
+                                        "raft_segment_reclaim_pending");
+
+// Size of the truncating steps when reclaiming a segment
+static const int64_t SEGMENT_RECLAIM_STEP = 1024 * 1024;
+
+static void reclaim_file(const std::string& file_path) {
     butil::Timer timer;
     timer.start();
-    int ret = ::unlink(file_path->c_str());
+    const int64_t bytes_per_second = FLAGS_raft_segment_reclaim_bytes_per_second;
+    if (bytes_per_second > 0) {
+        // Unlinking a large file in one shot blocks the file system for a
+        // while, release the blocks step by step instead
+        int fd = ::open(file_path.c_str(), O_WRONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0) {
+            const int64_t step = std::min(SEGMENT_RECLAIM_STEP, bytes_per_second);
+            int64_t size = st.st_size;
+            while (size > 0) {
+                size -= std::min(step, size);
+                if (ftruncate_uninterrupted(fd, size) != 0) {
+                    PLOG(WARNING) << "Fail to truncate " << file_path;
+                    break;
+                }
+                bthread_usleep(step * 1000000L / bytes_per_second);
+            }
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    int ret = ::unlink(file_path.c_str());
     timer.stop();
-    BRAFT_VLOG << "unlink " << *file_path << " ret " << ret << " time: " << timer.u_elapsed();
-    delete file_path;
+    g_segment_reclaim_latency << timer.u_elapsed();
+    BRAFT_VLOG << "unlink " << file_path << " ret " << ret << " time: " << timer.u_elapsed();
+}
 
-    return NULL;
+static int run_reclaim(void* /*meta*/, bthread::TaskIterator<std::string*>& iter) {
+    for (; iter; ++iter) {
+        reclaim_file(**iter);
+        delete *iter;
+        g_segment_reclaim_pending << -1;
+    }
+    return 0;
+}
+
+// The unlinked segments of all the groups are reclaimed one by one in the
+// background, so that the bandwidth of reclaiming is bounded
+static pthread_once_t g_reclaim_queue_once = PTHREAD_ONCE_INIT;
+static bthread::ExecutionQueueId<std::string*> g_reclaim_queue;
+static bool g_reclaim_queue_started = false;
+
+static void start_reclaim_queue() {
+    bthread::ExecutionQueueOptions options;
+    options.bthread_attr = BTHREAD_ATTR_NORMAL;
+    if (bthread::execution_queue_start(&g_reclaim_queue, &options,
+                                       run_reclaim, NULL) != 0) {
+        LOG(ERROR) << "Fail to start the segment reclaim queue";
+        return;
+    }
+    g_reclaim_queue_started = true;
+}
+
+static void reclaim_in_background(const std::string& file_path) {
+    pthread_once(&g_reclaim_queue_once, start_reclaim_queue);
+    std::string* task = new std::string(file_path);
+    g_segment_reclaim_pending << 1;
+    if (!g_reclaim_queue_started
+            || bthread::execution_queue_execute(g_reclaim_queue, task) != 0) {
+        reclaim_file(*task);
+        delete task;
+        g_segment_reclaim_pending << -1;
+    }
+}
+
+int Segment::copy_to(const std::string& dir, scoped_refptr<Segment>* copy) const {
+    CHECK(!_is_open);
+    const int64_t last_index = _last_index.load();
+    std::string src_path(_path);
+    butil::string_appendf(&src_path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                          _first_index, last_index);
+    std::string dst_path(dir);
+    butil::string_appendf(&dst_path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                          _first_index, last_index);
+    std::string tmp_path(dst_path);
+    tmp_path.append(".tmp");
+
+    FdGuard guard(this);
+    struct stat st_buf;
+    if (guard.fd() < 0 || fstat(guard.fd(), &st_buf) != 0) {
+        PLOG(ERROR) << "Fail to get the stat of " << src_path;
+        return -1;
+    }
+    int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to create " << tmp_path;
+        return -1;
+    }
+    butil::make_close_on_exec(fd);
+    // Copy the whole file including the index footer
+    const off_t file_size = st_buf.st_size;
+    const size_t BLOCK_SIZE = 1024 * 1024;
+    off_t offset = 0;
+    while (offset < file_size) {
+        butil::IOPortal buf;
+        const size_t to_read = std::min((off_t)BLOCK_SIZE, file_size - offset);
+        const ssize_t nr = file_pread(&buf, guard.fd(), offset, to_read);
+        if (nr != (ssize_t)to_read) {
+            PLOG(ERROR) << "Fail to read " << src_path;
+            break;
+        }
+        const ssize_t nw = file_pwrite(buf, fd, offset);
+        if (nw != nr) {
+            PLOG(ERROR) << "Fail to write " << tmp_path;
+            break;
+        }
+        offset += nr;
+    }
+    if (offset != file_size || raft_fsync(fd) != 0
+            || ::rename(tmp_path.c_str(), dst_path.c_str()) != 0) {
+        PLOG_IF(ERROR, offset == file_size) << "Fail to save " << dst_path;
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+        return -1;
+    }
+    // The source is unlinked once the copy is in use, make sure the copy
+    // survives a crash
+    if (raft_fsync_dir(dir) != 0) {
+        PLOG(ERROR) << "Fail to sync " << dir;
+        ::close(fd);
+        ::unlink(dst_path.c_str());
+        return -1;
+    }
+
+    scoped_refptr<Segment> segment =
+            new Segment(dir, _first_index, last_index, _checksum_type);
+    segment->_fd = fd;
+    segment->_bytes = _bytes;
+    segment->_salt = _salt;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        segment->_offset_and_term = _offset_and_term;
+        segment->_configuration_indexes = _configuration_indexes;
+    }
+    segment->_map();
+    if (FLAGS_raft_segment_fd_cache_size > 0) {
+        // Moved away as it's cold
+        segment_fd_cache()->evict(segment.get());
+    }
+    copy->swap(segment);
+    return 0;
 }
 
 int Segment::unlink() {
@@ -565,12 +1946,18 @@ int Segment::unlink() {
             break;
         }
 
-        // start bthread to unlink
-        // TODO unlink follow control
-        std::string* file_path = new std::string(tmp_path);
-        bthread_t tid;
-        if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL, run_unlink, file_path) != 0) {
-            run_unlink(file_path);
+        MappedSegment* mapping = NULL;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            std::swap(mapping, _mapping);
+        }
+        if (mapping) {
+            // Written before dropping our reference, so that it's visible to
+            // whoever drops the last one
+            mapping->reclaim_path = tmp_path;
+            release_mapping(mapping);
+        } else {
+            reclaim_in_background(tmp_path);
         }
 
         LOG(INFO) << "Unlinked segment `" << path << '\'';
@@ -582,28 +1969,37 @@ int Segment::unlink() {
 int Segment::truncate(const int64_t last_index_kept) {
     int64_t truncate_size = 0;
     int64_t first_truncate_in_offset = 0;
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<segment_mutex_t> lck(_mutex);
     if (last_index_kept >= _last_index) {
         return 0;
     }
     first_truncate_in_offset = last_index_kept + 1 - _first_index;
-    truncate_size = _offset_and_term[first_truncate_in_offset].first;
+    truncate_size = _offset_and_term.offset(first_truncate_in_offset);
     BRAFT_VLOG << "Truncating " << _path << " first_index: " << _first_index
               << " last_index from " << _last_index << " to " << last_index_kept
               << " truncate size to " << truncate_size;
     lck.unlock();
 
+    // The truncated pages must not be accessed through the mapping anymore.
+    // NOTE: the truncated entries are uncommitted, which are not supposed to
+    // be referenced by anyone.
+    _unmap();
+
     // truncate fd
-    int ret = ftruncate_uninterrupted(_fd, truncate_size);
+    FdGuard guard(this);
+    if (guard.fd() < 0) {
+        return -1;
+    }
+    int ret = ftruncate_uninterrupted(guard.fd(), truncate_size);
     if (ret < 0) {
         return ret;
     }
 
     // seek fd
-    off_t ret_off = ::lseek(_fd, truncate_size, SEEK_SET);
+    off_t ret_off = ::lseek(guard.fd(), truncate_size, SEEK_SET);
     if (ret_off < 0) {
-        PLOG(ERROR) << "Fail to lseek fd=" << _fd << " to size=" << truncate_size
-                    << " path: " << _path;
+        PLOG(ERROR) << "Fail to lseek fd=" << guard.fd() << " to size="
+                    << truncate_size << " path: " << _path;
         return -1;
     }
 
@@ -625,9 +2021,16 @@ int Segment::truncate(const int64_t last_index_kept) {
 
     lck.lock();
     // update memory var
-    _offset_and_term.resize(first_truncate_in_offset);
-    _last_index.store(last_index_kept, butil::memory_order_relaxed);
+    _offset_and_term.truncate(first_truncate_in_offset);
     _bytes = truncate_size;
+    if (_direct_fd >= 0 && _reset_direct_tail() != 0) {
+        ret = -1;
+    }
+    while (!_configuration_indexes.empty()
+            && _configuration_indexes.back() > last_index_kept) {
+        _configuration_indexes.pop_back();
+    }
+    _last_index.store(last_index_kept, butil::memory_order_relaxed);
     return ret;
 }
 
@@ -639,8 +2042,18 @@ int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
         LOG(ERROR) << "Fail to create " << dir_path.value() << " : " << e;
         return -1;
     }
+    if (!_cold_path.empty() && !butil::CreateDirectoryAndGetError(
+                butil::FilePath(_cold_path), &e,
+                FLAGS_raft_create_parent_directories)) {
+        LOG(ERROR) << "Fail to create " << _cold_path << " : " << e;
+        return -1;
+    }
 
-    if (butil::crc32c::IsFastCrc32Supported()) {
+    if (FLAGS_raft_log_checksum_type >= 0) {
+        _checksum_type = FLAGS_raft_log_checksum_type;
+        LOG_ONCE(INFO) << "Use checksum type " << _checksum_type
+                       << " of appending entries as configured";
+    } else if (is_fast_crc32c_supported()) {
         _checksum_type = CHECKSUM_CRC32;
         LOG_ONCE(INFO) << "Use crc32c as the checksum type of appending entries";
     } else {
@@ -683,6 +2096,15 @@ int64_t SegmentLogStorage::last_log_index() {
 }
 
 int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries) {
+    const int n = append_entries_nosync(entries);
+    if (n > 0 && n == (int)entries.size()) {
+        sync_entries();
+    }
+    return n;
+}
+
+int SegmentLogStorage::append_entries_nosync(
+        const std::vector<LogEntry*>& entries) {
     if (entries.empty()) {
         return 0;
     }
@@ -693,24 +2115,47 @@ int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries) {
         return -1;
     }
     scoped_refptr<Segment> last_segment = NULL;
-    for (size_t i = 0; i < entries.size(); i++) {
-        LogEntry* entry = entries[i];
-
+    for (size_t i = 0; i < entries.size(); ) {
         scoped_refptr<Segment> segment = open_segment();
         if (NULL == segment) {
             return i;
         }
-        int ret = segment->append(entry);
-        if (0 != ret) {
+        // Write as many entries as the open segment could hold at once
+        const int n = segment->append(entries, i);
+        if (n <= 0) {
             return i;
         }
-        _last_log_index.fetch_add(1, butil::memory_order_release);
+        _last_log_index.fetch_add(n, butil::memory_order_release);
+        if (segment != last_segment) {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (_unsynced_segments.empty()
+                    || _unsynced_segments.back() != segment) {
+                _unsynced_segments.push_back(segment);
+            }
+        }
         last_segment = segment;
+        i += n;
     }
-    last_segment->sync(_enable_sync);
     return entries.size();
 }
 
+int SegmentLogStorage::sync_entries() {
+    std::vector<scoped_refptr<Segment> > segments;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        segments.swap(_unsynced_segments);
+    }
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const int rc = segments[i]->sync(_enable_sync);
+        if (rc != 0) {
+            LOG(ERROR) << "Fail to sync segment " << segments[i]->file_name()
+                       << " path: " << _path;
+            return rc;
+        }
+    }
+    return 0;
+}
+
 int SegmentLogStorage::append_entry(const LogEntry* entry) {
     scoped_refptr<Segment> segment = open_segment();
     if (NULL == segment) {
@@ -736,6 +2181,34 @@ LogEntry* SegmentLogStorage::get_entry(const int64_t index) {
     return ptr->get(index);
 }
 
+int SegmentLogStorage::get_entries(const int64_t first_index, size_t max_count,
+                                   size_t max_bytes,
+                                   std::vector<LogEntry*>* entries) {
+    const size_t saved_size = entries->size();
+    int64_t index = first_index;
+    size_t bytes = 0;
+    while ((size_t)(index - first_index) < max_count && bytes < max_bytes) {
+        scoped_refptr<Segment> ptr;
+        if (get_segment(index, &ptr) != 0) {
+            break;
+        }
+        const size_t from = entries->size();
+        const int rc = ptr->get_entries(index, max_count - (index - first_index),
+                                        max_bytes - bytes, entries);
+        if (rc <= 0) {
+            if (rc < 0 && entries->size() == saved_size) {
+                return -1;
+            }
+            break;
+        }
+        for (size_t i = from; i < entries->size(); ++i) {
+            bytes += (*entries)[i]->data.size();
+        }
+        index += rc;
+    }
+    return entries->size() - saved_size;
+}
+
 int64_t SegmentLogStorage::get_term(const int64_t index) {
     scoped_refptr<Segment> ptr;
     if (get_segment(index, &ptr) != 0) {
@@ -795,12 +2268,55 @@ int SegmentLogStorage::truncate_prefix(const int64_t first_index_kept) {
     std::vector<scoped_refptr<Segment> > popped;
     pop_segments(first_index_kept, &popped);
     for (size_t i = 0; i < popped.size(); ++i) {
-        popped[i]->unlink();
+        if (recycle_segment(popped[i]) != 0) {
+            popped[i]->unlink();
+        }
         popped[i] = NULL;
     }
     return 0;
 }
 
+int SegmentLogStorage::recycle_segment(const scoped_refptr<Segment>& segment) {
+    if (!FLAGS_raft_preallocate_segment || segment->is_open()
+            // Someone is reading this segment
+            || !segment->HasOneRef()
+            // The file is on another device
+            || segment->path() != _path) {
+        return -1;
+    }
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_recycled_segments.size()
+                >= (size_t)FLAGS_raft_max_recycled_segments) {
+            return -1;
+        }
+    }
+    std::string recycled_path(_path);
+    butil::string_appendf(&recycled_path, "/" BRAFT_SEGMENT_RECYCLED_PATTERN,
+                          segment->first_index());
+    if (segment->recycle(recycled_path) != 0) {
+        return -1;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    _recycled_segments.push_back(recycled_path);
+    return 0;
+}
+
+int SegmentLogStorage::create_open_segment(Segment* segment) {
+    std::string recycled_path;
+    if (FLAGS_raft_preallocate_segment && !_recycled_segments.empty()) {
+        recycled_path = _recycled_segments.front();
+        _recycled_segments.pop_front();
+    }
+    if (!recycled_path.empty()) {
+        if (segment->create_from(recycled_path) == 0) {
+            return 0;
+        }
+        ::unlink(recycled_path.c_str());
+    }
+    return segment->create();
+}
+
 void SegmentLogStorage::pop_segments_from_back(
         const int64_t last_index_kept,
         std::vector<scoped_refptr<Segment> >* popped,
@@ -841,6 +2357,10 @@ void SegmentLogStorage::pop_segments_from_back(
 }
 
 int SegmentLogStorage::truncate_suffix(const int64_t last_index_kept) {
+    // Not interleaved with replacing the segments by the cold copies, which
+    // would bring the truncated logs back
+    BAIDU_SCOPED_LOCK(_truncate_mutex);
+    ++_suffix_truncations;
     // segment files
     std::vector<scoped_refptr<Segment> > popped;
     scoped_refptr<Segment> last_segment;
@@ -941,6 +2461,21 @@ int SegmentLogStorage::list_segments(bool is_empty) {
             continue;
         }
 
+        match = sscanf(dir_reader.name(), BRAFT_SEGMENT_RECYCLED_PATTERN,
+                       &first_index);
+        if (match == 1) {
+            std::string segment_path(_path);
+            segment_path.append("/");
+            segment_path.append(dir_reader.name());
+            if (FLAGS_raft_preallocate_segment && _recycled_segments.size()
+                        < (size_t)FLAGS_raft_max_recycled_segments) {
+                _recycled_segments.push_back(segment_path);
+            } else {
+                ::unlink(segment_path.c_str());
+            }
+            continue;
+        }
+
         match = sscanf(dir_reader.name(), BRAFT_SEGMENT_OPEN_PATTERN, 
                        &first_index);
         if (match == 1) {
@@ -957,6 +2492,10 @@ int SegmentLogStorage::list_segments(bool is_empty) {
         }
     }
 
+    if (!_cold_path.empty() && list_cold_segments(is_empty) != 0) {
+        return -1;
+    }
+
     // check segment
     int64_t last_log_index = -1;
     SegmentMap::iterator it;
@@ -1012,21 +2551,225 @@ int SegmentLogStorage::list_segments(bool is_empty) {
     return 0;
 }
 
+int SegmentLogStorage::list_cold_segments(bool is_empty) {
+    butil::DirReaderPosix dir_reader(_cold_path.c_str());
+    if (!dir_reader.IsValid()) {
+        LOG(WARNING) << "directory reader failed, maybe NOEXIST or PERMISSION."
+                     << " path: " << _cold_path;
+        return -1;
+    }
+    while (dir_reader.Next()) {
+        std::string segment_path(_cold_path);
+        segment_path.append("/");
+        segment_path.append(dir_reader.name());
+        const size_t len = strlen(dir_reader.name());
+        // Unfinished moving or unlinking
+        if ((is_empty && 0 == strncmp(dir_reader.name(), "log_", strlen("log_")))
+                || (len >= strlen(".tmp") && 0 == strcmp(
+                        dir_reader.name() + len - strlen(".tmp"), ".tmp"))) {
+            ::unlink(segment_path.c_str());
+            LOG(WARNING) << "unlink unused segment, path: " << segment_path;
+            continue;
+        }
+        int64_t first_index = 0;
+        int64_t last_index = 0;
+        if (sscanf(dir_reader.name(), BRAFT_SEGMENT_CLOSED_PATTERN,
+                   &first_index, &last_index) != 2) {
+            continue;
+        }
+        if (_segments.find(first_index) != _segments.end()) {
+            // The segment was copied but the primary file was not removed
+            // before the process exited
+            ::unlink(segment_path.c_str());
+            LOG(WARNING) << "unlink duplicated cold segment, path: "
+                         << segment_path;
+            continue;
+        }
+        LOG(INFO) << "restore cold segment, path: " << _cold_path
+                  << " first_index: " << first_index
+                  << " last_index: " << last_index;
+        _segments[first_index] =
+                new Segment(_cold_path, first_index, last_index, _checksum_type);
+    }
+    return 0;
+}
+
+static void* run_move_cold_segments(void* arg) {
+    static_cast<SegmentLogStorage*>(arg)->move_cold_segments();
+    return NULL;
+}
+
+void SegmentLogStorage::start_moving_cold_segments() {
+    if (_cold_path.empty()) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_moving_cold_segments) {
+        return;
+    }
+    if (_move_tid != INVALID_BTHREAD) {
+        // The last round has quit
+        bthread_join(_move_tid, NULL);
+        _move_tid = INVALID_BTHREAD;
+    }
+    if (bthread_start_background(&_move_tid, &BTHREAD_ATTR_NORMAL,
+                                 run_move_cold_segments, this) != 0) {
+        LOG(ERROR) << "Fail to start bthread to move cold segments";
+        _move_tid = INVALID_BTHREAD;
+        return;
+    }
+    _moving_cold_segments = true;
+}
+
+void SegmentLogStorage::move_cold_segments() {
+    while (true) {
+        scoped_refptr<Segment> segment;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            size_t hot_count = 0;
+            for (SegmentMap::reverse_iterator it = _segments.rbegin();
+                    it != _segments.rend(); ++it) {
+                if (it->second->path() != _path) {
+                    break;
+                }
+                if (++hot_count > (size_t)FLAGS_raft_log_hot_segments) {
+                    segment = it->second;
+                }
+            }
+            if (!segment || _stopping) {
+                _moving_cold_segments = false;
+                return;
+            }
+        }
+        int64_t truncations = 0;
+        {
+            BAIDU_SCOPED_LOCK(_truncate_mutex);
+            truncations = _suffix_truncations;
+        }
+        scoped_refptr<Segment> copy;
+        if (segment->copy_to(_cold_path, &copy) != 0) {
+            LOG(ERROR) << "Fail to move segment " << segment->file_name()
+                       << " from " << _path << " to " << _cold_path;
+            BAIDU_SCOPED_LOCK(_mutex);
+            _moving_cold_segments = false;
+            return;
+        }
+        bool replaced = false;
+        {
+            BAIDU_SCOPED_LOCK(_truncate_mutex);
+            BAIDU_SCOPED_LOCK(_mutex);
+            SegmentMap::iterator it = _segments.find(segment->first_index());
+            // The segment might be truncated or removed during copying, in
+            // which case the copy is stale
+            if (it != _segments.end() && it->second == segment
+                    && truncations == _suffix_truncations
+                    && segment->last_index() == copy->last_index()) {
+                it->second = copy;
+                replaced = true;
+            }
+        }
+        // Readers holding |segment| still read from the unlinked file
+        if (replaced) {
+            LOG(INFO) << "Moved segment " << segment->file_name()
+                      << " from " << _path << " to " << _cold_path;
+            segment->unlink();
+        } else {
+            copy->unlink();
+        }
+    }
+}
+
+struct LoadSegmentsCtx {
+    std::string path;
+    std::vector<Segment*> segments;
+    // Configurations found in each segment, which are merged in order after
+    // all the segments are loaded
+    std::vector<ConfigurationManager> conf_managers;
+    std::vector<int> results;
+    butil::atomic<size_t> next;
+};
+
+static void* run_load_segments(void* arg) {
+    LoadSegmentsCtx* ctx = (LoadSegmentsCtx*)arg;
+    while (true) {
+        const size_t i = ctx->next.fetch_add(1, butil::memory_order_relaxed);
+        if (i >= ctx->segments.size()) {
+            break;
+        }
+        Segment* segment = ctx->segments[i];
+        LOG(INFO) << "load closed segment, path: " << ctx->path
+            << " first_index: " << segment->first_index()
+            << " last_index: " << segment->last_index();
+        ctx->results[i] = segment->load(&ctx->conf_managers[i]);
+    }
+    return NULL;
+}
+
+int SegmentLogStorage::load_closed_segments_concurrently(
+        ConfigurationManager* configuration_manager, int concurrency) {
+    LoadSegmentsCtx ctx;
+    ctx.path = _path;
+    ctx.segments.reserve(_segments.size());
+    for (SegmentMap::iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        ctx.segments.push_back(it->second.get());
+    }
+    ctx.conf_managers.resize(ctx.segments.size());
+    ctx.results.resize(ctx.segments.size(), 0);
+    ctx.next.store(0, butil::memory_order_relaxed);
+    std::vector<bthread_t> tids;
+    tids.reserve(concurrency);
+    for (int i = 0; i < concurrency; ++i) {
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_load_segments, &ctx) != 0) {
+            PLOG(WARNING) << "Fail to start bthread, load segments in place";
+            run_load_segments(&ctx);
+            break;
+        }
+        tids.push_back(tid);
+    }
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    // Segments are independent while configurations must be handed to
+    // |configuration_manager| in the order of index
+    for (size_t i = 0; i < ctx.segments.size(); ++i) {
+        if (ctx.results[i] != 0) {
+            return ctx.results[i];
+        }
+        if (configuration_manager->merge(ctx.conf_managers[i]) != 0) {
+            return -1;
+        }
+        _last_log_index.store(ctx.segments[i]->last_index(),
+                              butil::memory_order_release);
+    }
+    return 0;
+}
+
 int SegmentLogStorage::load_segments(ConfigurationManager* configuration_manager) {
     int ret = 0;
 
     // closed segments
-    SegmentMap::iterator it;
-    for (it = _segments.begin(); it != _segments.end(); ++it) {
-        Segment* segment = it->second.get();
-        LOG(INFO) << "load closed segment, path: " << _path
-            << " first_index: " << segment->first_index()
-            << " last_index: " << segment->last_index();
-        ret = segment->load(configuration_manager);
+    const int concurrency = std::min<int>(FLAGS_raft_load_segment_concurrency,
+                                          _segments.size());
+    if (concurrency > 1) {
+        ret = load_closed_segments_concurrently(configuration_manager,
+                                                concurrency);
         if (ret != 0) {
             return ret;
-        } 
-        _last_log_index.store(segment->last_index(), butil::memory_order_release);
+        }
+    } else {
+        SegmentMap::iterator it;
+        for (it = _segments.begin(); it != _segments.end(); ++it) {
+            Segment* segment = it->second.get();
+            LOG(INFO) << "load closed segment, path: " << _path
+                << " first_index: " << segment->first_index()
+                << " last_index: " << segment->last_index();
+            ret = segment->load(configuration_manager);
+            if (ret != 0) {
+                return ret;
+            } 
+            _last_log_index.store(segment->last_index(), butil::memory_order_release);
+        }
     }
 
     // open segment
@@ -1102,7 +2845,7 @@ scoped_refptr<Segment> SegmentLogStorage::open_segment() {
         BAIDU_SCOPED_LOCK(_mutex);
         if (!_open_segment) {
             _open_segment = new Segment(_path, last_log_index() + 1, _checksum_type);
-            if (_open_segment->create() != 0) {
+            if (create_open_segment(_open_segment.get()) != 0) {
                 _open_segment = NULL;
                 return NULL;
             }
@@ -1117,7 +2860,7 @@ scoped_refptr<Segment> SegmentLogStorage::open_segment() {
             if (prev_open_segment->close(_enable_sync) == 0) {
                 BAIDU_SCOPED_LOCK(_mutex);
                 _open_segment = new Segment(_path, last_log_index() + 1, _checksum_type);
-                if (_open_segment->create() == 0) {
+                if (create_open_segment(_open_segment.get()) == 0) {
                     // success
                     break;
                 }
@@ -1131,6 +2874,9 @@ scoped_refptr<Segment> SegmentLogStorage::open_segment() {
             return NULL;
         }
     } while (0);
+    if (prev_open_segment) {
+        start_moving_cold_segments();
+    }
     return _open_segment;
 }
 
@@ -1176,6 +2922,40 @@ void SegmentLogStorage::list_files(std::vector<std::string>* seg_files) {
     }
 }
 
+void SegmentLogStorage::describe(std::ostream& os, bool use_html) {
+    const char* newline = use_html ? "<br>" : "\n";
+    size_t index_memory = 0;
+    int64_t entry_count = 0;
+    size_t segment_count = 0;
+    size_t cold_segment_count = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        for (SegmentMap::iterator it = _segments.begin(); it != _segments.end(); ++it) {
+            if (it->second->path() != _path) {
+                ++cold_segment_count;
+            }
+            index_memory += it->second->index_memory_usage();
+            entry_count += it->second->last_index() - it->second->first_index() + 1;
+            ++segment_count;
+        }
+        if (_open_segment) {
+            index_memory += _open_segment->index_memory_usage();
+            entry_count += _open_segment->last_index()
+                           - _open_segment->first_index() + 1;
+            ++segment_count;
+        }
+    }
+    // An (offset, term) pair per entry without compacting
+    const int64_t plain_memory = entry_count * 2 * sizeof(int64_t);
+    os << "segments: " << segment_count << newline;
+    if (!_cold_path.empty()) {
+        os << "cold_segments: " << cold_segment_count << newline;
+    }
+    os << "segment_index_memory: " << index_memory << newline;
+    os << "segment_index_memory_saved: " << plain_memory - (int64_t)index_memory
+       << newline;
+}
+
 void SegmentLogStorage::sync() {
     std::vector<scoped_refptr<Segment> > segments;
     {
@@ -1190,8 +2970,27 @@ void SegmentLogStorage::sync() {
     }
 }
 
+SegmentLogStorage::~SegmentLogStorage() {
+    bthread_t tid = INVALID_BTHREAD;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _stopping = true;
+        std::swap(tid, _move_tid);
+    }
+    if (tid != INVALID_BTHREAD) {
+        bthread_join(tid, NULL);
+    }
+}
+
 LogStorage* SegmentLogStorage::new_instance(const std::string& uri) const {
-    return new SegmentLogStorage(uri);
+    // ${path}?cold_path=${cold_path}
+    const size_t pos = uri.find("?cold_path=");
+    if (pos == std::string::npos) {
+        return new SegmentLogStorage(uri);
+    }
+    SegmentLogStorage* storage = new SegmentLogStorage(uri.substr(0, pos));
+    storage->set_cold_path(uri.substr(pos + strlen("?cold_path=")));
+    return storage;
 }
 
 }
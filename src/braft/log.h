@@ -21,6 +21,8 @@
 
 #include <vector>
 #include <map>
+#include <deque>
+#include <list>
 #include <butil/memory/ref_counted.h>
 #include <butil/atomicops.h>
 #include <butil/iobuf.h>
@@ -31,6 +33,79 @@
 
 namespace braft {
 
+DECLARE_bool(raft_segment_index_footer);
+DECLARE_int32(raft_load_segment_concurrency);
+DECLARE_bool(raft_segment_mmap_read);
+DECLARE_bool(raft_preallocate_segment);
+DECLARE_int32(raft_max_recycled_segments);
+DECLARE_bool(raft_segment_direct_io);
+
+struct MappedSegment;
+
+// In-memory index of the entries of a segment, which takes about 2.5 bytes
+// per entry rather than 16 bytes of an (offset, term) pair. Terms are kept as
+// runs as they barely change inside a segment, and offsets are kept as 16-bit
+// deltas to the base offset of each block of BLOCK_SIZE entries. A block
+// containing large entries falls back to 32-bit deltas.
+class SegmentIndex {
+public:
+    SegmentIndex() : _size(0) {}
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    // Largest offset of an entry in the index
+    static const int64_t MAX_OFFSET = 0xFFFFFFFFLL;
+    // |offset| must be larger than the offset of the last entry. Returns -1
+    // if it's out of [0, MAX_OFFSET], which only happens with a segment file
+    // larger than raft_max_segment_size allows, 0 otherwise.
+    int push_back(int64_t offset, int64_t term);
+    // O(1)
+    int64_t offset(size_t i) const {
+        const Block& b = _blocks[i / BLOCK_SIZE];
+        return (int64_t)b.base + (b.wide_pos == NARROW_BLOCK
+                ? _deltas[i] : _wide_deltas[b.wide_pos + i % BLOCK_SIZE]);
+    }
+    // O(log(number of runs))
+    int64_t term(size_t i) const;
+    // Keep the first |n| entries
+    void truncate(size_t n);
+    void clear();
+    void swap(SegmentIndex& rhs);
+
+    size_t run_count() const { return _term_runs.size(); }
+    int64_t run_term(size_t i) const { return _term_runs[i].term; }
+    size_t run_length(size_t i) const {
+        return (i + 1 < _term_runs.size() ? _term_runs[i + 1].start : _size)
+                - _term_runs[i].start;
+    }
+
+    size_t memory_usage() const;
+
+private:
+    static const size_t BLOCK_SIZE = 16;
+    static const uint32_t NARROW_BLOCK = 0xFFFFFFFF;
+    struct Block {
+        uint32_t base;
+        // Position of the deltas in _wide_deltas, NARROW_BLOCK if they are
+        // in _deltas
+        uint32_t wide_pos;
+    };
+    struct TermRun {
+        int64_t term;
+        uint32_t start;
+    };
+    std::vector<Block> _blocks;
+    std::vector<uint16_t> _deltas;
+    std::vector<uint32_t> _wide_deltas;
+    std::vector<TermRun> _term_runs;
+    size_t _size;
+};
+
+struct SegmentMutexTag {
+    static const char* name() { return "segment"; }
+};
+typedef ProfiledMutex<SegmentMutexTag> segment_mutex_t;
+
 class BAIDU_CACHELINE_ALIGNMENT Segment 
         : public butil::RefCountedThreadSafe<Segment> {
 public:
@@ -38,14 +113,18 @@ public:
         : _path(path), _bytes(0),
         _fd(-1), _is_open(true),
         _first_index(first_index), _last_index(first_index - 1),
-        _checksum_type(checksum_type)
+        _checksum_type(checksum_type), _salt(0), _mapping(NULL),
+        _direct_fd(-1), _direct_buf(NULL), _direct_buf_cap(0),
+        _fd_readers(0), _in_fd_cache(false)
     {}
     Segment(const std::string& path, const int64_t first_index, const int64_t last_index,
             int checksum_type)
         : _path(path), _bytes(0),
         _fd(-1), _is_open(false),
         _first_index(first_index), _last_index(last_index),
-        _checksum_type(checksum_type)
+        _checksum_type(checksum_type), _salt(0), _mapping(NULL),
+        _direct_fd(-1), _direct_buf(NULL), _direct_buf_cap(0),
+        _fd_readers(0), _in_fd_cache(false)
     {}
 
     struct EntryHeader;
@@ -53,6 +132,12 @@ public:
     // create open segment
     int create();
 
+    // create open segment by reusing the file at |recycled_path|
+    int create_from(const std::string& recycled_path);
+
+    // move the file of this closed segment to |recycled_path| for reusing
+    int recycle(const std::string& recycled_path);
+
     // load open or closed segment
     // open fd, load index, truncate uncompleted entry
     int load(ConfigurationManager* configuration_manager);
@@ -60,9 +145,24 @@ public:
     // serialize entry, and append to open segment
     int append(const LogEntry* entry);
 
+    // append entries starting from |entries[from]| until this segment is full
+    // return the number of appended entries, -1 on error
+    int append(const std::vector<LogEntry*>& entries, size_t from);
+
     // get entry by index
     LogEntry* get(const int64_t index) const;
 
+    // copy this closed segment into |dir|, |copy| is the segment of the new
+    // file which is ready for reading
+    int copy_to(const std::string& dir, scoped_refptr<Segment>* copy) const;
+
+    // get at most |max_count| entries starting from |first_index| with one
+    // read, stop before the file bytes of entries exceed |max_bytes| unless
+    // nothing is got. Returns the number of entries appended to |entries|,
+    // -1 on error
+    int get_entries(const int64_t first_index, size_t max_count,
+                    size_t max_bytes, std::vector<LogEntry*>* entries) const;
+
     // get entry's term by index
     int64_t get_term(const int64_t index) const;
 
@@ -86,6 +186,11 @@ public:
         return _bytes;
     }
 
+    // directory of the segment file
+    const std::string& path() const {
+        return _path;
+    }
+
     int64_t first_index() const {
         return _first_index;
     }
@@ -94,15 +199,19 @@ public:
         return _last_index.load(butil::memory_order_consume);
     }
 
+    // Bytes taken by the in-memory index of entries
+    size_t index_memory_usage() const {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _offset_and_term.memory_usage();
+    }
+
     std::string file_name();
 private:
 friend class butil::RefCountedThreadSafe<Segment>;
-    ~Segment() {
-        if (_fd >= 0) {
-            ::close(_fd);
-            _fd = -1;
-        }
-    }
+friend class SegmentFdCache;
+    ~Segment();
+
+    class FdGuard;
 
     struct LogMeta {
         off_t offset;
@@ -113,19 +222,93 @@ friend class butil::RefCountedThreadSafe<Segment>;
     int _load_entry(off_t offset, EntryHeader *head, butil::IOBuf *body, 
                     size_t size_hint) const;
 
+    int _load_mapped_entry(MappedSegment* mapping, off_t offset,
+                           EntryHeader* head, butil::IOBuf* body) const;
+
+    // Cut the entry of |length| bytes at |offset| from the front of |buf|
+    int _cut_entry(off_t offset, butil::IOBuf* buf, size_t length,
+                   EntryHeader* head, butil::IOBuf* data) const;
+
+    // Build the LogEntry from the loaded header and data
+    LogEntry* _parse_entry(int64_t index, const EntryHeader& header,
+                           butil::IOBuf* data) const;
+
+    void _preallocate();
+
+    int _serialize_entry(const LogEntry* entry, butil::IOBuf* header,
+                         butil::IOBuf* data) const;
+
+    // Entries serialized for one write, |bytes| is the size of the segment
+    // after them
+    struct StagedEntries {
+        butil::IOBuf data;
+        std::vector<std::pair<int64_t, int64_t> > offset_and_term;
+        std::vector<int64_t> configuration_indexes;
+        int64_t bytes;
+    };
+    // Serialize the entries from |entries[from]| until this segment is full,
+    // return the number of them, -1 on error
+    int _stage_entries(const std::vector<LogEntry*>& entries, size_t from,
+                       StagedEntries* staged);
+    // Index the first |count| staged entries written, with one lock
+    void _commit_staged(const StagedEntries& staged, size_t count);
+    // Write all the staged entries with writev through the page cache
+    int _append_batch(const std::vector<LogEntry*>& entries, size_t from);
+
+    // Direct io of the open segment
+    int _append_direct(const std::vector<LogEntry*>& entries, size_t from);
+    void _open_direct();
+    void _close_direct();
+    int _reset_direct_tail();
+
+    // Map the closed segment if raft_segment_mmap_read is on
+    void _map();
+    void _unmap();
+    MappedSegment* _acquire_mapping() const;
+
+    // Open the fd of a closed segment closed by SegmentFdCache on demand, and
+    // pin it until _release_fd. Returns -1 on error
+    int _acquire_fd() const;
+    void _release_fd() const;
+    // Close the fd of this closed segment if no one is reading it
+    bool _close_idle_fd() const;
+
     int _get_meta(int64_t index, LogMeta* meta) const;
 
+    // Append the index footer after the last entry of a closing segment
+    int _write_footer();
+
+    // Rebuild the index from the footer of a closed segment
+    // Returns 0 on success, otherwise the caller should scan the entries.
+    int _load_footer(int64_t file_size,
+                     ConfigurationManager* configuration_manager);
+
     int _truncate_meta_and_get_last(int64_t last);
 
     std::string _path;
     int64_t _bytes;
-    mutable raft_mutex_t _mutex;
-    int _fd;
+    mutable segment_mutex_t _mutex;
+    // Closed segments may close it when raft_segment_fd_cache_size is set
+    mutable int _fd;
     bool _is_open;
     const int64_t _first_index;
     butil::atomic<int64_t> _last_index;
     int _checksum_type;
-    std::vector<std::pair<int64_t/*offset*/, int64_t/*term*/> > _offset_and_term;
+    uint32_t _salt;
+    SegmentIndex _offset_and_term;
+    std::vector<int64_t> _configuration_indexes;
+    MappedSegment* _mapping;
+    int _direct_fd;
+    // Content of the partial block at the tail, which is rewritten with the
+    // next appending
+    std::string _direct_tail;
+    char* _direct_buf;
+    size_t _direct_buf_cap;
+    // Reads using _fd, which must not be closed meanwhile
+    mutable int _fd_readers;
+    // Position in SegmentFdCache, guarded by the mutex of the cache
+    mutable bool _in_fd_cache;
+    mutable std::list<const Segment*>::iterator _fd_cache_pos;
 };
 
 // LogStorage use segmented append-only file, all data in disk, all index in memory.
@@ -145,6 +328,10 @@ public:
         , _last_log_index(0)
         , _checksum_type(0)
         , _enable_sync(enable_sync)
+        , _move_tid(INVALID_BTHREAD)
+        , _moving_cold_segments(false)
+        , _stopping(false)
+        , _suffix_truncations(0)
     {} 
 
     SegmentLogStorage()
@@ -152,9 +339,23 @@ public:
         , _last_log_index(0)
         , _checksum_type(0)
         , _enable_sync(true)
+        , _move_tid(INVALID_BTHREAD)
+        , _moving_cold_segments(false)
+        , _stopping(false)
+        , _suffix_truncations(0)
     {}
 
-    virtual ~SegmentLogStorage() {}
+    virtual ~SegmentLogStorage();
+
+    // Move the closed segments except the latest raft_log_hot_segments ones
+    // to |cold_path| in the background, e.g. a cheaper device. Must be called
+    // before init()
+    void set_cold_path(const std::string& cold_path) {
+        _cold_path = cold_path;
+    }
+
+    // Move out the cold segments, called in the background
+    void move_cold_segments();
 
     // init logstorage, check consistency and integrity
     virtual int init(ConfigurationManager* configuration_manager);
@@ -170,6 +371,10 @@ public:
     // get logentry by index
     virtual LogEntry* get_entry(const int64_t index);
 
+    // get entries with one read from each segment
+    virtual int get_entries(const int64_t first_index, size_t max_count,
+                            size_t max_bytes, std::vector<LogEntry*>* entries);
+
     // get logentry's term by index
     virtual int64_t get_term(const int64_t index);
 
@@ -179,6 +384,12 @@ public:
     // append entries to log, return success append number
     virtual int append_entries(const std::vector<LogEntry*>& entries);
 
+    // append entries to log without fsync, return success append number
+    virtual int append_entries_nosync(const std::vector<LogEntry*>& entries);
+
+    // fsync the segments written by append_entries_nosync
+    virtual int sync_entries();
+
     // delete logs from storage's head, [1, first_index_kept) will be discarded
     virtual int truncate_prefix(const int64_t first_index_kept);
 
@@ -195,13 +406,21 @@ public:
 
     void list_files(std::vector<std::string>* seg_files);
 
+    virtual void describe(std::ostream& os, bool use_html);
+
     void sync();
 private:
     scoped_refptr<Segment> open_segment();
+    int create_open_segment(Segment* segment);
+    int recycle_segment(const scoped_refptr<Segment>& segment);
     int save_meta(const int64_t log_index);
     int load_meta();
     int list_segments(bool is_empty);
+    int list_cold_segments(bool is_empty);
+    void start_moving_cold_segments();
     int load_segments(ConfigurationManager* configuration_manager);
+    int load_closed_segments_concurrently(
+            ConfigurationManager* configuration_manager, int concurrency);
     int get_segment(int64_t log_index, scoped_refptr<Segment>* ptr);
     void pop_segments(
             int64_t first_index_kept, 
@@ -218,8 +437,19 @@ private:
     raft_mutex_t _mutex;
     SegmentMap _segments;
     scoped_refptr<Segment> _open_segment;
+    // Segments written by append_entries_nosync but not synced yet
+    std::vector<scoped_refptr<Segment> > _unsynced_segments;
+    std::deque<std::string> _recycled_segments;
     int _checksum_type;
     bool _enable_sync;
+    std::string _cold_path;
+    bthread_t _move_tid;
+    bool _moving_cold_segments;
+    bool _stopping;
+    // Serializes truncate_suffix with replacing the segments by their cold
+    // copies, and counts the former
+    raft_mutex_t _truncate_mutex;
+    int64_t _suffix_truncations;
 };
 
 }  //  namespace braft
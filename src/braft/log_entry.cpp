@@ -15,13 +15,45 @@
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
 #include "braft/log_entry.h"
+#include <new>
+#include <type_traits>
+#include <butil/raw_pack.h>                          // butil::RawPacker
+#include <butil/object_pool.h>                       // butil::get_object
 #include "braft/local_storage.pb.h"
 
 namespace braft {
 
 bvar::Adder<int64_t> g_nentries("raft_num_log_entries");
 
-LogEntry::LogEntry(): type(ENTRY_TYPE_UNKNOWN), peers(NULL), old_peers(NULL) {
+// Raw memory of one LogEntry in the pool, the entry is constructed and
+// destroyed in it by new and delete as usual
+struct LogEntryMemory {
+    std::aligned_storage<sizeof(LogEntry), alignof(LogEntry)>::type storage;
+};
+
+void* LogEntry::operator new(size_t size) noexcept {
+    if (size != sizeof(LogEntry)) {
+        return ::operator new(size, std::nothrow);
+    }
+    LogEntryMemory* mem = butil::get_object<LogEntryMemory>();
+    if (mem == NULL) {
+        LOG(ERROR) << "Fail to allocate LogEntry";
+    }
+    return mem;
+}
+
+void LogEntry::operator delete(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (size != sizeof(LogEntry)) {
+        return ::operator delete(ptr);
+    }
+    butil::return_object(static_cast<LogEntryMemory*>(ptr));
+}
+
+LogEntry::LogEntry(): type(ENTRY_TYPE_UNKNOWN), peers(NULL), old_peers(NULL)
+                    , learners(NULL), _meta(NULL) {
     g_nentries << 1;
 }
 
@@ -29,6 +61,41 @@ LogEntry::~LogEntry() {
     g_nentries << -1;
     delete peers;
     delete old_peers;
+    delete learners;
+    delete _meta.load(butil::memory_order_relaxed);
+}
+
+const EntryMeta& LogEntry::meta() const {
+    EntryMeta* meta = _meta.load(butil::memory_order_acquire);
+    if (meta != NULL) {
+        return *meta;
+    }
+    EntryMeta* new_meta = new EntryMeta;
+    new_meta->set_term(id.term);
+    new_meta->set_type(type);
+    if (peers != NULL) {
+        for (size_t i = 0; i < peers->size(); ++i) {
+            new_meta->add_peers((*peers)[i].to_string());
+        }
+        if (old_peers != NULL) {
+            for (size_t i = 0; i < old_peers->size(); ++i) {
+                new_meta->add_old_peers((*old_peers)[i].to_string());
+            }
+        }
+        if (learners != NULL) {
+            for (size_t i = 0; i < learners->size(); ++i) {
+                new_meta->add_learners((*learners)[i].to_string());
+            }
+        }
+    }
+    new_meta->set_data_len(data.length());
+    // Another thread may have encoded it concurrently, keep the first one
+    if (!_meta.compare_exchange_strong(meta, new_meta,
+                                       butil::memory_order_acq_rel)) {
+        delete new_meta;
+        return *meta;
+    }
+    return *new_meta;
 }
 
 butil::Status parse_configuration_meta(const butil::IOBuf& data, LogEntry* entry) {
@@ -49,6 +116,12 @@ butil::Status parse_configuration_meta(const butil::IOBuf& data, LogEntry* entry
             entry->old_peers->push_back(PeerId(meta.old_peers(i)));
         }
     }
+    if (meta.learners_size() > 0) {
+        entry->learners = new std::vector<PeerId>;
+        for (int i = 0; i < meta.learners_size(); i++) {
+            entry->learners->push_back(PeerId(meta.learners(i)));
+        }
+    }
     return status;    
 }
 
@@ -63,6 +136,11 @@ butil::Status serialize_configuration_meta(const LogEntry* entry, butil::IOBuf&
             meta.add_old_peers((*(entry->old_peers))[i].to_string());
         }
     }
+    if (entry->learners) {
+        for (size_t i = 0; i < entry->learners->size(); ++i) {
+            meta.add_learners((*(entry->learners))[i].to_string());
+        }
+    }
     butil::IOBufAsZeroCopyOutputStream wrapper(&data);
     if (!meta.SerializeToZeroCopyStream(&wrapper)) {
         status.set_error(EINVAL, "Fail to serialize ConfigurationPBMeta");
@@ -70,4 +148,130 @@ butil::Status serialize_configuration_meta(const LogEntry* entry, butil::IOBuf&
     return status;
 }
 
+void serialize_data_batch(const std::vector<butil::IOBuf*>& datas,
+                          butil::IOBuf* data) {
+    std::vector<char> header((datas.size() + 1) * sizeof(uint32_t));
+    butil::RawPacker packer(&header[0]);
+    packer.pack32(datas.size());
+    for (size_t i = 0; i < datas.size(); ++i) {
+        packer.pack32(datas[i]->size());
+    }
+    data->append(&header[0], header.size());
+    for (size_t i = 0; i < datas.size(); ++i) {
+        data->append(butil::IOBuf::Movable(*datas[i]));
+    }
+}
+
+butil::Status parse_data_batch(const butil::IOBuf& data,
+                               std::vector<butil::IOBuf>* datas) {
+    butil::Status status;
+    char buf[sizeof(uint32_t)];
+    uint32_t count = 0;
+    if (data.copy_to(buf, sizeof(buf)) != sizeof(buf)) {
+        status.set_error(EINVAL, "Fail to parse the count of tasks");
+        return status;
+    }
+    butil::RawUnpacker(buf).unpack32(count);
+    const size_t header_size = ((size_t)count + 1) * sizeof(uint32_t);
+    if (data.size() < header_size) {
+        status.set_error(EINVAL, "Fail to parse the length of %u tasks", count);
+        return status;
+    }
+    std::vector<char> header(header_size);
+    data.copy_to(&header[0], header_size);
+    butil::RawUnpacker unpacker(&header[sizeof(uint32_t)]);
+    butil::IOBuf payload(data);
+    payload.pop_front(header_size);
+    datas->resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t len = 0;
+        unpacker.unpack32(len);
+        if (payload.cutn(&(*datas)[i], len) != len) {
+            status.set_error(EINVAL, "Data of task %u is truncated", i);
+            return status;
+        }
+    }
+    if (!payload.empty()) {
+        status.set_error(EINVAL, "%zu bytes left after %u tasks",
+                         payload.size(), count);
+    }
+    return status;
+}
+
+void serialize_partitioned_data(int64_t partition_key, butil::IOBuf* task_data,
+                                butil::IOBuf* data) {
+    char header[sizeof(uint64_t)];
+    butil::RawPacker(header).pack64(partition_key);
+    data->append(header, sizeof(header));
+    data->append(butil::IOBuf::Movable(*task_data));
+}
+
+butil::Status parse_partitioned_data(const butil::IOBuf& data,
+                                     int64_t* partition_key,
+                                     butil::IOBuf* task_data) {
+    butil::Status status;
+    char header[sizeof(uint64_t)];
+    if (data.copy_to(header, sizeof(header)) != sizeof(header)) {
+        status.set_error(EINVAL, "Fail to parse the partition key");
+        return status;
+    }
+    uint64_t key = 0;
+    butil::RawUnpacker(header).unpack64(key);
+    *partition_key = key;
+    *task_data = data;
+    task_data->pop_front(sizeof(header));
+    return status;
+}
+
+bool pack_entry_metas(const google::protobuf::RepeatedPtrField<EntryMeta>& metas,
+                      int64_t base_term, std::string* packed) {
+    packed->resize(metas.size() * PACKED_ENTRY_META_SIZE);
+    char* p = packed->empty() ? NULL : &(*packed)[0];
+    for (int i = 0; i < metas.size(); ++i) {
+        const EntryMeta& meta = metas.Get(i);
+        const int64_t term_delta = meta.term() - base_term;
+        if (meta.peers_size() != 0 || meta.old_peers_size() != 0
+                || meta.learners_size() != 0
+                || term_delta < 0 || term_delta > (int64_t)UINT32_MAX
+                || meta.data_len() < 0 || meta.data_len() > (int64_t)UINT32_MAX) {
+            packed->clear();
+            return false;
+        }
+        butil::RawPacker(p).pack32(term_delta);
+        p[sizeof(uint32_t)] = (char)(uint8_t)meta.type();
+        butil::RawPacker(p + sizeof(uint32_t) + 1).pack32(meta.data_len());
+        p += PACKED_ENTRY_META_SIZE;
+    }
+    return true;
+}
+
+butil::Status unpack_entry_metas(
+        const std::string& packed, int64_t base_term,
+        google::protobuf::RepeatedPtrField<EntryMeta>* metas) {
+    butil::Status status;
+    if (packed.size() % PACKED_ENTRY_META_SIZE != 0) {
+        status.set_error(EINVAL, "Invalid size of packed entries=%lu",
+                         packed.size());
+        return status;
+    }
+    const char* p = packed.data();
+    for (size_t i = 0; i < packed.size() / PACKED_ENTRY_META_SIZE; ++i) {
+        uint32_t term_delta = 0;
+        uint32_t data_len = 0;
+        butil::RawUnpacker(p).unpack32(term_delta);
+        const int type = (uint8_t)p[sizeof(uint32_t)];
+        butil::RawUnpacker(p + sizeof(uint32_t) + 1).unpack32(data_len);
+        if (!EntryType_IsValid(type) || type == ENTRY_TYPE_CONFIGURATION) {
+            status.set_error(EINVAL, "Invalid type=%d of packed entry", type);
+            return status;
+        }
+        EntryMeta* meta = metas->Add();
+        meta->set_term(base_term + term_delta);
+        meta->set_type((EntryType)type);
+        meta->set_data_len(data_len);
+        p += PACKED_ENTRY_META_SIZE;
+    }
+    return status;
+}
+
 }
@@ -19,6 +19,7 @@
 
 #include <butil/iobuf.h>                         // butil::IOBuf
 #include <butil/memory/ref_counted.h>            // butil::RefCountedThreadSafe
+#include <butil/atomicops.h>                     // butil::atomic
 #include <butil/third_party/murmurhash3/murmurhash3.h>  // fmix64
 #include "braft/configuration.h"
 #include "braft/raft.pb.h"
@@ -41,14 +42,29 @@ public:
     LogId id;
     std::vector<PeerId>* peers; // peers
     std::vector<PeerId>* old_peers; // peers
+    std::vector<PeerId>* learners; // non-voting peers
     butil::IOBuf data;
 
     LogEntry();
 
+    // The memory of entries comes from the thread-local caches of
+    // butil::ObjectPool and goes back there when the last reference is
+    // released, which saves the allocations of the entries of both leaders
+    // and followers. Returns NULL if the pool runs out of memory.
+    static void* operator new(size_t size) noexcept;
+    static void operator delete(void* ptr, size_t size);
+
+    // Wire metadata of this entry, which is encoded on the first call and
+    // shared by all the following calls, e.g. from the replicators of all the
+    // followers. Don't modify the entry after calling this.
+    const EntryMeta& meta() const;
+
 private:
     DISALLOW_COPY_AND_ASSIGN(LogEntry);
     friend class butil::RefCountedThreadSafe<LogEntry>;
     virtual ~LogEntry();
+
+    mutable butil::atomic<EntryMeta*> _meta;
 };
 
 // Comparators
@@ -98,6 +114,52 @@ butil::Status parse_configuration_meta(const butil::IOBuf& data, LogEntry* entry
 
 butil::Status serialize_configuration_meta(const LogEntry* entry, butil::IOBuf& data);
 
+// Whether logs of |type| carry the data of tasks
+inline bool is_data_entry(EntryType type) {
+    return type == ENTRY_TYPE_DATA || type == ENTRY_TYPE_DATA_BATCH
+            || type == ENTRY_TYPE_PARTITIONED_DATA;
+}
+
+// The data of ENTRY_TYPE_DATA_BATCH is the number of the packed tasks and
+// the length of each task followed by the data of the tasks, all in network
+// byte order. The data of |datas| is moved into |data|.
+void serialize_data_batch(const std::vector<butil::IOBuf*>& datas,
+                          butil::IOBuf* data);
+
+butil::Status parse_data_batch(const butil::IOBuf& data,
+                               std::vector<butil::IOBuf>* datas);
+
+// The data of ENTRY_TYPE_PARTITIONED_DATA is the partition key in network
+// byte order followed by the data of the task, which is moved into |data|.
+void serialize_partitioned_data(int64_t partition_key, butil::IOBuf* task_data,
+                                butil::IOBuf* data);
+
+butil::Status parse_partitioned_data(const butil::IOBuf& data,
+                                     int64_t* partition_key,
+                                     butil::IOBuf* task_data);
+
+// Size of the records of AppendEntriesRequest::packed_entries, each of which
+// is the term of the entry minus prev_log_term of the request (uint32), the
+// type (uint8) and the data length (uint32) in network byte order
+static const size_t PACKED_ENTRY_META_SIZE = 9;
+
+// Pack |metas| into |packed|.
+// Returns false if any of |metas| has peers or doesn't fit in a record, in
+// which case the repeated EntryMeta should be used instead
+bool pack_entry_metas(const google::protobuf::RepeatedPtrField<EntryMeta>& metas,
+                      int64_t base_term, std::string* packed);
+
+butil::Status unpack_entry_metas(
+        const std::string& packed, int64_t base_term,
+        google::protobuf::RepeatedPtrField<EntryMeta>* metas);
+
+// Number of the entries of |request|, which may be packed
+inline int append_entries_count(const AppendEntriesRequest& request) {
+    return request.has_packed_entries()
+           ? int(request.packed_entries().size() / PACKED_ENTRY_META_SIZE)
+           : request.entries_size();
+}
+
 }  //  namespace braft
 
 #endif  //BRAFT_LOG_ENTRY_H
@@ -0,0 +1,147 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/log_entry_cache.h"
+
+#include <pthread.h>
+#include <gflags/gflags.h>
+#include <butil/atomicops.h>
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>
+
+namespace braft {
+
+DEFINE_int32(raft_log_cache_size_mb, 0,
+             "Max size of the process-wide cache of entries read from "
+             "LogStorage, 0 to disable the cache. The cache is created on the "
+             "first use and it's not disabled by setting this to 0 afterwards");
+BRPC_VALIDATE_GFLAG(raft_log_cache_size_mb, brpc::NonNegativeInteger);
+
+static bvar::Adder<int64_t> g_log_cache_hit("raft_log_cache_hit");
+static bvar::Adder<int64_t> g_log_cache_miss("raft_log_cache_miss");
+static bvar::Adder<int64_t> g_log_cache_eviction("raft_log_cache_eviction");
+
+// Overhead of Node and the hash entry
+static const size_t CACHE_NODE_OVERHEAD = 64;
+
+static pthread_once_t g_cache_once = PTHREAD_ONCE_INIT;
+static LogEntryCache* g_cache = NULL;
+static butil::static_atomic<int64_t> g_next_cache_id = BUTIL_STATIC_ATOMIC_INIT(1);
+
+static size_t get_cache_size(void* arg) {
+    return static_cast<LogEntryCache*>(arg)->size();
+}
+
+LogEntryCache* LogEntryCache::get_instance() {
+    if (FLAGS_raft_log_cache_size_mb <= 0 && g_cache == NULL) {
+        return NULL;
+    }
+    struct Creator {
+        static void create() {
+            g_cache = new LogEntryCache;
+            static bvar::PassiveStatus<size_t> s_cache_size(
+                    "raft_log_cache_size", get_cache_size, g_cache);
+        }
+    };
+    pthread_once(&g_cache_once, Creator::create);
+    return g_cache;
+}
+
+int64_t LogEntryCache::new_cache_id() {
+    return g_next_cache_id.fetch_add(1, butil::memory_order_relaxed);
+}
+
+LogEntryCache::LogEntryCache() {
+    for (size_t i = 0; i < SHARD_NUM; ++i) {
+        CHECK_EQ(0, _shards[i].map.init(1024));
+    }
+}
+
+LogEntryCache::~LogEntryCache() {
+    for (size_t i = 0; i < SHARD_NUM; ++i) {
+        for (NodeList::iterator it = _shards[i].lru.begin();
+                it != _shards[i].lru.end(); ++it) {
+            it->entry->Release();
+        }
+    }
+}
+
+LogEntry* LogEntryCache::get(int64_t cache_id, int64_t index) {
+    Key key;
+    key.cache_id = cache_id;
+    key.index = index;
+    Shard* shard = shard_of(key);
+    BAIDU_SCOPED_LOCK(shard->mutex);
+    NodeList::iterator* it = shard->map.seek(key);
+    if (it == NULL) {
+        g_log_cache_miss << 1;
+        return NULL;
+    }
+    g_log_cache_hit << 1;
+    // Move to the most recently used end
+    shard->lru.splice(shard->lru.end(), shard->lru, *it);
+    LogEntry* entry = (*it)->entry;
+    entry->AddRef();
+    return entry;
+}
+
+void LogEntryCache::put(int64_t cache_id, LogEntry* entry) {
+    const size_t capacity =
+            (size_t)FLAGS_raft_log_cache_size_mb * 1024 * 1024 / SHARD_NUM;
+    const size_t bytes = entry->data.size() + CACHE_NODE_OVERHEAD;
+    if (bytes > capacity) {
+        return;
+    }
+    Key key;
+    key.cache_id = cache_id;
+    key.index = entry->id.index;
+    Shard* shard = shard_of(key);
+    std::vector<LogEntry*> evicted;
+    {
+        BAIDU_SCOPED_LOCK(shard->mutex);
+        if (shard->map.seek(key) != NULL) {
+            return;
+        }
+        while (shard->bytes + bytes > capacity && !shard->lru.empty()) {
+            Node& node = shard->lru.front();
+            shard->map.erase(node.key);
+            shard->bytes -= node.bytes;
+            evicted.push_back(node.entry);
+            shard->lru.pop_front();
+        }
+        Node node;
+        node.key = key;
+        node.entry = entry;
+        node.bytes = bytes;
+        entry->AddRef();
+        shard->lru.push_back(node);
+        shard->map[key] = --shard->lru.end();
+        shard->bytes += bytes;
+    }
+    g_log_cache_eviction << evicted.size();
+    for (size_t i = 0; i < evicted.size(); ++i) {
+        evicted[i]->Release();
+    }
+}
+
+size_t LogEntryCache::size() {
+    size_t bytes = 0;
+    for (size_t i = 0; i < SHARD_NUM; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i].mutex);
+        bytes += _shards[i].bytes;
+    }
+    return bytes;
+}
+
+}  //  namespace braft
@@ -0,0 +1,87 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_LOG_ENTRY_CACHE_H
+#define BRAFT_LOG_ENTRY_CACHE_H
+
+#include <list>
+#include <gflags/gflags.h>
+#include <butil/containers/flat_map.h>           // butil::FlatMap
+#include "braft/log_entry.h"
+#include "braft/macros.h"
+
+namespace braft {
+
+DECLARE_int32(raft_log_cache_size_mb);
+
+// Process-wide LRU cache of the entries read from LogStorage, so that lagging
+// replicators and readers of committed logs don't read the same entries from
+// disk again and again. Entries are keyed by (|cache_id|, index), where
+// |cache_id| is got from new_cache_id() and is replaced by the owner whenever
+// the cached entries become invalid, e.g. after truncating suffix.
+class LogEntryCache {
+public:
+    // Returns NULL if raft_log_cache_size_mb is 0
+    static LogEntryCache* get_instance();
+
+    static int64_t new_cache_id();
+
+    // Return the entry with a reference added, NULL if it's not cached
+    LogEntry* get(int64_t cache_id, int64_t index);
+
+    void put(int64_t cache_id, LogEntry* entry);
+
+    // Total bytes of the cached entries
+    size_t size();
+
+private:
+    struct Key {
+        int64_t cache_id;
+        int64_t index;
+        bool operator==(const Key& rhs) const {
+            return cache_id == rhs.cache_id && index == rhs.index;
+        }
+    };
+    struct KeyHasher {
+        size_t operator()(const Key& key) const {
+            return key.cache_id * 1000003 + key.index;
+        }
+    };
+    struct Node {
+        Key key;
+        LogEntry* entry;
+        size_t bytes;
+    };
+    typedef std::list<Node> NodeList;
+    struct BAIDU_CACHELINE_ALIGNMENT Shard {
+        Shard() : bytes(0) {}
+        raft_mutex_t mutex;
+        NodeList lru;
+        butil::FlatMap<Key, NodeList::iterator, KeyHasher> map;
+        size_t bytes;
+    };
+    static const size_t SHARD_NUM = 32;
+
+    LogEntryCache();
+    ~LogEntryCache();
+    Shard* shard_of(const Key& key) {
+        return &_shards[KeyHasher()(key) % SHARD_NUM];
+    }
+
+    Shard _shards[SHARD_NUM];
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_LOG_ENTRY_CACHE_H
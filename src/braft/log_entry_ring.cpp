@@ -0,0 +1,173 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/log_entry_ring.h"
+
+#include <sched.h>
+#include <butil/logging.h>
+
+namespace braft {
+
+static const size_t LOG_ENTRY_RING_INITIAL_CAPACITY = 256;
+
+static butil::static_atomic<int64_t> g_total_bytes = BUTIL_STATIC_ATOMIC_INIT(0);
+
+int64_t LogEntryRing::total_bytes() {
+    return g_total_bytes.load(butil::memory_order_relaxed);
+}
+
+LogEntryRing::LogEntryRing(bool count_in_total)
+    : _array(new Array(LOG_ENTRY_RING_INITIAL_CAPACITY))
+    , _first_index(0)
+    , _size(0)
+    , _bytes(0)
+    , _count_in_total(count_in_total)
+{}
+
+LogEntryRing::~LogEntryRing() {
+    while (!empty()) {
+        pop_front()->Release();
+    }
+    Array* array = _array.load(butil::memory_order_relaxed);
+    while (array) {
+        Array* prev = array->prev;
+        delete array;
+        array = prev;
+    }
+}
+
+LogEntry* LogEntryRing::get(int64_t index) const {
+    if (index <= 0) {
+        return NULL;
+    }
+    const Slot& slot = _array.load(butil::memory_order_acquire)->slot(index);
+    // Pin the slot before checking the tag, which pairs with clear()
+    slot.readers.fetch_add(1, butil::memory_order_seq_cst);
+    LogEntry* entry = NULL;
+    if (slot.index.load(butil::memory_order_seq_cst) == index) {
+        entry = slot.entry.load(butil::memory_order_relaxed);
+        entry->AddRef();
+    }
+    slot.readers.fetch_sub(1, butil::memory_order_release);
+    return entry;
+}
+
+int64_t LogEntryRing::get_term(int64_t index) const {
+    if (index <= 0) {
+        return 0;
+    }
+    const Slot& slot = _array.load(butil::memory_order_acquire)->slot(index);
+    slot.readers.fetch_add(1, butil::memory_order_seq_cst);
+    int64_t term = 0;
+    if (slot.index.load(butil::memory_order_seq_cst) == index) {
+        term = slot.entry.load(butil::memory_order_relaxed)->id.term;
+    }
+    slot.readers.fetch_sub(1, butil::memory_order_release);
+    return term;
+}
+
+void LogEntryRing::publish(Slot& slot, int64_t index, LogEntry* entry) {
+    slot.entry.store(entry, butil::memory_order_relaxed);
+    // Readers seeing |index| see |entry| as well
+    slot.index.store(index, butil::memory_order_seq_cst);
+}
+
+LogEntry* LogEntryRing::clear(Slot& slot) {
+    slot.index.store(0, butil::memory_order_seq_cst);
+    // Readers pinned before the reset might have seen the old tag, wait for
+    // them. This is short as readers only add a reference.
+    while (slot.readers.load(butil::memory_order_seq_cst) != 0) {
+        sched_yield();
+    }
+    LogEntry* entry = slot.entry.load(butil::memory_order_relaxed);
+    slot.entry.store(NULL, butil::memory_order_relaxed);
+    return entry;
+}
+
+void LogEntryRing::grow() {
+    Array* old_array = _array.load(butil::memory_order_relaxed);
+    Array* new_array = new Array(old_array->capacity * 2);
+    for (int64_t index = _first_index;
+            index < _first_index + (int64_t)_size; ++index) {
+        LogEntry* entry = old_array->slot(index).entry.load(
+                                butil::memory_order_relaxed);
+        entry->AddRef();
+        publish(new_array->slot(index), index, entry);
+    }
+    new_array->prev = old_array;
+    _array.store(new_array, butil::memory_order_release);
+    for (int64_t index = _first_index;
+            index < _first_index + (int64_t)_size; ++index) {
+        clear(old_array->slot(index))->Release();
+    }
+}
+
+void LogEntryRing::push_back(LogEntry* entry) {
+    if (_size == 0) {
+        _first_index = entry->id.index;
+    } else {
+        CHECK_EQ(_first_index + (int64_t)_size, entry->id.index);
+    }
+    if (_size == _array.load(butil::memory_order_relaxed)->capacity) {
+        grow();
+    }
+    publish(_array.load(butil::memory_order_relaxed)->slot(entry->id.index),
+            entry->id.index, entry);
+    ++_size;
+    const int64_t bytes = entry->data.size();
+    _bytes.fetch_add(bytes, butil::memory_order_relaxed);
+    if (_count_in_total) {
+        g_total_bytes.fetch_add(bytes, butil::memory_order_relaxed);
+    }
+}
+
+void LogEntryRing::on_removed(const LogEntry* entry) {
+    const int64_t bytes = entry->data.size();
+    _bytes.fetch_sub(bytes, butil::memory_order_relaxed);
+    if (_count_in_total) {
+        g_total_bytes.fetch_sub(bytes, butil::memory_order_relaxed);
+    }
+}
+
+LogEntry* LogEntryRing::pop_front() {
+    CHECK(!empty());
+    LogEntry* entry = clear(
+            _array.load(butil::memory_order_relaxed)->slot(_first_index));
+    ++_first_index;
+    --_size;
+    on_removed(entry);
+    return entry;
+}
+
+LogEntry* LogEntryRing::pop_back() {
+    CHECK(!empty());
+    LogEntry* entry = clear(_array.load(butil::memory_order_relaxed)->slot(
+                                _first_index + _size - 1));
+    --_size;
+    on_removed(entry);
+    return entry;
+}
+
+LogEntry* LogEntryRing::replace(LogEntry* entry) {
+    const int64_t index = entry->id.index;
+    CHECK(at(index) != NULL) << "index=" << index << " is not in the ring";
+    Slot& slot = _array.load(butil::memory_order_relaxed)->slot(index);
+    LogEntry* old_entry = clear(slot);
+    CHECK_EQ(old_entry->data.size(), entry->data.size());
+    // Readers missing the slot in between fall back to the slower path
+    publish(slot, index, entry);
+    return old_entry;
+}
+
+}  //  namespace braft
@@ -0,0 +1,122 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_LOG_ENTRY_RING_H
+#define BRAFT_LOG_ENTRY_RING_H
+
+#include <butil/macros.h>
+#include <butil/atomicops.h>
+#include "braft/log_entry.h"
+
+namespace braft {
+
+// Ring buffer of the continuous logs in memory, which grows when it's full.
+// Modifications must be serialized by the caller, while get() and get_term()
+// are lock-free and could run concurrently with the modifications.
+//
+// Each slot is tagged with the index of the log it holds. A reader pins the
+// slot by bumping its reader count and then validates the tag, and the writer
+// resets the tag and waits for the pinned readers to go before releasing the
+// log of the slot, so that readers never touch a released log.
+class LogEntryRing {
+public:
+    // The logs of the ring are counted in total_bytes() if |count_in_total|
+    explicit LogEntryRing(bool count_in_total = true);
+    ~LogEntryRing();
+
+    // Lock-free, returns the log with a reference added, NULL if |index| is
+    // not in the ring
+    LogEntry* get(int64_t index) const;
+
+    // Lock-free, returns 0 if |index| is not in the ring
+    int64_t get_term(int64_t index) const;
+
+    // Lock-free, data bytes of the logs in this ring
+    int64_t bytes() const { return _bytes.load(butil::memory_order_relaxed); }
+
+    // Lock-free, data bytes of the logs in all the rings of this process
+    // counted in total
+    static int64_t total_bytes();
+
+    // Following methods must be serialized by the caller
+
+    bool empty() const { return _size == 0; }
+    size_t size() const { return _size; }
+    LogEntry* front() const { return entry_of(_first_index); }
+    LogEntry* back() const { return entry_of(_first_index + _size - 1); }
+    // Returns NULL if |index| is not in the ring
+    LogEntry* at(int64_t index) const {
+        if (index < _first_index || index >= _first_index + (int64_t)_size) {
+            return NULL;
+        }
+        return entry_of(index);
+    }
+
+    // Take over the reference of |entry|, whose index must be next to back()
+    void push_back(LogEntry* entry);
+
+    // Remove the first/last log and return it along with the reference held
+    // by the ring
+    LogEntry* pop_front();
+    LogEntry* pop_back();
+
+    // Replace the log of the same index with |entry| whose reference is taken
+    // over, and return the old one along with the reference held by the ring.
+    // Both must have the same data size.
+    LogEntry* replace(LogEntry* entry);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LogEntryRing);
+
+    struct Slot {
+        Slot() : index(0), readers(0), entry(NULL) {}
+        // 0 means empty as log indexes start from 1
+        butil::atomic<int64_t> index;
+        mutable butil::atomic<int64_t> readers;
+        butil::atomic<LogEntry*> entry;
+    };
+
+    struct Array {
+        explicit Array(size_t cap)
+            : capacity(cap), slots(new Slot[cap]), prev(NULL) {}
+        ~Array() { delete [] slots; }
+        Slot& slot(int64_t index) const {
+            return slots[index & (capacity - 1)];
+        }
+        size_t capacity;
+        Slot* slots;
+        // Replaced arrays are kept until the ring is destroyed as readers
+        // might be still visiting them
+        Array* prev;
+    };
+
+    LogEntry* entry_of(int64_t index) const {
+        return _array.load(butil::memory_order_relaxed)->slot(index)
+                .entry.load(butil::memory_order_relaxed);
+    }
+    static void publish(Slot& slot, int64_t index, LogEntry* entry);
+    static LogEntry* clear(Slot& slot);
+    void grow();
+    void on_removed(const LogEntry* entry);
+
+    butil::atomic<Array*> _array;
+    int64_t _first_index;
+    size_t _size;
+    butil::atomic<int64_t> _bytes;
+    bool _count_in_total;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_LOG_ENTRY_RING_H
@@ -17,17 +17,166 @@
 
 #include "braft/log_manager.h"
 
+#include <inttypes.h>
+#include <map>
+
 #include <butil/logging.h>                       // LOG
 #include <butil/object_pool.h>                   // butil::get_object
 #include <bthread/unstable.h>                   // bthread_flush
 #include <bthread/countdown_event.h>            // bthread::CountdownEvent
+#include <butil/string_printf.h>                 // butil::string_printf
 #include <brpc/reloadable_flags.h>         // BRPC_VALIDATE_GFLAG
 #include "braft/storage.h"                       // LogStorage
 #include "braft/fsm_caller.h"                    // FSMCaller
+#include "braft/log_entry_cache.h"               // LogEntryCache
+#include "braft/fsync.h"                         // DeferredSyncs
 
 namespace braft {
 
 DEFINE_int32(raft_leader_batch, 256, "max leader io batch");
+DECLARE_int32(raft_max_append_buffer_size);
+
+DEFINE_bool(raft_pipeline_log_sync, false,
+            "Sync the appended entries in a separate thread, so that the next "
+            "batch is written while the fsync of the previous is in flight. "
+            "Takes effect for the LogManager created afterwards");
+BRPC_VALIDATE_GFLAG(raft_pipeline_log_sync, ::brpc::PassValidate);
+
+DEFINE_int32(raft_relaxed_sync_interval_ms, 100,
+             "Max milliseconds for the written entries of the nodes with "
+             "relaxed_log_durability to stay not fsynced");
+BRPC_VALIDATE_GFLAG(raft_relaxed_sync_interval_ms, brpc::PositiveInteger);
+
+DEFINE_int64(raft_relaxed_sync_bytes, 4 * 1024 * 1024,
+             "The entries of the nodes with relaxed_log_durability are "
+             "fsynced once the data bytes written since the last fsync "
+             "reach this value");
+BRPC_VALIDATE_GFLAG(raft_relaxed_sync_bytes, brpc::PositiveInteger);
+
+DEFINE_int64(raft_retained_log_bytes, 0,
+             "The logs dropped by snapshots are retained for the slowest "
+             "follower of the leader to catch up from the logs rather than "
+             "installing a snapshot, as long as the logs it needs take no "
+             "more than this many data bytes, 0 means no retention");
+BRPC_VALIDATE_GFLAG(raft_retained_log_bytes, brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_retained_log_max_age_s, 600,
+             "The retained logs must also be appended within this many "
+             "seconds, 0 means no limit");
+BRPC_VALIDATE_GFLAG(raft_retained_log_max_age_s, brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_max_logs_in_memory_bytes, 0,
+             "Max data bytes of the logs in memory (not flushed or not applied "
+             "yet) of a node, new tasks are rejected with EBUSY when it's "
+             "exceeded, 0 means unlimited");
+BRPC_VALIDATE_GFLAG(raft_max_logs_in_memory_bytes, brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_max_total_logs_in_memory_bytes, 0,
+             "Max data bytes of the logs in memory of all the nodes in this "
+             "process, 0 means unlimited");
+BRPC_VALIDATE_GFLAG(raft_max_total_logs_in_memory_bytes, brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_apply_memory_budget_wait_ms, 0,
+             "Max milliseconds for a new task to wait for the logs in memory to "
+             "drop below the budget before being rejected, 0 means failing fast");
+BRPC_VALIDATE_GFLAG(raft_apply_memory_budget_wait_ms, brpc::NonNegativeInteger);
+
+static int64_t get_total_logs_in_memory_bytes(void*) {
+    return LogEntryRing::total_bytes();
+}
+static bvar::PassiveStatus<int64_t> g_total_logs_in_memory_bytes(
+        "raft_logs_in_memory_bytes", get_total_logs_in_memory_bytes, NULL);
+static bvar::Adder<int64_t> g_memory_budget_rejected(
+        "raft_memory_budget_rejected_count");
+
+DEFINE_bool(raft_batch_new_log_waiters, false,
+            "Notify all the waiters of new logs, e.g. the replicators, in one "
+            "bthread instead of one bthread per waiter");
+BRPC_VALIDATE_GFLAG(raft_batch_new_log_waiters, ::brpc::PassValidate);
+
+static bvar::IntRecorder g_new_log_waiters_batch(
+        "raft_new_log_waiters_batch");
+
+DEFINE_int32(raft_compact_logs_in_memory_max_bytes, 0,
+             "Data logs no larger than this, which stay in memory on disk for "
+             "raft_compact_logs_in_memory_age_ms waiting to be applied, are "
+             "copied into densely packed blocks so that they don't pin the "
+             "larger blocks they were cut from, 0 to disable");
+BRPC_VALIDATE_GFLAG(raft_compact_logs_in_memory_max_bytes,
+                    brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_compact_logs_in_memory_age_ms, 1000,
+             "Min milliseconds for a log to stay in memory before compacted");
+BRPC_VALIDATE_GFLAG(raft_compact_logs_in_memory_age_ms,
+                    brpc::NonNegativeInteger);
+
+static bvar::Adder<int64_t> g_compacted_logs_in_memory(
+        "raft_compacted_logs_in_memory_count");
+
+// Pooled along with the capacity of |wms| so that no allocation is needed
+// in the steady state
+struct LogManager::WaitMetaBatch {
+    std::vector<WaitMeta*> wms;
+};
+
+struct LogManager::SyncTask {
+    std::vector<StableClosure*> dones;
+    LogId last_id;
+    // Signaled when this task is done if not NULL
+    bthread::CountdownEvent* barrier;
+    // Sync the storage even if |dones| is empty
+    bool force_sync;
+};
+
+DEFINE_bool(raft_share_disk_thread, false,
+            "Write the logs of all the nodes on the same device in one disk "
+            "thread, which appends the batches of the nodes in turn and syncs "
+            "them together, with one syncfs if raft_group_commit_use_syncfs is "
+            "on. Takes effect for the LogManager initialized afterwards");
+BRPC_VALIDATE_GFLAG(raft_share_disk_thread, ::brpc::PassValidate);
+
+static bvar::IntRecorder g_shared_disk_thread_batch(
+        "raft_shared_disk_thread_batch");
+
+// Disk thread shared by the LogManagers of which the logs are on the same
+// device. The closures of each LogManager are handled in the order of
+// submission as in its own disk thread, while the syncs of all the
+// LogManagers in one round are deferred and flushed together. Never
+// destroyed.
+class SharedDiskThread {
+public:
+    struct Task {
+        LogManager* log_manager;
+        LogManager::StableClosure* done;
+    };
+
+    // Returns the thread of |disk| and |bthread_tag|, which is started on
+    // the first call
+    static SharedDiskThread* get(uint64_t disk, int bthread_tag);
+
+    int submit(LogManager* log_manager, LogManager::StableClosure* done) {
+        Task task;
+        task.log_manager = log_manager;
+        task.done = done;
+        return bthread::execution_queue_execute(_queue, task);
+    }
+
+private:
+    static int run(void* meta, bthread::TaskIterator<Task>& iter);
+
+    bthread::ExecutionQueueId<Task> _queue;
+};
+
+// The last closure of a LogManager submitted to SharedDiskThread, which is
+// run after all the others of the LogManager are done
+class DiskBarrierClosure : public LogManager::StableClosure {
+public:
+    DiskBarrierClosure() : _event(1) {}
+    void Run() { _event.signal(); }
+    void wait() { _event.wait(); }
+private:
+    bthread::CountdownEvent _event;
+};
 BRPC_VALIDATE_GFLAG(raft_leader_batch, ::brpc::PositiveInteger);
 
 static bvar::Adder<int64_t> g_read_entry_from_storage
@@ -42,16 +191,34 @@ static bvar::PerSecond<bvar::Adder<int64_t> > g_read_term_from_storage_second
 
 static bvar::LatencyRecorder g_storage_append_entries_latency(
                                         "raft_storage_append_entries");
+static bvar::Adder<int64_t> g_storage_append_entries_bytes(
+                                        "raft_storage_append_entries_bytes");
+static bvar::PerSecond<bvar::Adder<int64_t> > g_storage_append_entries_bytes_second(
+        "raft_storage_append_entries_bytes_second",
+        &g_storage_append_entries_bytes);
 static bvar::LatencyRecorder g_nomralized_append_entries_latency(
                                         "raft_storage_append_entries_normalized");
 
+static bvar::LatencyRecorder g_storage_sync_entries_latency(
+                                        "raft_storage_sync_entries");
 static bvar::CounterRecorder g_storage_flush_batch_counter(
                                         "raft_storage_flush_batch_counter");
 
+int64_t storage_append_entries_latency_us(time_t window_s) {
+    return g_storage_append_entries_latency.latency(window_s);
+}
+
+int64_t storage_append_entries_bytes_second(time_t window_s) {
+    return g_storage_append_entries_bytes_second.get_value(window_s);
+}
+
 LogManagerOptions::LogManagerOptions()
     : log_storage(NULL)
     , configuration_manager(NULL)
     , fsm_caller(NULL)
+    , bthread_tag(-1)
+    , disk(0)
+    , relaxed_durability(false)
 {}
 
 LogManager::LogManager()
@@ -62,6 +229,23 @@ LogManager::LogManager()
     , _next_wait_id(0)
     , _first_log_index(0)
     , _last_log_index(0)
+    , _cache_id(LogEntryCache::new_cache_id())
+    , _compact_mark_index(0)
+    , _compact_mark_ms(butil::monotonic_time_ms())
+    , _compacted_index(0)
+    , _append_buffer_limit(FLAGS_raft_max_append_buffer_size)
+    , _appended_bytes(0)
+    , _appended_bytes_at_snapshot(0)
+    , _retained_index(0)
+    , _pinned_index(0)
+    , _pipeline_sync(FLAGS_raft_pipeline_log_sync)
+    , _relaxed_durability(false)
+    , _unsynced_bytes(0)
+    , _sync_requested(false)
+    , _background_sync_stopped(false)
+    , _background_sync_tid(INVALID_BTHREAD)
+    , _bthread_tag(-1)
+    , _shared_disk_thread(NULL)
 {
     CHECK_EQ(0, start_disk_thread());
 }
@@ -85,21 +269,84 @@ int LogManager::init(const LogManagerOptions &options) {
     _last_log_index = _log_storage->last_log_index();
     _disk_id.index = _last_log_index;
     _disk_id.term = _log_storage->get_term(_last_log_index);
+    _written_id = _disk_id;
+    _durable_id = _disk_id;
     _fsm_caller = options.fsm_caller;
+    if (options.relaxed_durability) {
+        // Nothing has been queued yet, restart the disk thread along with
+        // the sync thread. The shared disk thread is not used as it syncs
+        // every round
+        stop_disk_thread();
+        _bthread_tag = options.bthread_tag;
+        _pipeline_sync = true;
+        _relaxed_durability = true;
+        if (start_disk_thread() != 0) {
+            LOG(ERROR) << "Fail to start disk thread";
+            return -1;
+        }
+    } else if (FLAGS_raft_share_disk_thread && options.disk != 0) {
+        // Nothing has been queued yet, hand over to the shared disk thread
+        SharedDiskThread* shared = SharedDiskThread::get(options.disk,
+                                                         options.bthread_tag);
+        if (shared == NULL) {
+            LOG(ERROR) << "Fail to get the shared disk thread";
+            return -1;
+        }
+        stop_disk_thread();
+        _bthread_tag = options.bthread_tag;
+        // The logs are synced along with the others' by the shared thread
+        _pipeline_sync = false;
+        _shared_disk_thread = shared;
+    } else if (options.bthread_tag >= 0) {
+        // Nothing has been queued yet, move the disk thread to the workers
+        // of the tag
+        stop_disk_thread();
+        _bthread_tag = options.bthread_tag;
+        if (start_disk_thread() != 0) {
+            LOG(ERROR) << "Fail to start disk thread";
+            return -1;
+        }
+    }
     return 0;
 }
 
 LogManager::~LogManager() {
     stop_disk_thread();
-    for (size_t i = 0; i < _logs_in_memory.size(); ++i) {
-        _logs_in_memory[i]->Release();
+    while (!_logs_in_memory.empty()) {
+        _logs_in_memory.pop_front()->Release();
+    }
+}
+
+int LogManager::submit_to_disk(StableClosure* done) {
+    if (_shared_disk_thread) {
+        return _shared_disk_thread->submit(this, done);
     }
-    _logs_in_memory.clear();
+    return bthread::execution_queue_execute(_disk_queue, done);
 }
 
 int LogManager::start_disk_thread() {
     bthread::ExecutionQueueOptions queue_options;
-    queue_options.bthread_attr = BTHREAD_ATTR_NORMAL;
+    queue_options.bthread_attr = bthread_attr_of_tag(BTHREAD_ATTR_NORMAL,
+                                                     _bthread_tag);
+    if (_pipeline_sync) {
+        const int rc = bthread::execution_queue_start(&_sync_queue,
+                                                      &queue_options,
+                                                      sync_thread,
+                                                      this);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    if (_relaxed_durability) {
+        _background_sync_stopped.store(false, butil::memory_order_relaxed);
+        const bthread_attr_t attr = bthread_attr_of_tag(BTHREAD_ATTR_NORMAL,
+                                                        _bthread_tag);
+        const int rc = bthread_start_background(&_background_sync_tid, &attr,
+                                                run_background_sync, this);
+        if (rc != 0) {
+            return rc;
+        }
+    }
     return bthread::execution_queue_start(&_disk_queue,
                                    &queue_options,
                                    disk_thread,
@@ -107,8 +354,38 @@ int LogManager::start_disk_thread() {
 }
 
 int LogManager::stop_disk_thread() {
+    if (_shared_disk_thread) {
+        // The closures of this LogManager are handled in order, all of them
+        // are done once the barrier runs
+        DiskBarrierClosure barrier;
+        const int rc = _shared_disk_thread->submit(this, &barrier);
+        if (rc == 0) {
+            barrier.wait();
+        }
+        return rc;
+    }
+    if (_background_sync_tid != INVALID_BTHREAD) {
+        _background_sync_stopped.store(true, butil::memory_order_relaxed);
+        bthread_stop(_background_sync_tid);
+        bthread_join(_background_sync_tid, NULL);
+        _background_sync_tid = INVALID_BTHREAD;
+    }
     bthread::execution_queue_stop(_disk_queue);
-    return bthread::execution_queue_join(_disk_queue);
+    int rc = bthread::execution_queue_join(_disk_queue);
+    if (_pipeline_sync) {
+        if (_relaxed_durability) {
+            // Sync what's left before quitting
+            _sync_requested.store(false, butil::memory_order_relaxed);
+            request_sync();
+        }
+        // The disk thread has quit, no more batches are coming
+        bthread::execution_queue_stop(_sync_queue);
+        const int sync_rc = bthread::execution_queue_join(_sync_queue);
+        if (rc == 0) {
+            rc = sync_rc;
+        }
+    }
+    return rc;
 }
 
 void LogManager::clear_memory_logs(const LogId& id) {
@@ -124,14 +401,95 @@ void LogManager::clear_memory_logs(const LogId& id) {
                 if (entry->id > id) {
                     break;
                 }
-                entries_to_clear[nentries++] = entry;
-                _logs_in_memory.pop_front();
+                entries_to_clear[nentries++] = _logs_in_memory.pop_front();
             }
         }  // out of _mutex
         for (size_t i = 0; i < nentries; ++i) {
             entries_to_clear[i]->Release();
         }
     } while (nentries == ARRAY_SIZE(entries_to_clear));
+    if (FLAGS_raft_compact_logs_in_memory_max_bytes > 0) {
+        compact_memory_logs();
+    }
+}
+
+void LogManager::compact_memory_logs() {
+    const size_t max_bytes = FLAGS_raft_compact_logs_in_memory_max_bytes;
+    const int64_t now_ms = butil::monotonic_time_ms();
+    std::vector<LogEntry*> entries;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (now_ms - _compact_mark_ms < FLAGS_raft_compact_logs_in_memory_age_ms) {
+            return;
+        }
+        // The logs up to the mark have been in memory for the age at least,
+        // and the ones not on disk yet are still referenced by the disk
+        // thread anyway
+        const int64_t last_index = std::min(_compact_mark_index, _disk_id.index);
+        for (int64_t index = _compacted_index + 1; index <= last_index; ++index) {
+            LogEntry* entry = _logs_in_memory.at(index);
+            if (entry == NULL || !is_data_entry(entry->type)
+                    || entry->data.empty() || entry->data.size() > max_bytes) {
+                continue;
+            }
+            entry->AddRef();
+            entries.push_back(entry);
+        }
+        _compacted_index = std::max(_compacted_index, last_index);
+        _compact_mark_index = _last_log_index;
+        _compact_mark_ms = now_ms;
+    }  // out of _mutex
+    if (entries.empty()) {
+        return;
+    }
+    // Copy the data of all the logs into as few blocks as possible, and cut
+    // them back into the compacted logs
+    butil::IOBuf packed;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const butil::IOBuf& data = entries[i]->data;
+        for (size_t j = 0; j < data.backing_block_num(); ++j) {
+            const butil::StringPiece block = data.backing_block(j);
+            packed.append(block.data(), block.size());
+        }
+    }
+    std::vector<LogEntry*> compacted(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        LogEntry* entry = new LogEntry;
+        if (entry == NULL) {
+            // Try again in the next round
+            for (size_t j = 0; j < entries.size(); ++j) {
+                entries[j]->Release();
+                if (j < i) {
+                    compacted[j]->Release();
+                }
+            }
+            return;
+        }
+        entry->AddRef();
+        entry->type = entries[i]->type;
+        entry->id = entries[i]->id;
+        packed.cutn(&entry->data, entries[i]->data.size());
+        compacted[i] = entry;
+    }
+    int64_t ncompacted = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            // Skip the logs applied or truncated in the meantime
+            if (_logs_in_memory.at(entries[i]->id.index) != entries[i]) {
+                continue;
+            }
+            // The ring takes over the reference of the compacted log and
+            // hands over the one of the old log, released below
+            compacted[i] = _logs_in_memory.replace(compacted[i]);
+            ++ncompacted;
+        }
+    }  // out of _mutex
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+        compacted[i]->Release();
+    }
+    g_compacted_logs_in_memory << ncompacted;
 }
 
 int64_t LogManager::first_log_index() {
@@ -161,7 +519,7 @@ private:
 };
 
 int64_t LogManager::last_log_index(bool is_flush) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);
     if (!is_flush) {
         return _last_log_index;
     } else {
@@ -169,7 +527,7 @@ int64_t LogManager::last_log_index(bool is_flush) {
             return _last_log_index;
         }
         LastLogIdClosure c;
-        CHECK_EQ(0, bthread::execution_queue_execute(_disk_queue, &c));
+        CHECK_EQ(0, submit_to_disk(&c));
         lck.unlock();
         c.wait();
         return c.last_log_id().index;
@@ -177,7 +535,7 @@ int64_t LogManager::last_log_index(bool is_flush) {
 }
 
 LogId LogManager::last_log_id(bool is_flush) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);
     if (!is_flush) {
         if (_last_log_index >= _first_log_index) {
             return LogId(_last_log_index, unsafe_get_term(_last_log_index));
@@ -188,7 +546,7 @@ LogId LogManager::last_log_id(bool is_flush) {
             return _last_snapshot_id;
         }
         LastLogIdClosure c;
-        CHECK_EQ(0, bthread::execution_queue_execute(_disk_queue, &c));
+        CHECK_EQ(0, submit_to_disk(&c));
         lck.unlock();
         c.wait();
         return c.last_log_id();
@@ -238,8 +596,8 @@ private:
 };
 
 int LogManager::truncate_prefix(const int64_t first_index_kept,
-                                std::unique_lock<raft_mutex_t>& lck) {
-    std::deque<LogEntry*> saved_logs_in_memory;
+                                std::unique_lock<log_manager_mutex_t>& lck) {
+    std::vector<LogEntry*> saved_logs_in_memory;
     // As the duration between two snapshot (which leads to truncate_prefix at
     // last) is likely to be a long period, _logs_in_memory is likely to
     // contain a large amount of logs to release, which holds the mutex so that
@@ -252,21 +610,25 @@ int LogManager::truncate_prefix(const int64_t first_index_kept,
     while (!_logs_in_memory.empty()) {
         LogEntry* entry = _logs_in_memory.front();
         if (entry->id.index < first_index_kept) {
-            saved_logs_in_memory.push_back(entry);
-            _logs_in_memory.pop_front();
+            saved_logs_in_memory.push_back(_logs_in_memory.pop_front());
         } else {
             break;
         }
     }
     CHECK_GE(first_index_kept, _first_log_index);
     _first_log_index = first_index_kept;
+    // Keep the last mark before the first log for the bytes after it
+    while (_retention_marks.size() > 1 &&
+            _retention_marks[1].index < first_index_kept) {
+        _retention_marks.pop_front();
+    }
     if (first_index_kept > _last_log_index) {
         // The entrie log is dropped
         _last_log_index = first_index_kept - 1;
     }
     _config_manager->truncate_prefix(first_index_kept);
     TruncatePrefixClosure* c = new TruncatePrefixClosure(first_index_kept);
-    const int rc = bthread::execution_queue_execute(_disk_queue, c);
+    const int rc = submit_to_disk(c);
     lck.unlock();
     for (size_t i = 0; i < saved_logs_in_memory.size(); ++i) {
         saved_logs_in_memory[i]->Release();
@@ -275,16 +637,24 @@ int LogManager::truncate_prefix(const int64_t first_index_kept,
 }
 
 int LogManager::reset(const int64_t next_log_index,
-                      std::unique_lock<raft_mutex_t>& lck) {
+                      std::unique_lock<log_manager_mutex_t>& lck) {
     CHECK(lck.owns_lock());
-    std::deque<LogEntry*> saved_logs_in_memory;
-    saved_logs_in_memory.swap(_logs_in_memory);
+    std::vector<LogEntry*> saved_logs_in_memory;
+    saved_logs_in_memory.reserve(_logs_in_memory.size());
+    while (!_logs_in_memory.empty()) {
+        saved_logs_in_memory.push_back(_logs_in_memory.pop_front());
+    }
     _first_log_index = next_log_index;
     _last_log_index = next_log_index - 1;
+    _retention_marks.clear();
+    _compacted_index = std::min(_compacted_index, _last_log_index);
+    _compact_mark_index = std::min(_compact_mark_index, _last_log_index);
     _config_manager->truncate_prefix(_first_log_index);
     _config_manager->truncate_suffix(_last_log_index);
+    // Entries cached with the previous id are unreachable from now on
+    _cache_id = LogEntryCache::new_cache_id();
     ResetClosure* c = new ResetClosure(next_log_index);
-    const int ret = bthread::execution_queue_execute(_disk_queue, c);
+    const int ret = submit_to_disk(c);
     lck.unlock();
     CHECK_EQ(0, ret) << "execq execute failed, ret: " << ret << " err: " << berror();
     for (size_t i = 0; i < saved_logs_in_memory.size(); ++i) {
@@ -304,20 +674,23 @@ void LogManager::unsafe_truncate_suffix(const int64_t last_index_kept) {
     while (!_logs_in_memory.empty()) {
         LogEntry* entry = _logs_in_memory.back();
         if (entry->id.index > last_index_kept) {
-            entry->Release();
-            _logs_in_memory.pop_back();
+            _logs_in_memory.pop_back()->Release();
         } else {
             break;
         }
     }
     _last_log_index = last_index_kept;
+    // Logs appended at the truncated indexes are new
+    _compacted_index = std::min(_compacted_index, last_index_kept);
+    _compact_mark_index = std::min(_compact_mark_index, last_index_kept);
+    _cache_id = LogEntryCache::new_cache_id();
     const int64_t last_term_kept = unsafe_get_term(last_index_kept);
     CHECK(last_index_kept == 0 || last_term_kept != 0)
         << "last_index_kept=" << last_index_kept;
     _config_manager->truncate_suffix(last_index_kept);
     TruncateSuffixClosure* tsc = new
             TruncateSuffixClosure(last_index_kept, last_term_kept);
-    CHECK_EQ(0, bthread::execution_queue_execute(_disk_queue, tsc));
+    CHECK_EQ(0, submit_to_disk(tsc));
 }
 
 int LogManager::check_and_resolve_conflict(
@@ -404,7 +777,7 @@ void LogManager::append_entries(
         done->status().set_error(EIO, "Corrupted LogStorage");
         return run_closure_in_bthread(done);
     }
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);
     if (!entries->empty() && check_and_resolve_conflict(entries, done) != 0) {
         lck.unlock();
         // release entries
@@ -426,11 +799,13 @@ void LogManager::append_entries(
 
     if (!entries->empty()) {
         done->_first_log_index = entries->front()->id.index;
-        _logs_in_memory.insert(_logs_in_memory.end(), entries->begin(), entries->end());
+        for (size_t i = 0; i < entries->size(); ++i) {
+            _logs_in_memory.push_back((*entries)[i]);
+        }
     }
 
     done->_entries.swap(*entries);
-    int ret = bthread::execution_queue_execute(_disk_queue, done);
+    int ret = submit_to_disk(done);
     CHECK_EQ(0, ret) << "execq execute failed, ret: " << ret << " err: " << berror();
     wakeup_all_waiter(lck);
 }
@@ -444,7 +819,9 @@ void LogManager::append_to_storage(std::vector<LogEntry*>* to_append,
         }
         butil::Timer timer;
         timer.start();
-        int nappent = _log_storage->append_entries(*to_append);
+        int nappent = _pipeline_sync
+                ? _log_storage->append_entries_nosync(*to_append)
+                : _log_storage->append_entries(*to_append);
         timer.stop();
         if (nappent != (int)to_append->size()) {
             // FIXME
@@ -457,9 +834,17 @@ void LogManager::append_to_storage(std::vector<LogEntry*>* to_append,
             *last_id = (*to_append)[nappent - 1]->id;
         }
         g_storage_append_entries_latency << timer.u_elapsed();
+        g_storage_append_entries_bytes << written_size;
+        _appended_bytes.fetch_add(written_size, butil::memory_order_relaxed);
+        if (_relaxed_durability) {
+            _unsynced_bytes.fetch_add(written_size, butil::memory_order_relaxed);
+        }
         if (written_size) {
             g_nomralized_append_entries_latency << timer.u_elapsed() * 1024 / written_size;
         }
+        if (nappent > 0 && FLAGS_raft_retained_log_bytes > 0) {
+            record_retention_mark(last_id->index);
+        }
     }
     for (size_t j = 0; j < to_append->size(); ++j) {
         (*to_append)[j]->Release();
@@ -470,6 +855,48 @@ void LogManager::append_to_storage(std::vector<LogEntry*>* to_append,
 DEFINE_int32(raft_max_append_buffer_size, 256 * 1024, 
              "Flush buffer to LogStorage if the buffer size reaches the limit");
 
+DEFINE_int32(raft_append_batch_target_latency_us, 0,
+             "Adapt the flushing limit of the append buffer to keep the latency "
+             "of appending to LogStorage below this value: the limit shrinks "
+             "multiplicatively above it and grows additively below it while "
+             "the appending queue backs up. 0 means always using "
+             "raft_max_append_buffer_size");
+BRPC_VALIDATE_GFLAG(raft_append_batch_target_latency_us, brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_max_adaptive_append_buffer_size, 8 * 1024 * 1024,
+             "Upper bound of the adaptive append buffer limit");
+BRPC_VALIDATE_GFLAG(raft_max_adaptive_append_buffer_size, brpc::PositiveInteger);
+
+static bvar::IntRecorder g_append_buffer_limit("raft_append_buffer_limit");
+
+// Bounds and growing step of the adaptive append buffer limit
+static const int64_t MIN_ADAPTIVE_APPEND_BUFFER_SIZE = 16 * 1024;
+static const int64_t ADAPTIVE_APPEND_BUFFER_STEP = 64 * 1024;
+
+void LogManager::adjust_append_buffer_limit(int64_t latency_us,
+                                            bool limit_reached) {
+    const int64_t target_us = FLAGS_raft_append_batch_target_latency_us;
+    if (target_us <= 0) {
+        _append_buffer_limit.store(FLAGS_raft_max_append_buffer_size,
+                                   butil::memory_order_relaxed);
+        return;
+    }
+    const int64_t max_limit = std::max(MIN_ADAPTIVE_APPEND_BUFFER_SIZE,
+            (int64_t)FLAGS_raft_max_adaptive_append_buffer_size);
+    // Only the disk thread writes the limit
+    int64_t limit = _append_buffer_limit.load(butil::memory_order_relaxed);
+    if (latency_us > target_us) {
+        limit = limit * 3 / 4;
+    } else if (limit_reached) {
+        // More entries are waiting, a larger batch saves the syncs
+        limit += ADAPTIVE_APPEND_BUFFER_STEP;
+    }
+    limit = std::min(max_limit,
+            std::max(MIN_ADAPTIVE_APPEND_BUFFER_SIZE, limit));
+    _append_buffer_limit.store(limit, butil::memory_order_relaxed);
+    g_append_buffer_limit << limit;
+}
+
 class AppendBatcher {
 public:
     AppendBatcher(LogManager::StableClosure* storage[], size_t cap, LogId* last_id, 
@@ -485,10 +912,45 @@ public:
     }
     ~AppendBatcher() { flush(); }
 
-    void flush() {
+    // |limit_reached| is true if the buffer is flushed as it's full
+    void flush(bool limit_reached = false) {
         if (_size > 0) {
+            const int64_t flush_start_us = butil::cpuwide_time_us();
+            for (size_t i = 0; i < _size; ++i) {
+                _storage[i]->_flush_start_us = flush_start_us;
+            }
+            butil::Timer timer;
+            timer.start();
             _lm->append_to_storage(&_to_append, _last_id);
+            timer.stop();
+            _lm->adjust_append_buffer_limit(timer.u_elapsed(), limit_reached);
             g_storage_flush_batch_counter << _size;
+            if (_lm->_shared_disk_thread) {
+                // Done after the syncs of the shared disk thread are flushed
+                for (size_t i = 0; i < _size; ++i) {
+                    _storage[i]->_entries.clear();
+                    _lm->_unsynced_closures.push_back(_storage[i]);
+                }
+                _size = 0;
+                _buffer_size = 0;
+                return;
+            }
+            if (_lm->_relaxed_durability) {
+                // Stable once written, the fsync is left to the sync thread
+                if (_lm->_unsynced_bytes.load(butil::memory_order_relaxed)
+                        >= FLAGS_raft_relaxed_sync_bytes) {
+                    _lm->request_sync();
+                }
+            } else if (_lm->_pipeline_sync) {
+                for (size_t i = 0; i < _size; ++i) {
+                    _storage[i]->_entries.clear();
+                }
+                _lm->sync_in_background(_storage, _size, *_last_id);
+                _to_append.clear();
+                _size = 0;
+                _buffer_size = 0;
+                return;
+            }
             for (size_t i = 0; i < _size; ++i) {
                 _storage[i]->_entries.clear();
                 if (_lm->_has_error.load(butil::memory_order_relaxed)) {
@@ -504,8 +966,9 @@ public:
     }
     void append(LogManager::StableClosure* done) {
         if (_size == _cap || 
-                _buffer_size >= (size_t)FLAGS_raft_max_append_buffer_size) {
-            flush();
+                (int64_t)_buffer_size >= _lm->_append_buffer_limit.load(
+                        butil::memory_order_relaxed)) {
+            flush(true);
         }
         _storage[_size++] = done;
         _to_append.insert(_to_append.end(), 
@@ -525,6 +988,43 @@ private:
     LogManager* _lm;
 };
 
+int LogManager::run_disk_operation(StableClosure* done, LogId* last_id) {
+    LastLogIdClosure* llic = dynamic_cast<LastLogIdClosure*>(done);
+    if (llic) {
+        // Not used get_disk_id() as it might be out of date
+        // FIXME: it's buggy
+        llic->set_last_log_id(*last_id);
+        return 0;
+    }
+    TruncatePrefixClosure* tpc = dynamic_cast<TruncatePrefixClosure*>(done);
+    if (tpc) {
+        BRAFT_VLOG << "Truncating storage to first_index_kept="
+                   << tpc->first_index_kept();
+        return _log_storage->truncate_prefix(tpc->first_index_kept());
+    }
+    TruncateSuffixClosure* tsc = dynamic_cast<TruncateSuffixClosure*>(done);
+    if (tsc) {
+        LOG(WARNING) << "Truncating storage to last_index_kept="
+                     << tsc->last_index_kept();
+        const int ret = _log_storage->truncate_suffix(tsc->last_index_kept());
+        if (ret == 0) {
+            // update last_id after truncate_suffix
+            last_id->index = tsc->last_index_kept();
+            last_id->term = tsc->last_term_kept();
+            CHECK(last_id->index == 0 || last_id->term != 0)
+                    << "last_id=" << *last_id;
+        }
+        return ret;
+    }
+    ResetClosure* rc = dynamic_cast<ResetClosure*>(done);
+    if (rc) {
+        LOG(INFO) << "Reseting storage to next_log_index="
+                  << rc->next_log_index();
+        return _log_storage->reset(rc->next_log_index());
+    }
+    return 0;
+}
+
 int LogManager::disk_thread(void* meta,
                             bthread::TaskIterator<StableClosure*>& iter) {
     if (iter.is_queue_stopped()) {
@@ -533,7 +1033,10 @@ int LogManager::disk_thread(void* meta,
 
     LogManager* log_manager = static_cast<LogManager*>(meta);
     // FXIME(chenzhangyi01): it's buggy
-    LogId last_id = log_manager->_disk_id;
+    // _disk_id falls behind the written entries when they are synced in
+    // the sync thread
+    LogId last_id = log_manager->_pipeline_sync ? log_manager->_written_id
+                                                : log_manager->_disk_id;
     StableClosure* storage[256];
     AppendBatcher ab(storage, ARRAY_SIZE(storage), &last_id, log_manager);
     
@@ -545,51 +1048,12 @@ int LogManager::disk_thread(void* meta,
             ab.append(done);
         } else {
             ab.flush();
-            int ret = 0;
-            do {
-                LastLogIdClosure* llic =
-                        dynamic_cast<LastLogIdClosure*>(done);
-                if (llic) {
-                    // Not used log_manager->get_disk_id() as it might be out of
-                    // date
-                    // FIXME: it's buggy
-                    llic->set_last_log_id(last_id);
-                    break;
-                }
-                TruncatePrefixClosure* tpc = 
-                        dynamic_cast<TruncatePrefixClosure*>(done);
-                if (tpc) {
-                    BRAFT_VLOG << "Truncating storage to first_index_kept="
-                        << tpc->first_index_kept();
-                    ret = log_manager->_log_storage->truncate_prefix(
-                                    tpc->first_index_kept());
-                    break;
-                }
-                TruncateSuffixClosure* tsc = 
-                        dynamic_cast<TruncateSuffixClosure*>(done);
-                if (tsc) {
-                    LOG(WARNING) << "Truncating storage to last_index_kept="
-                                 << tsc->last_index_kept();
-                    ret = log_manager->_log_storage->truncate_suffix(
-                                    tsc->last_index_kept());
-                    if (ret == 0) {
-                        // update last_id after truncate_suffix
-                        last_id.index = tsc->last_index_kept();
-                        last_id.term = tsc->last_term_kept();
-                        CHECK(last_id.index == 0 || last_id.term != 0)
-                                << "last_id=" << last_id;
-                    }
-                    break;
-                }
-                ResetClosure* rc = dynamic_cast<ResetClosure*>(done);
-                if (rc) {
-                    LOG(INFO) << "Reseting storage to next_log_index="
-                              << rc->next_log_index();
-                    ret = log_manager->_log_storage->reset(rc->next_log_index());
-                    break;
-                }
-            } while (0);
-
+            if (log_manager->_pipeline_sync) {
+                // Operations other than appending see all the previous
+                // entries on disk
+                log_manager->wait_pending_syncs(last_id);
+            }
+            const int ret = log_manager->run_disk_operation(done, &last_id);
             if (ret != 0) {
                 log_manager->report_error(ret, "Failed operation on LogStorage");
             }
@@ -598,7 +1062,249 @@ int LogManager::disk_thread(void* meta,
     }
     CHECK(!iter) << "Must iterate to the end";
     ab.flush();
-    log_manager->set_disk_id(last_id);
+    if (log_manager->_relaxed_durability) {
+        log_manager->_written_id = last_id;
+        log_manager->set_disk_id(last_id);
+    } else if (log_manager->_pipeline_sync) {
+        // disk_id is updated by the sync thread once the entries are durable
+        log_manager->_written_id = last_id;
+        log_manager->sync_in_background(NULL, 0, last_id);
+    } else {
+        log_manager->set_disk_id(last_id);
+    }
+    return 0;
+}
+
+SharedDiskThread* SharedDiskThread::get(uint64_t disk, int bthread_tag) {
+    static raft_mutex_t s_mutex;
+    static std::map<std::pair<uint64_t, int>, SharedDiskThread*> s_threads;
+    BAIDU_SCOPED_LOCK(s_mutex);
+    SharedDiskThread*& thread = s_threads[std::make_pair(disk, bthread_tag)];
+    if (thread == NULL) {
+        SharedDiskThread* new_thread = new SharedDiskThread;
+        bthread::ExecutionQueueOptions queue_options;
+        queue_options.bthread_attr = bthread_attr_of_tag(BTHREAD_ATTR_NORMAL,
+                                                         bthread_tag);
+        if (bthread::execution_queue_start(&new_thread->_queue, &queue_options,
+                                           run, new_thread) != 0) {
+            delete new_thread;
+            return NULL;
+        }
+        thread = new_thread;
+    }
+    return thread;
+}
+
+int SharedDiskThread::run(void* meta, bthread::TaskIterator<Task>& iter) {
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    // Group the closures by LogManager in the order of submission
+    std::vector<LogManager*> log_managers;
+    std::vector<std::vector<LogManager::StableClosure*> > closures;
+    std::vector<DiskBarrierClosure*> barriers;
+    std::map<LogManager*, size_t> positions;
+    for (; iter; ++iter) {
+        const Task& task = *iter;
+        std::pair<std::map<LogManager*, size_t>::iterator, bool> ret =
+                positions.insert(std::make_pair(task.log_manager,
+                                                log_managers.size()));
+        if (ret.second) {
+            log_managers.push_back(task.log_manager);
+            closures.push_back(std::vector<LogManager::StableClosure*>());
+            barriers.push_back(NULL);
+        }
+        DiskBarrierClosure* barrier =
+                dynamic_cast<DiskBarrierClosure*>(task.done);
+        if (barrier) {
+            barriers[ret.first->second] = barrier;
+        } else {
+            closures[ret.first->second].push_back(task.done);
+        }
+    }
+    g_shared_disk_thread_batch << log_managers.size();
+    DeferredSyncs syncs;
+    // Write the closures of the LogManagers in turn and sync all of them
+    // at once
+    for (size_t i = 0; i < log_managers.size(); ++i) {
+        log_managers[i]->write_in_shared_disk_thread(closures[i], &syncs);
+    }
+    for (size_t i = 0; i < log_managers.size(); ++i) {
+        // A failed sync only fails the LogManager whose file it is
+        log_managers[i]->finish_shared_disk_writes(
+                syncs.flush(log_managers[i]));
+        if (barriers[i]) {
+            // The LogManager might be destroyed from now on
+            barriers[i]->Run();
+        }
+    }
+    return 0;
+}
+
+void LogManager::write_in_shared_disk_thread(
+        const std::vector<StableClosure*>& dones, DeferredSyncs* syncs) {
+    LogId last_id = _written_id;
+    StableClosure* storage[256];
+    AppendBatcher ab(storage, ARRAY_SIZE(storage), &last_id, this);
+    syncs->set_owner(this);
+    for (size_t i = 0; i < dones.size(); ++i) {
+        StableClosure* done = dones[i];
+        if (!done->_entries.empty()) {
+            ab.append(done);
+            continue;
+        }
+        ab.flush();
+        if (!_unsynced_closures.empty()) {
+            // Operations other than appending see all the previous entries
+            // on disk
+            _written_id = last_id;
+            finish_shared_disk_writes(syncs->flush(this));
+        }
+        const int ret = run_disk_operation(done, &last_id);
+        if (ret != 0) {
+            report_error(ret, "Failed operation on LogStorage");
+        }
+        done->Run();
+    }
+    ab.flush();
+    _written_id = last_id;
+    syncs->set_owner(NULL);
+}
+
+void LogManager::finish_shared_disk_writes(int sync_rc) {
+    std::vector<StableClosure*> dones;
+    dones.swap(_unsynced_closures);
+    if (sync_rc != 0 && !dones.empty()) {
+        LOG(ERROR) << "Fail to sync entries, ret=" << sync_rc;
+        report_error(EIO, "Fail to sync entries");
+    }
+    for (size_t i = 0; i < dones.size(); ++i) {
+        if (_has_error.load(butil::memory_order_relaxed)) {
+            dones[i]->status().set_error(EIO, "Corrupted LogStorage");
+        }
+        dones[i]->Run();
+    }
+    set_disk_id(_written_id);
+}
+
+void LogManager::sync_in_background(StableClosure* dones[], size_t size,
+                                    const LogId& last_id) {
+    SyncTask* task = new SyncTask;
+    task->dones.assign(dones, dones + size);
+    task->last_id = last_id;
+    task->barrier = NULL;
+    task->force_sync = false;
+    const int ret = bthread::execution_queue_execute(_sync_queue, task);
+    CHECK_EQ(0, ret) << "execq execute failed, ret: " << ret << " err: " << berror();
+}
+
+void LogManager::wait_pending_syncs(const LogId& last_id) {
+    bthread::CountdownEvent event(1);
+    SyncTask* task = new SyncTask;
+    task->last_id = last_id;
+    task->barrier = &event;
+    // The following operation may remove the segments not synced yet with
+    // the relaxed durability
+    task->force_sync = _relaxed_durability;
+    const int ret = bthread::execution_queue_execute(_sync_queue, task);
+    CHECK_EQ(0, ret) << "execq execute failed, ret: " << ret << " err: " << berror();
+    event.wait();
+}
+
+void LogManager::request_sync() {
+    if (_sync_requested.exchange(true, butil::memory_order_relaxed)) {
+        return;
+    }
+    SyncTask* task = new SyncTask;
+    task->barrier = NULL;
+    task->force_sync = true;
+    const int ret = bthread::execution_queue_execute(_sync_queue, task);
+    CHECK_EQ(0, ret) << "execq execute failed, ret: " << ret << " err: " << berror();
+}
+
+void* LogManager::run_background_sync(void* arg) {
+    LogManager* log_manager = static_cast<LogManager*>(arg);
+    while (!log_manager->_background_sync_stopped.load(
+                    butil::memory_order_relaxed)) {
+        // Interrupted by bthread_stop
+        bthread_usleep(FLAGS_raft_relaxed_sync_interval_ms * 1000L);
+        bool synced = true;
+        {
+            BAIDU_SCOPED_LOCK(log_manager->_mutex);
+            synced = !(log_manager->_durable_id < log_manager->_disk_id);
+        }
+        if (!synced && !log_manager->_background_sync_stopped.load(
+                    butil::memory_order_relaxed)) {
+            log_manager->request_sync();
+        }
+    }
+    return NULL;
+}
+
+void LogManager::set_durable_id(const LogId& durable_id) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_durable_id < durable_id) {
+        _durable_id = durable_id;
+    }
+}
+
+int LogManager::sync_thread(void* meta, bthread::TaskIterator<SyncTask*>& iter) {
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    LogManager* log_manager = static_cast<LogManager*>(meta);
+    std::vector<SyncTask*> tasks;
+    bool has_appends = false;
+    for (; iter; ++iter) {
+        tasks.push_back(*iter);
+        has_appends = has_appends || !(*iter)->dones.empty()
+                || (*iter)->force_sync;
+    }
+    LogId durable_id;
+    if (log_manager->_relaxed_durability) {
+        // Everything written by now is covered by the following sync
+        log_manager->_sync_requested.store(false, butil::memory_order_relaxed);
+        log_manager->_unsynced_bytes.store(0, butil::memory_order_relaxed);
+        BAIDU_SCOPED_LOCK(log_manager->_mutex);
+        durable_id = log_manager->_disk_id;
+    }
+    // All the batches written so far are synced in one go
+    if (has_appends && !log_manager->_has_error.load(butil::memory_order_relaxed)) {
+        butil::Timer timer;
+        timer.start();
+        const int ret = log_manager->_log_storage->sync_entries();
+        timer.stop();
+        g_storage_sync_entries_latency << timer.u_elapsed();
+        if (ret != 0) {
+            LOG(ERROR) << "Fail to sync entries, ret=" << ret;
+            log_manager->report_error(EIO, "Fail to sync entries");
+        }
+    }
+    LogId last_id;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        SyncTask* task = tasks[i];
+        if (last_id < task->last_id) {
+            last_id = task->last_id;
+        }
+        for (size_t j = 0; j < task->dones.size(); ++j) {
+            if (log_manager->_has_error.load(butil::memory_order_relaxed)) {
+                task->dones[j]->status().set_error(
+                        EIO, "Corrupted LogStorage");
+            }
+            task->dones[j]->Run();
+        }
+        if (task->barrier) {
+            task->barrier->signal();
+        }
+        delete task;
+    }
+    if (log_manager->_relaxed_durability) {
+        if (!log_manager->_has_error.load(butil::memory_order_relaxed)) {
+            log_manager->set_durable_id(durable_id);
+        }
+    } else {
+        log_manager->set_disk_id(last_id);
+    }
     return 0;
 }
 
@@ -606,7 +1312,7 @@ void LogManager::set_snapshot(const SnapshotMeta* meta) {
     BRAFT_VLOG << "Set snapshot last_included_index="
               << meta->last_included_index()
               << " last_included_term=" <<  meta->last_included_term();
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);
     if (meta->last_included_index() <= _last_snapshot_id.index) {
         return;
     }
@@ -618,14 +1324,21 @@ void LogManager::set_snapshot(const SnapshotMeta* meta) {
     for (int i = 0; i < meta->old_peers_size(); ++i) {
         old_conf.add_peer(meta->old_peers(i));
     }
+    Configuration learners;
+    for (int i = 0; i < meta->learners_size(); ++i) {
+        learners.add_peer(meta->learners(i));
+    }
     ConfigurationEntry entry;
     entry.id = LogId(meta->last_included_index(), meta->last_included_term());
     entry.conf = conf;
     entry.old_conf = old_conf;
+    entry.learners = learners;
     _config_manager->set_snapshot(entry);
     int64_t term = unsafe_get_term(meta->last_included_index());
 
     const LogId last_but_one_snapshot_id = _last_snapshot_id;
+    _appended_bytes_at_snapshot =
+            _appended_bytes.load(butil::memory_order_relaxed);
     _last_snapshot_id.index = meta->last_included_index();
     _last_snapshot_id.term = meta->last_included_term();
     if (_last_snapshot_id > _applied_id) {
@@ -644,8 +1357,7 @@ void LogManager::set_snapshot(const SnapshotMeta* meta) {
         // followers
         if (last_but_one_snapshot_id.index > 0) {
             // We have last snapshot index
-            _virtual_first_log_id = last_but_one_snapshot_id;
-            truncate_prefix(last_but_one_snapshot_id.index + 1, lck);
+            truncate_prefix_retained(last_but_one_snapshot_id, lck);
         }
         return;
     } else {
@@ -658,24 +1370,133 @@ void LogManager::set_snapshot(const SnapshotMeta* meta) {
 }
 
 void LogManager::clear_bufferred_logs() {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);
     if (_last_snapshot_id.index != 0) {
-        _virtual_first_log_id = _last_snapshot_id;
-        truncate_prefix(_last_snapshot_id.index + 1, lck);
+        truncate_prefix_retained(_last_snapshot_id, lck);
     }
 }
 
-LogEntry* LogManager::get_entry_from_memory(const int64_t index) {
-    LogEntry* entry = NULL;
-    if (!_logs_in_memory.empty()) {
-        int64_t first_index = _logs_in_memory.front()->id.index;
-        int64_t last_index = _logs_in_memory.back()->id.index;
-        CHECK_EQ(last_index - first_index + 1, static_cast<int64_t>(_logs_in_memory.size()));
-        if (index >= first_index && index <= last_index) {
-            entry = _logs_in_memory[index - first_index];
+void LogManager::set_retained_index(int64_t index) {
+    _retained_index.store(index, butil::memory_order_relaxed);
+}
+
+void LogManager::set_pinned_index(int64_t index) {
+    _pinned_index.store(index, butil::memory_order_relaxed);
+}
+
+std::string LogManager::last_truncation() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _last_truncation;
+}
+
+void LogManager::record_retention_mark(int64_t last_index) {
+    const int64_t now_ms = butil::monotonic_time_ms();
+    const int64_t appended_bytes =
+            _appended_bytes.load(butil::memory_order_relaxed);
+    const int64_t max_bytes = FLAGS_raft_retained_log_bytes;
+    const int64_t max_age_ms = FLAGS_raft_retained_log_max_age_s * 1000L;
+    BAIDU_SCOPED_LOCK(_mutex);
+    // At most one mark per 100ms and 1/1024 of the budget
+    if (!_retention_marks.empty()) {
+        const RetentionMark& last = _retention_marks.back();
+        if (now_ms - last.time_ms < 100 ||
+                appended_bytes - last.appended_bytes < max_bytes / 1024) {
+            return;
         }
     }
-    return entry;
+    RetentionMark mark = { last_index, appended_bytes, now_ms };
+    _retention_marks.push_back(mark);
+    // The logs up to the second mark are beyond the budget once the ones
+    // after it are
+    while (_retention_marks.size() > 1) {
+        const RetentionMark& second = _retention_marks[1];
+        if (appended_bytes - second.appended_bytes <= max_bytes &&
+                (max_age_ms <= 0 || now_ms - second.time_ms <= max_age_ms)) {
+            break;
+        }
+        _retention_marks.pop_front();
+    }
+}
+
+int64_t LogManager::unsafe_retained_first_index(int64_t first_index_kept) {
+    const int64_t max_bytes = FLAGS_raft_retained_log_bytes;
+    int64_t retained_index = _retained_index.load(butil::memory_order_relaxed);
+    const int64_t pinned_index =
+            _pinned_index.load(butil::memory_order_relaxed);
+    if (pinned_index > 0 &&
+            (retained_index <= 0 || pinned_index < retained_index)) {
+        retained_index = pinned_index;
+    }
+    if (max_bytes <= 0 || retained_index <= 0 ||
+            retained_index >= first_index_kept) {
+        _last_truncation = butil::string_printf(
+                "dropped logs before %" PRId64 " for the snapshot",
+                first_index_kept);
+        return first_index_kept;
+    }
+    const int64_t index = std::max(retained_index, _first_log_index);
+    // The bytes and age of the logs from |index| are estimated by the marks:
+    // the ones up to the last mark before |index| are excluded, and |index| is
+    // appended by the time of the first mark after it
+    const int64_t now_ms = butil::monotonic_time_ms();
+    int64_t bytes_before = 0;
+    int64_t appended_ms = now_ms;
+    for (size_t i = 0; i < _retention_marks.size(); ++i) {
+        if (_retention_marks[i].index < index) {
+            bytes_before = _retention_marks[i].appended_bytes;
+        } else {
+            appended_ms = _retention_marks[i].time_ms;
+            break;
+        }
+    }
+    const int64_t bytes =
+            _appended_bytes.load(butil::memory_order_relaxed) - bytes_before;
+    const int64_t max_age_s = FLAGS_raft_retained_log_max_age_s;
+    if (bytes > max_bytes) {
+        _last_truncation = butil::string_printf(
+                "dropped logs before %" PRId64 " for the snapshot, the logs "
+                "from %" PRId64 " take about %" PRId64 " bytes beyond "
+                "raft_retained_log_bytes=%" PRId64,
+                first_index_kept, index, bytes, max_bytes);
+        return first_index_kept;
+    }
+    if (max_age_s > 0 && now_ms - appended_ms > max_age_s * 1000L) {
+        _last_truncation = butil::string_printf(
+                "dropped logs before %" PRId64 " for the snapshot, the logs "
+                "from %" PRId64 " are %" PRId64 "s old beyond "
+                "raft_retained_log_max_age_s=%" PRId64,
+                first_index_kept, index, (now_ms - appended_ms) / 1000,
+                max_age_s);
+        return first_index_kept;
+    }
+    _last_truncation = butil::string_printf(
+            "retained logs from %" PRId64 " of about %" PRId64 " bytes for "
+            "the followers and the log subscribers", index, bytes);
+    return index;
+}
+
+int LogManager::truncate_prefix_retained(
+        const LogId& last_id_dropped,
+        std::unique_lock<log_manager_mutex_t>& lck) {
+    LogId virtual_first_log_id = last_id_dropped;
+    const int64_t first_index_kept =
+            unsafe_retained_first_index(last_id_dropped.index + 1);
+    if (first_index_kept <= last_id_dropped.index) {
+        const int64_t term = unsafe_get_term(first_index_kept - 1);
+        if (term != 0) {
+            virtual_first_log_id = LogId(first_index_kept - 1, term);
+        }
+    }
+    _virtual_first_log_id = virtual_first_log_id;
+    if (virtual_first_log_id.index < _first_log_index) {
+        // Nothing more to drop
+        return 0;
+    }
+    return truncate_prefix(virtual_first_log_id.index + 1, lck);
+}
+
+LogEntry* LogManager::get_entry_from_memory(const int64_t index) {
+    return _logs_in_memory.at(index);
 }
 
 int64_t LogManager::unsafe_get_term(const int64_t index) {
@@ -709,7 +1530,13 @@ int64_t LogManager::get_term(const int64_t index) {
     if (index == 0) {
         return 0;
     }
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    // Fast path without the mutex. A log in memory has the same term as the
+    // snapshot or the virtual first log at its index
+    const int64_t term = _logs_in_memory.get_term(index);
+    if (term != 0) {
+        return term;
+    }
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);
     // check virtual first log
     if (index == _virtual_first_log_id.index) {
         return _virtual_first_log_id.term;
@@ -735,27 +1562,115 @@ int64_t LogManager::get_term(const int64_t index) {
 }
 
 LogEntry* LogManager::get_entry(const int64_t index) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    // Fast path without the mutex
+    LogEntry* entry = _logs_in_memory.get(index);
+    if (entry) {
+        return entry;
+    }
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);
 
     // out of range, direct return NULL
     if (index > _last_log_index || index < _first_log_index) {
         return NULL;
     }
 
-    LogEntry* entry = get_entry_from_memory(index);
+    entry = get_entry_from_memory(index);
     if (entry) {
         entry->AddRef();
         return entry;
     }
+    const int64_t cache_id = _cache_id;
     lck.unlock();
+    LogEntryCache* cache = LogEntryCache::get_instance();
+    if (cache) {
+        entry = cache->get(cache_id, index);
+        if (entry) {
+            return entry;
+        }
+    }
     g_read_entry_from_storage << 1;
     entry = _log_storage->get_entry(index);
     if (!entry) {
         report_error(EIO, "Corrupted entry at index=%" PRId64, index);
+        return NULL;
+    }
+    if (cache) {
+        // If the log was truncated after unlocking, |cache_id| has been
+        // replaced and the entry is never hit
+        cache->put(cache_id, entry);
     }
     return entry;
 }
 
+int LogManager::get_entries(const int64_t first_index, size_t max_count,
+                            size_t max_bytes, std::vector<LogEntry*>* entries) {
+    const size_t saved_size = entries->size();
+    LogEntryCache* cache = LogEntryCache::get_instance();
+    std::vector<LogEntry*> got;
+    int64_t index = first_index;
+    size_t bytes = 0;
+    while ((size_t)(index - first_index) < max_count && bytes < max_bytes) {
+        std::unique_lock<log_manager_mutex_t> lck(_mutex);
+        if (index > _last_log_index || index < _first_log_index) {
+            break;
+        }
+        LogEntry* entry = get_entry_from_memory(index);
+        if (entry) {
+            // The following logs are all in memory
+            do {
+                entry->AddRef();
+                entries->push_back(entry);
+                bytes += entry->data.size();
+                ++index;
+                if ((size_t)(index - first_index) >= max_count
+                        || bytes >= max_bytes || index > _last_log_index) {
+                    break;
+                }
+                entry = get_entry_from_memory(index);
+            } while (entry);
+            continue;
+        }
+        // Logs before the ones in memory are read from storage
+        const int64_t last_index = _logs_in_memory.empty()
+                ? _last_log_index : _logs_in_memory.front()->id.index - 1;
+        const int64_t cache_id = _cache_id;
+        lck.unlock();
+        if (cache) {
+            while (index <= last_index
+                    && (size_t)(index - first_index) < max_count
+                    && bytes < max_bytes
+                    && (entry = cache->get(cache_id, index)) != NULL) {
+                entries->push_back(entry);
+                bytes += entry->data.size();
+                ++index;
+            }
+            if (index > last_index || (size_t)(index - first_index) >= max_count
+                    || bytes >= max_bytes) {
+                continue;
+            }
+        }
+        got.clear();
+        const size_t count = std::min(max_count - (index - first_index),
+                                      (size_t)(last_index - index + 1));
+        const int rc = _log_storage->get_entries(index, count,
+                                                 max_bytes - bytes, &got);
+        if (rc <= 0) {
+            report_error(EIO, "Corrupted entry at index=%" PRId64, index);
+            break;
+        }
+        g_read_entry_from_storage << rc;
+        for (size_t i = 0; i < got.size(); ++i) {
+            if (cache) {
+                cache->put(cache_id, got[i]);
+            }
+            entries->push_back(got[i]);
+            bytes += got[i]->data.size();
+        }
+        index += rc;
+    }
+    return entries->size() - saved_size;
+}
+
 void LogManager::get_configuration(const int64_t index, ConfigurationEntry* conf) {
     BAIDU_SCOPED_LOCK(_mutex);
     return _config_manager->get(index, conf);
@@ -777,7 +1692,7 @@ bool LogManager::check_and_set_configuration(ConfigurationEntry* current) {
 }
 
 void LogManager::set_disk_id(const LogId& disk_id) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);  // Race with set_applied_id
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);  // Race with set_applied_id
     if (disk_id < _disk_id) {
         return;
     }
@@ -788,7 +1703,7 @@ void LogManager::set_disk_id(const LogId& disk_id) {
 }
 
 void LogManager::set_applied_id(const LogId& applied_id) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);  // Race with set_disk_id
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);  // Race with set_disk_id
     if (applied_id < _applied_id) {
         return;
     }
@@ -798,8 +1713,16 @@ void LogManager::set_applied_id(const LogId& applied_id) {
     return clear_memory_logs(clear_id);
 }
 
+void LogManager::get_growth_since_snapshot(int64_t* applied_logs,
+                                           int64_t* appended_bytes) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    *applied_logs = _applied_id.index - _last_snapshot_id.index;
+    *appended_bytes = _appended_bytes.load(butil::memory_order_relaxed)
+                      - _appended_bytes_at_snapshot;
+}
+
 void LogManager::shutdown() {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);
     _stopped = true;
     wakeup_all_waiter(lck);
 }
@@ -811,6 +1734,16 @@ void* LogManager::run_on_new_log(void *arg) {
     return NULL;
 }
 
+void* LogManager::run_on_new_log_batch(void *arg) {
+    WaitMetaBatch* batch = (WaitMetaBatch*)arg;
+    for (size_t i = 0; i < batch->wms.size(); ++i) {
+        run_on_new_log(batch->wms[i]);
+    }
+    batch->wms.clear();
+    butil::return_object(batch);
+    return NULL;
+}
+
 LogManager::WaitId LogManager::wait(
         int64_t expected_last_log_index, 
         int (*on_new_log)(void *arg, int error_code), void *arg) {
@@ -828,7 +1761,7 @@ LogManager::WaitId LogManager::wait(
 
 LogManager::WaitId LogManager::notify_on_new_log(
         int64_t expected_last_log_index, WaitMeta* wm) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);
     if (expected_last_log_index != _last_log_index || _stopped) {
         wm->error_code = _stopped ? ESTOP : 0;
         lck.unlock();
@@ -863,7 +1796,7 @@ int LogManager::remove_waiter(WaitId id) {
     return wm ? 0 : -1;
 }
 
-void LogManager::wakeup_all_waiter(std::unique_lock<raft_mutex_t>& lck) {
+void LogManager::wakeup_all_waiter(std::unique_lock<log_manager_mutex_t>& lck) {
     if (_wait_map.empty()) {
         return;
     }
@@ -876,6 +1809,25 @@ void LogManager::wakeup_all_waiter(std::unique_lock<raft_mutex_t>& lck) {
     _wait_map.clear();
     const int error_code = _stopped ? ESTOP : 0;
     lck.unlock();
+    g_new_log_waiters_batch << nwm;
+    WaitMetaBatch* batch = NULL;
+    if (FLAGS_raft_batch_new_log_waiters && nwm > 1
+            && (batch = butil::get_object<WaitMetaBatch>()) != NULL) {
+        // Waiters are mostly replicators which have caught up, of which the
+        // callbacks just issue RPCs with the logs in memory, it's cheaper to
+        // run them one by one than to start a bthread for each
+        batch->wms.assign(wm, wm + nwm);
+        for (size_t i = 0; i < nwm; ++i) {
+            wm[i]->error_code = error_code;
+        }
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_on_new_log_batch,
+                                     batch) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            run_on_new_log_batch(batch);
+        }
+        return;
+    }
     for (size_t i = 0; i < nwm; ++i) {
         wm[i]->error_code = error_code;
         bthread_t tid;
@@ -896,19 +1848,57 @@ void LogManager::describe(std::ostream& os, bool use_html) {
     int64_t last_index = _log_storage->last_log_index();
     os << "storage: [" << first_index << ", " << last_index << ']' << newline;
     os << "disk_index: " << _disk_id.index << newline;
+    if (_relaxed_durability) {
+        os << "durable_index: " << _durable_id.index << newline;
+    }
     os << "known_applied_index: " << _applied_id.index << newline;
     os << "last_log_id: " << last_log_id() << newline;
+    os << "logs_in_memory_bytes: " << _logs_in_memory.bytes() << newline;
+    os << "append_buffer_limit: "
+       << _append_buffer_limit.load(butil::memory_order_relaxed) << newline;
+    _log_storage->describe(os, use_html);
+}
+
+bool LogManager::memory_budget_exceeded() const {
+    const int64_t max_bytes = FLAGS_raft_max_logs_in_memory_bytes;
+    const int64_t max_total_bytes = FLAGS_raft_max_total_logs_in_memory_bytes;
+    // A full storage takes new tasks again after a snapshot discards logs
+    const int64_t capacity_bytes = _log_storage->capacity_bytes();
+    return (max_bytes > 0 && _logs_in_memory.bytes() >= max_bytes)
+        || (max_total_bytes > 0
+                && LogEntryRing::total_bytes() >= max_total_bytes)
+        || (capacity_bytes > 0
+                && _log_storage->used_bytes() >= capacity_bytes);
+}
+
+bool LogManager::wait_memory_budget() {
+    if (!memory_budget_exceeded()) {
+        return true;
+    }
+    const int64_t deadline_us = butil::monotonic_time_us()
+            + FLAGS_raft_apply_memory_budget_wait_ms * 1000L;
+    while (butil::monotonic_time_us() < deadline_us) {
+        bthread_usleep(1000);
+        if (!memory_budget_exceeded()) {
+            return true;
+        }
+    }
+    g_memory_budget_rejected << 1;
+    return false;
 }
 
 void LogManager::get_status(LogManagerStatus* status) {
     if (!status) {
         return;
     }
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<log_manager_mutex_t> lck(_mutex);
     status->first_index = _log_storage->first_log_index();
     status->last_index = _log_storage->last_log_index();
     status->disk_index = _disk_id.index;
+    status->durable_index = _relaxed_durability ? _durable_id.index
+                                                : _disk_id.index;
     status->known_applied_index = _applied_id.index;
+    status->memory_bytes = _logs_in_memory.bytes();
 }
 
 void LogManager::report_error(int error_code, const char* fmt, ...) {
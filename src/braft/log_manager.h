@@ -24,43 +24,68 @@
 #include <bthread/execution_queue.h>            // bthread::ExecutionQueueId
 
 #include "braft/raft.h"                          // Closure
-#include "braft/util.h"                          // raft_mutex_t
+#include "braft/util.h"                          // ProfiledMutex
 #include "braft/log_entry.h"                     // LogEntry
+#include "braft/log_entry_ring.h"                // LogEntryRing
 #include "braft/configuration_manager.h"         // ConfigurationManager
 
 namespace braft {
 
 class LogStorage;
 class FSMCaller;
+class DeferredSyncs;
+class SharedDiskThread;
 
 struct LogManagerOptions {
     LogManagerOptions();
     LogStorage* log_storage;
     ConfigurationManager* configuration_manager;
     FSMCaller* fsm_caller;  // To report log error
+    // Tag of the bthread workers running the disk thread, -1 for any
+    int bthread_tag;
+    // Device (st_dev) of the log storage, whose disk thread is shared with
+    // the other LogManagers on it if raft_share_disk_thread is on. 0 if
+    // unknown
+    uint64_t disk;
+    // Regard the entries as stable once written to the storage and fsync
+    // them in the background, see NodeOptions::relaxed_log_durability
+    bool relaxed_durability;
 };
 
 struct LogManagerStatus {
     LogManagerStatus()
-        : first_index(1), last_index(0), disk_index(0), known_applied_index(0)
+        : first_index(1), last_index(0), disk_index(0), durable_index(0)
+        , known_applied_index(0), memory_bytes(0)
     {}
     int64_t first_index;
     int64_t last_index;
     int64_t disk_index;
+    // The last log fsynced, which falls behind disk_index with the relaxed
+    // durability
+    int64_t durable_index;
     int64_t known_applied_index;
+    // Data bytes of the logs in memory
+    int64_t memory_bytes;
 };
 
 class SnapshotMeta;
 
+struct LogManagerMutexTag {
+    static const char* name() { return "log_manager"; }
+};
+typedef ProfiledMutex<LogManagerMutexTag> log_manager_mutex_t;
+
 class BAIDU_CACHELINE_ALIGNMENT LogManager {
 public:
     typedef int64_t WaitId;
 
     class StableClosure : public Closure {
     public:
-        StableClosure() : _first_log_index(0) {}
+        StableClosure() : _first_log_index(0), _flush_start_us(0) {}
     protected:
         int64_t _first_log_index;
+        // When the disk thread started writing the entries
+        int64_t _flush_start_us;
     private:
     friend class LogManager;
     friend class AppendBatcher;
@@ -86,11 +111,40 @@ public:
     // last snapshot immediately.
     BRAFT_MOCK void clear_bufferred_logs();
 
+    // The logs from |index| on are needed by the slowest follower, which are
+    // kept by set_snapshot and clear_bufferred_logs as long as they are within
+    // raft_retained_log_bytes and raft_retained_log_max_age_s, 0 retains
+    // nothing
+    void set_retained_index(int64_t index);
+
+    // The logs from |index| on are not yet delivered to the log subscribers,
+    // which are retained in the same way as set_retained_index(), 0 pins
+    // nothing
+    void set_pinned_index(int64_t index);
+
+    // Describe the last time the logs were dropped for a snapshot, and why
+    // the ones needed by the followers were not retained if so
+    std::string last_truncation();
+
     // Get the log at |index|
     // Returns:
     //  success return ptr, fail return null
     LogEntry* get_entry(const int64_t index);
 
+    // Get at most |max_count| logs starting from |first_index|, stop before
+    // the data of the got logs exceeds |max_bytes| unless nothing is got.
+    // The logs are appended to |entries| with a reference added.
+    // Returns:
+    //  the number of the got logs
+    int get_entries(const int64_t first_index, size_t max_count,
+                    size_t max_bytes, std::vector<LogEntry*>* entries);
+
+    // Lock-free, whether the log at |index| is in memory and could be got
+    // without reading the storage
+    bool in_memory(const int64_t index) const {
+        return _logs_in_memory.get_term(index) != 0;
+    }
+
     // Get the log term at |index|
     // Returns:
     //  success return term > 0, fail return 0
@@ -146,30 +200,94 @@ public:
     // Get the internal status of LogManager.
     void get_status(LogManagerStatus* status);
 
+    // Whether the logs in memory exceed raft_max_logs_in_memory_bytes of
+    // this node or raft_max_total_logs_in_memory_bytes of the process, or
+    // the log storage is full
+    bool memory_budget_exceeded() const;
+
+    // Data bytes of the logs in memory
+    int64_t memory_bytes() const { return _logs_in_memory.bytes(); }
+
+    // Get the number of the logs applied and the data bytes of the logs
+    // appended to the storage since the last snapshot
+    void get_growth_since_snapshot(int64_t* applied_logs,
+                                   int64_t* appended_bytes);
+
+    // Wait at most raft_apply_memory_budget_wait_ms for the logs in memory
+    // to drop below the budget
+    // Returns:
+    //  true if the budget is not exceeded
+    bool wait_memory_budget();
+
 private:
 friend class AppendBatcher;
+friend class SharedDiskThread;
     struct WaitMeta {
         int (*on_new_log)(void *arg, int error_code);
         void* arg;
         int error_code;
     };
 
+    struct SyncTask;
+    struct WaitMetaBatch;
+
     void append_to_storage(std::vector<LogEntry*>* to_append, LogId* last_id);
+    void adjust_append_buffer_limit(int64_t latency_us, bool limit_reached);
 
     static int disk_thread(void* meta,
                            bthread::TaskIterator<StableClosure*>& iter);
+
+    // Make the appended entries durable and run |dones| in order in the sync
+    // thread, so that the disk thread is able to write the next batch during
+    // the fsync of this one
+    static int sync_thread(void* meta, bthread::TaskIterator<SyncTask*>& iter);
+    void sync_in_background(StableClosure* dones[], size_t size,
+                            const LogId& last_id);
+    // Block until all the batches handed over to the sync thread are done
+    void wait_pending_syncs(const LogId& last_id);
+    // Ask the sync thread to fsync the written entries with the relaxed
+    // durability, unless it's been asked already
+    void request_sync();
+    // Request a sync every raft_relaxed_sync_interval_ms while there are
+    // entries not fsynced
+    static void* run_background_sync(void* arg);
+    void set_durable_id(const LogId& durable_id);
+
+    // Run the operation other than appending of |done| on the storage,
+    // |last_id| is the last log written to the storage
+    int run_disk_operation(StableClosure* done, LogId* last_id);
+
+    // Submit |done| to the disk thread of this LogManager, or the shared one
+    // if raft_share_disk_thread is on
+    int submit_to_disk(StableClosure* done);
+    // Called by the shared disk thread with the syncs of all the LogManagers
+    // of this round deferred by |syncs|, the appending closures are left in
+    // _unsynced_closures until finish_shared_disk_writes()
+    void write_in_shared_disk_thread(const std::vector<StableClosure*>& dones,
+                                     DeferredSyncs* syncs);
+    // Run the closures waiting for the syncs, which are done with |sync_rc|
+    void finish_shared_disk_writes(int sync_rc);
     
     // delete logs from storage's head, [1, first_index_kept) will be discarded
     // Returns:
     //  success return 0, failed return -1
     int truncate_prefix(const int64_t first_index_kept,
-                        std::unique_lock<raft_mutex_t>& lck);
+                        std::unique_lock<log_manager_mutex_t>& lck);
     
     int reset(const int64_t next_log_index,
-              std::unique_lock<raft_mutex_t>& lck);
-
-    // Must be called in the disk thread, otherwise the
-    // behavior is undefined
+              std::unique_lock<log_manager_mutex_t>& lck);
+
+    // Drop the logs up to |last_id_dropped| except the retained ones
+    int truncate_prefix_retained(const LogId& last_id_dropped,
+                                 std::unique_lock<log_manager_mutex_t>& lck);
+    // Lower |first_index_kept| to the retained index if the logs from it are
+    // within the budget
+    int64_t unsafe_retained_first_index(int64_t first_index_kept);
+    // Called after the logs up to |last_index| are appended to the storage
+    void record_retention_mark(int64_t last_index);
+
+    // Must be called in the disk thread (or the sync thread if
+    // raft_pipeline_log_sync is on), otherwise the behavior is undefined
     void set_disk_id(const LogId& disk_id);
 
     LogEntry* get_entry_from_memory(const int64_t index);
@@ -183,6 +301,8 @@ friend class AppendBatcher;
 
     // Clear the logs in memory whose id <= the given |id|
     void clear_memory_logs(const LogId& id);
+    // Copy the small logs staying in memory for long into dense blocks
+    void compact_memory_logs();
 
     int64_t unsafe_get_term(const int64_t index);
 
@@ -190,8 +310,9 @@ friend class AppendBatcher;
     int start_disk_thread();
     int stop_disk_thread();
 
-    void wakeup_all_waiter(std::unique_lock<raft_mutex_t>& lck);
+    void wakeup_all_waiter(std::unique_lock<log_manager_mutex_t>& lck);
     static void *run_on_new_log(void* arg);
+    static void *run_on_new_log_batch(void* arg);
 
     void report_error(int error_code, const char* fmt, ...);
 
@@ -201,16 +322,19 @@ friend class AppendBatcher;
     ConfigurationManager* _config_manager;
     FSMCaller* _fsm_caller;
 
-    raft_mutex_t _mutex;
+    log_manager_mutex_t _mutex;
     butil::FlatMap<int64_t, WaitMeta*> _wait_map;
     bool _stopped;
     butil::atomic<bool> _has_error;
     WaitId _next_wait_id;
 
     LogId _disk_id;
+    // The last id written by the disk thread, only used by the disk thread
+    // when raft_pipeline_log_sync is on
+    LogId _written_id;
     LogId _applied_id;
-    // TODO(chenzhangyi01): replace deque with a thread-safe data structure
-    std::deque<LogEntry* /*FIXME*/> _logs_in_memory;
+    // Modified with _mutex held, while readers look up the logs without it
+    LogEntryRing _logs_in_memory;
     int64_t _first_log_index;
     int64_t _last_log_index;
     // the last snapshot's log_id
@@ -222,9 +346,69 @@ friend class AppendBatcher;
     // or may cause some unexpect cases
     LogId _virtual_first_log_id;
 
+    // Key of the entries of this LogManager in LogEntryCache, replaced when
+    // the log is truncated or reset
+    int64_t _cache_id;
+
+    // The logs up to _compact_mark_index are compacted once it's
+    // raft_compact_logs_in_memory_age_ms after _compact_mark_ms, and the ones
+    // up to _compacted_index have been visited
+    int64_t _compact_mark_index;
+    int64_t _compact_mark_ms;
+    int64_t _compacted_index;
+
+    // Flushing limit of the append buffer, only modified by the disk thread
+    // and read by describe()
+    butil::atomic<int64_t> _append_buffer_limit;
+
+    // Data bytes of the logs ever appended to the storage, and the value at
+    // the last snapshot
+    butil::atomic<int64_t> _appended_bytes;
+    int64_t _appended_bytes_at_snapshot;
+
+    // The first log needed by the slowest follower, and the marks of
+    // _appended_bytes along with the time when the logs up to the index were
+    // appended, which estimate the bytes and age of the retained logs
+    struct RetentionMark {
+        int64_t index;
+        int64_t appended_bytes;
+        int64_t time_ms;
+    };
+    butil::atomic<int64_t> _retained_index;
+    butil::atomic<int64_t> _pinned_index;
+    std::deque<RetentionMark> _retention_marks;
+    std::string _last_truncation;
+
     bthread::ExecutionQueueId<StableClosure*> _disk_queue;
+    bool _pipeline_sync;
+    bthread::ExecutionQueueId<SyncTask*> _sync_queue;
+
+    // With the relaxed durability the entries are stable after written and
+    // synced by the sync thread up to _durable_id, when _unsynced_bytes
+    // reach raft_relaxed_sync_bytes or periodically by _background_sync_tid
+    bool _relaxed_durability;
+    LogId _durable_id;
+    butil::atomic<int64_t> _unsynced_bytes;
+    butil::atomic<bool> _sync_requested;
+    butil::atomic<bool> _background_sync_stopped;
+    bthread_t _background_sync_tid;
+    int _bthread_tag;
+
+    // Not NULL if the disk thread is shared with the other LogManagers on
+    // the same device, and the closures written but not synced yet, both
+    // only used by the disk thread
+    SharedDiskThread* _shared_disk_thread;
+    std::vector<StableClosure*> _unsynced_closures;
 };
 
+// Average latency of appending entries to the log storages of all the nodes
+// in this process within the last |window_s| seconds
+int64_t storage_append_entries_latency_us(time_t window_s);
+
+// Bytes of the entries appended to the log storages of all the nodes in this
+// process per second within the last |window_s| seconds
+int64_t storage_append_entries_bytes_second(time_t window_s);
+
 }  //  namespace braft
 
 #endif  //BRAFT_LOG_MANAGER_H
@@ -0,0 +1,264 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/log_subscription.h"
+
+#include <inttypes.h>
+#include <algorithm>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+#include "braft/node.h"
+#include "braft/log_manager.h"
+#include "braft/fsm_caller.h"
+#include "braft/log_entry.h"
+
+namespace braft {
+
+static bvar::Adder<int64_t> g_subscribed_logs("raft_subscribed_logs");
+
+class LogSubscription::WaitAppliedDone : public Closure {
+public:
+    explicit WaitAppliedDone(LogSubscription* subscription)
+        : _subscription(subscription) {}
+    void Run() {
+        _subscription->on_applied(status());
+        _subscription->Release();
+        delete this;
+    }
+private:
+    LogSubscription* _subscription;
+};
+
+class LogSubscription::BatchDone : public Closure {
+public:
+    explicit BatchDone(LogSubscription* subscription)
+        : _subscription(subscription) {}
+    void Run() {
+        // Don't deliver the next batch in the stack of the subscriber
+        bthread_t tid;
+        if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL,
+                                     run_deliver, _subscription) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            run_deliver(_subscription);
+        }
+        delete this;
+    }
+private:
+    LogSubscription* _subscription;
+};
+
+LogSubscription::LogSubscription(NodeImpl* node, LogManager* log_manager,
+                                 FSMCaller* fsm_caller, int64_t id,
+                                 const LogSubscriptionOptions& options,
+                                 LogSubscriber* subscriber)
+    : _node(node)
+    , _log_manager(log_manager)
+    , _fsm_caller(fsm_caller)
+    , _id(id)
+    , _options(options)
+    , _subscriber(subscriber)
+    , _next_index(options.start_index)
+    , _state(RUNNING)
+    , _stop_requested(false) {
+    _node->AddRef();
+}
+
+LogSubscription::~LogSubscription() {
+    _node->Release();
+}
+
+int LogSubscription::start() {
+    AddRef();
+    bthread_t tid;
+    if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL,
+                                 run_deliver, this) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        Release();
+        return -1;
+    }
+    return 0;
+}
+
+void LogSubscription::stop(const butil::Status& status) {
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_state == STOPPED || _stop_requested) {
+            return;
+        }
+        _stop_requested = true;
+        _stop_status = status;
+        if (_state != WAITING) {
+            // Stopped by deliver() after the current batch
+            return;
+        }
+        // The pending WaitAppliedDone is ignored
+        _state = STOPPED;
+    }
+    finish(status);
+}
+
+int64_t LogSubscription::pinned_index() const {
+    if (!_options.pin_logs) {
+        return 0;
+    }
+    return _next_index.load(butil::memory_order_relaxed);
+}
+
+void* LogSubscription::run_deliver(void* arg) {
+    LogSubscription* subscription = (LogSubscription*)arg;
+    subscription->deliver();
+    subscription->Release();
+    return NULL;
+}
+
+void LogSubscription::on_applied(const butil::Status& status) {
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_state == STOPPED) {
+            return;
+        }
+        if (status.ok()) {
+            _state = RUNNING;
+        } else {
+            _state = STOPPED;
+        }
+    }
+    if (!status.ok()) {
+        // The FSMCaller is shutting down
+        return finish(butil::Status(ENODESHUTDOWN, "%s",
+                                    status.error_cstr()));
+    }
+    deliver();
+}
+
+void LogSubscription::deliver() {
+    while (true) {
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (_stop_requested) {
+                _state = STOPPED;
+                break;
+            }
+        }
+        const int64_t applied_index = _fsm_caller->last_applied_index();
+        const int64_t next_index = _next_index.load(butil::memory_order_relaxed);
+        if (next_index > applied_index) {
+            {
+                BAIDU_SCOPED_LOCK(_mutex);
+                if (_stop_requested) {
+                    _state = STOPPED;
+                    break;
+                }
+                _state = WAITING;
+            }
+            AddRef();
+            return _fsm_caller->wait_applied(next_index,
+                                             new WaitAppliedDone(this));
+        }
+        butil::Status status;
+        if (read_batch(applied_index, &status) < 0) {
+            {
+                BAIDU_SCOPED_LOCK(_mutex);
+                _state = STOPPED;
+            }
+            return finish(status);
+        }
+        _node->update_log_pin();
+        if (_batch.empty()) {
+            // No tasks in the logs
+            continue;
+        }
+        g_subscribed_logs << _batch.size();
+        AddRef();
+        return _subscriber->on_logs(_batch, new BatchDone(this));
+    }
+    butil::Status status;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        status = _stop_status;
+    }
+    finish(status);
+}
+
+int LogSubscription::read_batch(int64_t applied_index, butil::Status* status) {
+    _batch.clear();
+    const int64_t next_index = _next_index.load(butil::memory_order_relaxed);
+    const size_t max_count = std::min(
+            std::max(_options.max_batch_count, (size_t)1),
+            (size_t)(applied_index - next_index + 1));
+    std::vector<LogEntry*> entries;
+    _log_manager->get_entries(next_index, max_count,
+                              std::max(_options.max_batch_bytes, (size_t)1),
+                              &entries);
+    if (entries.empty()) {
+        status->set_error(ELOGDELETED, "The log at index %" PRId64
+                          " is deleted", next_index);
+        return -1;
+    }
+    int rc = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        LogEntry* entry = entries[i];
+        if (rc != 0) {
+            entry->Release();
+            continue;
+        }
+        const int64_t index = entry->id.index;
+        butil::Status st;
+        if (entry->type == ENTRY_TYPE_DATA) {
+            _batch.push_back(SubscribedLog());
+            _batch.back().index = index;
+            _batch.back().data = entry->data;
+        } else if (entry->type == ENTRY_TYPE_DATA_BATCH) {
+            std::vector<butil::IOBuf> datas;
+            st = parse_data_batch(entry->data, &datas);
+            for (size_t j = 0; st.ok() && j < datas.size(); ++j) {
+                _batch.push_back(SubscribedLog());
+                _batch.back().index = index;
+                _batch.back().data.swap(datas[j]);
+            }
+        } else if (entry->type == ENTRY_TYPE_PARTITIONED_DATA) {
+            int64_t partition_key = 0;
+            _batch.push_back(SubscribedLog());
+            _batch.back().index = index;
+            st = parse_partitioned_data(entry->data, &partition_key,
+                                        &_batch.back().data);
+        }
+        entry->Release();
+        if (!st.ok()) {
+            status->set_error(EINVAL, "Fail to parse the tasks at index %"
+                              PRId64 ", %s", index, st.error_cstr());
+            rc = -1;
+        }
+    }
+    if (rc != 0) {
+        _batch.clear();
+        return -1;
+    }
+    _next_index.store(next_index + entries.size(),
+                      butil::memory_order_relaxed);
+    return entries.size();
+}
+
+void LogSubscription::finish(const butil::Status& status) {
+    LOG(INFO) << "node " << _node->node_id() << " stops log subscription "
+              << _id << " at index "
+              << _next_index.load(butil::memory_order_relaxed)
+              << ", " << status;
+    _next_index.store(0, butil::memory_order_relaxed);
+    _batch.clear();
+    _node->on_log_subscription_stopped(_id);
+    _subscriber->on_stop(status);
+}
+
+}  //  namespace braft
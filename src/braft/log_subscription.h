@@ -0,0 +1,92 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_LOG_SUBSCRIPTION_H
+#define BRAFT_LOG_SUBSCRIPTION_H
+
+#include <vector>
+#include <butil/atomicops.h>
+#include <butil/memory/ref_counted.h>
+#include "braft/raft.h"
+#include "braft/macros.h"
+
+namespace braft {
+
+class NodeImpl;
+class LogManager;
+class FSMCaller;
+
+// Delivers the applied tasks of a node to a LogSubscriber, see
+// Node::subscribe_logs. It reads a batch of the applied logs, waits for the
+// subscriber to finish it and reads the next one, or waits for more logs to
+// be applied once it catches up.
+class LogSubscription : public butil::RefCountedThreadSafe<LogSubscription> {
+public:
+    LogSubscription(NodeImpl* node, LogManager* log_manager,
+                    FSMCaller* fsm_caller, int64_t id,
+                    const LogSubscriptionOptions& options,
+                    LogSubscriber* subscriber);
+
+    int64_t id() const { return _id; }
+
+    // Start delivering in a bthread.
+    // Returns 0 on success, -1 otherwise
+    int start();
+
+    // Stop the subscription with |status|, at once if it's waiting for the
+    // logs to be applied, or after the batch being delivered otherwise
+    void stop(const butil::Status& status);
+
+    // The first log not yet delivered if the logs are pinned, 0 otherwise
+    int64_t pinned_index() const;
+
+private:
+friend class butil::RefCountedThreadSafe<LogSubscription>;
+    ~LogSubscription();
+    DISALLOW_COPY_AND_ASSIGN(LogSubscription);
+
+    enum State {
+        RUNNING,
+        WAITING,
+        STOPPED,
+    };
+    class WaitAppliedDone;
+    class BatchDone;
+
+    static void* run_deliver(void* arg);
+    void deliver();
+    // Read the tasks of the logs from _next_index up to |applied_index| to
+    // _batch. Returns the number of the logs read, -1 on failure
+    int read_batch(int64_t applied_index, butil::Status* status);
+    void on_applied(const butil::Status& status);
+    void finish(const butil::Status& status);
+
+    NodeImpl* _node;
+    LogManager* _log_manager;
+    FSMCaller* _fsm_caller;
+    const int64_t _id;
+    const LogSubscriptionOptions _options;
+    LogSubscriber* _subscriber;
+    butil::atomic<int64_t> _next_index;
+    std::vector<SubscribedLog> _batch;
+
+    raft_mutex_t _mutex;
+    State _state;
+    bool _stop_requested;
+    butil::Status _stop_status;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_LOG_SUBSCRIPTION_H
@@ -14,10 +14,11 @@
 
 // Authors: Qin,Duohao(qinduohao@baidu.com)
 
+#include <stdlib.h>
+#include <string.h>
 #include <butil/time.h>
 #include "braft/log_entry.h"
 #include "braft/memory_log.h"
-#include "braft/memory_log.h"
 
 namespace braft {
 
@@ -28,35 +29,36 @@ int MemoryLogStorage::init(ConfigurationManager* configuration_manager) {
 }
 
 LogEntry* MemoryLogStorage::get_entry(const int64_t index) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
-    if (index < _first_log_index.load(butil::memory_order_relaxed)
-            || index > _last_log_index.load(butil::memory_order_relaxed)) {
-        return NULL;
+    // NULL if |index| is out of the ring
+    LogEntry* temp = _log_entries.get(index);
+    if (temp == NULL && index >= first_log_index()
+            && index <= last_log_index()) {
+        // The ring was growing, fall back to the slower path
+        BAIDU_SCOPED_LOCK(_mutex);
+        temp = _log_entries.at(index);
+        if (temp) {
+            temp->AddRef();
+        }
+    }
+    if (temp) {
+        CHECK(temp->id.index == index) << "get_entry entry index not equal. logentry index:"
+                << temp->id.index << " required_index:" << index;
     }
-    LogEntry* temp = _log_entry_data[index - _first_log_index.load(butil::memory_order_relaxed)];
-    temp->AddRef();
-    CHECK(temp->id.index == index) << "get_entry entry index not equal. logentry index:"
-            << temp->id.index << " required_index:" << index;
-    lck.unlock();
     return temp;
 }
 
 int64_t MemoryLogStorage::get_term(const int64_t index) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
-    if (index < _first_log_index.load(butil::memory_order_relaxed)
-            || index > _last_log_index.load(butil::memory_order_relaxed)) {
-        return 0;
+    const int64_t term = _log_entries.get_term(index);
+    if (term != 0 || index < first_log_index() || index > last_log_index()) {
+        return term;
     }
-    LogEntry* temp = _log_entry_data.at(index - _first_log_index.load(butil::memory_order_relaxed));
-    CHECK(temp->id.index == index) << "get_term entry index not equal. logentry index:"
-            << temp->id.index << " required_index:" << index;
-    int64_t ret = temp->id.term;
-    lck.unlock();
-    return ret;
+    // The ring was growing, fall back to the slower path
+    BAIDU_SCOPED_LOCK(_mutex);
+    const LogEntry* entry = _log_entries.at(index);
+    return entry ? entry->id.term : 0;
 }
 
-int MemoryLogStorage::append_entry(const LogEntry* input_entry) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+int MemoryLogStorage::unsafe_append_entry(const LogEntry* input_entry) {
     if (input_entry->id.index !=
             _last_log_index.load(butil::memory_order_relaxed) + 1) {
         CHECK(false) << "input_entry index=" << input_entry->id.index
@@ -65,34 +67,34 @@ int MemoryLogStorage::append_entry(const LogEntry* input_entry) {
         return ERANGE;
     }
     input_entry->AddRef();
-    _log_entry_data.push_back(const_cast<LogEntry*>(input_entry));
-    _last_log_index.fetch_add(1, butil::memory_order_relaxed);
-    lck.unlock();
+    _log_entries.push_back(const_cast<LogEntry*>(input_entry));
+    _last_log_index.fetch_add(1, butil::memory_order_release);
     return 0;
 }
 
+int MemoryLogStorage::append_entry(const LogEntry* input_entry) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return unsafe_append_entry(input_entry);
+}
+
 int MemoryLogStorage::append_entries(const std::vector<LogEntry*>& entries) {
     if (entries.empty()) {
         return 0;
     }
+    BAIDU_SCOPED_LOCK(_mutex);
     for (size_t i = 0; i < entries.size(); i++) {
-        LogEntry* entry = entries[i];
-        append_entry(entry);
+        if (unsafe_append_entry(entries[i]) != 0) {
+            return i;
+        }
     }
     return entries.size();
 }
 
 int MemoryLogStorage::truncate_prefix(const int64_t first_index_kept) {
-    std::deque<LogEntry*> popped;
+    std::vector<LogEntry*> popped;
     std::unique_lock<raft_mutex_t> lck(_mutex);
-    while (!_log_entry_data.empty()) {
-        LogEntry* entry = _log_entry_data.front();
-        if (entry->id.index < first_index_kept) {
-            popped.push_back(entry);
-            _log_entry_data.pop_front();
-        } else {
-            break;
-        }
+    while (!_log_entries.empty() && _log_entries.front()->id.index < first_index_kept) {
+        popped.push_back(_log_entries.pop_front());
     }
     _first_log_index.store(first_index_kept, butil::memory_order_release);
     if (_first_log_index.load(butil::memory_order_relaxed)
@@ -108,16 +110,10 @@ int MemoryLogStorage::truncate_prefix(const int64_t first_index_kept) {
 }
 
 int MemoryLogStorage::truncate_suffix(const int64_t last_index_kept) {
-    std::deque<LogEntry*> popped;
+    std::vector<LogEntry*> popped;
     std::unique_lock<raft_mutex_t> lck(_mutex);
-    while (!_log_entry_data.empty()) {
-        LogEntry* entry = _log_entry_data.back();
-        if (entry->id.index > last_index_kept) {
-            popped.push_back(entry);
-            _log_entry_data.pop_back();
-        } else {
-            break;
-        }
+    while (!_log_entries.empty() && _log_entries.back()->id.index > last_index_kept) {
+        popped.push_back(_log_entries.pop_back());
     }
     _last_log_index.store(last_index_kept, butil::memory_order_release);
     if (_first_log_index.load(butil::memory_order_relaxed)
@@ -137,12 +133,10 @@ int MemoryLogStorage::reset(const int64_t next_log_index) {
         LOG(ERROR) << "Invalid next_log_index=" << next_log_index;
         return EINVAL;
     }
-    std::deque<LogEntry*> popped;
+    std::vector<LogEntry*> popped;
     std::unique_lock<raft_mutex_t> lck(_mutex);
-    while (!_log_entry_data.empty()) {
-        LogEntry* entry = _log_entry_data.back();
-        popped.push_back(entry);
-        _log_entry_data.pop_back();
+    while (!_log_entries.empty()) {
+        popped.push_back(_log_entries.pop_back());
     }
     _first_log_index.store(next_log_index, butil::memory_order_relaxed);
     _last_log_index.store(next_log_index - 1, butil::memory_order_relaxed);
@@ -155,7 +149,21 @@ int MemoryLogStorage::reset(const int64_t next_log_index) {
 }
 
 LogStorage* MemoryLogStorage::new_instance(const std::string& uri) const {
-    return new MemoryLogStorage(uri);
+    // ${path}?max_bytes=${max_bytes}
+    const size_t pos = uri.find("?max_bytes=");
+    if (pos == std::string::npos) {
+        return new MemoryLogStorage(uri);
+    }
+    const std::string value = uri.substr(pos + strlen("?max_bytes="));
+    char* end = NULL;
+    const long long max_bytes = strtoll(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || max_bytes < 0) {
+        LOG(ERROR) << "Invalid max_bytes in memory log uri=`" << uri << '\'';
+        return NULL;
+    }
+    MemoryLogStorage* storage = new MemoryLogStorage(uri.substr(0, pos));
+    storage->_max_bytes = max_bytes;
+    return storage;
 }
 
 } //  namespace braft
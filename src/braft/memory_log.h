@@ -18,27 +18,38 @@
 #define BRAFT_MEMORY_LOG_H
 
 #include <vector>
-#include <deque>
 #include <butil/atomicops.h>
 #include <butil/iobuf.h>
 #include <butil/logging.h>
 #include "braft/log_entry.h"
+#include "braft/log_entry_ring.h"
 #include "braft/storage.h"
 #include "braft/util.h"
 
 namespace braft {
 
+// Keeps the logs in memory only, of which the durability comes from the
+// replication. Created with memory://${path}?max_bytes=${max_bytes}, the node
+// takes a snapshot to discard the logs once the data appended since the last
+// one reach |max_bytes|, and rejects new tasks with EBUSY while the logs held
+// reach it.
+//
+// The logs are held in a ring, so that get_entry() and get_term() are
+// lock-free while the modifications are serialized by the mutex. They take
+// the mutex only if the ring misses a log in range while growing.
 class BAIDU_CACHELINE_ALIGNMENT MemoryLogStorage : public LogStorage {
 public:
-    typedef std::deque<LogEntry*> MemoryData;
-
     MemoryLogStorage(const std::string& path)
             : _path(path),
+            _max_bytes(0),
             _first_log_index(1),
-            _last_log_index(0) {}
+            _last_log_index(0),
+            _log_entries(false) {}
     MemoryLogStorage()
-            : _first_log_index(1),
-            _last_log_index(0) {}
+            : _max_bytes(0),
+            _first_log_index(1),
+            _last_log_index(0),
+            _log_entries(false) {}
 
     virtual ~MemoryLogStorage() {}
 
@@ -76,16 +87,25 @@ public:
     // This function is called after installing snapshot from leader
     virtual int reset(const int64_t next_log_index);
 
+    virtual int64_t capacity_bytes() { return _max_bytes; }
+
+    virtual int64_t used_bytes() { return _log_entries.bytes(); }
+
     // Create an instance of this kind of LogStorage with the parameters encoded
     // in |uri|
     // Return the address referenced to the instance on success, NULL otherwise.
     virtual LogStorage* new_instance(const std::string& uri) const;
 
 private:
+    int unsafe_append_entry(const LogEntry* entry);
+
     std::string _path;
+    int64_t _max_bytes;
     butil::atomic<int64_t> _first_log_index;
     butil::atomic<int64_t> _last_log_index;
-    MemoryData _log_entry_data;
+    // Not counted in the logs in memory of LogManager, which are limited by
+    // raft_max_total_logs_in_memory_bytes
+    LogEntryRing _log_entries;
     raft_mutex_t _mutex;
 };
 
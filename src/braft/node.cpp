@@ -16,7 +16,11 @@
 //          Zhangyi Chen(chenzhangyi01@baidu.com)
 //          Xiong,Kai(xionkai@baidu.com)
 
+#include <algorithm>
+#include <functional>
+#include <limits>
 #include <bthread/unstable.h>
+#include <bthread/countdown_event.h>
 #include <brpc/errno.pb.h>
 #include <brpc/controller.h>
 #include <brpc/channel.h>
@@ -32,6 +36,11 @@
 #include "braft/builtin_service_impl.h"
 #include "braft/node_manager.h"
 #include "braft/snapshot_executor.h"
+#include "braft/snapshot_scheduler.h"
+#include "braft/fsync.h"
+#include "braft/vote_aggregator.h"
+#include "braft/leader_balancer.h"
+#include "braft/transport.h"
 #include "braft/errno.pb.h"
 
 namespace braft {
@@ -40,10 +49,42 @@ DEFINE_int32(raft_max_election_delay_ms, 1000,
                      "Max election delay time allowed by user");
 BRPC_VALIDATE_GFLAG(raft_max_election_delay_ms, brpc::PositiveInteger);
 
+DEFINE_int32(raft_election_start_spread_ms, 0,
+             "The first election timeout of a node is delayed by a random "
+             "time up to this, so that the groups started together, e.g. by "
+             "restarting a server, don't elect all at once");
+BRPC_VALIDATE_GFLAG(raft_election_start_spread_ms, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_enable_adaptive_election_timeout, false,
+            "The leader derives the election timeout of the group from the "
+            "RTT of the heartbeats, within "
+            "[raft_adaptive_election_timeout_min_ms, election_timeout_ms], "
+            "and the heartbeat interval from it, which the followers adopt. "
+            "Not applied if the leader lease is enabled");
+BRPC_VALIDATE_GFLAG(raft_enable_adaptive_election_timeout,
+                    ::brpc::PassValidate);
+
+DEFINE_int32(raft_adaptive_election_timeout_min_ms, 100,
+             "Lower bound of the adaptive election timeout");
+BRPC_VALIDATE_GFLAG(raft_adaptive_election_timeout_min_ms,
+                    brpc::PositiveInteger);
+
+DEFINE_int32(raft_adaptive_election_timeout_rtt_factor, 20,
+             "The adaptive election timeout is this times the smoothed RTT "
+             "plus 4 times its variation of the slowest peer");
+BRPC_VALIDATE_GFLAG(raft_adaptive_election_timeout_rtt_factor,
+                    brpc::PositiveInteger);
+
 DEFINE_bool(raft_step_down_when_vote_timedout, true, 
             "candidate steps down when reaching timeout");
 BRPC_VALIDATE_GFLAG(raft_step_down_when_vote_timedout, brpc::PassValidate);
 
+DEFINE_bool(raft_enable_pre_vote, true,
+            "Do a pre_vote before increasing the term to elect self, which "
+            "keeps a partitioned node from disrupting the group when it comes "
+            "back at the cost of one more round trip in each election");
+BRPC_VALIDATE_GFLAG(raft_enable_pre_vote, brpc::PassValidate);
+
 DEFINE_bool(raft_enable_append_entries_cache, false,
             "enable cache for out-of-order append entries requests, should used when "
             "pipeline replication is enabled (raft_max_parallel_append_entries_rpc_num > 1).");
@@ -53,6 +94,50 @@ DEFINE_int32(raft_max_append_entries_cache_size, 8,
             "the max size of out-of-order append entries cache");
 BRPC_VALIDATE_GFLAG(raft_max_append_entries_cache_size, ::brpc::PositiveInteger);
 
+DEFINE_int64(raft_max_append_entries_cache_bytes, 64 * 1024 * 1024,
+             "the max attachment bytes of out-of-order append entries cache");
+BRPC_VALIDATE_GFLAG(raft_max_append_entries_cache_bytes,
+                    ::brpc::PositiveInteger);
+
+DEFINE_int32(raft_relay_wait_ms, 500,
+             "Max time a relay waits for the logs of the AppendEntries it "
+             "forwards to reach itself");
+BRPC_VALIDATE_GFLAG(raft_relay_wait_ms, ::brpc::PositiveInteger);
+
+DEFINE_int32(raft_follower_read_interval_ms, 1,
+             "The reads of a follower within this interval ask the leader "
+             "for the read index in one ReadIndex RPC");
+BRPC_VALIDATE_GFLAG(raft_follower_read_interval_ms,
+                    ::brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_hibernate_idle_ms, 0,
+             "Hibernate the group when the leader has no log appended for "
+             "this long and all the followers are caught up, so that the "
+             "heartbeats and the election timeouts become sparse until the "
+             "group is woken up. 0 disables hibernation");
+BRPC_VALIDATE_GFLAG(raft_hibernate_idle_ms, ::brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_hibernate_heartbeat_interval_ms, 30000,
+             "Interval of the heartbeats of hibernated groups, which detect "
+             "the failures of the leaders and the followers");
+BRPC_VALIDATE_GFLAG(raft_hibernate_heartbeat_interval_ms,
+                    ::brpc::PositiveInteger);
+
+DEFINE_int32(raft_snapshot_policy_check_interval_ms, 1000,
+             "Interval of checking the growth of the logs of the nodes whose "
+             "snapshots are triggered by snapshot_log_entries or "
+             "snapshot_log_bytes, which takes effect for the nodes "
+             "initialized afterwards");
+BRPC_VALIDATE_GFLAG(raft_snapshot_policy_check_interval_ms,
+                    ::brpc::PositiveInteger);
+
+DEFINE_int32(raft_snapshot_max_retry_backoff_ms, 60 * 1000,
+             "Max delay before an automatic snapshot is retried after it "
+             "fails, which doubles from raft_snapshot_policy_check_interval_ms "
+             "on each consecutive failure");
+BRPC_VALIDATE_GFLAG(raft_snapshot_max_retry_backoff_ms,
+                    ::brpc::PositiveInteger);
+
 #ifndef UNIT_TEST
 static bvar::Adder<int64_t> g_num_nodes("raft_node_count");
 #else
@@ -62,6 +147,9 @@ bvar::Adder<int64_t> g_num_nodes("raft_node_count");
 
 static bvar::CounterRecorder g_apply_tasks_batch_counter(
         "raft_apply_tasks_batch_counter");
+static bvar::Adder<int64_t> g_relay_append_entries_bytes(
+        "raft_relay_append_entries_bytes");
+static bvar::Adder<int64_t> g_lease_reads("raft_lease_reads");
 
 int SnapshotTimer::adjust_timeout_ms(int timeout_ms) {
     if (!_first_schedule) {
@@ -114,10 +202,22 @@ static inline int heartbeat_timeout(int election_timeout) {
     return std::max(election_timeout / FLAGS_raft_election_heartbeat_factor, 10);
 }
 
+DEFINE_bool(raft_separate_control_connection, false,
+            "Send heartbeats, votes and timeout_now through a connection of "
+            "their own, so that they are not queued behind the AppendEntries "
+            "and snapshots, which may delay them past the election timeout "
+            "under heavy replication traffic. Takes effect on new nodes");
+BRPC_VALIDATE_GFLAG(raft_separate_control_connection, ::brpc::PassValidate);
+
+// The connection group of the control RPCs, see
+// raft_separate_control_connection
+static const char* const RAFT_CONTROL_CONNECTION_GROUP = "braft_control";
+
 NodeImpl::NodeImpl(const GroupId& group_id, const PeerId& peer_id)
     : _state(STATE_UNINITIALIZED)
     , _current_term(0)
     , _last_leader_timestamp(butil::monotonic_time_ms())
+    , _init_timestamp(butil::monotonic_time_ms())
     , _group_id(group_id)
     , _conf_ctx(this)
     , _log_storage(NULL)
@@ -134,7 +234,24 @@ NodeImpl::NodeImpl(const GroupId& group_id, const PeerId& peer_id)
     , _append_entries_cache(NULL)
     , _append_entries_cache_version(0)
     , _node_readonly(false)
-    , _majority_nodes_readonly(false) {
+    , _majority_nodes_readonly(false)
+    , _read_index_in_flight(false)
+    , _follower_read_scheduled(false)
+    , _max_election_priority(0)
+    , _adaptive_election_timeout_ms(0)
+    , _last_priority_transfer_ms(0)
+    , _log_disk(0)
+    , _last_slow_disk_transfer_ms(0)
+    , _hibernating(false)
+    , _first_election_timeout(true)
+    , _last_active_ms(0)
+    , _wake_up_ms(0)
+    , _next_log_subscription_id(1)
+    , _snapshot_disk(0)
+    , _auto_snapshot_running(false)
+    , _last_auto_snapshot_ms(0)
+    , _auto_snapshot_failures(0)
+    , _auto_snapshot_retry_ms(0) {
     _server_id = peer_id;
     AddRef();
     g_num_nodes << 1;
@@ -144,6 +261,7 @@ NodeImpl::NodeImpl()
     : _state(STATE_UNINITIALIZED)
     , _current_term(0)
     , _last_leader_timestamp(butil::monotonic_time_ms())
+    , _init_timestamp(butil::monotonic_time_ms())
     , _group_id()
     , _conf_ctx(this)
     , _log_storage(NULL)
@@ -156,7 +274,24 @@ NodeImpl::NodeImpl()
     , _snapshot_executor(NULL)
     , _stop_transfer_arg(NULL)
     , _vote_triggered(false)
-    , _waking_candidate(0) {
+    , _waking_candidate(0)
+    , _read_index_in_flight(false)
+    , _follower_read_scheduled(false)
+    , _max_election_priority(0)
+    , _adaptive_election_timeout_ms(0)
+    , _last_priority_transfer_ms(0)
+    , _log_disk(0)
+    , _last_slow_disk_transfer_ms(0)
+    , _hibernating(false)
+    , _first_election_timeout(true)
+    , _last_active_ms(0)
+    , _wake_up_ms(0)
+    , _next_log_subscription_id(1)
+    , _snapshot_disk(0)
+    , _auto_snapshot_running(false)
+    , _last_auto_snapshot_ms(0)
+    , _auto_snapshot_failures(0)
+    , _auto_snapshot_retry_ms(0) {
         AddRef();
     g_num_nodes << 1;
 }
@@ -226,6 +361,7 @@ int NodeImpl::init_snapshot_storage() {
     opt.init_term = _current_term;
     opt.filter_before_copy_remote = _options.filter_before_copy_remote;
     opt.usercode_in_pthread = _options.usercode_in_pthread;
+    opt.witness = _options.witness;
     if (_options.snapshot_file_system_adaptor) {
         opt.file_system_adaptor = *_options.snapshot_file_system_adaptor;
     }
@@ -253,6 +389,9 @@ int NodeImpl::init_log_storage() {
     log_manager_options.log_storage = _log_storage;
     log_manager_options.configuration_manager = _config_manager;
     log_manager_options.fsm_caller = _fsm_caller;
+    log_manager_options.bthread_tag = _options.bthread_tag;
+    log_manager_options.disk = SnapshotScheduler::disk_of(_options.log_uri);
+    log_manager_options.relaxed_durability = _options.relaxed_log_durability;
     return _log_manager->init(log_manager_options);
 }
 
@@ -289,18 +428,98 @@ int NodeImpl::init_meta_storage() {
     return ret;
 }
 
+class AutoSnapshotDone : public Closure {
+public:
+    explicit AutoSnapshotDone(NodeImpl* node) : _node(node) {
+        _node->AddRef();
+    }
+    void Run() {
+        _node->on_auto_snapshot_done(status());
+        _node->Release();
+        delete this;
+    }
+private:
+    NodeImpl* _node;
+};
+
+bool NodeImpl::snapshot_policy_enabled() const {
+    return _options.snapshot_log_entries > 0 || _options.snapshot_log_bytes > 0
+        || (_log_storage && _log_storage->capacity_bytes() > 0);
+}
+
+bool NodeImpl::unsafe_snapshot_due(int64_t now_ms) {
+    if (!snapshot_policy_enabled()) {
+        // The timer fires every snapshot_interval_s
+        return true;
+    }
+    const int64_t elapsed_ms = now_ms - _last_auto_snapshot_ms;
+    if (_options.snapshot_interval_s > 0 &&
+            elapsed_ms >= _options.snapshot_interval_s * 1000L) {
+        return true;
+    }
+    if (elapsed_ms < _options.snapshot_min_interval_s * 1000L) {
+        return false;
+    }
+    int64_t applied_logs = 0;
+    int64_t appended_bytes = 0;
+    _log_manager->get_growth_since_snapshot(&applied_logs, &appended_bytes);
+    // The logs kept by the last snapshot for the slow followers are not
+    // discarded by another one, so only the bytes appended since then count
+    // towards the capacity of the storage
+    const int64_t capacity_bytes = _log_storage->capacity_bytes();
+    return (_options.snapshot_log_entries > 0 &&
+                applied_logs >= _options.snapshot_log_entries) ||
+           (_options.snapshot_log_bytes > 0 &&
+                appended_bytes >= _options.snapshot_log_bytes) ||
+           (capacity_bytes > 0 && appended_bytes >= capacity_bytes);
+}
+
 void NodeImpl::handle_snapshot_timeout() {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
 
     // check state
     if (!is_active_state(_state)) {
         return;
     }
-
+    const int64_t now_ms = butil::monotonic_time_ms();
+    if (_auto_snapshot_running || now_ms < _auto_snapshot_retry_ms ||
+            !unsafe_snapshot_due(now_ms)) {
+        return;
+    }
+    _auto_snapshot_running = true;
     lck.unlock();
-    // TODO: do_snapshot in another thread to avoid blocking the timer thread.
-    do_snapshot(NULL);
+    AddRef();  // Release in start_auto_snapshot
+    SnapshotScheduler::get_instance()->schedule(
+            _snapshot_disk, start_auto_snapshot, this);
+}
+
+void* NodeImpl::start_auto_snapshot(void* arg) {
+    NodeImpl* node = (NodeImpl*)arg;
+    node->do_snapshot(new AutoSnapshotDone(node));
+    node->Release();
+    return NULL;
+}
 
+void NodeImpl::on_auto_snapshot_done(const butil::Status& st) {
+    SnapshotScheduler::get_instance()->on_finished(_snapshot_disk);
+    BAIDU_SCOPED_LOCK(_mutex);
+    _auto_snapshot_running = false;
+    const int64_t now_ms = butil::monotonic_time_ms();
+    if (st.ok()) {
+        _last_auto_snapshot_ms = now_ms;
+        _auto_snapshot_failures = 0;
+        _auto_snapshot_retry_ms = 0;
+        return;
+    }
+    // Don't save a snapshot over and over on a failing disk
+    const int shift = std::min(_auto_snapshot_failures++, 16);
+    const int64_t backoff_ms = std::min<int64_t>(
+            (int64_t)FLAGS_raft_snapshot_policy_check_interval_ms << shift,
+            FLAGS_raft_snapshot_max_retry_backoff_ms);
+    _auto_snapshot_retry_ms = now_ms + backoff_ms;
+    LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                 << " fail to save the automatic snapshot, " << st
+                 << ", retry in " << backoff_ms << "ms";
 }
 
 int NodeImpl::init_fsm_caller(const LogId& bootstrap_id) {
@@ -317,6 +536,8 @@ int NodeImpl::init_fsm_caller(const LogId& bootstrap_id) {
     fsm_caller_options.closure_queue = _closure_queue;
     fsm_caller_options.node = this;
     fsm_caller_options.bootstrap_id = bootstrap_id;
+    fsm_caller_options.witness = _options.witness;
+    fsm_caller_options.bthread_tag = _options.bthread_tag;
     const int ret = _fsm_caller->init(fsm_caller_options);
     if (ret != 0) {
         delete fsm_caller_options.after_shutdown;
@@ -334,6 +555,9 @@ private:
 };
 
 int NodeImpl::bootstrap(const BootstrapOptions& options) {
+    if (options.from_local_snapshot) {
+        return bootstrap_from_local_snapshot(options);
+    }
 
     if (options.last_log_index > 0) {
         if (options.group_conf.empty() || options.fsm == NULL) {
@@ -382,7 +606,6 @@ int NodeImpl::bootstrap(const BootstrapOptions& options) {
             LOG(ERROR) << "Fail to set term";
             return -1;
         }
-        return -1;
     }
 
     if (options.fsm && init_fsm_caller(boostrap_id) != 0) {
@@ -408,12 +631,104 @@ int NodeImpl::bootstrap(const BootstrapOptions& options) {
     CHECK_EQ(_log_manager->first_log_index(), options.last_log_index + 1);
     CHECK_EQ(_log_manager->last_log_index(), options.last_log_index);
 
+    return append_bootstrap_configuration(options.group_conf);
+}
+
+int NodeImpl::bootstrap_from_local_snapshot(const BootstrapOptions& options) {
+    if (options.snapshot_uri.empty() || options.last_log_index <= 0) {
+        LOG(ERROR) << "Invalid arguments for " << __FUNCTION__
+                   << " snapshot_uri=" << options.snapshot_uri
+                   << " last_log_index=" << options.last_log_index;
+        return -1;
+    }
+    // The snapshot isn't loaded into the state machine here but by Node::init
+    // later, just like a node restarting
+    std::unique_ptr<SnapshotStorage> storage(
+            SnapshotStorage::create(options.snapshot_uri));
+    if (!storage || storage->init() != 0) {
+        LOG(ERROR) << "Fail to init snapshot storage from "
+                   << options.snapshot_uri;
+        return -1;
+    }
+    SnapshotMeta meta;
+    SnapshotReader* reader = storage->open();
+    if (reader == NULL) {
+        LOG(ERROR) << "No snapshot in " << options.snapshot_uri;
+        return -1;
+    }
+    const int rc = reader->load_meta(&meta);
+    storage->close(reader);
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to load snapshot meta from "
+                   << options.snapshot_uri;
+        return -1;
+    }
+    // Term is not an option since changing it is very dangerous
+    if (meta.last_included_index() != options.last_log_index ||
+            meta.last_included_term() != 1) {
+        LOG(ERROR) << "The snapshot in " << options.snapshot_uri << " is at "
+                   << meta.last_included_index() << ':'
+                   << meta.last_included_term() << " rather than "
+                   << options.last_log_index << ":1";
+        return -1;
+    }
+    Configuration group_conf = options.group_conf;
+    if (group_conf.empty()) {
+        for (int i = 0; i < meta.peers_size(); ++i) {
+            group_conf.add_peer(meta.peers(i));
+        }
+    }
+    if (group_conf.empty()) {
+        LOG(ERROR) << "bootstraping an empty node makes no sense";
+        return -1;
+    }
+
+    _options.usercode_in_pthread = options.usercode_in_pthread;
+    _options.log_uri = options.log_uri;
+    _options.raft_meta_uri = options.raft_meta_uri;
+    _options.snapshot_uri = options.snapshot_uri;
+    _config_manager = new ConfigurationManager();
+    // LogManager needs the FSMCaller to report errors, which is never
+    // initialized as there's no state machine to call
+    _fsm_caller = new FSMCaller();
+    if (init_log_storage() != 0) {
+        LOG(ERROR) << "Fail to init log_storage from " << _options.log_uri;
+        return -1;
+    }
+    if (_log_manager->last_log_index() != 0) {
+        LOG(ERROR) << "Fail to bootstrap from " << options.snapshot_uri
+                   << " as there have been logs in " << _options.log_uri;
+        return -1;
+    }
+    if (init_meta_storage() != 0) {
+        LOG(ERROR) << "Fail to init stable_storage from "
+                   << _options.raft_meta_uri;
+        return -1;
+    }
+    if (_current_term == 0) {
+        _current_term = 1;
+        if (_meta_storage->set_term_and_votedfor(1, PeerId()) != 0) {
+            LOG(ERROR) << "Fail to set term";
+            return -1;
+        }
+    }
+    _log_manager->set_snapshot(&meta);
+    CHECK_EQ(_log_manager->first_log_index(), options.last_log_index + 1);
+    CHECK_EQ(_log_manager->last_log_index(), options.last_log_index);
+
+    return append_bootstrap_configuration(group_conf);
+}
+
+int NodeImpl::append_bootstrap_configuration(const Configuration& conf) {
     LogEntry* entry = new LogEntry();
+    if (entry == NULL) {
+        return -1;
+    }
     entry->AddRef();
     entry->id.term = _current_term;
     entry->type = ENTRY_TYPE_CONFIGURATION;
     entry->peers = new std::vector<PeerId>;
-    options.group_conf.list_peers(entry->peers);
+    conf.list_peers(entry->peers);
 
     std::vector<LogEntry*> entries;
     entries.push_back(entry);
@@ -430,6 +745,7 @@ int NodeImpl::bootstrap(const BootstrapOptions& options) {
 
 int NodeImpl::init(const NodeOptions& options) {
     _options = options;
+    _init_timestamp = butil::monotonic_time_ms();
 
     // check _server_id
     if (butil::IP_ANY == _server_id.addr.ip) {
@@ -452,7 +768,10 @@ int NodeImpl::init(const NodeOptions& options) {
 
     _config_manager = new ConfigurationManager();
 
-    if (bthread::execution_queue_start(&_apply_queue_id, NULL,
+    bthread::ExecutionQueueOptions apply_queue_options;
+    apply_queue_options.bthread_attr = bthread_attr_of_tag(
+            BTHREAD_ATTR_NORMAL, options.bthread_tag);
+    if (bthread::execution_queue_start(&_apply_queue_id, &apply_queue_options,
                                        execute_applying_tasks, this) != 0) {
         LOG(ERROR) << "node " << _group_id << ":" << _server_id 
                    << " fail to start execution_queue";
@@ -494,6 +813,7 @@ int NodeImpl::init(const NodeOptions& options) {
     BallotBoxOptions ballot_box_options;
     ballot_box_options.waiter = _fsm_caller;
     ballot_box_options.closure_queue = _closure_queue;
+    ballot_box_options.replicator_group = &_replicator_group;
     if (_ballot_box->init(ballot_box_options) != 0) {
         LOG(ERROR) << "node " << _group_id << ":" << _server_id
                    << " init _ballot_box failed";
@@ -517,6 +837,12 @@ int NodeImpl::init(const NodeOptions& options) {
         return -1;
     }
 
+    if (_fsm_caller->load_applied_index() != 0) {
+        LOG(ERROR) << "node " << _group_id << ":" << _server_id
+                   << " fail to load the applied index of StateMachine";
+        return -1;
+    }
+
     _conf.id = LogId();
     // if have log using conf in log, else using conf in options
     if (_log_manager->last_log_index() > 0) {
@@ -526,6 +852,9 @@ int NodeImpl::init(const NodeOptions& options) {
     }
 
     // init replicator
+    if (FLAGS_raft_separate_control_connection) {
+        _control_connection_group = RAFT_CONTROL_CONNECTION_GROUP;
+    }
     ReplicatorGroupOptions rg_options;
     rg_options.heartbeat_timeout_ms = heartbeat_timeout(_options.election_timeout_ms);
     rg_options.election_timeout_ms = _options.election_timeout_ms;
@@ -538,11 +867,14 @@ int NodeImpl::init(const NodeOptions& options) {
     rg_options.snapshot_storage = _snapshot_executor
         ? _snapshot_executor->snapshot_storage()
         : NULL;
+    rg_options.control_connection_group = _control_connection_group;
     _replicator_group.init(NodeId(_group_id, _server_id), rg_options);
 
     // set state to follower
     _state = STATE_FOLLOWER;
 
+    _log_disk = SnapshotScheduler::disk_of(_options.log_uri);
+
     LOG(INFO) << "node " << _group_id << ":" << _server_id << " init,"
               << " term: " << _current_term
               << " last_log_id: " << _log_manager->last_log_id()
@@ -550,7 +882,20 @@ int NodeImpl::init(const NodeOptions& options) {
               << " old_conf: " << _conf.old_conf;
 
     // start snapshot timer
-    if (_snapshot_executor && _options.snapshot_interval_s > 0) {
+    if (_snapshot_executor &&
+            (_options.snapshot_interval_s > 0 || snapshot_policy_enabled())) {
+        _snapshot_disk = SnapshotScheduler::disk_of(_options.snapshot_uri);
+        if (snapshot_policy_enabled()) {
+            // The growth of the logs is checked periodically, which depends
+            // on the log storage as well
+            _snapshot_timer.reset(FLAGS_raft_snapshot_policy_check_interval_ms);
+        }
+        // Spread the time based snapshots of the nodes started together
+        _last_auto_snapshot_ms = butil::monotonic_time_ms();
+        if (snapshot_policy_enabled() && _options.snapshot_interval_s > 0) {
+            _last_auto_snapshot_ms -= butil::fast_rand_less_than(
+                    _options.snapshot_interval_s * 1000L);
+        }
         BRAFT_VLOG << "node " << _group_id << ":" << _server_id
                    << " term " << _current_term << " start snapshot_timer";
         _snapshot_timer.start();
@@ -566,10 +911,14 @@ int NodeImpl::init(const NodeOptions& options) {
                    << ":" << _server_id << " failed";
         return -1;
     }
+    if (FLAGS_raft_enable_leader_balance) {
+        // Start balancing
+        LeaderBalancer::get_instance();
+    }
 
     // Now the raft node is started , have to acquire the lock to avoid race
     // conditions
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     if (_conf.stable() && _conf.conf.size() == 1u
             && _conf.conf.contains(_server_id)) {
         // The group contains only this server which must be the LEADER, trigger
@@ -584,6 +933,18 @@ DEFINE_int32(raft_apply_batch, 32, "Max number of tasks that can be applied "
                                    " in a single batch");
 BRPC_VALIDATE_GFLAG(raft_apply_batch, ::brpc::PositiveInteger);
 
+DEFINE_bool(raft_coalesce_tasks, false,
+            "Pack the small tasks applied in one batch into one log, which "
+            "saves the cost of each log. All the peers must support it");
+BRPC_VALIDATE_GFLAG(raft_coalesce_tasks, ::brpc::PassValidate);
+
+DEFINE_int32(raft_coalesce_max_bytes, 64 * 1024,
+             "Tasks no smaller than this are not packed, and a packed log is "
+             "closed once its data reaches this");
+BRPC_VALIDATE_GFLAG(raft_coalesce_max_bytes, ::brpc::PositiveInteger);
+
+static bvar::CounterRecorder g_coalesced_tasks("raft_coalesced_tasks");
+
 int NodeImpl::execute_applying_tasks(
         void* meta, bthread::TaskIterator<LogEntryAndClosure>& iter) {
     if (iter.is_queue_stopped()) {
@@ -596,6 +957,16 @@ int NodeImpl::execute_applying_tasks(
     size_t cur_size = 0;
     NodeImpl* m = (NodeImpl*)meta;
     for (; iter; ++iter) {
+        if (iter->batch) {
+            // The tasks submitted in one call are applied as a whole
+            if (cur_size > 0) {
+                m->apply(tasks, cur_size);
+                cur_size = 0;
+            }
+            m->apply(&(*iter->batch)[0], iter->batch->size());
+            delete iter->batch;
+            continue;
+        }
         if (cur_size == batch_size) {
             m->apply(tasks, cur_size);
             cur_size = 0;
@@ -608,14 +979,44 @@ int NodeImpl::execute_applying_tasks(
     return 0;
 }
 
-void NodeImpl::apply(const Task& task) {
+static LogEntry* new_task_entry(const Task& task) {
     LogEntry* entry = new LogEntry;
+    if (entry == NULL) {
+        return NULL;
+    }
     entry->AddRef();
-    entry->data.swap(*task.data);
+    if (task.partition_key >= 0) {
+        serialize_partitioned_data(task.partition_key, task.data, &entry->data);
+        entry->type = ENTRY_TYPE_PARTITIONED_DATA;
+    } else {
+        entry->data.swap(*task.data);
+    }
+    return entry;
+}
+
+void NodeImpl::apply(const Task& task) {
+    // Shed load early rather than queueing more logs in memory when the disk
+    // or the state machine can't catch up
+    if (!_log_manager->wait_memory_budget()) {
+        if (task.done) {
+            task.done->status().set_error(EBUSY, "Too many logs in memory");
+            run_closure_in_bthread(task.done);
+        }
+        return;
+    }
+    LogEntry* entry = new_task_entry(task);
+    if (entry == NULL) {
+        if (task.done) {
+            task.done->status().set_error(ENOMEM, "Fail to allocate log entry");
+            run_closure_in_bthread(task.done);
+        }
+        return;
+    }
     LogEntryAndClosure m;
     m.entry = entry;
     m.done = task.done;
     m.expected_term = task.expected_term;
+    m.trace_start_us = EntryTracer::sample();
     if (_apply_queue->execute(m, &bthread::TASK_OPTIONS_INPLACE, NULL) != 0) {
         task.done->status().set_error(EPERM, "Node is down");
         entry->Release();
@@ -623,6 +1024,103 @@ void NodeImpl::apply(const Task& task) {
     }
 }
 
+// Runs the closure of a batch once all the tasks of the batch are done, with
+// the first error of them
+class ApplyBatchDone {
+public:
+    class SubDone : public Closure {
+    public:
+        SubDone() : _parent(NULL) {}
+        void set_parent(ApplyBatchDone* parent) { _parent = parent; }
+        void Run() { _parent->on_sub_done(status()); }
+    private:
+        ApplyBatchDone* _parent;
+    };
+
+    ApplyBatchDone(Closure* done, size_t size)
+        : _done(done), _subs(new SubDone[size]), _pending(size) {
+        for (size_t i = 0; i < size; ++i) {
+            _subs[i].set_parent(this);
+        }
+    }
+    ~ApplyBatchDone() { delete [] _subs; }
+
+    SubDone* sub(size_t i) { return &_subs[i]; }
+
+private:
+    void on_sub_done(const butil::Status& st) {
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (!st.ok() && _done->status().ok()) {
+                _done->status() = st;
+            }
+            if (--_pending != 0) {
+                return;
+            }
+        }
+        _done->Run();
+        delete this;
+    }
+
+    Closure* _done;
+    SubDone* _subs;
+    raft_mutex_t _mutex;
+    size_t _pending;
+};
+
+void NodeImpl::apply(const std::vector<Task>& tasks, Closure* done) {
+    if (tasks.empty()) {
+        if (done) {
+            run_closure_in_bthread(done);
+        }
+        return;
+    }
+    ApplyBatchDone* batch_done = NULL;
+    if (done) {
+        batch_done = new ApplyBatchDone(done, tasks.size());
+    }
+    std::vector<LogEntryAndClosure>* batch =
+            new std::vector<LogEntryAndClosure>(tasks.size());
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        LogEntryAndClosure& m = (*batch)[i];
+        m.done = batch_done ? batch_done->sub(i) : tasks[i].done;
+        m.expected_term = tasks[i].expected_term;
+    }
+    butil::Status st;
+    // The whole batch waits for the memory budget once
+    if (!_log_manager->wait_memory_budget()) {
+        st.set_error(EBUSY, "Too many logs in memory");
+    } else {
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            (*batch)[i].entry = new_task_entry(tasks[i]);
+            if ((*batch)[i].entry == NULL) {
+                st.set_error(ENOMEM, "Fail to allocate log entry");
+                break;
+            }
+        }
+        if (st.ok()) {
+            LogEntryAndClosure m;
+            m.batch = batch;
+            if (_apply_queue->execute(m, &bthread::TASK_OPTIONS_INPLACE,
+                                      NULL) == 0) {
+                return;
+            }
+            st.set_error(EPERM, "Node is down");
+        }
+    }
+    for (size_t i = 0; i < batch->size(); ++i) {
+        LogEntryAndClosure& m = (*batch)[i];
+        if (m.entry) {
+            m.entry->Release();
+        }
+        if (m.done) {
+            m.done->status() = st;
+            run_closure_in_bthread(m.done);
+        }
+    }
+    delete batch;
+}
+
 void NodeImpl::on_configuration_change_done(int64_t term) {
     BAIDU_SCOPED_LOCK(_mutex);
     if (_state > STATE_TRANSFERRING || term != _current_term) {
@@ -678,150 +1176,872 @@ void NodeImpl::on_caughtup(const PeerId& peer, int64_t term,
         return;
     }
 
-    if (st.ok()) {  // Caught up successfully
-        _conf_ctx.on_caughtup(version, peer, true);
+    if (st.ok()) {  // Caught up successfully
+        _conf_ctx.on_caughtup(version, peer, true);
+        return;
+    }
+
+    // Retry if this peer is still alive
+    if (st.error_code() == ETIMEDOUT 
+            && (butil::monotonic_time_ms()
+                -  _replicator_group.last_rpc_send_timestamp(peer))
+                    <= _options.election_timeout_ms) {
+
+        LOG(INFO) << "node " << _group_id << ":" << _server_id
+                  << " waits peer " << peer << " to catch up";
+
+        OnCaughtUp* caught_up = new OnCaughtUp(this, _current_term, peer, version);
+        timespec due_time = butil::milliseconds_from_now(
+                _options.election_timeout_ms);
+
+        if (0 == _replicator_group.wait_caughtup(
+                    peer, _options.catchup_margin, &due_time, caught_up)) {
+            return;
+        } else {
+            LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                << " wait_caughtup failed, peer " << peer;
+            delete caught_up;
+        }
+    }
+
+    _conf_ctx.on_caughtup(version, peer, false);
+}
+
+void NodeImpl::check_dead_nodes(const Configuration& conf, int64_t now_ms) {
+    std::vector<PeerId> peers;
+    conf.list_peers(&peers);
+    // The heartbeats are sparse in hibernation, and the acknowledgements may
+    // be stale for a while after waking up
+    int64_t dead_node_timeout_ms = _options.election_timeout_ms;
+    if (_hibernating.load(butil::memory_order_relaxed) ||
+            now_ms - _wake_up_ms <= _options.election_timeout_ms) {
+        dead_node_timeout_ms += 2L * FLAGS_raft_hibernate_heartbeat_interval_ms;
+    }
+    size_t alive_count = 0;
+    Configuration dead_nodes;  // for easily print
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (peers[i] == _server_id) {
+            ++alive_count;
+            continue;
+        }
+
+        if (now_ms - _replicator_group.last_rpc_send_timestamp(peers[i])
+                <= dead_node_timeout_ms) {
+            ++alive_count;
+            continue;
+        }
+        dead_nodes.add_peer(peers[i]);
+    }
+    if (alive_count >= peers.size() / 2 + 1) {
+        return;
+    }
+    LOG(WARNING) << "node " << node_id()
+                 << " term " << _current_term
+                 << " steps down when alive nodes don't satisfy quorum"
+                    " dead_nodes: " << dead_nodes
+                 << " conf: " << conf;
+    butil::Status status;
+    status.set_error(ERAFTTIMEDOUT, "Majority of the group dies");
+    step_down(_current_term, false, status);
+}
+
+void NodeImpl::unsafe_adapt_election_timeout() {
+    const int old_timeout_ms =
+            _adaptive_election_timeout_ms.load(butil::memory_order_relaxed);
+    // The followers refuse to vote within the configured timeout in the
+    // leader lease, so there's no use adapting it
+    if (!FLAGS_raft_enable_adaptive_election_timeout ||
+            _options.enable_leader_lease) {
+        if (old_timeout_ms != 0) {
+            _adaptive_election_timeout_ms.store(0, butil::memory_order_relaxed);
+            _replicator_group.reset_heartbeat_interval(
+                    heartbeat_timeout(_options.election_timeout_ms));
+        }
+        return;
+    }
+    const int64_t rtt_timeout_us = _replicator_group.max_rtt_timeout_us();
+    if (rtt_timeout_us < 0) {
+        return;
+    }
+    int64_t timeout_ms = rtt_timeout_us *
+            FLAGS_raft_adaptive_election_timeout_rtt_factor / 1000;
+    timeout_ms = std::max(timeout_ms,
+            (int64_t)FLAGS_raft_adaptive_election_timeout_min_ms);
+    timeout_ms = std::min(timeout_ms, (int64_t)_options.election_timeout_ms);
+    // The timeout might be learned from the previous leader, while the
+    // heartbeat interval is not
+    _replicator_group.reset_heartbeat_interval(heartbeat_timeout(timeout_ms));
+    if (timeout_ms == old_timeout_ms) {
+        return;
+    }
+    _adaptive_election_timeout_ms.store(timeout_ms, butil::memory_order_relaxed);
+    BRAFT_VLOG << "node " << _group_id << ":" << _server_id
+               << " adapts election timeout to " << timeout_ms
+               << "ms as the RTT timeout of the peers is " << rtt_timeout_us
+               << "us";
+}
+
+int NodeImpl::unsafe_election_timeout_ms() {
+    const int adaptive_timeout_ms =
+            _adaptive_election_timeout_ms.load(butil::memory_order_relaxed);
+    if (FLAGS_raft_enable_adaptive_election_timeout && adaptive_timeout_ms > 0) {
+        return std::min(_options.election_timeout_ms, adaptive_timeout_ms);
+    }
+    return _options.election_timeout_ms;
+}
+
+bool NodeImpl::check_leader_lease(const Configuration& conf, int64_t now_ms) {
+    std::vector<PeerId> peers;
+    conf.list_peers(&peers);
+    if (peers.empty()) {
+        return true;
+    }
+    std::vector<int64_t> ack_timestamps;
+    ack_timestamps.reserve(peers.size());
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (peers[i] == _server_id) {
+            ack_timestamps.push_back(now_ms);
+        } else {
+            ack_timestamps.push_back(
+                    _replicator_group.last_ack_timestamp(peers[i]));
+        }
+    }
+    // The lease starts when the heartbeats acked by a quorum were sent, as
+    // the followers count their election timeouts since receiving them
+    std::sort(ack_timestamps.begin(), ack_timestamps.end(),
+              std::greater<int64_t>());
+    const int64_t lease_start = ack_timestamps[peers.size() / 2];
+    if (lease_start <= 0) {
+        return false;
+    }
+    return now_ms < lease_start + _options.election_timeout_ms
+                    - _options.leader_lease_clock_drift_ms;
+}
+
+bool NodeImpl::unsafe_leader_lease_valid(int64_t now_ms) {
+    if (!_options.enable_leader_lease || _state != STATE_LEADER) {
+        return false;
+    }
+    if (!check_leader_lease(_conf.conf, now_ms)) {
+        return false;
+    }
+    return _conf.old_conf.empty() || check_leader_lease(_conf.old_conf, now_ms);
+}
+
+bool NodeImpl::unsafe_in_leader_lease(int64_t now_ms) {
+    if (!_options.enable_leader_lease) {
+        return false;
+    }
+    if (_state == STATE_LEADER || _state == STATE_TRANSFERRING) {
+        return true;
+    }
+    // The lease granted before a restart might still be valid while the
+    // leader is not known yet
+    if (now_ms - _init_timestamp < _options.election_timeout_ms) {
+        return true;
+    }
+    return !_leader_id.is_empty() &&
+           now_ms - _last_leader_timestamp < _options.election_timeout_ms;
+}
+
+void NodeImpl::handle_stepdown_timeout() {
+    std::unique_lock<node_mutex_t> lck(_mutex);
+
+    // check state
+    if (_state > STATE_TRANSFERRING) {
+        BRAFT_VLOG << "node " << _group_id << ":" << _server_id
+            << " term " << _current_term << " stop stepdown_timer"
+            << " state is " << state2str(_state);
+        return;
+    }
+
+    int64_t now = butil::monotonic_time_ms();
+    check_dead_nodes(_conf.conf, now);
+    if (!_conf.old_conf.empty()) {
+        check_dead_nodes(_conf.old_conf, now);
+    }
+    unsafe_check_hibernation(now);
+    unsafe_adapt_election_timeout();
+    // Keep the logs for the slowest follower across the snapshots
+    _log_manager->set_retained_index(_replicator_group.min_next_index());
+    PeerId peer;
+    if (unsafe_find_higher_priority_peer(now, &peer)) {
+        lck.unlock();
+        LOG(INFO) << "node " << _group_id << ":" << _server_id
+                  << " transfers leadership to " << peer
+                  << " of higher election priority";
+        transfer_leadership_to(peer);
+        return;
+    }
+    if (unsafe_on_slow_disk(now)) {
+        lck.unlock();
+        LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                     << " transfers leadership away as p99 sync latency of"
+                     << " the log disk is " << raft_disk_sync_p99_us(_log_disk)
+                     << "us";
+        transfer_leadership_to(ANY_PEER);
+    }
+}
+
+int NodeImpl::list_leader_loads(std::vector<PeerLeaderLoad>* out) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_state != STATE_LEADER || _conf_ctx.is_busy() ||
+            !_conf.stable() || _conf.conf.size() <= 1) {
+        return -1;
+    }
+    _replicator_group.list_leader_loads(
+            _options.election_priority, _log_manager->last_log_index(),
+            _conf, out);
+    return 0;
+}
+
+bool NodeImpl::unsafe_on_slow_disk(int64_t now_ms) {
+    if (!FLAGS_raft_slow_disk_transfer_leader || _state != STATE_LEADER ||
+            _conf_ctx.is_busy() || _conf.conf.size() <= 1 ||
+            now_ms - _last_slow_disk_transfer_ms
+                < 10L * _options.election_timeout_ms) {
+        return false;
+    }
+    if (!raft_disk_is_slow(_log_disk)) {
+        return false;
+    }
+    // Don't bounce the leadership back soon if the disks of the other peers
+    // are slow as well
+    _last_slow_disk_transfer_ms = now_ms;
+    return true;
+}
+
+bool NodeImpl::unsafe_find_higher_priority_peer(int64_t now_ms,
+                                                PeerId* peer) {
+    if (_state != STATE_LEADER) {
+        return false;
+    }
+    int max_priority = _options.election_priority;
+    const int rc = _replicator_group.find_higher_priority_peer(
+            _options.election_priority, _log_manager->last_log_index(),
+            _conf, peer, &max_priority);
+    _max_election_priority.store(max_priority, butil::memory_order_relaxed);
+    // Retry a while later if the last transfer didn't work out
+    if (rc != 0 || _conf_ctx.is_busy() || now_ms - _last_priority_transfer_ms
+                    < 10L * _options.election_timeout_ms) {
+        return false;
+    }
+    _last_priority_transfer_ms = now_ms;
+    return true;
+}
+
+void NodeImpl::unsafe_check_hibernation(int64_t now_ms) {
+    if (FLAGS_raft_hibernate_idle_ms <= 0 || _state != STATE_LEADER ||
+            _hibernating.load(butil::memory_order_relaxed) ||
+            _conf_ctx.is_busy() ||
+            now_ms - _last_active_ms < FLAGS_raft_hibernate_idle_ms) {
+        return;
+    }
+    const int64_t last_log_index = _log_manager->last_log_index();
+    if (_ballot_box->last_committed_index() != last_log_index ||
+            !_replicator_group.all_caught_up(last_log_index)) {
+        return;
+    }
+    LOG(INFO) << "node " << _group_id << ":" << _server_id
+              << " term " << _current_term << " hibernates after idle for "
+              << now_ms - _last_active_ms << "ms";
+    // Followers hibernate on the following heartbeats
+    _hibernating.store(true, butil::memory_order_relaxed);
+}
+
+void NodeImpl::unsafe_wake_up(int64_t now_ms) {
+    _last_active_ms = now_ms;
+    if (!_hibernating.load(butil::memory_order_relaxed)) {
+        return;
+    }
+    _hibernating.store(false, butil::memory_order_relaxed);
+    _wake_up_ms = now_ms;
+    LOG(INFO) << "node " << _group_id << ":" << _server_id
+              << " term " << _current_term << " wakes up";
+    if (_state == STATE_LEADER || _state == STATE_TRANSFERRING) {
+        _replicator_group.wake_up_all();
+    } else if (_state == STATE_FOLLOWER) {
+        // The last heartbeat might be long ago, give the leader one more
+        // election timeout before starting an election
+        _last_leader_timestamp = now_ms;
+        _election_timer.reset();
+    }
+}
+
+void NodeImpl::wake_up() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    unsafe_wake_up(butil::monotonic_time_ms());
+}
+
+int NodeImpl::adjust_election_timeout_ms(int timeout_ms) {
+    const int adaptive_timeout_ms =
+            _adaptive_election_timeout_ms.load(butil::memory_order_relaxed);
+    if (FLAGS_raft_enable_adaptive_election_timeout && adaptive_timeout_ms > 0) {
+        timeout_ms = std::min(timeout_ms, adaptive_timeout_ms);
+    }
+    if (_first_election_timeout.exchange(false, butil::memory_order_relaxed)
+            && FLAGS_raft_election_start_spread_ms > 0) {
+        timeout_ms += butil::fast_rand_less_than(
+                FLAGS_raft_election_start_spread_ms + 1);
+    }
+    if (_hibernating.load(butil::memory_order_relaxed)) {
+        // Leave enough time for the sparse heartbeats
+        timeout_ms += 2 * FLAGS_raft_hibernate_heartbeat_interval_ms;
+    }
+    // Give way to the peers of higher priority
+    if (_options.election_priority <
+            _max_election_priority.load(butil::memory_order_relaxed)) {
+        return random_timeout(timeout_ms) + timeout_ms;
+    }
+    return random_timeout(timeout_ms);
+}
+
+void NodeImpl::unsafe_register_conf_change(const Configuration& old_conf,
+                                           const Configuration& new_conf,
+                                           Closure* done) {
+    if (_state != STATE_LEADER) {
+        LOG(WARNING) << "[" << node_id()
+                     << "] Refusing configuration changing because the state is "
+                     << state2str(_state) ;
+        if (done) {
+            if (_state == STATE_TRANSFERRING) {
+                done->status().set_error(EBUSY, "Is transferring leadership");
+            } else {
+                done->status().set_error(EPERM, "Not leader");
+            }
+            run_closure_in_bthread(done);
+        }
+        return;
+    }
+
+    // check concurrent conf change
+    if (_conf_ctx.is_busy()) {
+        LOG(WARNING) << "[" << node_id()
+                     << " ] Refusing concurrent configuration changing";
+        if (done) {
+            done->status().set_error(EBUSY, "Doing another configuration change");
+            run_closure_in_bthread(done);
+        }
+        return;
+    }
+
+    // Return immediately when the new peers equals to current configuration
+    if (_conf.conf.equals(new_conf)) {
+        run_closure_in_bthread(done);
+        return;
+    }
+
+    return _conf_ctx.start(old_conf, new_conf, done);
+}
+
+void NodeImpl::unsafe_register_learners_change(const Configuration& new_learners,
+                                               Closure* done) {
+    if (_state != STATE_LEADER) {
+        LOG(WARNING) << "[" << node_id()
+                     << "] Refusing learners changing because the state is "
+                     << state2str(_state) ;
+        if (done) {
+            if (_state == STATE_TRANSFERRING) {
+                done->status().set_error(EBUSY, "Is transferring leadership");
+            } else {
+                done->status().set_error(EPERM, "Not leader");
+            }
+            run_closure_in_bthread(done);
+        }
+        return;
+    }
+
+    if (_conf_ctx.is_busy()) {
+        LOG(WARNING) << "[" << node_id()
+                     << " ] Refusing concurrent configuration changing";
+        if (done) {
+            done->status().set_error(EBUSY, "Doing another configuration change");
+            run_closure_in_bthread(done);
+        }
+        return;
+    }
+
+    for (Configuration::const_iterator
+            iter = new_learners.begin(); iter != new_learners.end(); ++iter) {
+        if (_conf.contains(*iter)) {
+            LOG(WARNING) << "[" << node_id() << "] Refusing to make voting peer "
+                         << *iter << " a learner";
+            if (done) {
+                done->status().set_error(EINVAL, "%s is a voting peer",
+                                         iter->to_string().c_str());
+                run_closure_in_bthread(done);
+            }
+            return;
+        }
+    }
+
+    if (_conf.learners.equals(new_learners)) {
+        run_closure_in_bthread(done);
+        return;
+    }
+
+    return _conf_ctx.start_learners_change(new_learners, done);
+}
+
+butil::Status NodeImpl::list_peers(std::vector<PeerId>* peers) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_state != STATE_LEADER) {
+        return butil::Status(EPERM, "Not leader");
+    }
+    _conf.conf.list_peers(peers);
+    return butil::Status::OK();
+}
+
+void NodeImpl::add_peer(const PeerId& peer, Closure* done) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    Configuration new_conf = _conf.conf;
+    new_conf.add_peer(peer);
+    return unsafe_register_conf_change(_conf.conf, new_conf, done);
+}
+
+void NodeImpl::remove_peer(const PeerId& peer, Closure* done) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    Configuration new_conf = _conf.conf;
+    new_conf.remove_peer(peer);
+    return unsafe_register_conf_change(_conf.conf, new_conf, done);
+}
+
+void NodeImpl::change_peers(const Configuration& new_peers, Closure* done) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return unsafe_register_conf_change(_conf.conf, new_peers, done);
+}
+
+butil::Status NodeImpl::list_learners(std::vector<PeerId>* learners) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_state != STATE_LEADER) {
+        return butil::Status(EPERM, "Not leader");
+    }
+    _conf.learners.list_peers(learners);
+    return butil::Status::OK();
+}
+
+void NodeImpl::add_learners(const std::vector<PeerId>& learners, Closure* done) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    Configuration new_learners = _conf.learners;
+    for (size_t i = 0; i < learners.size(); ++i) {
+        new_learners.add_peer(learners[i]);
+    }
+    return unsafe_register_learners_change(new_learners, done);
+}
+
+void NodeImpl::remove_learners(const std::vector<PeerId>& learners,
+                               Closure* done) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    Configuration new_learners = _conf.learners;
+    for (size_t i = 0; i < learners.size(); ++i) {
+        new_learners.remove_peer(learners[i]);
+    }
+    return unsafe_register_learners_change(new_learners, done);
+}
+
+static void finish_read(FSMCaller* fsm_caller, const PendingRead& read,
+                        int64_t read_index) {
+    if (read.index) {
+        *read.index = read_index;
+    }
+    if (read.wait_applied) {
+        fsm_caller->wait_applied(read_index, read.done);
+    } else {
+        run_closure_in_bthread(read.done);
+    }
+}
+
+// One round of heartbeats confirming the leadership for a batch of reads
+class ReadIndexRound {
+public:
+    ReadIndexRound(NodeImpl* node, int64_t term, int64_t read_index)
+        : _node(node), _term(term), _read_index(read_index), _refs(1)
+        , _confirmed(false) {
+        _node->AddRef();
+    }
+
+    int init(const ConfigurationEntry& conf, const PeerId& self) {
+        const int rc = _ballot.init(conf.conf,
+                                    conf.stable() ? NULL : &conf.old_conf);
+        _ballot.grant(self);
+        return rc;
+    }
+    bool granted() const { return _ballot.granted(); }
+    std::vector<PendingRead>* reads() { return &_reads; }
+    int64_t term() const { return _term; }
+    void add_ref() { _refs.fetch_add(1, butil::memory_order_relaxed); }
+
+    void on_heartbeat_returned(const PeerId& peer, bool acked);
+
+    // Hand the reads over to FSMCaller
+    void on_confirmed(FSMCaller* fsm_caller) {
+        for (size_t i = 0; i < _reads.size(); ++i) {
+            finish_read(fsm_caller, _reads[i], _read_index);
+        }
+        _reads.clear();
+    }
+
+    void release();
+
+private:
+    NodeImpl* _node;
+    const int64_t _term;
+    const int64_t _read_index;
+    butil::atomic<int> _refs;
+    raft_mutex_t _mutex;
+    Ballot _ballot;
+    bool _confirmed;
+    std::vector<PendingRead> _reads;
+};
+
+class ReadIndexHeartbeatDone : public google::protobuf::Closure {
+public:
+    ReadIndexHeartbeatDone(ReadIndexRound* round, const PeerId& peer)
+        : _round(round), _peer(peer) {
+        _round->add_ref();
+    }
+
+    void Run() {
+        // The follower of a newer term doesn't ack
+        _round->on_heartbeat_returned(
+                _peer, !cntl.Failed() && response.term() == _round->term());
+        _round->release();
+        delete this;
+    }
+
+    brpc::Controller cntl;
+    AppendEntriesRequest request;
+    AppendEntriesResponse response;
+
+private:
+    ReadIndexRound* _round;
+    PeerId _peer;
+};
+
+void ReadIndexRound::on_heartbeat_returned(const PeerId& peer, bool acked) {
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (!acked || _confirmed) {
+            return;
+        }
+        _ballot.grant(peer);
+        if (!_ballot.granted()) {
+            return;
+        }
+        _confirmed = true;
+    }
+    on_confirmed(_node->_fsm_caller);
+    _node->on_read_index_round_done();
+}
+
+void ReadIndexRound::release() {
+    if (_refs.fetch_sub(1, butil::memory_order_acq_rel) != 1) {
         return;
     }
+    if (!_confirmed) {
+        for (size_t i = 0; i < _reads.size(); ++i) {
+            _reads[i].done->status().set_error(
+                    EPERM, "Fail to confirm the leadership of term %" PRId64,
+                    _term);
+            run_closure_in_bthread(_reads[i].done);
+        }
+        _node->on_read_index_round_done();
+    }
+    _node->Release();
+    delete this;
+}
 
-    // Retry if this peer is still alive
-    if (st.error_code() == ETIMEDOUT 
-            && (butil::monotonic_time_ms()
-                -  _replicator_group.last_rpc_send_timestamp(peer))
-                    <= _options.election_timeout_ms) {
-
-        LOG(INFO) << "node " << _group_id << ":" << _server_id
-                  << " waits peer " << peer << " to catch up";
-
-        OnCaughtUp* caught_up = new OnCaughtUp(this, _current_term, peer, version);
-        timespec due_time = butil::milliseconds_from_now(
-                _options.election_timeout_ms);
+// Returns the read index confirmed by the leader to the follower
+class LeaderReadIndexDone : public Closure {
+public:
+    LeaderReadIndexDone(brpc::Controller* cntl, ReadIndexResponse* response,
+                        google::protobuf::Closure* done)
+        : index(0), _cntl(cntl), _response(response), _done(done) {}
 
-        if (0 == _replicator_group.wait_caughtup(
-                    peer, _options.catchup_margin, &due_time, caught_up)) {
-            return;
+    void Run() {
+        if (status().ok()) {
+            _response->set_index(index);
         } else {
-            LOG(WARNING) << "node " << _group_id << ":" << _server_id
-                << " wait_caughtup failed, peer " << peer;
-            delete caught_up;
+            _cntl->SetFailed(status().error_code(), "%s", status().error_cstr());
         }
+        _done->Run();
+        delete this;
     }
 
-    _conf_ctx.on_caughtup(version, peer, false);
-}
+    int64_t index;
 
-void NodeImpl::check_dead_nodes(const Configuration& conf, int64_t now_ms) {
-    std::vector<PeerId> peers;
-    conf.list_peers(&peers);
-    size_t alive_count = 0;
-    Configuration dead_nodes;  // for easily print
-    for (size_t i = 0; i < peers.size(); i++) {
-        if (peers[i] == _server_id) {
-            ++alive_count;
-            continue;
-        }
+private:
+    brpc::Controller* _cntl;
+    ReadIndexResponse* _response;
+    google::protobuf::Closure* _done;
+};
 
-        if (now_ms - _replicator_group.last_rpc_send_timestamp(peers[i])
-                <= _options.election_timeout_ms) {
-            ++alive_count;
-            continue;
+// Waits for the read index got from the leader for the reads of a follower
+class FollowerReadIndexDone : public google::protobuf::Closure {
+public:
+    explicit FollowerReadIndexDone(NodeImpl* node) : _node(node) {
+        _node->AddRef();
+    }
+    ~FollowerReadIndexDone() { _node->Release(); }
+
+    void Run() {
+        for (size_t i = 0; i < reads.size(); ++i) {
+            if (cntl.Failed()) {
+                reads[i]->status().set_error(
+                        cntl.ErrorCode(), "Fail to get the read index from "
+                        "the leader, %s", cntl.ErrorText().c_str());
+                run_closure_in_bthread(reads[i]);
+            } else {
+                _node->_fsm_caller->wait_applied(response.index(), reads[i]);
+            }
         }
-        dead_nodes.add_peer(peers[i]);
+        delete this;
     }
-    if (alive_count >= peers.size() / 2 + 1) {
+
+    brpc::Controller cntl;
+    ReadIndexRequest request;
+    ReadIndexResponse response;
+    std::vector<Closure*> reads;
+
+private:
+    NodeImpl* _node;
+};
+
+void NodeImpl::read_index(Closure* done) {
+    std::unique_lock<node_mutex_t> lck(_mutex);
+    if (_state == STATE_FOLLOWER && !_leader_id.is_empty()) {
+        // Ask the leader for the read index, and the reads within the
+        // interval share one RPC
+        _follower_reads.push_back(done);
+        if (!_follower_read_scheduled) {
+            unsafe_schedule_follower_reads();
+        }
         return;
     }
-    LOG(WARNING) << "node " << node_id()
-                 << " term " << _current_term
-                 << " steps down when alive nodes don't satisfy quorum"
-                    " dead_nodes: " << dead_nodes
-                 << " conf: " << conf;
-    butil::Status status;
-    status.set_error(ERAFTTIMEDOUT, "Majority of the group dies");
-    step_down(_current_term, false, status);
+    PendingRead read;
+    read.done = done;
+    return unsafe_leader_read_index(&lck, read);
 }
 
-void NodeImpl::handle_stepdown_timeout() {
-    BAIDU_SCOPED_LOCK(_mutex);
+void NodeImpl::handle_read_index_request(brpc::Controller* cntl,
+                                         const ReadIndexRequest* request,
+                                         ReadIndexResponse* response,
+                                         google::protobuf::Closure* done) {
+    LeaderReadIndexDone* read_done =
+            new LeaderReadIndexDone(cntl, response, done);
+    PendingRead read;
+    read.done = read_done;
+    read.index = &read_done->index;
+    // The follower waits for the read index to be applied by itself
+    read.wait_applied = false;
+    std::unique_lock<node_mutex_t> lck(_mutex);
+    return unsafe_leader_read_index(&lck, read);
+}
 
-    // check state
-    if (_state > STATE_TRANSFERRING) {
-        BRAFT_VLOG << "node " << _group_id << ":" << _server_id
-            << " term " << _current_term << " stop stepdown_timer"
-            << " state is " << state2str(_state);
+void NodeImpl::handle_get_snapshot_uri_request(
+        brpc::Controller* cntl, const GetSnapshotUriRequest* request,
+        GetSnapshotUriResponse* response, google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    if (_snapshot_executor == NULL) {
+        cntl->SetFailed(EINVAL, "Snapshot is not supported");
         return;
     }
-
-    int64_t now = butil::monotonic_time_ms();
-    check_dead_nodes(_conf.conf, now);
-    if (!_conf.old_conf.empty()) {
-        check_dead_nodes(_conf.old_conf, now);
+    SnapshotMeta meta;
+    std::string uri;
+    const int rc = _snapshot_executor->get_snapshot_uri(&meta, &uri);
+    if (rc == ENOENT) {
+        // No snapshot to copy
+        return;
     }
+    if (rc != 0) {
+        cntl->SetFailed(rc, "Fail to get the snapshot uri : %s", berror(rc));
+        return;
+    }
+    response->mutable_meta()->Swap(&meta);
+    response->set_uri(uri);
 }
 
-void NodeImpl::unsafe_register_conf_change(const Configuration& old_conf,
-                                           const Configuration& new_conf,
-                                           Closure* done) {
+void NodeImpl::unsafe_leader_read_index(std::unique_lock<node_mutex_t>* lck,
+                                        const PendingRead& read) {
     if (_state != STATE_LEADER) {
-        LOG(WARNING) << "[" << node_id()
-                     << "] Refusing configuration changing because the state is "
-                     << state2str(_state) ;
-        if (done) {
-            if (_state == STATE_TRANSFERRING) {
-                done->status().set_error(EBUSY, "Is transferring leadership");
-            } else {
-                done->status().set_error(EPERM, "Not leader");
-            }
-            run_closure_in_bthread(done);
-        }
+        lck->unlock();
+        read.done->status().set_error(EPERM, "Not leader");
+        return run_closure_in_bthread(read.done);
+    }
+    // The committed index of a new leader is unknown until it commits a log
+    // of its own term
+    const int64_t committed_index = _ballot_box->last_committed_index();
+    if (_log_manager->get_term(committed_index) != _current_term) {
+        lck->unlock();
+        read.done->status().set_error(EAGAIN, "Leader hasn't committed any "
+                                      "log of term %" PRId64 " yet",
+                                      _current_term);
+        return run_closure_in_bthread(read.done);
+    }
+    if (unsafe_leader_lease_valid(butil::monotonic_time_ms())) {
+        lck->unlock();
+        g_lease_reads << 1;
+        return finish_read(_fsm_caller, read, committed_index);
+    }
+    _pending_reads.push_back(read);
+    // Reads arriving during a round share the next one
+    if (_read_index_in_flight) {
         return;
     }
+    ReadIndexRound* round = unsafe_start_read_index_round();
+    lck->unlock();
+    if (round) {
+        round->release();
+    }
+}
 
-    // check concurrent conf change
-    if (_conf_ctx.is_busy()) {
-        LOG(WARNING) << "[" << node_id()
-                     << " ] Refusing concurrent configuration changing";
-        if (done) {
-            done->status().set_error(EBUSY, "Doing another configuration change");
-            run_closure_in_bthread(done);
+ReadIndexRound* NodeImpl::unsafe_start_read_index_round() {
+    ReadIndexRound* round = new ReadIndexRound(
+            this, _current_term, _ballot_box->last_committed_index());
+    round->reads()->swap(_pending_reads);
+    round->init(_conf, _server_id);
+    if (round->granted()) {
+        // This node is the only voter
+        round->on_confirmed(_fsm_caller);
+        delete round;
+        Release();
+        return NULL;
+    }
+    _read_index_in_flight = true;
+    std::set<PeerId> peers;
+    _conf.list_peers(&peers);
+    for (std::set<PeerId>::const_iterator
+            iter = peers.begin(); iter != peers.end(); ++iter) {
+        if (*iter == _server_id) {
+            continue;
+        }
+        ReadIndexHeartbeatDone* done = new ReadIndexHeartbeatDone(round, *iter);
+        if (_replicator_group.send_heartbeat(*iter, &done->cntl, &done->request,
+                                             &done->response, done) != 0) {
+            // Not acked, the last reference is held by the caller
+            round->release();
+            delete done;
         }
-        return;
     }
+    return round;
+}
 
-    // Return immediately when the new peers equals to current configuration
-    if (_conf.conf.equals(new_conf)) {
-        run_closure_in_bthread(done);
-        return;
+void NodeImpl::on_read_index_round_done() {
+    ReadIndexRound* round = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _read_index_in_flight = false;
+        if (_state == STATE_LEADER && !_pending_reads.empty()) {
+            round = unsafe_start_read_index_round();
+        }
+    }
+    if (round) {
+        round->release();
     }
+}
 
-    return _conf_ctx.start(old_conf, new_conf, done);
+void NodeImpl::fail_pending_reads(const butil::Status& status) {
+    for (size_t i = 0; i < _pending_reads.size(); ++i) {
+        _pending_reads[i].done->status().set_error(
+                EPERM, "Leader stepped down: %s", status.error_cstr());
+        run_closure_in_bthread(_pending_reads[i].done);
+    }
+    _pending_reads.clear();
 }
 
-butil::Status NodeImpl::list_peers(std::vector<PeerId>* peers) {
-    BAIDU_SCOPED_LOCK(_mutex);
-    if (_state != STATE_LEADER) {
-        return butil::Status(EPERM, "Not leader");
+void NodeImpl::unsafe_schedule_follower_reads() {
+    _follower_read_scheduled = true;
+    AddRef();  // Released in send_follower_reads
+    bthread_timer_t timer;
+    if (bthread_timer_add(&timer, butil::milliseconds_from_now(
+                                FLAGS_raft_follower_read_interval_ms),
+                          on_follower_reads_timer, this) == 0) {
+        return;
+    }
+    LOG(ERROR) << "Fail to add timer";
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, send_follower_reads, this) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        _follower_read_scheduled = false;
+        for (size_t i = 0; i < _follower_reads.size(); ++i) {
+            _follower_reads[i]->status().set_error(EAGAIN,
+                                                   "Fail to start bthread");
+            run_closure_in_bthread(_follower_reads[i]);
+        }
+        _follower_reads.clear();
+        Release();
     }
-    _conf.conf.list_peers(peers);
-    return butil::Status::OK();
 }
 
-void NodeImpl::add_peer(const PeerId& peer, Closure* done) {
-    BAIDU_SCOPED_LOCK(_mutex);
-    Configuration new_conf = _conf.conf;
-    new_conf.add_peer(peer);
-    return unsafe_register_conf_change(_conf.conf, new_conf, done);
+void NodeImpl::on_follower_reads_timer(void* arg) {
+    // Don't send RPC in the timer thread
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, send_follower_reads, arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        send_follower_reads(arg);
+    }
 }
 
-void NodeImpl::remove_peer(const PeerId& peer, Closure* done) {
+void* NodeImpl::send_follower_reads(void* arg) {
+    NodeImpl* node = (NodeImpl*)arg;
+    FollowerReadIndexDone* done = new FollowerReadIndexDone(node);
+    PeerId leader_id;
+    {
+        BAIDU_SCOPED_LOCK(node->_mutex);
+        node->_follower_read_scheduled = false;
+        done->reads.swap(node->_follower_reads);
+        leader_id = node->_leader_id;
+    }
+    node->Release();
+    if (leader_id.is_empty()) {
+        done->cntl.SetFailed(EPERM, "Unknown leader");
+        done->Run();
+        return NULL;
+    }
+    brpc::ChannelOptions options;
+    options.timeout_ms = node->_options.election_timeout_ms;
+    brpc::Channel channel;
+    if (init_peer_channel(&channel, leader_id.addr, &options) != 0) {
+        done->cntl.SetFailed(EINVAL, "Fail to init channel to %s",
+                             leader_id.to_string().c_str());
+        done->Run();
+        return NULL;
+    }
+    done->request.set_group_id(node->_group_id);
+    done->request.set_server_id(node->_server_id.to_string());
+    done->request.set_peer_id(leader_id.to_string());
+    RaftService_Stub stub(&channel);
+    stub.read_index(&done->cntl, &done->request, &done->response, done);
+    return NULL;
+}
+
+butil::Status NodeImpl::set_relay(const PeerId& peer, const PeerId& relay) {
+    if (peer.is_empty() || peer == relay) {
+        return butil::Status(EINVAL, "Invalid relay %s of %s",
+                             relay.to_string().c_str(),
+                             peer.to_string().c_str());
+    }
     BAIDU_SCOPED_LOCK(_mutex);
-    Configuration new_conf = _conf.conf;
-    new_conf.remove_peer(peer);
-    return unsafe_register_conf_change(_conf.conf, new_conf, done);
+    if (relay == _server_id) {
+        return butil::Status(EINVAL, "Fail to relay through self");
+    }
+    _replicator_group.set_relay(peer, relay);
+    return butil::Status::OK();
 }
 
-void NodeImpl::change_peers(const Configuration& new_peers, Closure* done) {
+butil::Status NodeImpl::set_snapshot_donor(const PeerId& peer,
+                                           const PeerId& donor) {
+    if (peer.is_empty() || peer == donor) {
+        return butil::Status(EINVAL, "Invalid snapshot donor %s of %s",
+                             donor.to_string().c_str(),
+                             peer.to_string().c_str());
+    }
     BAIDU_SCOPED_LOCK(_mutex);
-    return unsafe_register_conf_change(_conf.conf, new_peers, done);
+    if (donor == _server_id) {
+        return butil::Status(EINVAL, "The leader is the default donor");
+    }
+    _replicator_group.set_snapshot_donor(peer, donor);
+    return butil::Status::OK();
 }
 
 butil::Status NodeImpl::reset_peers(const Configuration& new_peers) {
@@ -969,7 +2189,7 @@ void NodeImpl::join() {
 }
 
 void NodeImpl::handle_election_timeout() {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
 
     // check state
     if (_state != STATE_FOLLOWER) {
@@ -977,9 +2197,13 @@ void NodeImpl::handle_election_timeout() {
     }
 
     // check timestamp, skip one cycle check when trigger vote
+    int64_t election_timeout_ms = unsafe_election_timeout_ms();
+    if (_hibernating.load(butil::memory_order_relaxed)) {
+        election_timeout_ms += 2L * FLAGS_raft_hibernate_heartbeat_interval_ms;
+    }
     if (!_vote_triggered &&
             (butil::monotonic_time_ms() - _last_leader_timestamp) 
-            < _options.election_timeout_ms) {
+            < election_timeout_ms) {
         return;
     }
     _vote_triggered = false;
@@ -1000,7 +2224,7 @@ void NodeImpl::handle_timeout_now_request(brpc::Controller* controller,
                                           TimeoutNowResponse* response,
                                           google::protobuf::Closure* done) {
     brpc::ClosureGuard done_guard(done);
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     if (request->term() != _current_term) {
         const int64_t saved_current_term = _current_term;
         if (request->term() > _current_term) {
@@ -1037,7 +2261,7 @@ void NodeImpl::handle_timeout_now_request(brpc::Controller* controller,
     response->set_success(true);
     // Parallelize Response and election
     run_closure_in_bthread(done_guard.release());
-    elect_self(&lck);
+    elect_self(&lck, true);
     // Don't touch any mutable field after this point, it's likely out of the
     // critical section
     if (lck.owns_lock()) {
@@ -1087,7 +2311,7 @@ void NodeImpl::handle_transfer_timeout(int64_t term, const PeerId& peer) {
 }
 
 int NodeImpl::transfer_leadership_to(const PeerId& peer) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     if (_state != STATE_LEADER) {
         LOG(WARNING) << "node " << _group_id << ":" << _server_id
                      << " is in state " << state2str(_state);
@@ -1134,6 +2358,11 @@ int NodeImpl::transfer_leadership_to(const PeerId& peer) {
                      << " which doesn't belong to " << _conf.conf;
         return EINVAL;
     }
+    if (_replicator_group.is_witness(peer_id)) {
+        LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                     << " refused to transfer leadership to witness " << peer_id;
+        return EINVAL;
+    }
     const int64_t last_log_index = _log_manager->last_log_index();
     const int rc = _replicator_group.transfer_leadership_to(peer_id, last_log_index);
     if (rc != 0) {
@@ -1161,7 +2390,7 @@ int NodeImpl::transfer_leadership_to(const PeerId& peer) {
 }
 
 void NodeImpl::vote(int election_timeout) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     _options.election_timeout_ms = election_timeout;
     _replicator_group.reset_heartbeat_interval(
             heartbeat_timeout(_options.election_timeout_ms));
@@ -1177,7 +2406,7 @@ void NodeImpl::vote(int election_timeout) {
 }
 
 void NodeImpl::reset_election_timeout_ms(int election_timeout_ms) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     _options.election_timeout_ms = election_timeout_ms;
     _replicator_group.reset_heartbeat_interval(
             heartbeat_timeout(_options.election_timeout_ms));
@@ -1196,7 +2425,7 @@ void NodeImpl::on_error(const Error& e) {
         // on_error of _fsm_caller is guaranteed to be executed once.
         _fsm_caller->on_error(e);
     }
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     // if it is leader, need to wake up a new one.
     // if it is follower, also step down to call on_stop_following
     if (_state <= STATE_FOLLOWER) {
@@ -1211,7 +2440,7 @@ void NodeImpl::on_error(const Error& e) {
 }
 
 void NodeImpl::handle_vote_timeout() {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
 
     // check state
     if (_state != STATE_CANDIDATE) {
@@ -1309,7 +2538,7 @@ struct OnRequestVoteRPCDone : public google::protobuf::Closure {
 
 void NodeImpl::handle_pre_vote_response(const PeerId& peer_id, const int64_t term,
                                             const RequestVoteResponse& response) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
 
     // check state
     if (_state != STATE_FOLLOWER) {
@@ -1379,7 +2608,7 @@ struct OnPreVoteRPCDone : public google::protobuf::Closure {
     NodeImpl* node;
 };
 
-void NodeImpl::pre_vote(std::unique_lock<raft_mutex_t>* lck) {
+void NodeImpl::pre_vote(std::unique_lock<node_mutex_t>* lck) {
     LOG(INFO) << "node " << _group_id << ":" << _server_id
               << " term " << _current_term << " start pre_vote";
     if (_snapshot_executor && _snapshot_executor->is_installing_snapshot()) {
@@ -1394,6 +2623,14 @@ void NodeImpl::pre_vote(std::unique_lock<raft_mutex_t>* lck) {
                      << " can't do pre_vote as it is not in " << _conf.conf;
         return;
     }
+    if (_options.witness) {
+        BRAFT_VLOG << "node " << _group_id << ':' << _server_id
+                   << " doesn't do pre_vote as it is a witness";
+        return;
+    }
+    if (!FLAGS_raft_enable_pre_vote) {
+        return elect_self(lck);
+    }
 
     int64_t old_term = _current_term;
     // get last_log_id outof node mutex
@@ -1415,16 +2652,6 @@ void NodeImpl::pre_vote(std::unique_lock<raft_mutex_t>* lck) {
         if (*iter == _server_id) {
             continue;
         }
-        brpc::ChannelOptions options;
-        options.connection_type = brpc::CONNECTION_TYPE_SINGLE;
-        options.max_retry = 0;
-        brpc::Channel channel;
-        if (0 != channel.Init(iter->addr, &options)) {
-            LOG(WARNING) << "node " << _group_id << ":" << _server_id
-                         << " channel init failed, addr " << iter->addr;
-            continue;
-        }
-
         OnPreVoteRPCDone* done = new OnPreVoteRPCDone(*iter, _current_term, this);
         done->cntl.set_timeout_ms(_options.election_timeout_ms);
         done->request.set_group_id(_group_id);
@@ -1434,6 +2661,25 @@ void NodeImpl::pre_vote(std::unique_lock<raft_mutex_t>* lck) {
         done->request.set_last_log_index(last_log_id.index);
         done->request.set_last_log_term(last_log_id.term);
 
+        if (FLAGS_raft_enable_multi_vote) {
+            VoteAggregator::pre_vote_aggregator()->send(
+                    _server_id.addr, iter->addr, _control_connection_group,
+                    &done->cntl,
+                    &done->request, &done->response, done);
+            continue;
+        }
+        brpc::ChannelOptions options;
+        options.connection_type = brpc::CONNECTION_TYPE_SINGLE;
+        options.connection_group = _control_connection_group;
+        options.max_retry = 0;
+        brpc::Channel channel;
+        if (0 != init_peer_channel(&channel, iter->addr, &options)) {
+            LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                         << " channel init failed, addr " << iter->addr;
+            delete done;
+            continue;
+        }
+
         RaftService_Stub stub(&channel);
         stub.pre_vote(&done->cntl, &done->request, &done->response, done);
     }
@@ -1445,7 +2691,8 @@ void NodeImpl::pre_vote(std::unique_lock<raft_mutex_t>* lck) {
 }
 
 // in lock
-void NodeImpl::elect_self(std::unique_lock<raft_mutex_t>* lck) {
+void NodeImpl::elect_self(std::unique_lock<node_mutex_t>* lck,
+                          bool leadership_transfer) {
     LOG(INFO) << "node " << _group_id << ":" << _server_id
               << " term " << _current_term << " start vote and grant vote self";
     if (!_conf.contains(_server_id)) {
@@ -1453,6 +2700,11 @@ void NodeImpl::elect_self(std::unique_lock<raft_mutex_t>* lck) {
                      << " can't do elect_self as it is not in " << _conf.conf;
         return;
     }
+    if (_options.witness) {
+        LOG(WARNING) << "node " << _group_id << ':' << _server_id
+                     << " can't do elect_self as it is a witness";
+        return;
+    }
     // cancel follower election timer
     if (_state == STATE_FOLLOWER) {
         BRAFT_VLOG << "node " << _group_id << ":" << _server_id
@@ -1497,16 +2749,6 @@ void NodeImpl::elect_self(std::unique_lock<raft_mutex_t>* lck) {
         if (*iter == _server_id) {
             continue;
         }
-        brpc::ChannelOptions options;
-        options.connection_type = brpc::CONNECTION_TYPE_SINGLE;
-        options.max_retry = 0;
-        brpc::Channel channel;
-        if (0 != channel.Init(iter->addr, &options)) {
-            LOG(WARNING) << "node " << _group_id << ":" << _server_id
-                         << " channel init failed, addr " << iter->addr;
-            continue;
-        }
-
         OnRequestVoteRPCDone* done = new OnRequestVoteRPCDone(*iter, _current_term, this);
         done->cntl.set_timeout_ms(_options.election_timeout_ms);
         done->request.set_group_id(_group_id);
@@ -1515,6 +2757,28 @@ void NodeImpl::elect_self(std::unique_lock<raft_mutex_t>* lck) {
         done->request.set_term(_current_term);
         done->request.set_last_log_index(last_log_id.index);
         done->request.set_last_log_term(last_log_id.term);
+        if (leadership_transfer) {
+            done->request.set_leadership_transfer(true);
+        }
+
+        if (FLAGS_raft_enable_multi_vote) {
+            VoteAggregator::request_vote_aggregator()->send(
+                    _server_id.addr, iter->addr, _control_connection_group,
+                    &done->cntl,
+                    &done->request, &done->response, done);
+            continue;
+        }
+        brpc::ChannelOptions options;
+        options.connection_type = brpc::CONNECTION_TYPE_SINGLE;
+        options.connection_group = _control_connection_group;
+        options.max_retry = 0;
+        brpc::Channel channel;
+        if (0 != init_peer_channel(&channel, iter->addr, &options)) {
+            LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                         << " channel init failed, addr " << iter->addr;
+            delete done;
+            continue;
+        }
 
         RaftService_Stub stub(&channel);
         stub.request_vote(&done->cntl, &done->request, &done->response, done);
@@ -1545,8 +2809,10 @@ void NodeImpl::step_down(const int64_t term, bool wakeup_a_candidate,
         _vote_timer.stop();
     } else if (_state <= STATE_TRANSFERRING) {
         _stepdown_timer.stop();
+        _log_manager->set_retained_index(0);
 
         _ballot_box->clear_pending_tasks();
+        _entry_tracer.reset();
 
         // signal fsm leader stop immediately
         if (_state  == STATE_LEADER) {
@@ -1562,7 +2828,9 @@ void NodeImpl::step_down(const int64_t term, bool wakeup_a_candidate,
     _state = STATE_FOLLOWER;
     // _conf_ctx.reset() will stop replicators of catching up nodes
     _conf_ctx.reset();
+    fail_pending_reads(status);
     _last_leader_timestamp = butil::monotonic_time_ms();
+    _hibernating.store(false, butil::memory_order_relaxed);
     _majority_nodes_readonly = false;
 
     clear_append_entries_cache();
@@ -1657,6 +2925,12 @@ void NodeImpl::become_leader() {
 
     _state = STATE_LEADER;
     _leader_id = _server_id;
+    _hibernating.store(false, butil::memory_order_relaxed);
+    _last_active_ms = butil::monotonic_time_ms();
+    // The timeout learned as a follower is derived from the RTT measured by
+    // the previous leader, while the replicators heartbeat at the interval
+    // of the configured timeout until the RTT is measured again
+    _adaptive_election_timeout_ms.store(0, butil::memory_order_relaxed);
 
     _replicator_group.reset_term(_current_term);
 
@@ -1674,6 +2948,13 @@ void NodeImpl::become_leader() {
         //TODO: check return code
         _replicator_group.add_replicator(*iter);
     }
+    for (Configuration::const_iterator
+            iter = _conf.learners.begin(); iter != _conf.learners.end(); ++iter) {
+        BRAFT_VLOG << "node " << _group_id << ":" << _server_id
+                   << " term " << _current_term
+                   << " add replicator to learner " << *iter;
+        _replicator_group.add_replicator(*iter);
+    }
 
     // init commit manager
     _ballot_box->reset_pending_index(_log_manager->last_log_index() + 1);
@@ -1691,23 +2972,32 @@ public:
 private:
     LeaderStableClosure(const NodeId& node_id,
                         size_t nentries,
-                        BallotBox* ballot_box);
+                        BallotBox* ballot_box,
+                        EntryTracer* tracer);
     ~LeaderStableClosure() {}
 friend class NodeImpl;
     NodeId _node_id;
     size_t _nentries;
     BallotBox* _ballot_box;
+    EntryTracer* _tracer;
 };
 
 LeaderStableClosure::LeaderStableClosure(const NodeId& node_id,
                                          size_t nentries,
-                                         BallotBox* ballot_box)
+                                         BallotBox* ballot_box,
+                                         EntryTracer* tracer)
     : _node_id(node_id), _nentries(nentries), _ballot_box(ballot_box)
+    , _tracer(tracer)
 {
 }
 
 void LeaderStableClosure::Run() {
     if (status().ok()) {
+        if (_tracer && !_tracer->empty()) {
+            _tracer->on_stable(_first_log_index,
+                               _first_log_index + _nentries - 1,
+                               _flush_start_us);
+        }
         if (_ballot_box) {
             // ballot_box check quorum ok, will call fsm_caller
             _ballot_box->commit_at(
@@ -1725,7 +3015,7 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
 
     std::vector<LogEntry*> entries;
     entries.reserve(size);
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     bool reject_new_user_logs = (_node_readonly || _majority_nodes_readonly);
     if (_state != STATE_LEADER || reject_new_user_logs) {
         butil::Status st;
@@ -1747,6 +3037,11 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
         }
         return;
     }
+    unsafe_wake_up(butil::monotonic_time_ms());
+    std::vector<LogEntryAndClosure> coalesced;
+    size_t coalesced_bytes = 0;
+    // Positions in |entries| of the traced tasks and their start time
+    std::vector<std::pair<size_t, int64_t> > traced;
     for (size_t i = 0; i < size; ++i) {
         if (tasks[i].expected_term != -1 && tasks[i].expected_term != _current_term) {
             BRAFT_VLOG << "node " << _group_id << ":" << _server_id
@@ -1761,27 +3056,120 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
             tasks[i].entry->Release();
             continue;
         }
-        entries.push_back(tasks[i].entry);
-        entries.back()->id.term = _current_term;
-        entries.back()->type = ENTRY_TYPE_DATA;
-        _ballot_box->append_pending_task(_conf.conf,
-                                         _conf.stable() ? NULL : &_conf.old_conf,
-                                         tasks[i].done);
+        const size_t bytes = tasks[i].entry->data.size();
+        // Partition keys are not kept in ENTRY_TYPE_DATA_BATCH, and the
+        // traced tasks keep their own logs
+        if (FLAGS_raft_coalesce_tasks &&
+                tasks[i].entry->type != ENTRY_TYPE_PARTITIONED_DATA &&
+                tasks[i].trace_start_us == 0 &&
+                bytes < (size_t)FLAGS_raft_coalesce_max_bytes) {
+            coalesced.push_back(tasks[i]);
+            coalesced_bytes += bytes;
+            if (coalesced_bytes >= (size_t)FLAGS_raft_coalesce_max_bytes) {
+                unsafe_append_coalesced_tasks(&coalesced, &entries);
+                coalesced_bytes = 0;
+            }
+            continue;
+        }
+        // Keep the order of the tasks
+        unsafe_append_coalesced_tasks(&coalesced, &entries);
+        coalesced_bytes = 0;
+        unsafe_append_task(tasks[i], &entries);
+        if (tasks[i].trace_start_us != 0) {
+            traced.push_back(std::make_pair(entries.size() - 1,
+                                            tasks[i].trace_start_us));
+        }
+    }
+    unsafe_append_coalesced_tasks(&coalesced, &entries);
+    if (!traced.empty()) {
+        // Only the leader appends logs, so |entries| follow the last log
+        const int64_t first_index = _log_manager->last_log_index() + 1;
+        for (size_t i = 0; i < traced.size(); ++i) {
+            _entry_tracer.on_appended(first_index + traced[i].first,
+                                      traced[i].second);
+        }
     }
     _log_manager->append_entries(&entries,
                                new LeaderStableClosure(
                                         NodeId(_group_id, _server_id),
                                         entries.size(),
-                                        _ballot_box));
+                                        _ballot_box, &_entry_tracer));
     // update _conf.first
     _log_manager->check_and_set_configuration(&_conf);
 }
 
+void NodeImpl::unsafe_append_task(const LogEntryAndClosure& task,
+                                  std::vector<LogEntry*>* entries) {
+    entries->push_back(task.entry);
+    entries->back()->id.term = _current_term;
+    if (entries->back()->type != ENTRY_TYPE_PARTITIONED_DATA) {
+        entries->back()->type = ENTRY_TYPE_DATA;
+    }
+    _ballot_box->append_pending_task(_conf.conf,
+                                     _conf.stable() ? NULL : &_conf.old_conf,
+                                     task.done);
+}
+
+void NodeImpl::unsafe_append_coalesced_tasks(
+        std::vector<LogEntryAndClosure>* tasks,
+        std::vector<LogEntry*>* entries) {
+    if (tasks->size() <= 1) {
+        if (!tasks->empty()) {
+            unsafe_append_task(tasks->front(), entries);
+        }
+        tasks->clear();
+        return;
+    }
+    LogEntry* entry = new LogEntry;
+    if (entry == NULL) {
+        // Append the tasks one by one, their entries are allocated already
+        for (size_t i = 0; i < tasks->size(); ++i) {
+            unsafe_append_task((*tasks)[i], entries);
+        }
+        tasks->clear();
+        return;
+    }
+    entry->AddRef();
+    entry->id.term = _current_term;
+    entry->type = ENTRY_TYPE_DATA_BATCH;
+    std::vector<butil::IOBuf*> datas;
+    std::vector<Closure*> dones;
+    bool has_done = false;
+    for (size_t i = 0; i < tasks->size(); ++i) {
+        datas.push_back(&(*tasks)[i].entry->data);
+        dones.push_back((*tasks)[i].done);
+        has_done = has_done || (*tasks)[i].done != NULL;
+    }
+    serialize_data_batch(datas, &entry->data);
+    for (size_t i = 0; i < tasks->size(); ++i) {
+        (*tasks)[i].entry->Release();
+    }
+    g_coalesced_tasks << tasks->size();
+    tasks->clear();
+    entries->push_back(entry);
+    TaskBatchClosure* batch_done = NULL;
+    if (has_done) {
+        batch_done = new TaskBatchClosure(&dones, _options.usercode_in_pthread);
+    }
+    _ballot_box->append_pending_task(_conf.conf,
+                                     _conf.stable() ? NULL : &_conf.old_conf,
+                                     batch_done);
+}
+
 void NodeImpl::unsafe_apply_configuration(const Configuration& new_conf,
                                           const Configuration* old_conf,
                                           bool leader_start) {
     CHECK(_conf_ctx.is_busy());
+    unsafe_wake_up(butil::monotonic_time_ms());
     LogEntry* entry = new LogEntry();
+    if (entry == NULL) {
+        butil::Status status(ENOMEM, "Fail to allocate configuration entry");
+        if (leader_start) {
+            // The leader can't commit anything of its term without the entry
+            return step_down(_current_term, false, status);
+        }
+        return _conf_ctx.reset(&status);
+    }
     entry->AddRef();
     entry->id.term = _current_term;
     entry->type = ENTRY_TYPE_CONFIGURATION;
@@ -1791,6 +3179,12 @@ void NodeImpl::unsafe_apply_configuration(const Configuration& new_conf,
         entry->old_peers = new std::vector<PeerId>;
         old_conf->list_peers(entry->old_peers);
     }
+    std::vector<PeerId> learners;
+    _conf_ctx.list_new_learners(&learners);
+    if (!learners.empty()) {
+        entry->learners = new std::vector<PeerId>;
+        entry->learners->swap(learners);
+    }
     ConfigurationChangeDone* configuration_change_done =
             new ConfigurationChangeDone(this, _current_term, leader_start);
     // Use the new_conf to deal the quorum of this very log
@@ -1801,13 +3195,13 @@ void NodeImpl::unsafe_apply_configuration(const Configuration& new_conf,
     _log_manager->append_entries(&entries,
                                  new LeaderStableClosure(
                                         NodeId(_group_id, _server_id),
-                                        1u, _ballot_box));
+                                        1u, _ballot_box, &_entry_tracer));
     _log_manager->check_and_set_configuration(&_conf);
 }
 
 int NodeImpl::handle_pre_vote_request(const RequestVoteRequest* request,
                                       RequestVoteResponse* response) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     
     if (!is_active_state(_state)) {
         const int64_t saved_current_term = _current_term;
@@ -1827,6 +3221,9 @@ int NodeImpl::handle_pre_vote_request(const RequestVoteRequest* request,
                      << " server_id bad format";
         return EINVAL;
     }
+    // The candidate misses the leader, which is either dead or hibernating.
+    // Either way the group should be woken up.
+    unsafe_wake_up(butil::monotonic_time_ms());
 
     bool granted = false;
     do {
@@ -1839,6 +3236,14 @@ int NodeImpl::handle_pre_vote_request(const RequestVoteRequest* request,
             break;
         }
 
+        if (unsafe_in_leader_lease(butil::monotonic_time_ms())) {
+            LOG(INFO) << "node " << _group_id << ":" << _server_id
+                      << " refuse PreVote from " << request->server_id()
+                      << " in term " << request->term()
+                      << " as the leader lease is valid";
+            break;
+        }
+
         // get last_log_id outof node mutex
         lck.unlock();
         LogId last_log_id = _log_manager->last_log_id(true);
@@ -1863,7 +3268,7 @@ int NodeImpl::handle_pre_vote_request(const RequestVoteRequest* request,
 
 int NodeImpl::handle_request_vote_request(const RequestVoteRequest* request,
                                           RequestVoteResponse* response) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
 
     if (!is_active_state(_state)) {
         const int64_t saved_current_term = _current_term;
@@ -1885,6 +3290,16 @@ int NodeImpl::handle_request_vote_request(const RequestVoteRequest* request,
     }
 
     do {
+        // Refuse before stepping down to the term of the candidate, so that
+        // the leader holding the lease is not disturbed
+        if (!request->leadership_transfer() &&
+                unsafe_in_leader_lease(butil::monotonic_time_ms())) {
+            LOG(INFO) << "node " << _group_id << ":" << _server_id
+                      << " refuse RequestVote from " << request->server_id()
+                      << " in term " << request->term()
+                      << " as the leader lease is valid";
+            break;
+        }
         // check term
         if (request->term() >= _current_term) {
             LOG(INFO) << "node " << _group_id << ":" << _server_id
@@ -1937,6 +3352,21 @@ int NodeImpl::handle_request_vote_request(const RequestVoteRequest* request,
     return 0;
 }
 
+// Report the leaders held by the server at |addr| to the leader
+static void set_server_leader_load(const butil::EndPoint& addr,
+                                   AppendEntriesResponse* response) {
+    if (!FLAGS_raft_enable_leader_balance) {
+        return;
+    }
+    int leader_count = 0;
+    int weight = 0;
+    if (LeaderBalancer::get_instance()->get_load(
+                addr, &leader_count, &weight) == 0) {
+        response->set_server_leader_count(leader_count);
+        response->set_server_leader_weight(weight);
+    }
+}
+
 class FollowerStableClosure : public LogManager::StableClosure {
 public:
     FollowerStableClosure(
@@ -1972,7 +3402,7 @@ private:
                              status().error_cstr());
             return;
         }
-        std::unique_lock<raft_mutex_t> lck(_node->_mutex);
+        std::unique_lock<node_mutex_t> lck(_node->_mutex);
         if (_term != _node->_current_term) {
             // The change of term indicates that leader has been changed during
             // appending entries, so we can't respond ok to the old leader
@@ -1993,6 +3423,11 @@ private:
             _response->set_term(_node->_current_term);
             return;
         }
+        _response->set_backlog_bytes(_node->_log_manager->memory_bytes());
+        _response->set_attachment_compress_supported(true);
+        _response->set_packed_entries_supported(true);
+        _response->set_election_priority(_node->_options.election_priority);
+        set_server_leader_load(_node->_server_id.addr, _response);
         // It's safe to release lck as we know everything is ok at this point.
         lck.unlock();
 
@@ -2021,15 +3456,111 @@ private:
     int64_t _term;
 };
 
+class LogEntriesGuard {
+public:
+    explicit LogEntriesGuard(std::vector<LogEntry*>* entries)
+        : _entries(entries) {}
+    ~LogEntriesGuard() {
+        for (size_t i = 0; i < _entries->size(); ++i) {
+            (*_entries)[i]->Release();
+        }
+        _entries->clear();
+    }
+private:
+    DISALLOW_COPY_AND_ASSIGN(LogEntriesGuard);
+    std::vector<LogEntry*>* _entries;
+};
+
+int NodeImpl::parse_append_entries(brpc::Controller* cntl,
+                                   const AppendEntriesRequest* request,
+                                   std::vector<LogEntry*>* entries) {
+    butil::IOBuf data_buf;
+    if (request->attachment_compress_type() != COMPRESS_NONE) {
+        if (!decompress_data(request->attachment_compress_type(),
+                             cntl->request_attachment(), &data_buf)) {
+            LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                         << " fail to decompress AppendEntries from "
+                         << request->server_id();
+            cntl->SetFailed(EINVAL, "Fail to decompress attachment");
+            return -1;
+        }
+    } else {
+        // Share the blocks rather than taking the attachment, which is
+        // parsed again if the request is cached as out-of-order
+        data_buf = cntl->request_attachment();
+    }
+    entries->reserve(request->entries_size());
+    int64_t index = request->prev_log_index();
+    for (int i = 0; i < request->entries_size(); i++) {
+        index++;
+        const EntryMeta& entry = request->entries(i);
+        if (entry.type() != ENTRY_TYPE_UNKNOWN) {
+            LogEntry* log_entry = new LogEntry();
+            if (log_entry == NULL) {
+                cntl->SetFailed(ENOMEM, "Fail to allocate log entry");
+                return -1;
+            }
+            log_entry->AddRef();
+            log_entry->id.term = entry.term();
+            log_entry->id.index = index;
+            log_entry->type = (EntryType)entry.type();
+            if (entry.peers_size() > 0) {
+                log_entry->peers = new std::vector<PeerId>;
+                for (int i = 0; i < entry.peers_size(); i++) {
+                    log_entry->peers->push_back(entry.peers(i));
+                }
+                CHECK_EQ(log_entry->type, ENTRY_TYPE_CONFIGURATION);
+                if (entry.old_peers_size() > 0) {
+                    log_entry->old_peers = new std::vector<PeerId>;
+                    for (int i = 0; i < entry.old_peers_size(); i++) {
+                        log_entry->old_peers->push_back(entry.old_peers(i));
+                    }
+                }
+                if (entry.learners_size() > 0) {
+                    log_entry->learners = new std::vector<PeerId>;
+                    for (int i = 0; i < entry.learners_size(); i++) {
+                        log_entry->learners->push_back(entry.learners(i));
+                    }
+                }
+            } else {
+                CHECK_NE(entry.type(), ENTRY_TYPE_CONFIGURATION);
+            }
+            if (entry.has_data_len()) {
+                int len = entry.data_len();
+                data_buf.cutn(&log_entry->data, len);
+            }
+            entries->push_back(log_entry);
+        }
+    }
+    return 0;
+}
+
 void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
                                              const AppendEntriesRequest* request,
                                              AppendEntriesResponse* response,
                                              google::protobuf::Closure* done,
                                              bool from_append_entries_cache) {
     std::vector<LogEntry*> entries;
-    entries.reserve(request->entries_size());
     brpc::ClosureGuard done_guard(done);
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    // Parse the request before locking _mutex, which is shared with votes,
+    // timers and status queries
+    PeerId server_id;
+    if (0 != server_id.parse(request->server_id())) {
+        LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                     << " received AppendEntries from " << request->server_id()
+                     << " server_id bad format";
+        cntl->SetFailed(brpc::EREQUEST,
+                        "Fail to parse server_id `%s'",
+                        request->server_id().c_str());
+        return;
+    }
+    // Entries not taken by LogManager are released at return
+    LogEntriesGuard entries_guard(&entries);
+    if (request->entries_size() > 0 &&
+            parse_append_entries(cntl, request, &entries) != 0) {
+        return;
+    }
+    std::unique_lock<node_mutex_t> lck(_mutex);
 
     // pre set term, to avoid get term in lock
     response->set_term(_current_term);
@@ -2046,18 +3577,6 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
         return;
     }
 
-    PeerId server_id;
-    if (0 != server_id.parse(request->server_id())) {
-        lck.unlock();
-        LOG(WARNING) << "node " << _group_id << ":" << _server_id
-                     << " received AppendEntries from " << request->server_id()
-                     << " server_id bad format";
-        cntl->SetFailed(brpc::EREQUEST,
-                        "Fail to parse server_id `%s'",
-                        request->server_id().c_str());
-        return;
-    }
-
     // check stale term
     if (request->term() < _current_term) {
         const int64_t saved_current_term = _current_term;
@@ -2092,6 +3611,15 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
         // Requests from cache already updated timestamp
         _last_leader_timestamp = butil::monotonic_time_ms();
     }
+    _max_election_priority.store(request->max_election_priority(),
+                                 butil::memory_order_relaxed);
+    _adaptive_election_timeout_ms.store(request->election_timeout_ms(),
+                                        butil::memory_order_relaxed);
+    if (request->hibernate()) {
+        _hibernating.store(true, butil::memory_order_relaxed);
+    } else if (_hibernating.load(butil::memory_order_relaxed)) {
+        unsafe_wake_up(butil::monotonic_time_ms());
+    }
 
     if (request->entries_size() > 0 &&
             (_snapshot_executor
@@ -2151,6 +3679,11 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
         response->set_term(_current_term);
         response->set_last_log_index(_log_manager->last_log_index());
         response->set_readonly(_node_readonly);
+        response->set_backlog_bytes(_log_manager->memory_bytes());
+        response->set_attachment_compress_supported(true);
+        response->set_packed_entries_supported(true);
+        response->set_election_priority(_options.election_priority);
+        set_server_leader_load(_server_id.addr, response);
         lck.unlock();
         // see the comments at FollowerStableClosure::run()
         _ballot_box->set_last_committed_index(
@@ -2159,44 +3692,10 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
         return;
     }
 
-    // Parse request
-    butil::IOBuf data_buf;
-    data_buf.swap(cntl->request_attachment());
-    int64_t index = prev_log_index;
-    for (int i = 0; i < request->entries_size(); i++) {
-        index++;
-        const EntryMeta& entry = request->entries(i);
-        if (entry.type() != ENTRY_TYPE_UNKNOWN) {
-            LogEntry* log_entry = new LogEntry();
-            log_entry->AddRef();
-            log_entry->id.term = entry.term();
-            log_entry->id.index = index;
-            log_entry->type = (EntryType)entry.type();
-            if (entry.peers_size() > 0) {
-                log_entry->peers = new std::vector<PeerId>;
-                for (int i = 0; i < entry.peers_size(); i++) {
-                    log_entry->peers->push_back(entry.peers(i));
-                }
-                CHECK_EQ(log_entry->type, ENTRY_TYPE_CONFIGURATION);
-                if (entry.old_peers_size() > 0) {
-                    log_entry->old_peers = new std::vector<PeerId>;
-                    for (int i = 0; i < entry.old_peers_size(); i++) {
-                        log_entry->old_peers->push_back(entry.old_peers(i));
-                    }
-                }
-            } else {
-                CHECK_NE(entry.type(), ENTRY_TYPE_CONFIGURATION);
-            }
-            if (entry.has_data_len()) {
-                int len = entry.data_len();
-                data_buf.cutn(&log_entry->data, len);
-            }
-            entries.push_back(log_entry);
-        }
-    }
-
+    const int64_t index = prev_log_index + request->entries_size();
     // check out-of-order cache
-    check_append_entries_cache(index);
+    butil::LinkedList<AppendEntriesRpc> runnable;
+    check_append_entries_cache(index, &runnable);
 
     FollowerStableClosure* c = new FollowerStableClosure(
             cntl, request, response, done_guard.release(),
@@ -2205,6 +3704,152 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
 
     // update configuration after _log_manager updated its memory status
     _log_manager->check_and_set_configuration(&_conf);
+    if (runnable.empty()) {
+        return;
+    }
+    lck.unlock();
+    // Handle the requests contiguous to this one right away in order, before
+    // the following requests of the pipeline arrive
+    while (!runnable.empty()) {
+        AppendEntriesRpc* rpc = runnable.head()->value();
+        rpc->RemoveFromList();
+        handle_append_entries_request(rpc->cntl, rpc->request,
+                                      rpc->response, rpc->done, true);
+        delete rpc;
+    }
+}
+
+// Returns the response of the forwarded request to the leader
+class RelayAppendEntriesDone : public google::protobuf::Closure {
+public:
+    RelayAppendEntriesDone(brpc::Controller* cntl,
+                           AppendEntriesResponse* response,
+                           google::protobuf::Closure* done)
+        : _cntl(cntl), _response(response), _done(done) {}
+
+    void Run() {
+        if (forward_cntl.Failed()) {
+            _cntl->SetFailed(forward_cntl.ErrorCode(), "%s",
+                             forward_cntl.ErrorText().c_str());
+        } else {
+            _response->Swap(&forward_response);
+        }
+        _done->Run();
+        delete this;
+    }
+
+    brpc::Channel channel;
+    brpc::Controller forward_cntl;
+    AppendEntriesRequest forward_request;
+    AppendEntriesResponse forward_response;
+
+private:
+    brpc::Controller* _cntl;
+    AppendEntriesResponse* _response;
+    google::protobuf::Closure* _done;
+};
+
+// Wakes up the relay waiting for new logs
+struct RelayLogWaiter {
+    RelayLogWaiter() : event(1), error_code(0) {}
+    static int on_new_log(void* arg, int error_code) {
+        RelayLogWaiter* w = (RelayLogWaiter*)arg;
+        w->error_code = error_code;
+        w->event.signal();
+        return 0;
+    }
+    bthread::CountdownEvent event;
+    int error_code;
+};
+
+void NodeImpl::handle_relay_append_entries_request(
+                                    brpc::Controller* cntl,
+                                    const AppendEntriesRequest* request,
+                                    AppendEntriesResponse* response,
+                                    google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    PeerId peer_id;
+    if (peer_id.parse(request->peer_id()) != 0) {
+        cntl->SetFailed(EINVAL, "peer_id invalid");
+        return;
+    }
+    // The logs usually reach this relay a little earlier than the request
+    // as the leader replicates them to both of us at the same time
+    const int64_t first_index = request->prev_log_index() + 1;
+    const int64_t last_index = request->prev_log_index()
+                               + request->entries_size();
+    const int64_t deadline_ms = butil::monotonic_time_ms()
+                                + FLAGS_raft_relay_wait_ms;
+    int64_t local_last_index = _log_manager->last_log_index();
+    while (local_last_index < last_index) {
+        const int64_t now_ms = butil::monotonic_time_ms();
+        if (now_ms >= deadline_ms) {
+            cntl->SetFailed(EAGAIN, "Relay %s lags behind log %" PRId64,
+                            _server_id.to_string().c_str(), last_index);
+            return;
+        }
+        RelayLogWaiter waiter;
+        const LogManager::WaitId wait_id = _log_manager->wait(
+                local_last_index, RelayLogWaiter::on_new_log, &waiter);
+        waiter.event.timed_wait(
+                butil::milliseconds_from_now(deadline_ms - now_ms));
+        if (_log_manager->remove_waiter(wait_id) != 0) {
+            // The waiter is woken up or being woken up
+            waiter.event.wait();
+        }
+        if (waiter.error_code != 0) {
+            cntl->SetFailed(waiter.error_code, "Relay %s stopped waiting "
+                            "for log %" PRId64, _server_id.to_string().c_str(),
+                            last_index);
+            return;
+        }
+        local_last_index = _log_manager->last_log_index();
+    }
+
+    std::unique_ptr<RelayAppendEntriesDone> relay_done(
+            new RelayAppendEntriesDone(cntl, response, done));
+    std::vector<LogEntry*> entries;
+    entries.reserve(request->entries_size());
+    _log_manager->get_entries(first_index, request->entries_size(),
+                              std::numeric_limits<size_t>::max(), &entries);
+    // Same index and term means the same log, others are not served
+    bool matched = (int)entries.size() == request->entries_size();
+    butil::IOBuf& data = relay_done->forward_cntl.request_attachment();
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const EntryMeta& em = request->entries(i);
+        if (matched && (entries[i]->id.term != em.term() ||
+                        entries[i]->data.size() != (size_t)em.data_len())) {
+            matched = false;
+        }
+        if (matched) {
+            data.append(entries[i]->data);
+        }
+        entries[i]->Release();
+    }
+    if (!matched) {
+        cntl->SetFailed(EAGAIN, "Relay %s has different logs in [%" PRId64
+                        ", %" PRId64 "]", _server_id.to_string().c_str(),
+                        first_index, last_index);
+        return;
+    }
+
+    brpc::ChannelOptions channel_opt;
+    channel_opt.timeout_ms = _options.election_timeout_ms;
+    if (init_peer_channel(&relay_done->channel, peer_id.addr,
+                          &channel_opt) != 0) {
+        cntl->SetFailed(EINVAL, "Fail to init channel to %s",
+                        peer_id.to_string().c_str());
+        return;
+    }
+    relay_done->forward_request.CopyFrom(*request);
+    relay_done->forward_request.clear_relay_peer_id();
+    g_relay_append_entries_bytes << data.size();
+    done_guard.release();
+    RelayAppendEntriesDone* forward_done = relay_done.release();
+    RaftService_Stub stub(&forward_done->channel);
+    stub.append_entries(&forward_done->forward_cntl,
+                        &forward_done->forward_request,
+                        &forward_done->forward_response, forward_done);
 }
 
 int NodeImpl::increase_term_to(int64_t new_term, const butil::Status& status) {
@@ -2253,7 +3898,7 @@ void NodeImpl::handle_install_snapshot_request(brpc::Controller* cntl,
                         request->server_id().c_str());
         return;
     }
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     
     if (!is_active_state(_state)) {
         const int64_t saved_current_term = _current_term;
@@ -2332,6 +3977,31 @@ butil::Status NodeImpl::read_committed_user_log(const int64_t index, UserLog* us
             user_log->set_log_data(entry->data);
             entry->Release();
             return butil::Status();
+        } else if (entry->type == ENTRY_TYPE_DATA_BATCH) {
+            // All the tasks packed in the log
+            std::vector<butil::IOBuf> datas;
+            butil::Status st = parse_data_batch(entry->data, &datas);
+            entry->Release();
+            if (!st.ok() || datas.empty()) {
+                return butil::Status(EINVAL, "Fail to parse the tasks at "
+                                     "index:%" PRId64, cur_index);
+            }
+            user_log->set_log_index(cur_index);
+            user_log->set_task_datas(&datas);
+            return butil::Status();
+        } else if (entry->type == ENTRY_TYPE_PARTITIONED_DATA) {
+            int64_t partition_key = 0;
+            butil::IOBuf data;
+            butil::Status st = parse_partitioned_data(entry->data,
+                                                      &partition_key, &data);
+            entry->Release();
+            if (!st.ok()) {
+                return butil::Status(EINVAL, "Fail to parse the task at "
+                                     "index:%" PRId64, cur_index);
+            }
+            user_log->set_log_index(cur_index);
+            user_log->set_log_data(data);
+            return butil::Status();
         } else {
             entry->Release();
             ++cur_index;
@@ -2347,10 +4017,95 @@ butil::Status NodeImpl::read_committed_user_log(const int64_t index, UserLog* us
     return butil::Status(ELOGDELETED, "user log is deleted at index:%" PRId64, cur_index);
 }
 
+int NodeImpl::subscribe_logs(const LogSubscriptionOptions& options,
+                             LogSubscriber* subscriber,
+                             int64_t* subscription_id) {
+    if (options.start_index <= 0 || subscriber == NULL) {
+        LOG(ERROR) << "node " << _group_id << ":" << _server_id
+                   << " got invalid log subscription from index "
+                   << options.start_index;
+        return -1;
+    }
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_state == STATE_UNINITIALIZED || _state >= STATE_SHUTTING) {
+            LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                         << " can't subscribe the logs in state "
+                         << state2str(_state);
+            return -1;
+        }
+    }
+    scoped_refptr<LogSubscription> subscription;
+    {
+        BAIDU_SCOPED_LOCK(_log_subscriptions_mutex);
+        const int64_t id = _next_log_subscription_id++;
+        subscription = new LogSubscription(this, _log_manager, _fsm_caller,
+                                           id, options, subscriber);
+        _log_subscriptions[id] = subscription;
+    }
+    update_log_pin();
+    if (subscription->start() != 0) {
+        on_log_subscription_stopped(subscription->id());
+        return -1;
+    }
+    LOG(INFO) << "node " << _group_id << ":" << _server_id
+              << " starts log subscription " << subscription->id()
+              << " from index " << options.start_index;
+    *subscription_id = subscription->id();
+    return 0;
+}
+
+int NodeImpl::unsubscribe_logs(int64_t subscription_id) {
+    scoped_refptr<LogSubscription> subscription;
+    {
+        BAIDU_SCOPED_LOCK(_log_subscriptions_mutex);
+        std::map<int64_t, scoped_refptr<LogSubscription> >::iterator
+                it = _log_subscriptions.find(subscription_id);
+        if (it == _log_subscriptions.end()) {
+            return -1;
+        }
+        subscription = it->second;
+    }
+    subscription->stop(butil::Status(ECANCELED, "Unsubscribed"));
+    return 0;
+}
+
+void NodeImpl::update_log_pin() {
+    int64_t pinned_index = 0;
+    {
+        BAIDU_SCOPED_LOCK(_log_subscriptions_mutex);
+        for (std::map<int64_t, scoped_refptr<LogSubscription> >::iterator
+                it = _log_subscriptions.begin();
+                it != _log_subscriptions.end(); ++it) {
+            const int64_t index = it->second->pinned_index();
+            if (index > 0 && (pinned_index == 0 || index < pinned_index)) {
+                pinned_index = index;
+            }
+        }
+    }
+    _log_manager->set_pinned_index(pinned_index);
+}
+
+void NodeImpl::on_log_subscription_stopped(int64_t subscription_id) {
+    scoped_refptr<LogSubscription> subscription;
+    {
+        BAIDU_SCOPED_LOCK(_log_subscriptions_mutex);
+        std::map<int64_t, scoped_refptr<LogSubscription> >::iterator
+                it = _log_subscriptions.find(subscription_id);
+        if (it == _log_subscriptions.end()) {
+            return;
+        }
+        // Released out of the lock
+        subscription.swap(it->second);
+        _log_subscriptions.erase(it);
+    }
+    update_log_pin();
+}
+
 void NodeImpl::describe(std::ostream& os, bool use_html) {
     PeerId leader;
     std::vector<ReplicatorId> replicators;
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     const State st = _state;
     if (st == STATE_FOLLOWER) {
         leader = _leader_id;
@@ -2360,6 +4115,8 @@ void NodeImpl::describe(std::ostream& os, bool use_html) {
     //const int ref_count = ref_count_;
     std::vector<PeerId> peers;
     _conf.conf.list_peers(&peers);
+    std::vector<PeerId> learners;
+    _conf.learners.list_peers(&learners);
 
     const std::string is_changing_conf = _conf_ctx.is_busy() ? "YES" : "NO";
     const char* conf_statge = _conf_ctx.stage_str(); 
@@ -2374,11 +4131,15 @@ void NodeImpl::describe(std::ostream& os, bool use_html) {
     _replicator_group.list_replicators(&replicators);
     const int64_t leader_timestamp = _last_leader_timestamp;
     const bool readonly = (_node_readonly || _majority_nodes_readonly);
+    const bool hibernating = _hibernating.load(butil::memory_order_relaxed);
     lck.unlock();
     const char *newline = use_html ? "<br>" : "\r\n";
     os << "peer_id: " << _server_id << newline;
     os << "state: " << state2str(st) << newline;
     os << "readonly: " << readonly << newline;
+    if (hibernating) {
+        os << "hibernating: " << hibernating << newline;
+    }
     os << "term: " << term << newline;
     os << "conf_index: " << conf_index << newline;
     os << "peers:";
@@ -2394,6 +4155,13 @@ void NodeImpl::describe(std::ostream& os, bool use_html) {
         }
     }
     os << newline;  // newline for peers
+    if (!learners.empty()) {
+        os << "learners:";
+        for (size_t j = 0; j < learners.size(); ++j) {
+            os << ' ' << learners[j];
+        }
+        os << newline;
+    }
 
     // info of configuration change
     if (st == STATE_LEADER) {
@@ -2477,7 +4245,7 @@ void NodeImpl::get_status(NodeStatus* status) {
 
     std::vector<PeerId> peers;
     std::vector<std::pair<PeerId, ReplicatorId> > replicators;
-    std::unique_lock<raft_mutex_t> lck(_mutex);
+    std::unique_lock<node_mutex_t> lck(_mutex);
     status->state = _state;
     status->term = _current_term;
     status->peer_id = _server_id;
@@ -2499,6 +4267,8 @@ void NodeImpl::get_status(NodeStatus* status) {
     status->first_index = log_manager_status.first_index;
     status->last_index = log_manager_status.last_index;
     status->disk_index = log_manager_status.disk_index;
+    status->durable_index = log_manager_status.durable_index;
+    status->logs_in_memory_bytes = log_manager_status.memory_bytes;
 
     BallotBoxStatus ballot_box_status;
     _ballot_box->get_status(&ballot_box_status);
@@ -2507,6 +4277,12 @@ void NodeImpl::get_status(NodeStatus* status) {
     status->pending_queue_size = ballot_box_status.pending_queue_size;
 
     status->applying_index = _fsm_caller->applying_index();
+
+    if (_snapshot_executor) {
+        _snapshot_executor->get_status(&status->snapshot_index,
+                                       &status->saving_snapshot,
+                                       &status->installing_snapshot);
+    }
     
     if (replicators.size() == 0) {
         return;
@@ -2559,6 +4335,7 @@ bool NodeImpl::handle_out_of_order_append_entries(brpc::Controller* cntl,
     rpc->response = response;
     rpc->done = done;
     rpc->receive_time_ms = butil::gettimeofday_ms();
+    rpc->bytes = cntl->request_attachment().size();
     bool rc = _append_entries_cache->store(rpc);
     if (!rc && _append_entries_cache->empty()) {
         delete _append_entries_cache;
@@ -2567,11 +4344,12 @@ bool NodeImpl::handle_out_of_order_append_entries(brpc::Controller* cntl,
     return rc;
 }
 
-void NodeImpl::check_append_entries_cache(int64_t local_last_index) {
+void NodeImpl::check_append_entries_cache(
+        int64_t local_last_index, butil::LinkedList<AppendEntriesRpc>* runnable) {
     if (!_append_entries_cache) {
         return;
     }
-    _append_entries_cache->process_runable_rpcs(local_last_index);
+    _append_entries_cache->process_runable_rpcs(local_last_index, runnable);
     if (_append_entries_cache->empty()) {
         delete _append_entries_cache;
         _append_entries_cache = NULL;
@@ -2624,7 +4402,7 @@ void* NodeImpl::handle_append_entries_cache_timedout(void* arg) {
     AppendEntriesCacheTimerArg* timer_arg = (AppendEntriesCacheTimerArg*)arg;
     NodeImpl* node = timer_arg->node;
 
-    std::unique_lock<raft_mutex_t> lck(node->_mutex);
+    std::unique_lock<node_mutex_t> lck(node->_mutex);
     if (node->_append_entries_cache &&
         timer_arg->cache_version == node->_append_entries_cache->cache_version()) {
         node->_append_entries_cache->do_handle_append_entries_cache_timedout(
@@ -2641,9 +4419,9 @@ void* NodeImpl::handle_append_entries_cache_timedout(void* arg) {
 }
 
 int64_t NodeImpl::AppendEntriesCache::first_index() const {
-    CHECK(!_rpc_map.empty());
+    CHECK(!_rpcs.empty());
     CHECK(!_rpc_queue.empty());
-    return _rpc_map.begin()->second->request->prev_log_index() + 1;
+    return _rpcs.front()->request->prev_log_index() + 1;
 }
 
 int64_t NodeImpl::AppendEntriesCache::cache_version() const {
@@ -2651,56 +4429,66 @@ int64_t NodeImpl::AppendEntriesCache::cache_version() const {
 }
 
 bool NodeImpl::AppendEntriesCache::empty() const {
-    return _rpc_map.empty();
+    return _rpcs.empty();
+}
+
+bool NodeImpl::AppendEntriesCache::prev_index_less(
+        int64_t prev_log_index, const AppendEntriesRpc* rpc) {
+    return prev_log_index < rpc->request->prev_log_index();
 }
 
 bool NodeImpl::AppendEntriesCache::store(AppendEntriesRpc* rpc) {
-    if (!_rpc_map.empty()) {
-        bool need_clear = false;
-        std::map<int64_t, AppendEntriesRpc*>::iterator it =
-            _rpc_map.lower_bound(rpc->request->prev_log_index());
-        int64_t rpc_prev_index = rpc->request->prev_log_index();
-        int64_t rpc_last_index = rpc_prev_index + rpc->request->entries_size();
-
-        // Some rpcs with the overlap log index alredy exist, means retransmission
-        // happend, simplely clean all out of order requests, and store the new
-        // one.
-        if (it != _rpc_map.begin()) {
-            --it;
-            AppendEntriesRpc* prev_rpc = it->second;
-            if (prev_rpc->request->prev_log_index() +
-                prev_rpc->request->entries_size() > rpc_prev_index) {
-                need_clear = true;
-            }
-            ++it;
-        }
-        if (!need_clear && it != _rpc_map.end()) {
-            AppendEntriesRpc* next_rpc = it->second;
-            if (next_rpc->request->prev_log_index() < rpc_last_index) {
-                need_clear = true;
-            }
+    int64_t rpc_prev_index = rpc->request->prev_log_index();
+    int64_t rpc_last_index = rpc_prev_index + rpc->request->entries_size();
+    // Requests mostly arrive in the order of indexes, so they are usually
+    // appended at the back of the ring
+    std::deque<AppendEntriesRpc*>::iterator it = _rpcs.end();
+    if (!_rpcs.empty() &&
+            _rpcs.back()->request->prev_log_index() > rpc_prev_index) {
+        it = std::upper_bound(_rpcs.begin(), _rpcs.end(), rpc_prev_index,
+                              prev_index_less);
+    }
+    // Some rpcs with the overlap log index alredy exist, means retransmission
+    // happend, simplely clean all out of order requests, and store the new
+    // one.
+    bool need_clear = false;
+    if (it != _rpcs.begin()) {
+        AppendEntriesRpc* prev_rpc = *(it - 1);
+        if (prev_rpc->request->prev_log_index() +
+            prev_rpc->request->entries_size() > rpc_prev_index) {
+            need_clear = true;
         }
-        if (need_clear) {
-            clear();
+    }
+    if (!need_clear && it != _rpcs.end()) {
+        AppendEntriesRpc* next_rpc = *it;
+        if (next_rpc->request->prev_log_index() < rpc_last_index) {
+            need_clear = true;
         }
     }
+    if (need_clear) {
+        clear();
+        it = _rpcs.end();
+    }
     _rpc_queue.Append(rpc);
-    _rpc_map.insert(std::make_pair(rpc->request->prev_log_index(), rpc));
+    _rpcs.insert(it, rpc);
+    _bytes += rpc->bytes;
 
     // The first rpc need to start the timer
-    if (_rpc_map.size() == 1) {
+    if (_rpcs.size() == 1) {
         if (!start_timer()) {
             clear();
             return true;
         }
     }
+    // Drop the requests of the highest indexes, which are needed the last
     HandleAppendEntriesFromCacheArg* arg = NULL;
-    while (_rpc_map.size() > (size_t)FLAGS_raft_max_append_entries_cache_size) {
-        std::map<int64_t, AppendEntriesRpc*>::iterator it = _rpc_map.end();
-        --it;
-        AppendEntriesRpc* rpc_to_release = it->second;
+    while (_rpcs.size() > (size_t)FLAGS_raft_max_append_entries_cache_size ||
+           (_rpcs.size() > 1 &&
+                _bytes > FLAGS_raft_max_append_entries_cache_bytes)) {
+        AppendEntriesRpc* rpc_to_release = _rpcs.back();
+        _rpcs.pop_back();
+        _bytes -= rpc_to_release->bytes;
         rpc_to_release->RemoveFromList();
-        _rpc_map.erase(it);
         if (arg == NULL) {
             arg = new HandleAppendEntriesFromCacheArg;
             arg->node = _node;
@@ -2713,29 +4501,22 @@ bool NodeImpl::AppendEntriesCache::store(AppendEntriesRpc* rpc) {
     return true;
 }
 
-void NodeImpl::AppendEntriesCache::process_runable_rpcs(int64_t local_last_index) {
-    CHECK(!_rpc_map.empty());
+void NodeImpl::AppendEntriesCache::process_runable_rpcs(
+        int64_t local_last_index, butil::LinkedList<AppendEntriesRpc>* runnable) {
+    CHECK(!_rpcs.empty());
     CHECK(!_rpc_queue.empty());
-    HandleAppendEntriesFromCacheArg* arg = NULL;
-    for (std::map<int64_t, AppendEntriesRpc*>::iterator it = _rpc_map.begin();
-        it != _rpc_map.end();) {
-        AppendEntriesRpc* rpc = it->second;
+    while (!_rpcs.empty()) {
+        AppendEntriesRpc* rpc = _rpcs.front();
         if (rpc->request->prev_log_index() > local_last_index) {
             break;
         }
         local_last_index = rpc->request->prev_log_index() + rpc->request->entries_size();
-        _rpc_map.erase(it++);
+        _rpcs.pop_front();
+        _bytes -= rpc->bytes;
         rpc->RemoveFromList();
-        if (arg == NULL) {
-            arg = new HandleAppendEntriesFromCacheArg;
-            arg->node = _node;
-        }
-        arg->rpcs.Append(rpc);
-    }
-    if (arg != NULL) {
-        start_to_handle(arg);
+        runnable->Append(rpc);
     }
-    if (_rpc_map.empty()) {
+    if (_rpcs.empty()) {
         stop_timer();
     }
 }
@@ -2751,7 +4532,8 @@ void NodeImpl::AppendEntriesCache::clear() {
         rpc->RemoveFromList();
         arg->rpcs.Append(rpc);
     }
-    _rpc_map.clear();
+    _rpcs.clear();
+    _bytes = 0;
     start_to_handle(arg);
 }
 
@@ -2821,7 +4603,7 @@ void NodeImpl::AppendEntriesCache::do_handle_append_entries_cache_timedout(
     if (timer_version != _timer_version) {
         return;
     }
-    CHECK(!_rpc_map.empty());
+    CHECK(!_rpcs.empty());
     CHECK(!_rpc_queue.empty());
     // If the head of out-of-order requests is not be handled, clear the entire cache,
     // otherwise, start a new timer.
@@ -2843,6 +4625,15 @@ void NodeImpl::ConfigurationCtx::start(const Configuration& old_conf,
     _stage = STAGE_CATCHING_UP;
     old_conf.list_peers(&_old_peers);
     new_conf.list_peers(&_new_peers);
+    // Learners added as voting peers are promoted once they catch up, and
+    // are no longer learners in the new configuration
+    _node->_conf.learners.list_peers(&_old_learners);
+    for (std::set<PeerId>::const_iterator
+            iter = _old_learners.begin(); iter != _old_learners.end(); ++iter) {
+        if (_new_peers.find(*iter) == _new_peers.end()) {
+            _new_learners.insert(*iter);
+        }
+    }
     Configuration adding;
     Configuration removing;
     new_conf.diffs(old_conf, &adding, &removing);
@@ -2881,9 +4672,38 @@ void NodeImpl::ConfigurationCtx::start(const Configuration& old_conf,
     }
 }
 
+void NodeImpl::ConfigurationCtx::start_learners_change(
+        const Configuration& new_learners, Closure* done) {
+    CHECK(!is_busy());
+    CHECK(!_done);
+    _done = done;
+    _stage = STAGE_STABLE;
+    _node->_conf.conf.list_peers(&_new_peers);
+    _old_peers = _new_peers;
+    _node->_conf.learners.list_peers(&_old_learners);
+    new_learners.list_peers(&_new_learners);
+    LOG(INFO) << "node " << _node->_group_id << ":" << _node->_server_id
+              << " change_learners from " << _node->_conf.learners
+              << " to " << new_learners;
+    // Learners don't need to catch up before joining as they never vote
+    for (std::set<PeerId>::const_iterator
+            iter = _new_learners.begin(); iter != _new_learners.end(); ++iter) {
+        if (_node->_replicator_group.add_replicator(*iter) != 0) {
+            LOG(ERROR) << "node " << _node->node_id()
+                       << " start replicator failed, learner " << *iter;
+            butil::Status err(EINVAL, "Fail to start replicator to %s",
+                              iter->to_string().c_str());
+            return reset(&err);
+        }
+    }
+    _node->unsafe_apply_configuration(Configuration(_new_peers), NULL, false);
+}
+
 void NodeImpl::ConfigurationCtx::flush(const Configuration& conf,
                                        const Configuration& old_conf) {
     CHECK(!is_busy());
+    _node->_conf.learners.list_peers(&_new_learners);
+    _old_learners = _new_learners;
     conf.list_peers(&_new_peers);
     if (old_conf.empty()) {
         _stage = STAGE_STABLE;
@@ -2969,17 +4789,25 @@ void NodeImpl::ConfigurationCtx::reset(butil::Status* st) {
 
     LOG(INFO) << "node " << _node->node_id()
               << " reset ConfigurationCtx, new_peers: " << Configuration(_new_peers)
-              << ", old_peers: " << Configuration(_old_peers);
+              << ", old_peers: " << Configuration(_old_peers)
+              << ", new_learners: " << Configuration(_new_learners)
+              << ", old_learners: " << Configuration(_old_learners);
+    std::set<PeerId> new_nodes(_new_peers);
+    new_nodes.insert(_new_learners.begin(), _new_learners.end());
+    std::set<PeerId> old_nodes(_old_peers);
+    old_nodes.insert(_old_learners.begin(), _old_learners.end());
     if (st && st->ok()) {
-        _node->stop_replicator(_new_peers, _old_peers);
+        _node->stop_replicator(new_nodes, old_nodes);
     } else {
         // leader step_down may stop replicators of catching up nodes, leading to
         // run catchup_closure
-        _node->stop_replicator(_old_peers, _new_peers);
+        _node->stop_replicator(old_nodes, new_nodes);
     }
     _new_peers.clear();
     _old_peers.clear();
     _adding_peers.clear();
+    _new_learners.clear();
+    _old_learners.clear();
     ++_version;
     _stage = STAGE_NONE;
     _nchanges = 0;
@@ -3060,7 +4888,8 @@ void NodeImpl::check_majority_nodes_readonly(const Configuration& conf) {
 
 // Timers
 int NodeTimer::init(NodeImpl* node, int timeout_ms) {
-    BRAFT_RETURN_IF(RepeatedTimerTask::init(timeout_ms) != 0, -1);
+    BRAFT_RETURN_IF(RepeatedTimerTask::init(
+                timeout_ms, node->_options.bthread_tag) != 0, -1);
     _node = node;
     node->AddRef();
     return 0;
@@ -3078,7 +4907,7 @@ void ElectionTimer::run() {
 }
 
 int ElectionTimer::adjust_timeout_ms(int timeout_ms) {
-    return random_timeout(timeout_ms);
+    return _node->adjust_election_timeout_ms(timeout_ms);
 }
 
 void VoteTimer::run() {
@@ -20,6 +20,7 @@
 #define BRAFT_RAFT_NODE_H
 
 #include <set>
+#include <deque>
 #include <butil/atomic_ref_count.h>
 #include <butil/memory/ref_counted.h>
 #include <butil/iobuf.h>
@@ -37,6 +38,8 @@
 #include "braft/closure_queue.h"
 #include "braft/configuration_manager.h"
 #include "braft/repeated_timer_task.h"
+#include "braft/entry_tracer.h"
+#include "braft/log_subscription.h"
 
 namespace braft {
 
@@ -45,8 +48,20 @@ class RaftMetaStorage;
 class SnapshotStorage;
 class SnapshotExecutor;
 class StopTransferArg;
+class ReadIndexRound;
 
 class NodeImpl;
+
+// A read of NodeImpl::read_index waiting for the read index
+struct PendingRead {
+    PendingRead() : done(NULL), index(NULL), wait_applied(true) {}
+    Closure* done;
+    // Assigned with the read index if not NULL
+    int64_t* index;
+    // Run |done| once the read index is applied, otherwise once it's known
+    bool wait_applied;
+};
+
 class NodeTimer : public RepeatedTimerTask {
 public:
     NodeTimer() : _node(NULL) {}
@@ -85,12 +100,19 @@ private:
     bool _first_schedule;
 };
 
+struct NodeMutexTag {
+    static const char* name() { return "node"; }
+};
+typedef ProfiledMutex<NodeMutexTag> node_mutex_t;
+
 class BAIDU_CACHELINE_ALIGNMENT NodeImpl 
         : public butil::RefCountedThreadSafe<NodeImpl> {
 friend class RaftServiceImpl;
 friend class RaftStatImpl;
 friend class FollowerStableClosure;
 friend class ConfigurationChangeDone;
+friend class ReadIndexRound;
+friend class FollowerReadIndexDone;
 public:
     NodeImpl(const GroupId& group_id, const PeerId& peer_id);
     NodeImpl();
@@ -109,6 +131,8 @@ public:
         return _state == STATE_LEADER;
     }
 
+    EntryTracer* entry_tracer() { return &_entry_tracer; }
+
     // public user api
     //
     // init node
@@ -133,12 +157,33 @@ public:
     //
     void apply(const Task& task);
 
+    // apply |tasks| in order with one submission to the apply queue. If
+    // |done| is not NULL, the done of the tasks are ignored and |done| is
+    // called once all the tasks are done.
+    void apply(const std::vector<Task>& tasks, Closure* done);
+
     butil::Status list_peers(std::vector<PeerId>* peers);
 
     // @Node configuration change
     void add_peer(const PeerId& peer, Closure* done);
     void remove_peer(const PeerId& peer, Closure* done);
     void change_peers(const Configuration& new_peers, Closure* done);
+
+    // list learners of this raft group, only leader returns ok
+    butil::Status list_learners(std::vector<PeerId>* learners);
+    // Add/remove non-voting learners, which are replicated by the leader but
+    // never counted in the quorum or elections
+    void add_learners(const std::vector<PeerId>& learners, Closure* done);
+    void remove_learners(const std::vector<PeerId>& learners, Closure* done);
+
+    // Replicate the log data to |peer| through |relay|, or directly if
+    // |relay| is empty
+    butil::Status set_relay(const PeerId& peer, const PeerId& relay);
+
+    // Install the snapshots to |peer| from |donor|, or from this node if
+    // |donor| is empty
+    butil::Status set_snapshot_donor(const PeerId& peer, const PeerId& donor);
+
     butil::Status reset_peers(const Configuration& new_peers);
 
     // trigger snapshot
@@ -166,6 +211,13 @@ public:
                                       google::protobuf::Closure* done,
                                       bool from_append_entries_cache = false);
 
+    // handle received AppendEntries which should be forwarded to another peer
+    // by this relay along with the data of the logs
+    void handle_relay_append_entries_request(brpc::Controller* cntl,
+                                             const AppendEntriesRequest* request,
+                                             AppendEntriesResponse* response,
+                                             google::protobuf::Closure* done);
+
     // handle received InstallSnapshot
     void handle_install_snapshot_request(brpc::Controller* controller,
                                         const InstallSnapshotRequest* request,
@@ -227,14 +279,91 @@ public:
     
     butil::Status read_committed_user_log(const int64_t index, UserLog* user_log);
 
+    int subscribe_logs(const LogSubscriptionOptions& options,
+                       LogSubscriber* subscriber, int64_t* subscription_id);
+    int unsubscribe_logs(int64_t subscription_id);
+
+    // Pin the logs not yet delivered to the log subscriptions, called by
+    // them after delivering a batch
+    void update_log_pin();
+    // Called by the log subscription of |subscription_id| once it stops
+    void on_log_subscription_stopped(int64_t subscription_id);
+
+    // Run |done| once the logs committed before the call are applied, if
+    // this node is confirmed to be the leader. A follower gets the read index
+    // from the leader and waits for applying it itself.
+    void read_index(Closure* done);
+
+    // handle received ReadIndex from the followers
+    void handle_read_index_request(brpc::Controller* cntl,
+                                   const ReadIndexRequest* request,
+                                   ReadIndexResponse* response,
+                                   google::protobuf::Closure* done);
+
+    // handle received GetSnapshotUri from the leader, which copies the
+    // snapshot of this node to another follower
+    void handle_get_snapshot_uri_request(brpc::Controller* cntl,
+                                         const GetSnapshotUriRequest* request,
+                                         GetSnapshotUriResponse* response,
+                                         google::protobuf::Closure* done);
+
     int bootstrap(const BootstrapOptions& options);
+    // Bootstrap with the snapshot already in options.snapshot_uri
+    int bootstrap_from_local_snapshot(const BootstrapOptions& options);
+    // Append the configuration entry of |conf| which starts the group
+    int append_bootstrap_configuration(const Configuration& conf);
 
     bool disable_cli() const { return _options.disable_cli; }
 
+    // The highest NodeOptions::election_priority of the group known by this
+    // node
+    int max_election_priority() const {
+        return _max_election_priority.load(butil::memory_order_relaxed);
+    }
+
+    // Election timeout of this node, which is longer if there are peers of
+    // higher election priority or the group hibernates
+    int adjust_election_timeout_ms(int timeout_ms);
+
+    // The election timeout derived from the RTT of the peers by the leader,
+    // which a follower learns from it, 0 if not adapted.
+    // See raft_enable_adaptive_election_timeout
+    int adaptive_election_timeout_ms() const {
+        return _adaptive_election_timeout_ms.load(butil::memory_order_relaxed);
+    }
+
+    // Whether the group hibernates, see raft_hibernate_idle_ms
+    bool hibernating() const {
+        return _hibernating.load(butil::memory_order_relaxed);
+    }
+
+    // Wake up the hibernating group
+    void wake_up();
+
+    // List the leader loads of the servers of the followers which the
+    // leadership could be transferred to, see LeaderBalancer.
+    // Returns 0 on success, -1 if this node is not a leader free to transfer
+    int list_leader_loads(std::vector<PeerLeaderLoad>* out);
+
 private:
 friend class butil::RefCountedThreadSafe<NodeImpl>;
 
     virtual ~NodeImpl();
+    // Serve |read| with the committed index once the leadership is confirmed
+    // by the lease or a round of heartbeats. |lck| is unlocked unless |read|
+    // waits for a round in flight
+    void unsafe_leader_read_index(std::unique_lock<node_mutex_t>* lck,
+                                  const PendingRead& read);
+    // Confirm the leadership for the pending reads with one round of
+    // heartbeats. Returns the started round, which the caller should release
+    // after unlocking _mutex
+    ReadIndexRound* unsafe_start_read_index_round();
+    void on_read_index_round_done();
+    void fail_pending_reads(const butil::Status& status);
+    void unsafe_schedule_follower_reads();
+    static void on_follower_reads_timer(void* arg);
+    static void* send_follower_reads(void* arg);
+
     // internal init func
     int init_snapshot_storage();
     int init_log_storage();
@@ -243,6 +372,8 @@ friend class butil::RefCountedThreadSafe<NodeImpl>;
     void unsafe_register_conf_change(const Configuration& old_conf,
                                      const Configuration& new_conf,
                                      Closure* done);
+    void unsafe_register_learners_change(const Configuration& new_learners,
+                                         Closure* done);
     void stop_replicator(const std::set<PeerId>& keep,
                          const std::set<PeerId>& drop);
 
@@ -264,10 +395,12 @@ friend class butil::RefCountedThreadSafe<NodeImpl>;
     void check_step_down(const int64_t term, const PeerId& server_id);
 
     // pre vote before elect_self
-    void pre_vote(std::unique_lock<raft_mutex_t>* lck);
+    void pre_vote(std::unique_lock<node_mutex_t>* lck);
 
-    // elect self to candidate
-    void elect_self(std::unique_lock<raft_mutex_t>* lck);
+    // elect self to candidate, |leadership_transfer| is set if the leader
+    // asks this node to do so
+    void elect_self(std::unique_lock<node_mutex_t>* lck,
+                    bool leadership_transfer = false);
 
     // leader async apply configuration
     void unsafe_apply_configuration(const Configuration& new_conf,
@@ -276,6 +409,13 @@ friend class butil::RefCountedThreadSafe<NodeImpl>;
 
     void do_snapshot(Closure* done);
 
+    // Whether the snapshot is triggered by the growth of the logs besides
+    // the timer
+    bool snapshot_policy_enabled() const;
+    bool unsafe_snapshot_due(int64_t now_ms);
+    static void* start_auto_snapshot(void* arg);
+    void on_auto_snapshot_done(const butil::Status& st);
+
     void after_shutdown();
     static void after_shutdown(NodeImpl* node);
 
@@ -285,14 +425,55 @@ friend class butil::RefCountedThreadSafe<NodeImpl>;
     static int execute_applying_tasks(
                 void* meta, bthread::TaskIterator<LogEntryAndClosure>& iter);
     void apply(LogEntryAndClosure tasks[], size_t size);
+    void unsafe_append_task(const LogEntryAndClosure& task,
+                            std::vector<LogEntry*>* entries);
+    // Pack |tasks| into one ENTRY_TYPE_DATA_BATCH log if there are more than
+    // one of them
+    void unsafe_append_coalesced_tasks(std::vector<LogEntryAndClosure>* tasks,
+                                       std::vector<LogEntry*>* entries);
     void check_dead_nodes(const Configuration& conf, int64_t now_ms);
 
+    // Whether this leader holds the lease of NodeOptions::enable_leader_lease
+    bool unsafe_leader_lease_valid(int64_t now_ms);
+    bool check_leader_lease(const Configuration& conf, int64_t now_ms);
+    // Whether the votes for other candidates should be refused as a leader
+    // might hold the lease
+    bool unsafe_in_leader_lease(int64_t now_ms);
+    // Whether the leadership should be transferred to |peer|, which is a
+    // caught up voter of higher election priority
+    bool unsafe_find_higher_priority_peer(int64_t now_ms, PeerId* peer);
+    // Whether the leadership should be transferred away as the log storage
+    // is on a slow disk, see raft_slow_disk_transfer_leader
+    bool unsafe_on_slow_disk(int64_t now_ms);
+    // Hibernate the group if the leader is idle and the followers are
+    // caught up
+    void unsafe_check_hibernation(int64_t now_ms);
+    // Derive the election timeout and the heartbeat interval from the RTT
+    // of the peers, see raft_enable_adaptive_election_timeout
+    void unsafe_adapt_election_timeout();
+    // The election timeout learned from the leader in the adaptive mode, or
+    // NodeOptions::election_timeout_ms
+    int unsafe_election_timeout_ms();
+    // Called on activities of the group, which wake up the group if it
+    // hibernates
+    void unsafe_wake_up(int64_t now_ms);
+
+    // Build the logs of |request| out of _mutex.
+    // Returns 0 on success, -1 otherwise and |cntl| is set failed
+    int parse_append_entries(brpc::Controller* cntl,
+                             const AppendEntriesRequest* request,
+                             std::vector<LogEntry*>* entries);
+
+    struct AppendEntriesRpc;
     bool handle_out_of_order_append_entries(brpc::Controller* cntl,
                                             const AppendEntriesRequest* request,
                                             AppendEntriesResponse* response,
                                             google::protobuf::Closure* done,
                                             int64_t local_last_index);
-    void check_append_entries_cache(int64_t local_last_index);
+    // Move the cached requests which become contiguous to |local_last_index|
+    // into |runnable|
+    void check_append_entries_cache(int64_t local_last_index,
+                                    butil::LinkedList<AppendEntriesRpc>* runnable);
     void clear_append_entries_cache();
     static void* handle_append_entries_from_cache(void* arg);
     static void on_append_entries_cache_timedout(void* arg);
@@ -326,6 +507,13 @@ private:
                 old_peers->push_back(*it);
             }
         }
+        void list_new_learners(std::vector<PeerId>* new_learners) const {
+            new_learners->clear();
+            std::set<PeerId>::iterator it;
+            for (it = _new_learners.begin(); it != _new_learners.end(); ++it) {
+                new_learners->push_back(*it);
+            }
+        }
         const char* stage_str() {
             const char* str[] = {"STAGE_NONE", "STAGE_CATCHING_UP", 
                                  "STAGE_JOINT", "STAGE_STABLE", };
@@ -342,6 +530,10 @@ private:
         void start(const Configuration& old_conf, 
                    const Configuration& new_conf,
                    Closure * done);
+        // Start changing the learners to |new_learners|, which doesn't
+        // change the voting peers and thus goes to STAGE_STABLE directly.
+        void start_learners_change(const Configuration& new_learners,
+                                   Closure* done);
         // Invoked when this node becomes the leader, write a configuration
         // change log as the first log
         void flush(const Configuration& conf,
@@ -356,13 +548,23 @@ private:
         std::set<PeerId> _new_peers;
         std::set<PeerId> _old_peers;
         std::set<PeerId> _adding_peers;
+        std::set<PeerId> _new_learners;
+        std::set<PeerId> _old_learners;
         Closure* _done;
     };
 
     struct LogEntryAndClosure {
+        LogEntryAndClosure()
+            : entry(NULL), done(NULL), expected_term(-1), trace_start_us(0)
+            , batch(NULL) {}
         LogEntry* entry;
         Closure* done;
         int64_t expected_term;
+        // Start time of the task if it's sampled by EntryTracer
+        int64_t trace_start_us;
+        // If not NULL, this element carries the tasks of one
+        // apply(std::vector<Task>) call instead
+        std::vector<LogEntryAndClosure>* batch;
     };
 
     struct AppendEntriesRpc : public butil::LinkNode<AppendEntriesRpc> {
@@ -371,6 +573,7 @@ private:
         AppendEntriesResponse* response;
         google::protobuf::Closure* done;
         int64_t receive_time_ms;
+        int64_t bytes;
     };
 
     struct HandleAppendEntriesFromCacheArg {
@@ -378,31 +581,44 @@ private:
         butil::LinkedList<AppendEntriesRpc> rpcs;
     };
 
-    // A simple cache to temporaryly store out-of-order AppendEntries requests.
+    // Reorder buffer of out-of-order AppendEntries requests, which are kept
+    // in a ring in the order of their log indexes and limited by both
+    // raft_max_append_entries_cache_size and
+    // raft_max_append_entries_cache_bytes. Once the gap before them is
+    // filled, the contiguous requests are handled at once in the bthread that
+    // fills the gap.
     class AppendEntriesCache {
     public:
         AppendEntriesCache(NodeImpl* node, int64_t version)
-            : _node(node), _timer(bthread_timer_t())
+            : _node(node), _bytes(0), _timer(bthread_timer_t())
             , _cache_version(0), _timer_version(0) {}
 
         int64_t first_index() const;
         int64_t cache_version() const;
         bool empty() const;
+        size_t size() const { return _rpcs.size(); }
+        int64_t bytes() const { return _bytes; }
         bool store(AppendEntriesRpc* rpc);
-        void process_runable_rpcs(int64_t local_last_index);
+        void process_runable_rpcs(int64_t local_last_index,
+                                  butil::LinkedList<AppendEntriesRpc>* runnable);
         void clear();
         void do_handle_append_entries_cache_timedout(
                 int64_t timer_version, int64_t timer_start_ms);
 
     private:
+        static bool prev_index_less(int64_t prev_log_index,
+                                    const AppendEntriesRpc* rpc);
         void ack_fail(AppendEntriesRpc* rpc);
         void start_to_handle(HandleAppendEntriesFromCacheArg* arg);
         bool start_timer();
         void stop_timer();
 
         NodeImpl* _node;
+        // In the order of arrival
         butil::LinkedList<AppendEntriesRpc> _rpc_queue;
-        std::map<int64_t, AppendEntriesRpc*> _rpc_map;
+        // In the order of prev_log_index, without overlaps
+        std::deque<AppendEntriesRpc*> _rpcs;
+        int64_t _bytes;
         bthread_timer_t _timer;
         int64_t _cache_version;
         int64_t _timer_version;
@@ -411,6 +627,7 @@ private:
     State _state;
     int64_t _current_term;
     int64_t _last_leader_timestamp;
+    int64_t _init_timestamp;
     PeerId _leader_id;
     PeerId _voted_id;
     Ballot _vote_ctx;
@@ -421,7 +638,7 @@ private:
     PeerId _server_id;
     NodeOptions _options;
 
-    raft_mutex_t _mutex;
+    node_mutex_t _mutex;
     ConfigurationCtx _conf_ctx;
     LogStorage* _log_storage;
     RaftMetaStorage* _meta_storage;
@@ -430,8 +647,12 @@ private:
     LogManager* _log_manager;
     FSMCaller* _fsm_caller;
     BallotBox* _ballot_box;
+    EntryTracer _entry_tracer;
     SnapshotExecutor* _snapshot_executor;
     ReplicatorGroup _replicator_group;
+    // Connection group of the heartbeats, votes and timeout_now, empty if
+    // they share the connections of the AppendEntries
+    std::string _control_connection_group;
     std::vector<Closure*> _shutdown_continuations;
     ElectionTimer _election_timer;
     VoteTimer _vote_timer;
@@ -449,6 +670,44 @@ private:
     // for readonly mode
     bool _node_readonly;
     bool _majority_nodes_readonly;
+
+    // The reads waiting for the next round of confirming the leadership
+    std::vector<PendingRead> _pending_reads;
+    bool _read_index_in_flight;
+    // The reads of the follower waiting to be sent to the leader
+    std::vector<Closure*> _follower_reads;
+    bool _follower_read_scheduled;
+    // The highest NodeOptions::election_priority of the group, which a
+    // follower learns from the leader
+    butil::atomic<int> _max_election_priority;
+    butil::atomic<int> _adaptive_election_timeout_ms;
+    int64_t _last_priority_transfer_ms;
+    // The disk where the log storage is, 0 if unknown
+    uint64_t _log_disk;
+    int64_t _last_slow_disk_transfer_ms;
+    butil::atomic<bool> _hibernating;
+    // Whether the next election timeout is the first one since init, which
+    // is spread by raft_election_start_spread_ms
+    butil::atomic<bool> _first_election_timeout;
+    // The last time the leader appends logs
+    int64_t _last_active_ms;
+    // The last time the group is woken up
+    int64_t _wake_up_ms;
+
+    // The subscriptions of the committed logs, see subscribe_logs
+    raft_mutex_t _log_subscriptions_mutex;
+    std::map<int64_t, scoped_refptr<LogSubscription> > _log_subscriptions;
+    int64_t _next_log_subscription_id;
+
+    // The disk of the snapshots in SnapshotScheduler
+    uint64_t _snapshot_disk;
+    bool _auto_snapshot_running;
+    // The last time a snapshot triggered by this node is done
+    int64_t _last_auto_snapshot_ms;
+    // Consecutive failures of the automatic snapshots, and the time before
+    // which they are not retried
+    int _auto_snapshot_failures;
+    int64_t _auto_snapshot_retry_ms;
 };
 
 }
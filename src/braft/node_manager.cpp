@@ -14,15 +14,26 @@
 
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
+#include <map>
+#include <algorithm>
+#include <butil/time.h>
+#include <butil/files/file_enumerator.h>
+#include <bthread/bthread.h>
+#include <bthread/mutex.h>
+#include <bthread/condition_variable.h>
 #include "braft/node.h"
 #include "braft/node_manager.h"
+#include "braft/storage.h"
+#include "braft/snapshot_scheduler.h"
 #include "braft/file_service.h"
 #include "braft/builtin_service_impl.h"
 #include "braft/cli_service.h"
 
 namespace braft {
 
-NodeManager::NodeManager() {}
+NodeManager::NodeManager() {
+    _nodes.Modify(_init);
+}
 
 NodeManager::~NodeManager() {}
 
@@ -68,6 +79,14 @@ int NodeManager::add_service(brpc::Server* server,
         LOG(ERROR) << "Fail to add RaftStatService";
         return -1;
     }
+    if (0 != server->AddService(new RaftLockStatImpl, brpc::SERVER_OWNS_SERVICE)) {
+        LOG(ERROR) << "Fail to add RaftLockStatService";
+        return -1;
+    }
+    if (0 != server->AddService(new RaftMetricsImpl, brpc::SERVER_OWNS_SERVICE)) {
+        LOG(ERROR) << "Fail to add RaftMetricsService";
+        return -1;
+    }
     if (0 != server->AddService(new CliServiceImpl, brpc::SERVER_OWNS_SERVICE)) {
         LOG(ERROR) << "Fail to add CliService";
         return -1;
@@ -80,35 +99,46 @@ int NodeManager::add_service(brpc::Server* server,
     return 0;
 }
 
+size_t NodeManager::_init(Maps& m) {
+    CHECK_EQ(0, m.group_map.init(1024));
+    return 1;
+}
+
 size_t NodeManager::_add_node(Maps& m, const NodeImpl* node) {
     NodeId node_id = node->node_id();
-    std::pair<NodeMap::iterator, bool> ret = m.node_map.insert(
-            NodeMap::value_type(node_id, const_cast<NodeImpl*>(node)));
-    if (ret.second) {
-        m.group_map.insert(GroupMap::value_type(
-                    node_id.group_id, const_cast<NodeImpl*>(node)));
-        return 1;
+    GroupNodes& nodes = m.group_map[node_id.group_id];
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (nodes[i].peer_id == node_id.peer_id) {
+            return 0;
+        }
     }
-    return 0;
+    GroupNode gn;
+    gn.peer_id = node_id.peer_id;
+    gn.peer_id_str = node_id.peer_id.to_string();
+    gn.node = const_cast<NodeImpl*>(node);
+    nodes.push_back(gn);
+    ++m.node_count;
+    return 1;
 }
 
 size_t NodeManager::_remove_node(Maps& m, const NodeImpl* node) {
-    NodeMap::iterator iter = m.node_map.find(node->node_id());
-    if (iter == m.node_map.end() || iter->second.get() != node) {
-                                  // ^^
-                                  // Avoid duplicated nodes
+    const NodeId node_id = node->node_id();
+    GroupNodes* nodes = m.group_map.seek(node_id.group_id);
+    if (nodes == NULL) {
         return 0;
     }
-    m.node_map.erase(iter);
-    std::pair<GroupMap::iterator, GroupMap::iterator> 
-            range = m.group_map.equal_range(node->node_id().group_id);
-    for (GroupMap::iterator it = range.first; it != range.second; ++it) {
-        if (it->second == node) {
-            m.group_map.erase(it);
+    for (size_t i = 0; i < nodes->size(); ++i) {
+        if ((*nodes)[i].node.get() == node) {
+                        // ^^
+                        // Avoid duplicated nodes
+            nodes->erase(nodes->begin() + i);
+            if (nodes->empty()) {
+                m.group_map.erase(node_id.group_id);
+            }
+            --m.node_count;
             return 1;
         }
     }
-    CHECK(false) << "Can't reach here";
     return 0;
 }
 
@@ -130,13 +160,49 @@ scoped_refptr<NodeImpl> NodeManager::get(const GroupId& group_id, const PeerId&
     if (_nodes.Read(&ptr) != 0) {
         return NULL;
     }
-    NodeMap::const_iterator it = ptr->node_map.find(NodeId(group_id, peer_id));
-    if (it != ptr->node_map.end()) {
-        return it->second;
+    const GroupNodes* nodes = ptr->group_map.seek(group_id);
+    if (nodes == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < nodes->size(); ++i) {
+        if ((*nodes)[i].peer_id == peer_id) {
+            return (*nodes)[i].node;
+        }
     }
     return NULL;
 }
 
+scoped_refptr<NodeImpl> NodeManager::find(const GroupId& group_id,
+                                          const std::string& peer_id,
+                                          int* error_code) {
+    {
+        butil::DoublyBufferedData<Maps>::ScopedPtr ptr;
+        if (_nodes.Read(&ptr) != 0) {
+            *error_code = ENOENT;
+            return NULL;
+        }
+        const GroupNodes* nodes = ptr->group_map.seek(group_id);
+        if (nodes != NULL) {
+            // The peers put in the requests are formatted in the same way
+            for (size_t i = 0; i < nodes->size(); ++i) {
+                if ((*nodes)[i].peer_id_str == peer_id) {
+                    return (*nodes)[i].node;
+                }
+            }
+        }
+    }
+    PeerId parsed_peer_id;
+    if (parsed_peer_id.parse(peer_id) != 0) {
+        *error_code = EINVAL;
+        return NULL;
+    }
+    scoped_refptr<NodeImpl> node = get(group_id, parsed_peer_id);
+    if (node == NULL) {
+        *error_code = ENOENT;
+    }
+    return node;
+}
+
 void NodeManager::get_nodes_by_group_id(
         const GroupId& group_id, std::vector<scoped_refptr<NodeImpl> >* nodes) {
 
@@ -145,25 +211,232 @@ void NodeManager::get_nodes_by_group_id(
     if (_nodes.Read(&ptr) != 0) {
         return;
     }
-    std::pair<GroupMap::const_iterator, GroupMap::const_iterator> 
-            range = ptr->group_map.equal_range(group_id);
-    for (GroupMap::const_iterator it = range.first; it != range.second; ++it) {
-        nodes->push_back(it->second);
+    const GroupNodes* group_nodes = ptr->group_map.seek(group_id);
+    if (group_nodes == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < group_nodes->size(); ++i) {
+        nodes->push_back((*group_nodes)[i].node);
     }
 }
 
+struct NodeGroupLess {
+    bool operator()(const scoped_refptr<NodeImpl>& n1,
+                    const scoped_refptr<NodeImpl>& n2) const {
+        return n1->node_id().group_id < n2->node_id().group_id;
+    }
+};
+
 void NodeManager::get_all_nodes(std::vector<scoped_refptr<NodeImpl> >* nodes) {
     nodes->clear();
-    butil::DoublyBufferedData<Maps>::ScopedPtr ptr;
-    if (_nodes.Read(&ptr) != 0) {
-        return;
+    {
+        butil::DoublyBufferedData<Maps>::ScopedPtr ptr;
+        if (_nodes.Read(&ptr) != 0) {
+            return;
+        }
+        nodes->reserve(ptr->node_count);
+        for (GroupMap::const_iterator
+                it = ptr->group_map.begin(); it != ptr->group_map.end(); ++it) {
+            for (size_t i = 0; i < it->second.size(); ++i) {
+                nodes->push_back(it->second[i].node);
+            }
+        }
+    }
+    // List the nodes by group as before
+    std::stable_sort(nodes->begin(), nodes->end(), NodeGroupLess());
+}
+
+namespace {
+
+// The path of the local:// storage at |uri|, empty otherwise
+std::string local_path_of(const std::string& uri) {
+    const std::string prefix = "local://";
+    if (uri.compare(0, prefix.size(), prefix) != 0) {
+        return std::string();
     }
-    nodes->reserve(ptr->group_map.size());
-    for (GroupMap::const_iterator 
-            it = ptr->group_map.begin(); it != ptr->group_map.end(); ++it) {
-        nodes->push_back(it->second);
+    std::string path = uri.substr(prefix.size());
+    const size_t query_pos = path.find('?');
+    if (query_pos != std::string::npos) {
+        path.erase(query_pos);
     }
+    return path;
 }
 
-}  //  namespace braft
+int64_t local_log_size(const std::string& log_uri) {
+    const std::string path = local_path_of(log_uri);
+    if (path.empty()) {
+        return 0;
+    }
+    int64_t size = 0;
+    butil::FileEnumerator files(butil::FilePath(path), false,
+                                butil::FileEnumerator::FILES);
+    for (butil::FilePath file = files.Next(); !file.empty();
+            file = files.Next()) {
+        size += files.GetInfo().GetSize();
+    }
+    return size;
+}
+
+bool voted_for_self(const std::string& raft_meta_uri, const PeerId& self) {
+    if (local_path_of(raft_meta_uri).empty()) {
+        return false;
+    }
+    RaftMetaStorage* meta = RaftMetaStorage::create(raft_meta_uri);
+    if (meta == NULL) {
+        return false;
+    }
+    PeerId votedfor;
+    const bool voted_self = meta->init() == 0 &&
+            meta->get_votedfor(&votedfor) == 0 && votedfor == self;
+    delete meta;
+    return voted_self;
+}
+
+struct PendingInit {
+    NodeInitTask* task;
+    uint64_t disk;
+    bool voted_self;
+    int64_t log_size;
+};
+
+struct PendingInitOrder {
+    bool operator()(const PendingInit& lhs, const PendingInit& rhs) const {
+        if (lhs.task->priority != rhs.task->priority) {
+            return lhs.task->priority > rhs.task->priority;
+        }
+        if (lhs.voted_self != rhs.voted_self) {
+            return lhs.voted_self;
+        }
+        return lhs.log_size < rhs.log_size;
+    }
+};
+
+class InitScheduler {
+public:
+    InitScheduler(std::vector<PendingInit>* pending, int max_per_disk)
+        : _max_per_disk(max_per_disk), _failed(0) {
+        _pending.swap(*pending);
+        _next = _pending.begin();
+    }
+
+    static void* run(void* arg) {
+        InitScheduler* scheduler = (InitScheduler*)arg;
+        PendingInit p;
+        while (scheduler->pick(&p)) {
+            NodeInitTask* task = p.task;
+            task->rc = task->node->init(task->options);
+            scheduler->on_done(p);
+            if (task->done) {
+                if (task->rc != 0) {
+                    task->done->status().set_error(EINVAL,
+                            "Fail to init node %s",
+                            task->node->node_id().to_string().c_str());
+                }
+                task->done->Run();
+            }
+        }
+        return NULL;
+    }
 
+    int failed() const { return _failed; }
+
+private:
+    // Pick the first pending task whose disk is not busy, waiting if all of
+    // them are. Returns false once there's no pending task.
+    bool pick(PendingInit* p) {
+        std::unique_lock<bthread::Mutex> lck(_mutex);
+        while (true) {
+            if (_next == _pending.end()) {
+                return false;
+            }
+            for (std::vector<PendingInit>::iterator
+                    it = _next; it != _pending.end(); ++it) {
+                if (it->task == NULL) {
+                    continue;
+                }
+                int& running = _running[it->disk];
+                if (_max_per_disk > 0 && running >= _max_per_disk) {
+                    continue;
+                }
+                ++running;
+                *p = *it;
+                it->task = NULL;
+                while (_next != _pending.end() && _next->task == NULL) {
+                    ++_next;
+                }
+                return true;
+            }
+            _cond.wait(lck);
+        }
+    }
+
+    void on_done(const PendingInit& p) {
+        std::unique_lock<bthread::Mutex> lck(_mutex);
+        --_running[p.disk];
+        if (p.task->rc != 0) {
+            ++_failed;
+        }
+        _cond.notify_all();
+    }
+
+    const int _max_per_disk;
+    bthread::Mutex _mutex;
+    bthread::ConditionVariable _cond;
+    std::vector<PendingInit> _pending;
+    // The first task not picked yet
+    std::vector<PendingInit>::iterator _next;
+    std::map<uint64_t, int> _running;
+    int _failed;
+};
+
+}  // namespace
+
+int NodeManager::init_nodes(std::vector<NodeInitTask>* tasks,
+                            const InitNodesOptions& options) {
+    if (tasks->empty()) {
+        return 0;
+    }
+    const int64_t start_ms = butil::monotonic_time_ms();
+    std::vector<PendingInit> pending(tasks->size());
+    for (size_t i = 0; i < tasks->size(); ++i) {
+        NodeInitTask* task = &(*tasks)[i];
+        PendingInit& p = pending[i];
+        p.task = task;
+        p.disk = SnapshotScheduler::disk_of(task->options.log_uri);
+        p.voted_self = false;
+        p.log_size = 0;
+        if (options.estimate_priority) {
+            p.voted_self = voted_for_self(task->options.raft_meta_uri,
+                                          task->node->node_id().peer_id);
+            p.log_size = local_log_size(task->options.log_uri);
+        }
+    }
+    std::stable_sort(pending.begin(), pending.end(), PendingInitOrder());
+
+    InitScheduler scheduler(&pending, options.max_concurrent_per_disk);
+    const size_t concurrency = std::min(
+            (size_t)std::max(options.concurrency, 1), tasks->size());
+    std::vector<bthread_t> tids;
+    for (size_t i = 0; i < concurrency; ++i) {
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, InitScheduler::run,
+                                     &scheduler) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            break;
+        }
+        tids.push_back(tid);
+    }
+    if (tids.empty()) {
+        InitScheduler::run(&scheduler);
+    }
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    LOG(INFO) << "Initialized " << tasks->size() - scheduler.failed()
+              << " of " << tasks->size() << " nodes with concurrency="
+              << tids.size() << " in "
+              << butil::monotonic_time_ms() - start_ms << "ms";
+    return scheduler.failed() == 0 ? 0 : -1;
+}
+
+}  //  namespace braft
@@ -19,6 +19,7 @@
 
 #include <butil/memory/singleton.h>
 #include <butil/containers/doubly_buffered_data.h>
+#include <butil/containers/flat_map.h>
 #include "braft/raft.h"
 #include "braft/util.h"
 
@@ -41,6 +42,14 @@ public:
     // get node by group_id and peer_id
     scoped_refptr<NodeImpl> get(const GroupId& group_id, const PeerId& peer_id);
 
+    // Same as get(), but takes |peer_id| in the string form of the requests,
+    // which is parsed only if it's not the same string as the one of the
+    // node. Returns NULL with |error_code| set to EINVAL if |peer_id| is
+    // invalid, or ENOENT if the node doesn't exist
+    scoped_refptr<NodeImpl> find(const GroupId& group_id,
+                                 const std::string& peer_id,
+                                 int* error_code);
+
     // get all the nodes of |group_id|
     void get_nodes_by_group_id(const GroupId& group_id, 
                                std::vector<scoped_refptr<NodeImpl> >* nodes);
@@ -57,22 +66,33 @@ public:
     // Remove the addr from _addr_set when the backing service is destroyed
     void remove_address(butil::EndPoint addr);
 
+    // Initialize the nodes of |tasks| with a bounded pool of bthreads,
+    // see braft::init_nodes
+    int init_nodes(std::vector<NodeInitTask>* tasks,
+                   const InitNodesOptions& options);
+
 private:
     NodeManager();
     ~NodeManager();
     DISALLOW_COPY_AND_ASSIGN(NodeManager);
     friend struct DefaultSingletonTraits<NodeManager>;
     
-    // TODO(chenzhangyi01): replace std::map with FlatMap
-    // To make implementation simplicity, we use two maps here, although
-    // it works practically with only one GroupMap
-    typedef std::map<NodeId, scoped_refptr<NodeImpl> > NodeMap;
-    typedef std::multimap<GroupId, NodeImpl* > GroupMap;
+    // The nodes of a group in the order they were added, there's usually
+    // only one of them in a process
+    struct GroupNode {
+        PeerId peer_id;
+        std::string peer_id_str;
+        scoped_refptr<NodeImpl> node;
+    };
+    typedef std::vector<GroupNode> GroupNodes;
+    typedef butil::FlatMap<GroupId, GroupNodes> GroupMap;
     struct Maps {
-        NodeMap node_map;
+        Maps() : node_count(0) {}
         GroupMap group_map;
+        size_t node_count;
     };
     // Functor to modify DBD
+    static size_t _init(Maps&);
     static size_t _add_node(Maps&, const NodeImpl* node);
     static size_t _remove_node(Maps&, const NodeImpl* node);
 
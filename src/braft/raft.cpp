@@ -16,8 +16,10 @@
 //          Wang,Yao(wangyao02@baidu.com)
 
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <butil/string_printf.h>
+#include <butil/file_util.h>
 #include <butil/class_name.h>
 #include "braft/raft.h"
 #include "braft/node.h"
@@ -25,9 +27,12 @@
 #include "braft/node_manager.h"
 #include "braft/log.h"
 #include "braft/memory_log.h"
+#include "braft/shared_log.h"
 #include "braft/raft_meta.h"
+#include "braft/shared_meta.h"
 #include "braft/snapshot.h"
 #include "braft/fsm_caller.h"            // IteratorImpl
+#include "braft/transport.h"
 
 namespace braft {
 
@@ -48,8 +53,12 @@ static pthread_once_t global_init_once = PTHREAD_ONCE_INIT;
 struct GlobalExtension {
     SegmentLogStorage local_log;
     MemoryLogStorage memory_log;
+    SharedLogStorage shared_log;
     LocalRaftMetaStorage local_meta;
+    SharedRaftMetaStorage shared_meta;
     LocalSnapshotStorage local_snapshot;
+    TcpTransport tcp_transport;
+    RdmaTransport rdma_transport;
 };
 
 static void global_init_or_die_impl() {
@@ -57,8 +66,12 @@ static void global_init_or_die_impl() {
 
     log_storage_extension()->RegisterOrDie("local", &s_ext.local_log);
     log_storage_extension()->RegisterOrDie("memory", &s_ext.memory_log);
+    log_storage_extension()->RegisterOrDie("shared", &s_ext.shared_log);
     meta_storage_extension()->RegisterOrDie("local", &s_ext.local_meta);
+    meta_storage_extension()->RegisterOrDie("shared", &s_ext.shared_meta);
     snapshot_storage_extension()->RegisterOrDie("local", &s_ext.local_snapshot);
+    transport_extension()->RegisterOrDie("tcp", &s_ext.tcp_transport);
+    transport_extension()->RegisterOrDie("rdma", &s_ext.rdma_transport);
 }
 
 // Non-static for unit test
@@ -74,6 +87,15 @@ int add_service(brpc::Server* server, const butil::EndPoint& listen_addr) {
     return NodeManager::GetInstance()->add_service(server, listen_addr);
 }
 
+int setup_server_options(brpc::ServerOptions* options) {
+    const Transport* transport = current_transport();
+    if (transport == NULL) {
+        LOG(ERROR) << "Fail to find transport " << FLAGS_raft_transport;
+        return -1;
+    }
+    return transport->setup_server(options);
+}
+
 int add_service(brpc::Server* server, int port) {
     butil::EndPoint addr(butil::IP_ANY, port);
     return add_service(server, addr);
@@ -128,6 +150,18 @@ void Node::apply(const Task& task) {
     _impl->apply(task);
 }
 
+void Node::apply(const std::vector<Task>& tasks) {
+    _impl->apply(tasks, NULL);
+}
+
+void Node::apply(const std::vector<Task>& tasks, Closure* done) {
+    _impl->apply(tasks, done);
+}
+
+void Node::read_index(Closure* done) {
+    _impl->read_index(done);
+}
+
 butil::Status Node::list_peers(std::vector<PeerId>* peers) {
     return _impl->list_peers(peers);
 }
@@ -144,6 +178,27 @@ void Node::change_peers(const Configuration& new_peers, Closure* done) {
     _impl->change_peers(new_peers, done);
 }
 
+butil::Status Node::list_learners(std::vector<PeerId>* learners) {
+    return _impl->list_learners(learners);
+}
+
+void Node::add_learners(const std::vector<PeerId>& learners, Closure* done) {
+    _impl->add_learners(learners, done);
+}
+
+void Node::remove_learners(const std::vector<PeerId>& learners, Closure* done) {
+    _impl->remove_learners(learners, done);
+}
+
+butil::Status Node::set_relay(const PeerId& peer, const PeerId& relay) {
+    return _impl->set_relay(peer, relay);
+}
+
+butil::Status Node::set_snapshot_donor(const PeerId& peer,
+                                       const PeerId& donor) {
+    return _impl->set_snapshot_donor(peer, donor);
+}
+
 butil::Status Node::reset_peers(const Configuration& new_peers) {
     return _impl->reset_peers(new_peers);
 }
@@ -168,6 +223,15 @@ butil::Status Node::read_committed_user_log(const int64_t index, UserLog* user_l
     return _impl->read_committed_user_log(index, user_log);
 }
 
+int Node::subscribe_logs(const LogSubscriptionOptions& options,
+                         LogSubscriber* subscriber, int64_t* subscription_id) {
+    return _impl->subscribe_logs(options, subscriber, subscription_id);
+}
+
+int Node::unsubscribe_logs(int64_t subscription_id) {
+    return _impl->unsubscribe_logs(subscription_id);
+}
+
 void Node::get_status(NodeStatus* status) {
     return _impl->get_status(status);
 }
@@ -192,7 +256,7 @@ void Iterator::next() {
 }
 
 bool Iterator::valid() const {
-    return _impl->is_good() && _impl->entry()->type == ENTRY_TYPE_DATA;
+    return _impl->is_task();
 }
 
 int64_t Iterator::index() const { return _impl->index(); }
@@ -200,13 +264,21 @@ int64_t Iterator::index() const { return _impl->index(); }
 int64_t Iterator::term() const { return _impl->entry()->id.term; }
 
 const butil::IOBuf& Iterator::data() const {
-    return _impl->entry()->data;
+    return _impl->data();
+}
+
+int64_t Iterator::partition_key() const {
+    return _impl->partition_key();
 }
 
 Closure* Iterator::done() const {
     return _impl->done();
 }
 
+Closure* Iterator::ticket() {
+    return _impl->ticket();
+}
+
 void Iterator::set_error_and_rollback(size_t ntail, const butil::Status* st) {
     return _impl->set_error_and_rollback(ntail, st);
 }
@@ -225,6 +297,10 @@ void StateMachine::on_snapshot_save(SnapshotWriter* writer, Closure* done) {
     done->Run();
 }
 
+SnapshotHook* StateMachine::on_snapshot_freeze() {
+    return NULL;
+}
+
 int StateMachine::on_snapshot_load(SnapshotReader* reader) {
     (void)reader;
     LOG(ERROR) << butil::class_name_str(*this)
@@ -233,6 +309,10 @@ int StateMachine::on_snapshot_load(SnapshotReader* reader) {
     return -1;
 }
 
+int64_t StateMachine::on_applied_index_load() {
+    return 0;
+}
+
 void StateMachine::on_leader_start(int64_t) {}
 void StateMachine::on_leader_stop(const butil::Status&) {}
 void StateMachine::on_error(const Error& e) {
@@ -261,6 +341,7 @@ BootstrapOptions::BootstrapOptions()
     , fsm(NULL)
     , node_owns_fsm(false)
     , usercode_in_pthread(false)
+    , from_local_snapshot(false)
 {}
 
 int bootstrap(const BootstrapOptions& options) {
@@ -273,4 +354,95 @@ int bootstrap(const BootstrapOptions& options) {
     return rc;
 }
 
+int init_nodes(std::vector<NodeInitTask>* tasks,
+               const InitNodesOptions& options) {
+    global_init_once_or_die();
+    return NodeManager::GetInstance()->init_nodes(tasks, options);
+}
+
+#ifdef BRAFT_WITH_BTHREAD_TAG
+
+// CPUs of each NUMA node, never freed as the workers might start any time
+static std::vector<cpu_set_t>* g_numa_node_cpus = NULL;
+
+static void bind_worker_to_numa_node(bthread_tag_t tag) {
+    const cpu_set_t& cpus = (*g_numa_node_cpus)[tag % g_numa_node_cpus->size()];
+    const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc != 0) {
+        LOG(WARNING) << "Fail to bind the worker of tag=" << tag
+                     << " to NUMA node " << tag % g_numa_node_cpus->size()
+                     << ", " << berror(rc);
+    }
+}
+
+// Parse the cpulist of sysfs, e.g. "0-15,32-47"
+static int parse_cpu_list(const std::string& list, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    const char* p = list.c_str();
+    while (*p != '\0' && *p != '\n') {
+        char* end = NULL;
+        const long first = strtol(p, &end, 10);
+        if (end == p) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*p == ',') {
+            ++p;
+        }
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+#endif  // BRAFT_WITH_BTHREAD_TAG
+
+int bind_bthread_tags_to_numa_nodes() {
+#ifdef BRAFT_WITH_BTHREAD_TAG
+    if (g_numa_node_cpus != NULL) {
+        return 0;
+    }
+    std::vector<cpu_set_t>* nodes = new std::vector<cpu_set_t>;
+    for (int i = 0; ; ++i) {
+        std::string list;
+        if (!butil::ReadFileToString(butil::FilePath(butil::string_printf(
+                "/sys/devices/system/node/node%d/cpulist", i)), &list)) {
+            break;
+        }
+        cpu_set_t cpus;
+        if (parse_cpu_list(list, &cpus) != 0) {
+            LOG(ERROR) << "Invalid cpulist=`" << list << "' of NUMA node " << i;
+            delete nodes;
+            return -1;
+        }
+        nodes->push_back(cpus);
+    }
+    if (nodes->empty()) {
+        LOG(ERROR) << "Fail to find NUMA nodes";
+        delete nodes;
+        return -1;
+    }
+    g_numa_node_cpus = nodes;
+    if (bthread_set_tagged_worker_startfn(bind_worker_to_numa_node) != 0) {
+        LOG(ERROR) << "Fail to set the start function of bthread workers";
+        return -1;
+    }
+    LOG(INFO) << "Bind bthread tags to " << nodes->size() << " NUMA nodes";
+    return 0;
+#else
+    LOG(ERROR) << "bthread tags are not supported by brpc";
+    return -1;
+#endif  // BRAFT_WITH_BTHREAD_TAG
+}
+
 }
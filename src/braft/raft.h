@@ -21,6 +21,7 @@
 #define BRAFT_RAFT_H
 
 #include <string>
+#include <vector>
 
 #include <butil/logging.h>
 #include <butil/iobuf.h>
@@ -33,6 +34,7 @@ template <typename T> class scoped_refptr;
 
 namespace brpc {
 class Server;
+struct ServerOptions;
 }  // namespace brpc
 
 namespace braft {
@@ -105,7 +107,7 @@ inline std::ostream& operator<<(std::ostream& os, const Error& e) {
 
 // Basic message structure of libraft
 struct Task {
-    Task() : data(NULL), done(NULL), expected_term(-1) {}
+    Task() : data(NULL), done(NULL), expected_term(-1), partition_key(-1) {}
 
     // The data applied to StateMachine
     butil::IOBuf* data;
@@ -117,6 +119,15 @@ struct Task {
     // this Node if the value is not -1
     // Default: -1
     int64_t expected_term;
+
+    // Tasks with the same non-negative key are applied in order by the same
+    // lane of ParallelStateMachine, while the tasks with different keys could
+    // be applied concurrently. Tasks with a negative key are applied by
+    // on_apply after all the previous tasks are applied. The key is
+    // replicated along with the data, and such tasks are never packed with
+    // the others by raft_coalesce_tasks.
+    // Default: -1
+    int64_t partition_key;
 };
 
 class IteratorImpl;
@@ -143,6 +154,8 @@ public:
     //  - Monotonicity guarantees that for any index pair i, j (i < j), task 
     //    at index |i| must be applied before task at index |j| in all the 
     //    peers from the group.
+    // The tasks packed in one log with raft_coalesce_tasks share the index of
+    // the log, and are iterated in the order they were applied.
     int64_t index() const;
 
     // Returns the term of the leader which to task was applied to.
@@ -152,6 +165,10 @@ public:
     // Node::apply in the leader node.
     const butil::IOBuf& data() const;
 
+    // Return the partition_key of the task passed to Node::apply, -1 if
+    // it's not set.
+    int64_t partition_key() const;
+
     // If done() is non-NULL, you must call done()->Run() after applying this
     // task no matter this operation succeeds or fails, otherwise the
     // corresponding resources would leak.
@@ -163,6 +180,19 @@ public:
     // StateMachine with the given task. Otherweise done() must be NULL.
     Closure* done() const;
 
+    // Take the ticket of the tasks iterated by this on_apply, which returns
+    // the same ticket if it's called again in this on_apply. Once a ticket
+    // is taken, the tasks of this on_apply and all the following ones don't
+    // count as applied until the ticket is Run() with the result of the
+    // tasks, so that the StateMachine could return before the tasks are
+    // durable, e.g. in an asynchronous storage engine, and keep several
+    // batches in flight. A failed status is regarded as a critical error of
+    // the StateMachine.
+    // The ticket must be Run() without waiting for the following on_apply,
+    // as snapshots and shutdown wait for all the tickets. It's NULL in
+    // ParallelStateMachine::on_apply_lane.
+    Closure* ticket();
+
     // Return true this iterator is currently references to a valid task, false
     // otherwise, indicating that the iterator has reached the end of this
     // batch of tasks or some error has occurred
@@ -186,6 +216,19 @@ friend class FSMCaller;
     IteratorImpl* _impl;
 };
 
+// A frozen view of the StateMachine taken by StateMachine::on_snapshot_freeze,
+// e.g. a RocksDB checkpoint, which is saved in a background bthread while
+// the StateMachine keeps applying the following tasks.
+class SnapshotHook {
+public:
+    virtual ~SnapshotHook() {}
+
+    // Save the frozen view to |writer|, which is called in a background
+    // bthread and may block.
+    // success return 0, fail return errno
+    virtual int save(::braft::SnapshotWriter* writer) = 0;
+};
+
 // |StateMachine| is the sink of all the events of a very raft node.
 // Implement a specific StateMachine for your own business logic.
 //
@@ -221,12 +264,27 @@ public:
     virtual void on_snapshot_save(::braft::SnapshotWriter* writer,
                                   ::braft::Closure* done);
 
+    // Take a frozen view of the StateMachine at the point of the snapshot
+    // instead of saving it in on_snapshot_save. This method blocks on_apply
+    // as well, so the view should be cheap to take. braft saves the returned
+    // hook in a background bthread and deletes it after that, and
+    // on_snapshot_save is not called.
+    // Default: Return NULL, the snapshot is saved by on_snapshot_save.
+    virtual SnapshotHook* on_snapshot_freeze();
+
     // user defined snapshot load function
     // get and load snapshot
     // success return 0, fail return errno
     // Default: Load nothing and returns error.
     virtual int on_snapshot_load(::braft::SnapshotReader* reader);
 
+    // Invoked once when the node starts, after the snapshot is loaded, to get
+    // the index of the last log whose effect has been persisted by the
+    // StateMachine itself (e.g. in the WAL of RocksDB). The logs up to it are
+    // not applied again, including the configurations.
+    // Default: Return 0, all the logs after the snapshot are applied again.
+    virtual int64_t on_applied_index_load();
+
     // Invoked when the belonging node becomes the leader of the group at |term|
     // Default: Do nothing
     virtual void on_leader_start(int64_t term);
@@ -266,6 +324,25 @@ public:
     virtual void on_start_following(const ::braft::LeaderChangeContext& ctx);
 };
 
+// |ParallelStateMachine| applies the tasks with partition keys in
+// lane_num() lanes concurrently, and a task goes to the lane of
+// partition_key % lane_num(), so that the tasks of the same key are applied
+// in order. The other tasks and events are still applied sequentially by the
+// interfaces of StateMachine, after the lanes have applied all the tasks
+// before, so on_apply, on_snapshot_save and the others never run
+// concurrently with on_apply_lane. The applied index advances once all the
+// lanes have applied the logs up to it.
+class ParallelStateMachine : public StateMachine {
+public:
+    // Number of the lanes, which must not change once the node starts
+    virtual int lane_num() const = 0;
+
+    // Update the StateMachine with a batch of the tasks of |lane| in the order
+    // of their indexes, which are accessed through |iter| like on_apply.
+    // Invoked concurrently for different lanes.
+    virtual void on_apply_lane(int lane, ::braft::Iterator& iter) = 0;
+};
+
 enum State {
     // Don't change the order if you are not sure about the usage.
     STATE_LEADER = 1,
@@ -334,32 +411,102 @@ public:
         , _data(log_data)
     {};
     int64_t log_index() const { return _index; }
+    // The first task of the log
     const butil::IOBuf& log_data() const { return _data; }
+    // All the tasks of the log, which has more than one if they were applied
+    // in a batch, see Node::apply(const std::vector<Task>&, Closure*)
+    size_t task_count() const { return _batch.empty() ? 1 : _batch.size(); }
+    const butil::IOBuf& task_data(size_t i) const {
+        return _batch.empty() ? _data : _batch[i];
+    }
     void set_log_index(const int64_t log_index) { _index = log_index; }
-    void set_log_data(const butil::IOBuf& log_data) { _data = log_data; }
+    void set_log_data(const butil::IOBuf& log_data) {
+        _data = log_data;
+        _batch.clear();
+    }
+    // Swap in the non-empty |task_datas|
+    void set_task_datas(std::vector<butil::IOBuf>* task_datas) {
+        _batch.swap(*task_datas);
+        _data = _batch[0];
+    }
     void reset() {
         _index = 0;
         _data.clear();
+        _batch.clear();
     }
 
 private:
     int64_t _index;
     butil::IOBuf _data;
+    std::vector<butil::IOBuf> _batch;
 };
 
 inline std::ostream& operator<<(std::ostream& os, const UserLog& user_log) {
     os << "{user_log: index=" << user_log.log_index()
        << ", data size=" << user_log.log_data().size()
+       << ", task count=" << user_log.task_count()
        << "}";
     return os;
 }
 
+// A task committed in the group, delivered to LogSubscriber. The tasks
+// packed in one log are delivered one by one with the same index.
+struct SubscribedLog {
+    SubscribedLog() : index(0) {}
+    int64_t index;
+    // References the data of the log without copying
+    butil::IOBuf data;
+};
+
+// Receives the committed tasks of a group in order, see Node::subscribe_logs
+class LogSubscriber {
+public:
+    virtual ~LogSubscriber() {}
+
+    // Called with the tasks applied after the last batch. The next batch is
+    // not delivered until |done| is run, so a slow subscriber holds the
+    // delivery back instead of missing the logs, as long as they are pinned.
+    // |logs| is valid until |done| is run.
+    virtual void on_logs(const std::vector<SubscribedLog>& logs,
+                         Closure* done) = 0;
+
+    // Called once the subscription ends, after which the subscriber is not
+    // touched any more. The status is:
+    //     - ECANCELED if Node::unsubscribe_logs was called;
+    //     - ELOGDELETED if the logs to deliver were dropped, e.g. the node
+    //       installed a snapshot, or the pinned logs were beyond the budget;
+    //     - ENODESHUTDOWN if the node shut down.
+    virtual void on_stop(const butil::Status& status) = 0;
+};
+
+struct LogSubscriptionOptions {
+    LogSubscriptionOptions()
+        : start_index(1), max_batch_count(128)
+        , max_batch_bytes(1024 * 1024), pin_logs(true) {}
+
+    // Deliver the tasks of the logs from this index on
+    int64_t start_index;
+
+    // A batch reads at most this many logs, and stops before the data of the
+    // logs exceed |max_batch_bytes| unless there's only one
+    size_t max_batch_count;
+    size_t max_batch_bytes;
+
+    // Whether the logs not yet delivered are kept by the snapshots, as long
+    // as they are within raft_retained_log_bytes and
+    // raft_retained_log_max_age_s like the logs of the lagging followers
+    bool pin_logs;
+};
+
 // Status of a peer
 struct PeerStatus {
     PeerStatus()
         : valid(false), installing_snapshot(false), next_index(0)
         , last_rpc_send_timestamp(0), flying_append_entries_size(0)
         , readonly_index(0), consecutive_error_times(0)
+        , lag(0), since_last_success_ms(-1), append_entries_latency_us(0)
+        , append_entries_latency_p99_us(0), entries_per_rpc(0)
+        , bytes_per_rpc(0)
     {}
 
     bool    valid;
@@ -369,6 +516,16 @@ struct PeerStatus {
     int64_t flying_append_entries_size;
     int64_t readonly_index;
     int     consecutive_error_times;
+    // Number of the logs not acked by the peer yet
+    int64_t lag;
+    // Time since the last successful AppendEntries with logs, -1 if none
+    int64_t since_last_success_ms;
+    // Recent latency and size of the AppendEntries with logs, 0 unless
+    // raft_expose_replicator_bvars is on
+    int64_t append_entries_latency_us;
+    int64_t append_entries_latency_p99_us;
+    int64_t entries_per_rpc;
+    int64_t bytes_per_rpc;
 };
 
 // Status of Node
@@ -380,7 +537,8 @@ public:
     NodeStatus()
         : state(STATE_END), readonly(false), term(0), committed_index(0), known_applied_index(0)
         , pending_index(0), pending_queue_size(0), applying_index(0), first_index(0)
-        , last_index(-1), disk_index(0)
+        , last_index(-1), disk_index(0), durable_index(0), logs_in_memory_bytes(0)
+        , snapshot_index(0), saving_snapshot(false), installing_snapshot(false)
     {}
 
     State state;
@@ -423,6 +581,24 @@ public:
     // The max log in disk.
     int64_t disk_index;
 
+    // The max log fsynced, which is the same as disk_index unless
+    // NodeOptions::relaxed_log_durability is on, in which case the logs in
+    // (durable_index, disk_index] might be lost on a crash.
+    int64_t durable_index;
+
+    // Data bytes of the logs in memory which are not flushed or applied yet.
+    //
+    // WARNING: new tasks are rejected with EBUSY when this reaches
+    // raft_max_logs_in_memory_bytes, users can consider to slow down the
+    // writing rate before that.
+    int64_t logs_in_memory_bytes;
+
+    // The last log included in the latest snapshot of the node, and whether
+    // a snapshot is being saved or installed.
+    int64_t snapshot_index;
+    bool saving_snapshot;
+    bool installing_snapshot;
+
     // Stable followers are peers in current configuration.
     // If the node is not leader, this map is empty.
     PeerStatusMap stable_followers;
@@ -445,6 +621,20 @@ struct NodeOptions {
     // Default: 3600 (1 hour)
     int snapshot_interval_s;
 
+    // A snapshot saving would also be triggered once the logs applied since
+    // the last snapshot reach |snapshot_log_entries|, or the logs appended
+    // since then reach |snapshot_log_bytes| bytes, but not within
+    // |snapshot_min_interval_s| seconds since the last one. Non-positive
+    // values disable the corresponding condition.
+    // The snapshots triggered by the timer or these conditions are saved
+    // through the process-wide scheduler limited by
+    // raft_max_concurrent_snapshots_per_disk.
+    //
+    // Default: 0, 0, 0
+    int64_t snapshot_log_entries;
+    int64_t snapshot_log_bytes;
+    int snapshot_min_interval_s;
+
     // We will regard a adding peer as caught up if the margin between the
     // last_log_index of this peer and the last_log_index of leader is less than
     // |catchup_margin|
@@ -491,6 +681,8 @@ struct NodeOptions {
     std::string log_uri;
 
     // Describe a specific RaftMetaStorage in format ${type}://${parameters}
+    // e.g. shared://${dir}?group=${group} keeps the meta of all the groups
+    // sharing |dir| in one file, whose updates share fsyncs.
     std::string raft_meta_uri;
 
     // Describe a specific SnapshotStorage in format ${type}://${parameters}
@@ -514,6 +706,56 @@ struct NodeOptions {
     // Default: false
     bool disable_cli;
 
+    // If true, this node is a witness, which votes and persists the logs
+    // without data like other voting peers, but never applies the logs to
+    // |fsm| or loads snapshots into it, and never becomes the leader. The
+    // snapshots of a witness consist of the meta only.
+    // The peer should be added to the group as a witness (e.g.
+    // "ip:port:idx:1"), so that the leader sends it no data.
+    // Default: false
+    bool witness;
+
+    // If true, the leader serves read_index() locally while it holds the
+    // lease, which starts at the sending time of the heartbeats acked by a
+    // quorum and lasts |election_timeout_ms| - |leader_lease_clock_drift_ms|.
+    // In return the followers refuse to vote for other candidates within
+    // |election_timeout_ms| since they heard from the leader, except for
+    // transferring the leadership. This should be set on all the peers of the
+    // group, and |leader_lease_clock_drift_ms| must bound the difference
+    // between the clock rates of any two servers during an election timeout.
+    // Default: false
+    bool enable_leader_lease;
+    // Default: 100
+    int leader_lease_clock_drift_ms;
+
+    // Leaders are preferred to be the peers of higher priority. Peers below
+    // the highest priority of the group wait for one more election timeout
+    // before starting an election, and a leader hands the leadership over
+    // to a caught-up voter of a higher priority. Peers of the same priority
+    // are equal as before.
+    // Default: 0
+    int election_priority;
+
+    // If not negative, the queues and timers of this node, i.e. applying
+    // tasks, writing logs and running |fsm|, are run by the bthread workers
+    // of this tag (-task_group_ntags of brpc) only, so that the hot data of
+    // the group stays in the caches of these workers. Serve the node with a
+    // server of the same tag (ServerOptions::bthread_tag) and see
+    // bind_bthread_tags_to_numa_nodes() to spread the groups across the NUMA
+    // nodes. Ignored if brpc doesn't support bthread tags.
+    // Default: -1
+    int bthread_tag;
+
+    // If true, both the leader and the followers regard the logs as stable
+    // once written to the log storage without waiting for the fsync, which
+    // is done in the background every raft_relaxed_sync_interval_ms or once
+    // raft_relaxed_sync_bytes are written. The committed logs written within
+    // that time might be lost if a majority of the group crash at the same
+    // time, so it's only for the data which affords this, e.g. caches.
+    // NodeStatus::durable_index shows how far the logs are fsynced.
+    // Default: false
+    bool relaxed_log_durability;
+
     // Construct a default instance
     NodeOptions();
 };
@@ -521,6 +763,9 @@ struct NodeOptions {
 inline NodeOptions::NodeOptions() 
     : election_timeout_ms(1000)
     , snapshot_interval_s(3600)
+    , snapshot_log_entries(0)
+    , snapshot_log_bytes(0)
+    , snapshot_min_interval_s(0)
     , catchup_margin(1000)
     , fsm(NULL)
     , node_owns_fsm(false)
@@ -531,6 +776,12 @@ inline NodeOptions::NodeOptions()
     , snapshot_file_system_adaptor(NULL)
     , snapshot_throttle(NULL)
     , disable_cli(false)
+    , witness(false)
+    , enable_leader_lease(false)
+    , leader_lease_clock_drift_ms(100)
+    , election_priority(0)
+    , bthread_tag(-1)
+    , relaxed_log_durability(false)
 {}
 
 class NodeImpl;
@@ -572,6 +823,34 @@ public:
     //
     void apply(const Task& task);
 
+    // [Thread-safe and wait-free]
+    // apply |tasks| in order to the replicated-state-machine, which costs one
+    // operation of the apply queue for the whole batch and makes the tasks
+    // appended in one batch, regardless of raft_apply_batch.
+    // The ownership is the same as apply(const Task&).
+    void apply(const std::vector<Task>& tasks);
+
+    // Same as above, but |task.done| of |tasks| is ignored and |done| is
+    // called once after all the tasks are done, with the first error of them
+    // if any. StateMachine::on_apply gets an internal closure from
+    // Iterator::done() for each task in this case, which must be run as usual.
+    void apply(const std::vector<Task>& tasks, Closure* done);
+
+    // [Thread-safe]
+    // Linearizable read without appending any log. |done| is called with OK
+    // once this node is confirmed to be the leader by a quorum and the logs
+    // committed before this call are applied, and the state machine could
+    // be read then. Concurrent reads share one round of heartbeats, and no
+    // heartbeat is needed while the leader holds the lease if
+    // NodeOptions::enable_leader_lease is on.
+    // A follower asks the leader for the read index, the reads within
+    // raft_follower_read_interval_ms sharing one RPC, and runs |done| once
+    // it applies the read index itself.
+    // Fails with EPERM if neither this node nor the leader it knows is the
+    // leader, or EAGAIN if the leader hasn't committed any log of its term
+    // yet.
+    void read_index(Closure* done);
+
     // list peers of this raft group, only leader retruns ok
     // [NOTE] when list_peers concurrency with add_peer/remove_peer, maybe return peers is staled.
     // because add_peer/remove_peer immediately modify configuration in memory
@@ -590,6 +869,39 @@ public:
     // result.
     void change_peers(const Configuration& new_peers, Closure* done);
 
+    // list learners of this raft group, only leader returns ok
+    butil::Status list_learners(std::vector<PeerId>* learners);
+
+    // Add non-voting learners to the raft group. Learners receive the logs
+    // and snapshots from the leader like followers, but are counted neither
+    // in the quorum nor in elections, so they could serve reads without
+    // slowing down the writes. A learner is promoted to a voting peer by
+    // add_peer, which waits for it to catch up as usual. done->Run() would be
+    // invoked after this operation finishes, describing the detailed result.
+    void add_learners(const std::vector<PeerId>& learners, Closure* done);
+
+    // Remove the learners from the raft group. done->Run() would be invoked
+    // after this operation finishes, describing the detailed result.
+    void remove_learners(const std::vector<PeerId>& learners, Closure* done);
+
+    // Let the leader send the AppendEntries of |peer| to |relay|, which
+    // attaches the data of the logs from its own log and forwards the
+    // requests to |peer|, so that the data sent by the leader is shared by
+    // the peers in a remote region. The requests are sent to |peer| directly
+    // again for a while if |relay| fails. An empty |relay| stops relaying.
+    // The setting is kept by this node only and takes effect whenever it's
+    // the leader, so set it on every node which might become the leader.
+    butil::Status set_relay(const PeerId& peer, const PeerId& relay);
+
+    // Let |peer| copy the snapshots from |donor| instead of the leader, e.g.
+    // a peer in the same region with a snapshot which is new enough. The
+    // leader asks |donor| for its snapshot before installing one to |peer|,
+    // and falls back to its own if the donor has no snapshot new enough or
+    // fails to get it, and so does |peer| if copying from the donor fails.
+    // An empty |donor| stops it. Like set_relay(), the setting takes effect
+    // whenever this node is the leader.
+    butil::Status set_snapshot_donor(const PeerId& peer, const PeerId& donor);
+
     // Reset the configuration of this node individually, without any repliation
     // to other peers before this node beomes the leader. This function is
     // supposed to be inovoked when the majority of the replication group are
@@ -618,7 +930,8 @@ public:
     int transfer_leadership_to(const PeerId& peer);
 
     // Read the first committed user log from the given index.
-    // Return OK on success and user_log is assigned with the very data. Be awared
+    // Return OK on success and user_log is assigned with the very data, with
+    // all the tasks of the log if they were applied in a batch. Be awared
     // that the user_log may be not the exact log at the given index, but the
     // first available user log from the given index to last_committed_index.
     // Otherwise, appropriate errors are returned:
@@ -628,6 +941,21 @@ public:
     // in code implementation.
     butil::Status read_committed_user_log(const int64_t index, UserLog* user_log);
 
+    // Deliver the tasks of the logs from |options.start_index| on to
+    // |subscriber| in batches once they are applied, see LogSubscriber. Only
+    // the tasks applied to the StateMachine are delivered, the logs of
+    // configurations are skipped. |subscriber| must be valid until its
+    // on_stop() is called.
+    // Returns 0 on success and |subscription_id| is assigned with the id to
+    // unsubscribe, -1 otherwise.
+    int subscribe_logs(const LogSubscriptionOptions& options,
+                       LogSubscriber* subscriber, int64_t* subscription_id);
+
+    // Stop the subscription of |subscription_id|, whose subscriber is stopped
+    // with ECANCELED once the batch being delivered is done.
+    // Returns 0 on success, -1 if it doesn't exist.
+    int unsubscribe_logs(int64_t subscription_id);
+
     // Get the internal status of this node, the information is mostly the same as we
     // see from the website.
     void get_status(NodeStatus* status);
@@ -693,11 +1021,20 @@ struct BootstrapOptions {
     std::string log_uri;
 
     // Describe a specific RaftMetaStorage in format ${type}://${parameters}
+    // e.g. shared://${dir}?group=${group} keeps the meta of all the groups
+    // sharing |dir| in one file, whose updates share fsyncs.
     std::string raft_meta_uri;
 
     // Describe a specific SnapshotStorage in format ${type}://${parameters}
     std::string snapshot_uri;
 
+    // Bootstrap from the snapshot already in |snapshot_uri| (e.g. built
+    // offline by braft_snapshot_builder) rather than dumping one with |fsm|,
+    // which is then not needed. The snapshot must be at |last_log_index|
+    // with term 1, and its peers are taken if |group_conf| is empty.
+    // Default: false
+    bool from_local_snapshot;
+
     // Construct default options
     BootstrapOptions();
 
@@ -706,6 +1043,66 @@ struct BootstrapOptions {
 // Bootstrap a non-empty raft node, 
 int bootstrap(const BootstrapOptions& options);
 
+// A node to be initialized by init_nodes()
+struct NodeInitTask {
+    // The node to initialize with |options|, not owned
+    Node* node;
+    NodeOptions options;
+
+    // The nodes of higher priority are initialized first, so that e.g. the
+    // groups serving the most traffic come online first.
+    // Default: 0
+    int64_t priority;
+
+    // Run once the node is initialized, with the error of Node::init in its
+    // status if it failed. Could be NULL
+    Closure* done;
+
+    // Output: the return value of Node::init
+    int rc;
+
+    NodeInitTask() : node(NULL), priority(0), done(NULL), rc(-1) {}
+};
+
+struct InitNodesOptions {
+    // Maximum of the nodes initialized at the same time
+    // Default: 16
+    int concurrency;
+
+    // Maximum of the nodes whose logs are on the same disk initialized at
+    // the same time, so that the nodes on the other disks are not starved
+    // while one disk is busy loading the logs. No limit if it's not positive.
+    // Default: 4
+    int max_concurrent_per_disk;
+
+    // Among the nodes of the same priority, initialize the ones which voted
+    // for themselves in their last term first as they were likely the
+    // leaders, and then the ones with less logs to load. The hint is only
+    // taken from the local:// logs and meta.
+    // Default: true
+    bool estimate_priority;
+
+    InitNodesOptions()
+        : concurrency(16), max_concurrent_per_disk(4), estimate_priority(true)
+    {}
+};
+
+// Initialize the nodes of |tasks| concurrently, which is much faster than
+// calling Node::init one by one when there are many groups in the process.
+// Each node serves as soon as its own initialization is done, with the done
+// of its task called. Blocks until all the tasks are done.
+// Returns 0 if all the nodes are initialized, -1 otherwise, see
+// NodeInitTask::rc for the result of each node
+int init_nodes(std::vector<NodeInitTask>* tasks,
+               const InitNodesOptions& options);
+
+// Bind the bthread workers of tag i to the CPUs of NUMA node i % the number
+// of NUMA nodes, so that the nodes of different NodeOptions::bthread_tag are
+// spread across the NUMA nodes. Call this before any bthread is started,
+// e.g. at the beginning of main().
+// Returns 0 on success, -1 otherwise
+int bind_bthread_tags_to_numa_nodes();
+
 // Attach raft services to |server|, this makes the raft services share the same
 // listen address with the user services.
 //
@@ -717,6 +1114,12 @@ int add_service(brpc::Server* server, const butil::EndPoint& listen_addr);
 int add_service(brpc::Server* server, int port);
 int add_service(brpc::Server* server, const char* listen_ip_and_port);
 
+// Set up |options| of the server which the raft services are attached to,
+// so that it accepts the connections of the transport selected by
+// raft_transport, e.g. enables RDMA. Call this before starting the server.
+// Returns 0 on success, -1 otherwise.
+int setup_server_options(brpc::ServerOptions* options);
+
 }  //  namespace braft
 
 #endif //BRAFT_RAFT_H
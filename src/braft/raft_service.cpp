@@ -16,11 +16,14 @@
 //          Zhangyi Chen(chenzhangyi01@baidu.com)
 
 #include <butil/logging.h>
+#include <butil/atomicops.h>
 #include <brpc/server.h>
+#include <bthread/bthread.h>
 #include "braft/raft_service.h"
 #include "braft/raft.h"
 #include "braft/node.h"
 #include "braft/node_manager.h"
+#include "braft/log_entry.h"
 
 namespace braft {
 
@@ -36,17 +39,13 @@ void RaftServiceImpl::pre_vote(google::protobuf::RpcController* cntl_base,
     brpc::Controller* cntl =
         static_cast<brpc::Controller*>(cntl_base);
 
-    PeerId peer_id;
-    if (0 != peer_id.parse(request->peer_id())) {
-        cntl->SetFailed(EINVAL, "peer_id invalid");
-        return;
-    }
-
-    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->get(request->group_id(),
-                                                                       peer_id);
+    int error_code = 0;
+    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->find(
+            request->group_id(), request->peer_id(), &error_code);
     NodeImpl* node = node_ptr.get();
     if (!node) {
-        cntl->SetFailed(ENOENT, "peer_id not exist");
+        cntl->SetFailed(error_code, error_code == EINVAL
+                        ? "peer_id invalid" : "peer_id not exist");
         return;
     }
 
@@ -66,17 +65,13 @@ void RaftServiceImpl::request_vote(google::protobuf::RpcController* cntl_base,
     brpc::Controller* cntl =
         static_cast<brpc::Controller*>(cntl_base);
 
-    PeerId peer_id;
-    if (0 != peer_id.parse(request->peer_id())) {
-        cntl->SetFailed(EINVAL, "peer_id invalid");
-        return;
-    }
-
-    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->get(request->group_id(),
-                                                                       peer_id);
+    int error_code = 0;
+    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->find(
+            request->group_id(), request->peer_id(), &error_code);
     NodeImpl* node = node_ptr.get();
     if (!node) {
-        cntl->SetFailed(ENOENT, "peer_id not exist");
+        cntl->SetFailed(error_code, error_code == EINVAL
+                        ? "peer_id invalid" : "peer_id not exist");
         return;
     }
 
@@ -87,6 +82,28 @@ void RaftServiceImpl::request_vote(google::protobuf::RpcController* cntl_base,
     }
 }
 
+// Turn the packed entries of |request| back into EntryMeta so that the nodes
+// handle one form of requests only. The request is owned by the server,
+// which is not const in fact.
+// Returns 0 on success, -1 otherwise
+static int unpack_entries(const AppendEntriesRequest* request) {
+    if (!request->has_packed_entries()) {
+        return 0;
+    }
+    AppendEntriesRequest* mutable_request =
+            const_cast<AppendEntriesRequest*>(request);
+    const butil::Status st = unpack_entry_metas(
+            request->packed_entries(), request->prev_log_term(),
+            mutable_request->mutable_entries());
+    mutable_request->clear_packed_entries();
+    if (!st.ok()) {
+        LOG(WARNING) << "Fail to unpack the entries of group "
+                     << request->group_id() << ", " << st;
+        return -1;
+    }
+    return 0;
+}
+
 void RaftServiceImpl::append_entries(google::protobuf::RpcController* cntl_base,
                             const AppendEntriesRequest* request,
                             AppendEntriesResponse* response,
@@ -95,17 +112,32 @@ void RaftServiceImpl::append_entries(google::protobuf::RpcController* cntl_base,
     brpc::Controller* cntl =
         static_cast<brpc::Controller*>(cntl_base);
 
-    PeerId peer_id;
-    if (0 != peer_id.parse(request->peer_id())) {
-        cntl->SetFailed(EINVAL, "peer_id invalid");
+    if (unpack_entries(request) != 0) {
+        cntl->SetFailed(EINVAL, "packed_entries invalid");
         return;
     }
 
-    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->get(request->group_id(),
-                                                                       peer_id);
+    // |peer_id| is served by another server, forward the request to it
+    if (request->has_relay_peer_id()) {
+        int error_code = 0;
+        scoped_refptr<NodeImpl> relay_ptr = NodeManager::GetInstance()->find(
+                request->group_id(), request->relay_peer_id(), &error_code);
+        if (!relay_ptr) {
+            cntl->SetFailed(error_code, error_code == EINVAL
+                            ? "relay_peer_id invalid" : "relay_peer_id not exist");
+            return;
+        }
+        return relay_ptr->handle_relay_append_entries_request(
+                cntl, request, response, done_guard.release());
+    }
+
+    int error_code = 0;
+    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->find(
+            request->group_id(), request->peer_id(), &error_code);
     NodeImpl* node = node_ptr.get();
     if (!node) {
-        cntl->SetFailed(ENOENT, "peer_id not exist");
+        cntl->SetFailed(error_code, error_code == EINVAL
+                        ? "peer_id invalid" : "peer_id not exist");
         return;
     }
 
@@ -120,19 +152,13 @@ void RaftServiceImpl::install_snapshot(google::protobuf::RpcController* cntl_bas
     brpc::Controller* cntl =
         static_cast<brpc::Controller*>(cntl_base);
 
-    PeerId peer_id;
-    if (0 != peer_id.parse(request->peer_id())) {
-        cntl->SetFailed(EINVAL, "peer_id invalid");
-        done->Run();
-        return;
-    }
-
-    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->get(request->group_id(),
-                                                                       peer_id);
+    int error_code = 0;
+    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->find(
+            request->group_id(), request->peer_id(), &error_code);
     NodeImpl* node = node_ptr.get();
     if (!node) {
-        cntl->SetFailed(ENOENT, "peer_id not exist");
-
+        cntl->SetFailed(error_code, error_code == EINVAL
+                        ? "peer_id invalid" : "peer_id not exist");
         done->Run();
         return;
     }
@@ -147,23 +173,300 @@ void RaftServiceImpl::timeout_now(::google::protobuf::RpcController* controller,
     brpc::Controller* cntl =
         static_cast<brpc::Controller*>(controller);
 
-    PeerId peer_id;
-    if (0 != peer_id.parse(request->peer_id())) {
-        cntl->SetFailed(EINVAL, "peer_id invalid");
+    int error_code = 0;
+    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->find(
+            request->group_id(), request->peer_id(), &error_code);
+    NodeImpl* node = node_ptr.get();
+    if (!node) {
+        cntl->SetFailed(error_code, error_code == EINVAL
+                        ? "peer_id invalid" : "peer_id not exist");
         done->Run();
         return;
     }
 
-    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->get(request->group_id(),
-                                                                       peer_id);
+    node->handle_timeout_now_request(cntl, request, response, done);
+}
+
+void RaftServiceImpl::read_index(::google::protobuf::RpcController* controller,
+                                 const ::braft::ReadIndexRequest* request,
+                                 ::braft::ReadIndexResponse* response,
+                                 ::google::protobuf::Closure* done) {
+    brpc::Controller* cntl =
+        static_cast<brpc::Controller*>(controller);
+
+    int error_code = 0;
+    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->find(
+            request->group_id(), request->peer_id(), &error_code);
     NodeImpl* node = node_ptr.get();
     if (!node) {
-        cntl->SetFailed(ENOENT, "peer_id not exist");
+        cntl->SetFailed(error_code, error_code == EINVAL
+                        ? "peer_id invalid" : "peer_id not exist");
         done->Run();
         return;
     }
 
-    node->handle_timeout_now_request(cntl, request, response, done);
+    node->handle_read_index_request(cntl, request, response, done);
+}
+
+void RaftServiceImpl::get_snapshot_uri(::google::protobuf::RpcController* controller,
+                                       const ::braft::GetSnapshotUriRequest* request,
+                                       ::braft::GetSnapshotUriResponse* response,
+                                       ::google::protobuf::Closure* done) {
+    brpc::Controller* cntl =
+        static_cast<brpc::Controller*>(controller);
+
+    int error_code = 0;
+    scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->find(
+            request->group_id(), request->peer_id(), &error_code);
+    NodeImpl* node = node_ptr.get();
+    if (!node) {
+        cntl->SetFailed(error_code, error_code == EINVAL
+                        ? "peer_id invalid" : "peer_id not exist");
+        done->Run();
+        return;
+    }
+
+    node->handle_get_snapshot_uri_request(cntl, request, response, done);
+}
+
+// Tracks the requests in one MultiHeartbeat or MultiAppendEntries RPC, and
+// runs the done of the RPC after all of them are handled
+class MultiAppendEntriesCall {
+public:
+    class SubDone : public google::protobuf::Closure {
+    public:
+        SubDone(MultiAppendEntriesCall* call, int index)
+            : _call(call), _index(index) {}
+        void Run() { _call->on_sub_done(this); }
+        brpc::Controller cntl;
+        int index() const { return _index; }
+    private:
+        MultiAppendEntriesCall* _call;
+        int _index;
+    };
+
+    MultiAppendEntriesCall(MultiAppendEntriesResponse* response,
+                           google::protobuf::Closure* done, int count)
+        : _response(response), _done(done), _pending(count + 1) {
+        for (int i = 0; i < count; ++i) {
+            _response->add_responses();
+            _response->add_error_codes(0);
+            _response->add_error_texts();
+            _subs.push_back(new SubDone(this, i));
+        }
+    }
+
+    SubDone* sub(int index) { return _subs[index]; }
+
+    // Called when a request is handled, or with NULL by the dispatcher after
+    // dispatching all the requests
+    void on_sub_done(SubDone* sub) {
+        if (sub != NULL && sub->cntl.Failed()) {
+            // Each request touches its own elements only
+            _response->mutable_error_codes()->Set(sub->index(),
+                                                  sub->cntl.ErrorCode());
+            _response->mutable_error_texts(sub->index())->assign(
+                                                  sub->cntl.ErrorText());
+        }
+        if (_pending.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+            _done->Run();
+            delete this;
+        }
+    }
+
+private:
+    ~MultiAppendEntriesCall() {
+        for (size_t i = 0; i < _subs.size(); ++i) {
+            delete _subs[i];
+        }
+    }
+
+    MultiAppendEntriesResponse* _response;
+    google::protobuf::Closure* _done;
+    butil::atomic<int> _pending;
+    std::vector<SubDone*> _subs;
+};
+
+// Dispatch the requests in |request| to the nodes in order, so the requests
+// of the same group are handled in the order they were sent
+static void dispatch_multi_append_entries(
+        brpc::Controller* cntl,
+        const MultiAppendEntriesRequest* request,
+        MultiAppendEntriesResponse* response,
+        google::protobuf::Closure* done,
+        bool heartbeat) {
+    if (!heartbeat &&
+            request->attachment_sizes_size() != request->requests_size()) {
+        brpc::ClosureGuard done_guard(done);
+        cntl->SetFailed(EINVAL, "attachment_sizes mismatch");
+        return;
+    }
+    MultiAppendEntriesCall* call = new MultiAppendEntriesCall(
+            response, done, request->requests_size());
+    for (int i = 0; i < request->requests_size(); ++i) {
+        const AppendEntriesRequest& sub_request = request->requests(i);
+        MultiAppendEntriesCall::SubDone* sub_done = call->sub(i);
+        if (!heartbeat) {
+            cntl->request_attachment().cutn(
+                    &sub_done->cntl.request_attachment(),
+                    request->attachment_sizes(i));
+        }
+        if (heartbeat && append_entries_count(sub_request) != 0) {
+            sub_done->cntl.SetFailed(EINVAL, "Not a heartbeat");
+            sub_done->Run();
+            continue;
+        }
+        if (unpack_entries(&sub_request) != 0) {
+            sub_done->cntl.SetFailed(EINVAL, "packed_entries invalid");
+            sub_done->Run();
+            continue;
+        }
+        int error_code = 0;
+        scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->find(
+                sub_request.group_id(), sub_request.peer_id(), &error_code);
+        NodeImpl* node = node_ptr.get();
+        if (!node) {
+            sub_done->cntl.SetFailed(error_code, error_code == EINVAL
+                                     ? "peer_id invalid" : "peer_id not exist");
+            sub_done->Run();
+            continue;
+        }
+        node->handle_append_entries_request(&sub_done->cntl, &sub_request,
+                                            response->mutable_responses(i),
+                                            sub_done);
+    }
+    call->on_sub_done(NULL);
+}
+
+void RaftServiceImpl::multi_heartbeat(::google::protobuf::RpcController* controller,
+                                      const ::braft::MultiAppendEntriesRequest* request,
+                                      ::braft::MultiAppendEntriesResponse* response,
+                                      ::google::protobuf::Closure* done) {
+    return dispatch_multi_append_entries(
+            static_cast<brpc::Controller*>(controller),
+            request, response, done, true);
+}
+
+void RaftServiceImpl::multi_append_entries(
+        ::google::protobuf::RpcController* controller,
+        const ::braft::MultiAppendEntriesRequest* request,
+        ::braft::MultiAppendEntriesResponse* response,
+        ::google::protobuf::Closure* done) {
+    return dispatch_multi_append_entries(
+            static_cast<brpc::Controller*>(controller),
+            request, response, done, false);
+}
+
+// Handles the votes in one MultiPreVote or MultiRequestVote RPC in parallel,
+// as a RequestVote persists the term and votedfor of its node, and runs the
+// done of the RPC after all of them are handled
+class MultiVoteCall {
+public:
+    MultiVoteCall(const MultiRequestVoteRequest* request,
+                  MultiRequestVoteResponse* response,
+                  google::protobuf::Closure* done, bool pre_vote)
+        : _request(request), _response(response), _done(done)
+        , _pre_vote(pre_vote), _pending(request->requests_size() + 1) {
+        for (int i = 0; i < request->requests_size(); ++i) {
+            _response->add_responses();
+            _response->add_error_codes(0);
+            _response->add_error_texts();
+        }
+    }
+
+    void dispatch() {
+        for (int i = 0; i < _request->requests_size(); ++i) {
+            Task* task = new Task;
+            task->call = this;
+            task->index = i;
+            bthread_t tid;
+            if (bthread_start_background(&tid, NULL, run_task, task) != 0) {
+                PLOG(ERROR) << "Fail to start bthread";
+                run_task(task);
+            }
+        }
+        on_handled();
+    }
+
+private:
+    struct Task {
+        MultiVoteCall* call;
+        int index;
+    };
+
+    static void* run_task(void* arg) {
+        Task* task = (Task*)arg;
+        task->call->handle(task->index);
+        task->call->on_handled();
+        delete task;
+        return NULL;
+    }
+
+    // Each request touches its own elements only
+    void handle(int index) {
+        const RequestVoteRequest& sub_request = _request->requests(index);
+        int error_code = 0;
+        scoped_refptr<NodeImpl> node_ptr = NodeManager::GetInstance()->find(
+                sub_request.group_id(), sub_request.peer_id(), &error_code);
+        NodeImpl* node = node_ptr.get();
+        std::string error_text;
+        if (!node) {
+            error_text = error_code == EINVAL
+                         ? "peer_id invalid" : "peer_id not exist";
+        } else {
+            RequestVoteResponse* sub_response =
+                    _response->mutable_responses(index);
+            error_code = _pre_vote
+                    ? node->handle_pre_vote_request(&sub_request, sub_response)
+                    : node->handle_request_vote_request(&sub_request,
+                                                        sub_response);
+            if (error_code != 0) {
+                error_text = berror(error_code);
+            }
+        }
+        if (error_code != 0) {
+            _response->mutable_error_codes()->Set(index, error_code);
+            _response->mutable_error_texts(index)->swap(error_text);
+            // The required fields must be set or the whole batch fails
+            // to serialize
+            RequestVoteResponse* sub_response =
+                    _response->mutable_responses(index);
+            if (!sub_response->has_term()) {
+                sub_response->set_term(0);
+            }
+            if (!sub_response->has_granted()) {
+                sub_response->set_granted(false);
+            }
+        }
+    }
+
+    void on_handled() {
+        if (_pending.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+            _done->Run();
+            delete this;
+        }
+    }
+
+    const MultiRequestVoteRequest* _request;
+    MultiRequestVoteResponse* _response;
+    google::protobuf::Closure* _done;
+    bool _pre_vote;
+    butil::atomic<int> _pending;
+};
+
+void RaftServiceImpl::multi_pre_vote(::google::protobuf::RpcController* controller,
+                                     const ::braft::MultiRequestVoteRequest* request,
+                                     ::braft::MultiRequestVoteResponse* response,
+                                     ::google::protobuf::Closure* done) {
+    (new MultiVoteCall(request, response, done, true))->dispatch();
+}
+
+void RaftServiceImpl::multi_request_vote(
+        ::google::protobuf::RpcController* controller,
+        const ::braft::MultiRequestVoteRequest* request,
+        ::braft::MultiRequestVoteResponse* response,
+        ::google::protobuf::Closure* done) {
+    (new MultiVoteCall(request, response, done, false))->dispatch();
 }
 
 }
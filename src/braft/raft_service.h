@@ -50,6 +50,36 @@ public:
                      const ::braft::TimeoutNowRequest* request,
                      ::braft::TimeoutNowResponse* response,
                      ::google::protobuf::Closure* done);
+
+    void read_index(::google::protobuf::RpcController* controller,
+                    const ::braft::ReadIndexRequest* request,
+                    ::braft::ReadIndexResponse* response,
+                    ::google::protobuf::Closure* done);
+
+    void get_snapshot_uri(::google::protobuf::RpcController* controller,
+                          const ::braft::GetSnapshotUriRequest* request,
+                          ::braft::GetSnapshotUriResponse* response,
+                          ::google::protobuf::Closure* done);
+
+    void multi_heartbeat(::google::protobuf::RpcController* controller,
+                         const ::braft::MultiAppendEntriesRequest* request,
+                         ::braft::MultiAppendEntriesResponse* response,
+                         ::google::protobuf::Closure* done);
+
+    void multi_append_entries(::google::protobuf::RpcController* controller,
+                              const ::braft::MultiAppendEntriesRequest* request,
+                              ::braft::MultiAppendEntriesResponse* response,
+                              ::google::protobuf::Closure* done);
+
+    void multi_pre_vote(::google::protobuf::RpcController* controller,
+                        const ::braft::MultiRequestVoteRequest* request,
+                        ::braft::MultiRequestVoteResponse* response,
+                        ::google::protobuf::Closure* done);
+
+    void multi_request_vote(::google::protobuf::RpcController* controller,
+                            const ::braft::MultiRequestVoteRequest* request,
+                            ::braft::MultiRequestVoteResponse* response,
+                            ::google::protobuf::Closure* done);
 private:
     butil::EndPoint _addr;
 };
@@ -18,6 +18,7 @@
 
 #include "braft/remote_file_copier.h"
 
+#include <algorithm>
 #include <gflags/gflags.h>
 #include <butil/strings/string_piece.h>
 #include <butil/strings/string_number_conversions.h>
@@ -25,8 +26,11 @@
 #include <butil/file_util.h>
 #include <bthread/bthread.h>
 #include <brpc/controller.h>
+#include <brpc/errno.pb.h>
 #include "braft/util.h"
 #include "braft/snapshot.h"
+#include "braft/file_service.h"
+#include "braft/transport.h"
 
 namespace braft {
 
@@ -41,6 +45,24 @@ DEFINE_bool(raft_enable_throttle_when_install_snapshot, true,
             "enable throttle when install snapshot, for both leader and follower");
 BRPC_VALIDATE_GFLAG(raft_enable_throttle_when_install_snapshot,
                     ::brpc::PassValidate);
+DEFINE_int32(raft_max_inflight_rpcs_per_file, 1,
+             "Maximum of the GetFile RPCs reading different ranges of one "
+             "file at the same time when copying a snapshot");
+BRPC_VALIDATE_GFLAG(raft_max_inflight_rpcs_per_file, brpc::PositiveInteger);
+DEFINE_bool(raft_enable_file_stream, false,
+            "Let the remote push the whole file on a brpc stream with flow "
+            "control when copying a snapshot, instead of polling the ranges "
+            "of the file with GetFile RPCs");
+BRPC_VALIDATE_GFLAG(raft_enable_file_stream, ::brpc::PassValidate);
+DECLARE_int32(raft_file_stream_max_buf_size);
+DEFINE_int32(raft_file_write_buffer_size, 0,
+             "Coalesce the sequential pieces received when copying a snapshot "
+             "into writes of this size, 0 means writing each piece at once");
+BRPC_VALIDATE_GFLAG(raft_file_write_buffer_size, brpc::NonNegativeInteger);
+DEFINE_bool(raft_file_write_direct_io, false,
+            "Write the coalesced pieces of snapshot files with O_DIRECT, "
+            "which takes effect if raft_file_write_buffer_size is positive");
+BRPC_VALIDATE_GFLAG(raft_file_write_direct_io, ::brpc::PassValidate);
 
 RemoteFileCopier::RemoteFileCopier()
     : _reader_id(0)
@@ -65,7 +87,15 @@ int RemoteFileCopier::init(const std::string& uri, FileSystemAdaptor* fs,
                    << " in " << uri;
         return -1;
     }
-    if (_channel.Init(ip_and_port.as_string().c_str(), NULL) != 0) {
+    if (butil::str2endpoint(ip_and_port.as_string().c_str(),
+                            &_remote_addr) != 0 &&
+        butil::hostname2endpoint(ip_and_port.as_string().c_str(),
+                                 &_remote_addr) != 0) {
+        LOG(ERROR) << "Invalid remote address=" << ip_and_port
+                   << " in " << uri;
+        return -1;
+    }
+    if (init_peer_channel(&_channel, _remote_addr, NULL) != 0) {
         LOG(ERROR) << "Fail to init Channel to " << ip_and_port;
         return -1;
     }
@@ -129,8 +159,75 @@ RemoteFileCopier::start_to_copy_to_file(
                       const std::string& source,
                       const std::string& dest_path,
                       const CopyOptions* options) {
+    scoped_refptr<Session> session =
+            create_file_session(source, dest_path, O_TRUNC, options);
+    if (session == NULL) {
+        return NULL;
+    }
+    session->start_from(0);
+    return session;
+}
+
+scoped_refptr<RemoteFileCopier::Session> 
+RemoteFileCopier::start_to_resume_copy_to_file(
+                      const std::string& source,
+                      const std::string& dest_path,
+                      int64_t offset,
+                      const CopyOptions* options) {
+    scoped_refptr<Session> session =
+            create_file_session(source, dest_path, 0, options);
+    if (session == NULL) {
+        return NULL;
+    }
+    session->start_from(offset);
+    return session;
+}
+
+scoped_refptr<RemoteFileCopier::Session> 
+RemoteFileCopier::start_to_copy_ranges_to_file(
+                      const std::string& source,
+                      const std::string& dest_path,
+                      const std::vector<std::pair<int64_t, int64_t> >& ranges,
+                      const CopyOptions* options) {
+    scoped_refptr<Session> session =
+            create_file_session(source, dest_path, 0, options);
+    if (session == NULL) {
+        return NULL;
+    }
+    {
+        BAIDU_SCOPED_LOCK(session->_mutex);
+        session->_whole_file = false;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            for (int64_t begin = ranges[i].first; begin < ranges[i].second;
+                    begin += session->_range_size) {
+                session->_ranges.push_back(std::make_pair(
+                        begin, std::min(begin + session->_range_size,
+                                        ranges[i].second)));
+            }
+        }
+    }
+    session->start();
+    return session;
+}
+
+scoped_refptr<RemoteFileCopier::Session> 
+RemoteFileCopier::create_file_session(
+                      const std::string& source,
+                      const std::string& dest_path,
+                      int open_flags,
+                      const CopyOptions* options) {
     butil::File::Error e;
-    FileAdaptor* file = _fs->open(dest_path, O_TRUNC | O_WRONLY | O_CREAT | O_CLOEXEC, NULL, &e);
+    const int oflag = open_flags | O_WRONLY | O_CREAT | O_CLOEXEC;
+    FileAdaptor* file = NULL;
+    if (FLAGS_raft_file_write_buffer_size > 0) {
+        BufferedFileOptions buffered_options;
+        buffered_options.buffer_size = FLAGS_raft_file_write_buffer_size;
+        buffered_options.use_direct_io = FLAGS_raft_file_write_direct_io;
+        file = open_buffered_file(_fs.get(), dest_path, oflag, NULL,
+                                  buffered_options, &e);
+    } else {
+        file = _fs->open(dest_path, oflag, NULL, &e);
+    }
     
     if (!file) {
         LOG(ERROR) << "Fail to open " << dest_path 
@@ -143,6 +240,10 @@ RemoteFileCopier::start_to_copy_to_file(
     session->_file = file;
     session->_request.set_filename(source);
     session->_request.set_reader_id(_reader_id);
+    const int compress_type = replication_compress_type(_remote_addr);
+    if (compress_type != COMPRESS_NONE) {
+        session->_request.set_accept_compress_type(compress_type);
+    }
     session->_channel = &_channel;
     if (options) {
         session->_options = *options;
@@ -151,7 +252,8 @@ RemoteFileCopier::start_to_copy_to_file(
     if (_throttle) {
         session->_throttle = _throttle;
     }
-    session->send_next_rpc();
+    session->_max_slots = FLAGS_raft_max_inflight_rpcs_per_file;
+    session->_range_size = FLAGS_raft_max_byte_count_per_rpc;
     return session;
 }
 
@@ -166,25 +268,54 @@ RemoteFileCopier::start_to_copy_to_iobuf(
     session->_buf = dest_buf;
     session->_request.set_filename(source);
     session->_request.set_reader_id(_reader_id);
+    const int compress_type = replication_compress_type(_remote_addr);
+    if (compress_type != COMPRESS_NONE) {
+        session->_request.set_accept_compress_type(compress_type);
+    }
     session->_channel = &_channel;
     if (options) {
         session->_options = *options;
     }
-    session->send_next_rpc();
+    // The data is appended to |dest_buf| in order, read it with one slot
+    session->_max_slots = 1;
+    session->_range_size = UINT_MAX;
+    session->start();
     return session;
 }
 
+RemoteFileCopier::Session::Slot::Slot()
+    : owner(NULL)
+    , retry_times(0)
+    , end_offset(0)
+    , rpc_call(INVALID_BTHREAD_ID)
+    , timer()
+    , throttle_token_acquire_time_us(1)
+{}
+
 RemoteFileCopier::Session::Session() 
     : _channel(NULL)
     , _file(NULL)
-    , _retry_times(0)
     , _finished(false)
     , _buf(NULL)
-    , _timer()
+    , _max_slots(1)
+    , _running_slots(0)
+    , _range_size(0)
+    , _next_offset(0)
+    , _whole_file(true)
+    , _next_range(0)
+    , _eof_offset(-1)
+    , _copied_offset(0)
+    , _use_stream(false)
+    , _stream_rpc_running(false)
+    , _stream_retry_times(0)
+    , _stream_offset(0)
+    , _stream_id(brpc::INVALID_STREAM_ID)
+    , _stream_call(INVALID_BTHREAD_ID)
+    , _stream_timer()
     , _throttle(NULL)
-    , _throttle_token_acquire_time_us(1)
 {
-    _done.owner = this;
+    _stream_handler.owner = this;
+    _stream_done.owner = this;
 }
 
 RemoteFileCopier::Session::~Session() {
@@ -193,19 +324,113 @@ RemoteFileCopier::Session::~Session() {
         delete _file;
         _file = NULL;
     }
+    for (size_t i = 0; i < _slots.size(); ++i) {
+        delete _slots[i];
+    }
+}
+
+void RemoteFileCopier::Session::start() {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    Slot* slot = new_slot();
+    if (slot == NULL) {
+        // Nothing to copy
+        return on_finished();
+    }
+    lck.unlock();
+    send_next_rpc(slot);
+}
+
+void RemoteFileCopier::Session::start_from(int64_t offset) {
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _next_offset = offset;
+        _stream_offset = offset;
+        _copied_offset = offset;
+        _use_stream = FLAGS_raft_enable_file_stream;
+    }
+    if (_use_stream) {
+        start_stream();
+    } else {
+        start();
+    }
+}
+
+void RemoteFileCopier::Session::add_copied_range(int64_t begin, int64_t end) {
+    if (begin >= end) {
+        return;
+    }
+    if (begin > _copied_offset) {
+        // Copied by a slot ahead of the others
+        _copied_ranges[begin] = end;
+        return;
+    }
+    _copied_offset = std::max(_copied_offset, end);
+    std::map<int64_t, int64_t>::iterator it = _copied_ranges.begin();
+    while (it != _copied_ranges.end() && it->first <= _copied_offset) {
+        _copied_offset = std::max(_copied_offset, it->second);
+        _copied_ranges.erase(it++);
+    }
+}
+
+bool RemoteFileCopier::Session::take_range(int64_t* begin, int64_t* end) {
+    if (_whole_file) {
+        if (_eof_offset >= 0 && _next_offset >= _eof_offset) {
+            return false;
+        }
+        *begin = _next_offset;
+        *end = _next_offset + _range_size;
+        _next_offset = *end;
+        return true;
+    }
+    if (_next_range >= _ranges.size()) {
+        return false;
+    }
+    *begin = _ranges[_next_range].first;
+    *end = _ranges[_next_range].second;
+    ++_next_range;
+    return true;
 }
 
-void RemoteFileCopier::Session::send_next_rpc() {
-    _cntl.Reset();
-    _response.Clear();
-    // Not clear request as we need some fields of the previous RPC
-    off_t offset = _request.offset() + _request.count();
-    const size_t max_count = 
-            (!_buf) ? FLAGS_raft_max_byte_count_per_rpc : UINT_MAX;
-    _cntl.set_timeout_ms(_options.timeout_ms);
-    _request.set_offset(offset);
+RemoteFileCopier::Session::Slot* RemoteFileCopier::Session::new_slot() {
+    int64_t begin = 0;
+    int64_t end = 0;
+    if (!take_range(&begin, &end)) {
+        return NULL;
+    }
+    Slot* slot = new Slot;
+    slot->owner = this;
+    slot->request = _request;
+    slot->request.set_offset(begin);
+    slot->end_offset = end;
+    _slots.push_back(slot);
+    ++_running_slots;
+    return slot;
+}
+
+bool RemoteFileCopier::Session::next_range(Slot* slot, int64_t offset) {
+    if (offset >= slot->end_offset ||
+            (_eof_offset >= 0 && offset >= _eof_offset)) {
+        // The range of this slot is done, move on to the next one
+        int64_t end = 0;
+        if (!take_range(&offset, &end)) {
+            return false;
+        }
+        slot->end_offset = end;
+    }
+    slot->request.set_offset(offset);
+    return true;
+}
+
+void RemoteFileCopier::Session::send_next_rpc(Slot* slot) {
+    slot->cntl.Reset();
+    slot->response.Clear();
+    // Read the rest of the range, which is retried as a whole on failure
+    const size_t max_count = std::min(
+            slot->end_offset - slot->request.offset(), (int64_t)UINT_MAX);
+    slot->cntl.set_timeout_ms(_options.timeout_ms);
     // Read partly when throttled
-    _request.set_read_partly(FLAGS_raft_allow_read_partly_when_install_snapshot);
+    slot->request.set_read_partly(
+            FLAGS_raft_allow_read_partly_when_install_snapshot);
     std::unique_lock<raft_mutex_t> lck(_mutex);
     if (_finished) {
         return;
@@ -213,34 +438,32 @@ void RemoteFileCopier::Session::send_next_rpc() {
     // throttle
     size_t new_max_count = max_count;
     if (_throttle && FLAGS_raft_enable_throttle_when_install_snapshot) {
-        _throttle_token_acquire_time_us = butil::cpuwide_time_us();
+        slot->throttle_token_acquire_time_us = butil::cpuwide_time_us();
         new_max_count = _throttle->throttled_by_throughput(max_count);
         if (new_max_count == 0) {
-            // Reset count to make next rpc retry the previous one
             BRAFT_VLOG << "Copy file throttled, path: " << _dest_path;
-            _request.set_count(0);
             AddRef();
             int64_t retry_interval_ms_when_throttled = 
                                     _throttle->get_retry_interval_ms();
             if (bthread_timer_add(
-                    &_timer, 
+                    &slot->timer, 
                     butil::milliseconds_from_now(retry_interval_ms_when_throttled),
-                    on_timer, this) != 0) {
+                    on_timer, slot) != 0) {
                 lck.unlock();
                 LOG(ERROR) << "Fail to add timer";
-                return on_timer(this);
+                return on_timer(slot);
             }
             return;
         }
     }
-    _request.set_count(new_max_count);
-    _rpc_call = _cntl.call_id();
+    slot->request.set_count(new_max_count);
+    slot->rpc_call = slot->cntl.call_id();
     FileService_Stub stub(_channel);
     AddRef();  // Release in on_rpc_returned
-    return stub.get_file(&_cntl, &_request, &_response, &_done);
+    return stub.get_file(&slot->cntl, &slot->request, &slot->response, slot);
 }
 
-void RemoteFileCopier::Session::on_rpc_returned() {
+void RemoteFileCopier::Session::on_rpc_returned(Slot* slot) {
     scoped_refptr<Session> ref_gurad;
     Session* this_ref = this;
     ref_gurad.swap(&this_ref);
@@ -248,72 +471,69 @@ void RemoteFileCopier::Session::on_rpc_returned() {
     if (_finished) {
         return;
     }
-    if (_cntl.Failed()) {
-        // Reset count to make next rpc retry the previous one
-        int64_t request_count = _request.count();
-        _request.set_count(0);
-        if (_cntl.ErrorCode() == ECANCELED) {
+    brpc::Controller& cntl = slot->cntl;
+    if (cntl.Failed()) {
+        if (cntl.ErrorCode() == ECANCELED) {
             if (_st.ok()) {
-                _st.set_error(_cntl.ErrorCode(), _cntl.ErrorText());
+                _st.set_error(cntl.ErrorCode(), cntl.ErrorText());
                 return on_finished();
             }
         }
-        // Throttled reading failure does not increase _retry_times
-        if (_cntl.ErrorCode() != EAGAIN && _retry_times++ >= _options.max_retry) {
+        // Throttled reading failure does not increase retry_times
+        if (cntl.ErrorCode() != EAGAIN &&
+                slot->retry_times++ >= _options.max_retry) {
             if (_st.ok()) {
-                _st.set_error(_cntl.ErrorCode(), _cntl.ErrorText());
+                _st.set_error(cntl.ErrorCode(), cntl.ErrorText());
                 return on_finished();
             }
         }
         // set retry time interval
         int64_t retry_interval_ms = _options.retry_interval_ms; 
-        if (_cntl.ErrorCode() == EAGAIN && _throttle) {
+        if (cntl.ErrorCode() == EAGAIN && _throttle) {
             retry_interval_ms = _throttle->get_retry_interval_ms();
             // No token consumed, just return back, other nodes maybe able to use them
             if (FLAGS_raft_enable_throttle_when_install_snapshot) {
                 _throttle->return_unused_throughput(
-                        request_count, 0,
-                        butil::cpuwide_time_us() - _throttle_token_acquire_time_us);
+                        slot->request.count(), 0,
+                        butil::cpuwide_time_us() -
+                                slot->throttle_token_acquire_time_us);
             }
         }
         AddRef();
         if (bthread_timer_add(
-                    &_timer, 
+                    &slot->timer, 
                     butil::milliseconds_from_now(retry_interval_ms),
-                    on_timer, this) != 0) {
+                    on_timer, slot) != 0) {
             lck.unlock();
             LOG(ERROR) << "Fail to add timer";
-            return on_timer(this);
+            return on_timer(slot);
         }
         return;
     }
+    if (slot->response.compress_type() != COMPRESS_NONE) {
+        butil::IOBuf data;
+        if (!decompress_data(slot->response.compress_type(),
+                             cntl.response_attachment(), &data)) {
+            LOG(WARNING) << "Fail to decompress the data of " << _dest_path;
+            _st.set_error(EIO, "Fail to decompress");
+            return on_finished();
+        }
+        cntl.response_attachment().swap(data);
+    }
     if (_throttle && FLAGS_raft_enable_throttle_when_install_snapshot &&
-        _request.count() > (int64_t)_cntl.response_attachment().size()) {
+        slot->request.count() > (int64_t)cntl.response_attachment().size()) {
         _throttle->return_unused_throughput(
-                _request.count(), _cntl.response_attachment().size(),
-                butil::cpuwide_time_us() - _throttle_token_acquire_time_us);
-    }
-    _retry_times = 0;
-    // Reset count to |real_read_size| to make next rpc get the right offset
-    if (_response.has_read_size() && (_response.read_size() != 0)
-            && FLAGS_raft_allow_read_partly_when_install_snapshot) {
-        _request.set_count(_response.read_size());
+                slot->request.count(), cntl.response_attachment().size(),
+                butil::cpuwide_time_us() - slot->throttle_token_acquire_time_us);
     }
+    slot->retry_times = 0;
     if (_file) {
-        FileSegData data(_cntl.response_attachment());
-        uint64_t seg_offset = 0;
-        butil::IOBuf seg_data;
-        while (0 != data.next(&seg_offset, &seg_data)) {
-            ssize_t nwritten = _file->write(seg_data, seg_offset);
-            if (static_cast<size_t>(nwritten) != seg_data.size()) {
-                LOG(WARNING) << "Fail to write into file: " << _dest_path;
-                _st.set_error(EIO, "%s", berror(EIO));
-                return on_finished();
-            }
-            seg_data.clear();
+        if (write_to_file(cntl.response_attachment()) != 0) {
+            _st.set_error(EIO, "%s", berror(EIO));
+            return on_finished();
         }
     } else {
-        FileSegData data(_cntl.response_attachment());
+        FileSegData data(cntl.response_attachment());
         uint64_t seg_offset = 0;
         butil::IOBuf seg_data;
         while (0 != data.next(&seg_offset, &seg_data)) {
@@ -322,17 +542,272 @@ void RemoteFileCopier::Session::on_rpc_returned() {
             _buf->append(seg_data);
         }
     }
-    if (_response.eof()) {
-        on_finished();
+    // Continue from |real_read_size| if the file was read partly
+    int64_t read_size = slot->request.count();
+    if (slot->response.has_read_size() &&
+            (slot->response.eof() ||
+             (slot->response.read_size() != 0 &&
+              FLAGS_raft_allow_read_partly_when_install_snapshot))) {
+        read_size = slot->response.read_size();
+    }
+    const int64_t offset = slot->request.offset() + read_size;
+    if (_file && _whole_file) {
+        add_copied_range(slot->request.offset(), offset);
+    }
+    if (slot->response.eof()) {
+        if (!_whole_file && offset < slot->end_offset) {
+            LOG(WARNING) << "File " << _request.filename() << " ends at "
+                         << offset << " before the range to copy into "
+                         << _dest_path;
+            _st.set_error(EIO, "File is shorter than expected");
+            return on_finished();
+        }
+        _eof_offset = _eof_offset < 0 ? offset : std::min(_eof_offset, offset);
+    }
+    if (!next_range(slot, offset)) {
+        if (--_running_slots == 0) {
+            on_finished();
+        }
         return;
     }
+    // Read the following ranges in parallel once the file turns out to be
+    // larger than one range
+    std::vector<Slot*> new_slots;
+    while ((int)_slots.size() < _max_slots) {
+        Slot* s = new_slot();
+        if (s == NULL) {
+            break;
+        }
+        new_slots.push_back(s);
+    }
     lck.unlock();
-    return send_next_rpc();
+    send_next_rpc(slot);
+    for (size_t i = 0; i < new_slots.size(); ++i) {
+        send_next_rpc(new_slots[i]);
+    }
 }
 
-void* RemoteFileCopier::Session::send_next_rpc_on_timedout(void* arg) {
+int RemoteFileCopier::Session::write_to_file(const butil::IOBuf& buf) {
+    FileSegData data(buf);
+    uint64_t seg_offset = 0;
+    butil::IOBuf seg_data;
+    while (0 != data.next(&seg_offset, &seg_data)) {
+        ssize_t nwritten = write_and_wait(_file, seg_data, seg_offset);
+        if (static_cast<size_t>(nwritten) != seg_data.size()) {
+            LOG(WARNING) << "Fail to write into file: " << _dest_path;
+            return -1;
+        }
+        seg_data.clear();
+    }
+    return 0;
+}
+
+void RemoteFileCopier::Session::start_stream() {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    if (_finished) {
+        return;
+    }
+    _stream_cntl.Reset();
+    _stream_cntl.set_timeout_ms(_options.timeout_ms);
+    _stream_response.Clear();
+    _stream_request.set_reader_id(_request.reader_id());
+    _stream_request.set_filename(_request.filename());
+    _stream_request.set_offset(_stream_offset);
+    if (_request.has_accept_compress_type()) {
+        _stream_request.set_accept_compress_type(
+                _request.accept_compress_type());
+    }
+    brpc::StreamOptions stream_options;
+    stream_options.handler = &_stream_handler;
+    stream_options.max_buf_size = FLAGS_raft_file_stream_max_buf_size;
+    if (brpc::StreamCreate(&_stream_id, _stream_cntl, &stream_options) != 0) {
+        _stream_id = brpc::INVALID_STREAM_ID;
+        return retry_stream(&lck, EINVAL, "Fail to create stream");
+    }
+    AddRef();  // Release in on_stream_closed
+    _stream_call = _stream_cntl.call_id();
+    _stream_rpc_running = true;
+    FileService_Stub stub(_channel);
+    AddRef();  // Release in on_stream_rpc_returned
+    return stub.stream_file(&_stream_cntl, &_stream_request,
+                            &_stream_response, &_stream_done);
+}
+
+void RemoteFileCopier::Session::on_stream_rpc_returned() {
+    scoped_refptr<Session> ref_gurad;
+    Session* this_ref = this;
+    ref_gurad.swap(&this_ref);
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    _stream_rpc_running = false;
+    if (_finished) {
+        return;
+    }
+    if (!_stream_cntl.Failed()) {
+        if (_stream_id == brpc::INVALID_STREAM_ID) {
+            // Broken before the RPC returned
+            retry_stream(&lck, EPIPE, "Stream is broken");
+        }
+        return;
+    }
+    // Ignore the close of the stream as the failure is handled here
+    const brpc::StreamId stream = _stream_id;
+    _stream_id = brpc::INVALID_STREAM_ID;
+    if (_stream_cntl.ErrorCode() == brpc::ENOMETHOD) {
+        LOG(WARNING) << "Remote doesn't support stream_file, copy "
+                     << _request.filename() << " with get_file instead";
+        _use_stream = false;
+        lck.unlock();
+        brpc::StreamClose(stream);
+        return start();
+    }
+    retry_stream(&lck, _stream_cntl.ErrorCode(), _stream_cntl.ErrorText());
+    if (lck.owns_lock()) {
+        lck.unlock();
+    }
+    if (stream != brpc::INVALID_STREAM_ID) {
+        brpc::StreamClose(stream);
+    }
+}
+
+void RemoteFileCopier::Session::on_stream_broken(
+        std::unique_lock<raft_mutex_t>* lck, int error_code,
+        const std::string& error_text) {
+    _stream_id = brpc::INVALID_STREAM_ID;
+    if (_stream_rpc_running) {
+        // Retried when the RPC returns as the controller is still in use
+        return;
+    }
+    retry_stream(lck, error_code, error_text);
+}
+
+void RemoteFileCopier::Session::acquire_stream_throughput(size_t size) {
+    if (!_throttle || !FLAGS_raft_enable_throttle_when_install_snapshot) {
+        return;
+    }
+    // Not consuming the messages holds back the remote through the flow
+    // control of the stream
+    size_t acquired = 0;
+    while (true) {
+        acquired += _throttle->throttled_by_throughput(size - acquired);
+        if (acquired >= size) {
+            return;
+        }
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (_finished) {
+                return;
+            }
+        }
+        bthread_usleep(_throttle->get_retry_interval_ms() * 1000L);
+    }
+}
+
+int RemoteFileCopier::Session::on_stream_messages(
+        brpc::StreamId id, butil::IOBuf *const messages[], size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        butil::IOBuf* message = messages[i];
+        acquire_stream_throughput(message->size());
+        std::unique_lock<raft_mutex_t> lck(_mutex);
+        if (_finished || id != _stream_id) {
+            return 0;
+        }
+        FileStreamHeader header;
+        if (header.cut_from(message) != 0 || header.offset != _stream_offset) {
+            LOG(WARNING) << "Unexpected message on the stream of "
+                         << _request.filename() << " at offset="
+                         << header.offset << ", expected=" << _stream_offset;
+            on_stream_broken(&lck, EPROTO, "Unexpected message on the stream");
+            if (lck.owns_lock()) {
+                lck.unlock();
+            }
+            brpc::StreamClose(id);
+            return 0;
+        }
+        if (header.compress_type != COMPRESS_NONE) {
+            butil::IOBuf data;
+            if (!decompress_data(header.compress_type, *message, &data)) {
+                LOG(WARNING) << "Fail to decompress the data of " << _dest_path;
+                _st.set_error(EIO, "Fail to decompress");
+                on_finished();
+                return 0;
+            }
+            message->swap(data);
+        }
+        if (write_to_file(*message) != 0) {
+            _st.set_error(EIO, "%s", berror(EIO));
+            on_finished();
+            return 0;
+        }
+        _stream_offset += header.read_size;
+        _copied_offset = _stream_offset;
+        _stream_retry_times = 0;
+        if (header.eof) {
+            on_finished();
+            return 0;
+        }
+    }
+    return 0;
+}
+
+void RemoteFileCopier::Session::on_stream_closed(brpc::StreamId id) {
+    // Release the reference of the stream
+    scoped_refptr<Session> ref_gurad;
+    Session* this_ref = this;
+    ref_gurad.swap(&this_ref);
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    if (_finished || id != _stream_id) {
+        return;
+    }
+    on_stream_broken(&lck, EPIPE, "Stream is closed before the end of the file");
+}
+
+void RemoteFileCopier::Session::retry_stream(
+        std::unique_lock<raft_mutex_t>* lck, int error_code,
+        const std::string& error_text) {
+    if (_stream_retry_times++ >= _options.max_retry) {
+        if (_st.ok()) {
+            _st.set_error(error_code, "%s", error_text.c_str());
+        }
+        return on_finished();
+    }
+    LOG(WARNING) << "Fail to stream " << _request.filename() << " : "
+                 << error_text << ", resume from offset=" << _stream_offset;
+    AddRef();
+    if (bthread_timer_add(
+                &_stream_timer,
+                butil::milliseconds_from_now(_options.retry_interval_ms),
+                on_stream_timer, this) != 0) {
+        lck->unlock();
+        LOG(ERROR) << "Fail to add timer";
+        return on_stream_timer(this);
+    }
+}
+
+void* RemoteFileCopier::Session::start_stream_on_timedout(void* arg) {
     Session* m = (Session*)arg;
-    m->send_next_rpc();
+    m->start_stream();
+    m->Release();
+    return NULL;
+}
+
+void RemoteFileCopier::Session::on_stream_timer(void* arg) {
+    bthread_t tid;
+    if (bthread_start_background(
+                &tid, NULL, start_stream_on_timedout, arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        start_stream_on_timedout(arg);
+    }
+}
+
+static void* close_stream(void* arg) {
+    brpc::StreamClose((brpc::StreamId)(uintptr_t)arg);
+    return NULL;
+}
+
+void* RemoteFileCopier::Session::send_next_rpc_on_timedout(void* arg) {
+    Slot* slot = (Slot*)arg;
+    Session* m = slot->owner;
+    m->send_next_rpc(slot);
     m->Release();
     return NULL;
 }
@@ -348,7 +823,34 @@ void RemoteFileCopier::Session::on_timer(void* arg) {
 
 void RemoteFileCopier::Session::on_finished() {
     if (!_finished) {
+        // Stop the other slots if this session failed
+        for (size_t i = 0; i < _slots.size(); ++i) {
+            brpc::StartCancel(_slots[i]->rpc_call);
+            if (bthread_timer_del(_slots[i]->timer) == 0) {
+                // Release reference of the timer task
+                Release();
+            }
+        }
+        if (_use_stream) {
+            brpc::StartCancel(_stream_call);
+            if (bthread_timer_del(_stream_timer) == 0) {
+                Release();
+            }
+            if (_stream_id != brpc::INVALID_STREAM_ID) {
+                // The handler may be called in StreamClose, which locks
+                // _mutex
+                bthread_t tid;
+                if (bthread_start_background(&tid, NULL, close_stream,
+                            (void*)(uintptr_t)_stream_id) != 0) {
+                    PLOG(ERROR) << "Fail to start bthread";
+                }
+            }
+        }
         if (_file) {
+            // Keep what has been copied for a later resumption
+            if (!_st.ok() && !_file->sync()) {
+                _copied_offset = 0;
+            }
             if (!_file->close()) {
                 _st.set_error(EIO, "%s", berror(EIO));
             }
@@ -365,11 +867,6 @@ void RemoteFileCopier::Session::cancel() {
     if (_finished) {
         return; 
     }
-    brpc::StartCancel(_rpc_call);
-    if (bthread_timer_del(_timer) == 0) {
-        // Release reference of the timer task
-        Release();
-    }
     if (_st.ok()) {
         _st.set_error(ECANCELED, "%s", berror(ECANCELED));
     }
@@ -380,4 +877,18 @@ void RemoteFileCopier::Session::join() {
     _finish_event.wait();
 }
 
+int RemoteFileCopier::Session::timed_join(const timespec& abstime) {
+    return _finish_event.timed_wait(abstime);
+}
+
+int64_t RemoteFileCopier::Session::synced_offset() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    // The file is synced in on_finished if the copy is unfinished
+    if (_file && !_file->sync()) {
+        LOG(WARNING) << "Fail to sync " << _dest_path;
+        return -1;
+    }
+    return _copied_offset;
+}
+
 } //  namespace braft
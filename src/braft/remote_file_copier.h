@@ -19,7 +19,10 @@
 #ifndef  BRAFT_REMOTE_FILE_COPIER_H
 #define  BRAFT_REMOTE_FILE_COPIER_H
 
+#include <map>
+#include <vector>
 #include <brpc/channel.h>
+#include <brpc/stream.h>
 #include <bthread/countdown_event.h>
 #include "braft/file_service.pb.h"
 #include "braft/util.h"
@@ -57,41 +60,128 @@ public:
         void cancel();
         // Wait until this file was copied from the remote reader
         void join();
+        // Wait until this file was copied or |abstime| is reached.
+        // Returns 0 on finished, ETIMEDOUT otherwise
+        int timed_join(const timespec& abstime);
+        // Sync the local file and return the length of its prefix which has
+        // been copied and synced, which is only tracked when copying the
+        // whole file. Returns -1 if failed to sync
+        int64_t synced_offset();
 
         const butil::Status& status() const { return _st; }
     private:
     friend class RemoteFileCopier;
-    friend class Closure;
-        struct Closure : google::protobuf::Closure {
+        // An in-flight GetFile RPC, which reads a range of the file. A
+        // session copying a file keeps up to raft_max_inflight_rpcs_per_file
+        // slots reading different ranges at the same time.
+        struct Slot : google::protobuf::Closure {
+            Slot();
             void Run() {
-                owner->on_rpc_returned();
+                owner->on_rpc_returned(this);
             }
             Session* owner;
+            int retry_times;
+            // End of the range read by this slot
+            int64_t end_offset;
+            brpc::CallId rpc_call;
+            bthread_timer_t timer;
+            int64_t throttle_token_acquire_time_us;
+            brpc::Controller cntl;
+            GetFileRequest request;
+            GetFileResponse response;
         };
-        void on_rpc_returned();
-        void send_next_rpc();
+        void start();
+        // Copy the whole file from |offset|, assuming the content before it
+        // was copied already
+        void start_from(int64_t offset);
+        void add_copied_range(int64_t begin, int64_t end);
+        bool take_range(int64_t* begin, int64_t* end);
+        Slot* new_slot();
+        bool next_range(Slot* slot, int64_t offset);
+        void on_rpc_returned(Slot* slot);
+        void send_next_rpc(Slot* slot);
+        int write_to_file(const butil::IOBuf& seg_data);
         void on_finished();
         static void on_timer(void* arg);
         static void* send_next_rpc_on_timedout(void* arg);
 
+        // The whole file is pushed by the remote on a brpc stream instead, if
+        // raft_enable_file_stream is on and the remote supports it. The
+        // stream is set up again from where it broke on failure.
+        struct StreamHandler : public brpc::StreamInputHandler {
+            int on_received_messages(brpc::StreamId id,
+                                     butil::IOBuf *const messages[],
+                                     size_t size) {
+                return owner->on_stream_messages(id, messages, size);
+            }
+            void on_idle_timeout(brpc::StreamId id) { (void)id; }
+            void on_closed(brpc::StreamId id) {
+                owner->on_stream_closed(id);
+            }
+            Session* owner;
+        };
+        struct StreamDone : google::protobuf::Closure {
+            void Run() {
+                owner->on_stream_rpc_returned();
+            }
+            Session* owner;
+        };
+        void start_stream();
+        void on_stream_rpc_returned();
+        int on_stream_messages(brpc::StreamId id,
+                               butil::IOBuf *const messages[], size_t size);
+        void on_stream_closed(brpc::StreamId id);
+        void on_stream_broken(std::unique_lock<raft_mutex_t>* lck,
+                              int error_code, const std::string& error_text);
+        void retry_stream(std::unique_lock<raft_mutex_t>* lck, int error_code,
+                          const std::string& error_text);
+        void acquire_stream_throughput(size_t size);
+        static void on_stream_timer(void* arg);
+        static void* start_stream_on_timedout(void* arg);
+
         raft_mutex_t _mutex;
         butil::Status _st;
         brpc::Channel* _channel;
         std::string _dest_path;
         FileAdaptor* _file;
-        int _retry_times;
         bool _finished;
-        brpc::CallId _rpc_call;
         butil::IOBuf* _buf;
-        bthread_timer_t _timer;
         CopyOptions _options;
-        Closure _done;
-        brpc::Controller _cntl;
+        // Template of the requests of the slots
         GetFileRequest _request;
-        GetFileResponse _response;
+        std::vector<Slot*> _slots;
+        int _max_slots;
+        int _running_slots;
+        int64_t _range_size;
+        // Offset of the first range not assigned to any slot when copying the
+        // whole file
+        int64_t _next_offset;
+        // Ranges to copy, which are assigned to the slots in order, if only
+        // a part of the file is copied
+        bool _whole_file;
+        std::vector<std::pair<int64_t, int64_t> > _ranges;
+        size_t _next_range;
+        // End of the file, which is -1 until any slot reaches it
+        int64_t _eof_offset;
+        // Everything before this offset has been written into the file, and
+        // the ranges written after it are kept in |_copied_ranges|
+        int64_t _copied_offset;
+        std::map<int64_t, int64_t> _copied_ranges;
+        bool _use_stream;
+        bool _stream_rpc_running;
+        int _stream_retry_times;
+        // Where the next message on the stream starts
+        int64_t _stream_offset;
+        brpc::StreamId _stream_id;
+        brpc::CallId _stream_call;
+        bthread_timer_t _stream_timer;
+        StreamHandler _stream_handler;
+        StreamDone _stream_done;
+        brpc::Controller _stream_cntl;
+        StreamFileRequest _stream_request;
+        StreamFileResponse _stream_response;
         bthread::CountdownEvent _finish_event;
         scoped_refptr<SnapshotThrottle> _throttle;   
-        int64_t _throttle_token_acquire_time_us;
     };
 
     RemoteFileCopier();
@@ -109,16 +199,38 @@ public:
                       const std::string& source,
                       const std::string& dest_path,
                       const CopyOptions* options);
+    // Copy the ranges [first, second) of `source' from remote to the same
+    // offsets of dest, and leave the other parts of dest as they are
+    scoped_refptr<Session> start_to_copy_ranges_to_file(
+                      const std::string& source,
+                      const std::string& dest_path,
+                      const std::vector<std::pair<int64_t, int64_t> >& ranges,
+                      const CopyOptions* options);
+    // Copy `source' from |offset| to the end into the same offsets of dest,
+    // which keeps the content of dest before |offset|
+    scoped_refptr<Session> start_to_resume_copy_to_file(
+                      const std::string& source,
+                      const std::string& dest_path,
+                      int64_t offset,
+                      const CopyOptions* options);
     scoped_refptr<Session> start_to_copy_to_iobuf(
                       const std::string& source,
                       butil::IOBuf* dest_buf,
                       const CopyOptions* options);
 private:
+    // Create a session writing into |dest_path|, which is started by the
+    // caller
+    scoped_refptr<Session> create_file_session(
+                      const std::string& source,
+                      const std::string& dest_path,
+                      int open_flags,
+                      const CopyOptions* options);
     int read_piece_of_file(butil::IOBuf* buf, const std::string& source,
                            off_t offset, size_t max_count,
                            long timeout_ms, bool* is_eof);
     DISALLOW_COPY_AND_ASSIGN(RemoteFileCopier);
     brpc::Channel _channel;
+    butil::EndPoint _remote_addr;
     int64_t _reader_id;
     scoped_refptr<FileSystemAdaptor> _fs;
     scoped_refptr<SnapshotThrottle> _throttle;
@@ -17,6 +17,7 @@
 
 #include "braft/repeated_timer_task.h"
 #include "braft/util.h"
+#include "braft/timer_wheel.h"
 
 namespace braft {
 
@@ -26,6 +27,9 @@ RepeatedTimerTask::RepeatedTimerTask()
     , _running(false)
     , _destroyed(true)
     , _invoking(false)
+    , _use_timer_wheel(false)
+    , _wheel_timer(0)
+    , _bthread_tag(-1)
 {}
 
 RepeatedTimerTask::~RepeatedTimerTask()
@@ -34,12 +38,15 @@ RepeatedTimerTask::~RepeatedTimerTask()
     CHECK(_destroyed) << "destroy() must be invoked before descrution";
 }
 
-int RepeatedTimerTask::init(int timeout_ms) {
+int RepeatedTimerTask::init(int timeout_ms, int bthread_tag) {
     _timeout_ms = timeout_ms;
+    _bthread_tag = bthread_tag;
     _destroyed = false;
     _stopped = true;
     _running = false;
     _timer = bthread_timer_t();
+    _use_timer_wheel = FLAGS_raft_enable_timer_wheel;
+    _wheel_timer = 0;
     return 0;
 }
 
@@ -48,7 +55,7 @@ void RepeatedTimerTask::stop() {
     BRAFT_RETURN_IF(_stopped);
     _stopped = true;
     CHECK(_running);
-    const int rc = bthread_timer_del(_timer);
+    const int rc = del_timer();
     if (rc == 0) {
         _running = false;
         return;
@@ -100,7 +107,7 @@ void RepeatedTimerTask::start() {
 
 void RepeatedTimerTask::run_once_now() {
     std::unique_lock<raft_mutex_t> lck(_mutex);
-    if (bthread_timer_del(_timer) == 0) {
+    if (del_timer() == 0) {
         lck.unlock();
         on_timedout(this);
     }
@@ -116,18 +123,38 @@ void RepeatedTimerTask::on_timedout(void* arg) {
     // Start a bthread to invoke run() so we won't block the timer thread.
     // as run() might access the disk so the time it takes is probably beyond
     // expection
+    RepeatedTimerTask* m = (RepeatedTimerTask*)arg;
+    const bthread_attr_t attr = bthread_attr_of_tag(BTHREAD_ATTR_NORMAL,
+                                                    m->_bthread_tag);
     bthread_t tid;
     if (bthread_start_background(
-                &tid, NULL, run_on_timedout_in_new_thread, arg) != 0) {
+                &tid, &attr, run_on_timedout_in_new_thread, arg) != 0) {
         PLOG(ERROR) << "Fail to start bthread";
         run_on_timedout_in_new_thread(arg);
     }
 }
 
+int RepeatedTimerTask::add_timer() {
+    if (_use_timer_wheel) {
+        // The timer wheel runs the callback in a new bthread itself
+        return TimerWheel::get_instance()->schedule(
+                &_wheel_timer, run_on_timedout_in_new_thread, this,
+                _next_duetime, _bthread_tag);
+    }
+    return bthread_timer_add(&_timer, _next_duetime, on_timedout, this);
+}
+
+int RepeatedTimerTask::del_timer() {
+    if (_use_timer_wheel) {
+        return TimerWheel::get_instance()->unschedule(_wheel_timer);
+    }
+    return bthread_timer_del(_timer);
+}
+
 void RepeatedTimerTask::schedule(std::unique_lock<raft_mutex_t>& lck) {
     _next_duetime =
             butil::milliseconds_from_now(adjust_timeout_ms(_timeout_ms));
-    if (bthread_timer_add(&_timer, _next_duetime, on_timedout, this) != 0) {
+    if (add_timer() != 0) {
         lck.unlock();
         LOG(ERROR) << "Fail to add timer";
         return on_timedout(this);
@@ -138,7 +165,7 @@ void RepeatedTimerTask::reset() {
     std::unique_lock<raft_mutex_t> lck(_mutex);
     BRAFT_RETURN_IF(_stopped);
     CHECK(_running);
-    const int rc = bthread_timer_del(_timer);
+    const int rc = del_timer();
     if (rc == 0) {
         return schedule(lck);
     }
@@ -150,7 +177,7 @@ void RepeatedTimerTask::reset(int timeout_ms) {
     _timeout_ms = timeout_ms;
     BRAFT_RETURN_IF(_stopped);
     CHECK(_running);
-    const int rc = bthread_timer_del(_timer);
+    const int rc = del_timer();
     if (rc == 0) {
         return schedule(lck);
     }
@@ -169,7 +196,7 @@ void RepeatedTimerTask::destroy() {
     }
     BRAFT_RETURN_IF(_stopped);
     _stopped = true;
-    const int rc = bthread_timer_del(_timer);
+    const int rc = del_timer();
     if (rc == 0) {
         _running = false;
         lck.unlock();
@@ -29,8 +29,9 @@ DISALLOW_COPY_AND_ASSIGN(RepeatedTimerTask);
 public:
     RepeatedTimerTask();
     virtual ~RepeatedTimerTask();
-    // Initialize timer task
-    int init(int timeout_ms);
+    // Initialize timer task, which runs in the bthread workers of
+    // |bthread_tag| if it's not negative
+    int init(int timeout_ms, int bthread_tag = -1);
 
     // Start the timer
     void start();
@@ -71,6 +72,10 @@ private:
     static void* run_on_timedout_in_new_thread(void* arg);
     void on_timedout();
     void schedule(std::unique_lock<raft_mutex_t>& lck);
+    // Add or delete the timer of _next_duetime on either the bthread timer
+    // thread or the TimerWheel
+    int add_timer();
+    int del_timer();
 
     raft_mutex_t _mutex;
     bthread_timer_t _timer;
@@ -80,6 +85,9 @@ private:
     bool _running;
     bool _destroyed;
     bool _invoking;
+    bool _use_timer_wheel;
+    uint64_t _wheel_timer;
+    int _bthread_tag;
 };
 
 }  //  namespace braft
@@ -18,19 +18,28 @@
 
 #include "braft/replicator.h"
 
+#include <inttypes.h>
+
 #include <gflags/gflags.h>                       // DEFINE_int32
 #include <butil/unique_ptr.h>                    // std::unique_ptr
+#include <butil/object_pool.h>                   // butil::get_object
 #include <butil/time.h>                          // butil::gettimeofday_us
+#include <butil/string_printf.h>                 // butil::string_printf
 #include <brpc/controller.h>                     // brpc::Controller
+#include <brpc/errno.pb.h>                       // brpc::ERPCTIMEDOUT
 #include <brpc/reloadable_flags.h>               // BRPC_VALIDATE_GFLAG
 
 #include "braft/node.h"                          // NodeImpl
 #include "braft/ballot_box.h"                    // BallotBox 
 #include "braft/log_entry.h"                     // LogEntry
 #include "braft/snapshot_throttle.h"             // SnapshotThrottle
+#include "braft/append_entries_aggregator.h"     // AppendEntriesAggregator
+#include "braft/transport.h"                     // init_peer_channel
 
 namespace braft {
 
+DECLARE_int32(raft_hibernate_heartbeat_interval_ms);
+
 DEFINE_int32(raft_max_entries_size, 1024,
              "The max number of entries in AppendEntriesRequest");
 BRPC_VALIDATE_GFLAG(raft_max_entries_size, ::brpc::PositiveInteger);
@@ -40,6 +49,15 @@ DEFINE_int32(raft_max_parallel_append_entries_rpc_num, 1,
 BRPC_VALIDATE_GFLAG(raft_max_parallel_append_entries_rpc_num,
                     ::brpc::PositiveInteger);
 
+DEFINE_int32(raft_replicator_connection_num, 1,
+             "The number of connections to each peer over which the parallel "
+             "AppendEntries requests are striped, so that the replication is "
+             "not limited by the congestion window of a single connection. "
+             "The followers should enable raft_enable_append_entries_cache "
+             "to reorder the requests arriving out of order. Takes effect on "
+             "new replicators");
+BRPC_VALIDATE_GFLAG(raft_replicator_connection_num, ::brpc::PositiveInteger);
+
 DEFINE_int32(raft_max_body_size, 512 * 1024,
              "The max byte size of AppendEntriesRequest");
 BRPC_VALIDATE_GFLAG(raft_max_body_size, ::brpc::PositiveInteger);
@@ -49,11 +67,61 @@ DEFINE_int32(raft_retry_replicate_interval_ms, 1000,
 BRPC_VALIDATE_GFLAG(raft_retry_replicate_interval_ms,
                     brpc::PositiveInteger);
 
+DEFINE_bool(raft_replicator_adaptive_window, false,
+            "Limit the in-flight AppendEntries RPCs of each replicator by a "
+            "byte window instead of raft_max_parallel_append_entries_rpc_num. "
+            "The window grows additively on successful responses and shrinks "
+            "by half on timeouts or EBUSY");
+BRPC_VALIDATE_GFLAG(raft_replicator_adaptive_window, ::brpc::PassValidate);
+
+DEFINE_int64(raft_replicator_min_window_bytes, 512 * 1024,
+             "The min byte size of the adaptive in-flight window");
+BRPC_VALIDATE_GFLAG(raft_replicator_min_window_bytes, ::brpc::PositiveInteger);
+
+DEFINE_int64(raft_replicator_max_window_bytes, 64 * 1024 * 1024,
+             "The max byte size of the adaptive in-flight window");
+BRPC_VALIDATE_GFLAG(raft_replicator_max_window_bytes, ::brpc::PositiveInteger);
+
+DEFINE_int64(raft_follower_backlog_limit_bytes, 0,
+             "Send at most one AppendEntries RPC at a time to the follower of "
+             "which the logs in memory exceed this value, 0 to disable");
+BRPC_VALIDATE_GFLAG(raft_follower_backlog_limit_bytes,
+                    ::brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_replicator_read_ahead, true,
+            "Read the logs of the next AppendEntries in the background while "
+            "the replicator of a lagging follower waits for the in-flight ones");
+BRPC_VALIDATE_GFLAG(raft_replicator_read_ahead, ::brpc::PassValidate);
+
+DEFINE_bool(raft_expose_replicator_bvars, false,
+            "Track the AppendEntries RPCs of each replicator in bvars named "
+            "after the group and the peer, which are also shown in /raft and "
+            "PeerStatus. Takes effect on the replicators started afterwards");
+BRPC_VALIDATE_GFLAG(raft_expose_replicator_bvars, ::brpc::PassValidate);
+
+DEFINE_bool(raft_enable_packed_entries, false,
+            "Send the metas of the entries in fixed-width records instead of "
+            "repeated EntryMeta to the peers supporting it, which saves the "
+            "bytes and the parsing of the requests of tiny entries");
+BRPC_VALIDATE_GFLAG(raft_enable_packed_entries, ::brpc::PassValidate);
+
+DEFINE_bool(raft_propagate_committed_index, false,
+            "Leaders send the new committed index to the idle followers as "
+            "soon as it advances instead of with the next heartbeat, so that "
+            "the followers apply the logs about one RTT after the leader");
+BRPC_VALIDATE_GFLAG(raft_propagate_committed_index, ::brpc::PassValidate);
+
+// Issued to a replicator through bthread_id_error when the committed index
+// advances, which is delivered once the replicator is unlocked
+static const int ECOMMITTEDINDEX = 10100;
+
 static bvar::LatencyRecorder g_send_entries_latency("raft_send_entries");
 static bvar::LatencyRecorder g_normalized_send_entries_latency(
              "raft_send_entries_normalized");
 static bvar::CounterRecorder g_send_entries_batch_counter(
              "raft_send_entries_batch_counter");
+static bvar::Adder<int64_t> g_read_ahead_entries(
+             "raft_replicator_read_ahead_entries");
 
 ReplicatorOptions::ReplicatorOptions()
     : dynamic_heartbeat_timeout_ms(NULL)
@@ -65,13 +133,100 @@ ReplicatorOptions::ReplicatorOptions()
 {
 }
 
+struct Replicator::AppendEntriesCall : public google::protobuf::Closure {
+    AppendEntriesCall() : id(0), rpc_send_time(0), is_heartbeat(false) {}
+    void Run() {
+        // The handlers return this call to the pool
+        if (is_heartbeat) {
+            _on_heartbeat_returned(id, this, rpc_send_time);
+        } else {
+            _on_rpc_returned(id, this, rpc_send_time);
+        }
+    }
+    // Set |call| as the done of the RPC issued now
+    static google::protobuf::Closure* done(AppendEntriesCallGuard* call,
+                                           ReplicatorId id, bool is_heartbeat) {
+        (*call)->id = id;
+        (*call)->rpc_send_time = butil::monotonic_time_ms();
+        (*call)->is_heartbeat = is_heartbeat;
+        return call->release();
+    }
+
+    brpc::Controller cntl;
+    AppendEntriesRequest request;
+    AppendEntriesResponse response;
+    ReplicatorId id;
+    int64_t rpc_send_time;
+    bool is_heartbeat;
+};
+
+Replicator::AppendEntriesCall* Replicator::_new_append_entries_call() {
+    return butil::get_object<AppendEntriesCall>();
+}
+
+void Replicator::AppendEntriesCallDeleter::operator()(
+        AppendEntriesCall* call) const {
+    call->cntl.Reset();
+    // Clear() keeps the allocated EntryMeta for the next request
+    call->request.Clear();
+    call->response.Clear();
+    butil::return_object(call);
+}
+
+// Allocated only with raft_expose_replicator_bvars, since the recorders and
+// windows of thousands of replicators are costly
+struct Replicator::Metrics {
+    explicit Metrics(Replicator* r)
+        : entries_per_rpc_window(&entries_per_rpc, -1)
+        , bytes_per_rpc_window(&bytes_per_rpc, -1)
+        , lag(_get_lag, r)
+        , since_last_success_ms(_get_since_last_success_ms, r)
+    {}
+
+    void get_status(PeerStatus* status) {
+        status->append_entries_latency_us = append_entries_latency.latency();
+        status->append_entries_latency_p99_us =
+                append_entries_latency.latency_percentile(0.99);
+        status->entries_per_rpc =
+                entries_per_rpc_window.get_value().get_average_int();
+        status->bytes_per_rpc =
+                bytes_per_rpc_window.get_value().get_average_int();
+    }
+
+    bvar::LatencyRecorder append_entries_latency;
+    bvar::IntRecorder entries_per_rpc;
+    bvar::Window<bvar::IntRecorder> entries_per_rpc_window;
+    bvar::IntRecorder bytes_per_rpc;
+    bvar::Window<bvar::IntRecorder> bytes_per_rpc_window;
+    bvar::PassiveStatus<int64_t> lag;
+    bvar::PassiveStatus<int64_t> since_last_success_ms;
+};
+
 Replicator::Replicator() 
-    : _next_index(0)
+    : _control_channel_ptr(&_sending_channel)
+    , _next_stripe(0)
+    , _next_index(0)
     , _flying_append_entries_size(0)
+    , _flying_append_entries_bytes(0)
+    , _window_bytes(FLAGS_raft_replicator_min_window_bytes)
+    , _peer_backlog_bytes(0)
+    , _committed_index_sent(0)
+    , _peer_compress_supported(false)
+    , _peer_packed_entries_supported(false)
+    , _peer_election_priority(0)
+    , _peer_leader_count(-1)
+    , _peer_leader_weight(0)
+    , _srtt_us(-1)
+    , _rttvar_us(-1)
+    , _relay_channel(NULL)
+    , _relay_disabled_until_ms(0)
+    , _donor_channel(NULL)
+    , _read_ahead_running(false)
     , _consecutive_error_times(0)
     , _has_succeeded(false)
     , _timeout_now_index(0)
     , _last_rpc_send_timestamp(0)
+    , _last_ack_timestamp(0)
     , _heartbeat_counter(0)
     , _append_entries_counter(0)
     , _install_snapshot_counter(0)
@@ -80,6 +235,9 @@ Replicator::Replicator()
     , _is_waiter_canceled(false)
     , _reader(NULL)
     , _catchup_closure(NULL)
+    , _match_index(0)
+    , _last_append_success_ms(0)
+    , _metrics(NULL)
 {
     _install_snapshot_in_fly.value = 0;
     _heartbeat_in_fly.value = 0;
@@ -88,9 +246,21 @@ Replicator::Replicator()
 }
 
 Replicator::~Replicator() {
+    // The lag bvar visits the LogManager of the node
+    delete _metrics;
+    _metrics = NULL;
     // bind lifecycle with node, Release
     // Replicator stop is async
     _close_reader();
+    delete _relay_channel;
+    _relay_channel = NULL;
+    delete _donor_channel;
+    _donor_channel = NULL;
+    for (size_t i = 0; i < _stripe_channels.size(); ++i) {
+        delete _stripe_channels[i];
+    }
+    _stripe_channels.clear();
+    _clear_read_ahead();
     if (_options.node) {
         _options.node->Release();
         _options.node = NULL;
@@ -107,19 +277,60 @@ int Replicator::start(const ReplicatorOptions& options, ReplicatorId *id) {
     brpc::ChannelOptions channel_opt;
     //channel_opt.connect_timeout_ms = *options.heartbeat_timeout_ms;
     channel_opt.timeout_ms = -1; // We don't need RPC timeout
-    if (r->_sending_channel.Init(options.peer_id.addr, &channel_opt) != 0) {
+    if (init_peer_channel(&r->_sending_channel, options.peer_id.addr,
+                          &channel_opt) != 0) {
         LOG(ERROR) << "Fail to init sending channel"
                    << ", group " << options.group_id;
         delete r;
         return -1;
     }
+    if (!options.control_connection_group.empty()) {
+        // Not queued behind the large AppendEntries on the same connection
+        channel_opt.connection_group = options.control_connection_group;
+        if (init_peer_channel(&r->_control_channel,
+                              options.peer_id.addr, &channel_opt) != 0) {
+            LOG(ERROR) << "Fail to init control channel"
+                       << ", group " << options.group_id;
+            delete r;
+            return -1;
+        }
+        r->_control_channel_ptr = &r->_control_channel;
+    }
+    for (int i = 1; i < FLAGS_raft_replicator_connection_num; ++i) {
+        channel_opt.connection_group = butil::string_printf("braft_stripe_%d", i);
+        brpc::Channel* channel = new brpc::Channel;
+        r->_stripe_channels.push_back(channel);
+        if (init_peer_channel(channel, options.peer_id.addr, &channel_opt) != 0) {
+            LOG(ERROR) << "Fail to init stripe channel " << i
+                       << ", group " << options.group_id;
+            delete r;
+            return -1;
+        }
+    }
 
     // bind lifecycle with node, AddRef
     // Replicator stop is async
     options.node->AddRef();
 
     r->_options = options;
+    if (!r->_options.committed_index_signaled) {
+        r->_options.committed_index_signaled.reset(
+                new butil::atomic<bool>(false));
+    }
+    r->_server_id_str = options.server_id.to_string();
+    r->_peer_id_str = options.peer_id.to_string();
     r->_next_index = r->_options.log_manager->last_log_index() + 1;
+    if (FLAGS_raft_expose_replicator_bvars) {
+        r->_expose_bvars();
+    }
+    if (!options.relay_id.is_empty() && r->_reset_relay(options.relay_id) != 0) {
+        delete r;
+        return -1;
+    }
+    if (!options.snapshot_donor_id.is_empty()) {
+        // Install the snapshots from this node if the donor is unavailable
+        r->_reset_snapshot_donor(options.snapshot_donor_id);
+    }
     if (bthread_id_create(&r->_id, r, _on_error) != 0) {
         LOG(ERROR) << "Fail to create bthread_id"
                    << ", group " << options.group_id;
@@ -170,6 +381,123 @@ int64_t Replicator::last_rpc_send_timestamp(ReplicatorId id) {
     return timestamp;
 }
 
+int64_t Replicator::last_ack_timestamp(ReplicatorId id) {
+    bthread_id_t dummy_id = { id };
+    Replicator* r = NULL;
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        return 0;
+    }
+    int64_t timestamp = r->_last_ack_timestamp;
+    CHECK_EQ(0, bthread_id_unlock(dummy_id))
+        << "Fail to unlock " << dummy_id;
+    return timestamp;
+}
+
+int Replicator::election_priority(ReplicatorId id) {
+    bthread_id_t dummy_id = { id };
+    Replicator* r = NULL;
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        return 0;
+    }
+    const int priority = r->_peer_election_priority;
+    CHECK_EQ(0, bthread_id_unlock(dummy_id))
+        << "Fail to unlock " << dummy_id;
+    return priority;
+}
+
+int Replicator::peer_leader_load(ReplicatorId id, int* leader_count,
+                                 int* weight) {
+    bthread_id_t dummy_id = { id };
+    Replicator* r = NULL;
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        return -1;
+    }
+    *leader_count = r->_peer_leader_count;
+    *weight = r->_peer_leader_weight;
+    CHECK_EQ(0, bthread_id_unlock(dummy_id))
+        << "Fail to unlock " << dummy_id;
+    return *leader_count >= 0 ? 0 : -1;
+}
+
+int Replicator::peer_rtt(ReplicatorId id, int64_t* srtt_us,
+                         int64_t* rttvar_us) {
+    bthread_id_t dummy_id = { id };
+    Replicator* r = NULL;
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        return -1;
+    }
+    *srtt_us = r->_srtt_us;
+    *rttvar_us = r->_rttvar_us;
+    CHECK_EQ(0, bthread_id_unlock(dummy_id))
+        << "Fail to unlock " << dummy_id;
+    return *srtt_us >= 0 ? 0 : -1;
+}
+
+void Replicator::_update_rtt(int64_t rtt_us) {
+    // Smoothed in the same way as the RTO of TCP, see RFC 6298
+    if (_srtt_us < 0) {
+        _srtt_us = rtt_us;
+        _rttvar_us = rtt_us / 2;
+        return;
+    }
+    const int64_t delta = rtt_us > _srtt_us ? rtt_us - _srtt_us
+                                            : _srtt_us - rtt_us;
+    _rttvar_us = (3 * _rttvar_us + delta) / 4;
+    _srtt_us = (7 * _srtt_us + rtt_us) / 8;
+}
+
+void Replicator::wake_up(ReplicatorId id) {
+    bthread_id_t dummy_id = { id };
+    Replicator* r = NULL;
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        return;
+    }
+    // The timer is not pending if the heartbeat is in flight, which is
+    // followed by the normal heartbeats anyway
+    const bool pending = bthread_timer_del(r->_heartbeat_timer) == 0;
+    CHECK_EQ(0, bthread_id_unlock(dummy_id))
+        << "Fail to unlock " << dummy_id;
+    if (pending) {
+        _on_timedout((void*)id);
+    }
+}
+
+void Replicator::propagate_committed_index(ReplicatorId id,
+                                           butil::atomic<bool>* signaled) {
+    if (signaled->exchange(true)) {
+        // The replicator reads the committed index after clearing it
+        return;
+    }
+    bthread_id_t dummy_id = { id };
+    // Fails if the replicator is stopped
+    bthread_id_error(dummy_id, ECOMMITTEDINDEX);
+}
+
+void Replicator::_signal_committed_index() {
+    if (!_options.committed_index_signaled->exchange(true)) {
+        // Delivered on unlocking _id
+        bthread_id_error(_id, ECOMMITTEDINDEX);
+    }
+}
+
+bool Replicator::_committed_index_stale() const {
+    return FLAGS_raft_propagate_committed_index &&
+           _committed_index_sent < _options.ballot_box->last_committed_index();
+}
+
+void Replicator::_send_committed_index() {
+    // The RPCs in flight are followed by _wait_more_entries or
+    // _on_heartbeat_returned which check it again
+    if (_st.st != IDLE || !_append_entries_in_fly.empty()
+            || !_committed_index_stale()
+            || bthread_timer_del(_heartbeat_timer) != 0) {
+        CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
+        return;
+    }
+    // _id is unlock in _send_empty_entries
+    _send_empty_entries(true);
+}
+
 void Replicator::wait_for_caught_up(ReplicatorId id, 
                                     int64_t max_margin,
                                     const timespec* due_time,
@@ -271,13 +599,11 @@ void Replicator::_block(long start_time_us, int error_code) {
 }
 
 void Replicator::_on_heartbeat_returned(
-        ReplicatorId id, brpc::Controller* cntl,
-        AppendEntriesRequest* request, 
-        AppendEntriesResponse* response,
-        int64_t rpc_send_time) {
-    std::unique_ptr<brpc::Controller> cntl_guard(cntl);
-    std::unique_ptr<AppendEntriesRequest>  req_guard(request);
-    std::unique_ptr<AppendEntriesResponse> res_guard(response);
+        ReplicatorId id, AppendEntriesCall* call, int64_t rpc_send_time) {
+    AppendEntriesCallGuard call_guard(call);
+    brpc::Controller* cntl = &call->cntl;
+    AppendEntriesRequest* request = &call->request;
+    AppendEntriesResponse* response = &call->response;
     Replicator *r = NULL;
     bthread_id_t dummy_id = { id };
     const long start_time_us = butil::gettimeofday_us();
@@ -285,15 +611,13 @@ void Replicator::_on_heartbeat_returned(
         return;
     }
 
-    std::stringstream ss;
-    ss << "node " << r->_options.group_id << ":" << r->_options.server_id 
-       << " received HeartbeatResponse from "
-       << r->_options.peer_id << " prev_log_index " << request->prev_log_index()
-       << " prev_log_term " << request->prev_log_term();
-               
     if (cntl->Failed()) {
-        ss << " fail, sleep.";
-        BRAFT_VLOG << ss.str();
+        BRAFT_VLOG << "node " << r->_options.group_id << ":"
+                   << r->_options.server_id
+                   << " received HeartbeatResponse from " << r->_options.peer_id
+                   << " prev_log_index " << request->prev_log_index()
+                   << " prev_log_term " << request->prev_log_term()
+                   << " fail, sleep.";
 
         // TODO: Should it be VLOG?
         LOG_IF(WARNING, (r->_consecutive_error_times++) % 10 == 0)
@@ -302,14 +626,29 @@ void Replicator::_on_heartbeat_returned(
                         << " _consecutive_error_times=" << r->_consecutive_error_times
                         << ", " << cntl->ErrorText();
         r->_start_heartbeat_timer(start_time_us);
+        NodeImpl* node_impl = r->_options.node;
+        const bool hibernating = node_impl->hibernating();
+        if (hibernating) {
+            node_impl->AddRef();
+        }
         CHECK_EQ(0, bthread_id_unlock(dummy_id)) << "Fail to unlock " << dummy_id;
+        if (hibernating) {
+            // Watch the failed peer with the normal heartbeats
+            node_impl->wake_up();
+            node_impl->Release();
+        }
         return;
     }
     r->_consecutive_error_times = 0;
+    r->_update_rtt(cntl->latency_us());
     if (response->term() > r->_options.term) {
-        ss << " fail, greater term " << response->term()
-           << " expect term " << r->_options.term;
-        BRAFT_VLOG << ss.str();
+        BRAFT_VLOG << "node " << r->_options.group_id << ":"
+                   << r->_options.server_id
+                   << " received HeartbeatResponse from " << r->_options.peer_id
+                   << " prev_log_index " << request->prev_log_index()
+                   << " prev_log_term " << request->prev_log_term()
+                   << " fail, greater term "
+                   << response->term() << " expect term " << r->_options.term;
 
         NodeImpl *node_impl = r->_options.node;
         // Acquire a reference of Node here in case that Node is detroyed
@@ -328,11 +667,39 @@ void Replicator::_on_heartbeat_returned(
     }
 
     bool readonly = response->has_readonly() && response->readonly();
-    BRAFT_VLOG << ss.str() << " readonly " << readonly;
+    BRAFT_VLOG << "node " << r->_options.group_id << ":"
+               << r->_options.server_id
+               << " received HeartbeatResponse from " << r->_options.peer_id
+               << " prev_log_index " << request->prev_log_index()
+               << " prev_log_term " << request->prev_log_term()
+               << " readonly " << readonly;
+    if (response->has_backlog_bytes()) {
+        r->_peer_backlog_bytes = response->backlog_bytes();
+    }
+    if (response->attachment_compress_supported()) {
+        r->_peer_compress_supported = true;
+    }
+    if (response->packed_entries_supported()) {
+        r->_peer_packed_entries_supported = true;
+    }
+    if (response->has_election_priority()) {
+        r->_peer_election_priority = response->election_priority();
+    }
+    if (response->has_server_leader_count()) {
+        r->_peer_leader_count = response->server_leader_count();
+        r->_peer_leader_weight = response->server_leader_weight();
+    }
     if (rpc_send_time > r->_last_rpc_send_timestamp) {
         r->_last_rpc_send_timestamp = rpc_send_time; 
     }
+    if (rpc_send_time > r->_last_ack_timestamp) {
+        r->_last_ack_timestamp = rpc_send_time;
+    }
     r->_start_heartbeat_timer(start_time_us);
+    if (r->_committed_index_stale()) {
+        // Committed while the heartbeat was in flight
+        r->_signal_committed_index();
+    }
     NodeImpl* node_impl = NULL;
     // Check if readonly config changed
     if ((readonly && r->_readonly_index == 0) ||
@@ -352,13 +719,12 @@ void Replicator::_on_heartbeat_returned(
     return;
 }
 
-void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
-                     AppendEntriesRequest* request, 
-                     AppendEntriesResponse* response,
-                     int64_t rpc_send_time) {
-    std::unique_ptr<brpc::Controller> cntl_guard(cntl);
-    std::unique_ptr<AppendEntriesRequest>  req_guard(request);
-    std::unique_ptr<AppendEntriesResponse> res_guard(response);
+void Replicator::_on_rpc_returned(ReplicatorId id, AppendEntriesCall* call,
+                                  int64_t rpc_send_time) {
+    AppendEntriesCallGuard call_guard(call);
+    brpc::Controller* cntl = &call->cntl;
+    AppendEntriesRequest* request = &call->request;
+    AppendEntriesResponse* response = &call->response;
     Replicator *r = NULL;
     bthread_id_t dummy_id = { id };
     const long start_time_us = butil::gettimeofday_us();
@@ -370,7 +736,7 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
     ss << "node " << r->_options.group_id << ":" << r->_options.server_id 
        << " received AppendEntriesResponse from "
        << r->_options.peer_id << " prev_log_index " << request->prev_log_index()
-       << " prev_log_term " << request->prev_log_term() << " count " << request->entries_size();
+       << " prev_log_term " << request->prev_log_term() << " count " << append_entries_count(*request);
 
     bool valid_rpc = false;
     int64_t rpc_first_index = request->prev_log_index() + 1;
@@ -403,6 +769,21 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
                         << " fail to issue RPC to " << r->_options.peer_id
                         << " _consecutive_error_times=" << r->_consecutive_error_times
                         << ", " << cntl->ErrorText();
+        if (cntl->ErrorCode() == brpc::ERPCTIMEDOUT ||
+                cntl->ErrorCode() == EBUSY) {
+            r->_shrink_window();
+        }
+        if (request->has_relay_peer_id()) {
+            // Don't tell whether the relay or the follower fails, send to
+            // the follower directly for a while
+            LOG(WARNING) << "Group " << r->_options.group_id
+                         << " fail to relay AppendEntries to "
+                         << r->_options.peer_id << " through "
+                         << request->relay_peer_id()
+                         << ", send directly instead, " << cntl->ErrorText();
+            r->_relay_disabled_until_ms = butil::monotonic_time_ms()
+                                          + *r->_options.election_timeout_ms;
+        }
         // If the follower crashes, any RPC to the follower fails immediately,
         // so we need to block the follower for a while instead of looping until
         // it comes back or be removed
@@ -437,6 +818,9 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
         if (rpc_send_time > r->_last_rpc_send_timestamp) {
             r->_last_rpc_send_timestamp = rpc_send_time; 
         }
+        if (rpc_send_time > r->_last_ack_timestamp) {
+            r->_last_ack_timestamp = rpc_send_time;
+        }
         // prev_log_index and prev_log_term doesn't match
         r->_reset_next_index();
         if (response->last_log_index() + 1 < r->_next_index) {
@@ -478,7 +862,26 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
     if (rpc_send_time > r->_last_rpc_send_timestamp) {
         r->_last_rpc_send_timestamp = rpc_send_time; 
     }
-    const int entries_size = request->entries_size();
+    if (rpc_send_time > r->_last_ack_timestamp) {
+        r->_last_ack_timestamp = rpc_send_time;
+    }
+    if (response->has_backlog_bytes()) {
+        r->_peer_backlog_bytes = response->backlog_bytes();
+    }
+    if (response->attachment_compress_supported()) {
+        r->_peer_compress_supported = true;
+    }
+    if (response->packed_entries_supported()) {
+        r->_peer_packed_entries_supported = true;
+    }
+    if (response->has_election_priority()) {
+        r->_peer_election_priority = response->election_priority();
+    }
+    if (response->has_server_leader_count()) {
+        r->_peer_leader_count = response->server_leader_count();
+        r->_peer_leader_weight = response->server_leader_weight();
+    }
+    const int entries_size = append_entries_count(*request);
     const int64_t rpc_last_log_index = request->prev_log_index() + entries_size;
     BRAFT_VLOG_IF(entries_size > 0) << "Group " << r->_options.group_id
                                     << " replicated logs in [" 
@@ -486,10 +889,22 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
                                     << rpc_last_log_index
                                     << "] to peer " << r->_options.peer_id;
     if (entries_size > 0) {
+        EntryTracer* tracer = r->_options.node->entry_tracer();
+        if (!tracer->empty()) {
+            tracer->on_replicated(min_flying_index, rpc_last_log_index);
+        }
         r->_options.ballot_box->commit_at(
                 min_flying_index, rpc_last_log_index,
                 r->_options.peer_id);
         g_send_entries_latency << cntl->latency_us();
+        if (r->_metrics) {
+            r->_metrics->append_entries_latency << cntl->latency_us();
+            r->_metrics->entries_per_rpc << entries_size;
+            r->_metrics->bytes_per_rpc << cntl->request_attachment().size();
+        }
+        r->_match_index.store(rpc_last_log_index, butil::memory_order_relaxed);
+        r->_last_append_success_ms.store(butil::monotonic_time_ms(),
+                                         butil::memory_order_relaxed);
         if (cntl->request_attachment().size() > 0) {
             g_normalized_send_entries_latency << 
                 cntl->latency_us() * 1024 / cntl->request_attachment().size();
@@ -500,6 +915,8 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
     while (!r->_append_entries_in_fly.empty() &&
            r->_append_entries_in_fly.front().log_index <= rpc_first_index) {
         r->_flying_append_entries_size -= r->_append_entries_in_fly.front().entries_size;
+        r->_flying_append_entries_bytes -= r->_append_entries_in_fly.front().bytes;
+        r->_grow_window(r->_append_entries_in_fly.front().bytes);
         r->_append_entries_in_fly.pop_front();
     }
     r->_has_succeeded = true;
@@ -533,26 +950,44 @@ int Replicator::_fill_common_fields(AppendEntriesRequest* request,
     }
     request->set_term(_options.term);
     request->set_group_id(_options.group_id);
-    request->set_server_id(_options.server_id.to_string());
-    request->set_peer_id(_options.peer_id.to_string());
+    request->set_server_id(_server_id_str);
+    request->set_peer_id(_peer_id_str);
     request->set_prev_log_index(prev_log_index);
     request->set_prev_log_term(prev_log_term);
     request->set_committed_index(_options.ballot_box->last_committed_index());
+    _committed_index_sent = std::max(_committed_index_sent,
+                                     request->committed_index());
+    const int max_election_priority = _options.node->max_election_priority();
+    if (max_election_priority > 0) {
+        request->set_max_election_priority(max_election_priority);
+    }
+    if (_options.node->hibernating()) {
+        request->set_hibernate(true);
+    }
+    const int election_timeout_ms =
+            _options.node->adaptive_election_timeout_ms();
+    if (election_timeout_ms > 0) {
+        request->set_election_timeout_ms(election_timeout_ms);
+    }
     return 0;
 }
 
 void Replicator::_send_empty_entries(bool is_heartbeat) {
-    std::unique_ptr<brpc::Controller> cntl(new brpc::Controller);
-    std::unique_ptr<AppendEntriesRequest> request(new AppendEntriesRequest);
-    std::unique_ptr<AppendEntriesResponse> response(new AppendEntriesResponse);
+    AppendEntriesCallGuard call_guard(_new_append_entries_call());
+    AppendEntriesCall* call = call_guard.get();
+    brpc::Controller* cntl = &call->cntl;
+    AppendEntriesRequest* request = &call->request;
     if (_fill_common_fields(
-                request.get(), _next_index - 1, is_heartbeat) != 0) {
+                request, _next_index - 1, is_heartbeat) != 0) {
         CHECK(!is_heartbeat);
         // _id is unlock in _install_snapshot
         return _install_snapshot();
     }
+    const bool aggregated = is_heartbeat && FLAGS_raft_enable_multi_heartbeat;
     if (is_heartbeat) {
-        _heartbeat_in_fly = cntl->call_id();
+        if (!aggregated) {
+            _heartbeat_in_fly = cntl->call_id();
+        }
         _heartbeat_counter++;
         // set RPC timeout for heartbeat, how long should timeout be is waiting to be optimized.
         cntl->set_timeout_ms(*_options.election_timeout_ms / 2);
@@ -562,7 +997,8 @@ void Replicator::_send_empty_entries(bool is_heartbeat) {
         _st.last_log_index = _next_index - 1;
         CHECK(_append_entries_in_fly.empty());
         CHECK_EQ(_flying_append_entries_size, 0);
-        _append_entries_in_fly.push_back(FlyingAppendEntriesRpc(_next_index, 0, cntl->call_id()));
+        _append_entries_in_fly.push_back(FlyingAppendEntriesRpc(_next_index, 0, 0,
+                                                                cntl->call_id()));
         _append_entries_counter++;
     }
 
@@ -572,26 +1008,27 @@ void Replicator::_send_empty_entries(bool is_heartbeat) {
         << " prev_log_index " << request->prev_log_index()
         << " last_committed_index " << request->committed_index();
 
-    google::protobuf::Closure* done = brpc::NewCallback(
-                is_heartbeat ? _on_heartbeat_returned : _on_rpc_returned, 
-                _id.value, cntl.get(), request.get(), response.get(),
-                butil::monotonic_time_ms());
+    google::protobuf::Closure* done = AppendEntriesCall::done(
+                &call_guard, _id.value, is_heartbeat);
 
-    RaftService_Stub stub(&_sending_channel);
-    stub.append_entries(cntl.release(), request.release(), 
-                        response.release(), done);
+    if (aggregated) {
+        AppendEntriesAggregator::heartbeat_aggregator()->send(
+                _options.server_id.addr, _options.peer_id.addr,
+                cntl, request, &call->response, done);
+    } else {
+        RaftService_Stub stub(is_heartbeat ? _control_channel_ptr
+                                           : &_sending_channel);
+        stub.append_entries(cntl, request, &call->response, done);
+    }
     CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
 }
 
-int Replicator::_prepare_entry(int offset, EntryMeta* em, butil::IOBuf *data) {
+int Replicator::_prepare_entry(const LogEntry* entry, EntryMeta* em,
+                               butil::IOBuf *data) {
     if (data->length() >= (size_t)FLAGS_raft_max_body_size) {
         return ERANGE;
     }
-    const int64_t log_index = _next_index + offset;
-    LogEntry *entry = _options.log_manager->get_entry(log_index);
-    if (entry == NULL) {
-        return ENOENT;
-    }
+    const int64_t log_index = entry->id.index;
     // When leader become readonly, no new user logs can submit. On the other side,
     // if any user log are accepted after this replicator become readonly, the leader
     // still have enough followers to commit logs, we can safely stop waiting new logs
@@ -602,31 +1039,32 @@ int Replicator::_prepare_entry(int offset, EntryMeta* em, butil::IOBuf *data) {
         }
         _readonly_index = log_index + 1;
     }
-    em->set_term(entry->id.term);
-    em->set_type(entry->type);
     if (entry->peers != NULL) {
         CHECK(!entry->peers->empty()) << "log_index=" << log_index;
-        for (size_t i = 0; i < entry->peers->size(); ++i) {
-            em->add_peers((*entry->peers)[i].to_string());
-        }
-        if (entry->old_peers != NULL) {
-            for (size_t i = 0; i < entry->old_peers->size(); ++i) {
-                em->add_old_peers((*entry->old_peers)[i].to_string());
-            }
-        }
     } else {
         CHECK(entry->type != ENTRY_TYPE_CONFIGURATION) << "log_index=" << log_index;
     }
-    em->set_data_len(entry->data.length());
+    // The encoded meta is shared by the replicators of all the followers
+    em->CopyFrom(entry->meta());
+    if (_options.peer_id.is_witness()) {
+        // A witness keeps the metadata of the logs only
+        em->set_data_len(0);
+        return 0;
+    }
     data->append(entry->data);
-    entry->Release();
     return 0;
 }
 
+brpc::Channel* Replicator::_next_sending_channel() {
+    if (_stripe_channels.empty()) {
+        return &_sending_channel;
+    }
+    const size_t stripe = _next_stripe++ % (_stripe_channels.size() + 1);
+    return stripe == 0 ? &_sending_channel : _stripe_channels[stripe - 1];
+}
+
 void Replicator::_send_entries() {
-    if (_flying_append_entries_size >= FLAGS_raft_max_entries_size ||
-        _append_entries_in_fly.size() >= (size_t)FLAGS_raft_max_parallel_append_entries_rpc_num ||
-        _st.st == BLOCKING) {
+    if (!_has_room_in_flight() || _st.st == BLOCKING) {
         BRAFT_VLOG << "node " << _options.group_id << ":" << _options.server_id
             << " skip sending AppendEntriesRequest to " << _options.peer_id
             << ", too many requests in flying, or the replicator is in block,"
@@ -635,23 +1073,49 @@ void Replicator::_send_entries() {
         return;
     }
 
-    std::unique_ptr<brpc::Controller> cntl(new brpc::Controller);
-    std::unique_ptr<AppendEntriesRequest> request(new AppendEntriesRequest);
-    std::unique_ptr<AppendEntriesResponse> response(new AppendEntriesResponse);
-    if (_fill_common_fields(request.get(), _next_index - 1, false) != 0) {
+    AppendEntriesCallGuard call_guard(_new_append_entries_call());
+    AppendEntriesCall* call = call_guard.get();
+    brpc::Controller* cntl = &call->cntl;
+    AppendEntriesRequest* request = &call->request;
+    if (_fill_common_fields(request, _next_index - 1, false) != 0) {
         _reset_next_index();
         return _install_snapshot();
     }
-    EntryMeta em;
     const int max_entries_size = FLAGS_raft_max_entries_size - _flying_append_entries_size;
     int prepare_entry_rc = 0;
     CHECK_GT(max_entries_size, 0);
-    for (int i = 0; i < max_entries_size; ++i) {
-        prepare_entry_rc = _prepare_entry(i, &em, &cntl->request_attachment());
-        if (prepare_entry_rc != 0) {
-            break;
+    // Get the logs in one batch so that they are read from the storage with
+    // the least reads
+    std::vector<LogEntry*> entries;
+    entries.reserve(std::min(max_entries_size, 1024));
+    int64_t max_body_size = FLAGS_raft_max_body_size;
+    if (FLAGS_raft_replicator_adaptive_window) {
+        max_body_size = std::min(max_body_size,
+                                 _window_bytes - _flying_append_entries_bytes);
+    }
+    _take_read_ahead(max_entries_size, max_body_size, &entries);
+    if (entries.empty()) {
+        _options.log_manager->get_entries(_next_index, max_entries_size,
+                                          max_body_size, &entries);
+    }
+    if (entries.empty()) {
+        prepare_entry_rc = ENOENT;
+    }
+    // The relay attaches the data from its own log, which is still collected
+    // here for the limits of the request
+    const bool relayed = _use_relay() && !_options.peer_id.is_witness();
+    butil::IOBuf relayed_data;
+    butil::IOBuf* data = relayed ? &relayed_data : &cntl->request_attachment();
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (prepare_entry_rc == 0) {
+            // The EntryMeta cleared by the pool is reused
+            prepare_entry_rc = _prepare_entry(
+                    entries[i], request->add_entries(), data);
+            if (prepare_entry_rc != 0) {
+                request->mutable_entries()->RemoveLast();
+            }
         }
-        request->add_entries()->Swap(&em);
+        entries[i]->Release();
     }
     if (request->entries_size() == 0) {
         // _id is unlock in _wait_more
@@ -672,11 +1136,22 @@ void Replicator::_send_entries() {
         return _wait_more_entries();
     }
 
+    if (_peer_compress_supported && !relayed) {
+        const int compress_type = compress_replication_data(
+                replication_compress_type(_options.peer_id.addr),
+                &cntl->request_attachment());
+        if (compress_type != COMPRESS_NONE) {
+            request->set_attachment_compress_type(compress_type);
+        }
+    }
     _append_entries_in_fly.push_back(FlyingAppendEntriesRpc(_next_index,
-                                     request->entries_size(), cntl->call_id()));
+                                     request->entries_size(),
+                                     data->size(),
+                                     cntl->call_id()));
     _append_entries_counter++;
     _next_index += request->entries_size();
     _flying_append_entries_size += request->entries_size();
+    _flying_append_entries_bytes += data->size();
     
     g_send_entries_batch_counter << request->entries_size();
 
@@ -689,15 +1164,122 @@ void Replicator::_send_entries() {
     _st.st = APPENDING_ENTRIES;
     _st.first_log_index = _min_flying_index();
     _st.last_log_index = _next_index - 1;
-    google::protobuf::Closure* done = brpc::NewCallback(
-                _on_rpc_returned, _id.value, cntl.get(), 
-                request.get(), response.get(), butil::monotonic_time_ms());
-    RaftService_Stub stub(&_sending_channel);
-    stub.append_entries(cntl.release(), request.release(), 
-                        response.release(), done);
+    if (FLAGS_raft_enable_packed_entries && _peer_packed_entries_supported
+            && pack_entry_metas(request->entries(), request->prev_log_term(),
+                                request->mutable_packed_entries())) {
+        request->clear_entries();
+    } else {
+        request->clear_packed_entries();
+    }
+    google::protobuf::Closure* done = AppendEntriesCall::done(
+                &call_guard, _id.value, false);
+    if (relayed) {
+        request->set_relay_peer_id(_relay_id.to_string());
+        cntl->set_timeout_ms(*_options.election_timeout_ms);
+        RaftService_Stub stub(_relay_channel);
+        stub.append_entries(cntl, request, &call->response, done);
+    } else if (FLAGS_raft_enable_multi_append_entries) {
+        AppendEntriesAggregator::entries_aggregator()->send(
+                _options.server_id.addr, _options.peer_id.addr,
+                cntl, request, &call->response, done);
+    } else {
+        RaftService_Stub stub(_next_sending_channel());
+        stub.append_entries(cntl, request, &call->response, done);
+    }
+    _start_read_ahead();
     _wait_more_entries();
 }
 
+struct ReadAheadArg {
+    ReplicatorId id;
+    NodeImpl* node;
+    LogManager* log_manager;
+    int64_t first_index;
+    size_t max_count;
+    size_t max_bytes;
+};
+
+void Replicator::_start_read_ahead() {
+    // Only the replicator which is about to wait for the in-flight RPCs with
+    // more logs to send benefits from reading ahead
+    if (!FLAGS_raft_replicator_read_ahead || _read_ahead_running
+            || !_read_ahead_entries.empty() || _has_room_in_flight()
+            || _options.log_manager->last_log_index() - _next_index + 1
+                    <= FLAGS_raft_max_entries_size) {
+        return;
+    }
+    ReadAheadArg* arg = new ReadAheadArg;
+    arg->id = _id.value;
+    arg->node = _options.node;
+    arg->node->AddRef();  // Keeps the LogManager alive
+    arg->log_manager = _options.log_manager;
+    arg->first_index = _next_index;
+    arg->max_count = FLAGS_raft_max_entries_size;
+    arg->max_bytes = FLAGS_raft_max_body_size;
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, _run_read_ahead, arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        arg->node->Release();
+        delete arg;
+        return;
+    }
+    _read_ahead_running = true;
+}
+
+void* Replicator::_run_read_ahead(void* arg) {
+    ReadAheadArg* read_ahead = (ReadAheadArg*)arg;
+    std::vector<LogEntry*> entries;
+    read_ahead->log_manager->get_entries(read_ahead->first_index,
+                                         read_ahead->max_count,
+                                         read_ahead->max_bytes, &entries);
+    Replicator* r = NULL;
+    bthread_id_t dummy_id = { read_ahead->id };
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        for (size_t i = 0; i < entries.size(); ++i) {
+            entries[i]->Release();
+        }
+    } else {
+        r->_read_ahead_running = false;
+        r->_clear_read_ahead();
+        r->_read_ahead_entries.assign(entries.begin(), entries.end());
+        CHECK_EQ(0, bthread_id_unlock(dummy_id)) << "Fail to unlock " << dummy_id;
+    }
+    read_ahead->node->Release();
+    delete read_ahead;
+    return NULL;
+}
+
+void Replicator::_take_read_ahead(size_t max_count, size_t max_bytes,
+                                  std::vector<LogEntry*>* entries) {
+    // Drop the logs which have been sent
+    while (!_read_ahead_entries.empty() &&
+            _read_ahead_entries.front()->id.index < _next_index) {
+        _read_ahead_entries.front()->Release();
+        _read_ahead_entries.pop_front();
+    }
+    if (_read_ahead_entries.empty() ||
+            _read_ahead_entries.front()->id.index != _next_index) {
+        // _next_index was reset
+        return _clear_read_ahead();
+    }
+    size_t bytes = 0;
+    while (!_read_ahead_entries.empty() && entries->size() < max_count
+            && bytes < max_bytes) {
+        LogEntry* entry = _read_ahead_entries.front();
+        _read_ahead_entries.pop_front();
+        bytes += entry->data.size();
+        entries->push_back(entry);
+    }
+    g_read_ahead_entries << entries->size();
+}
+
+void Replicator::_clear_read_ahead() {
+    for (size_t i = 0; i < _read_ahead_entries.size(); ++i) {
+        _read_ahead_entries[i]->Release();
+    }
+    _read_ahead_entries.clear();
+}
+
 int Replicator::_continue_sending(void* arg, int error_code) {
     Replicator* r = NULL;
     bthread_id_t id = { (uint64_t)arg };
@@ -738,9 +1320,47 @@ int Replicator::_continue_sending(void* arg, int error_code) {
     return 0;
 }
 
+bool Replicator::_has_room_in_flight() const {
+    if (_flying_append_entries_size >= FLAGS_raft_max_entries_size) {
+        return false;
+    }
+    // Pace the follower which can't keep up with flushing or applying, the
+    // quorum is not affected as the other followers are sent as usual
+    if (FLAGS_raft_follower_backlog_limit_bytes > 0 &&
+            _peer_backlog_bytes > FLAGS_raft_follower_backlog_limit_bytes) {
+        return _append_entries_in_fly.empty();
+    }
+    if (FLAGS_raft_replicator_adaptive_window) {
+        return _flying_append_entries_bytes < _window_bytes;
+    }
+    return _append_entries_in_fly.size() <
+                (size_t)FLAGS_raft_max_parallel_append_entries_rpc_num;
+}
+
+void Replicator::_grow_window(int64_t acked_bytes) {
+    if (!FLAGS_raft_replicator_adaptive_window) {
+        return;
+    }
+    // Grow by about raft_max_body_size after a whole window is acked
+    const int64_t step = std::max<int64_t>(
+            1, FLAGS_raft_max_body_size * acked_bytes / std::max<int64_t>(_window_bytes, 1));
+    _window_bytes = std::min(_window_bytes + step,
+                             FLAGS_raft_replicator_max_window_bytes);
+    _window_bytes = std::max(_window_bytes, FLAGS_raft_replicator_min_window_bytes);
+}
+
+void Replicator::_shrink_window() {
+    if (!FLAGS_raft_replicator_adaptive_window) {
+        return;
+    }
+    _window_bytes = std::max(_window_bytes / 2,
+                             FLAGS_raft_replicator_min_window_bytes);
+    BRAFT_VLOG << "Group " << _options.group_id << " shrink the window of "
+               << _options.peer_id << " to " << _window_bytes;
+}
+
 void Replicator::_wait_more_entries() {
-    if (_wait_id == 0 && FLAGS_raft_max_entries_size > _flying_append_entries_size &&
-        (size_t)FLAGS_raft_max_parallel_append_entries_rpc_num > _append_entries_in_fly.size()) {
+    if (_wait_id == 0 && _has_room_in_flight()) {
         _wait_id = _options.log_manager->wait(
                 _next_index - 1, _continue_sending, (void*)_id.value);
         _is_waiter_canceled = false;
@@ -749,10 +1369,28 @@ void Replicator::_wait_more_entries() {
     }
     if (_flying_append_entries_size == 0) {
         _st.st = IDLE;
+        if (_committed_index_stale()) {
+            // The logs were committed after the RPCs were sent
+            _signal_committed_index();
+        }
     }
     CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
 }
 
+struct Replicator::GetSnapshotUriDone : public google::protobuf::Closure {
+    void Run() {
+        _on_get_snapshot_uri_returned(this);
+        delete this;
+    }
+    ReplicatorId id;
+    // The snapshot of this node
+    SnapshotMeta meta;
+    std::string uri;
+    brpc::Controller cntl;
+    GetSnapshotUriRequest request;
+    GetSnapshotUriResponse response;
+};
+
 void Replicator::_install_snapshot() {
     if (_reader) {
         // follower's readonly mode change may cause two install_snapshot
@@ -774,6 +1412,10 @@ void Replicator::_install_snapshot() {
     // pre-set replictor state to INSTALLING_SNAPSHOT, so replicator could be
     // blocked if something is wrong, such as throttled for a period of time 
     _st.st = INSTALLING_SNAPSHOT;
+    _install_snapshot_reason = butil::string_printf(
+            "next_index=%" PRId64 " first_log_index=%" PRId64 ", %s",
+            _next_index, _options.log_manager->first_log_index(),
+            _options.log_manager->last_truncation().c_str());
 
     _reader = _options.snapshot_storage->open();
     if (!_reader) {
@@ -790,16 +1432,21 @@ void Replicator::_install_snapshot() {
         node_impl->Release();
         return;
     } 
-    std::string uri = _reader->generate_uri_for_copy();
-    // NOTICE: If uri is something wrong, retry later instead of reporting error
-    // immediately(making raft Node error), as FileSystemAdaptor layer of _reader is 
-    // user defined and may need some control logic when opened
-    if (uri.empty()) {
-        LOG(WARNING) << "node " << _options.group_id << ":" << _options.server_id
-                     << " refuse to send InstallSnapshotRequest to " << _options.peer_id
-                     << " because snapshot uri is empty";
-        _close_reader();
-        return _block(butil::gettimeofday_us(), EBUSY); 
+    // A witness copies no files but installs the meta only, which is carried
+    // by the request
+    std::string uri;
+    if (!_options.peer_id.is_witness()) {
+        uri = _reader->generate_uri_for_copy();
+        // NOTICE: If uri is something wrong, retry later instead of reporting error
+        // immediately(making raft Node error), as FileSystemAdaptor layer of _reader is 
+        // user defined and may need some control logic when opened
+        if (uri.empty()) {
+            LOG(WARNING) << "node " << _options.group_id << ":" << _options.server_id
+                         << " refuse to send InstallSnapshotRequest to " << _options.peer_id
+                         << " because snapshot uri is empty";
+            _close_reader();
+            return _block(butil::gettimeofday_us(), EBUSY); 
+        }
     }
     SnapshotMeta meta;
     // report error on failure
@@ -815,6 +1462,60 @@ void Replicator::_install_snapshot() {
         node_impl->Release();
         return;
     } 
+    if (_donor_channel != NULL && !_options.peer_id.is_witness()) {
+        // Ask the donor for its snapshot first, and keep the reader of this
+        // node open for the peer to fall back to
+        GetSnapshotUriDone* done = new GetSnapshotUriDone;
+        done->id = _id.value;
+        done->meta.Swap(&meta);
+        done->uri = uri;
+        done->request.set_group_id(_options.group_id);
+        done->request.set_server_id(_options.server_id.to_string());
+        done->request.set_peer_id(_donor_id.to_string());
+        done->cntl.set_timeout_ms(*_options.election_timeout_ms);
+        _install_snapshot_in_fly = done->cntl.call_id();
+        RaftService_Stub stub(_donor_channel);
+        stub.get_snapshot_uri(&done->cntl, &done->request, &done->response, done);
+        CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
+        return;
+    }
+    return _send_install_snapshot(meta, uri, NULL, std::string());
+}
+
+void Replicator::_on_get_snapshot_uri_returned(GetSnapshotUriDone* done) {
+    Replicator *r = NULL;
+    bthread_id_t dummy_id = { done->id };
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        return;
+    }
+    if (r->_reader == NULL) {
+        // The installing was given up
+        CHECK_EQ(0, bthread_id_unlock(dummy_id)) << "Fail to unlock " << dummy_id;
+        return;
+    }
+    // The peer goes on with the logs following the snapshot from this node
+    const int64_t required_index = r->_options.log_manager->first_log_index() - 1;
+    if (done->cntl.Failed()) {
+        LOG(WARNING) << "node " << r->_options.group_id << ":" << r->_options.server_id
+                     << " fail to get the snapshot of donor " << r->_donor_id
+                     << " : " << done->cntl.ErrorText();
+    } else if (!done->response.has_meta() ||
+               done->response.meta().last_included_index() < required_index) {
+        LOG(INFO) << "node " << r->_options.group_id << ":" << r->_options.server_id
+                  << " donor " << r->_donor_id << " has no snapshot at or beyond"
+                  << " index " << required_index;
+    } else {
+        return r->_send_install_snapshot(done->response.meta(),
+                                         done->response.uri(),
+                                         &done->meta, done->uri);
+    }
+    return r->_send_install_snapshot(done->meta, done->uri, NULL, std::string());
+}
+
+void Replicator::_send_install_snapshot(const SnapshotMeta& meta,
+                                        const std::string& uri,
+                                        const SnapshotMeta* fallback_meta,
+                                        const std::string& fallback_uri) {
     brpc::Controller* cntl = new brpc::Controller;
     cntl->set_max_retry(0);
     cntl->set_timeout_ms(-1);
@@ -826,11 +1527,16 @@ void Replicator::_install_snapshot() {
     request->set_peer_id(_options.peer_id.to_string());
     request->mutable_meta()->CopyFrom(meta);
     request->set_uri(uri);
+    if (fallback_meta) {
+        request->mutable_fallback_meta()->CopyFrom(*fallback_meta);
+        request->set_fallback_uri(fallback_uri);
+    }
 
     LOG(INFO) << "node " << _options.group_id << ":" << _options.server_id
               << " send InstallSnapshotRequest to " << _options.peer_id
               << " term " << _options.term << " last_included_term " << meta.last_included_term()
-              << " last_included_index " << meta.last_included_index() << " uri " << uri;
+              << " last_included_index " << meta.last_included_index() << " uri " << uri
+              << " as " << _install_snapshot_reason;
 
     _install_snapshot_in_fly = cntl->call_id();
     _install_snapshot_counter++;
@@ -891,7 +1597,9 @@ void Replicator::_on_install_snapshot_returned(
             // Let hearbeat do step down
             break;
         }
-        // Success 
+        // Success. If the peer fell back to the snapshot of this node, which
+        // may be older than the donor's, the AppendEntries find the right
+        // next_index
         r->_next_index = request->meta().last_included_index() + 1;
         ss << " success.";
         LOG(INFO) << ss.str();
@@ -949,9 +1657,11 @@ void Replicator::_on_timedout(void* arg) {
 }
 
 void Replicator::_start_heartbeat_timer(long start_time_us) {
+    const int interval_ms = _options.node->hibernating()
+            ? FLAGS_raft_hibernate_heartbeat_interval_ms
+            : *_options.dynamic_heartbeat_timeout_ms;
     const timespec due_time = butil::milliseconds_from(
-            butil::microseconds_to_timespec(start_time_us), 
-            *_options.dynamic_heartbeat_timeout_ms);
+            butil::microseconds_to_timespec(start_time_us), interval_ms);
     if (bthread_timer_add(&_heartbeat_timer, due_time,
                        _on_timedout, (void*)_id.value) != 0) {
         _on_timedout((void*)_id.value);
@@ -997,6 +1707,12 @@ int Replicator::_on_error(bthread_id_t id, void* arg, int error_code) {
             _send_heartbeat(reinterpret_cast<void*>(id.value));
         }
         return 0;
+    } else if (error_code == ECOMMITTEDINDEX) {
+        // The following commits signal again
+        r->_options.committed_index_signaled->store(false);
+        // id is unlock in _send_committed_index
+        r->_send_committed_index();
+        return 0;
     } else {
         CHECK(false) << "Group " << r->_options.group_id 
                      << " Unknown error_code=" << error_code;
@@ -1066,7 +1782,10 @@ void Replicator::_cancel_append_entries_rpcs() {
 void Replicator::_reset_next_index() {
     _next_index -= _flying_append_entries_size;
     _flying_append_entries_size = 0;
+    _flying_append_entries_bytes = 0;
     _cancel_append_entries_rpcs();
+    // The logs read ahead for the old _next_index are not sent any more
+    _clear_read_ahead();
     _is_waiter_canceled = true;
     if (_wait_id != 0) {
         _options.log_manager->remove_waiter(_wait_id);
@@ -1092,7 +1811,7 @@ void Replicator::_send_timeout_now(bool unlock_id, bool stop_after_finish,
     if (timeout_ms > 0) {
         cntl->set_timeout_ms(timeout_ms);
     }
-    RaftService_Stub stub(&_sending_channel);
+    RaftService_Stub stub(_control_channel_ptr);
     ::google::protobuf::Closure* done = brpc::NewCallback(
             _on_timeout_now_returned, _id.value, cntl, request, response,
             stop_after_finish);
@@ -1229,6 +1948,97 @@ bool Replicator::readonly(ReplicatorId id) {
     return readonly;
 }
 
+int Replicator::set_relay(ReplicatorId id, const PeerId& relay) {
+    Replicator *r = NULL;
+    bthread_id_t dummy_id = { id };
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        return 0;
+    }
+    const int rc = r->_reset_relay(relay);
+    CHECK_EQ(0, bthread_id_unlock(dummy_id)) << "Fail to unlock " << dummy_id;
+    return rc;
+}
+
+int Replicator::send_heartbeat(ReplicatorId id, brpc::Controller* cntl,
+                               AppendEntriesRequest* request,
+                               AppendEntriesResponse* response,
+                               google::protobuf::Closure* done) {
+    Replicator *r = NULL;
+    bthread_id_t dummy_id = { id };
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        return -1;
+    }
+    // Never fails for heartbeats
+    r->_fill_common_fields(request, r->_next_index - 1, true);
+    cntl->set_timeout_ms(*r->_options.election_timeout_ms / 2);
+    RaftService_Stub stub(r->_control_channel_ptr);
+    stub.append_entries(cntl, request, response, done);
+    CHECK_EQ(0, bthread_id_unlock(dummy_id)) << "Fail to unlock " << dummy_id;
+    return 0;
+}
+
+int Replicator::set_snapshot_donor(ReplicatorId id, const PeerId& donor) {
+    Replicator *r = NULL;
+    bthread_id_t dummy_id = { id };
+    if (bthread_id_lock(dummy_id, (void**)&r) != 0) {
+        return 0;
+    }
+    const int rc = r->_reset_snapshot_donor(donor);
+    CHECK_EQ(0, bthread_id_unlock(dummy_id)) << "Fail to unlock " << dummy_id;
+    return rc;
+}
+
+int Replicator::_reset_snapshot_donor(const PeerId& donor) {
+    delete _donor_channel;
+    _donor_channel = NULL;
+    _donor_id.reset();
+    if (donor.is_empty()) {
+        return 0;
+    }
+    brpc::Channel* channel = new brpc::Channel;
+    brpc::ChannelOptions channel_opt;
+    channel_opt.timeout_ms = -1;  // Set by the requests
+    if (init_peer_channel(channel, donor.addr, &channel_opt) != 0) {
+        LOG(ERROR) << "Fail to init channel to snapshot donor " << donor
+                   << ", group " << _options.group_id;
+        delete channel;
+        return -1;
+    }
+    _donor_channel = channel;
+    _donor_id = donor;
+    LOG(INFO) << "node " << _options.group_id << ":" << _options.server_id
+              << " install snapshots to " << _options.peer_id
+              << " from " << donor;
+    return 0;
+}
+
+int Replicator::_reset_relay(const PeerId& relay) {
+    delete _relay_channel;
+    _relay_channel = NULL;
+    _relay_id.reset();
+    _relay_disabled_until_ms = 0;
+    if (relay.is_empty()) {
+        LOG(INFO) << "node " << _options.group_id << ":" << _options.server_id
+                  << " stop relaying AppendEntries to " << _options.peer_id;
+        return 0;
+    }
+    brpc::Channel* channel = new brpc::Channel;
+    brpc::ChannelOptions channel_opt;
+    channel_opt.timeout_ms = -1;  // Set by the requests
+    if (init_peer_channel(channel, relay.addr, &channel_opt) != 0) {
+        LOG(ERROR) << "Fail to init channel to relay " << relay
+                   << ", group " << _options.group_id;
+        delete channel;
+        return -1;
+    }
+    _relay_channel = channel;
+    _relay_id = relay;
+    LOG(INFO) << "node " << _options.group_id << ":" << _options.server_id
+              << " relay AppendEntries to " << _options.peer_id
+              << " through " << relay;
+    return 0;
+}
+
 void Replicator::_destroy() {
     bthread_id_t saved_id = _id;
     CHECK_EQ(0, bthread_id_unlock_and_destroy(saved_id));
@@ -1242,18 +2052,36 @@ void Replicator::_describe(std::ostream& os, bool use_html) {
     const PeerId peer_id = _options.peer_id;
     const int64_t next_index = _next_index;
     const int flying_append_entries_size = _flying_append_entries_size;
+    const int64_t flying_append_entries_bytes = _flying_append_entries_bytes;
+    const int64_t window_bytes = _window_bytes;
+    const int64_t peer_backlog_bytes = _peer_backlog_bytes;
     const bthread_id_t id = _id;
     const int consecutive_error_times = _consecutive_error_times;
     const int64_t heartbeat_counter = _heartbeat_counter;
     const int64_t append_entries_counter = _append_entries_counter;
     const int64_t install_snapshot_counter = _install_snapshot_counter;
+    const std::string install_snapshot_reason = _install_snapshot_reason;
     const int64_t readonly_index = _readonly_index;
+    const int64_t lag = _get_lag(this);
+    const int64_t since_last_success_ms = _get_since_last_success_ms(this);
+    const bool has_metrics = _metrics != NULL;
+    PeerStatus rpc_status;
+    if (has_metrics) {
+        _metrics->get_status(&rpc_status);
+    }
     CHECK_EQ(0, bthread_id_unlock(_id));
     // Don't touch *this ever after
     const char* new_line = use_html ? "<br>" : "\r\n";
     os << "replicator_" << id << '@' << peer_id << ':';
     os << " next_index=" << next_index << ' ';
     os << " flying_append_entries_size=" << flying_append_entries_size << ' ';
+    if (FLAGS_raft_replicator_adaptive_window) {
+        os << " flying_append_entries_bytes=" << flying_append_entries_bytes
+           << " window_bytes=" << window_bytes << ' ';
+    }
+    if (peer_backlog_bytes != 0) {
+        os << " peer_backlog_bytes=" << peer_backlog_bytes << ' ';
+    }
     if (readonly_index != 0) {
         os << " readonly_index=" << readonly_index << ' ';
     }
@@ -1269,10 +2097,19 @@ void Replicator::_describe(std::ostream& os, bool use_html) {
         break;
     case INSTALLING_SNAPSHOT:
         os << "installing snapshot {" << st.last_log_included
-           << ", " << st.last_term_included  << '}';
+           << ", " << st.last_term_included  << "} as "
+           << install_snapshot_reason;
         break;
     }
-    os << " hc=" << heartbeat_counter << " ac=" << append_entries_counter << " ic=" << install_snapshot_counter << new_line;
+    os << " hc=" << heartbeat_counter << " ac=" << append_entries_counter << " ic=" << install_snapshot_counter;
+    os << " lag=" << lag << " since_last_success_ms=" << since_last_success_ms;
+    if (has_metrics) {
+        os << " latency_us=" << rpc_status.append_entries_latency_us
+           << " latency_p99_us=" << rpc_status.append_entries_latency_p99_us
+           << " entries_per_rpc=" << rpc_status.entries_per_rpc
+           << " bytes_per_rpc=" << rpc_status.bytes_per_rpc;
+    }
+    os << new_line;
 }
 
 void Replicator::_get_status(PeerStatus* status) {
@@ -1283,9 +2120,46 @@ void Replicator::_get_status(PeerStatus* status) {
     status->last_rpc_send_timestamp = _last_rpc_send_timestamp;
     status->consecutive_error_times = _consecutive_error_times;
     status->readonly_index = _readonly_index;
+    status->lag = _get_lag(this);
+    status->since_last_success_ms = _get_since_last_success_ms(this);
+    if (_metrics) {
+        _metrics->get_status(status);
+    }
     CHECK_EQ(0, bthread_id_unlock(_id));
 }
 
+void Replicator::_expose_bvars() {
+    std::string prefix;
+    butil::string_printf(&prefix, "raft_replicator_%s_%s",
+                         _options.group_id.c_str(),
+                         _options.peer_id.to_string().c_str());
+    _metrics = new Metrics(this);
+    _metrics->append_entries_latency.expose(prefix + "_append_entries");
+    _metrics->entries_per_rpc_window.expose(prefix + "_entries_per_rpc");
+    _metrics->bytes_per_rpc_window.expose(prefix + "_bytes_per_rpc");
+    _metrics->lag.expose(prefix + "_lag");
+    _metrics->since_last_success_ms.expose(prefix + "_since_last_success_ms");
+}
+
+int64_t Replicator::_get_lag(void* arg) {
+    Replicator* r = (Replicator*)arg;
+    if (r->_options.log_manager == NULL) {
+        return 0;
+    }
+    return r->_options.log_manager->last_log_index()
+           - r->_match_index.load(butil::memory_order_relaxed);
+}
+
+int64_t Replicator::_get_since_last_success_ms(void* arg) {
+    Replicator* r = (Replicator*)arg;
+    const int64_t last_ms =
+            r->_last_append_success_ms.load(butil::memory_order_relaxed);
+    if (last_ms == 0) {
+        return -1;
+    }
+    return butil::monotonic_time_ms() - last_ms;
+}
+
 void Replicator::describe(ReplicatorId id, std::ostream& os, bool use_html) {
     bthread_id_t dummy_id = { id };
     Replicator* r = NULL;
@@ -1352,6 +2226,7 @@ int ReplicatorGroup::init(const NodeId& node_id, const ReplicatorGroupOptions& o
     _common_options.server_id = node_id.peer_id;
     _common_options.snapshot_storage = options.snapshot_storage;
     _common_options.snapshot_throttle = options.snapshot_throttle;
+    _common_options.control_connection_group = options.control_connection_group;
     return 0;
 }
 
@@ -1362,6 +2237,16 @@ int ReplicatorGroup::add_replicator(const PeerId& peer) {
     }
     ReplicatorOptions options = _common_options;
     options.peer_id = peer;
+    std::map<PeerId, PeerId>::const_iterator relay_iter = _relays.find(peer);
+    if (relay_iter != _relays.end()) {
+        options.relay_id = relay_iter->second;
+    }
+    std::map<PeerId, PeerId>::const_iterator donor_iter =
+            _snapshot_donors.find(peer);
+    if (donor_iter != _snapshot_donors.end()) {
+        options.snapshot_donor_id = donor_iter->second;
+    }
+    options.committed_index_signaled.reset(new butil::atomic<bool>(false));
     ReplicatorId rid;
     if (Replicator::start(options, &rid) != 0) {
         LOG(ERROR) << "Group " << options.group_id
@@ -1369,6 +2254,8 @@ int ReplicatorGroup::add_replicator(const PeerId& peer) {
         return -1;
     }
     _rmap[peer] = rid;
+    _committed_index_signals[rid] = options.committed_index_signaled;
+    _update_rids();
     return 0;
 }
 
@@ -1393,6 +2280,14 @@ int64_t ReplicatorGroup::last_rpc_send_timestamp(const PeerId& peer) {
     return Replicator::last_rpc_send_timestamp(rid);
 }
 
+int64_t ReplicatorGroup::last_ack_timestamp(const PeerId& peer) {
+    std::map<PeerId, ReplicatorId>::iterator iter = _rmap.find(peer);
+    if (iter == _rmap.end()) {
+        return 0;
+    }
+    return Replicator::last_ack_timestamp(iter->second);
+}
+
 int ReplicatorGroup::stop_replicator(const PeerId &peer) {
     std::map<PeerId, ReplicatorId>::iterator iter = _rmap.find(peer);
     if (iter == _rmap.end()) {
@@ -1402,6 +2297,7 @@ int ReplicatorGroup::stop_replicator(const PeerId &peer) {
     // Calling ReplicatorId::stop might lead to calling stop_replicator again, 
     // erase iter first to avoid race condition
     _rmap.erase(iter);
+    _update_rids();
     return Replicator::stop(rid);
 }
 
@@ -1413,6 +2309,7 @@ int ReplicatorGroup::stop_all() {
         rids.push_back(iter->second);
     }
     _rmap.clear();
+    _update_rids();
     for (size_t i = 0; i < rids.size(); ++i) {
         Replicator::stop(rids[i]);
     }
@@ -1423,6 +2320,12 @@ bool ReplicatorGroup::contains(const PeerId& peer) const {
     return _rmap.find(peer) != _rmap.end();
 }
 
+bool ReplicatorGroup::is_witness(const PeerId& peer) const {
+    std::map<PeerId, ReplicatorId>::const_iterator iter = _rmap.find(peer);
+    // The key keeps the role of the peer in the configuration
+    return iter != _rmap.end() && iter->first.is_witness();
+}
+
 int ReplicatorGroup::reset_term(int64_t new_term) {
     if (new_term <= _common_options.term) {
         CHECK_GT(new_term, _common_options.term) << "term cannot be decreased";
@@ -1481,6 +2384,7 @@ int ReplicatorGroup::stop_all_and_find_the_next_candidate(
         }
     }
     _rmap.clear();
+    _update_rids();
     return 0;
 }
 
@@ -1489,7 +2393,7 @@ int ReplicatorGroup::find_the_next_candidate(
     int64_t max_index =  0;
     for (std::map<PeerId, ReplicatorId>::const_iterator
             iter = _rmap.begin();  iter != _rmap.end(); ++iter) {
-        if (!conf.contains(iter->first)) {
+        if (!conf.contains(iter->first) || iter->first.is_witness()) {
             continue;
         }
         const int64_t next_index = Replicator::get_next_index(iter->second);
@@ -1506,6 +2410,125 @@ int ReplicatorGroup::find_the_next_candidate(
     return 0;
 }
 
+bool ReplicatorGroup::all_caught_up(int64_t last_log_index) {
+    for (std::map<PeerId, ReplicatorId>::const_iterator
+            iter = _rmap.begin();  iter != _rmap.end(); ++iter) {
+        if (Replicator::get_next_index(iter->second) <= last_log_index) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int64_t ReplicatorGroup::min_next_index() {
+    int64_t min_index = 0;
+    for (std::map<PeerId, ReplicatorId>::const_iterator
+            iter = _rmap.begin();  iter != _rmap.end(); ++iter) {
+        const int64_t next_index = Replicator::get_next_index(iter->second);
+        if (next_index > 0 && (min_index == 0 || next_index < min_index)) {
+            min_index = next_index;
+        }
+    }
+    return min_index;
+}
+
+void ReplicatorGroup::wake_up_all() {
+    for (std::map<PeerId, ReplicatorId>::const_iterator
+            iter = _rmap.begin();  iter != _rmap.end(); ++iter) {
+        Replicator::wake_up(iter->second);
+    }
+}
+
+size_t ReplicatorGroup::_set_rids(std::vector<SignaledReplicator>& bg,
+                                  const std::vector<SignaledReplicator>& rids) {
+    bg = rids;
+    return 1;
+}
+
+void ReplicatorGroup::_update_rids() {
+    std::vector<SignaledReplicator> rids;
+    std::map<ReplicatorId, std::shared_ptr<butil::atomic<bool> > > signals;
+    rids.reserve(_rmap.size());
+    for (std::map<PeerId, ReplicatorId>::const_iterator
+            iter = _rmap.begin();  iter != _rmap.end(); ++iter) {
+        std::shared_ptr<butil::atomic<bool> >& signaled =
+                signals[iter->second];
+        signaled = _committed_index_signals[iter->second];
+        rids.push_back(SignaledReplicator(iter->second, signaled));
+    }
+    // Drop the flags of the removed replicators
+    _committed_index_signals.swap(signals);
+    _rids.Modify(_set_rids, rids);
+}
+
+void ReplicatorGroup::propagate_committed_index() {
+    if (!FLAGS_raft_propagate_committed_index) {
+        return;
+    }
+    butil::DoublyBufferedData<std::vector<SignaledReplicator> >::ScopedPtr ptr;
+    if (_rids.Read(&ptr) != 0) {
+        return;
+    }
+    for (size_t i = 0; i < ptr->size(); ++i) {
+        Replicator::propagate_committed_index((*ptr)[i].first,
+                                              (*ptr)[i].second.get());
+    }
+}
+
+int ReplicatorGroup::find_higher_priority_peer(
+        int priority, int64_t last_log_index, const ConfigurationEntry& conf,
+        PeerId* peer_id, int* max_priority) {
+    *max_priority = priority;
+    int best_priority = priority;
+    for (std::map<PeerId, ReplicatorId>::const_iterator
+            iter = _rmap.begin();  iter != _rmap.end(); ++iter) {
+        if (!conf.contains(iter->first) || iter->first.is_witness()) {
+            continue;
+        }
+        const int peer_priority = Replicator::election_priority(iter->second);
+        *max_priority = std::max(*max_priority, peer_priority);
+        if (peer_priority > best_priority &&
+                Replicator::get_next_index(iter->second) > last_log_index) {
+            best_priority = peer_priority;
+            *peer_id = iter->first;
+        }
+    }
+    return best_priority > priority ? 0 : -1;
+}
+
+void ReplicatorGroup::list_leader_loads(int priority, int64_t last_log_index,
+                                        const ConfigurationEntry& conf,
+                                        std::vector<PeerLeaderLoad>* out) {
+    out->clear();
+    for (std::map<PeerId, ReplicatorId>::const_iterator
+            iter = _rmap.begin();  iter != _rmap.end(); ++iter) {
+        if (!conf.contains(iter->first) || iter->first.is_witness() ||
+                Replicator::election_priority(iter->second) < priority ||
+                Replicator::get_next_index(iter->second) <= last_log_index) {
+            continue;
+        }
+        PeerLeaderLoad load;
+        load.peer_id = iter->first;
+        if (Replicator::peer_leader_load(iter->second, &load.leader_count,
+                                         &load.weight) == 0) {
+            out->push_back(load);
+        }
+    }
+}
+
+int64_t ReplicatorGroup::max_rtt_timeout_us() {
+    int64_t max_timeout_us = -1;
+    for (std::map<PeerId, ReplicatorId>::const_iterator
+            iter = _rmap.begin();  iter != _rmap.end(); ++iter) {
+        int64_t srtt_us = 0;
+        int64_t rttvar_us = 0;
+        if (Replicator::peer_rtt(iter->second, &srtt_us, &rttvar_us) == 0) {
+            max_timeout_us = std::max(max_timeout_us, srtt_us + 4 * rttvar_us);
+        }
+    }
+    return max_timeout_us;
+}
+
 void ReplicatorGroup::list_replicators(std::vector<ReplicatorId>* out) const {
     out->clear();
     out->reserve(_rmap.size());
@@ -1543,4 +2566,42 @@ bool ReplicatorGroup::readonly(const PeerId& peer) const {
     return Replicator::readonly(rid);
 }
 
+int ReplicatorGroup::set_relay(const PeerId& peer, const PeerId& relay) {
+    if (relay.is_empty()) {
+        _relays.erase(peer);
+    } else {
+        _relays[peer] = relay;
+    }
+    std::map<PeerId, ReplicatorId>::const_iterator iter = _rmap.find(peer);
+    if (iter == _rmap.end()) {
+        return 0;
+    }
+    return Replicator::set_relay(iter->second, relay);
+}
+
+int ReplicatorGroup::set_snapshot_donor(const PeerId& peer, const PeerId& donor) {
+    if (donor.is_empty()) {
+        _snapshot_donors.erase(peer);
+    } else {
+        _snapshot_donors[peer] = donor;
+    }
+    std::map<PeerId, ReplicatorId>::const_iterator iter = _rmap.find(peer);
+    if (iter == _rmap.end()) {
+        return 0;
+    }
+    return Replicator::set_snapshot_donor(iter->second, donor);
+}
+
+int ReplicatorGroup::send_heartbeat(const PeerId& peer, brpc::Controller* cntl,
+                                    AppendEntriesRequest* request,
+                                    AppendEntriesResponse* response,
+                                    google::protobuf::Closure* done) {
+    std::map<PeerId, ReplicatorId>::const_iterator iter = _rmap.find(peer);
+    if (iter == _rmap.end()) {
+        return -1;
+    }
+    return Replicator::send_heartbeat(iter->second, cntl, request, response,
+                                      done);
+}
+
 } //  namespace braft
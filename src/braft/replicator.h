@@ -19,7 +19,12 @@
 #ifndef  BRAFT_REPLICATOR_H
 #define  BRAFT_REPLICATOR_H
 
+#include <memory>                                       // std::shared_ptr
 #include <bthread/bthread.h>                            // bthread_id
+#include <butil/time.h>                    // butil::monotonic_time_ms
+#include <butil/unique_ptr.h>              // std::unique_ptr
+#include <butil/containers/doubly_buffered_data.h>
+#include <bvar/bvar.h>                     // bvar::LatencyRecorder
 #include <brpc/channel.h>                  // brpc::Channel
 
 #include "braft/storage.h"                       // SnapshotStorage
@@ -48,6 +53,18 @@ struct ReplicatorOptions {
     int64_t term;
     SnapshotStorage* snapshot_storage;
     SnapshotThrottle* snapshot_throttle;
+    // The peer forwarding the AppendEntries to |peer_id|, empty if none
+    PeerId relay_id;
+    // The peer which |peer_id| copies the snapshots from, empty if none
+    PeerId snapshot_donor_id;
+    // The heartbeats and timeout_now go through the connections of this
+    // group, instead of the one of the AppendEntries and snapshots, if not
+    // empty
+    std::string control_connection_group;
+    // Set while a new committed index is signaled to the replicator and not
+    // handled yet, so that the commits in the meantime don't signal it again.
+    // Created by Replicator::start if NULL
+    std::shared_ptr<butil::atomic<bool> > committed_index_signaled;
 };
 
 typedef uint64_t ReplicatorId;
@@ -84,6 +101,33 @@ public:
 
     static int64_t last_rpc_send_timestamp(ReplicatorId id);
 
+    // Get the sending time of the last RPC acked by the peer, 0 if none
+    static int64_t last_ack_timestamp(ReplicatorId id);
+
+    // Get NodeOptions::election_priority of the peer, 0 if unknown
+    static int election_priority(ReplicatorId id);
+
+    // Get the leader count and the leader weight of the server of the peer
+    // reported in its responses, see LeaderBalancer.
+    // Returns 0 on success, -1 if unknown
+    static int peer_leader_load(ReplicatorId id, int* leader_count,
+                                int* weight);
+
+    // Get the smoothed RTT of the heartbeats to the peer and its variation.
+    // Returns 0 on success, -1 if no heartbeat has returned yet
+    static int peer_rtt(ReplicatorId id, int64_t* srtt_us, int64_t* rttvar_us);
+
+    // Send a heartbeat at once rather than waiting for the heartbeat timer,
+    // which might be long in hibernation
+    static void wake_up(ReplicatorId id);
+
+    // Send the new committed index to the peer at once if the replicator is
+    // idle, otherwise it goes with the next RPC. Does nothing if |signaled|,
+    // the committed_index_signaled of the replicator, is set already. Never
+    // blocks
+    static void propagate_committed_index(ReplicatorId id,
+                                          butil::atomic<bool>* signaled);
+
     // Wait until the margin between |last_log_index| from leader and the peer
     // is less than |max_margin| or error occurs. 
     // |done| can't be NULL and it is called after waiting fnishies.
@@ -116,6 +160,23 @@ public:
 
     // Check if a replicator is readonly
     static bool readonly(ReplicatorId id);
+
+    // Send the AppendEntries through |relay|, or directly if |relay| is empty
+    static int set_relay(ReplicatorId id, const PeerId& relay);
+
+    // Let the peer copy the snapshots from |donor|, or from this node if
+    // |donor| is empty
+    static int set_snapshot_donor(ReplicatorId id, const PeerId& donor);
+
+    // Send a heartbeat to the peer at once, e.g. to confirm the leadership.
+    // |done| is called when the RPC returns, before which |cntl|, |request|
+    // and |response| must stay valid.
+    // Returns 0 on success, -1 if the replicator is gone and |done| is not
+    // going to be called.
+    static int send_heartbeat(ReplicatorId id, brpc::Controller* cntl,
+                              AppendEntriesRequest* request,
+                              AppendEntriesResponse* response,
+                              google::protobuf::Closure* done);
     
 private:
     enum St {
@@ -139,16 +200,27 @@ private:
     Replicator();
     ~Replicator();
 
-    int _prepare_entry(int offset, EntryMeta* em, butil::IOBuf* data);
+    int _prepare_entry(const LogEntry* entry, EntryMeta* em, butil::IOBuf* data);
     void _wait_more_entries();
+    bool _committed_index_stale() const;
+    void _signal_committed_index();
+    void _send_committed_index();
     void _send_empty_entries(bool is_hearbeat);
     void _send_entries();
+    // Channel of the next AppendEntries carrying logs
+    brpc::Channel* _next_sending_channel();
     void _notify_on_caught_up(int error_code, bool);
     int _fill_common_fields(AppendEntriesRequest* request, int64_t prev_log_index,
                             bool is_heartbeat);
     void _block(long start_time_us, int error_code);
     void _install_snapshot();
+    // Send the InstallSnapshotRequest copying |uri|, which falls back to
+    // |fallback_uri| if |fallback_meta| is not NULL
+    void _send_install_snapshot(const SnapshotMeta& meta, const std::string& uri,
+                                const SnapshotMeta* fallback_meta,
+                                const std::string& fallback_uri);
     void _start_heartbeat_timer(long start_time_us);
+    void _update_rtt(int64_t rtt_us);
     void _send_timeout_now(bool unlock_id, bool stop_after_finish,
                            int timeout_ms = -1);
     int _transfer_leadership(int64_t log_index);
@@ -158,18 +230,40 @@ private:
         return _next_index - _flying_append_entries_size;
     }
     int _change_readonly_config(bool readonly);
+    int _reset_relay(const PeerId& relay);
+    int _reset_snapshot_donor(const PeerId& donor);
+    // Take the read-ahead logs starting from _next_index
+    void _take_read_ahead(size_t max_count, size_t max_bytes,
+                          std::vector<LogEntry*>* entries);
+    void _start_read_ahead();
+    void _clear_read_ahead();
+    static void* _run_read_ahead(void* arg);
+    struct Metrics;
+    void _expose_bvars();
+    static int64_t _get_lag(void* arg);
+    static int64_t _get_since_last_success_ms(void* arg);
+    bool _use_relay() const {
+        return _relay_channel != NULL &&
+               butil::monotonic_time_ms() >= _relay_disabled_until_ms;
+    }
+
+    // The controller, messages and done of an AppendEntries RPC, which are
+    // pooled so that the messages keep the memory of their fields across RPCs
+    // and nothing is allocated for a heartbeat
+    struct AppendEntriesCall;
+    struct AppendEntriesCallDeleter {
+        // Return |call| to the pool
+        void operator()(AppendEntriesCall* call) const;
+    };
+    typedef std::unique_ptr<AppendEntriesCall, AppendEntriesCallDeleter>
+            AppendEntriesCallGuard;
+    static AppendEntriesCall* _new_append_entries_call();
 
     static void _on_rpc_returned(
-                ReplicatorId id, brpc::Controller* cntl,
-                AppendEntriesRequest* request, 
-                AppendEntriesResponse* response,
-                int64_t);
+                ReplicatorId id, AppendEntriesCall* call, int64_t);
 
     static void _on_heartbeat_returned(
-                ReplicatorId id, brpc::Controller* cntl,
-                AppendEntriesRequest* request, 
-                AppendEntriesResponse* response,
-                int64_t);
+                ReplicatorId id, AppendEntriesCall* call, int64_t);
 
     static void _on_timeout_now_returned(
                 ReplicatorId id, brpc::Controller* cntl,
@@ -190,6 +284,8 @@ private:
                 ReplicatorId id, brpc::Controller* cntl,
                 InstallSnapshotRequest* request, 
                 InstallSnapshotResponse* response);
+    struct GetSnapshotUriDone;
+    static void _on_get_snapshot_uri_returned(GetSnapshotUriDone* done);
     void _destroy();
     void _describe(std::ostream& os, bool use_html);
     void _get_status(PeerStatus* status);
@@ -211,22 +307,75 @@ private:
     struct FlyingAppendEntriesRpc {
         int64_t log_index;
         int entries_size;
+        int64_t bytes;
         brpc::CallId call_id;
-        FlyingAppendEntriesRpc(int64_t index, int size, brpc::CallId id)
-            : log_index(index), entries_size(size), call_id(id) {}
+        FlyingAppendEntriesRpc(int64_t index, int size, int64_t nbytes,
+                               brpc::CallId id)
+            : log_index(index), entries_size(size), bytes(nbytes)
+            , call_id(id) {}
     };
+
+    // Whether another AppendEntries RPC is allowed to be in flight
+    bool _has_room_in_flight() const;
+    // AIMD of the in-flight window
+    void _grow_window(int64_t acked_bytes);
+    void _shrink_window();
     
     brpc::Channel _sending_channel;
+    // The channel of the heartbeats and timeout_now, which is _sending_channel
+    // unless the control RPCs use their own connection
+    brpc::Channel _control_channel;
+    brpc::Channel* _control_channel_ptr;
+    // The AppendEntries carrying logs are striped over _sending_channel and
+    // these, each of which is on a connection of its own
+    std::vector<brpc::Channel*> _stripe_channels;
+    size_t _next_stripe;
     int64_t _next_index;
     int64_t _flying_append_entries_size;
+    int64_t _flying_append_entries_bytes;
+    // Max bytes of the in-flight AppendEntries RPCs, adjusted by AIMD when
+    // raft_replicator_adaptive_window is on
+    int64_t _window_bytes;
+    // Bytes of the logs in the memory of the peer, got from its responses
+    int64_t _peer_backlog_bytes;
+    // The largest committed index sent to the peer
+    int64_t _committed_index_sent;
+    // Whether the peer accepts compressed attachments
+    bool _peer_compress_supported;
+    // Whether the peer accepts packed entries
+    bool _peer_packed_entries_supported;
+    int _peer_election_priority;
+    // The leader count and the leader weight of the server of the peer, the
+    // count is -1 if unknown
+    int _peer_leader_count;
+    int _peer_leader_weight;
+    // The smoothed RTT of the heartbeats and its variation, -1 if unknown
+    int64_t _srtt_us;
+    int64_t _rttvar_us;
+    // Channel to the relay of the peer, NULL if the peer is not relayed
+    PeerId _relay_id;
+    brpc::Channel* _relay_channel;
+    // The AppendEntries are sent directly until then since the relay failed
+    int64_t _relay_disabled_until_ms;
+    // Channel to the snapshot donor of the peer, NULL if none
+    PeerId _donor_id;
+    brpc::Channel* _donor_channel;
+    // Logs read from the storage in the background while the previous
+    // AppendEntries is in flight
+    std::deque<LogEntry*> _read_ahead_entries;
+    bool _read_ahead_running;
     int _consecutive_error_times;
     bool _has_succeeded;
     int64_t _timeout_now_index;
     // the sending time of last successful RPC
     int64_t _last_rpc_send_timestamp;
+    // the sending time of last RPC acked by the peer in this term
+    int64_t _last_ack_timestamp;
     int64_t _heartbeat_counter;
     int64_t _append_entries_counter;
     int64_t _install_snapshot_counter;
+    // Why the peer installs the snapshot last time
+    std::string _install_snapshot_reason;
     int64_t _readonly_index;
     Stat _st;
     std::deque<FlyingAppendEntriesRpc> _append_entries_in_fly;
@@ -237,9 +386,26 @@ private:
     bool _is_waiter_canceled;
     bthread_id_t _id;
     ReplicatorOptions _options;
+    // Formatted once for the requests
+    std::string _server_id_str;
+    std::string _peer_id_str;
     bthread_timer_t _heartbeat_timer;
     SnapshotReader* _reader;
     CatchupClosure *_catchup_closure;
+    // The last log acked by the peer
+    butil::atomic<int64_t> _match_index;
+    // Time of the last successful AppendEntries with logs, 0 if none
+    butil::atomic<int64_t> _last_append_success_ms;
+    // Per-peer metrics of the AppendEntries RPCs with logs, NULL unless
+    // raft_expose_replicator_bvars is on
+    Metrics* _metrics;
+};
+
+// The leaders held by the server of a peer, see LeaderBalancer
+struct PeerLeaderLoad {
+    PeerId peer_id;
+    int leader_count;
+    int weight;
 };
 
 struct ReplicatorGroupOptions {
@@ -251,6 +417,8 @@ struct ReplicatorGroupOptions {
     NodeImpl* node;
     SnapshotStorage* snapshot_storage;
     SnapshotThrottle* snapshot_throttle;
+    // See ReplicatorOptions::control_connection_group
+    std::string control_connection_group;
 };
 
 // Maintains the replicators attached to all the followers
@@ -281,6 +449,8 @@ public:
 
     int64_t last_rpc_send_timestamp(const PeerId& peer);
 
+    int64_t last_ack_timestamp(const PeerId& peer);
+
     // Stop all the replicators
     int stop_all();
 
@@ -305,6 +475,9 @@ public:
     // Returns true if the there's a replicator attached to the given |peer|
     bool contains(const PeerId& peer) const;
 
+    // Returns true if the replicator attached to |peer| replicates to a witness
+    bool is_witness(const PeerId& peer) const;
+
     // Transfer leadership to the given |peer|
     int transfer_leadership_to(const PeerId& peer, int64_t log_index);
 
@@ -328,6 +501,40 @@ public:
     int find_the_next_candidate(PeerId* peer_id,
                                 const ConfigurationEntry& conf);
 
+    // Find the voter of |conf| with the highest election priority above
+    // |priority| among those having all the logs until |last_log_index|.
+    // |max_priority| is assigned with the highest priority of the voters and
+    // |priority|.
+    // Returns 0 on success and |peer_id| is assigned with the very peer,
+    // -1 otherwise.
+    int find_higher_priority_peer(int priority, int64_t last_log_index,
+                                  const ConfigurationEntry& conf,
+                                  PeerId* peer_id, int* max_priority);
+
+    // List the leader loads of the servers of the voters of |conf| which
+    // have all the logs until |last_log_index| and whose election priority
+    // is not below |priority|, skipping those of unknown loads
+    void list_leader_loads(int priority, int64_t last_log_index,
+                           const ConfigurationEntry& conf,
+                           std::vector<PeerLeaderLoad>* out);
+
+    // Whether all the peers have the logs until |last_log_index|
+    bool all_caught_up(int64_t last_log_index);
+
+    // The largest smoothed RTT plus 4 times its variation among the peers,
+    // -1 if none is measured yet
+    int64_t max_rtt_timeout_us();
+
+    // The least next_index of the peers that have been reached, 0 if none
+    int64_t min_next_index();
+
+    // Send heartbeats to all the peers at once, see Replicator::wake_up
+    void wake_up_all();
+
+    // Called by the leader when the committed index advances, which is safe
+    // to call without the lock of the node, see raft_propagate_committed_index
+    void propagate_committed_index();
+
     // List all the existing replicators
     void list_replicators(std::vector<ReplicatorId>* out) const;
 
@@ -340,11 +547,38 @@ public:
     // Check if a replicator is in readonly
     bool readonly(const PeerId& peer) const;
 
+    // Send the AppendEntries of |peer| through |relay| since now, or
+    // directly if |relay| is empty
+    int set_relay(const PeerId& peer, const PeerId& relay);
+
+    // Let |peer| copy the snapshots from |donor| since now, or from this node
+    // if |donor| is empty
+    int set_snapshot_donor(const PeerId& peer, const PeerId& donor);
+
+    // Send a heartbeat to |peer| at once, see Replicator::send_heartbeat
+    int send_heartbeat(const PeerId& peer, brpc::Controller* cntl,
+                       AppendEntriesRequest* request,
+                       AppendEntriesResponse* response,
+                       google::protobuf::Closure* done);
+
 private:
 
     int _add_replicator(const PeerId& peer, ReplicatorId *rid);
+    // Publish _rmap to _rids after changing it
+    void _update_rids();
+    // Replicator and its ReplicatorOptions::committed_index_signaled
+    typedef std::pair<ReplicatorId, std::shared_ptr<butil::atomic<bool> > >
+            SignaledReplicator;
+    static size_t _set_rids(std::vector<SignaledReplicator>& bg,
+                            const std::vector<SignaledReplicator>& rids);
 
     std::map<PeerId, ReplicatorId> _rmap;
+    std::map<ReplicatorId, std::shared_ptr<butil::atomic<bool> > >
+            _committed_index_signals;
+    // Read by propagate_committed_index without the lock of the node
+    butil::DoublyBufferedData<std::vector<SignaledReplicator> > _rids;
+    std::map<PeerId, PeerId> _relays;
+    std::map<PeerId, PeerId> _snapshot_donors;
     ReplicatorOptions _common_options;
     int _dynamic_timeout_ms;
     int _election_timeout_ms;
@@ -16,6 +16,8 @@
 
 #include "braft/route_table.h"
 
+#include <map>
+#include <set>
 #include <gflags/gflags.h>
 #include <butil/memory/singleton.h>
 #include <butil/containers/doubly_buffered_data.h>
@@ -211,6 +213,144 @@ butil::Status refresh_leader(const GroupId& group, int timeout_ms) {
     return error;
 }
 
+// Tracks the get_leaders RPCs of one refresh_leaders(), and runs the done
+// after all of them finish
+class RefreshLeadersCall {
+public:
+    class Rpc : public google::protobuf::Closure {
+    public:
+        explicit Rpc(RefreshLeadersCall* call) : _call(call) {}
+        void Run() { _call->on_rpc_done(this); }
+        brpc::Channel channel;
+        brpc::Controller cntl;
+        GetLeadersRequest request;
+        GetLeadersResponse response;
+    private:
+        RefreshLeadersCall* _call;
+    };
+
+    explicit RefreshLeadersCall(Closure* done) : _done(done), _pending(1) {}
+
+    void add_missing_group(const GroupId& group) {
+        _missing_groups.push_back(group);
+    }
+
+    void add_group(const GroupId& group) {
+        _unresolved_groups.insert(group);
+    }
+
+    void start(std::map<butil::EndPoint, GetLeadersRequest>* requests,
+               int timeout_ms) {
+        _pending.fetch_add(requests->size(), butil::memory_order_relaxed);
+        for (std::map<butil::EndPoint, GetLeadersRequest>::iterator
+                it = requests->begin(); it != requests->end(); ++it) {
+            Rpc* rpc = new Rpc(this);
+            rpc->request.Swap(&it->second);
+            rpc->cntl.set_timeout_ms(timeout_ms);
+            if (rpc->channel.Init(it->first, NULL) != 0) {
+                rpc->cntl.SetFailed(EINVAL, "Fail to init channel to %s",
+                                    butil::endpoint2str(it->first).c_str());
+                rpc->Run();
+                continue;
+            }
+            CliService_Stub stub(&rpc->channel);
+            stub.get_leaders(&rpc->cntl, &rpc->request, &rpc->response, rpc);
+        }
+        on_rpc_done(NULL);
+    }
+
+private:
+    // Called when a RPC finishes, or with NULL after all of them are issued
+    void on_rpc_done(Rpc* rpc) {
+        if (rpc != NULL) {
+            if (rpc->cntl.Failed()) {
+                LOG(WARNING) << "Fail to get leaders from "
+                             << rpc->cntl.remote_side() << ", "
+                             << rpc->cntl.ErrorText();
+            } else if (rpc->response.leader_ids_size()
+                            == rpc->request.group_ids_size()) {
+                const bool has_self_reported =
+                        rpc->response.self_reported_size()
+                            == rpc->response.leader_ids_size();
+                for (int i = 0; i < rpc->request.group_ids_size(); ++i) {
+                    const std::string& leader = rpc->response.leader_ids(i);
+                    if (!leader.empty()) {
+                        on_leader(rpc->request.group_ids(i), leader,
+                                  has_self_reported
+                                        && rpc->response.self_reported(i));
+                    }
+                }
+            }
+            delete rpc;
+        }
+        if (_pending.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+            finish();
+        }
+    }
+
+    // The hint of a follower goes to the RouteTable at once, so that the
+    // clients may retry before all the RPCs finish, unless the leader has
+    // already answered for itself. The answer of the leader overrides the
+    // hints, which may be stale.
+    void on_leader(const GroupId& group, const std::string& leader,
+                   bool self_reported) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_confirmed_groups.count(group) != 0) {
+            return;
+        }
+        if (self_reported) {
+            _confirmed_groups.insert(group);
+        } else if (!_hinted_groups.insert(group).second) {
+            return;
+        }
+        _unresolved_groups.erase(group);
+        update_leader(group, leader);
+    }
+
+    void finish() {
+        if (!_missing_groups.empty()) {
+            _done->status().set_error(ENOENT,
+                    "group %s is not registered in RouteTable",
+                    _missing_groups.front().c_str());
+        } else if (!_unresolved_groups.empty()) {
+            _done->status().set_error(EAGAIN,
+                    "Unknown leaders of %lu groups, e.g. %s",
+                    _unresolved_groups.size(),
+                    _unresolved_groups.begin()->c_str());
+        }
+        _done->Run();
+        delete this;
+    }
+
+    Closure* _done;
+    butil::atomic<int> _pending;
+    raft_mutex_t _mutex;
+    std::set<GroupId> _unresolved_groups;
+    std::set<GroupId> _hinted_groups;
+    std::set<GroupId> _confirmed_groups;
+    std::vector<GroupId> _missing_groups;
+};
+
+void refresh_leaders(const std::vector<GroupId>& groups, int timeout_ms,
+                     Closure* done) {
+    RouteTable* const rtb = RouteTable::GetInstance();
+    RefreshLeadersCall* call = new RefreshLeadersCall(done);
+    std::map<butil::EndPoint, GetLeadersRequest> requests;
+    for (size_t i = 0; i < groups.size(); ++i) {
+        Configuration conf;
+        if (rtb->list_conf(groups[i], &conf) != 0) {
+            call->add_missing_group(groups[i]);
+            continue;
+        }
+        call->add_group(groups[i]);
+        for (Configuration::const_iterator
+                iter = conf.begin(); iter != conf.end(); ++iter) {
+            requests[iter->addr].add_group_ids(groups[i]);
+        }
+    }
+    call->start(&requests, timeout_ms);
+}
+
 int select_leader(const GroupId& group, PeerId* leader) {
     RouteTable* const rtb = RouteTable::GetInstance();
     return rtb->select_leader(group, leader);
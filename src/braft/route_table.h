@@ -43,6 +43,15 @@ int update_leader(const GroupId& group, const std::string& leader_str);
 // Blocking the thread until query_leader finishes
 butil::Status refresh_leader(const GroupId& group, int timeout_ms);
 
+// Refresh the leaders of |groups| asynchronously with one get_leaders RPC to
+// each endpoint in the configurations of the groups, so that all the leaders
+// are known after one round trip. The leader that answers for itself is
+// preferred; otherwise the hint of a follower is taken, which updates the
+// RouteTable as soon as it arrives. |done| is run once all the RPCs finish,
+// with an OK status if the leaders of all the groups are found.
+void refresh_leaders(const std::vector<GroupId>& groups, int timeout_ms,
+                     Closure* done);
+
 // Remove this group from route table
 int remove_group(const GroupId& group);
 
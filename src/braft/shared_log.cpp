@@ -0,0 +1,822 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/shared_log.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <butil/files/dir_reader_posix.h>            // butil::DirReaderPosix
+#include <butil/file_util.h>                         // butil::CreateDirectory
+#include <butil/string_printf.h>                     // butil::string_appendf
+#include <butil/raw_pack.h>                          // butil::RawPacker
+#include <butil/fd_utility.h>                        // butil::make_close_on_exec
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/configuration_manager.h"
+#include "braft/fsync.h"
+
+#define BRAFT_WAL_FILE_PATTERN "wal_%020" PRId64
+
+namespace braft {
+
+DEFINE_int32(raft_shared_wal_file_size, 64 * 1024 * 1024,
+             "Max size of one file in the shared wal");
+BRPC_VALIDATE_GFLAG(raft_shared_wal_file_size, brpc::PositiveInteger);
+
+DECLARE_bool(raft_sync);
+DECLARE_bool(raft_create_parent_directories);
+
+// Defined in log.cpp
+int ftruncate_uninterrupted(int fd, off_t length);
+
+static bvar::Adder<int64_t> g_shared_wal_fsync("raft_shared_wal_fsync");
+static bvar::Adder<int64_t> g_shared_wal_sync_saved("raft_shared_wal_sync_saved");
+
+static const size_t WAL_RECORD_HEADER_SIZE = 12;
+static const size_t WAL_PAYLOAD_FIXED_SIZE = 20;
+
+static pthread_mutex_t g_wal_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+typedef std::map<std::string, SharedWal*> WalMap;
+static WalMap* g_wal_map = NULL;
+
+SharedWal* SharedWal::open(const std::string& dir) {
+    pthread_mutex_lock(&g_wal_map_mutex);
+    if (g_wal_map == NULL) {
+        g_wal_map = new WalMap;
+    }
+    WalMap::iterator it = g_wal_map->find(dir);
+    SharedWal* wal = NULL;
+    if (it != g_wal_map->end()) {
+        wal = it->second;
+        ++wal->_nref;
+    } else {
+        wal = new SharedWal(dir);
+        if (wal->init() == 0) {
+            wal->_nref = 1;
+            (*g_wal_map)[dir] = wal;
+        } else {
+            delete wal;
+            wal = NULL;
+        }
+    }
+    pthread_mutex_unlock(&g_wal_map_mutex);
+    return wal;
+}
+
+void SharedWal::close(SharedWal* wal) {
+    pthread_mutex_lock(&g_wal_map_mutex);
+    if (--wal->_nref > 0) {
+        wal = NULL;
+    } else {
+        g_wal_map->erase(wal->_dir);
+    }
+    pthread_mutex_unlock(&g_wal_map_mutex);
+    delete wal;
+}
+
+SharedWal::SharedWal(const std::string& dir)
+    : _dir(dir)
+    , _nref(0)
+    , _active_file_id(0)
+    , _written_seq(0)
+    , _synced_seq(0)
+{}
+
+SharedWal::~SharedWal() {}
+
+std::string SharedWal::file_path(int64_t file_id) const {
+    std::string path(_dir);
+    butil::string_appendf(&path, "/" BRAFT_WAL_FILE_PATTERN, file_id);
+    return path;
+}
+
+int SharedWal::init() {
+    butil::FilePath dir_path(_dir);
+    butil::File::Error e;
+    if (!butil::CreateDirectoryAndGetError(
+                dir_path, &e, FLAGS_raft_create_parent_directories)) {
+        LOG(ERROR) << "Fail to create " << dir_path.value() << " : " << e;
+        return -1;
+    }
+    butil::DirReaderPosix dir_reader(_dir.c_str());
+    if (!dir_reader.IsValid()) {
+        LOG(ERROR) << "Fail to open dir " << _dir;
+        return -1;
+    }
+    std::vector<int64_t> file_ids;
+    while (dir_reader.Next()) {
+        int64_t file_id = 0;
+        int match = sscanf(dir_reader.name(), BRAFT_WAL_FILE_PATTERN, &file_id);
+        if (match == 1) {
+            file_ids.push_back(file_id);
+        }
+    }
+    std::sort(file_ids.begin(), file_ids.end());
+    for (size_t i = 0; i < file_ids.size(); ++i) {
+        if (load_file(file_ids[i], i + 1 == file_ids.size()) != 0) {
+            return -1;
+        }
+    }
+    if (file_ids.empty()) {
+        return create_file(1);
+    }
+    _active_file_id = file_ids.back();
+    remove_unused_files();
+    return 0;
+}
+
+int SharedWal::create_file(int64_t file_id) {
+    const std::string path = file_path(file_id);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to create " << path;
+        return -1;
+    }
+    butil::make_close_on_exec(fd);
+    scoped_refptr<WalFile> file = new WalFile;
+    file->fd = fd;
+    _files[file_id] = file;
+    _active_file_id = file_id;
+    LOG(INFO) << "Created wal file `" << path << '\'';
+    return 0;
+}
+
+int SharedWal::load_file(int64_t file_id, bool is_last) {
+    const std::string path = file_path(file_id);
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << path;
+        return -1;
+    }
+    butil::make_close_on_exec(fd);
+    scoped_refptr<WalFile> file = new WalFile;
+    file->fd = fd;
+    _files[file_id] = file;
+    struct stat st_buf;
+    if (fstat(fd, &st_buf) != 0) {
+        PLOG(ERROR) << "Fail to get the stat of " << path;
+        return -1;
+    }
+    const int64_t file_size = st_buf.st_size;
+    int64_t offset = 0;
+    while (offset < file_size) {
+        butil::IOPortal header_buf;
+        if (file_pread(&header_buf, fd, offset, WAL_RECORD_HEADER_SIZE)
+                != (ssize_t)WAL_RECORD_HEADER_SIZE) {
+            break;
+        }
+        char header[WAL_RECORD_HEADER_SIZE];
+        header_buf.copy_to(header, WAL_RECORD_HEADER_SIZE);
+        uint32_t payload_len = 0;
+        uint32_t payload_checksum = 0;
+        uint32_t header_checksum = 0;
+        butil::RawUnpacker(header).unpack32(payload_len)
+                                  .unpack32(payload_checksum)
+                                  .unpack32(header_checksum);
+        if (header_checksum != crc32(header, WAL_RECORD_HEADER_SIZE - 4)
+                || payload_len < WAL_PAYLOAD_FIXED_SIZE) {
+            break;
+        }
+        butil::IOPortal payload;
+        if (file_pread(&payload, fd, offset + WAL_RECORD_HEADER_SIZE, payload_len)
+                != (ssize_t)payload_len) {
+            break;
+        }
+        if (payload_checksum != crc32(payload)) {
+            break;
+        }
+        char fixed[WAL_PAYLOAD_FIXED_SIZE];
+        payload.cutn(fixed, WAL_PAYLOAD_FIXED_SIZE);
+        uint32_t meta_field = 0;
+        uint64_t index = 0;
+        uint64_t term = 0;
+        butil::RawUnpacker(fixed).unpack32(meta_field)
+                                 .unpack64(index)
+                                 .unpack64(term);
+        const int type = meta_field >> 24;
+        const size_t group_len = meta_field & 0xFFFF;
+        if (payload.size() < group_len) {
+            break;
+        }
+        std::string group;
+        payload.cutn(&group, group_len);
+        GroupIndex* gi = &_groups[group];
+        switch (type) {
+        case RECORD_ENTRY:
+            {
+                EntryLocation loc;
+                loc.file_id = file_id;
+                loc.offset = offset;
+                loc.term = term;
+                loc.length = WAL_RECORD_HEADER_SIZE + payload_len;
+                loc.type = (EntryType)((meta_field >> 16) & 0xFF);
+                apply_entry(gi, index, loc);
+            }
+            break;
+        case RECORD_TRUNCATE_PREFIX:
+            apply_truncate_prefix(gi, index);
+            break;
+        case RECORD_TRUNCATE_SUFFIX:
+            apply_truncate_suffix(gi, index);
+            break;
+        case RECORD_RESET:
+            apply_reset(gi, index);
+            break;
+        case RECORD_REMOVE:
+            apply_remove(group);
+            break;
+        default:
+            LOG(ERROR) << "Unknown record type=" << type << " in " << path
+                       << " offset: " << offset;
+            return -1;
+        }
+        offset += WAL_RECORD_HEADER_SIZE + payload_len;
+    }
+    if (offset != file_size) {
+        if (!is_last) {
+            LOG(ERROR) << "Found corrupted record in " << path
+                       << " offset: " << offset;
+            return -1;
+        }
+        LOG(INFO) << "Truncate uncompleted record in " << path
+                  << " old_size: " << file_size << " new_size: " << offset;
+        if (ftruncate_uninterrupted(fd, offset) != 0) {
+            PLOG(ERROR) << "Fail to truncate " << path;
+            return -1;
+        }
+    }
+    file->size = offset;
+    _written_seq += offset;
+    _synced_seq = _written_seq;
+    return 0;
+}
+
+int SharedWal::serialize_record(RecordType type, const std::string& group,
+                                const LogEntry* entry, int64_t index,
+                                butil::IOBuf* buf) {
+    butil::IOBuf data;
+    int64_t term = 0;
+    EntryType entry_type = ENTRY_TYPE_UNKNOWN;
+    if (entry) {
+        index = entry->id.index;
+        term = entry->id.term;
+        entry_type = entry->type;
+        switch (entry->type) {
+        case ENTRY_TYPE_DATA:
+        case ENTRY_TYPE_DATA_BATCH:
+        case ENTRY_TYPE_PARTITIONED_DATA:
+            data.append(entry->data);
+            break;
+        case ENTRY_TYPE_NO_OP:
+            break;
+        case ENTRY_TYPE_CONFIGURATION:
+            if (!serialize_configuration_meta(entry, data).ok()) {
+                LOG(ERROR) << "Fail to serialize ConfigurationPBMeta";
+                return -1;
+            }
+            break;
+        default:
+            LOG(ERROR) << "Unknown entry type: " << entry->type;
+            return -1;
+        }
+    }
+    butil::IOBuf payload;
+    char fixed[WAL_PAYLOAD_FIXED_SIZE];
+    const uint32_t meta_field = (type << 24) | (entry_type << 16)
+                                | (uint32_t)group.size();
+    butil::RawPacker(fixed).pack32(meta_field).pack64(index).pack64(term);
+    payload.append(fixed, WAL_PAYLOAD_FIXED_SIZE);
+    payload.append(group);
+    payload.append(data);
+    char header[WAL_RECORD_HEADER_SIZE];
+    butil::RawPacker packer(header);
+    packer.pack32(payload.size()).pack32(crc32(payload));
+    packer.pack32(crc32(header, WAL_RECORD_HEADER_SIZE - 4));
+    buf->append(header, WAL_RECORD_HEADER_SIZE);
+    buf->append(payload);
+    return 0;
+}
+
+int SharedWal::maybe_roll() {
+    // Must be called with _mutex held
+    scoped_refptr<WalFile> active = _files[_active_file_id];
+    if (active->size < FLAGS_raft_shared_wal_file_size) {
+        return 0;
+    }
+    // What's in the previous files is durable, so that sync_to() only has to
+    // care about the active file
+    if (FLAGS_raft_sync && raft_fsync(active->fd) != 0) {
+        PLOG(ERROR) << "Fail to sync " << file_path(_active_file_id);
+        return -1;
+    }
+    if (create_file(_active_file_id + 1) != 0) {
+        return -1;
+    }
+    // Save where each group starts, so that the records of earlier files
+    // could be removed
+    butil::IOBuf buf;
+    for (GroupMap::iterator it = _groups.begin(); it != _groups.end(); ++it) {
+        serialize_record(RECORD_TRUNCATE_PREFIX, it->first, NULL,
+                         it->second.first_index, &buf);
+    }
+    int64_t file_id = 0;
+    int64_t offset = 0;
+    if (write(buf, &file_id, &offset) < 0) {
+        return -1;
+    }
+    remove_unused_files();
+    return 0;
+}
+
+int64_t SharedWal::write(const butil::IOBuf& buf, int64_t* file_id,
+                         int64_t* offset) {
+    // Must be called with _mutex held
+    scoped_refptr<WalFile> active = _files[_active_file_id];
+    if (file_pwrite(buf, active->fd, active->size) != (ssize_t)buf.size()) {
+        PLOG(ERROR) << "Fail to write to " << file_path(_active_file_id);
+        // Drop the partial write, the following records are appended after
+        // the good ones
+        ftruncate_uninterrupted(active->fd, active->size);
+        return -1;
+    }
+    *file_id = _active_file_id;
+    *offset = active->size;
+    active->size += buf.size();
+    _written_seq += buf.size();
+    return _written_seq;
+}
+
+int SharedWal::sync_to(int64_t seq) {
+    if (!FLAGS_raft_sync) {
+        return 0;
+    }
+    BAIDU_SCOPED_LOCK(_sync_mutex);
+    if (_synced_seq >= seq) {
+        // Synced along with the records of other groups
+        g_shared_wal_sync_saved << 1;
+        return 0;
+    }
+    scoped_refptr<WalFile> active;
+    int64_t target = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        active = _files[_active_file_id];
+        target = _written_seq;
+    }
+    if (raft_fsync(active->fd) != 0) {
+        PLOG(ERROR) << "Fail to sync wal in " << _dir;
+        return -1;
+    }
+    g_shared_wal_fsync << 1;
+    _synced_seq = target;
+    return 0;
+}
+
+void SharedWal::release_entry(const EntryLocation& loc) {
+    FileMap::iterator it = _files.find(loc.file_id);
+    if (it != _files.end()) {
+        --it->second->live_entries;
+    }
+}
+
+void SharedWal::apply_entry(GroupIndex* gi, int64_t index,
+                            const EntryLocation& loc) {
+    if (index <= gi->last_index() && index >= gi->first_index) {
+        // Overwrite the conflicting entries
+        apply_truncate_suffix(gi, index - 1);
+    } else if (index != gi->last_index() + 1) {
+        // The group was reset
+        apply_reset(gi, index);
+    }
+    gi->entries.push_back(loc);
+    FileMap::iterator it = _files.find(loc.file_id);
+    if (it != _files.end()) {
+        ++it->second->live_entries;
+    }
+}
+
+void SharedWal::apply_truncate_prefix(GroupIndex* gi, int64_t first_index_kept) {
+    if (first_index_kept > gi->last_index() + 1) {
+        return apply_reset(gi, first_index_kept);
+    }
+    while (gi->first_index < first_index_kept) {
+        release_entry(gi->entries.front());
+        gi->entries.pop_front();
+        ++gi->first_index;
+    }
+}
+
+void SharedWal::apply_truncate_suffix(GroupIndex* gi, int64_t last_index_kept) {
+    while (!gi->entries.empty() && gi->last_index() > last_index_kept) {
+        release_entry(gi->entries.back());
+        gi->entries.pop_back();
+    }
+}
+
+void SharedWal::apply_reset(GroupIndex* gi, int64_t next_log_index) {
+    for (size_t i = 0; i < gi->entries.size(); ++i) {
+        release_entry(gi->entries[i]);
+    }
+    gi->entries.clear();
+    gi->first_index = next_log_index;
+}
+
+void SharedWal::apply_remove(const std::string& group) {
+    GroupMap::iterator it = _groups.find(group);
+    if (it != _groups.end()) {
+        apply_reset(&it->second, 1);
+        _groups.erase(it);
+    }
+}
+
+void SharedWal::remove_unused_files() {
+    // Must be called with _mutex held. Only the oldest files are removed as
+    // the truncations recorded in a file might affect entries in earlier
+    // files
+    while (_files.size() > 1) {
+        FileMap::iterator it = _files.begin();
+        if (it->first == _active_file_id || it->second->live_entries > 0) {
+            break;
+        }
+        const std::string path = file_path(it->first);
+        if (::unlink(path.c_str()) != 0) {
+            PLOG(ERROR) << "Fail to unlink " << path;
+            break;
+        }
+        LOG(INFO) << "Removed unused wal file `" << path << '\'';
+        _files.erase(it);
+    }
+}
+
+int SharedWal::attach(const std::string& group) {
+    if (group.empty() || group.size() > 0xFFFF) {
+        LOG(ERROR) << "Invalid group `" << group << '\'';
+        return EINVAL;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    GroupIndex* gi = &_groups[group];
+    if (gi->attached) {
+        LOG(ERROR) << "Group `" << group << "' is already attached to "
+                   << _dir;
+        return EBUSY;
+    }
+    gi->attached = true;
+    return 0;
+}
+
+void SharedWal::detach(const std::string& group) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _groups[group].attached = false;
+}
+
+int64_t SharedWal::first_log_index(const std::string& group) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _groups[group].first_index;
+}
+
+int64_t SharedWal::last_log_index(const std::string& group) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _groups[group].last_index();
+}
+
+int64_t SharedWal::get_term(const std::string& group, const int64_t index) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const GroupIndex& gi = _groups[group];
+    if (index < gi.first_index || index > gi.last_index()) {
+        return 0;
+    }
+    return gi.entries[index - gi.first_index].term;
+}
+
+LogEntry* SharedWal::get_entry(const std::string& group, const int64_t index) {
+    EntryLocation loc;
+    scoped_refptr<WalFile> file;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        const GroupIndex& gi = _groups[group];
+        if (index < gi.first_index || index > gi.last_index()) {
+            return NULL;
+        }
+        loc = gi.entries[index - gi.first_index];
+        file = _files[loc.file_id];
+    }
+    butil::IOPortal buf;
+    if (file_pread(&buf, file->fd, loc.offset, loc.length) != (ssize_t)loc.length) {
+        LOG(ERROR) << "Fail to read entry of group " << group << " index: "
+                   << index << " from " << file_path(loc.file_id);
+        return NULL;
+    }
+    char header[WAL_RECORD_HEADER_SIZE];
+    buf.cutn(header, WAL_RECORD_HEADER_SIZE);
+    uint32_t payload_len = 0;
+    uint32_t payload_checksum = 0;
+    butil::RawUnpacker(header).unpack32(payload_len).unpack32(payload_checksum);
+    if (payload_checksum != crc32(buf)) {
+        LOG(ERROR) << "Found corrupted entry of group " << group << " index: "
+                   << index << " in " << file_path(loc.file_id);
+        return NULL;
+    }
+    buf.pop_front(WAL_PAYLOAD_FIXED_SIZE + group.size());
+    LogEntry* entry = new LogEntry;
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->AddRef();
+    entry->id.index = index;
+    entry->id.term = loc.term;
+    entry->type = loc.type;
+    switch (loc.type) {
+    case ENTRY_TYPE_DATA:
+    case ENTRY_TYPE_DATA_BATCH:
+    case ENTRY_TYPE_PARTITIONED_DATA:
+        entry->data.swap(buf);
+        break;
+    case ENTRY_TYPE_NO_OP:
+        break;
+    case ENTRY_TYPE_CONFIGURATION:
+        if (!parse_configuration_meta(buf, entry).ok()) {
+            LOG(ERROR) << "Fail to parse ConfigurationPBMeta of group " << group
+                       << " index: " << index;
+            entry->Release();
+            return NULL;
+        }
+        break;
+    default:
+        CHECK(false) << "Unknown entry type, group: " << group
+                     << " index: " << index;
+        entry->Release();
+        return NULL;
+    }
+    return entry;
+}
+
+int SharedWal::append_entries(const std::string& group,
+                              const std::vector<LogEntry*>& entries) {
+    if (entries.empty()) {
+        return 0;
+    }
+    butil::IOBuf buf;
+    std::vector<uint32_t> lengths;
+    lengths.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const size_t old_size = buf.size();
+        if (serialize_record(RECORD_ENTRY, group, entries[i], 0, &buf) != 0) {
+            return -1;
+        }
+        lengths.push_back(buf.size() - old_size);
+    }
+    int64_t seq = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        GroupIndex* gi = &_groups[group];
+        if (gi->last_index() + 1 != entries.front()->id.index) {
+            LOG(FATAL) << "There's gap between appending entries and "
+                          "last_log_index of group " << group;
+            return -1;
+        }
+        if (maybe_roll() != 0) {
+            return -1;
+        }
+        int64_t file_id = 0;
+        int64_t offset = 0;
+        seq = write(buf, &file_id, &offset);
+        if (seq < 0) {
+            return -1;
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            EntryLocation loc;
+            loc.file_id = file_id;
+            loc.offset = offset;
+            loc.term = entries[i]->id.term;
+            loc.length = lengths[i];
+            loc.type = entries[i]->type;
+            apply_entry(gi, entries[i]->id.index, loc);
+            offset += lengths[i];
+        }
+    }
+    if (sync_to(seq) != 0) {
+        return -1;
+    }
+    return entries.size();
+}
+
+int SharedWal::sync_operation(RecordType type, const std::string& group,
+                              int64_t index) {
+    butil::IOBuf buf;
+    serialize_record(type, group, NULL, index, &buf);
+    int64_t seq = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (maybe_roll() != 0) {
+            return -1;
+        }
+        int64_t file_id = 0;
+        int64_t offset = 0;
+        seq = write(buf, &file_id, &offset);
+        if (seq < 0) {
+            return -1;
+        }
+        GroupIndex* gi = &_groups[group];
+        switch (type) {
+        case RECORD_TRUNCATE_PREFIX:
+            apply_truncate_prefix(gi, index);
+            break;
+        case RECORD_TRUNCATE_SUFFIX:
+            apply_truncate_suffix(gi, index);
+            break;
+        case RECORD_RESET:
+            apply_reset(gi, index);
+            break;
+        default:
+            CHECK(false) << "Unexpected record type=" << type;
+            return -1;
+        }
+        remove_unused_files();
+    }
+    return sync_to(seq);
+}
+
+int SharedWal::truncate_prefix(const std::string& group,
+                               const int64_t first_index_kept) {
+    return sync_operation(RECORD_TRUNCATE_PREFIX, group, first_index_kept);
+}
+
+int SharedWal::truncate_suffix(const std::string& group,
+                               const int64_t last_index_kept) {
+    return sync_operation(RECORD_TRUNCATE_SUFFIX, group, last_index_kept);
+}
+
+int SharedWal::reset(const std::string& group, const int64_t next_log_index) {
+    if (next_log_index <= 0) {
+        LOG(ERROR) << "Invalid next_log_index=" << next_log_index
+                   << " group: " << group;
+        return EINVAL;
+    }
+    return sync_operation(RECORD_RESET, group, next_log_index);
+}
+
+void SharedWal::list_configuration_indexes(const std::string& group,
+                                           std::vector<int64_t>* indexes) {
+    indexes->clear();
+    BAIDU_SCOPED_LOCK(_mutex);
+    const GroupIndex& gi = _groups[group];
+    for (size_t i = 0; i < gi.entries.size(); ++i) {
+        if (gi.entries[i].type == ENTRY_TYPE_CONFIGURATION) {
+            indexes->push_back(gi.first_index + i);
+        }
+    }
+}
+
+int SharedWal::remove_group(const std::string& group) {
+    butil::IOBuf buf;
+    serialize_record(RECORD_REMOVE, group, NULL, 0, &buf);
+    int64_t seq = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        GroupMap::iterator it = _groups.find(group);
+        if (it == _groups.end()) {
+            return 0;
+        }
+        if (it->second.attached) {
+            LOG(ERROR) << "Fail to remove group `" << group
+                       << "' attached to " << _dir;
+            return EBUSY;
+        }
+        if (maybe_roll() != 0) {
+            return -1;
+        }
+        int64_t file_id = 0;
+        int64_t offset = 0;
+        seq = write(buf, &file_id, &offset);
+        if (seq < 0) {
+            return -1;
+        }
+        apply_remove(group);
+        remove_unused_files();
+    }
+    LOG(INFO) << "Removed group " << group << " from shared wal " << _dir;
+    return sync_to(seq);
+}
+
+size_t SharedWal::file_count() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _files.size();
+}
+
+SharedLogStorage::~SharedLogStorage() {
+    if (_wal) {
+        _wal->detach(_group);
+        SharedWal::close(_wal);
+    }
+}
+
+int SharedLogStorage::init(ConfigurationManager* configuration_manager) {
+    if (_wal) {
+        LOG(ERROR) << "Already initialized, group: " << _group;
+        return -1;
+    }
+    SharedWal* wal = SharedWal::open(_wal_dir);
+    if (wal == NULL) {
+        return -1;
+    }
+    if (wal->attach(_group) != 0) {
+        SharedWal::close(wal);
+        return -1;
+    }
+    _wal = wal;
+    const int64_t first_index = _wal->first_log_index(_group);
+    const int64_t last_index = _wal->last_log_index(_group);
+    // Configurations are rare, read only them as the types of the entries
+    // are in the index
+    std::vector<int64_t> conf_indexes;
+    _wal->list_configuration_indexes(_group, &conf_indexes);
+    for (size_t i = 0; i < conf_indexes.size(); ++i) {
+        LogEntry* entry = _wal->get_entry(_group, conf_indexes[i]);
+        if (entry == NULL) {
+            LOG(ERROR) << "Fail to load entry " << conf_indexes[i]
+                       << " of group " << _group;
+            return -1;
+        }
+        ConfigurationEntry conf_entry(*entry);
+        configuration_manager->add(conf_entry);
+        entry->Release();
+    }
+    LOG(INFO) << "Loaded group " << _group << " from shared wal " << _wal_dir
+              << " first_log_index: " << first_index
+              << " last_log_index: " << last_index;
+    return 0;
+}
+
+int64_t SharedLogStorage::first_log_index() {
+    return _wal->first_log_index(_group);
+}
+
+int64_t SharedLogStorage::last_log_index() {
+    return _wal->last_log_index(_group);
+}
+
+LogEntry* SharedLogStorage::get_entry(const int64_t index) {
+    return _wal->get_entry(_group, index);
+}
+
+int64_t SharedLogStorage::get_term(const int64_t index) {
+    return _wal->get_term(_group, index);
+}
+
+int SharedLogStorage::append_entry(const LogEntry* entry) {
+    std::vector<LogEntry*> entries(1, const_cast<LogEntry*>(entry));
+    return _wal->append_entries(_group, entries) == 1 ? 0 : EIO;
+}
+
+int SharedLogStorage::append_entries(const std::vector<LogEntry*>& entries) {
+    return _wal->append_entries(_group, entries);
+}
+
+int SharedLogStorage::truncate_prefix(const int64_t first_index_kept) {
+    return _wal->truncate_prefix(_group, first_index_kept);
+}
+
+int SharedLogStorage::truncate_suffix(const int64_t last_index_kept) {
+    return _wal->truncate_suffix(_group, last_index_kept);
+}
+
+int SharedLogStorage::reset(const int64_t next_log_index) {
+    return _wal->reset(_group, next_log_index);
+}
+
+int SharedLogStorage::remove_group(const std::string& wal_dir,
+                                   const std::string& group) {
+    SharedWal* wal = SharedWal::open(wal_dir);
+    if (wal == NULL) {
+        return EIO;
+    }
+    const int rc = wal->remove_group(group);
+    SharedWal::close(wal);
+    return rc;
+}
+
+LogStorage* SharedLogStorage::new_instance(const std::string& uri) const {
+    // ${wal_dir}?group=${group}
+    const size_t pos = uri.find("?group=");
+    if (pos == std::string::npos || pos + 7 == uri.size()) {
+        LOG(ERROR) << "Missing group in shared log uri=`" << uri << '\'';
+        return NULL;
+    }
+    return new SharedLogStorage(uri.substr(0, pos), uri.substr(pos + 7));
+}
+
+}  //  namespace braft
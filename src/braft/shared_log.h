@@ -0,0 +1,202 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_SHARED_LOG_H
+#define BRAFT_SHARED_LOG_H
+
+#include <map>
+#include <deque>
+#include <butil/memory/ref_counted.h>
+#include <butil/iobuf.h>
+#include "braft/log_entry.h"
+#include "braft/storage.h"
+#include "braft/util.h"
+
+namespace braft {
+
+DECLARE_int32(raft_shared_wal_file_size);
+
+// Write-ahead log shared by all the raft groups in this process which are
+// configured with the same directory. Entries of different groups are
+// multiplexed into one sequence of files, so that the disk sees sequential
+// writes and concurrent appendings share fsyncs.
+//
+// Files are named as wal_${file_id} and each one is a sequence of records:
+//   payload_len(32) | payload_checksum(32) | header_checksum(32) | payload
+//   payload: type(8) | entry_type(8) | group_len(16) | index(64) | term(64) |
+//            group | data
+// Truncations are records as well and the in-memory index of each group is
+// rebuilt by replaying the files in order. A file is removed once it's the
+// oldest one and none of the groups references entries in it anymore.
+class SharedWal {
+public:
+    // Get the wal of |dir| shared by this process, which is loaded on the
+    // first call. Returns NULL on failure.
+    static SharedWal* open(const std::string& dir);
+    // Release the reference got by open()
+    static void close(SharedWal* wal);
+
+    // A group is attached to at most one LogStorage at the same time
+    int attach(const std::string& group);
+    void detach(const std::string& group);
+
+    int64_t first_log_index(const std::string& group);
+    int64_t last_log_index(const std::string& group);
+    LogEntry* get_entry(const std::string& group, const int64_t index);
+    int64_t get_term(const std::string& group, const int64_t index);
+    // Return the number of appended entries, -1 on error.
+    int append_entries(const std::string& group,
+                       const std::vector<LogEntry*>& entries);
+    int truncate_prefix(const std::string& group, const int64_t first_index_kept);
+    int truncate_suffix(const std::string& group, const int64_t last_index_kept);
+    int reset(const std::string& group, const int64_t next_log_index);
+    // Indexes of the configuration entries of |group|, found without reading
+    // the entries
+    void list_configuration_indexes(const std::string& group,
+                                    std::vector<int64_t>* indexes);
+    // Drop all the entries of the detached |group| for good, so that the
+    // files referenced by them could be removed
+    int remove_group(const std::string& group);
+
+    size_t file_count();
+
+private:
+    struct WalFile : public butil::RefCountedThreadSafe<WalFile> {
+        WalFile() : fd(-1), size(0), live_entries(0) {}
+        ~WalFile() {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        int fd;
+        int64_t size;
+        int64_t live_entries;
+    };
+    struct EntryLocation {
+        int64_t file_id;
+        int64_t offset;
+        int64_t term;
+        uint32_t length;
+        EntryType type;
+    };
+    struct GroupIndex {
+        GroupIndex() : first_index(1), attached(false) {}
+        int64_t last_index() const { return first_index + entries.size() - 1; }
+        int64_t first_index;
+        std::deque<EntryLocation> entries;
+        bool attached;
+    };
+    enum RecordType {
+        RECORD_ENTRY = 0,
+        RECORD_TRUNCATE_PREFIX = 1,
+        RECORD_TRUNCATE_SUFFIX = 2,
+        RECORD_RESET = 3,
+        RECORD_REMOVE = 4,
+    };
+    typedef std::map<std::string, GroupIndex> GroupMap;
+    typedef std::map<int64_t, scoped_refptr<WalFile> > FileMap;
+
+    explicit SharedWal(const std::string& dir);
+    ~SharedWal();
+
+    int init();
+    int load_file(int64_t file_id, bool is_last);
+    int create_file(int64_t file_id);
+    std::string file_path(int64_t file_id) const;
+
+    static int serialize_record(RecordType type, const std::string& group,
+                                const LogEntry* entry, int64_t index,
+                                butil::IOBuf* buf);
+    // Write |buf| to the end of the wal, return the sequence to sync to
+    int64_t write(const butil::IOBuf& buf, int64_t* file_id, int64_t* offset);
+    int sync_to(int64_t seq);
+    int maybe_roll();
+    int sync_operation(RecordType type, const std::string& group, int64_t index);
+
+    // Update the in-memory index, shared by replaying and writing
+    void apply_entry(GroupIndex* gi, int64_t index, const EntryLocation& loc);
+    void apply_truncate_prefix(GroupIndex* gi, int64_t first_index_kept);
+    void apply_truncate_suffix(GroupIndex* gi, int64_t last_index_kept);
+    void apply_reset(GroupIndex* gi, int64_t next_log_index);
+    void apply_remove(const std::string& group);
+    void release_entry(const EntryLocation& loc);
+    void remove_unused_files();
+
+    std::string _dir;
+    int _nref;
+    raft_mutex_t _mutex;
+    GroupMap _groups;
+    FileMap _files;
+    int64_t _active_file_id;
+    // Bytes ever written to this wal in this process
+    int64_t _written_seq;
+    raft_mutex_t _sync_mutex;
+    int64_t _synced_seq;
+};
+
+// LogStorage of a group which saves entries in a SharedWal.
+//   uri: shared://${wal_dir}?group=${group}
+class SharedLogStorage : public LogStorage {
+public:
+    SharedLogStorage() : _wal(NULL) {}
+    SharedLogStorage(const std::string& wal_dir, const std::string& group)
+        : _wal_dir(wal_dir), _group(group), _wal(NULL) {}
+    virtual ~SharedLogStorage();
+
+    // init logstorage, check consistency and integrity
+    virtual int init(ConfigurationManager* configuration_manager);
+
+    // first log index in log
+    virtual int64_t first_log_index();
+
+    // last log index in log
+    virtual int64_t last_log_index();
+
+    // get logentry by index
+    virtual LogEntry* get_entry(const int64_t index);
+
+    // get logentry's term by index
+    virtual int64_t get_term(const int64_t index);
+
+    // append entry to log
+    virtual int append_entry(const LogEntry* entry);
+
+    // append entries to log, return success append number
+    virtual int append_entries(const std::vector<LogEntry*>& entries);
+
+    // delete logs from storage's head, [1, first_index_kept) will be discarded
+    virtual int truncate_prefix(const int64_t first_index_kept);
+
+    // delete uncommitted logs from storage's tail, (last_index_kept, infinity) will be discarded
+    virtual int truncate_suffix(const int64_t last_index_kept);
+
+    virtual int reset(const int64_t next_log_index);
+
+    virtual LogStorage* new_instance(const std::string& uri) const;
+
+    // Drop the entries of |group|, which is removed from this process, from
+    // the shared wal in |wal_dir|. Otherwise they keep the wal files from
+    // being removed.
+    // Returns 0 on success, the error otherwise
+    static int remove_group(const std::string& wal_dir, const std::string& group);
+
+private:
+    std::string _wal_dir;
+    std::string _group;
+    SharedWal* _wal;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_SHARED_LOG_H
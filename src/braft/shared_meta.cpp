@@ -0,0 +1,469 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/shared_meta.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <gflags/gflags.h>
+#include <butil/file_util.h>                         // butil::CreateDirectory
+#include <butil/raw_pack.h>                          // butil::RawPacker
+#include <butil/fd_utility.h>                        // butil::make_close_on_exec
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/fsync.h"
+
+#define BRAFT_META_LOG_FILE "raft_meta_log"
+
+namespace braft {
+
+DEFINE_int32(raft_shared_meta_compact_size, 4 * 1024 * 1024,
+             "Compact the shared raft meta log once it exceeds this size and "
+             "twice the size of the latest records of the groups");
+BRPC_VALIDATE_GFLAG(raft_shared_meta_compact_size, brpc::PositiveInteger);
+
+DECLARE_bool(raft_create_parent_directories);
+
+// Defined in log.cpp
+int ftruncate_uninterrupted(int fd, off_t length);
+
+static bvar::Adder<int64_t> g_shared_meta_fsync("raft_shared_meta_fsync");
+static bvar::Adder<int64_t> g_shared_meta_sync_saved(
+        "raft_shared_meta_sync_saved");
+
+static const size_t META_RECORD_HEADER_SIZE = 12;
+static const size_t META_PAYLOAD_FIXED_SIZE = 12;
+
+static pthread_mutex_t g_meta_log_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+typedef std::map<std::string, SharedMetaLog*> MetaLogMap;
+static MetaLogMap* g_meta_log_map = NULL;
+
+SharedMetaLog* SharedMetaLog::open(const std::string& dir) {
+    pthread_mutex_lock(&g_meta_log_map_mutex);
+    if (g_meta_log_map == NULL) {
+        g_meta_log_map = new MetaLogMap;
+    }
+    MetaLogMap::iterator it = g_meta_log_map->find(dir);
+    SharedMetaLog* log = NULL;
+    if (it != g_meta_log_map->end()) {
+        log = it->second;
+        ++log->_nref;
+    } else {
+        log = new SharedMetaLog(dir);
+        if (log->init() == 0) {
+            log->_nref = 1;
+            (*g_meta_log_map)[dir] = log;
+        } else {
+            delete log;
+            log = NULL;
+        }
+    }
+    pthread_mutex_unlock(&g_meta_log_map_mutex);
+    return log;
+}
+
+void SharedMetaLog::close(SharedMetaLog* log) {
+    pthread_mutex_lock(&g_meta_log_map_mutex);
+    if (--log->_nref > 0) {
+        log = NULL;
+    } else {
+        g_meta_log_map->erase(log->_dir);
+    }
+    pthread_mutex_unlock(&g_meta_log_map_mutex);
+    delete log;
+}
+
+SharedMetaLog::SharedMetaLog(const std::string& dir)
+    : _dir(dir)
+    , _nref(0)
+    , _fd(-1)
+    , _file_size(0)
+    , _live_size(0)
+    , _compacting(false)
+    , _compact_tid(INVALID_BTHREAD)
+    , _written_seq(0)
+    , _synced_seq(0)
+    , _need_sync_dir(false)
+{}
+
+SharedMetaLog::~SharedMetaLog() {
+    if (_compact_tid != INVALID_BTHREAD) {
+        bthread_join(_compact_tid, NULL);
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+    }
+}
+
+std::string SharedMetaLog::file_path() const {
+    return _dir + "/" BRAFT_META_LOG_FILE;
+}
+
+int SharedMetaLog::init() {
+    butil::FilePath dir_path(_dir);
+    butil::File::Error e;
+    if (!butil::CreateDirectoryAndGetError(
+                dir_path, &e, FLAGS_raft_create_parent_directories)) {
+        LOG(ERROR) << "Fail to create " << dir_path.value() << " : " << e;
+        return -1;
+    }
+    const std::string path = file_path();
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (_fd < 0) {
+        PLOG(ERROR) << "Fail to open " << path;
+        return -1;
+    }
+    butil::make_close_on_exec(_fd);
+    return load();
+}
+
+int SharedMetaLog::load() {
+    const std::string path = file_path();
+    struct stat st_buf;
+    if (fstat(_fd, &st_buf) != 0) {
+        PLOG(ERROR) << "Fail to get the stat of " << path;
+        return -1;
+    }
+    const int64_t file_size = st_buf.st_size;
+    int64_t offset = 0;
+    while (offset < file_size) {
+        butil::IOPortal header_buf;
+        if (file_pread(&header_buf, _fd, offset, META_RECORD_HEADER_SIZE)
+                != (ssize_t)META_RECORD_HEADER_SIZE) {
+            break;
+        }
+        char header[META_RECORD_HEADER_SIZE];
+        header_buf.copy_to(header, META_RECORD_HEADER_SIZE);
+        uint32_t payload_len = 0;
+        uint32_t payload_checksum = 0;
+        uint32_t header_checksum = 0;
+        butil::RawUnpacker(header).unpack32(payload_len)
+                                  .unpack32(payload_checksum)
+                                  .unpack32(header_checksum);
+        if (header_checksum != crc32(header, META_RECORD_HEADER_SIZE - 4)
+                || payload_len < META_PAYLOAD_FIXED_SIZE) {
+            break;
+        }
+        butil::IOPortal payload;
+        if (file_pread(&payload, _fd, offset + META_RECORD_HEADER_SIZE,
+                       payload_len) != (ssize_t)payload_len) {
+            break;
+        }
+        if (payload_checksum != crc32(payload)) {
+            break;
+        }
+        char fixed[META_PAYLOAD_FIXED_SIZE];
+        payload.cutn(fixed, META_PAYLOAD_FIXED_SIZE);
+        uint64_t term = 0;
+        uint32_t group_len = 0;
+        butil::RawUnpacker(fixed).unpack64(term).unpack32(group_len);
+        if (payload.size() < group_len) {
+            break;
+        }
+        std::string group;
+        payload.cutn(&group, group_len);
+        GroupMeta& gm = _groups[group];
+        if (gm.votedfor.parse(payload.to_string()) != 0) {
+            LOG(ERROR) << "Fail to parse votedfor of group `" << group
+                       << "' in " << path << " offset: " << offset;
+            return -1;
+        }
+        gm.term = term;
+        const int64_t record_size = META_RECORD_HEADER_SIZE + payload_len;
+        _live_size += record_size - gm.record_size;
+        gm.record_size = record_size;
+        offset += record_size;
+    }
+    if (offset != file_size) {
+        LOG(INFO) << "Truncate uncompleted record in " << path
+                  << " old_size: " << file_size << " new_size: " << offset;
+        if (ftruncate_uninterrupted(_fd, offset) != 0) {
+            PLOG(ERROR) << "Fail to truncate " << path;
+            return -1;
+        }
+    }
+    _file_size = offset;
+    _written_seq = offset;
+    _synced_seq = offset;
+    return 0;
+}
+
+void SharedMetaLog::serialize_record(const std::string& group,
+                                     const GroupMeta& meta,
+                                     butil::IOBuf* buf) {
+    butil::IOBuf payload;
+    char fixed[META_PAYLOAD_FIXED_SIZE];
+    butil::RawPacker(fixed).pack64(meta.term).pack32(group.size());
+    payload.append(fixed, META_PAYLOAD_FIXED_SIZE);
+    payload.append(group);
+    payload.append(meta.votedfor.to_string());
+    char header[META_RECORD_HEADER_SIZE];
+    butil::RawPacker packer(header);
+    packer.pack32(payload.size()).pack32(crc32(payload));
+    packer.pack32(crc32(header, META_RECORD_HEADER_SIZE - 4));
+    buf->append(header, META_RECORD_HEADER_SIZE);
+    buf->append(payload);
+}
+
+int SharedMetaLog::attach(const std::string& group) {
+    if (group.empty()) {
+        LOG(ERROR) << "Invalid group `" << group << '\'';
+        return EINVAL;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    GroupMeta& gm = _groups[group];
+    if (gm.attached) {
+        LOG(ERROR) << "Group `" << group << "' is already attached to "
+                   << _dir;
+        return EBUSY;
+    }
+    gm.attached = true;
+    return 0;
+}
+
+void SharedMetaLog::detach(const std::string& group) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _groups[group].attached = false;
+}
+
+void SharedMetaLog::get(const std::string& group, int64_t* term,
+                        PeerId* votedfor) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const GroupMeta& gm = _groups[group];
+    *term = gm.term;
+    *votedfor = gm.votedfor;
+}
+
+int SharedMetaLog::set(const std::string& group, int64_t term,
+                       const PeerId& votedfor) {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    GroupMeta& gm = _groups[group];
+    GroupMeta updated = gm;
+    updated.term = term;
+    updated.votedfor = votedfor;
+    butil::IOBuf buf;
+    serialize_record(group, updated, &buf);
+    if (file_pwrite(buf, _fd, _file_size) != (ssize_t)buf.size()) {
+        PLOG(ERROR) << "Fail to write to " << file_path();
+        // Drop the partial write, the following records are appended after
+        // the good ones
+        ftruncate_uninterrupted(_fd, _file_size);
+        return -1;
+    }
+    _live_size += (int64_t)buf.size() - gm.record_size;
+    updated.record_size = buf.size();
+    gm = updated;
+    _file_size += buf.size();
+    _written_seq += buf.size();
+    const int64_t seq = _written_seq;
+    const bool need_compact = !_compacting &&
+            _file_size >= FLAGS_raft_shared_meta_compact_size &&
+            _file_size >= 2 * _live_size;
+    bthread_t last_compact_tid = INVALID_BTHREAD;
+    bool compact_in_place = false;
+    if (need_compact) {
+        _compacting = true;
+        last_compact_tid = _compact_tid;
+        // The compaction waits for _mutex, so it never finishes before
+        // _compact_tid is set
+        if (bthread_start_background(&_compact_tid, NULL, run_compact, this)
+                != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            _compact_tid = INVALID_BTHREAD;
+            compact_in_place = true;
+        }
+    }
+    lck.unlock();
+    // The last compaction is done except returning
+    if (last_compact_tid != INVALID_BTHREAD) {
+        bthread_join(last_compact_tid, NULL);
+    }
+    if (compact_in_place) {
+        compact();
+    }
+    return sync_to(seq);
+}
+
+int SharedMetaLog::sync_to(int64_t seq) {
+    if (!raft_sync_meta()) {
+        return 0;
+    }
+    BAIDU_SCOPED_LOCK(_sync_mutex);
+    if (_synced_seq >= seq) {
+        // Synced along with the records of other groups
+        g_shared_meta_sync_saved << 1;
+        return 0;
+    }
+    int fd = -1;
+    int64_t target = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        fd = _fd;
+        target = _written_seq;
+    }
+    // The file is only replaced by compact() with _sync_mutex held
+    if (raft_fsync(fd) != 0) {
+        PLOG(ERROR) << "Fail to sync " << file_path();
+        return -1;
+    }
+    if (_need_sync_dir) {
+        if (raft_fsync_dir(_dir) != 0) {
+            PLOG(ERROR) << "Fail to sync " << _dir;
+            return -1;
+        }
+        _need_sync_dir = false;
+    }
+    g_shared_meta_fsync << 1;
+    _synced_seq = target;
+    return 0;
+}
+
+void* SharedMetaLog::run_compact(void* arg) {
+    ((SharedMetaLog*)arg)->compact();
+    return NULL;
+}
+
+int SharedMetaLog::compact() {
+    BAIDU_SCOPED_LOCK(_sync_mutex);
+    // The updates wait for the rewriting, which is small as each group has
+    // only one record
+    BAIDU_SCOPED_LOCK(_mutex);
+    _compacting = false;
+    butil::IOBuf buf;
+    for (GroupMap::iterator it = _groups.begin(); it != _groups.end(); ++it) {
+        if (it->second.record_size > 0) {
+            serialize_record(it->first, it->second, &buf);
+        }
+    }
+    const std::string path = file_path();
+    const std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << tmp_path;
+        return -1;
+    }
+    butil::make_close_on_exec(fd);
+    // Always sync the new file, or the meta of all the groups might be lost
+    // after renaming
+    if (file_pwrite(buf, fd, 0) != (ssize_t)buf.size() ||
+            raft_fsync(fd) != 0) {
+        PLOG(ERROR) << "Fail to write " << tmp_path;
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+        return -1;
+    }
+    if (::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        PLOG(ERROR) << "Fail to rename " << tmp_path << " to " << path;
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+        return -1;
+    }
+    LOG(INFO) << "Compacted " << path << " from " << _file_size
+              << " to " << buf.size() << " bytes";
+    ::close(_fd);
+    _fd = fd;
+    _file_size = buf.size();
+    _live_size = buf.size();
+    // The records are lost if the rename is, sync_to retries on failure
+    _need_sync_dir = true;
+    if (raft_fsync_dir(_dir) != 0) {
+        PLOG(ERROR) << "Fail to sync " << _dir;
+        return -1;
+    }
+    _need_sync_dir = false;
+    _synced_seq = _written_seq;
+    return 0;
+}
+
+int64_t SharedMetaLog::file_size() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _file_size;
+}
+
+SharedRaftMetaStorage::~SharedRaftMetaStorage() {
+    if (_log) {
+        _log->detach(_group);
+        SharedMetaLog::close(_log);
+    }
+}
+
+int SharedRaftMetaStorage::init() {
+    if (_log) {
+        return 0;
+    }
+    SharedMetaLog* log = SharedMetaLog::open(_dir);
+    if (log == NULL) {
+        return -1;
+    }
+    if (log->attach(_group) != 0) {
+        SharedMetaLog::close(log);
+        return -1;
+    }
+    log->get(_group, &_term, &_votedfor);
+    _log = log;
+    return 0;
+}
+
+int SharedRaftMetaStorage::set_term(const int64_t term) {
+    return set_term_and_votedfor(term, _votedfor);
+}
+
+int64_t SharedRaftMetaStorage::get_term() {
+    if (!_log) {
+        LOG(WARNING) << "SharedRaftMetaStorage not init(), group: " << _group;
+        return -1;
+    }
+    return _term;
+}
+
+int SharedRaftMetaStorage::set_votedfor(const PeerId& peer_id) {
+    return set_term_and_votedfor(_term, peer_id);
+}
+
+int SharedRaftMetaStorage::get_votedfor(PeerId* peer_id) {
+    if (!_log) {
+        LOG(WARNING) << "SharedRaftMetaStorage not init(), group: " << _group;
+        return -1;
+    }
+    *peer_id = _votedfor;
+    return 0;
+}
+
+int SharedRaftMetaStorage::set_term_and_votedfor(const int64_t term,
+                                                 const PeerId& peer_id) {
+    if (!_log) {
+        LOG(WARNING) << "SharedRaftMetaStorage not init(), group: " << _group;
+        return -1;
+    }
+    if (_log->set(_group, term, peer_id) != 0) {
+        return -1;
+    }
+    _term = term;
+    _votedfor = peer_id;
+    return 0;
+}
+
+RaftMetaStorage* SharedRaftMetaStorage::new_instance(
+        const std::string& uri) const {
+    // ${meta_dir}?group=${group}
+    const size_t pos = uri.find("?group=");
+    if (pos == std::string::npos || pos + 7 == uri.size()) {
+        LOG(ERROR) << "Missing group in shared meta uri=`" << uri << '\'';
+        return NULL;
+    }
+    return new SharedRaftMetaStorage(uri.substr(0, pos), uri.substr(pos + 7));
+}
+
+}  //  namespace braft
@@ -0,0 +1,140 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_SHARED_META_H
+#define BRAFT_SHARED_META_H
+
+#include <map>
+#include <bthread/bthread.h>
+#include <butil/iobuf.h>
+#include "braft/storage.h"
+#include "braft/util.h"
+
+namespace braft {
+
+DECLARE_int32(raft_shared_meta_compact_size);
+
+// Raft meta (term and votedfor) of all the raft groups in this process which
+// are configured with the same directory, kept in one append-only file, so
+// that concurrent updates of different groups share fsyncs, e.g. when
+// thousands of groups vote at the same time.
+//
+// The file is named raft_meta_log and is a sequence of records:
+//   payload_len(32) | payload_checksum(32) | header_checksum(32) | payload
+//   payload: term(64) | group_len(32) | group | votedfor
+// The last record of each group wins when the file is replayed. Once the
+// file exceeds raft_shared_meta_compact_size and twice the size of the live
+// records, it's rewritten with the latest record of each group in background.
+class SharedMetaLog {
+public:
+    // Get the meta log of |dir| shared by this process, which is loaded on
+    // the first call. Returns NULL on failure.
+    static SharedMetaLog* open(const std::string& dir);
+    // Release the reference got by open()
+    static void close(SharedMetaLog* log);
+
+    // A group is attached to at most one RaftMetaStorage at the same time
+    int attach(const std::string& group);
+    void detach(const std::string& group);
+
+    void get(const std::string& group, int64_t* term, PeerId* votedfor);
+    // Returns 0 once the meta is durable, -1 otherwise
+    int set(const std::string& group, int64_t term, const PeerId& votedfor);
+
+    int64_t file_size();
+
+private:
+    struct GroupMeta {
+        GroupMeta() : term(1), record_size(0), attached(false) {}
+        int64_t term;
+        PeerId votedfor;
+        // Size of the latest record of this group, 0 if there's none
+        int64_t record_size;
+        bool attached;
+    };
+    typedef std::map<std::string, GroupMeta> GroupMap;
+
+    explicit SharedMetaLog(const std::string& dir);
+    ~SharedMetaLog();
+
+    int init();
+    int load();
+    std::string file_path() const;
+
+    static void serialize_record(const std::string& group,
+                                 const GroupMeta& meta, butil::IOBuf* buf);
+    int sync_to(int64_t seq);
+    static void* run_compact(void* arg);
+    int compact();
+
+    std::string _dir;
+    int _nref;
+    raft_mutex_t _mutex;
+    GroupMap _groups;
+    int _fd;
+    int64_t _file_size;
+    // Size of the file if it only has the latest record of each group
+    int64_t _live_size;
+    bool _compacting;
+    // Guarded by _mutex
+    bthread_t _compact_tid;
+    // Bytes ever written to this log in this process
+    int64_t _written_seq;
+    raft_mutex_t _sync_mutex;
+    int64_t _synced_seq;
+    // Whether the rename of the last compaction is not durable yet, guarded
+    // by _sync_mutex
+    bool _need_sync_dir;
+};
+
+// RaftMetaStorage of a group which saves the meta in a SharedMetaLog.
+//   uri: shared://${meta_dir}?group=${group}
+class SharedRaftMetaStorage : public RaftMetaStorage {
+public:
+    SharedRaftMetaStorage() : _log(NULL), _term(1) {}
+    SharedRaftMetaStorage(const std::string& dir, const std::string& group)
+        : _dir(dir), _group(group), _log(NULL), _term(1) {}
+    virtual ~SharedRaftMetaStorage();
+
+    // init stable storage, check consistency and integrity
+    virtual int init();
+
+    // set current term
+    virtual int set_term(const int64_t term);
+
+    // get current term
+    virtual int64_t get_term();
+
+    // set votefor information
+    virtual int set_votedfor(const PeerId& peer_id);
+
+    // get votefor information
+    virtual int get_votedfor(PeerId* peer_id);
+
+    // set term and peer_id
+    virtual int set_term_and_votedfor(const int64_t term, const PeerId& peer_id);
+
+    RaftMetaStorage* new_instance(const std::string& uri) const;
+
+private:
+    std::string _dir;
+    std::string _group;
+    SharedMetaLog* _log;
+    int64_t _term;
+    PeerId _votedfor;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_SHARED_META_H
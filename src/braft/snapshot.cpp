@@ -17,9 +17,12 @@
 //          Zheng,Pengfei(zhengpengfei@baidu.com)
 //          Xiong,Kai(xiongkai@baidu.com)
 
+#include <algorithm>
+#include <memory>
 #include <butil/time.h>
 #include <butil/string_printf.h>                     // butil::string_appendf
 #include <brpc/uri.h>
+#include <brpc/reloadable_flags.h>
 #include "braft/util.h"
 #include "braft/protobuf_file.h"
 #include "braft/local_storage.pb.h"
@@ -31,11 +34,88 @@
 //#define BRAFT_SNAPSHOT_PATTERN "snapshot_%020ld"
 #define BRAFT_SNAPSHOT_PATTERN "snapshot_%020" PRId64
 #define BRAFT_SNAPSHOT_META_FILE "__raft_snapshot_meta"
+#define BRAFT_DOWNLOAD_PROGRESS_FILE "__raft_download_progress"
 
 namespace braft {
 
 const char* LocalSnapshotStorage::_s_temp_path = "temp";
 
+DEFINE_bool(raft_reuse_last_snapshot_files, true,
+            "Link the files of the last snapshot whose checksums are the same "
+            "as the remote ones instead of downloading them when installing "
+            "a snapshot, even if filter_before_copy_remote is not set");
+BRPC_VALIDATE_GFLAG(raft_reuse_last_snapshot_files, ::brpc::PassValidate);
+
+DEFINE_int32(raft_max_copying_files_when_install_snapshot, 1,
+             "Maximum of the files downloaded at the same time when "
+             "installing a snapshot, all of which go through the snapshot "
+             "throttle");
+BRPC_VALIDATE_GFLAG(raft_max_copying_files_when_install_snapshot,
+                    brpc::PositiveInteger);
+
+DEFINE_int64(raft_snapshot_chunk_size, 0,
+             "Keep the content hashes of the chunks of this size of the "
+             "snapshot files in the meta, with which only the chunks not "
+             "found locally are downloaded when installing a snapshot. "
+             "0 means disabled");
+BRPC_VALIDATE_GFLAG(raft_snapshot_chunk_size, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_resume_snapshot_download, false,
+            "Keep the partly downloaded snapshot across restarts, and resume "
+            "the files from where they were copied if the remote snapshot "
+            "stays the same");
+BRPC_VALIDATE_GFLAG(raft_resume_snapshot_download, ::brpc::PassValidate);
+
+DEFINE_int32(raft_snapshot_download_progress_interval_ms, 1000,
+             "Interval of saving the progress of the files being downloaded "
+             "if raft_resume_snapshot_download is on");
+BRPC_VALIDATE_GFLAG(raft_snapshot_download_progress_interval_ms,
+                    brpc::PositiveInteger);
+
+static bool has_chunk_hashes(const LocalFileMeta& meta) {
+    return meta.chunk_size() > 0 && meta.has_size() &&
+           meta.chunk_hashes_size() ==
+                (meta.size() + meta.chunk_size() - 1) / meta.chunk_size();
+}
+
+// Whether |lhs| and |rhs| are the metas of the same content, which can't be
+// told without a checksum or the chunk hashes
+static bool same_file_content(const LocalFileMeta& lhs,
+                              const LocalFileMeta& rhs) {
+    if (lhs.has_size() && rhs.has_size() && lhs.size() != rhs.size()) {
+        return false;
+    }
+    if (lhs.has_checksum() && rhs.has_checksum()) {
+        return lhs.checksum() == rhs.checksum();
+    }
+    if (!has_chunk_hashes(lhs) || !has_chunk_hashes(rhs) ||
+            lhs.size() != rhs.size() || lhs.chunk_size() != rhs.chunk_size()) {
+        return false;
+    }
+    for (int i = 0; i < lhs.chunk_hashes_size(); ++i) {
+        if (lhs.chunk_hashes(i) != rhs.chunk_hashes(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Create the parent directories of |filename| under |path|
+static bool create_parent_directory(FileSystemAdaptor* fs,
+                                    const std::string& path,
+                                    const std::string& filename,
+                                    butil::File::Error* e) {
+    butil::FilePath sub_path(filename);
+    if (sub_path == sub_path.DirName() || sub_path.DirName().value() == ".") {
+        return true;
+    }
+    if (FLAGS_raft_create_parent_directories) {
+        butil::FilePath sub_dir = butil::FilePath(path).Append(sub_path.DirName());
+        return fs->create_directory(sub_dir.value(), e, true);
+    }
+    return create_sub_directory(path, sub_path.DirName().value(), fs, e);
+}
+
 LocalSnapshotMetaTable::LocalSnapshotMetaTable() {}
 
 LocalSnapshotMetaTable::~LocalSnapshotMetaTable() {}
@@ -176,10 +256,11 @@ int LocalSnapshot::get_file_meta(const std::string& filename,
 
 LocalSnapshotWriter::LocalSnapshotWriter(const std::string& path,
                                          FileSystemAdaptor* fs)
-    : _path(path), _fs(fs) {
+    : _path(path), _fs(fs), _storage(NULL), _last_snapshot(NULL) {
 }
 
 LocalSnapshotWriter::~LocalSnapshotWriter() {
+    CHECK(!_last_snapshot);
 }
 
 int LocalSnapshotWriter::init() {
@@ -246,6 +327,84 @@ int LocalSnapshotWriter::add_file(
     return _meta_table.add_file(filename, meta);
 }
 
+int LocalSnapshotWriter::add_file_from_last_snapshot(
+        const std::string& filename) {
+    if (_storage == NULL) {
+        return -1;
+    }
+    if (_last_snapshot == NULL) {
+        _last_snapshot = _storage->open();
+        if (_last_snapshot == NULL) {
+            return -1;
+        }
+    }
+    LocalFileMeta meta;
+    if (_last_snapshot->get_file_meta(filename, &meta) != 0) {
+        return -1;
+    }
+    if (meta.source() == FILE_SOURCE_LOCAL) {
+        const std::string source_path = _last_snapshot->get_path() + '/'
+                                        + filename;
+        const std::string dest_path = _path + '/' + filename;
+        butil::File::Error e;
+        if (!create_parent_directory(_fs, _path, filename, &e)) {
+            LOG(ERROR) << "Fail to create directory for " << dest_path
+                       << " : " << butil::File::ErrorToString(e);
+            return -1;
+        }
+        _fs->delete_file(dest_path, false);
+        if (!_fs->link(source_path, dest_path)) {
+            PLOG(ERROR) << "Fail to link " << source_path
+                        << " to " << dest_path;
+            return -1;
+        }
+    }
+    return _meta_table.add_file(filename, meta);
+}
+
+void LocalSnapshotWriter::hash_file_chunks(int64_t chunk_size) {
+    std::vector<std::string> files;
+    _meta_table.list_files(&files);
+    for (size_t i = 0; i < files.size(); ++i) {
+        LocalFileMeta meta;
+        CHECK_EQ(0, _meta_table.get_file_meta(files[i], &meta));
+        if (meta.source() != FILE_SOURCE_LOCAL ||
+                (meta.chunk_size() == chunk_size && has_chunk_hashes(meta))) {
+            continue;
+        }
+        // Hashes are optional, just skip the files failed to read
+        const std::string file_path = _path + '/' + files[i];
+        butil::File::Error e;
+        FileAdaptor* file = _fs->open(file_path, O_RDONLY | O_CLOEXEC, &meta, &e);
+        if (!file) {
+            LOG(WARNING) << "Fail to open " << file_path << " : "
+                         << butil::File::ErrorToString(e);
+            continue;
+        }
+        std::unique_ptr<FileAdaptor, DestroyObj<FileAdaptor> > guard(file);
+        LocalFileMeta hashed_meta(meta);
+        hashed_meta.clear_chunk_hashes();
+        int64_t offset = 0;
+        ssize_t nread = 0;
+        do {
+            butil::IOPortal buf;
+            nread = file->read(&buf, offset, chunk_size);
+            if (nread > 0) {
+                hashed_meta.add_chunk_hashes(murmurhash64(buf));
+                offset += nread;
+            }
+        } while (nread == chunk_size);
+        if (nread < 0) {
+            LOG(WARNING) << "Fail to read " << file_path;
+            continue;
+        }
+        hashed_meta.set_size(offset);
+        hashed_meta.set_chunk_size(chunk_size);
+        _meta_table.remove_file(files[i]);
+        _meta_table.add_file(files[i], hashed_meta);
+    }
+}
+
 void LocalSnapshotWriter::list_files(std::vector<std::string> *files) {
     return _meta_table.list_files(files);
 }
@@ -356,11 +515,48 @@ public:
                   bool read_partly,
                   size_t* read_count,
                   bool* is_eof) const {
+        return read_file_throttled(out, filename, offset, max_count,
+                                   read_partly, read_count, is_eof, false);
+    }
+
+    int read_file_segments(butil::IOBuf* out,
+                           const std::string &filename,
+                           off_t offset,
+                           size_t max_count,
+                           bool read_partly,
+                           size_t* read_count,
+                           bool* is_eof) const {
+        return read_file_throttled(out, filename, offset, max_count,
+                                   read_partly, read_count, is_eof, true);
+    }
+
+    int64_t throttle_retry_interval_ms() const {
+        return _snapshot_throttle ? _snapshot_throttle->get_retry_interval_ms()
+                                  : FileReader::throttle_retry_interval_ms();
+    }
+
+private:
+    int read_file_throttled(butil::IOBuf* out,
+                            const std::string &filename,
+                            off_t offset,
+                            size_t max_count,
+                            bool read_partly,
+                            size_t* read_count,
+                            bool* is_eof,
+                            bool skip_holes) const {
         if (filename == BRAFT_SNAPSHOT_META_FILE) {
-            int ret = _meta_table.save_to_iobuf_as_remote(out);
+            butil::IOBuf meta_buf;
+            int ret = _meta_table.save_to_iobuf_as_remote(&meta_buf);
             if (ret == 0) {
-                *read_count = out->size();
+                *read_count = meta_buf.size();
                 *is_eof = true;
+                if (skip_holes) {
+                    FileSegData seg_data;
+                    seg_data.append(meta_buf, 0);
+                    out->swap(seg_data.data());
+                } else {
+                    out->swap(meta_buf);
+                }
             }
             return ret;
         }
@@ -385,8 +581,11 @@ public:
             }
             if (ret == 0) {
                 ret = LocalDirReader::read_file_with_meta(
-                    out, filename, &file_meta, offset, new_max_count, read_count, is_eof);
-                used_count = out->size();
+                    out, filename, &file_meta, offset, new_max_count,
+                    read_count, is_eof, skip_holes);
+                // |out| has the headers of the segments but not the holes
+                // with skip_holes, while the throughput is taken by range
+                used_count = *read_count;
             }
             if ((ret == 0 || ret == EAGAIN) && used_count < (int64_t)new_max_count) {
                 _snapshot_throttle->return_unused_throughput(
@@ -395,10 +594,10 @@ public:
             return ret;
         }
         return LocalDirReader::read_file_with_meta(
-                out, filename, &file_meta, offset, new_max_count, read_count, is_eof);
+                out, filename, &file_meta, offset, new_max_count,
+                read_count, is_eof, skip_holes);
     }
-   
-private:
+
     LocalSnapshotMetaTable _meta_table;
     scoped_refptr<SnapshotThrottle> _snapshot_throttle;
 };
@@ -453,7 +652,7 @@ int LocalSnapshotStorage::init() {
         return -1;
     }
     // delete temp snapshot
-    if (!_filter_before_copy_remote) {
+    if (!_filter_before_copy_remote && !FLAGS_raft_resume_snapshot_download) {
         std::string temp_snapshot_path(_path);
         temp_snapshot_path.append("/");
         temp_snapshot_path.append(_s_temp_path);
@@ -558,6 +757,7 @@ SnapshotWriter* LocalSnapshotStorage::create(bool from_empty) {
         }
 
         writer = new LocalSnapshotWriter(snapshot_path, _fs.get());
+        writer->_storage = this;
         if (writer->init() != 0) {
             LOG(ERROR) << "Fail to init writer, path: " << snapshot_path;
             delete writer;
@@ -574,6 +774,7 @@ SnapshotCopier* LocalSnapshotStorage::start_to_copy_from(const std::string& uri)
     LocalSnapshotCopier* copier = new LocalSnapshotCopier();
     copier->_storage = this;
     copier->_filter_before_copy_remote = _filter_before_copy_remote;
+    copier->_resume_download = FLAGS_raft_resume_snapshot_download;
     copier->_fs = _fs.get();
     copier->_throttle = _snapshot_throttle.get();
     if (copier->init(uri) != 0) {
@@ -614,6 +815,9 @@ int LocalSnapshotStorage::close(SnapshotWriter* writer_base,
         if (0 != ret) {
             break;
         }
+        if (FLAGS_raft_snapshot_chunk_size > 0) {
+            writer->hash_file_chunks(FLAGS_raft_snapshot_chunk_size);
+        }
         ret = writer->sync();
         if (ret != 0) {
             break;
@@ -662,6 +866,10 @@ int LocalSnapshotStorage::close(SnapshotWriter* writer_base,
     if (ret != 0 && !keep_data_on_error) {
         destroy_snapshot(writer->get_path());
     }
+    if (writer->_last_snapshot) {
+        close(writer->_last_snapshot);
+        writer->_last_snapshot = NULL;
+    }
     delete writer;
     return ret != EIO ? 0 : -1;
 }
@@ -725,12 +933,12 @@ LocalSnapshotCopier::LocalSnapshotCopier()
     : _tid(INVALID_BTHREAD)
     , _cancelled(false)
     , _filter_before_copy_remote(false)
+    , _resume_download(false)
     , _fs(NULL)
     , _throttle(NULL)
     , _writer(NULL)
     , _storage(NULL)
     , _reader(NULL)
-    , _cur_session(NULL)
 {}
 
 LocalSnapshotCopier::~LocalSnapshotCopier() {
@@ -755,8 +963,17 @@ void LocalSnapshotCopier::copy() {
         }
         std::vector<std::string> files;
         _remote_snapshot.list_files(&files);
+        std::deque<CopyingFile> copying;
         for (size_t i = 0; i < files.size() && ok(); ++i) {
-            copy_file(files[i]);
+            if ((int)copying.size() >=
+                    FLAGS_raft_max_copying_files_when_install_snapshot) {
+                finish_copying_file(&copying);
+            }
+            start_to_copy_file(files[i], &copying);
+        }
+        // Wait for the files in flight even if some file failed
+        while (!copying.empty()) {
+            finish_copying_file(&copying);
         }
     } while (0);
     if (!ok() && _writer && _writer->ok()) {
@@ -765,10 +982,20 @@ void LocalSnapshotCopier::copy() {
                      << " writer path " << _writer->get_path();
         _writer->set_error(error_code(), error_cstr());
     }
+    if (_writer && _resume_download) {
+        if (ok()) {
+            _fs->delete_file(_writer->get_path() + "/"
+                             BRAFT_DOWNLOAD_PROGRESS_FILE, false);
+        } else {
+            save_download_progress(std::deque<CopyingFile>());
+        }
+    }
     if (_writer) {
         // set_error for copier only when failed to close writer and copier was 
         // ok before this moment 
-        if (_storage->close(_writer, _filter_before_copy_remote) != 0 && ok()) {
+        if (_storage->close(_writer,
+                    _filter_before_copy_remote || _resume_download) != 0
+                && ok()) {
             set_error(EIO, "Fail to close writer");
         }
         _writer = NULL;
@@ -788,11 +1015,11 @@ void LocalSnapshotCopier::load_meta_table() {
     scoped_refptr<RemoteFileCopier::Session> session
             = _copier.start_to_copy_to_iobuf(BRAFT_SNAPSHOT_META_FILE,
                                             &meta_buf, NULL);
-    _cur_session = session.get();
+    _sessions.insert(session.get());
     lck.unlock();
     session->join();
     lck.lock();
-    _cur_session = NULL;
+    _sessions.erase(session.get());
     lck.unlock();
     if (!session->status().ok()) {
         LOG(WARNING) << "Fail to copy meta file : " << session->status();
@@ -830,7 +1057,10 @@ int LocalSnapshotCopier::filter_before_copy(LocalSnapshotWriter* writer,
         if (!remote_meta.has_checksum()) {
             // Redownload file if this file doen't have checksum
             writer->remove_file(filename);
-            to_remove.push_back(filename);
+            // Unless it's copied partly and verified by the chunk hashes
+            if (_partial_files.find(filename) == _partial_files.end()) {
+                to_remove.push_back(filename);
+            }
             continue;
         }
 
@@ -896,14 +1126,21 @@ int LocalSnapshotCopier::filter_before_copy(LocalSnapshotWriter* writer,
 }
 
 void LocalSnapshotCopier::filter() {
-    _writer = (LocalSnapshotWriter*)_storage->create(!_filter_before_copy_remote);
+    _writer = (LocalSnapshotWriter*)_storage->create(
+            !_filter_before_copy_remote && !_resume_download);
     if (_writer == NULL) {
         set_error(EIO, "Fail to create snapshot writer");
         return;
     }
+    if (_resume_download) {
+        load_download_progress();
+    }
 
-    if (_filter_before_copy_remote) {
-        SnapshotReader* reader = _storage->open();
+    SnapshotReader* reader = _storage->open();
+    if (_filter_before_copy_remote || _resume_download ||
+            FLAGS_raft_reuse_last_snapshot_files) {
+        // Only the files of the last snapshot can be reused if the writer
+        // is created from empty
         if (filter_before_copy(_writer, reader) != 0) {
             LOG(WARNING) << "Fail to filter writer before copying"
                             ", path: " << _writer->get_path() 
@@ -911,14 +1148,22 @@ void LocalSnapshotCopier::filter() {
             _writer->set_error(-1, "Fail to filter");
             _storage->close(_writer, false);
             _writer = (LocalSnapshotWriter*)_storage->create(true);
+            _partial_files.clear();
         }
+    }
+    if (_writer != NULL) {
+        // The last snapshot stays until the copied one replaces it
         if (reader) {
-            _storage->close(reader);
-        }
-        if (_writer == NULL) {
-            set_error(EIO, "Fail to create snapshot writer");
-            return;
+            index_snapshot_chunks(reader);
         }
+        index_snapshot_chunks(_writer);
+    }
+    if (reader) {
+        _storage->close(reader);
+    }
+    if (_writer == NULL) {
+        set_error(EIO, "Fail to create snapshot writer");
+        return;
     }
     _writer->save_meta(_remote_snapshot._meta_table.meta());
     if (_writer->sync() != 0) {
@@ -927,58 +1172,105 @@ void LocalSnapshotCopier::filter() {
     }
 }
 
-void LocalSnapshotCopier::copy_file(const std::string& filename) {
+void LocalSnapshotCopier::start_to_copy_file(const std::string& filename,
+                                             std::deque<CopyingFile>* copying) {
     if (_writer->get_file_meta(filename, NULL) == 0) {
         LOG(INFO) << "Skipped downloading " << filename
                   << " path: " << _writer->get_path();
         return;
     }
     std::string file_path = _writer->get_path() + '/' + filename;
-    butil::FilePath sub_path(filename);
-    if (sub_path != sub_path.DirName() && sub_path.DirName().value() != ".") {
-        butil::File::Error e;
-        bool rc = false;
-        if (FLAGS_raft_create_parent_directories) {
-            butil::FilePath sub_dir =
-                    butil::FilePath(_writer->get_path()).Append(sub_path.DirName());
-            rc = _fs->create_directory(sub_dir.value(), &e, true);
-        } else {
-            rc = create_sub_directory(
-                    _writer->get_path(), sub_path.DirName().value(), _fs, &e);
-        }
-        if (!rc) {
-            LOG(ERROR) << "Fail to create directory for " << file_path
-                       << " : " << butil::File::ErrorToString(e);
-            set_error(file_error_to_os_error(e), 
-                      "Fail to create directory");
-        }
+    butil::File::Error e;
+    if (!create_parent_directory(_fs, _writer->get_path(), filename, &e)) {
+        LOG(ERROR) << "Fail to create directory for " << file_path
+                   << " : " << butil::File::ErrorToString(e);
+        set_error(file_error_to_os_error(e), 
+                  "Fail to create directory");
     }
     LocalFileMeta meta;
     _remote_snapshot.get_file_meta(filename, &meta);
+    std::map<std::string, int64_t>::const_iterator
+            partial = _partial_files.find(filename);
+    const int64_t resume_offset =
+            partial != _partial_files.end() ? partial->second : 0;
+    std::vector<std::pair<int64_t, int64_t> > ranges;
+    const bool copy_ranges = resume_offset == 0 && has_chunk_hashes(meta)
+            && !_chunk_index.empty()
+            && copy_local_chunks(file_path, meta, &ranges) == 0;
     std::unique_lock<raft_mutex_t> lck(_mutex);
     if (_cancelled) {
         set_error(ECANCELED, "%s", berror(ECANCELED));
         return;
     }
-    scoped_refptr<RemoteFileCopier::Session> session
-        = _copier.start_to_copy_to_file(filename, file_path, NULL);
+    scoped_refptr<RemoteFileCopier::Session> session;
+    if (resume_offset > 0) {
+        LOG(INFO) << "Resume downloading " << filename << " from offset="
+                  << resume_offset << " path: " << _writer->get_path();
+        session = _copier.start_to_resume_copy_to_file(
+                filename, file_path, resume_offset, NULL);
+    } else if (copy_ranges) {
+        session = _copier.start_to_copy_ranges_to_file(
+                filename, file_path, ranges, NULL);
+    } else {
+        session = _copier.start_to_copy_to_file(filename, file_path, NULL);
+    }
     if (session == NULL) {
         LOG(WARNING) << "Fail to copy " << filename
                      << " path: " << _writer->get_path();
         set_error(-1, "Fail to copy %s", filename.c_str());
         return;
     }
-    _cur_session = session.get();
+    _sessions.insert(session.get());
     lck.unlock();
-    session->join();
-    lck.lock();
-    _cur_session = NULL;
+    copying->push_back(CopyingFile());
+    CopyingFile& file = copying->back();
+    file.filename = filename;
+    file.meta.Swap(&meta);
+    file.session = session;
+}
+
+void LocalSnapshotCopier::finish_copying_file(
+        std::deque<CopyingFile>* copying) {
+    CopyingFile file;
+    file.filename.swap(copying->front().filename);
+    file.meta.Swap(&copying->front().meta);
+    file.session.swap(copying->front().session);
+    copying->pop_front();
+    RemoteFileCopier::Session* session = file.session.get();
+    if (!ok()) {
+        // Don't bother to finish the other files
+        session->cancel();
+    }
+    if (_resume_download) {
+        // Save the progress of the files in flight from time to time, in
+        // case of restart
+        while (session->timed_join(butil::milliseconds_from_now(
+                FLAGS_raft_snapshot_download_progress_interval_ms)) != 0) {
+            std::deque<CopyingFile> in_flight(*copying);
+            in_flight.push_front(file);
+            save_download_progress(in_flight);
+        }
+    } else {
+        session->join();
+    }
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    _sessions.erase(session);
     lck.unlock();
+    if (!session->status().ok() && _resume_download) {
+        const int64_t offset = session->synced_offset();
+        if (offset > 0) {
+            _partial_files[file.filename] = offset;
+        }
+    }
+    if (!ok()) {
+        return;
+    }
     if (!session->status().ok()) {
         set_error(session->status().error_code(), session->status().error_cstr());
         return;
     }
-    if (_writer->add_file(filename, &meta) != 0) {
+    _partial_files.erase(file.filename);
+    if (_writer->add_file(file.filename, &file.meta) != 0) {
         set_error(EIO, "Fail to add file to writer");
         return;
     }
@@ -986,6 +1278,166 @@ void LocalSnapshotCopier::copy_file(const std::string& filename) {
         set_error(EIO, "Fail to sync writer");
         return;
     }
+    index_file_chunks(_writer->get_path(), file.filename, file.meta);
+}
+
+void LocalSnapshotCopier::load_download_progress() {
+    const std::string path = _writer->get_path() + "/"
+                             BRAFT_DOWNLOAD_PROGRESS_FILE;
+    if (!_fs->path_exists(path)) {
+        return;
+    }
+    ProtoBufFile pb_file(path, _fs);
+    LocalDownloadProgressPbMeta pb_meta;
+    if (pb_file.load(&pb_meta) != 0) {
+        LOG(WARNING) << "Fail to load " << path;
+        return;
+    }
+    const SnapshotMeta& remote_meta = _remote_snapshot._meta_table.meta();
+    if (pb_meta.meta().last_included_index() !=
+                remote_meta.last_included_index() ||
+            pb_meta.meta().last_included_term() !=
+                remote_meta.last_included_term()) {
+        LOG(INFO) << "Discard the partly copied files of snapshot index="
+                  << pb_meta.meta().last_included_index()
+                  << " term=" << pb_meta.meta().last_included_term()
+                  << " in " << _writer->get_path();
+        return;
+    }
+    for (int i = 0; i < pb_meta.files_size(); ++i) {
+        const LocalDownloadProgressPbMeta::File& f = pb_meta.files(i);
+        LocalFileMeta remote_file_meta;
+        if (_writer->get_file_meta(f.name(), NULL) == 0 ||
+                _remote_snapshot.get_file_meta(f.name(),
+                                               &remote_file_meta) != 0) {
+            continue;
+        }
+        // The copied content is useless unless the remote file is known to
+        // be the same, otherwise it's downloaded again
+        if (!same_file_content(f.meta(), remote_file_meta)) {
+            LOG(INFO) << "Discard the partly copied file=" << f.name()
+                      << " in " << _writer->get_path()
+                      << " as it can't be verified against the remote one";
+            continue;
+        }
+        butil::File::Error e;
+        std::unique_ptr<FileAdaptor, DestroyObj<FileAdaptor> > file(
+                _fs->open(_writer->get_path() + "/" + f.name(),
+                          O_RDONLY | O_CLOEXEC, NULL, &e));
+        if (!file || file->size() < f.offset()) {
+            continue;
+        }
+        _partial_files[f.name()] = f.offset();
+    }
+}
+
+int LocalSnapshotCopier::save_download_progress(
+        const std::deque<CopyingFile>& copying) {
+    for (size_t i = 0; i < copying.size(); ++i) {
+        const int64_t offset = copying[i].session->synced_offset();
+        if (offset > 0) {
+            _partial_files[copying[i].filename] = offset;
+        }
+    }
+    LocalDownloadProgressPbMeta pb_meta;
+    *pb_meta.mutable_meta() = _remote_snapshot._meta_table.meta();
+    for (std::map<std::string, int64_t>::const_iterator
+            it = _partial_files.begin(); it != _partial_files.end(); ++it) {
+        LocalDownloadProgressPbMeta::File* f = pb_meta.add_files();
+        f->set_name(it->first);
+        f->set_offset(it->second);
+        _remote_snapshot.get_file_meta(it->first, f->mutable_meta());
+    }
+    const std::string path = _writer->get_path() + "/"
+                             BRAFT_DOWNLOAD_PROGRESS_FILE;
+    ProtoBufFile pb_file(path, _fs);
+    if (pb_file.save(&pb_meta, true) != 0) {
+        LOG(WARNING) << "Fail to save " << path;
+        return -1;
+    }
+    return 0;
+}
+
+void LocalSnapshotCopier::index_file_chunks(const std::string& dir,
+                                            const std::string& filename,
+                                            const LocalFileMeta& meta) {
+    if (meta.source() != FILE_SOURCE_LOCAL || !has_chunk_hashes(meta)) {
+        return;
+    }
+    ChunkSource source;
+    source.path = dir + '/' + filename;
+    for (int i = 0; i < meta.chunk_hashes_size(); ++i) {
+        source.offset = i * meta.chunk_size();
+        const int64_t len = std::min(meta.chunk_size(),
+                                     meta.size() - source.offset);
+        _chunk_index.insert(ChunkIndex::value_type(
+                std::make_pair(len, meta.chunk_hashes(i)), source));
+    }
+}
+
+void LocalSnapshotCopier::index_snapshot_chunks(Snapshot* snapshot) {
+    std::vector<std::string> files;
+    snapshot->list_files(&files);
+    for (size_t i = 0; i < files.size(); ++i) {
+        LocalFileMeta meta;
+        if (snapshot->get_file_meta(files[i], &meta) == 0) {
+            index_file_chunks(snapshot->get_path(), files[i], meta);
+        }
+    }
+}
+
+int LocalSnapshotCopier::copy_local_chunks(
+        const std::string& file_path, const LocalFileMeta& meta,
+        std::vector<std::pair<int64_t, int64_t> >* ranges) {
+    butil::File::Error e;
+    FileAdaptor* dest = _fs->open(file_path,
+            O_TRUNC | O_WRONLY | O_CREAT | O_CLOEXEC, NULL, &e);
+    if (!dest) {
+        LOG(WARNING) << "Fail to open " << file_path << " : "
+                     << butil::File::ErrorToString(e);
+        return -1;
+    }
+    std::unique_ptr<FileAdaptor, DestroyObj<FileAdaptor> > dest_guard(dest);
+    std::unique_ptr<FileAdaptor, DestroyObj<FileAdaptor> > source_guard;
+    std::string source_path;
+    int64_t reused_size = 0;
+    for (int i = 0; i < meta.chunk_hashes_size(); ++i) {
+        const int64_t offset = i * meta.chunk_size();
+        const int64_t len = std::min(meta.chunk_size(), meta.size() - offset);
+        ChunkIndex::const_iterator it = _chunk_index.find(
+                std::make_pair(len, meta.chunk_hashes(i)));
+        bool reused = false;
+        if (it != _chunk_index.end()) {
+            if (it->second.path != source_path) {
+                source_path = it->second.path;
+                source_guard.reset(_fs->open(source_path, O_RDONLY | O_CLOEXEC,
+                                             NULL, &e));
+            }
+            butil::IOPortal buf;
+            // Check the content in case the local file has been changed
+            if (source_guard &&
+                    source_guard->read(&buf, it->second.offset, len) == len &&
+                    murmurhash64(buf) == meta.chunk_hashes(i)) {
+                if (dest->write(buf, offset) != len) {
+                    LOG(WARNING) << "Fail to write into " << file_path;
+                    return -1;
+                }
+                reused = true;
+                reused_size += len;
+            }
+        }
+        if (reused) {
+            continue;
+        }
+        if (!ranges->empty() && ranges->back().second == offset) {
+            ranges->back().second = offset + len;
+        } else {
+            ranges->push_back(std::make_pair(offset, offset + len));
+        }
+    }
+    LOG(INFO) << "Reused " << reused_size << " of " << meta.size()
+              << " bytes of " << file_path << " from the local chunks";
+    return 0;
 }
 
 void LocalSnapshotCopier::start() {
@@ -1006,8 +1458,9 @@ void LocalSnapshotCopier::cancel() {
         return;
     }
     _cancelled = true;
-    if (_cur_session) {
-        _cur_session->cancel();
+    for (std::set<RemoteFileCopier::Session*>::iterator
+            it = _sessions.begin(); it != _sessions.end(); ++it) {
+        (*it)->cancel();
     }
 }
 
@@ -21,6 +21,8 @@
 #define BRAFT_RAFT_SNAPSHOT_H
 
 #include <string>
+#include <deque>
+#include <set>
 #include "braft/storage.h"
 #include "braft/macros.h"
 #include "braft/local_file_meta.pb.h"
@@ -58,6 +60,7 @@ private:
     SnapshotMeta _meta;
 };
 
+class LocalSnapshotStorage;
 class LocalSnapshotWriter : public SnapshotWriter {
 friend class LocalSnapshotStorage;
 public:
@@ -73,6 +76,13 @@ public:
     // Remove a file from the snapshot, it doesn't guarantees that the real file
     // would be removed from the storage.
     virtual int remove_file(const std::string& filename);
+    // Hardlink the file of the last snapshot into this snapshot and copy its
+    // meta, or only copy the meta if the file is a reference. The linked
+    // file shares the data with the last snapshot, so it must not be
+    // modified in place.
+    // Returns 0 on success, -1 if the last snapshot doesn't have this file or
+    // fails to link it.
+    virtual int add_file_from_last_snapshot(const std::string& filename);
     // List all the existing files in the Snapshot currently
     virtual void list_files(std::vector<std::string> *files);
 
@@ -83,6 +93,9 @@ public:
     int sync();
     FileSystemAdaptor* file_system() { return _fs.get(); }
 private:
+    // Compute the content hashes of the chunks of the local files which
+    // don't have ones of |chunk_size| yet
+    void hash_file_chunks(int64_t chunk_size);
     // Users shouldn't create LocalSnapshotWriter Directly
     LocalSnapshotWriter(const std::string& path, 
                         FileSystemAdaptor* fs);
@@ -91,6 +104,10 @@ private:
     std::string _path;
     LocalSnapshotMetaTable _meta_table;
     scoped_refptr<FileSystemAdaptor> _fs;
+    LocalSnapshotStorage* _storage;
+    // Opened at the first add_file_from_last_snapshot and closed along with
+    // the writer, which keeps the last snapshot from being destroyed
+    SnapshotReader* _last_snapshot;
 };
 
 class LocalSnapshotReader: public SnapshotReader {
@@ -142,7 +159,6 @@ private:
     LocalSnapshotMetaTable _meta_table;
 };
 
-class LocalSnapshotStorage;
 class LocalSnapshotCopier : public SnapshotCopier {
 friend class LocalSnapshotStorage;
 public:
@@ -160,18 +176,51 @@ private:
     int filter_before_copy(LocalSnapshotWriter* writer, 
                            SnapshotReader* last_snapshot);
     void filter();
-    void copy_file(const std::string& filename);
+    // A file being downloaded
+    struct CopyingFile {
+        std::string filename;
+        LocalFileMeta meta;
+        scoped_refptr<RemoteFileCopier::Session> session;
+    };
+    void start_to_copy_file(const std::string& filename,
+                            std::deque<CopyingFile>* copying);
+    // Wait for the first file of |copying| and pop it
+    void finish_copying_file(std::deque<CopyingFile>* copying);
+    // Load the offsets of the partly copied files of the same remote
+    // snapshot from the writer
+    void load_download_progress();
+    // Record the offsets of the files in |copying| and save them into the
+    // writer
+    int save_download_progress(const std::deque<CopyingFile>& copying);
+    // Local chunks indexed by their length and content hash
+    struct ChunkSource {
+        std::string path;
+        int64_t offset;
+    };
+    typedef std::map<std::pair<int64_t, uint64_t>, ChunkSource> ChunkIndex;
+    void index_file_chunks(const std::string& dir, const std::string& filename,
+                           const LocalFileMeta& meta);
+    void index_snapshot_chunks(Snapshot* snapshot);
+    // Write the chunks of the file which are found locally into |file_path|
+    // and put the ranges to download into |ranges|
+    int copy_local_chunks(const std::string& file_path,
+                          const LocalFileMeta& meta,
+                          std::vector<std::pair<int64_t, int64_t> >* ranges);
 
     raft_mutex_t _mutex;
     bthread_t _tid;
     bool _cancelled;
     bool _filter_before_copy_remote;
+    bool _resume_download;
     FileSystemAdaptor* _fs;
     SnapshotThrottle* _throttle;
     LocalSnapshotWriter* _writer;
     LocalSnapshotStorage* _storage;
     SnapshotReader* _reader;
-    RemoteFileCopier::Session* _cur_session;
+    std::set<RemoteFileCopier::Session*> _sessions;
+    ChunkIndex _chunk_index;
+    // Files copied partly, from which the downloading is resumed
+    std::map<std::string, int64_t> _partial_files;
     LocalSnapshot _remote_snapshot;
     RemoteFileCopier _copier;
 };
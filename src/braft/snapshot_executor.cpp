@@ -83,6 +83,7 @@ SnapshotExecutor::SnapshotExecutor()
     , _saving_snapshot(false)
     , _loading_snapshot(false)
     , _stopped(false)
+    , _witness(false)
     , _snapshot_storage(NULL)
     , _cur_copier(NULL)
     , _fsm_caller(NULL)
@@ -91,6 +92,7 @@ SnapshotExecutor::SnapshotExecutor()
     , _downloading_snapshot(NULL)
     , _running_jobs(0)
     , _snapshot_throttle(NULL)
+    , _donor_reader(NULL)
 {
 }
 
@@ -101,6 +103,7 @@ SnapshotExecutor::~SnapshotExecutor() {
     CHECK(!_cur_copier);
     CHECK(!_loading_snapshot);
     CHECK(!_downloading_snapshot.load(butil::memory_order_relaxed));
+    CHECK(!_donor_reader);
     if (_snapshot_storage) {
         delete _snapshot_storage;
     }
@@ -337,6 +340,7 @@ int SnapshotExecutor::init(const SnapshotExecutorOptions& options) {
     _node = options.node;
     _term = options.init_term;
     _usercode_in_pthread = options.usercode_in_pthread;
+    _witness = options.witness;
 
     _snapshot_storage = SnapshotStorage::create(options.uri);
     if (!_snapshot_storage) {
@@ -390,6 +394,9 @@ void SnapshotExecutor::install_snapshot(brpc::Controller* cntl,
                                         const InstallSnapshotRequest* request,
                                         InstallSnapshotResponse* response,
                                         google::protobuf::Closure* done) {
+    if (_witness) {
+        return install_witness_snapshot(cntl, request, response, done);
+    }
     int ret = 0;
     brpc::ClosureGuard done_guard(done);
     SnapshotMeta meta = request->meta();
@@ -444,6 +451,34 @@ void SnapshotExecutor::load_downloading_snapshot(DownloadingSnapshot* ds,
     brpc::ClosureGuard done_guard(ds->done);
     CHECK(_cur_copier);
     SnapshotReader* reader = _cur_copier->get_reader();
+    if (!_cur_copier->ok() && _cur_copier->error_code() != ECANCELED
+            && !ds->fallen_back && ds->request->has_fallback_uri()) {
+        // Copy the snapshot of the leader instead of the donor's
+        LOG(WARNING) << "Fail to copy snapshot from " << ds->request->uri()
+                     << " : " << _cur_copier->error_cstr()
+                     << ", fall back to " << ds->request->fallback_uri();
+        if (reader) {
+            _snapshot_storage->close(reader);
+        }
+        _snapshot_storage->close(_cur_copier);
+        _cur_copier = _snapshot_storage->start_to_copy_from(
+                ds->request->fallback_uri());
+        if (_cur_copier) {
+            ds->fallen_back = true;
+            const SnapshotMeta fallback_meta = ds->request->fallback_meta();
+            lck.unlock();
+            _cur_copier->join();
+            ds_guard.release();
+            done_guard.release();
+            return load_downloading_snapshot(ds, fallback_meta);
+        }
+        _downloading_snapshot.store(NULL, butil::memory_order_relaxed);
+        lck.unlock();
+        ds->cntl->SetFailed(EINVAL, "Fail to copy from %s",
+                            ds->request->fallback_uri().c_str());
+        _running_jobs.signal();
+        return;
+    }
     if (!_cur_copier->ok()) {
         if (_cur_copier->error_code() == EIO) {
             report_error(_cur_copier->error_code(), 
@@ -493,6 +528,71 @@ void SnapshotExecutor::load_downloading_snapshot(DownloadingSnapshot* ds,
     }
 }
 
+void SnapshotExecutor::install_witness_snapshot(
+        brpc::Controller* cntl, const InstallSnapshotRequest* request,
+        InstallSnapshotResponse* response, google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    const SnapshotMeta& meta = request->meta();
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    if (_stopped) {
+        cntl->SetFailed(EHOSTDOWN, "Node is stopped");
+        return;
+    }
+    if (request->term() != _term) {
+        response->set_success(false);
+        response->set_term(_term);
+        return;
+    }
+    response->set_term(_term);
+    if (meta.last_included_index() <= _last_snapshot_index) {
+        response->set_success(true);
+        return;
+    }
+    if (_saving_snapshot
+            || _downloading_snapshot.load(butil::memory_order_relaxed)) {
+        cntl->SetFailed(EBUSY, "Is saving or installing snapshot");
+        return;
+    }
+    // A witness has no data of the state machine, so there is nothing to
+    // download and the snapshot is made of the meta from the leader.
+    SnapshotWriter* writer = _snapshot_storage->create();
+    if (!writer) {
+        lck.unlock();
+        cntl->SetFailed(EIO, "Fail to create writer");
+        report_error(EIO, "Fail to create SnapshotWriter");
+        return;
+    }
+    if (writer->save_meta(meta) != 0) {
+        writer->set_error(EIO, "Fail to save snapshot meta");
+    }
+    SnapshotReader* reader = NULL;
+    if (_snapshot_storage->close(writer) != 0
+            || (reader = _snapshot_storage->open()) == NULL) {
+        lck.unlock();
+        cntl->SetFailed(EIO, "Fail to save snapshot meta");
+        report_error(EIO, "Fail to save snapshot meta");
+        return;
+    }
+    DownloadingSnapshot* ds = new DownloadingSnapshot;
+    ds->cntl = cntl;
+    ds->done = done_guard.release();
+    ds->response = response;
+    ds->request = request;
+    // The owner of ds is on_snapshot_load_done
+    _downloading_snapshot.store(ds, butil::memory_order_relaxed);
+    _loading_snapshot = true;
+    _loading_snapshot_meta = meta;
+    _running_jobs.add_count(1);
+    lck.unlock();
+    InstallSnapshotDone* install_snapshot_done =
+            new InstallSnapshotDone(this, reader);
+    if (_fsm_caller->on_snapshot_load(install_snapshot_done) != 0) {
+        LOG(WARNING) << "node " << _node->node_id() << " fail to call on_snapshot_load";
+        install_snapshot_done->status().set_error(EHOSTDOWN, "This raft node is down");
+        install_snapshot_done->Run();
+    }
+}
+
 int SnapshotExecutor::register_downloading_snapshot(DownloadingSnapshot* ds) {
     std::unique_lock<raft_mutex_t> lck(_mutex);
     if (_stopped) {
@@ -550,6 +650,7 @@ int SnapshotExecutor::register_downloading_snapshot(DownloadingSnapshot* ds) {
         // this RPC.
         saved = *m;
         *m = *ds;
+        m->fallen_back = saved.fallen_back;
         rc = 1;
     } else if (m->request->meta().last_included_index() 
             > ds->request->meta().last_included_index()) {
@@ -617,6 +718,15 @@ void SnapshotExecutor::report_error(int error_code, const char* fmt, ...) {
     _fsm_caller->on_error(e);
 }
 
+void SnapshotExecutor::get_status(int64_t* last_snapshot_index,
+                                  bool* saving_snapshot,
+                                  bool* installing_snapshot) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    *last_snapshot_index = _last_snapshot_index;
+    *saving_snapshot = _saving_snapshot;
+    *installing_snapshot = is_installing_snapshot();
+}
+
 void SnapshotExecutor::describe(std::ostream&os, bool use_html) {
     SnapshotMeta meta;
     InstallSnapshotRequest request;
@@ -663,10 +773,53 @@ void SnapshotExecutor::shutdown() {
     std::unique_lock<raft_mutex_t> lck(_mutex);
     const int64_t saved_term = _term;
     _stopped = true;
+    close_donor_reader();
     lck.unlock();
     interrupt_downloading_snapshot(saved_term);
 }
 
+int SnapshotExecutor::get_snapshot_uri(SnapshotMeta* meta, std::string* uri) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_stopped) {
+        return EPERM;
+    }
+    if (_witness) {
+        // The snapshots of a witness have no files
+        return ENOENT;
+    }
+    if (_donor_reader &&
+            _donor_meta.last_included_index() != _last_snapshot_index) {
+        close_donor_reader();
+    }
+    if (!_donor_reader) {
+        SnapshotReader* reader = _snapshot_storage->open();
+        if (!reader) {
+            return ENOENT;
+        }
+        if (reader->load_meta(&_donor_meta) != 0) {
+            _snapshot_storage->close(reader);
+            return EIO;
+        }
+        _donor_uri = reader->generate_uri_for_copy();
+        if (_donor_uri.empty()) {
+            _snapshot_storage->close(reader);
+            return EAGAIN;
+        }
+        _donor_reader = reader;
+    }
+    *meta = _donor_meta;
+    *uri = _donor_uri;
+    return 0;
+}
+
+void SnapshotExecutor::close_donor_reader() {
+    if (_donor_reader) {
+        _snapshot_storage->close(_donor_reader);
+        _donor_reader = NULL;
+        _donor_uri.clear();
+    }
+}
+
 void SnapshotExecutor::join() {
     // Wait until all the running jobs finishes
     _running_jobs.wait();
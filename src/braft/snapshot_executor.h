@@ -44,6 +44,8 @@ struct SnapshotExecutorOptions {
     butil::EndPoint addr;
     bool filter_before_copy_remote;
     bool usercode_in_pthread;
+    // Snapshots from the leader carry the meta only
+    bool witness;
     scoped_refptr<FileSystemAdaptor> file_system_adaptor;
     scoped_refptr<SnapshotThrottle> snapshot_throttle;
 };
@@ -107,8 +109,19 @@ public:
     // Return the backing snapshot storage
     SnapshotStorage* snapshot_storage() { return _snapshot_storage; }
 
+    // Get the meta and the URI of the last snapshot for the leader to let
+    // another follower copy it from this node. The reader of the snapshot is
+    // kept open until a newer one is asked for or this executor shuts down.
+    // Returns 0 on success, ENOENT if there's no snapshot, the error otherwise
+    int get_snapshot_uri(SnapshotMeta* meta, std::string* uri);
+
     void describe(std::ostream& os, bool use_html);
 
+    // Get the index of the last snapshot and whether a snapshot is being
+    // saved or installed
+    void get_status(int64_t* last_snapshot_index, bool* saving_snapshot,
+                    bool* installing_snapshot);
+
     // Shutdown the SnapshotExecutor and all the following jobs would be refused
     void shutdown();
 
@@ -127,10 +140,13 @@ friend class InstallSnapshotDone;
                               SnapshotWriter* writer);
 
     struct DownloadingSnapshot {
+        DownloadingSnapshot() : fallen_back(false) {}
         const InstallSnapshotRequest* request;
         InstallSnapshotResponse* response;
         brpc::Controller* cntl;
         google::protobuf::Closure* done;
+        // Whether it's copying the fallback snapshot of the leader
+        bool fallen_back;
     };
 
     int register_downloading_snapshot(DownloadingSnapshot* ds);
@@ -139,7 +155,12 @@ friend class InstallSnapshotDone;
             SnapshotMeta* meta);
     void load_downloading_snapshot(DownloadingSnapshot* ds,
                                   const SnapshotMeta& meta);
+    void install_witness_snapshot(brpc::Controller* cntl,
+                                  const InstallSnapshotRequest* request,
+                                  InstallSnapshotResponse* response,
+                                  google::protobuf::Closure* done);
     void report_error(int error_code, const char* fmt, ...);
+    void close_donor_reader();
 
     raft_mutex_t _mutex;
     int64_t _last_snapshot_term;
@@ -149,6 +170,7 @@ friend class InstallSnapshotDone;
     bool _loading_snapshot;
     bool _stopped;
     bool _usercode_in_pthread;
+    bool _witness;
     SnapshotStorage* _snapshot_storage;
     SnapshotCopier* _cur_copier;
     FSMCaller* _fsm_caller;
@@ -163,6 +185,10 @@ friend class InstallSnapshotDone;
     SnapshotMeta _loading_snapshot_meta;
     bthread::CountdownEvent _running_jobs;
     scoped_refptr<SnapshotThrottle> _snapshot_throttle;
+    // The snapshot copied by the other followers from this node
+    SnapshotReader* _donor_reader;
+    SnapshotMeta _donor_meta;
+    std::string _donor_uri;
 };
 
 inline SnapshotExecutorOptions::SnapshotExecutorOptions() 
@@ -172,6 +198,7 @@ inline SnapshotExecutorOptions::SnapshotExecutorOptions()
     , init_term(0)
     , filter_before_copy_remote(false)
     , usercode_in_pthread(false)
+    , witness(false)
 {}
 
 }  //  namespace braft
@@ -0,0 +1,126 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/snapshot_scheduler.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <butil/logging.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>
+
+namespace braft {
+
+DEFINE_int32(raft_max_concurrent_snapshots_per_disk, 0,
+             "Maximum of the snapshots triggered by the nodes themselves "
+             "which are saved on the same disk at the same time, the others "
+             "wait until these are done. 0 means unlimited");
+BRPC_VALIDATE_GFLAG(raft_max_concurrent_snapshots_per_disk,
+                    brpc::NonNegativeInteger);
+
+static bvar::Adder<int64_t> g_waiting_snapshots("raft_waiting_snapshots");
+
+static pthread_once_t g_snapshot_scheduler_once = PTHREAD_ONCE_INIT;
+static SnapshotScheduler* g_snapshot_scheduler = NULL;
+
+SnapshotScheduler* SnapshotScheduler::get_instance() {
+    struct Creator {
+        static void create() {
+            g_snapshot_scheduler = new SnapshotScheduler;
+        }
+    };
+    pthread_once(&g_snapshot_scheduler_once, Creator::create);
+    return g_snapshot_scheduler;
+}
+
+uint64_t SnapshotScheduler::disk_of(const std::string& snapshot_uri) {
+    // ${protocol}://${path}, the path of the local snapshot storage
+    std::string path = snapshot_uri;
+    const size_t pos = path.find("://");
+    if (pos != std::string::npos) {
+        path.erase(0, pos + 3);
+    }
+    const size_t query_pos = path.find('?');
+    if (query_pos != std::string::npos) {
+        path.erase(query_pos);
+    }
+    if (path.empty()) {
+        return 0;
+    }
+    // The storage might not be created yet, which will be on the device of
+    // its nearest existing ancestor
+    struct stat st;
+    while (stat(path.c_str(), &st) != 0) {
+        if (path == "." || path == "/") {
+            return 0;
+        }
+        const size_t slash = path.find_last_of('/');
+        if (slash == std::string::npos) {
+            path = ".";
+        } else if (slash == 0) {
+            path = "/";
+        } else {
+            path.erase(slash);
+        }
+    }
+    return st.st_dev;
+}
+
+void SnapshotScheduler::run(const Task& task) {
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, task.fn, task.arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        task.fn(task.arg);
+    }
+}
+
+void SnapshotScheduler::schedule(uint64_t disk, Callback fn, void* arg) {
+    Task task;
+    task.fn = fn;
+    task.arg = arg;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        Disk& d = _disks[disk];
+        const int max_running = FLAGS_raft_max_concurrent_snapshots_per_disk;
+        if (max_running > 0 && d.running >= max_running) {
+            d.waiting.push_back(task);
+            g_waiting_snapshots << 1;
+            return;
+        }
+        ++d.running;
+    }
+    run(task);
+}
+
+void SnapshotScheduler::on_finished(uint64_t disk) {
+    Task task;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        Disk& d = _disks[disk];
+        --d.running;
+        const int max_running = FLAGS_raft_max_concurrent_snapshots_per_disk;
+        if (d.waiting.empty() ||
+                (max_running > 0 && d.running >= max_running)) {
+            return;
+        }
+        task = d.waiting.front();
+        d.waiting.pop_front();
+        ++d.running;
+    }
+    g_waiting_snapshots << -1;
+    run(task);
+}
+
+}  //  namespace braft
@@ -0,0 +1,73 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_SNAPSHOT_SCHEDULER_H
+#define BRAFT_SNAPSHOT_SCHEDULER_H
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <gflags/gflags.h>
+#include <butil/macros.h>
+#include "braft/macros.h"
+
+namespace braft {
+
+DECLARE_int32(raft_max_concurrent_snapshots_per_disk);
+
+// Process-wide scheduler of the snapshots which the nodes trigger by
+// themselves. At most raft_max_concurrent_snapshots_per_disk of them are
+// saved on the same disk at the same time, and the others wait in order, so
+// that the snapshots of lots of groups don't saturate the disk together.
+class SnapshotScheduler {
+public:
+    typedef void* (*Callback)(void*);
+
+    static SnapshotScheduler* get_instance();
+
+    // Get the disk where the snapshots of |snapshot_uri| are, or the nearest
+    // existing ancestor of the path if it's not created yet, which is 0 if
+    // unknown
+    static uint64_t disk_of(const std::string& snapshot_uri);
+
+    // Run |fn|(|arg|) in a new bthread once the snapshots being saved on
+    // |disk| are below the limit. on_finished(|disk|) must be called once the
+    // snapshot started by |fn| is done
+    void schedule(uint64_t disk, Callback fn, void* arg);
+
+    void on_finished(uint64_t disk);
+
+private:
+    SnapshotScheduler() {}
+    DISALLOW_COPY_AND_ASSIGN(SnapshotScheduler);
+
+    struct Task {
+        Callback fn;
+        void* arg;
+    };
+    struct Disk {
+        Disk() : running(0) {}
+        int running;
+        std::deque<Task> waiting;
+    };
+    static void run(const Task& task);
+
+    raft_mutex_t _mutex;
+    std::map<uint64_t, Disk> _disks;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_SNAPSHOT_SCHEDULER_H
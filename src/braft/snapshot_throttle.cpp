@@ -14,10 +14,12 @@
 
 // Authors: Xiong,Kai(xiongkai@baidu.com)
 
+#include <pthread.h>
 #include <butil/time.h>
 #include <gflags/gflags.h>
 #include <brpc/reloadable_flags.h>
 #include "braft/snapshot_throttle.h"
+#include "braft/log_manager.h"
 #include "braft/util.h"
 
 namespace braft {
@@ -34,6 +36,24 @@ DEFINE_int32(raft_max_install_snapshot_tasks_num, 1000,
 BRPC_VALIDATE_GFLAG(raft_max_install_snapshot_tasks_num, 
                     brpc::PositiveInteger);
 
+DEFINE_int64(raft_adaptive_throttle_target_latency_us, 10 * 1000,
+             "The adaptive snapshot throttle halves its throughput when the "
+             "average latency of appending entries to the log storages "
+             "exceeds this value");
+BRPC_VALIDATE_GFLAG(raft_adaptive_throttle_target_latency_us,
+                    brpc::PositiveInteger);
+DEFINE_int64(raft_adaptive_throttle_min_mb, 10,
+             "Minimal throughput per second of the process-wide adaptive "
+             "snapshot throttle, which takes effect when it's used for the "
+             "first time");
+DEFINE_int64(raft_adaptive_throttle_max_mb, 200,
+             "Maximal throughput per second of the disk shared by the "
+             "foreground writes and the process-wide adaptive snapshot "
+             "throttle, which takes effect when it's used for the first time");
+DEFINE_int32(raft_adaptive_throttle_check_cycle, 10,
+             "Check cycles per second of the process-wide adaptive snapshot "
+             "throttle, which takes effect when it's used for the first time");
+
 ThroughputSnapshotThrottle::ThroughputSnapshotThrottle(
         int64_t throttle_throughput_bytes, int64_t check_cycle) 
     : _throttle_throughput_bytes(throttle_throughput_bytes)
@@ -125,4 +145,125 @@ void ThroughputSnapshotThrottle::return_unused_throughput(
             _cur_throughput_bytes - (acquired - consumed), int64_t(0));
 }
 
+static pthread_once_t g_adaptive_throttle_once = PTHREAD_ONCE_INIT;
+static AdaptiveSnapshotThrottle* g_adaptive_throttle = NULL;
+
+AdaptiveSnapshotThrottle* AdaptiveSnapshotThrottle::get_instance() {
+    struct Creator {
+        static void create() {
+            const int64_t min_bytes =
+                    FLAGS_raft_adaptive_throttle_min_mb * 1024 * 1024;
+            g_adaptive_throttle = new AdaptiveSnapshotThrottle(
+                    min_bytes,
+                    std::max(min_bytes,
+                             FLAGS_raft_adaptive_throttle_max_mb * 1024 * 1024),
+                    std::max(FLAGS_raft_adaptive_throttle_check_cycle, 1));
+            // Never destroyed
+            g_adaptive_throttle->AddRef();
+        }
+    };
+    pthread_once(&g_adaptive_throttle_once, Creator::create);
+    return g_adaptive_throttle;
+}
+
+AdaptiveSnapshotThrottle::AdaptiveSnapshotThrottle(
+        int64_t min_throughput_bytes, int64_t max_throughput_bytes,
+        int64_t check_cycle)
+    : _min_throughput_bytes(min_throughput_bytes)
+    , _max_throughput_bytes(max_throughput_bytes)
+    , _check_cycle(check_cycle)
+    , _throughput_bytes(min_throughput_bytes)
+    , _tokens(0)
+    , _last_refill_time_us(butil::cpuwide_time_us())
+    , _last_adjust_time_us(_last_refill_time_us)
+    , _task_num(0)
+    , _snapshot_task_num(0)
+{}
+
+AdaptiveSnapshotThrottle::~AdaptiveSnapshotThrottle() {}
+
+int64_t AdaptiveSnapshotThrottle::get_throughput() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _throughput_bytes;
+}
+
+void AdaptiveSnapshotThrottle::adjust_throughput(int64_t now_us) {
+    if (now_us - _last_adjust_time_us < 1000 * 1000) {
+        return;
+    }
+    _last_adjust_time_us = now_us;
+    const int64_t latency_us = storage_append_entries_latency_us(1);
+    const int64_t foreground_bytes = storage_append_entries_bytes_second(1);
+    if (latency_us > FLAGS_raft_adaptive_throttle_target_latency_us) {
+        _throughput_bytes /= 2;
+    } else {
+        _throughput_bytes += _max_throughput_bytes / 10;
+    }
+    // Leave the room for the foreground writes
+    const int64_t ceiling = std::max(_min_throughput_bytes,
+                                     _max_throughput_bytes - foreground_bytes);
+    _throughput_bytes = std::min(std::max(_throughput_bytes,
+                                          _min_throughput_bytes), ceiling);
+}
+
+void AdaptiveSnapshotThrottle::refill_tokens(int64_t now_us) {
+    // Tokens of at most a cycle are kept
+    const int64_t elapsed_us = std::min(now_us - _last_refill_time_us,
+                                        int64_t(1000 * 1000) / _check_cycle);
+    _last_refill_time_us = now_us;
+    _tokens = std::min(_tokens + _throughput_bytes * elapsed_us / (1000 * 1000),
+                       tokens_per_cycle());
+}
+
+size_t AdaptiveSnapshotThrottle::throttled_by_throughput(int64_t bytes) {
+    const int64_t now = butil::cpuwide_time_us();
+    BAIDU_SCOPED_LOCK(_mutex);
+    adjust_throughput(now);
+    refill_tokens(now);
+    // Each task takes its share of a cycle at most
+    const int64_t share = std::max(tokens_per_cycle() / std::max(_task_num, 1),
+                                   int64_t(1));
+    const int64_t available = std::max(
+            std::min(std::min(bytes, _tokens), share), int64_t(0));
+    _tokens -= available;
+    return available;
+}
+
+bool AdaptiveSnapshotThrottle::add_one_more_task(bool is_leader) {
+    const int task_num_threshold = FLAGS_raft_max_install_snapshot_tasks_num;
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    // Don't limit leader, let follower do it
+    if (!is_leader) {
+        if (_snapshot_task_num >= task_num_threshold) {
+            const int saved_task_num = _snapshot_task_num;
+            lck.unlock();
+            LOG(WARNING) << "Fail to add one more task when current task num is: "
+                         << saved_task_num << ", task num threshold: "
+                         << task_num_threshold;
+            return false;
+        }
+        ++_snapshot_task_num;
+    }
+    ++_task_num;
+    return true;
+}
+
+void AdaptiveSnapshotThrottle::finish_one_task(bool is_leader) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (!is_leader) {
+        --_snapshot_task_num;
+        CHECK_GE(_snapshot_task_num, 0);
+    }
+    --_task_num;
+    CHECK_GE(_task_num, 0);
+}
+
+void AdaptiveSnapshotThrottle::return_unused_throughput(
+            int64_t acquired, int64_t consumed, int64_t elaspe_time_us) {
+    (void)elaspe_time_us;
+    BAIDU_SCOPED_LOCK(_mutex);
+    _tokens = std::min(_tokens + std::max(acquired - consumed, int64_t(0)),
+                       tokens_per_cycle());
+}
+
 }  //  namespace braft
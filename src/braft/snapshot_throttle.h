@@ -75,6 +75,53 @@ private:
     raft_mutex_t _mutex;
 };
 
+// SnapshotThrottle whose throughput adapts to the foreground writes, which
+// is meant to be shared by all the nodes of a process. The tokens are refilled
+// at a rate which is halved when the latency of appending entries to the log
+// storages exceeds raft_adaptive_throttle_target_latency_us, and increased
+// step by step otherwise, within [min_throughput_bytes, max_throughput_bytes
+// - bytes appended to the log storages per second]. The tokens of a cycle are
+// shared fairly by the running install_snapshot tasks.
+class AdaptiveSnapshotThrottle : public SnapshotThrottle {
+public:
+    AdaptiveSnapshotThrottle(int64_t min_throughput_bytes,
+                             int64_t max_throughput_bytes,
+                             int64_t check_cycle);
+    // The throttle of this process configured by the
+    // raft_adaptive_throttle_* flags
+    static AdaptiveSnapshotThrottle* get_instance();
+    int64_t get_throughput();
+    size_t throttled_by_throughput(int64_t bytes);
+    bool add_one_more_task(bool is_leader);
+    void finish_one_task(bool is_leader);
+    int64_t get_retry_interval_ms() { return 1000 / _check_cycle + 1;}
+    void return_unused_throughput(
+            int64_t acquired, int64_t consumed, int64_t elaspe_time_us);
+
+private:
+    ~AdaptiveSnapshotThrottle();
+    // Adjust the throughput with the feedback of the foreground writes once
+    // a second, called with _mutex held
+    void adjust_throughput(int64_t now_us);
+    // Called with _mutex held
+    void refill_tokens(int64_t now_us);
+    int64_t tokens_per_cycle() const { return _throughput_bytes / _check_cycle; }
+
+    const int64_t _min_throughput_bytes;
+    const int64_t _max_throughput_bytes;
+    const int64_t _check_cycle;
+    // current throughput, bytes per second
+    int64_t _throughput_bytes;
+    int64_t _tokens;
+    int64_t _last_refill_time_us;
+    int64_t _last_adjust_time_us;
+    // the num of the tasks sharing the tokens, including the leaders'
+    int _task_num;
+    // the num of the followers' tasks doing install_snapshot
+    int _snapshot_task_num;
+    raft_mutex_t _mutex;
+};
+
 inline int64_t caculate_check_time_us(int64_t current_time_us, 
         int64_t check_cycle) {
     int64_t base_aligning_time_us = 1000 * 1000 / check_cycle;
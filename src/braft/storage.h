@@ -58,6 +58,27 @@ public:
     // get logentry by index
     virtual LogEntry* get_entry(const int64_t index) = 0;
 
+    // get at most |max_count| entries starting from |first_index|, stop
+    // before the data of the got entries exceeds |max_bytes| (at least one
+    // entry is got if exists). Entries are appended to |entries| with a
+    // reference added, return the number of the got entries, -1 on error
+    virtual int get_entries(const int64_t first_index, size_t max_count,
+                            size_t max_bytes, std::vector<LogEntry*>* entries) {
+        const size_t saved_size = entries->size();
+        size_t bytes = 0;
+        for (int64_t index = first_index;
+                (size_t)(index - first_index) < max_count && bytes < max_bytes;
+                ++index) {
+            LogEntry* entry = get_entry(index);
+            if (entry == NULL) {
+                break;
+            }
+            bytes += entry->data.size();
+            entries->push_back(entry);
+        }
+        return entries->size() - saved_size;
+    }
+
     // get logentry's term by index
     virtual int64_t get_term(const int64_t index) = 0;
 
@@ -67,6 +88,28 @@ public:
     // append entries to log, return append success number
     virtual int append_entries(const std::vector<LogEntry*>& entries) = 0;
 
+    // append entries to log without waiting for them to be durable, which
+    // are made durable by the following sync_entries(), return append success
+    // number
+    virtual int append_entries_nosync(const std::vector<LogEntry*>& entries) {
+        return append_entries(entries);
+    }
+
+    // make the entries appended by append_entries_nosync durable. It's called
+    // in another thread and might run concurrently with the appending of the
+    // following entries
+    virtual int sync_entries() { return 0; }
+
+    // Data bytes of the logs the storage is able to hold, 0 means unlimited.
+    // The node takes a snapshot once the logs appended since the last one
+    // reach it, checked every raft_snapshot_policy_check_interval_ms, and
+    // rejects new tasks with EBUSY while used_bytes() reaches it
+    virtual int64_t capacity_bytes() { return 0; }
+
+    // Data bytes of the logs in the storage, only used if capacity_bytes()
+    // is not 0
+    virtual int64_t used_bytes() { return 0; }
+
     // delete logs from storage's head, [first_log_index, first_index_kept) will be discarded
     virtual int truncate_prefix(const int64_t first_index_kept) = 0;
 
@@ -82,6 +125,12 @@ public:
     // Return the address referenced to the instance on success, NULL otherwise.
     virtual LogStorage* new_instance(const std::string& uri) const = 0;
 
+    // Describe the internal status, which shows up in the page of the node
+    virtual void describe(std::ostream& os, bool use_html) {
+        (void)os;
+        (void)use_html;
+    }
+
     static LogStorage* create(const std::string& uri);
 };
 
@@ -162,6 +211,16 @@ public:
     // Note that whether the file will be removed from the backing storage is
     // implementation-defined.
     virtual int remove_file(const std::string& filename) = 0;
+
+    // Add a file which is unchanged since the last snapshot of the storage,
+    // along with its file_meta, without writing it again. Implementations
+    // that don't support incremental snapshots just fail, in which case the
+    // file should be written and added as usual.
+    // Returns 0 on success, -1 otherwise.
+    virtual int add_file_from_last_snapshot(const std::string& filename) {
+        (void)filename;
+        return -1;
+    }
 };
 
 class SnapshotReader : public Snapshot {
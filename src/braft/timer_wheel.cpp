@@ -0,0 +1,170 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/timer_wheel.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#include <butil/time.h>
+#include <butil/logging.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/util.h"
+
+namespace braft {
+
+DEFINE_bool(raft_enable_timer_wheel, false,
+            "Schedule the timers of the nodes on the process-wide timer wheel "
+            "instead of the bthread timer thread, which takes effect for the "
+            "nodes initialized afterwards");
+BRPC_VALIDATE_GFLAG(raft_enable_timer_wheel, ::brpc::PassValidate);
+
+DEFINE_int32(raft_timer_wheel_tick_ms, 10,
+             "Tick of the timer wheel, which is the precision of its timers. "
+             "Takes effect when the timer wheel is used for the first time");
+BRPC_VALIDATE_GFLAG(raft_timer_wheel_tick_ms, ::brpc::PositiveInteger);
+
+static bvar::CounterRecorder g_timer_wheel_batch_counter(
+        "raft_timer_wheel_batch_counter");
+
+static pthread_once_t g_timer_wheel_once = PTHREAD_ONCE_INIT;
+static TimerWheel* g_timer_wheel = NULL;
+
+TimerWheel* TimerWheel::get_instance() {
+    struct Creator {
+        static void create() {
+            g_timer_wheel = new TimerWheel;
+        }
+    };
+    pthread_once(&g_timer_wheel_once, Creator::create);
+    return g_timer_wheel;
+}
+
+TimerWheel::TimerWheel() : _tick_ms(FLAGS_raft_timer_wheel_tick_ms) {
+    const int64_t now_tick = butil::gettimeofday_ms() / _tick_ms;
+    for (size_t i = 0; i < SHARD_NUM; ++i) {
+        _shards[i].next_tick = now_tick;
+        CHECK_EQ(0, _shards[i].tasks.init(1024));
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, run_ticks, this) != 0) {
+        PLOG(FATAL) << "Fail to create the thread of the timer wheel";
+    }
+}
+
+int TimerWheel::schedule(TimerId* id, Callback fn, void* arg,
+                         const timespec& abstime, int bthread_tag) {
+    const int64_t due_ms = butil::timespec_to_milliseconds(abstime);
+    // Timers of the same owner always go to the same shard
+    const size_t index = ((uint64_t)(uintptr_t)arg * 0x9E3779B97F4A7C15ULL)
+                         >> (64 - SHARD_BITS);
+    Shard& shard = _shards[index];
+    Task* task = new Task;
+    task->fn = fn;
+    task->arg = arg;
+    task->bthread_tag = bthread_tag;
+    BAIDU_SCOPED_LOCK(shard.mutex);
+    // Timers already due are expired in the next tick
+    task->tick = std::max((due_ms + _tick_ms - 1) / _tick_ms, shard.next_tick);
+    task->id = (shard.next_seq++ << SHARD_BITS) | index;
+    if (shard.tasks.insert(task->id, task) == NULL) {
+        delete task;
+        return -1;
+    }
+    shard.slots[task->tick % SLOT_NUM].Append(task);
+    *id = task->id;
+    return 0;
+}
+
+int TimerWheel::unschedule(TimerId id) {
+    Shard& shard = _shards[id & (SHARD_NUM - 1)];
+    Task* task = NULL;
+    {
+        BAIDU_SCOPED_LOCK(shard.mutex);
+        Task** ptask = shard.tasks.seek(id);
+        if (ptask == NULL) {
+            return 1;
+        }
+        task = *ptask;
+        shard.tasks.erase(id);
+        task->RemoveFromList();
+    }
+    delete task;
+    return 0;
+}
+
+void TimerWheel::expire(Shard* shard, int64_t now_tick,
+                        std::vector<Task*>* expired) {
+    BAIDU_SCOPED_LOCK(shard->mutex);
+    // Visiting each slot once is enough if the thread lags behind a round
+    const int64_t end_tick = std::min(now_tick + 1,
+                                      shard->next_tick + (int64_t)SLOT_NUM);
+    for (int64_t tick = shard->next_tick; tick < end_tick; ++tick) {
+        butil::LinkedList<Task>& slot = shard->slots[tick % SLOT_NUM];
+        for (butil::LinkNode<Task>* node = slot.head(); node != slot.end();) {
+            Task* task = node->value();
+            node = node->next();
+            if (task->tick <= now_tick) {
+                task->RemoveFromList();
+                shard->tasks.erase(task->id);
+                expired->push_back(task);
+            }
+        }
+    }
+    shard->next_tick = std::max(shard->next_tick, now_tick + 1);
+}
+
+void TimerWheel::dispatch(std::vector<Task*>* expired) {
+    g_timer_wheel_batch_counter << expired->size();
+    // Signal the workers once for all the bthreads, except the ones of
+    // tagged workers which are signaled one by one
+    const bthread_attr_t nosignal_attr = BTHREAD_ATTR_NORMAL | BTHREAD_NOSIGNAL;
+    for (size_t i = 0; i < expired->size(); ++i) {
+        Task* task = (*expired)[i];
+        const bthread_attr_t attr = task->bthread_tag < 0 ? nosignal_attr
+                : bthread_attr_of_tag(BTHREAD_ATTR_NORMAL, task->bthread_tag);
+        bthread_t tid;
+        if (bthread_start_background(&tid, &attr, task->fn, task->arg) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            task->fn(task->arg);
+        }
+        delete task;
+    }
+    bthread_flush();
+    expired->clear();
+}
+
+void* TimerWheel::run_ticks(void* arg) {
+    TimerWheel* wheel = (TimerWheel*)arg;
+    std::vector<Task*> expired;
+    while (true) {
+        const int64_t now_tick = butil::gettimeofday_ms() / wheel->_tick_ms;
+        for (size_t i = 0; i < SHARD_NUM; ++i) {
+            wheel->expire(&wheel->_shards[i], now_tick, &expired);
+        }
+        if (!expired.empty()) {
+            dispatch(&expired);
+        }
+        const int64_t sleep_ms =
+                (now_tick + 1) * wheel->_tick_ms - butil::gettimeofday_ms();
+        if (sleep_ms > 0) {
+            usleep(sleep_ms * 1000);
+        }
+    }
+    return NULL;
+}
+
+}  //  namespace braft
@@ -0,0 +1,86 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_TIMER_WHEEL_H
+#define BRAFT_TIMER_WHEEL_H
+
+#include <vector>
+#include <gflags/gflags.h>
+#include <butil/macros.h>
+#include <butil/containers/flat_map.h>           // butil::FlatMap
+#include <butil/containers/linked_list.h>        // butil::LinkedList
+#include "braft/macros.h"
+
+namespace braft {
+
+DECLARE_bool(raft_enable_timer_wheel);
+
+// Process-wide hashed timer wheel shared by the timers of all the nodes.
+// Timers are expired in ticks of raft_timer_wheel_tick_ms instead of one by
+// one, and the callbacks expired in the same tick are started in bthreads in
+// one batch, which saves the wakeups of the timer thread and the workers when
+// there are lots of groups. The precision of the timers is one tick.
+class TimerWheel {
+public:
+    typedef uint64_t TimerId;
+    typedef void* (*Callback)(void*);
+
+    static TimerWheel* get_instance();
+
+    // Run |fn|(|arg|) in a new bthread at |abstime|, by the bthread workers
+    // of |bthread_tag| if it's not negative. |id| is assigned with the id of
+    // the timer.
+    // Returns 0 on success, -1 otherwise
+    int schedule(TimerId* id, Callback fn, void* arg, const timespec& abstime,
+                 int bthread_tag = -1);
+
+    // Returns 0 if the timer is removed before it runs, 1 if it's running or
+    // has run
+    int unschedule(TimerId id);
+
+private:
+    TimerWheel();
+    DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+
+    struct Task : public butil::LinkNode<Task> {
+        TimerId id;
+        int64_t tick;
+        Callback fn;
+        void* arg;
+        int bthread_tag;
+    };
+    static const size_t SHARD_BITS = 4;
+    static const size_t SHARD_NUM = 1 << SHARD_BITS;
+    static const size_t SLOT_NUM = 512;
+    struct BAIDU_CACHELINE_ALIGNMENT Shard {
+        Shard() : next_tick(0), next_seq(1) {}
+        raft_mutex_t mutex;
+        butil::LinkedList<Task> slots[SLOT_NUM];
+        butil::FlatMap<TimerId, Task*> tasks;
+        // Ticks before this one have been expired
+        int64_t next_tick;
+        uint64_t next_seq;
+    };
+
+    static void* run_ticks(void* arg);
+    void expire(Shard* shard, int64_t now_tick, std::vector<Task*>* expired);
+    static void dispatch(std::vector<Task*>* expired);
+
+    const int64_t _tick_ms;
+    Shard _shards[SHARD_NUM];
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_TIMER_WHEEL_H
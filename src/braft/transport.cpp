@@ -0,0 +1,83 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/transport.h"
+
+#include <butil/logging.h>
+
+namespace braft {
+
+DEFINE_string(raft_transport, "tcp",
+              "The transport of the RPCs between the peers, which must be "
+              "registered to transport_extension(), e.g. tcp or rdma");
+
+extern void global_init_once_or_die();
+
+int TcpTransport::init_channel(brpc::Channel* channel,
+                               const butil::EndPoint& addr,
+                               const brpc::ChannelOptions* options) const {
+    return channel->Init(addr, options);
+}
+
+int TcpTransport::setup_server(brpc::ServerOptions* /*options*/) const {
+    return 0;
+}
+
+#ifdef BRAFT_WITH_RDMA_OPTIONS
+int RdmaTransport::init_channel(brpc::Channel* channel,
+                                const butil::EndPoint& addr,
+                                const brpc::ChannelOptions* options) const {
+    brpc::ChannelOptions rdma_options;
+    if (options != NULL) {
+        rdma_options = *options;
+    }
+    rdma_options.use_rdma = true;
+    // brpc fails the initialization if it's not built with RDMA
+    return channel->Init(addr, &rdma_options);
+}
+
+int RdmaTransport::setup_server(brpc::ServerOptions* options) const {
+    options->use_rdma = true;
+    return 0;
+}
+#else
+int RdmaTransport::init_channel(brpc::Channel* /*channel*/,
+                                const butil::EndPoint& /*addr*/,
+                                const brpc::ChannelOptions* /*options*/) const {
+    LOG(ERROR) << "brpc has no RDMA options, which are added in brpc 1.0";
+    return -1;
+}
+
+int RdmaTransport::setup_server(brpc::ServerOptions* /*options*/) const {
+    LOG(ERROR) << "brpc has no RDMA options, which are added in brpc 1.0";
+    return -1;
+}
+#endif  // BRAFT_WITH_RDMA_OPTIONS
+
+const Transport* current_transport() {
+    global_init_once_or_die();
+    return transport_extension()->Find(FLAGS_raft_transport.c_str());
+}
+
+int init_peer_channel(brpc::Channel* channel, const butil::EndPoint& addr,
+                      const brpc::ChannelOptions* options) {
+    const Transport* transport = current_transport();
+    if (transport == NULL) {
+        LOG(ERROR) << "Fail to find transport " << FLAGS_raft_transport;
+        return -1;
+    }
+    return transport->init_channel(channel, addr, options);
+}
+
+}  //  namespace braft
@@ -0,0 +1,80 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_TRANSPORT_H
+#define BRAFT_TRANSPORT_H
+
+#include <gflags/gflags.h>
+#include <butil/endpoint.h>
+#include <brpc/channel.h>
+#include <brpc/server.h>
+#include <brpc/extension.h>
+
+namespace braft {
+
+DECLARE_string(raft_transport);
+
+// The transport of the RPCs between the peers, i.e. AppendEntries,
+// heartbeats, votes and the get_file of the snapshots, which is the one
+// registered to transport_extension() as raft_transport. The builtin ones are:
+//  - tcp: the default transport of brpc
+//  - rdma: the RDMA (verbs) endpoint of brpc, which posts the blocks of the
+//    IOBufs to the NIC without copying them. It requires brpc built with
+//    WITH_RDMA, and all the peers of the groups must use it.
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    // Init |channel| to the peer at |addr| with |options|, which is the
+    // default ChannelOptions if NULL.
+    // Returns 0 on success, -1 otherwise
+    virtual int init_channel(brpc::Channel* channel,
+                             const butil::EndPoint& addr,
+                             const brpc::ChannelOptions* options) const = 0;
+
+    // Set |options| of the server serving the raft services to accept the
+    // connections of this transport.
+    // Returns 0 on success, -1 otherwise
+    virtual int setup_server(brpc::ServerOptions* options) const = 0;
+};
+
+class TcpTransport : public Transport {
+public:
+    int init_channel(brpc::Channel* channel, const butil::EndPoint& addr,
+                     const brpc::ChannelOptions* options) const;
+    int setup_server(brpc::ServerOptions* options) const;
+};
+
+class RdmaTransport : public Transport {
+public:
+    int init_channel(brpc::Channel* channel, const butil::EndPoint& addr,
+                     const brpc::ChannelOptions* options) const;
+    int setup_server(brpc::ServerOptions* options) const;
+};
+
+inline brpc::Extension<const Transport>* transport_extension() {
+    return brpc::Extension<const Transport>::instance();
+}
+
+// Get the transport of raft_transport, NULL if it's not registered
+const Transport* current_transport();
+
+// Init |channel| to the peer at |addr| with the current transport.
+// Returns 0 on success, -1 otherwise
+int init_peer_channel(brpc::Channel* channel, const butil::EndPoint& addr,
+                      const brpc::ChannelOptions* options);
+
+}  //  namespace braft
+
+#endif  //BRAFT_TRANSPORT_H
@@ -18,11 +18,35 @@
 #include "braft/util.h"
 #include <gflags/gflags.h>
 #include <stdlib.h>
+#include <arpa/inet.h>
 #include <butil/macros.h>
 #include <butil/raw_pack.h>                     // butil::RawPacker
 #include <butil/file_util.h>
+#include <brpc/policy/snappy_compress.h>       // brpc::policy::SnappyCompress
+#include <brpc/policy/gzip_compress.h>         // brpc::policy::ZlibCompress
+#include <brpc/reloadable_flags.h>             // BRPC_VALIDATE_GFLAG
 #include "braft/raft.h"
 
+// The CRC32 instructions are optional in ARMv8.0, they are compiled in
+// regardless of -march and used only if the CPU reports them
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define BRAFT_ARM_CRC32C 1
+#if defined(__clang__)
+#define BRAFT_TARGET_CRC __attribute__((target("crc")))
+#define BRAFT_CRC32CB __builtin_arm_crc32cb
+#define BRAFT_CRC32CD __builtin_arm_crc32cd
+#else
+#define BRAFT_TARGET_CRC __attribute__((target("+crc")))
+#define BRAFT_CRC32CB __builtin_aarch64_crc32cb
+#define BRAFT_CRC32CD __builtin_aarch64_crc32cx
+#endif
+#endif
+
 namespace bvar {
 
 // Reloading following gflags does not change names of the corresponding bvars.
@@ -248,6 +272,59 @@ std::ostream& operator<<(std::ostream& os, const CounterRecorder& rec) {
 
 namespace braft {
 
+static uint32_t butil_crc32c_extend(uint32_t crc, const char* data, size_t n) {
+    return butil::crc32c::Extend(crc, data, n);
+}
+
+#ifdef BRAFT_ARM_CRC32C
+BRAFT_TARGET_CRC
+static uint32_t arm_crc32c_extend(uint32_t crc, const char* data, size_t n) {
+    crc = ~crc;
+    for (; n > 0 && ((uintptr_t)data & 7); --n, ++data) {
+        crc = BRAFT_CRC32CB(crc, *(const uint8_t*)data);
+    }
+    for (; n >= 8; n -= 8, data += 8) {
+        crc = BRAFT_CRC32CD(crc, *(const uint64_t*)data);
+    }
+    for (; n > 0; --n, ++data) {
+        crc = BRAFT_CRC32CB(crc, *(const uint8_t*)data);
+    }
+    return ~crc;
+}
+
+static bool is_arm_crc32c_supported() {
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#endif  // BRAFT_ARM_CRC32C
+
+typedef uint32_t (*Crc32cExtendFn)(uint32_t crc, const char* data, size_t n);
+
+static Crc32cExtendFn pick_crc32c_extend() {
+#ifdef BRAFT_ARM_CRC32C
+    if (is_arm_crc32c_supported()) {
+        return arm_crc32c_extend;
+    }
+#endif
+    // butil dispatches to SSE4.2 by itself
+    return butil_crc32c_extend;
+}
+
+uint32_t crc32c_extend(uint32_t crc, const char* data, size_t n) {
+    // Picked on the first call, which might happen during static
+    // initialization of other files
+    static const Crc32cExtendFn s_crc32c_extend = pick_crc32c_extend();
+    return s_crc32c_extend(crc, data, n);
+}
+
+bool is_fast_crc32c_supported() {
+#ifdef BRAFT_ARM_CRC32C
+    if (is_arm_crc32c_supported()) {
+        return true;
+    }
+#endif
+    return butil::crc32c::IsFastCrc32Supported();
+}
+
 static void* run_closure(void* arg) {
     ::google::protobuf::Closure *c = (google::protobuf::Closure*)arg;
     if (c) {
@@ -283,6 +360,48 @@ void run_closure_in_bthread_nosig(google::protobuf::Closure* closure,
     }
 }
 
+bthread_attr_t bthread_attr_of_tag(const bthread_attr_t& attr, int bthread_tag) {
+    bthread_attr_t tagged = attr;
+#ifdef BRAFT_WITH_BTHREAD_TAG
+    if (bthread_tag >= 0) {
+        tagged.tag = bthread_tag;
+    }
+#endif
+    return tagged;
+}
+
+static void* run_closures(void* arg) {
+    std::vector<google::protobuf::Closure*>* closures =
+            (std::vector<google::protobuf::Closure*>*)arg;
+    for (size_t i = 0; i < closures->size(); ++i) {
+        (*closures)[i]->Run();
+    }
+    delete closures;
+    return NULL;
+}
+
+void run_closures_in_bthread(std::vector<google::protobuf::Closure*>* closures,
+                             bool in_pthread) {
+    if (closures->empty()) {
+        return;
+    }
+    if (closures->size() == 1) {
+        run_closure_in_bthread(closures->front(), in_pthread);
+        closures->clear();
+        return;
+    }
+    std::vector<google::protobuf::Closure*>* saved =
+            new std::vector<google::protobuf::Closure*>;
+    saved->swap(*closures);
+    bthread_t tid;
+    bthread_attr_t attr = (in_pthread) 
+                          ? BTHREAD_ATTR_PTHREAD : BTHREAD_ATTR_NORMAL;
+    if (bthread_start_background(&tid, &attr, run_closures, saved) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        run_closures(saved);
+    }
+}
+
 ssize_t file_pread(butil::IOPortal* portal, int fd, off_t offset, size_t size) {
     off_t orig_offset = offset;
     ssize_t left = size;
@@ -404,4 +523,108 @@ size_t FileSegData::next(uint64_t* offset, butil::IOBuf* data) {
     return seg_len;
 }
 
+static bool validate_replication_compress_type(const char*, int32_t value) {
+    return value >= COMPRESS_NONE && value <= COMPRESS_ZLIB;
+}
+DEFINE_int32(raft_replication_compress_type, 0,
+             "Compress the attachments of AppendEntries and GetFile RPCs to "
+             "the peers supporting it, 0: none, 1: snappy, 2: zlib");
+BRPC_VALIDATE_GFLAG(raft_replication_compress_type,
+                    validate_replication_compress_type);
+
+DEFINE_int32(raft_replication_compress_min_bytes, 4096,
+             "Attachments shorter than this are sent uncompressed");
+BRPC_VALIDATE_GFLAG(raft_replication_compress_min_bytes,
+                    brpc::NonNegativeInteger);
+
+static bool validate_prefix_len(const char*, int32_t value) {
+    return value >= 0 && value <= 32;
+}
+DEFINE_int32(raft_replication_compress_lan_prefix_len, 0,
+             "Peers of which the IPv4 address shares at least this number of "
+             "leading bits with this server are regarded as in the same "
+             "locality and sent uncompressed, 0 to compress for all the peers");
+BRPC_VALIDATE_GFLAG(raft_replication_compress_lan_prefix_len,
+                    validate_prefix_len);
+
+bool compress_data(int compress_type, const butil::IOBuf& in,
+                   butil::IOBuf* out) {
+    switch (compress_type) {
+    case COMPRESS_SNAPPY:
+        return brpc::policy::SnappyCompress(in, out);
+    case COMPRESS_ZLIB:
+        return brpc::policy::ZlibCompress(in, out, NULL);
+    default:
+        LOG(ERROR) << "Unknown compress_type=" << compress_type;
+        return false;
+    }
+}
+
+bool decompress_data(int compress_type, const butil::IOBuf& in,
+                     butil::IOBuf* out) {
+    switch (compress_type) {
+    case COMPRESS_SNAPPY:
+        return brpc::policy::SnappyDecompress(in, out);
+    case COMPRESS_ZLIB:
+        return brpc::policy::ZlibDecompress(in, out);
+    default:
+        LOG(ERROR) << "Unknown compress_type=" << compress_type;
+        return false;
+    }
+}
+
+int replication_compress_type(const butil::EndPoint& remote) {
+    const int compress_type = FLAGS_raft_replication_compress_type;
+    const int prefix_len = FLAGS_raft_replication_compress_lan_prefix_len;
+    if (compress_type == COMPRESS_NONE || prefix_len == 0) {
+        return compress_type;
+    }
+    const uint32_t local_ip = ntohl(butil::ip2int(butil::my_ip()));
+    const uint32_t remote_ip = ntohl(butil::ip2int(remote.ip));
+    const int shift = 32 - prefix_len;
+    if ((local_ip >> shift) == (remote_ip >> shift)) {
+        return COMPRESS_NONE;
+    }
+    return compress_type;
+}
+
+int compress_replication_data(int compress_type, butil::IOBuf* data) {
+    if (compress_type == COMPRESS_NONE ||
+            data->size() < (size_t)FLAGS_raft_replication_compress_min_bytes) {
+        return COMPRESS_NONE;
+    }
+    butil::IOBuf compressed;
+    if (!compress_data(compress_type, *data, &compressed) ||
+            compressed.size() >= data->size()) {
+        return COMPRESS_NONE;
+    }
+    data->swap(compressed);
+    return compress_type;
+}
+
+DEFINE_bool(raft_profile_locks, false,
+            "Record the wait and hold time of the profiled raft locks, see "
+            "/raft_lock_stat");
+BRPC_VALIDATE_GFLAG(raft_profile_locks, brpc::PassValidate);
+
+static raft_mutex_t s_lock_sites_mutex;
+
+static std::vector<LockSite*>* lock_sites() {
+    static std::vector<LockSite*>* s_sites = new std::vector<LockSite*>;
+    return s_sites;
+}
+
+LockSite::LockSite(const std::string& name)
+    : _name(name)
+    , _wait("raft_lock_" + name + "_wait")
+    , _hold("raft_lock_" + name + "_hold") {
+    BAIDU_SCOPED_LOCK(s_lock_sites_mutex);
+    lock_sites()->push_back(this);
+}
+
+void LockSite::list_sites(std::vector<LockSite*>* sites) {
+    BAIDU_SCOPED_LOCK(s_lock_sites_mutex);
+    *sites = *lock_sites();
+}
+
 }  //  namespace braft
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string>
 #include <set>
+#include <vector>
 #include <butil/third_party/murmurhash3/murmurhash3.h>
 #include <butil/endpoint.h>
 #include <butil/scoped_lock.h>
@@ -41,6 +42,7 @@
 #include <bthread/unstable.h>
 #include <bthread/countdown_event.h>
 #include <bvar/bvar.h>
+#include <gflags/gflags.h>
 #include "braft/macros.h"
 #include "braft/raft.h"
 
@@ -172,6 +174,8 @@ std::ostream& operator<<(std::ostream& os, const CounterRecorder&);
 namespace braft {
 class Closure;
 
+DECLARE_bool(raft_profile_locks);
+
 // http://stackoverflow.com/questions/1493936/faster-approach-to-checking-for-an-all-zero-buffer-in-c
 inline bool is_zero(const char* buff, const size_t size) {
     if (size >= sizeof(uint64_t)) {
@@ -206,8 +210,32 @@ inline uint32_t murmurhash32(const butil::IOBuf& buf) {
     return hash;
 }
 
+// 64-bit content hash of |buf|, which is the first half of the 128-bit
+// murmurhash3
+inline uint64_t murmurhash64(const butil::IOBuf& buf) {
+    butil::MurmurHash3_x64_128_Context ctx;
+    butil::MurmurHash3_x64_128_Init(&ctx, 0);
+    const size_t block_num = buf.backing_block_num();
+    for (size_t i = 0; i < block_num; ++i) {
+        butil::StringPiece sp = buf.backing_block(i);
+        if (!sp.empty()) {
+            butil::MurmurHash3_x64_128_Update(&ctx, sp.data(), sp.size());
+        }
+    }
+    uint64_t hash[2];
+    butil::MurmurHash3_x64_128_Final(hash, &ctx);
+    return hash[0];
+}
+
+// Same as butil::crc32c::Extend, but also uses the CRC32 instructions of
+// ARMv8 if the CPU supports them. The implementation is picked at runtime.
+uint32_t crc32c_extend(uint32_t crc, const char* data, size_t n);
+
+// Whether crc32c_extend runs with hardware instructions
+bool is_fast_crc32c_supported();
+
 inline uint32_t crc32(const void* key, int len) {
-    return butil::crc32c::Value((const char*)key, len);
+    return crc32c_extend(0, (const char*)key, len);
 }
 
 inline uint32_t crc32(const butil::IOBuf& buf) {
@@ -216,7 +244,7 @@ inline uint32_t crc32(const butil::IOBuf& buf) {
     for (size_t i = 0; i < block_num; ++i) {
         butil::StringPiece sp = buf.backing_block(i);
         if (!sp.empty()) {
-            hash = butil::crc32c::Extend(hash, sp.data(), sp.size());
+            hash = crc32c_extend(hash, sp.data(), sp.size());
         }
     }
     return hash;
@@ -240,6 +268,18 @@ typedef std::unique_ptr<google::protobuf::Closure, RunClosureInBthread>
 void run_closure_in_bthread_nosig(::google::protobuf::Closure* closure,
                                   bool in_pthread = false);
 
+// Start one bthread to run all the |closures| in order, which saves the
+// bthreads and the context switches of running them one by one. |closures|
+// is cleared.
+void run_closures_in_bthread(
+        std::vector< ::google::protobuf::Closure*>* closures,
+        bool in_pthread = false);
+
+// Returns |attr| whose bthreads are run by the workers of |bthread_tag|,
+// which is unchanged if |bthread_tag| is negative or brpc doesn't support
+// bthread tags
+bthread_attr_t bthread_attr_of_tag(const bthread_attr_t& attr, int bthread_tag);
+
 struct RunClosureInBthreadNoSig {
     void operator()(google::protobuf::Closure* done) {
         return run_closure_in_bthread_nosig(done);
@@ -284,6 +324,88 @@ private:
     uint32_t _seg_len;
 };
 
+// Compress types of the data in segments and RPC attachments
+enum CompressType {
+    COMPRESS_NONE = 0,
+    COMPRESS_SNAPPY = 1,
+    COMPRESS_ZLIB = 2,
+};
+
+bool compress_data(int compress_type, const butil::IOBuf& in,
+                   butil::IOBuf* out);
+
+bool decompress_data(int compress_type, const butil::IOBuf& in,
+                     butil::IOBuf* out);
+
+// Compress type of the data replicated to |remote| decided by
+// raft_replication_compress_type and raft_replication_compress_lan_prefix_len,
+// COMPRESS_NONE if the data should be sent as is
+int replication_compress_type(const butil::EndPoint& remote);
+
+// Compress |data| in place if it's at least raft_replication_compress_min_bytes
+// and gets smaller after compressed
+// Returns the compress type applied to |data|
+int compress_replication_data(int compress_type, butil::IOBuf* data);
+
+// Wait and hold time of the locks sharing a name, exposed as
+// bvar::LatencyRecorder raft_lock_<name>_wait and raft_lock_<name>_hold
+class LockSite {
+public:
+    explicit LockSite(const std::string& name);
+    const std::string& name() const { return _name; }
+    bvar::LatencyRecorder& wait() { return _wait; }
+    bvar::LatencyRecorder& hold() { return _hold; }
+    // Get all the sites ever locked with raft_profile_locks on
+    static void list_sites(std::vector<LockSite*>* sites);
+private:
+    std::string _name;
+    bvar::LatencyRecorder _wait;
+    bvar::LatencyRecorder _hold;
+};
+
+// A drop-in replacement of raft_mutex_t which records the wait and hold time
+// into the LockSite named Tag::name() when raft_profile_locks is on. When
+// it's off the only extra cost is a flag check on each lock and unlock.
+template <typename Tag>
+class ProfiledMutex {
+public:
+    ProfiledMutex() : _locked_us(0) {}
+    void lock() {
+        if (!FLAGS_raft_profile_locks) {
+            _mutex.lock();
+            _locked_us = 0;
+            return;
+        }
+        const int64_t start_us = butil::cpuwide_time_us();
+        _mutex.lock();
+        _locked_us = butil::cpuwide_time_us();
+        site()->wait() << _locked_us - start_us;
+    }
+    bool try_lock() {
+        if (!_mutex.try_lock()) {
+            return false;
+        }
+        _locked_us = FLAGS_raft_profile_locks ? butil::cpuwide_time_us() : 0;
+        return true;
+    }
+    void unlock() {
+        // Must be read before the lock is released
+        const int64_t locked_us = _locked_us;
+        _mutex.unlock();
+        if (locked_us != 0) {
+            site()->hold() << butil::cpuwide_time_us() - locked_us;
+        }
+    }
+    static LockSite* site() {
+        static LockSite* s_site = new LockSite(Tag::name());
+        return s_site;
+    }
+private:
+    DISALLOW_COPY_AND_ASSIGN(ProfiledMutex);
+    raft_mutex_t _mutex;
+    int64_t _locked_us;
+};
+
 // A special Closure which provides synchronization primitives
 class SynchronizedClosure : public Closure {
 public:
@@ -0,0 +1,232 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/vote_aggregator.h"
+
+#include <pthread.h>
+#include <butil/time.h>
+#include <bthread/bthread.h>
+#include <bthread/unstable.h>
+#include <bvar/bvar.h>
+#include <brpc/errno.pb.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/transport.h"
+
+namespace braft {
+
+DEFINE_bool(raft_enable_multi_vote, false,
+            "Send the PreVote and RequestVote requests of the groups sharing "
+            "the same pair of candidate and peer endpoints in one "
+            "MultiPreVote or MultiRequestVote RPC");
+BRPC_VALIDATE_GFLAG(raft_enable_multi_vote, ::brpc::PassValidate);
+
+DEFINE_int32(raft_multi_vote_window_ms, 5,
+             "Votes issued within this window are sent in one MultiPreVote or "
+             "MultiRequestVote RPC");
+BRPC_VALIDATE_GFLAG(raft_multi_vote_window_ms, brpc::NonNegativeInteger);
+
+static bvar::CounterRecorder g_multi_pre_vote_batch_counter(
+        "raft_multi_pre_vote_batch_counter");
+static bvar::CounterRecorder g_multi_request_vote_batch_counter(
+        "raft_multi_request_vote_batch_counter");
+
+static pthread_once_t g_aggregators_once = PTHREAD_ONCE_INIT;
+static VoteAggregator* g_pre_vote_aggregator = NULL;
+static VoteAggregator* g_request_vote_aggregator = NULL;
+
+class VoteAggregator::MultiVoteDone : public google::protobuf::Closure {
+public:
+    brpc::Controller cntl;
+    MultiRequestVoteRequest request;
+    MultiRequestVoteResponse response;
+    std::vector<Pending> pending;
+
+    void Run() {
+        for (size_t i = 0; i < pending.size(); ++i) {
+            const Pending& p = pending[i];
+            const int index = i;
+            if (cntl.Failed()) {
+                p.cntl->SetFailed(cntl.ErrorCode(), "%s",
+                                  cntl.ErrorText().c_str());
+            } else if (index >= response.responses_size()) {
+                p.cntl->SetFailed(brpc::ERESPONSE,
+                                  "Missing response in the batch");
+            } else if (index < response.error_codes_size() &&
+                            response.error_codes(index) != 0) {
+                p.cntl->SetFailed(response.error_codes(index), "%s",
+                                  index < response.error_texts_size()
+                                  ? response.error_texts(index).c_str()
+                                  : berror(response.error_codes(index)));
+            } else {
+                p.response->Swap(response.mutable_responses(index));
+            }
+            p.done->Run();
+        }
+        delete this;
+    }
+};
+
+VoteAggregator* VoteAggregator::pre_vote_aggregator() {
+    struct Creator {
+        static void create() {
+            g_pre_vote_aggregator = new VoteAggregator(true);
+            g_request_vote_aggregator = new VoteAggregator(false);
+        }
+    };
+    pthread_once(&g_aggregators_once, Creator::create);
+    return g_pre_vote_aggregator;
+}
+
+VoteAggregator* VoteAggregator::request_vote_aggregator() {
+    pre_vote_aggregator();
+    return g_request_vote_aggregator;
+}
+
+VoteAggregator::~VoteAggregator() {
+    for (std::map<Key, Batch>::iterator it = _batches.begin();
+            it != _batches.end(); ++it) {
+        delete it->second.channel;
+    }
+}
+
+void VoteAggregator::send(const butil::EndPoint& local,
+                          const butil::EndPoint& remote,
+                          const std::string& connection_group,
+                          brpc::Controller* cntl,
+                          const RequestVoteRequest* request,
+                          RequestVoteResponse* response,
+                          google::protobuf::Closure* done) {
+    const Key key(local, remote, connection_group);
+    Pending p;
+    p.cntl = cntl;
+    p.request = request;
+    p.response = response;
+    p.done = done;
+    bool need_schedule = false;
+    bool channel_failed = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        Batch& batch = _batches[key];
+        if (batch.channel == NULL) {
+            brpc::Channel* channel = new brpc::Channel;
+            brpc::ChannelOptions channel_opt;
+            channel_opt.timeout_ms = -1;  // Set by the requests
+            channel_opt.max_retry = 0;
+            // Not queued behind the AppendEntries of the same endpoints
+            channel_opt.connection_type = brpc::CONNECTION_TYPE_SINGLE;
+            channel_opt.connection_group = connection_group;
+            if (init_peer_channel(channel, remote, &channel_opt) != 0) {
+                delete channel;
+                channel = NULL;
+            }
+            batch.channel = channel;
+        }
+        if (batch.channel != NULL) {
+            batch.pending.push_back(p);
+            need_schedule = !batch.scheduled;
+            batch.scheduled = true;
+        } else {
+            channel_failed = true;
+        }
+    }
+    if (channel_failed) {
+        LOG(ERROR) << "Fail to init channel to " << remote;
+        cntl->SetFailed(EINVAL, "Fail to init channel to %s",
+                        butil::endpoint2str(remote).c_str());
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_failed,
+                                     new Pending(p)) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            done->Run();
+        }
+        return;
+    }
+    if (!need_schedule) {
+        return;
+    }
+    FlushArg* arg = new FlushArg;
+    arg->aggregator = this;
+    arg->key = key;
+    bthread_timer_t timer;
+    if (bthread_timer_add(&timer,
+                          butil::milliseconds_from_now(
+                                  FLAGS_raft_multi_vote_window_ms),
+                          on_timer, arg) != 0) {
+        LOG(ERROR) << "Fail to add timer";
+        on_timer(arg);
+    }
+}
+
+void* VoteAggregator::run_failed(void* arg) {
+    Pending* p = (Pending*)arg;
+    p->done->Run();
+    delete p;
+    return NULL;
+}
+
+void VoteAggregator::on_timer(void* arg) {
+    // Don't send RPC in the timer thread, nor in the caller which holds the
+    // mutex of its node
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, run_flush, arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        run_flush(arg);
+    }
+}
+
+void* VoteAggregator::run_flush(void* arg) {
+    FlushArg* flush_arg = (FlushArg*)arg;
+    flush_arg->aggregator->flush(flush_arg->key);
+    delete flush_arg;
+    return NULL;
+}
+
+void VoteAggregator::flush(const Key& key) {
+    MultiVoteDone* done = new MultiVoteDone;
+    brpc::Channel* channel = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        Batch& batch = _batches[key];
+        batch.scheduled = false;
+        done->pending.swap(batch.pending);
+        channel = batch.channel;
+    }
+    if (done->pending.empty()) {
+        delete done;
+        return;
+    }
+    // Use the tightest timeout of the requests
+    int64_t timeout_ms = -1;
+    for (size_t i = 0; i < done->pending.size(); ++i) {
+        const Pending& p = done->pending[i];
+        done->request.add_requests()->CopyFrom(*p.request);
+        if (p.cntl->timeout_ms() > 0 &&
+                (timeout_ms < 0 || p.cntl->timeout_ms() < timeout_ms)) {
+            timeout_ms = p.cntl->timeout_ms();
+        }
+    }
+    done->cntl.set_timeout_ms(timeout_ms);
+    RaftService_Stub stub(channel);
+    if (_pre_vote) {
+        g_multi_pre_vote_batch_counter << done->pending.size();
+        stub.multi_pre_vote(&done->cntl, &done->request,
+                            &done->response, done);
+    } else {
+        g_multi_request_vote_batch_counter << done->pending.size();
+        stub.multi_request_vote(&done->cntl, &done->request,
+                                &done->response, done);
+    }
+}
+
+}  //  namespace braft
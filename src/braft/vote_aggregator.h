@@ -0,0 +1,108 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_VOTE_AGGREGATOR_H
+#define BRAFT_VOTE_AGGREGATOR_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <gflags/gflags.h>
+#include <butil/endpoint.h>
+#include <brpc/channel.h>
+#include <brpc/controller.h>
+#include "braft/raft.pb.h"
+#include "braft/macros.h"
+
+namespace braft {
+
+DECLARE_bool(raft_enable_multi_vote);
+
+// Batches the PreVote and RequestVote RPCs of all the groups from the same
+// candidate endpoint to the same peer endpoint into one RPC. When a server
+// hosting a lot of leaders goes away, the groups elect at about the same
+// time and the votes would otherwise flood the peers with one RPC per group.
+// PreVotes are sent in MultiPreVote RPCs and RequestVotes are sent in
+// MultiRequestVote RPCs by the two instances respectively.
+class VoteAggregator {
+public:
+    static VoteAggregator* pre_vote_aggregator();
+    static VoteAggregator* request_vote_aggregator();
+
+    // Send |request| from |local| to |remote| along with the other requests
+    // issued within the window of this aggregator. Like an ordinary
+    // asynchronous RPC, |cntl| and |response| are filled and |done| is called
+    // in another bthread when the request returns, and they are still owned
+    // by the caller. The RPC is sent through a single connection of
+    // |connection_group|, like the votes sent by the node itself.
+    void send(const butil::EndPoint& local, const butil::EndPoint& remote,
+              const std::string& connection_group,
+              brpc::Controller* cntl, const RequestVoteRequest* request,
+              RequestVoteResponse* response, google::protobuf::Closure* done);
+
+private:
+    explicit VoteAggregator(bool pre_vote) : _pre_vote(pre_vote) {}
+    ~VoteAggregator();
+    DISALLOW_COPY_AND_ASSIGN(VoteAggregator);
+
+    struct Pending {
+        brpc::Controller* cntl;
+        const RequestVoteRequest* request;
+        RequestVoteResponse* response;
+        google::protobuf::Closure* done;
+    };
+    struct Key {
+        Key() {}
+        Key(const butil::EndPoint& local_, const butil::EndPoint& remote_,
+            const std::string& connection_group_)
+            : local(local_), remote(remote_)
+            , connection_group(connection_group_) {}
+        bool operator<(const Key& rhs) const {
+            if (local != rhs.local) {
+                return local < rhs.local;
+            }
+            if (remote != rhs.remote) {
+                return remote < rhs.remote;
+            }
+            return connection_group < rhs.connection_group;
+        }
+        butil::EndPoint local;
+        butil::EndPoint remote;
+        std::string connection_group;
+    };
+    struct Batch {
+        Batch() : channel(NULL), scheduled(false) {}
+        brpc::Channel* channel;
+        std::vector<Pending> pending;
+        bool scheduled;
+    };
+    struct FlushArg {
+        VoteAggregator* aggregator;
+        Key key;
+    };
+    class MultiVoteDone;
+
+    static void on_timer(void* arg);
+    static void* run_flush(void* arg);
+    static void* run_failed(void* arg);
+    void flush(const Key& key);
+
+    const bool _pre_vote;
+    raft_mutex_t _mutex;
+    std::map<Key, Batch> _batches;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_VOTE_AGGREGATOR_H
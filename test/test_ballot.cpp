@@ -101,3 +101,45 @@ TEST(BallotTest, joint_consensus_different_conf) {
     bl.grant(peer4);
     ASSERT_TRUE(bl.granted());
 }
+
+TEST(BallotTest, shared_layout) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 1; i <= 100; ++i) {
+        peers.push_back(braft::PeerId(butil::EndPoint(butil::my_ip(), i)));
+    }
+    braft::Configuration conf(std::vector<braft::PeerId>(
+                                    peers.begin(), peers.begin() + 3));
+    braft::Configuration conf2(std::vector<braft::PeerId>(
+                                    peers.begin() + 1, peers.begin() + 5));
+    scoped_refptr<braft::Ballot::Layout> layout(
+            new braft::Ballot::Layout(conf, &conf2));
+    // The peers of both configurations are mapped once
+    ASSERT_EQ(5u, layout->_peers.size());
+    braft::Ballot bl1;
+    braft::Ballot bl2;
+    bl1.init(layout.get());
+    bl2.init(layout.get());
+    bl1.grant(peers[1]);
+    bl1.grant(peers[2]);
+    ASSERT_FALSE(bl1.granted());
+    bl1.grant(peers[3]);
+    ASSERT_TRUE(bl1.granted());
+    ASSERT_EQ(2, bl2._quorum);
+    ASSERT_EQ(3, bl2._old_quorum);
+    bl2.grant(peers[0]);
+    bl2.grant(peers[0]);
+    ASSERT_EQ(1, bl2._quorum);
+    ASSERT_EQ(3, bl2._old_quorum);
+
+    // More than 64 voters
+    braft::Configuration large_conf(peers);
+    braft::Ballot bl3;
+    ASSERT_EQ(0, bl3.init(large_conf, NULL));
+    for (int i = 99; i >= 50; --i) {
+        bl3.grant(peers[i]);
+        bl3.grant(peers[i]);
+    }
+    ASSERT_FALSE(bl3.granted());
+    bl3.grant(peers[0]);
+    ASSERT_TRUE(bl3.granted());
+}
@@ -5,11 +5,16 @@
 
 #include <algorithm>
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include <butil/string_printf.h>
 #include "braft/ballot_box.h"
 #include "braft/configuration.h"
 #include "braft/fsm_caller.h"
 
+namespace braft {
+DECLARE_bool(raft_commit_by_match_index);
+}
+
 class BallotBoxTest : public testing::Test {
 protected:
     void SetUp() {}
@@ -155,3 +160,64 @@ TEST_F(BallotBoxTest, even_cluster) {
     ASSERT_EQ(100, caller.committed_index());
 }
 
+
+TEST_F(BallotBoxTest, match_index) {
+    braft::FLAGS_raft_commit_by_match_index = true;
+    DummyCaller caller;
+    braft::ClosureQueue cq(false);
+    braft::BallotBoxOptions opt;
+    opt.waiter = &caller;
+    opt.closure_queue = &cq;
+    braft::BallotBox cm;
+    ASSERT_EQ(0, cm.init(opt));
+    ASSERT_EQ(EINVAL, cm.commit_at(1, 1, braft::PeerId("192.168.1.1:8888")));
+    ASSERT_EQ(0, cm.reset_pending_index(1));
+    std::vector<braft::PeerId> peers;
+    for (int i = 1; i <= 4; ++i) {
+        std::string peer_addr;
+        butil::string_printf(&peer_addr, "192.168.1.%d:8888", i);
+        peers.push_back(braft::PeerId(peer_addr));
+    }
+    braft::Configuration conf(std::vector<braft::PeerId>(
+                                    peers.begin(), peers.begin() + 3));
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(0, cm.append_pending_task(conf, NULL, NULL));
+    }
+    ASSERT_EQ(0, cm.commit_at(1, 100, peers[0]));
+    ASSERT_EQ(0, caller.committed_index());
+    ASSERT_EQ(0, cm.commit_at(1, 50, peers[1]));
+    ASSERT_EQ(50, caller.committed_index());
+    // Acks out of order don't go back
+    ASSERT_EQ(0, cm.commit_at(1, 30, peers[1]));
+    ASSERT_EQ(50, cm.last_committed_index());
+    // Not a voter
+    ASSERT_EQ(0, cm.commit_at(1, 100, peers[3]));
+    ASSERT_EQ(50, cm.last_committed_index());
+    ASSERT_EQ(ERANGE, cm.commit_at(1, 101, peers[2]));
+
+    // Joint consensus of adding peers[3]
+    braft::Configuration new_conf(peers);
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(0, cm.append_pending_task(new_conf, &conf, NULL));
+    }
+    ASSERT_EQ(0, cm.commit_at(1, 200, peers[0]));
+    ASSERT_EQ(0, cm.commit_at(1, 200, peers[3]));
+    // The new logs need quorums of both the configurations
+    ASSERT_EQ(50, cm.last_committed_index());
+    ASSERT_EQ(0, cm.commit_at(1, 150, peers[2]));
+    ASSERT_EQ(150, cm.last_committed_index());
+    ASSERT_EQ(0, cm.commit_at(1, 200, peers[1]));
+    ASSERT_EQ(200, caller.committed_index());
+
+    // Stepping down drops the match indexes
+    ASSERT_EQ(0, cm.clear_pending_tasks());
+    ASSERT_EQ(EINVAL, cm.commit_at(201, 201, peers[0]));
+    ASSERT_EQ(0, cm.reset_pending_index(201));
+    ASSERT_EQ(0, cm.append_pending_task(new_conf, NULL, NULL));
+    ASSERT_EQ(0, cm.commit_at(201, 201, peers[0]));
+    ASSERT_EQ(0, cm.commit_at(201, 201, peers[1]));
+    ASSERT_EQ(200, cm.last_committed_index());
+    ASSERT_EQ(0, cm.commit_at(201, 201, peers[2]));
+    ASSERT_EQ(201, cm.last_committed_index());
+    braft::FLAGS_raft_commit_by_match_index = false;
+}
@@ -0,0 +1,226 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <butil/iobuf.h>
+#include <brpc/server.h>
+#include <brpc/closure_guard.h>
+#include "braft/batch_service.h"
+#include "braft/batch_client.h"
+#include "braft/route_table.h"
+#include "braft/util.h"
+
+class BatchTest : public testing::Test {
+protected:
+    void SetUp() {
+        GFLAGS_NS::SetCommandLineOption("raft_sync", "false");
+        ::system("rm -rf data");
+    }
+    void TearDown() {
+        ::system("rm -rf data");
+    }
+};
+
+// Answers each operation with the operation followed by "!"
+class EchoFSM : public braft::StateMachine {
+public:
+    EchoFSM() : _applied_ops(0) {}
+    virtual void on_apply(braft::Iterator& iter) {
+        for (; iter.valid(); iter.next()) {
+            braft::BatchReader reader;
+            ASSERT_EQ(0, reader.init(iter.data()));
+            braft::BatchClosure* done =
+                    dynamic_cast<braft::BatchClosure*>(iter.done());
+            brpc::ClosureGuard done_guard(iter.done());
+            butil::IOBuf op;
+            while (reader.next(&op)) {
+                _applied_ops.fetch_add(1, butil::memory_order_relaxed);
+                if (done) {
+                    op.append("!");
+                    done->add_result(op);
+                }
+            }
+        }
+    }
+    int64_t applied_ops() const {
+        return _applied_ops.load(butil::memory_order_relaxed);
+    }
+private:
+    butil::atomic<int64_t> _applied_ops;
+};
+
+class BatchNode {
+public:
+    BatchNode() : _node(NULL) {}
+    ~BatchNode() {
+        if (_node) {
+            _node->shutdown(NULL);
+            _node->join();
+        }
+        _server.Stop(0);
+        _server.Join();
+        delete _node;
+    }
+    int start(int port, const braft::Configuration& conf) {
+        if (braft::add_service(&_server, port) != 0) {
+            return -1;
+        }
+        if (_server.AddService(&_batch_service,
+                               brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
+            return -1;
+        }
+        if (_server.Start(port, NULL) != 0) {
+            return -1;
+        }
+        braft::NodeOptions options;
+        std::string prefix;
+        butil::string_printf(&prefix, "local://./data/%d", port);
+        options.log_uri = prefix + "/log";
+        options.raft_meta_uri = prefix + "/raft_meta";
+        options.snapshot_uri = prefix + "/snapshot";
+        options.fsm = &_fsm;
+        options.node_owns_fsm = false;
+        options.election_timeout_ms = 300;
+        options.initial_conf = conf;
+        _node = new braft::Node("batch", braft::PeerId(
+                    butil::EndPoint(butil::my_ip(), port), 0));
+        return _node->init(options);
+    }
+    braft::Node* node() const { return _node; }
+    const EchoFSM& fsm() const { return _fsm; }
+private:
+    brpc::Server _server;
+    braft::BatchServiceImpl _batch_service;
+    braft::Node* _node;
+    EchoFSM _fsm;
+};
+
+// Submits |n| operations of "op<i>" and checks the results
+static void submit_and_check(braft::BatchClient* client, int n) {
+    std::vector<butil::IOBuf> results(n);
+    std::vector<braft::SynchronizedClosure> dones(n);
+    for (int i = 0; i < n; ++i) {
+        butil::IOBuf op;
+        op.append("op" + std::to_string(i));
+        client->submit("batch", op, &results[i], &dones[i]);
+    }
+    for (int i = 0; i < n; ++i) {
+        dones[i].wait();
+        ASSERT_TRUE(dones[i].status().ok()) << dones[i].status();
+        ASSERT_EQ("op" + std::to_string(i) + "!", results[i].to_string());
+    }
+}
+
+TEST_F(BatchTest, encode_and_read) {
+    std::vector<butil::IOBuf> ops(3);
+    ops[0].append("hello");
+    ops[2].append("world!");
+    butil::IOBuf data;
+    braft::encode_batch(ops, &data);
+
+    braft::BatchReader reader;
+    ASSERT_EQ(0, reader.init(data));
+    ASSERT_EQ(3u, reader.size());
+    butil::IOBuf op;
+    ASSERT_TRUE(reader.next(&op));
+    ASSERT_EQ("hello", op.to_string());
+    ASSERT_TRUE(reader.next(&op));
+    ASSERT_TRUE(op.empty());
+    ASSERT_TRUE(reader.next(&op));
+    ASSERT_EQ("world!", op.to_string());
+    ASSERT_FALSE(reader.next(&op));
+    // |data| is not consumed by the reader
+    ASSERT_EQ(0, reader.init(data));
+    ASSERT_EQ(3u, reader.size());
+}
+
+TEST_F(BatchTest, reject_invalid_data) {
+    braft::BatchReader reader;
+    butil::IOBuf data;
+    ASSERT_EQ(-1, reader.init(data));
+    data.append("not a batch of operations");
+    ASSERT_EQ(-1, reader.init(data));
+
+    std::vector<butil::IOBuf> ops(1);
+    ops[0].append("hello");
+    butil::IOBuf truncated;
+    braft::encode_batch(ops, &truncated);
+    truncated.pop_back(1);
+    ASSERT_EQ(-1, reader.init(truncated));
+    ASSERT_EQ(0u, reader.size());
+}
+
+TEST_F(BatchTest, invalid_options) {
+    braft::BatchClient client;
+    braft::BatchClientOptions options;
+    options.max_batch_ops = 0;
+    ASSERT_EQ(-1, client.init(options));
+    options = braft::BatchClientOptions();
+    ASSERT_EQ(0, client.init(options));
+}
+
+TEST_F(BatchTest, submit_to_leader) {
+    const int kPorts[] = { 5700, 5701, 5702 };
+    braft::Configuration conf;
+    for (size_t i = 0; i < ARRAY_SIZE(kPorts); ++i) {
+        conf.add_peer(braft::PeerId(butil::EndPoint(butil::my_ip(), kPorts[i]), 0));
+    }
+    BatchNode nodes[ARRAY_SIZE(kPorts)];
+    for (size_t i = 0; i < ARRAY_SIZE(kPorts); ++i) {
+        ASSERT_EQ(0, nodes[i].start(kPorts[i], conf));
+    }
+    BatchNode* leader = NULL;
+    while (leader == NULL) {
+        usleep(100 * 1000);
+        for (size_t i = 0; i < ARRAY_SIZE(kPorts); ++i) {
+            if (nodes[i].node()->is_leader()) {
+                leader = &nodes[i];
+            }
+        }
+    }
+    ASSERT_EQ(0, braft::rtb::update_configuration("batch", conf));
+
+    braft::BatchClient client;
+    braft::BatchClientOptions options;
+    options.max_batch_ops = 8;
+    options.max_inflight_batches = 2;
+    ASSERT_EQ(0, client.init(options));
+
+    // Unknown leader, found by refreshing the RouteTable
+    submit_and_check(&client, 100);
+    braft::PeerId cached;
+    ASSERT_EQ(0, braft::rtb::select_leader("batch", &cached));
+    ASSERT_EQ(leader->node()->node_id().peer_id, cached);
+
+    // A follower redirects the batch to the leader
+    for (size_t i = 0; i < ARRAY_SIZE(kPorts); ++i) {
+        if (&nodes[i] != leader) {
+            braft::rtb::update_leader("batch", nodes[i].node()->node_id().peer_id);
+            break;
+        }
+    }
+    submit_and_check(&client, 10);
+    ASSERT_EQ(0, braft::rtb::select_leader("batch", &cached));
+    ASSERT_EQ(leader->node()->node_id().peer_id, cached);
+
+    // The cached leader is unreachable, so the batch is resent after the
+    // leader is refreshed
+    braft::rtb::update_leader("batch",
+            braft::PeerId(butil::EndPoint(butil::my_ip(), 5703), 0));
+    submit_and_check(&client, 10);
+
+    ASSERT_EQ(120, leader->fsm().applied_ops());
+    braft::rtb::remove_group("batch");
+}
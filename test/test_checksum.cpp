@@ -34,8 +34,37 @@ TEST_F(ChecksumTest, benchmark) {
     timer.stop();
     const long crc_elp = timer.u_elapsed();
 
+    timer.start();
+    for (size_t i = 0; i < N; ++i) {
+        braft::crc32(data, sizeof(data));
+    }
+    timer.stop();
+    const long raft_crc_elp = timer.u_elapsed();
+
     LOG(INFO) << "murmurhash32_TP=" << sizeof(data) * N / (double)mur_elp << "MB/s"
-              << " base_crc32_TP=" << sizeof(data) * N / (double)crc_elp << "MB/s";
-    LOG(INFO) << "base_is_fast_crc32_support=" << butil::crc32c::IsFastCrc32Supported();
+              << " base_crc32_TP=" << sizeof(data) * N / (double)crc_elp << "MB/s"
+              << " raft_crc32_TP=" << sizeof(data) * N / (double)raft_crc_elp << "MB/s";
+    LOG(INFO) << "base_is_fast_crc32_support=" << butil::crc32c::IsFastCrc32Supported()
+              << " raft_is_fast_crc32_support=" << braft::is_fast_crc32c_supported();
 
 }
+
+TEST_F(ChecksumTest, crc32c_matches_butil) {
+    char data[4096 + 7];
+    for (size_t i = 0; i < ARRAY_SIZE(data); ++i) {
+        data[i] = butil::fast_rand_in('a', 'z');
+    }
+    // Unaligned heads and tails of all lengths
+    for (size_t off = 0; off < 8; ++off) {
+        for (size_t len = 0; len + off <= ARRAY_SIZE(data); len += 61) {
+            ASSERT_EQ(butil::crc32c::Value(data + off, len),
+                      braft::crc32(data + off, len));
+            ASSERT_EQ(butil::crc32c::Extend(12345, data + off, len),
+                      braft::crc32c_extend(12345, data + off, len));
+        }
+    }
+    butil::IOBuf buf;
+    buf.append(data, 100);
+    buf.append(data + 100, sizeof(data) - 100);
+    ASSERT_EQ(butil::crc32c::Value(data, sizeof(data)), braft::crc32(buf));
+}
@@ -10,6 +10,7 @@
 #include "braft/raft.h"
 #include "braft/cli.h"
 #include "braft/node.h"
+#include "braft/route_table.h"
 
 class CliTest : public testing::Test {
 public:
@@ -196,3 +197,67 @@ TEST_F(CliTest, change_peer) {
     }
 }
 
+
+TEST_F(CliTest, refresh_leaders) {
+    RaftNode node1;
+    ASSERT_EQ(0, node1.start(9520, true));
+    braft::Configuration conf;
+    conf.add_peer(node1.peer_id());
+    // The RPC to the absent peer fails, which doesn't matter
+    conf.add_peer(braft::PeerId("127.0.0.1:9521"));
+    ASSERT_EQ(0, braft::rtb::update_configuration("test", conf));
+    std::vector<braft::GroupId> groups;
+    groups.push_back("test");
+    butil::Status st;
+    for (int i = 0; i < 50; ++i) {
+        braft::SynchronizedClosure done;
+        braft::rtb::refresh_leaders(groups, 500, &done);
+        done.wait();
+        st = done.status();
+        if (st.ok()) {
+            break;
+        }
+        ASSERT_EQ(EAGAIN, st.error_code()) << st;
+        usleep(100 * 1000);
+    }
+    ASSERT_TRUE(st.ok()) << st;
+    braft::PeerId leader;
+    ASSERT_EQ(0, braft::rtb::select_leader("test", &leader));
+    ASSERT_EQ(node1.peer_id(), leader);
+
+    groups.push_back("not_registered");
+    braft::SynchronizedClosure done;
+    braft::rtb::refresh_leaders(groups, 500, &done);
+    done.wait();
+    ASSERT_EQ(ENOENT, done.status().error_code());
+    braft::rtb::remove_group("test");
+}
+
+TEST_F(CliTest, refresh_leaders_prefers_self_reported_leader) {
+    RaftNode node1;
+    ASSERT_EQ(0, node1.start(9522, true));
+    RaftNode node2;
+    ASSERT_EQ(0, node2.start(9523, false));
+    braft::Configuration conf;
+    conf.add_peer(node1.peer_id());
+    conf.add_peer(node2.peer_id());
+    ASSERT_EQ(0, braft::rtb::update_configuration("test", conf));
+    std::vector<braft::GroupId> groups;
+    groups.push_back("test");
+    while (!node1._node->is_leader()) {
+        usleep(100 * 1000);
+    }
+    // node2 has no configuration and keeps this stale leader forever
+    node2._node->_impl->_leader_id = braft::PeerId("127.0.0.1:9524");
+    for (int i = 0; i < 10; ++i) {
+        braft::rtb::update_leader("test", braft::PeerId());
+        braft::SynchronizedClosure done;
+        braft::rtb::refresh_leaders(groups, 500, &done);
+        done.wait();
+        ASSERT_TRUE(done.status().ok()) << done.status();
+        braft::PeerId leader;
+        ASSERT_EQ(0, braft::rtb::select_leader("test", &leader));
+        ASSERT_EQ(node1.peer_id(), leader);
+    }
+    braft::rtb::remove_group("test");
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include <bthread/countdown_event.h>
+#include "braft/closure_queue.h"
+#include "braft/raft.h"
+
+class ClosureQueueTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+class CountedClosure : public braft::Closure {
+public:
+    CountedClosure(int64_t index, bthread::CountdownEvent* event)
+        : _index(index), _event(event) {}
+    void Run() {
+        ASSERT_FALSE(status().ok());
+        _event->signal();
+    }
+    int64_t _index;
+private:
+    bthread::CountdownEvent* _event;
+};
+
+TEST_F(ClosureQueueTest, wrap_around) {
+    braft::ClosureQueue queue(false);
+    queue.reset_first_index(1);
+    int64_t next_index = 1;
+    int64_t expected_index = 1;
+    bthread::CountdownEvent event(0);
+    std::vector<CountedClosure*> closures;
+    // Pop less than appended every round so that the ring grows and the
+    // closures wrap around its end
+    for (int round = 0; round < 100; ++round) {
+        for (int i = 0; i < 7; ++i) {
+            CountedClosure* c = (next_index % 3 == 0) ? NULL
+                    : new CountedClosure(next_index, &event);
+            queue.append_pending_closure(c);
+            closures.push_back(c);
+            ++next_index;
+        }
+        std::vector<braft::Closure*> out;
+        int64_t out_first_index = 0;
+        const int64_t index = expected_index + 4;
+        ASSERT_EQ(0, queue.pop_closure_until(index, &out, &out_first_index));
+        ASSERT_EQ(expected_index, out_first_index);
+        ASSERT_EQ(5u, out.size());
+        for (size_t i = 0; i < out.size(); ++i) {
+            ASSERT_EQ(closures[expected_index - 1 + i], out[i]);
+            delete out[i];
+        }
+        expected_index = index + 1;
+    }
+    // The rest are failed by clear() in one bthread
+    int rest = 0;
+    for (int64_t i = expected_index; i < next_index; ++i) {
+        if (closures[i - 1]) {
+            ++rest;
+        }
+    }
+    event.reset(rest);
+    queue.clear();
+    ASSERT_EQ(0, event.wait());
+    for (int64_t i = expected_index; i < next_index; ++i) {
+        delete closures[i - 1];
+    }
+    std::vector<braft::Closure*> out;
+    int64_t out_first_index = 0;
+    ASSERT_EQ(0, queue.pop_closure_until(next_index, &out, &out_first_index));
+    ASSERT_TRUE(out.empty());
+}
@@ -51,6 +51,15 @@ TEST_F(TestUsageSuits, PeerId) {
 
     braft::PeerId id3("1.2.3.4:1000:0");
     LOG(NOTICE) << "id:" << id3;
+
+    braft::PeerId witness("1.2.3.4:1000:0:1");
+    ASSERT_TRUE(witness.is_witness());
+    ASSERT_FALSE(id3.is_witness());
+    ASSERT_EQ("1.2.3.4:1000:0:1", witness.to_string());
+    ASSERT_EQ("1.2.3.4:1000:0", id3.to_string());
+    // Role doesn't make a different peer
+    ASSERT_TRUE(witness == id3);
+    ASSERT_NE(0, id1.parse("1.2.3.4:1000:0:2"));
 }
 
 TEST_F(TestUsageSuits, Configuration) {
@@ -130,3 +139,62 @@ TEST_F(TestUsageSuits, ConfigurationManager) {
     ASSERT_EQ(braft::LogId(0, 0), conf_manager.last_configuration().id);
 
 }
+
+TEST_F(TestUsageSuits, ConfigurationCopyOnWrite) {
+    braft::Configuration conf;
+    ASSERT_EQ(0, conf.parse_from("1.1.1.1:1000:0,1.1.1.1:1000:1"));
+    braft::Configuration copy = conf;
+    ASSERT_EQ(conf.begin(), copy.begin());
+    ASSERT_TRUE(copy.add_peer(braft::PeerId("1.1.1.1:1000:2")));
+    ASSERT_EQ(2u, conf.size());
+    ASSERT_EQ(3u, copy.size());
+    ASSERT_FALSE(copy.add_peer(braft::PeerId("1.1.1.1:1000:2")));
+    ASSERT_TRUE(conf.remove_peer(braft::PeerId("1.1.1.1:1000:0")));
+    ASSERT_EQ(1u, conf.size());
+    ASSERT_TRUE(copy.contains(braft::PeerId("1.1.1.1:1000:0")));
+
+    braft::Configuration included;
+    braft::Configuration excluded;
+    copy.diffs(conf, &included, &excluded);
+    ASSERT_EQ(2u, included.size());
+    ASSERT_TRUE(excluded.empty());
+    ASSERT_EQ(3u, copy.size());
+    ASSERT_EQ(1u, conf.size());
+}
+
+TEST_F(TestUsageSuits, ConfigurationManagerGet) {
+    braft::ConfigurationManager conf_manager;
+    braft::ConfigurationEntry snapshot;
+    snapshot.id = braft::LogId(10, 1);
+    snapshot.conf.parse_from("1.1.1.1:1000:0");
+    conf_manager.set_snapshot(snapshot);
+    braft::Configuration conf = snapshot.conf;
+    for (int i = 1; i <= 100; ++i) {
+        braft::ConfigurationEntry entry;
+        entry.id = braft::LogId(10 + i * 10, 1);
+        if (i % 2 == 1) {
+            // joint configuration
+            entry.old_conf = conf;
+            conf.add_peer(braft::PeerId(butil::EndPoint(butil::IP_ANY, i)));
+        }
+        entry.conf = conf;
+        ASSERT_EQ(0, conf_manager.add(entry));
+    }
+    braft::ConfigurationEntry entry;
+    conf_manager.get(15, &entry);
+    ASSERT_EQ(braft::LogId(10, 1), entry.id);
+    for (int i = 1; i <= 100; ++i) {
+        conf_manager.get(10 + i * 10, &entry);
+        ASSERT_EQ(10 + i * 10, entry.id.index);
+        conf_manager.get(10 + i * 10 + 9, &entry);
+        ASSERT_EQ(10 + i * 10, entry.id.index);
+        ASSERT_EQ((size_t)(1 + (i + 1) / 2), entry.conf.size());
+    }
+    // The conf of a joint configuration is shared by the next one
+    braft::ConfigurationEntry joint;
+    braft::ConfigurationEntry next;
+    conf_manager.get(20, &joint);
+    conf_manager.get(30, &next);
+    ASSERT_FALSE(joint.stable());
+    ASSERT_EQ(joint.conf.begin(), next.conf.begin());
+}
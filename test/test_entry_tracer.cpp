@@ -0,0 +1,59 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+#include <bvar/bvar.h>
+#include "braft/entry_tracer.h"
+
+class EntryTracerTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {
+        braft::FLAGS_raft_entry_trace_sample_rate = 0;
+    }
+};
+
+TEST_F(EntryTracerTest, sample) {
+    braft::FLAGS_raft_entry_trace_sample_rate = 0;
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQ(0, braft::EntryTracer::sample());
+    }
+    braft::FLAGS_raft_entry_trace_sample_rate = 1;
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_NE(0, braft::EntryTracer::sample());
+    }
+}
+
+TEST_F(EntryTracerTest, stages) {
+    braft::FLAGS_raft_entry_trace_sample_rate = 1;
+    braft::EntryTracer tracer;
+    ASSERT_TRUE(tracer.empty());
+    const int64_t start_us = braft::EntryTracer::sample();
+    tracer.on_appended(10, start_us);
+    tracer.on_appended(12, start_us);
+    ASSERT_FALSE(tracer.empty());
+    tracer.on_stable(10, 12, start_us);
+    tracer.on_replicated(10, 11);
+    tracer.on_committed(11);
+    tracer.on_applying(11);
+    tracer.on_applied(11);
+    // Log 12 is not applied yet
+    ASSERT_FALSE(tracer.empty());
+    std::string total;
+    ASSERT_EQ(0, bvar::Variable::describe_exposed(
+                        "raft_entry_trace_total_count", &total));
+    ASSERT_NE("0", total);
+    tracer.reset();
+    ASSERT_TRUE(tracer.empty());
+}
@@ -16,6 +16,8 @@
 
 namespace braft {
 DECLARE_bool(raft_file_check_hole);
+DECLARE_bool(raft_file_read_mmap);
+DECLARE_bool(raft_file_read_sequential);
 }
 
 int g_port = 0;
@@ -125,4 +127,26 @@ TEST_F(FileServiceTest, hole_file) {
     ASSERT_EQ(0, copier.copy_to_file("hole.data", "./c/hole.data", NULL));
     ret = system("diff ./a/hole.data ./c/hole.data");
     ASSERT_EQ(0, ret);
+
+    braft::FLAGS_raft_file_read_mmap = true;
+    ASSERT_EQ(0, system("rm -rf d"));
+    ASSERT_TRUE(butil::CreateDirectory(butil::FilePath("./d")));
+    ASSERT_EQ(0, copier.copy_to_file("hole.data", "./d/hole.data", NULL));
+    ret = system("diff ./a/hole.data ./d/hole.data");
+    ASSERT_EQ(0, ret);
+    braft::FLAGS_raft_file_read_mmap = false;
+
+    braft::FLAGS_raft_file_read_sequential = true;
+    ASSERT_EQ(0, system("rm -rf e"));
+    ASSERT_TRUE(butil::CreateDirectory(butil::FilePath("./e")));
+    ASSERT_EQ(0, copier.copy_to_file("hole.data", "./e/hole.data", NULL));
+    ret = system("diff ./a/hole.data ./e/hole.data");
+    ASSERT_EQ(0, ret);
+    braft::FLAGS_raft_file_check_hole = false;
+    ASSERT_EQ(0, system("rm -rf f"));
+    ASSERT_TRUE(butil::CreateDirectory(butil::FilePath("./f")));
+    ASSERT_EQ(0, copier.copy_to_file("hole.data", "./f/hole.data", NULL));
+    ret = system("diff ./a/hole.data ./f/hole.data");
+    ASSERT_EQ(0, ret);
+    braft::FLAGS_raft_file_read_sequential = false;
 }
@@ -5,6 +5,7 @@
 // Date: 2017/06/16 10:29:05
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "braft/file_system_adaptor.h"
 
 class TestFileSystemAdaptorSuits : public testing::Test {
@@ -176,3 +177,123 @@ TEST_F(TestFileSystemAdaptorSuits, create_sub_directory) {
     ASSERT_FALSE(braft::create_sub_directory(parent_path, "../sub4/sub5", fs, NULL));
     ::system("rm -rf test_dir");
 }
+
+TEST_F(TestFileSystemAdaptorSuits, read_mapped_and_seek_data) {
+    ::system("rm -f test_file");
+    scoped_refptr<braft::FileSystemAdaptor> fs = new braft::PosixFileSystemAdaptor();
+    butil::File::Error e;
+    braft::FileAdaptor* file = fs->open("test_file", O_CREAT | O_TRUNC | O_RDWR, NULL, &e);
+    ASSERT_TRUE(file != NULL);
+    const off_t hole_end = 1024 * 1024;
+    butil::IOBuf data;
+    data.append("hello");
+    ASSERT_EQ(data.size(), file->write(data, 0));
+    data.clear();
+    data.append("world");
+    ASSERT_EQ(data.size(), file->write(data, hole_end));
+
+    butil::IOBuf out;
+    ASSERT_EQ(2, file->read_mapped(&out, 3, 2));
+    ASSERT_EQ("lo", out.to_string());
+    out.clear();
+    ASSERT_EQ(5, file->read_mapped(&out, hole_end, 100));
+    ASSERT_EQ("world", out.to_string());
+    out.clear();
+    ASSERT_EQ(0, file->read_mapped(&out, hole_end + 5, 100));
+    ASSERT_TRUE(out.empty());
+
+    // The data regions cover the data, the holes depend on the file system
+    off_t data_begin = -1;
+    off_t data_end = -1;
+    ASSERT_EQ(0, file->seek_data(0, &data_begin, &data_end));
+    ASSERT_EQ(0, data_begin);
+    ASSERT_GE(data_end, 5);
+    ASSERT_EQ(0, file->seek_data(data_end - 1, &data_begin, &data_end));
+    if (data_end < hole_end) {
+        ASSERT_EQ(0, file->seek_data(data_end, &data_begin, &data_end));
+    }
+    ASSERT_LE(data_begin, hole_end);
+    ASSERT_EQ(hole_end + 5, data_end);
+    ASSERT_EQ(1, file->seek_data(hole_end + 5, &data_begin, &data_end));
+    delete file;
+    ::system("rm -f test_file");
+}
+
+TEST_F(TestFileSystemAdaptorSuits, read_and_write_in_io_threads) {
+    ::system("rm -f test_file");
+    const int32_t saved_io_threads = braft::FLAGS_raft_file_io_threads;
+    scoped_refptr<braft::FileSystemAdaptor> fs = new braft::PosixFileSystemAdaptor();
+    butil::File::Error e;
+    braft::FileAdaptor* file = fs->open("test_file", O_CREAT | O_TRUNC | O_RDWR, NULL, &e);
+    ASSERT_TRUE(file != NULL);
+    for (int io_threads = 0; io_threads <= 2; io_threads += 2) {
+        braft::FLAGS_raft_file_io_threads = io_threads;
+        butil::IOBuf data;
+        data.append("hello world");
+        ASSERT_EQ((ssize_t)data.size(), braft::write_and_wait(file, data, 5));
+        butil::IOPortal portal;
+        ASSERT_EQ(5, braft::read_and_wait(file, &portal, 11, 100));
+        ASSERT_EQ("world", portal.to_string());
+        portal.clear();
+        ASSERT_EQ(0, braft::read_and_wait(file, &portal, 100, 10));
+    }
+    delete file;
+
+    // Failures are reported through the closure as well
+    file = fs->open("test_file", O_RDONLY, NULL, &e);
+    ASSERT_TRUE(file != NULL);
+    butil::IOBuf data;
+    data.append("x");
+    ASSERT_EQ(-1, braft::write_and_wait(file, data, 0));
+    delete file;
+    braft::FLAGS_raft_file_io_threads = saved_io_threads;
+    ::system("rm -f test_file");
+}
+
+TEST_F(TestFileSystemAdaptorSuits, buffered_file) {
+    ::system("rm -f test_file");
+    scoped_refptr<braft::FileSystemAdaptor> fs = new braft::PosixFileSystemAdaptor();
+    for (int direct = 0; direct < 2; ++direct) {
+        braft::BufferedFileOptions options;
+        options.buffer_size = 3 * braft::BufferedFileAdaptor::DIRECT_IO_ALIGN;
+        options.use_direct_io = direct;
+        butil::File::Error e;
+        braft::FileAdaptor* file = braft::open_buffered_file(
+                fs, "test_file", O_CREAT | O_TRUNC | O_RDWR, NULL, options, &e);
+        ASSERT_TRUE(file != NULL);
+        std::string expected;
+        for (int i = 0; i < 100; ++i) {
+            const std::string piece(1000, 'a' + i % 26);
+            butil::IOBuf data;
+            data.append(piece);
+            ASSERT_EQ((ssize_t)piece.size(), file->write(data, expected.size()));
+            expected.append(piece);
+        }
+        // Non-sequential writes flush the buffer first
+        butil::IOBuf data;
+        data.append("hello");
+        ASSERT_EQ(5, file->write(data, 10));
+        expected.replace(10, 5, "hello");
+        ASSERT_EQ((ssize_t)expected.size(), file->size());
+        butil::IOPortal portal;
+        ASSERT_EQ((ssize_t)expected.size(),
+                  file->read(&portal, 0, expected.size() + 1));
+        ASSERT_EQ(expected, portal.to_string());
+        data.clear();
+        data.append("world");
+        ASSERT_EQ(5, file->write(data, expected.size()));
+        expected.append("world");
+        ASSERT_TRUE(file->sync());
+        ASSERT_TRUE(file->close());
+        delete file;
+
+        file = fs->open("test_file", O_RDONLY, NULL, &e);
+        ASSERT_TRUE(file != NULL);
+        portal.clear();
+        ASSERT_EQ((ssize_t)expected.size(),
+                  file->read(&portal, 0, expected.size() + 1));
+        ASSERT_EQ(expected, portal.to_string());
+        delete file;
+    }
+    ::system("rm -f test_file");
+}
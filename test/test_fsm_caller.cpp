@@ -11,6 +11,7 @@
 #include "braft/log.h"
 #include "braft/configuration.h"
 #include "braft/log_manager.h"
+#include "braft/util.h"
 
 class FSMCallerTest : public testing::Test {
 protected:
@@ -146,6 +147,142 @@ TEST_F(FSMCallerTest, sanity) {
     ASSERT_EQ(fsm._expected_next, N);
 }
 
+namespace braft {
+DECLARE_int32(raft_fsm_fetch_entries);
+}
+
+TEST_F(FSMCallerTest, replay_from_storage) {
+    system("rm -rf ./data");
+    const size_t N = 1000;
+    {
+        scoped_ptr<braft::ConfigurationManager> cm(
+                                    new braft::ConfigurationManager);
+        scoped_ptr<braft::SegmentLogStorage> storage(
+                                    new braft::SegmentLogStorage("./data"));
+        scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+        braft::LogManagerOptions log_opt;
+        log_opt.log_storage = storage.get();
+        log_opt.configuration_manager = cm.get();
+        ASSERT_EQ(0, lm->init(log_opt));
+        for (size_t i = 0; i < N; ++i) {
+            std::vector<braft::LogEntry*> entries;
+            braft::LogEntry* entry = new braft::LogEntry;
+            entry->AddRef();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            std::string buf;
+            butil::string_printf(&buf, "hello_%lld", (long long)i);
+            entry->data.append(buf);
+            entry->id.index = i + 1;
+            entry->id.term = 1;
+            entries.push_back(entry);
+            SyncClosure c;
+            lm->append_entries(&entries, &c);
+            c.join();
+            ASSERT_TRUE(c.status().ok()) << c.status();
+        }
+    }
+    // Restart and replay the logs from the storage in small chunks
+    const int32_t saved_fetch_entries = braft::FLAGS_raft_fsm_fetch_entries;
+    braft::FLAGS_raft_fsm_fetch_entries = 7;
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+    ASSERT_EQ((int64_t)N, lm->last_log_index());
+    ASSERT_FALSE(lm->in_memory(1));
+
+    braft::ClosureQueue cq(false);
+    OrderedStateMachine fsm;
+    braft::FSMCallerOptions opt;
+    opt.log_manager = lm.get();
+    opt.after_shutdown = NULL;
+    opt.fsm = &fsm;
+    opt.closure_queue = &cq;
+    braft::FSMCaller caller;
+    ASSERT_EQ(0, caller.init(opt));
+    ASSERT_EQ(0, caller.on_committed(N));
+    ASSERT_EQ(0, caller.shutdown());
+    fsm.join();
+    braft::FLAGS_raft_fsm_fetch_entries = saved_fetch_entries;
+    ASSERT_EQ(N, fsm._expected_next);
+    ASSERT_EQ((int64_t)N, caller.last_applied_index());
+}
+
+class PersistentStateMachine : public OrderedStateMachine {
+public:
+    explicit PersistentStateMachine(int64_t applied_index)
+        : _applied_index(applied_index) {}
+    int64_t on_applied_index_load() {
+        return _applied_index;
+    }
+private:
+    int64_t _applied_index;
+};
+
+TEST_F(FSMCallerTest, load_applied_index) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+    const size_t N = 100;
+    for (size_t i = 0; i < N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        std::string buf;
+        butil::string_printf(&buf, "hello_%lld", (long long)i);
+        entry->data.append(buf);
+        entry->id.index = i + 1;
+        entry->id.term = 1;
+        entries.push_back(entry);
+        SyncClosure c;
+        lm->append_entries(&entries, &c);
+        c.join();
+        ASSERT_TRUE(c.status().ok()) << c.status();
+    }
+
+    braft::ClosureQueue cq(false);
+    braft::FSMCallerOptions opt;
+    opt.log_manager = lm.get();
+    opt.after_shutdown = NULL;
+    opt.closure_queue = &cq;
+    {
+        // Ahead of the logs
+        PersistentStateMachine fsm(N + 1);
+        opt.fsm = &fsm;
+        braft::FSMCaller caller;
+        ASSERT_EQ(0, caller.init(opt));
+        ASSERT_NE(0, caller.load_applied_index());
+        ASSERT_EQ(0, caller.shutdown());
+        fsm.join();
+    }
+    PersistentStateMachine fsm(N / 2);
+    opt.fsm = &fsm;
+    braft::FSMCaller caller;
+    ASSERT_EQ(0, caller.init(opt));
+    ASSERT_EQ(0, caller.load_applied_index());
+    ASSERT_EQ((int64_t)N / 2, caller.last_applied_index());
+    // Only the logs after the applied index are applied
+    fsm._expected_next = N / 2;
+    ASSERT_EQ(0, caller.on_committed(N));
+    ASSERT_EQ(0, caller.shutdown());
+    fsm.join();
+    ASSERT_EQ(N, fsm._expected_next);
+    ASSERT_EQ((int64_t)N, caller.last_applied_index());
+}
+
 TEST_F(FSMCallerTest, on_leader_start_and_stop) {
     scoped_ptr<braft::LogManager> lm(new braft::LogManager());
     OrderedStateMachine fsm;
@@ -286,3 +423,444 @@ TEST_F(FSMCallerTest, snapshot) {
     ASSERT_EQ(1, load_snapshot_done._start_times);
 }
 
+
+class PartitionedStateMachine : public braft::ParallelStateMachine {
+public:
+    static const int LANE_NUM = 4;
+    static const int KEY_NUM = 16;
+
+    PartitionedStateMachine()
+        : _next_seqs(KEY_NUM, 0), _applied(0), _running_lanes(0)
+        , _max_running_lanes(0), _barriers(0), _applied_on_snapshot(0)
+        , _stopped(false) {}
+    int lane_num() const { return LANE_NUM; }
+    void on_apply_lane(int lane, braft::Iterator& iter) {
+        const int running = _running_lanes.fetch_add(1) + 1;
+        int max_running = _max_running_lanes.load();
+        while (running > max_running &&
+                !_max_running_lanes.compare_exchange_weak(max_running, running)) {}
+        for (; iter.valid(); iter.next()) {
+            const int64_t key = iter.partition_key();
+            ASSERT_EQ(lane, key % LANE_NUM);
+            std::string expected;
+            butil::string_printf(&expected, "%" PRId64 "_%" PRId64,
+                                 key, _next_seqs[key]++);
+            ASSERT_EQ(expected, iter.data().to_string());
+            _applied.fetch_add(1);
+            bthread_usleep(100);
+        }
+        _running_lanes.fetch_sub(1);
+    }
+    void on_apply(braft::Iterator& iter) {
+        for (; iter.valid(); iter.next()) {
+            ASSERT_EQ(-1, iter.partition_key());
+            // All the tasks before are applied by the lanes
+            ASSERT_EQ(0, _running_lanes.load());
+            ASSERT_EQ(iter.data().to_string(),
+                      butil::string_printf("barrier_%d", _applied.load()));
+            ++_barriers;
+        }
+    }
+    void on_snapshot_save(braft::SnapshotWriter* /*writer*/, braft::Closure* done) {
+        ASSERT_EQ(0, _running_lanes.load());
+        _applied_on_snapshot = _applied.load();
+        done->Run();
+    }
+    void on_shutdown() {
+        _stopped = true;
+    }
+    void join() {
+        while (!_stopped) {
+            bthread_usleep(100);
+        }
+    }
+
+    std::vector<int64_t> _next_seqs;
+    butil::atomic<int> _applied;
+    butil::atomic<int> _running_lanes;
+    butil::atomic<int> _max_running_lanes;
+    int _barriers;
+    int _applied_on_snapshot;
+    bool _stopped;
+};
+
+TEST_F(FSMCallerTest, parallel_apply) {
+    braft::SnapshotMeta snapshot_meta;
+    // Saved after all the logs are applied
+    snapshot_meta.set_last_included_index(1000);
+    snapshot_meta.set_last_included_term(1);
+    DummySnapshoWriter dummy_writer;
+    MockSaveSnapshotClosure save_snapshot_done(&dummy_writer, &snapshot_meta);
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+
+    braft::ClosureQueue cq(false);
+    PartitionedStateMachine fsm;
+    braft::FSMCallerOptions opt;
+    opt.log_manager = lm.get();
+    opt.after_shutdown = NULL;
+    opt.fsm = &fsm;
+    opt.closure_queue = &cq;
+    braft::FSMCaller caller;
+    ASSERT_EQ(0, caller.init(opt));
+
+    // Every 100 tasks with keys are followed by a task without key
+    const int N = 1000;
+    std::vector<int64_t> seqs(PartitionedStateMachine::KEY_NUM, 0);
+    int keyed = 0;
+    for (int i = 0; i < N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->id.index = i + 1;
+        entry->id.term = 1;
+        if (i % 101 == 100) {
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->data.append(butil::string_printf("barrier_%d", keyed));
+        } else {
+            const int64_t key = i % PartitionedStateMachine::KEY_NUM;
+            butil::IOBuf data;
+            data.append(butil::string_printf("%" PRId64 "_%" PRId64,
+                                             key, seqs[key]++));
+            entry->type = braft::ENTRY_TYPE_PARTITIONED_DATA;
+            braft::serialize_partitioned_data(key, &data, &entry->data);
+            ++keyed;
+        }
+        entries.push_back(entry);
+        SyncClosure c;
+        lm->append_entries(&entries, &c);
+        c.join();
+        ASSERT_TRUE(c.status().ok()) << c.status();
+    }
+    ASSERT_EQ(0, caller.on_committed(N));
+    ASSERT_EQ(0, caller.on_snapshot_save(&save_snapshot_done));
+    ASSERT_EQ(0, caller.shutdown());
+    fsm.join();
+    ASSERT_EQ(keyed, fsm._applied.load());
+    ASSERT_EQ(keyed, fsm._applied_on_snapshot);
+    ASSERT_EQ(N - keyed, fsm._barriers);
+    ASSERT_EQ(seqs, fsm._next_seqs);
+    ASSERT_GT(fsm._max_running_lanes.load(), 1);
+    ASSERT_EQ(N, caller.last_applied_index());
+}
+
+class TicketStateMachine : public braft::StateMachine {
+public:
+    TicketStateMachine() : _applied(0), _snapshot_saved(false), _stopped(false) {}
+    void on_apply(braft::Iterator& iter) {
+        braft::Closure* ticket = iter.ticket();
+        ASSERT_TRUE(ticket != NULL);
+        ASSERT_EQ(ticket, iter.ticket());
+        for (; iter.valid(); iter.next()) {
+            ++_applied;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        _tickets.push_back(ticket);
+    }
+    void on_snapshot_save(braft::SnapshotWriter* /*writer*/, braft::Closure* done) {
+        _snapshot_saved = true;
+        done->Run();
+    }
+    void on_shutdown() {
+        _stopped = true;
+    }
+    void join() {
+        while (!_stopped) {
+            bthread_usleep(100);
+        }
+    }
+    braft::Closure* wait_ticket(size_t i) {
+        while (true) {
+            {
+                BAIDU_SCOPED_LOCK(_mutex);
+                if (_tickets.size() > i) {
+                    return _tickets[i];
+                }
+            }
+            bthread_usleep(100);
+        }
+    }
+
+    int _applied;
+    bool _snapshot_saved;
+    bool _stopped;
+    braft::raft_mutex_t _mutex;
+    std::vector<braft::Closure*> _tickets;
+};
+
+TEST_F(FSMCallerTest, apply_ticket) {
+    braft::SnapshotMeta snapshot_meta;
+    snapshot_meta.set_last_included_index(15);
+    snapshot_meta.set_last_included_term(1);
+    DummySnapshoWriter dummy_writer;
+    MockSaveSnapshotClosure save_snapshot_done(&dummy_writer, &snapshot_meta);
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+
+    braft::ClosureQueue cq(false);
+    TicketStateMachine fsm;
+    braft::FSMCallerOptions opt;
+    opt.log_manager = lm.get();
+    opt.after_shutdown = NULL;
+    opt.fsm = &fsm;
+    opt.closure_queue = &cq;
+    braft::FSMCaller caller;
+    ASSERT_EQ(0, caller.init(opt));
+
+    for (int i = 0; i < 15; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append("hello");
+        entry->id.index = i + 1;
+        entry->id.term = 1;
+        entries.push_back(entry);
+        SyncClosure c;
+        lm->append_entries(&entries, &c);
+        c.join();
+        ASSERT_TRUE(c.status().ok()) << c.status();
+    }
+    ASSERT_EQ(0, caller.on_committed(5));
+    braft::Closure* ticket0 = fsm.wait_ticket(0);
+    ASSERT_EQ(0, caller.on_committed(10));
+    braft::Closure* ticket1 = fsm.wait_ticket(1);
+    ASSERT_EQ(10, fsm._applied);
+    ASSERT_EQ(0, caller.last_applied_index());
+
+    // Tickets are done out of order
+    ticket1->Run();
+    usleep(10 * 1000);
+    ASSERT_EQ(0, caller.last_applied_index());
+    ticket0->Run();
+    ASSERT_EQ(10, caller.last_applied_index());
+
+    // Snapshot waits for the tickets
+    ASSERT_EQ(0, caller.on_committed(15));
+    braft::Closure* ticket2 = fsm.wait_ticket(2);
+    ASSERT_EQ(0, caller.on_snapshot_save(&save_snapshot_done));
+    usleep(10 * 1000);
+    ASSERT_FALSE(fsm._snapshot_saved);
+    ticket2->Run();
+    ASSERT_EQ(0, caller.shutdown());
+    fsm.join();
+    ASSERT_TRUE(fsm._snapshot_saved);
+    ASSERT_EQ(15, caller.last_applied_index());
+}
+
+class FrozenView : public braft::SnapshotHook {
+public:
+    FrozenView(int applied, butil::atomic<bool>* released, int* saved)
+        : _applied(applied), _released(released), _saved(saved) {}
+    int save(braft::SnapshotWriter* /*writer*/) {
+        while (!_released->load()) {
+            bthread_usleep(100);
+        }
+        *_saved = _applied;
+        return 0;
+    }
+private:
+    int _applied;
+    butil::atomic<bool>* _released;
+    int* _saved;
+};
+
+class FreezingStateMachine : public braft::StateMachine {
+public:
+    FreezingStateMachine()
+        : _applied(0), _released(false), _saved(-1), _stopped(false) {}
+    void on_apply(braft::Iterator& iter) {
+        for (; iter.valid(); iter.next()) {
+            ++_applied;
+        }
+    }
+    braft::SnapshotHook* on_snapshot_freeze() {
+        return new FrozenView(_applied.load(), &_released, &_saved);
+    }
+    void on_snapshot_save(braft::SnapshotWriter* /*writer*/, braft::Closure* done) {
+        ADD_FAILURE() << "Should never be called";
+        done->Run();
+    }
+    void on_shutdown() {
+        _stopped = true;
+    }
+    void join() {
+        while (!_stopped) {
+            bthread_usleep(100);
+        }
+    }
+
+    butil::atomic<int> _applied;
+    butil::atomic<bool> _released;
+    int _saved;
+    bool _stopped;
+};
+
+class SaveHookClosure : public MockSaveSnapshotClosure {
+public:
+    SaveHookClosure(braft::SnapshotWriter* writer,
+                    braft::SnapshotMeta *expected_meta)
+        : MockSaveSnapshotClosure(writer, expected_meta), _done(false) {}
+    void Run() {
+        MockSaveSnapshotClosure::Run();
+        _done = true;
+    }
+    butil::atomic<bool> _done;
+};
+
+TEST_F(FSMCallerTest, snapshot_hook) {
+    braft::SnapshotMeta snapshot_meta;
+    snapshot_meta.set_last_included_index(5);
+    snapshot_meta.set_last_included_term(1);
+    DummySnapshoWriter dummy_writer;
+    SaveHookClosure save_snapshot_done(&dummy_writer, &snapshot_meta);
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+
+    braft::ClosureQueue cq(false);
+    FreezingStateMachine fsm;
+    braft::FSMCallerOptions opt;
+    opt.log_manager = lm.get();
+    opt.after_shutdown = NULL;
+    opt.fsm = &fsm;
+    opt.closure_queue = &cq;
+    braft::FSMCaller caller;
+    ASSERT_EQ(0, caller.init(opt));
+
+    for (int i = 0; i < 10; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append("hello");
+        entry->id.index = i + 1;
+        entry->id.term = 1;
+        entries.push_back(entry);
+        SyncClosure c;
+        lm->append_entries(&entries, &c);
+        c.join();
+        ASSERT_TRUE(c.status().ok()) << c.status();
+    }
+    ASSERT_EQ(0, caller.on_committed(5));
+    ASSERT_EQ(0, caller.on_snapshot_save(&save_snapshot_done));
+    // Applying goes on while the frozen view is being saved
+    ASSERT_EQ(0, caller.on_committed(10));
+    while (caller.last_applied_index() != 10) {
+        bthread_usleep(100);
+    }
+    ASSERT_FALSE(save_snapshot_done._done);
+    fsm._released = true;
+    while (!save_snapshot_done._done) {
+        bthread_usleep(100);
+    }
+    ASSERT_EQ(5, fsm._saved);
+    ASSERT_EQ(0, caller.shutdown());
+    fsm.join();
+}
+
+// Fails the log at |fail_index|
+class FailingStateMachine : public braft::StateMachine {
+public:
+    explicit FailingStateMachine(int64_t fail_index)
+        : _fail_index(fail_index), _stopped(false) {}
+    void on_apply(braft::Iterator& iter) {
+        for (; iter.valid(); iter.next()) {
+            if (iter.index() == _fail_index) {
+                iter.set_error_and_rollback();
+                return;
+            }
+        }
+    }
+    void on_shutdown() {
+        _stopped = true;
+    }
+    void join() {
+        while (!_stopped) {
+            bthread_usleep(100);
+        }
+    }
+private:
+    int64_t _fail_index;
+    bool _stopped;
+};
+
+TEST_F(FSMCallerTest, wait_applied_after_error) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions log_opt;
+    log_opt.log_storage = storage.get();
+    log_opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(log_opt));
+
+    braft::ClosureQueue cq(false);
+    FailingStateMachine fsm(6);
+    braft::FSMCallerOptions opt;
+    opt.log_manager = lm.get();
+    opt.after_shutdown = NULL;
+    opt.fsm = &fsm;
+    opt.closure_queue = &cq;
+    braft::FSMCaller caller;
+    ASSERT_EQ(0, caller.init(opt));
+
+    const int64_t N = 10;
+    for (int64_t i = 0; i < N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append("hello");
+        entry->id.index = i + 1;
+        entry->id.term = 1;
+        entries.push_back(entry);
+        SyncClosure c;
+        lm->append_entries(&entries, &c);
+        c.join();
+        ASSERT_TRUE(c.status().ok()) << c.status();
+    }
+    braft::SynchronizedClosure before_error;
+    caller.wait_applied(5, &before_error);
+    braft::SynchronizedClosure after_error;
+    caller.wait_applied(8, &after_error);
+    ASSERT_EQ(0, caller.on_committed(N));
+    before_error.wait();
+    ASSERT_TRUE(before_error.status().ok()) << before_error.status();
+    // The logs from the failed one on are never applied
+    after_error.wait();
+    ASSERT_FALSE(after_error.status().ok());
+    ASSERT_EQ(5, caller.last_applied_index());
+    braft::SynchronizedClosure later;
+    caller.wait_applied(7, &later);
+    later.wait();
+    ASSERT_FALSE(later.status().ok());
+
+    ASSERT_EQ(0, caller.shutdown());
+    fsm.join();
+}
@@ -7,10 +7,18 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
 #include <gtest/gtest.h>
 #include <butil/fd_guard.h>
 #include <butil/time.h>
 #include <butil/logging.h>
+#include <butil/string_printf.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+#include "braft/fsync.h"
 
 class FsyncTest : public testing::Test {
 };
@@ -55,3 +63,146 @@ TEST_F(FsyncTest, benchmark_append) {
 
 TEST_F(FsyncTest, benchmark_randomly_write) {
 }
+
+struct GroupFsyncArg {
+    int fd;
+    int rc;
+};
+
+static void* run_group_fsync(void* arg) {
+    GroupFsyncArg* a = (GroupFsyncArg*)arg;
+    for (int i = 0; i < 100 && a->rc == 0; ++i) {
+        if (write(a->fd, "hello", 5) != 5) {
+            a->rc = -1;
+            break;
+        }
+        a->rc = braft::raft_group_fsync(a->fd);
+    }
+    return NULL;
+}
+
+TEST_F(FsyncTest, group_fsync) {
+    const int32_t saved_window_us = braft::FLAGS_raft_group_commit_window_us;
+    braft::FLAGS_raft_group_commit_window_us = 1000;
+    const int N = 10;
+    GroupFsyncArg args[N];
+    bthread_t tids[N];
+    butil::Timer timer;
+    timer.start();
+    for (int i = 0; i < N; ++i) {
+        std::string path = butil::string_printf("group_fsync_%d.data", i);
+        args[i].fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ASSERT_NE(-1, args[i].fd);
+        args[i].rc = 0;
+        ASSERT_EQ(0, bthread_start_background(&tids[i], NULL,
+                                              run_group_fsync, &args[i]));
+    }
+    for (int i = 0; i < N; ++i) {
+        bthread_join(tids[i], NULL);
+        ASSERT_EQ(0, args[i].rc);
+        ::close(args[i].fd);
+        ::unlink(butil::string_printf("group_fsync_%d.data", i).c_str());
+    }
+    timer.stop();
+    LOG(INFO) << "group fsync takes " << timer.u_elapsed();
+    braft::FLAGS_raft_group_commit_window_us = saved_window_us;
+}
+
+TEST_F(FsyncTest, disk_latency) {
+    butil::fd_guard fd(::open("disk_latency.data", O_RDWR | O_CREAT | O_TRUNC, 0644));
+    ASSERT_NE(-1, fd);
+    struct stat st;
+    ASSERT_EQ(0, fstat(fd, &st));
+    ASSERT_EQ(0, braft::raft_disk_sync_p99_us(st.st_dev + 1));
+    char buf[1024] = {0};
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ((ssize_t)sizeof(buf), write(fd, buf, sizeof(buf)));
+        ASSERT_EQ(0, braft::raft_fsync(fd));
+    }
+    const std::string name = butil::string_printf(
+            "raft_fsync_disk_%u_%u_count",
+            (unsigned)major(st.st_dev), (unsigned)minor(st.st_dev));
+    ASSERT_LE(10, atoi(bvar::Variable::describe_exposed(name).c_str()));
+
+    // Disabled by default
+    usleep(1100 * 1000);
+    const int64_t p99_us = braft::raft_disk_sync_p99_us(st.st_dev);
+    ASSERT_FALSE(braft::raft_disk_is_slow(st.st_dev));
+    braft::FLAGS_raft_slow_disk_p99_us = p99_us + 1000000;
+    ASSERT_FALSE(braft::raft_disk_is_slow(st.st_dev));
+    if (p99_us > 1) {
+        braft::FLAGS_raft_slow_disk_p99_us = 1;
+        ASSERT_TRUE(braft::raft_disk_is_slow(st.st_dev));
+    }
+    braft::FLAGS_raft_slow_disk_p99_us = 0;
+    ::unlink("disk_latency.data");
+}
+
+TEST_F(FsyncTest, deferred_syncs) {
+    const int N = 3;
+    int fds[N];
+    {
+        braft::DeferredSyncs syncs;
+        for (int i = 0; i < N; ++i) {
+            std::string path = butil::string_printf("deferred_sync_%d.data", i);
+            fds[i] = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            ASSERT_NE(-1, fds[i]);
+            ASSERT_EQ(4, write(fds[i], "abcd", 4));
+            ASSERT_EQ(0, braft::raft_group_fsync(fds[i]));
+        }
+        ASSERT_EQ((size_t)N, syncs._fds.size());
+        // The files could be closed before they are synced
+        for (int i = 0; i < N; ++i) {
+            ::close(fds[i]);
+        }
+        ASSERT_EQ(0, syncs.flush());
+        ASSERT_TRUE(syncs._fds.empty());
+        {
+            // Nested scopes defer to the innermost one
+            braft::DeferredSyncs inner;
+            fds[0] = ::open("deferred_sync_0.data", O_RDWR);
+            ASSERT_EQ(0, braft::raft_group_fsync(fds[0]));
+            ASSERT_EQ(1u, inner._fds.size());
+            ASSERT_TRUE(syncs._fds.empty());
+            ::close(fds[0]);
+        }
+    }
+    // Synced at once out of the scopes
+    fds[0] = ::open("deferred_sync_0.data", O_RDWR);
+    ASSERT_EQ(0, braft::raft_group_fsync(fds[0]));
+    ::close(fds[0]);
+    for (int i = 0; i < N; ++i) {
+        ::unlink(butil::string_printf("deferred_sync_%d.data", i).c_str());
+    }
+}
+
+TEST_F(FsyncTest, deferred_syncs_of_owners) {
+    int good_owner = 0;
+    int bad_owner = 0;
+    braft::DeferredSyncs syncs;
+    int fd = ::open("deferred_sync_owner.data", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(-1, fd);
+    ASSERT_EQ(4, write(fd, "abcd", 4));
+    syncs.set_owner(&good_owner);
+    ASSERT_EQ(0, braft::raft_group_fsync(fd));
+    // A pipe can't be synced
+    int pipe_fds[2];
+    ASSERT_EQ(0, pipe(pipe_fds));
+    syncs.set_owner(&bad_owner);
+    ASSERT_EQ(0, braft::raft_group_fsync(pipe_fds[1]));
+    syncs.set_owner(NULL);
+    ASSERT_EQ(2u, syncs._fds.size());
+
+    // The failure is reported to its owner only, and only once
+    ASSERT_EQ(0, syncs.flush(&good_owner));
+    ASSERT_EQ(-1, syncs.flush(&bad_owner));
+    ASSERT_EQ(0, syncs.flush(&bad_owner));
+    syncs.set_owner(&good_owner);
+    ASSERT_EQ(0, braft::raft_group_fsync(fd));
+    ASSERT_EQ(0, syncs.flush(&good_owner));
+
+    ::close(fd);
+    ::close(pipe_fds[0]);
+    ::close(pipe_fds[1]);
+    ::unlink("deferred_sync_owner.data");
+}
@@ -499,6 +499,8 @@ int truncate_uninterrupted(const char* filename, off_t length) {
 
 TEST_F(LogStorageTest, data_lost) {
     ::system("rm -rf data");
+    // Losing the tail of a closed segment with a footer only drops the footer
+    braft::FLAGS_raft_segment_index_footer = false;
     braft::LogStorage* storage = new braft::SegmentLogStorage("./data");
     braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
     ASSERT_EQ(0, storage->init(configuration_manager));
@@ -585,6 +587,7 @@ TEST_F(LogStorageTest, data_lost) {
 
     delete storage;
     delete configuration_manager;
+    braft::FLAGS_raft_segment_index_footer = true;
 }
 
 TEST_F(LogStorageTest, append_read_badcase) {
@@ -855,6 +858,10 @@ void* write_thread_routine(void* arg) {
 
 namespace braft {
 DECLARE_int32(raft_max_segment_size);
+DECLARE_int32(raft_log_compress_type);
+DECLARE_int32(raft_segment_reclaim_bytes_per_second);
+DECLARE_int32(raft_log_hot_segments);
+DECLARE_int32(raft_segment_fd_cache_size);
 }
 
 TEST_F(LogStorageTest, multi_read_single_modify_thread_safe) {
@@ -1090,3 +1097,691 @@ TEST_F(LogStorageTest, joint_configuration) {
     }
 }
 
+
+TEST_F(LogStorageTest, closed_segment_index_footer) {
+    ::system("rm -rf data");
+    ::system("mkdir data/");
+    braft::Segment* seg1 = new braft::Segment("./data", 1L, 0);
+    seg1->AddRef();
+    ASSERT_EQ(0, seg1->create());
+    for (int i = 0; i < 10; i++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->AddRef();
+        entry->id.term = i < 5 ? 1 : 2;
+        entry->id.index = i + 1;
+        if (i == 3) {
+            entry->type = braft::ENTRY_TYPE_CONFIGURATION;
+            entry->peers = new std::vector<braft::PeerId>;
+            entry->peers->push_back(braft::PeerId("1.1.1.1:1000:0"));
+            entry->peers->push_back(braft::PeerId("1.1.1.1:2000:0"));
+        } else {
+            entry->type = braft::ENTRY_TYPE_DATA;
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i + 1);
+            entry->data.append(data_buf);
+        }
+        ASSERT_EQ(0, seg1->append(entry));
+        entry->Release();
+    }
+    const int64_t data_bytes = seg1->bytes();
+    ASSERT_EQ(0, seg1->close());
+    std::string path = "./data/" + seg1->file_name();
+    ASSERT_GT(file_size(path.c_str()), data_bytes);
+    seg1->Release();
+
+    for (int round = 0; round < 2; ++round) {
+        if (round == 1) {
+            // Corrupt the footer to fall back to scanning
+            ASSERT_EQ(0, truncate_uninterrupted(path.c_str(),
+                                                file_size(path.c_str()) - 1));
+        }
+        braft::ConfigurationManager cm;
+        scoped_refptr<braft::Segment> seg2 = new braft::Segment("./data", 1, 10, 0);
+        ASSERT_EQ(0, seg2->load(&cm));
+        ASSERT_EQ(data_bytes, seg2->bytes());
+        braft::ConfigurationEntry conf_entry;
+        cm.get(10, &conf_entry);
+        ASSERT_EQ(braft::LogId(4, 1), conf_entry.id);
+        ASSERT_EQ(2u, conf_entry.conf.size());
+        for (int i = 0; i < 10; i++) {
+            ASSERT_EQ(i < 5 ? 1 : 2, seg2->get_term(i + 1));
+            braft::LogEntry* entry = seg2->get(i + 1);
+            ASSERT_TRUE(entry != NULL);
+            ASSERT_EQ(i + 1, entry->id.index);
+            if (i == 3) {
+                ASSERT_EQ(braft::ENTRY_TYPE_CONFIGURATION, entry->type);
+            } else {
+                char data_buf[128];
+                snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i + 1);
+                ASSERT_EQ(data_buf, entry->data.to_string());
+            }
+            entry->Release();
+        }
+    }
+    // The corrupted footer was truncated while scanning
+    ASSERT_EQ(data_bytes, file_size(path.c_str()));
+}
+
+TEST_F(LogStorageTest, load_segments_concurrently) {
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 1024;
+    system("rm -rf ./data");
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, storage->init(&cm));
+    const int N = 2000;
+    for (int i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->id.index = i;
+        entry->id.term = 1;
+        if (i % 100 == 0) {
+            entry->type = braft::ENTRY_TYPE_CONFIGURATION;
+            entry->peers = new std::vector<braft::PeerId>;
+            entry->peers->push_back(
+                    braft::PeerId("127.0.0.1:" + std::to_string(i)));
+        } else {
+            entry->type = braft::ENTRY_TYPE_DATA;
+            std::string data;
+            butil::string_printf(&data, "hello_%d", i);
+            entry->data.append(data);
+        }
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    ASSERT_LT(8u, storage->segments().size());
+    delete storage;
+
+    braft::FLAGS_raft_load_segment_concurrency = 4;
+    braft::ConfigurationManager cm2;
+    storage = new braft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(&cm2));
+    braft::FLAGS_raft_load_segment_concurrency = 1;
+    ASSERT_EQ(1, storage->first_log_index());
+    ASSERT_EQ(N, storage->last_log_index());
+    for (int i = 1; i <= N; ++i) {
+        braft::ConfigurationEntry conf_entry;
+        cm2.get(i, &conf_entry);
+        ASSERT_EQ(i / 100 * 100, conf_entry.id.index);
+        braft::LogEntry* entry = storage->get_entry(i);
+        ASSERT_TRUE(entry != NULL);
+        if (entry->type == braft::ENTRY_TYPE_DATA) {
+            std::string data;
+            butil::string_printf(&data, "hello_%d", i);
+            ASSERT_EQ(data, entry->data.to_string());
+        }
+        entry->Release();
+    }
+    delete storage;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, mmap_closed_segment) {
+    ::system("rm -rf data");
+    ::system("mkdir data/");
+    braft::FLAGS_raft_segment_mmap_read = true;
+    scoped_refptr<braft::Segment> seg1 = new braft::Segment("./data", 1L, 0);
+    ASSERT_EQ(0, seg1->create());
+    for (int i = 0; i < 10; i++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 1;
+        entry->id.index = i + 1;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i + 1);
+        entry->data.append(data_buf);
+        ASSERT_EQ(0, seg1->append(entry));
+        entry->Release();
+    }
+    ASSERT_TRUE(seg1->_mapping == NULL);
+    ASSERT_EQ(0, seg1->close());
+    ASSERT_TRUE(seg1->_mapping != NULL);
+
+    braft::ConfigurationManager cm;
+    scoped_refptr<braft::Segment> seg2 = new braft::Segment("./data", 1, 10, 0);
+    ASSERT_EQ(0, seg2->load(&cm));
+    ASSERT_TRUE(seg2->_mapping != NULL);
+    std::vector<braft::LogEntry*> entries;
+    for (int i = 0; i < 10; i++) {
+        braft::LogEntry* entry = seg2->get(i + 1);
+        ASSERT_TRUE(entry != NULL);
+        entries.push_back(entry);
+    }
+    // The data outlives the segment
+    seg1->unlink();
+    seg1 = NULL;
+    seg2 = NULL;
+    for (int i = 0; i < 10; i++) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i + 1);
+        ASSERT_EQ(data_buf, entries[i]->data.to_string());
+        entries[i]->Release();
+    }
+    braft::FLAGS_raft_segment_mmap_read = false;
+}
+
+static int count_files_with_suffix(const char* dir, const char* suffix) {
+    int count = 0;
+    butil::DirReaderPosix dir_reader(dir);
+    while (dir_reader.Next()) {
+        const size_t len = strlen(dir_reader.name());
+        if (len >= strlen(suffix)
+                && strcmp(dir_reader.name() + len - strlen(suffix), suffix) == 0) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+TEST_F(LogStorageTest, reclaim_mapped_segment) {
+    ::system("rm -rf data");
+    ::system("mkdir data/");
+    braft::FLAGS_raft_segment_mmap_read = true;
+    braft::FLAGS_raft_segment_reclaim_bytes_per_second = 1024 * 1024;
+    scoped_refptr<braft::Segment> seg = new braft::Segment("./data", 1L, 0);
+    ASSERT_EQ(0, seg->create());
+    std::string payload(64 * 1024, 'a');
+    for (int i = 0; i < 10; i++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 1;
+        entry->id.index = i + 1;
+        entry->data.append(payload);
+        ASSERT_EQ(0, seg->append(entry));
+        entry->Release();
+    }
+    ASSERT_EQ(0, seg->close());
+    ASSERT_TRUE(seg->_mapping != NULL);
+    braft::LogEntry* entry = seg->get(10);
+    ASSERT_TRUE(entry != NULL);
+
+    // The file is not truncated while the data is still mapped
+    ASSERT_EQ(0, seg->unlink());
+    seg = NULL;
+    usleep(1000 * 1000);
+    ASSERT_EQ(1, count_files_with_suffix("./data", ".tmp"));
+    ASSERT_EQ(payload, entry->data.to_string());
+    entry->Release();
+    for (int i = 0; i < 100 && count_files_with_suffix("./data", ".tmp") > 0; ++i) {
+        usleep(100 * 1000);
+    }
+    ASSERT_EQ(0, count_files_with_suffix("./data", ".tmp"));
+    braft::FLAGS_raft_segment_reclaim_bytes_per_second = 0;
+    braft::FLAGS_raft_segment_mmap_read = false;
+}
+
+TEST_F(LogStorageTest, preallocate_and_recycle_segments) {
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 1024;
+    braft::FLAGS_raft_preallocate_segment = true;
+    system("rm -rf ./data");
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, storage->init(&cm));
+    const int N = 1000;
+    for (int i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.index = i;
+        entry->id.term = 1;
+        std::string data;
+        butil::string_printf(&data, "hello_%d", i);
+        entry->data.append(data);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    // The open segment is preallocated
+    std::string open_path = "./data/" + storage->_open_segment->file_name();
+    ASSERT_LE(braft::FLAGS_raft_max_segment_size, file_size(open_path.c_str()));
+    ASSERT_EQ(0, storage->truncate_prefix(N / 2));
+    ASSERT_EQ((size_t)braft::FLAGS_raft_max_recycled_segments,
+              storage->_recycled_segments.size());
+    // Roll segments to reuse the recycled files
+    for (int i = N + 1; i <= 2 * N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.index = i;
+        entry->id.term = 2;
+        std::string data;
+        butil::string_printf(&data, "hello_%d", i);
+        entry->data.append(data);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    ASSERT_GT((size_t)braft::FLAGS_raft_max_recycled_segments,
+              storage->_recycled_segments.size());
+    delete storage;
+
+    // The tail of the preallocated open segment is told apart on reload
+    braft::ConfigurationManager cm2;
+    storage = new braft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(&cm2));
+    ASSERT_EQ(N / 2, storage->first_log_index());
+    ASSERT_EQ(2 * N, storage->last_log_index());
+    for (int i = N / 2; i <= 2 * N; ++i) {
+        braft::LogEntry* entry = storage->get_entry(i);
+        ASSERT_TRUE(entry != NULL) << i;
+        ASSERT_EQ(i <= N ? 1 : 2, entry->id.term);
+        std::string data;
+        butil::string_printf(&data, "hello_%d", i);
+        ASSERT_EQ(data, entry->data.to_string());
+        entry->Release();
+    }
+    delete storage;
+    braft::FLAGS_raft_preallocate_segment = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, direct_io_append) {
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 8192;
+    braft::FLAGS_raft_segment_direct_io = true;
+    system("rm -rf ./data");
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, storage->init(&cm));
+    const int N = 1000;
+    for (int i = 0; i < N / 10; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        for (int j = 0; j < 10; ++j) {
+            int64_t index = 10 * i + j + 1;
+            braft::LogEntry* entry = new braft::LogEntry;
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.index = index;
+            entry->id.term = 1;
+            std::string data;
+            butil::string_printf(&data, "hello_%" PRId64, index);
+            entry->data.append(data);
+            entries.push_back(entry);
+        }
+        ASSERT_EQ(10, storage->append_entries(entries));
+        for (size_t j = 0; j < entries.size(); ++j) {
+            entries[j]->Release();
+        }
+    }
+    // Truncate in the middle of a block and keep appending
+    ASSERT_EQ(0, storage->truncate_suffix(N - 5));
+    for (int i = N - 4; i <= N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.index = i;
+        entry->id.term = 2;
+        std::string data;
+        butil::string_printf(&data, "hello_%d", i);
+        entry->data.append(data);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    delete storage;
+
+    // The zero padding of the last block is dropped on reload
+    braft::ConfigurationManager cm2;
+    storage = new braft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(&cm2));
+    ASSERT_EQ(1, storage->first_log_index());
+    ASSERT_EQ(N, storage->last_log_index());
+    for (int i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = storage->get_entry(i);
+        ASSERT_TRUE(entry != NULL) << i;
+        ASSERT_EQ(i <= N - 5 ? 1 : 2, entry->id.term);
+        std::string data;
+        butil::string_printf(&data, "hello_%d", i);
+        ASSERT_EQ(data, entry->data.to_string());
+        entry->Release();
+    }
+    delete storage;
+    braft::FLAGS_raft_segment_direct_io = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, batch_append) {
+    system("rm -rf ./data");
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, storage->init(&cm));
+    // More blocks than one writev takes
+    const int N = 1000;
+    std::vector<braft::LogEntry*> entries;
+    for (int i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.index = i;
+        entry->id.term = 1;
+        std::string data;
+        butil::string_printf(&data, "hello_%d", i);
+        entry->data.append(data);
+        entries.push_back(entry);
+    }
+    ASSERT_EQ(N, storage->append_entries(entries));
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+    ASSERT_EQ(N, storage->last_log_index());
+    delete storage;
+
+    braft::ConfigurationManager cm2;
+    storage = new braft::SegmentLogStorage("./data");
+    ASSERT_EQ(0, storage->init(&cm2));
+    ASSERT_EQ(N, storage->last_log_index());
+    for (int i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = storage->get_entry(i);
+        ASSERT_TRUE(entry != NULL) << i;
+        std::string data;
+        butil::string_printf(&data, "hello_%d", i);
+        ASSERT_EQ(data, entry->data.to_string());
+        entry->Release();
+    }
+    delete storage;
+}
+
+TEST_F(LogStorageTest, compress_entries) {
+    system("rm -rf ./data");
+    const int N = 100;
+    std::string payload(4096, 'a');
+    for (int compress_type = 1; compress_type <= 2; ++compress_type) {
+        system("rm -rf ./data");
+        braft::FLAGS_raft_log_compress_type = compress_type;
+        braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+        braft::ConfigurationManager cm;
+        ASSERT_EQ(0, storage->init(&cm));
+        for (int i = 1; i <= N; ++i) {
+            braft::LogEntry* entry = new braft::LogEntry;
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.index = i;
+            entry->id.term = 1;
+            entry->data.append(payload);
+            // The tail is short enough to be written uncompressed
+            if (i % 2 == 0) {
+                entry->data.clear();
+                entry->data.append("hello");
+            }
+            ASSERT_EQ(0, storage->append_entry(entry));
+            entry->Release();
+        }
+        std::string open_path = "./data/" + storage->_open_segment->file_name();
+        ASSERT_GT((ssize_t)payload.size() * N / 2, file_size(open_path.c_str()));
+        delete storage;
+
+        // Readable after the codec is turned off
+        braft::FLAGS_raft_log_compress_type = 0;
+        braft::ConfigurationManager cm2;
+        storage = new braft::SegmentLogStorage("./data");
+        ASSERT_EQ(0, storage->init(&cm2));
+        for (int i = 1; i <= N; ++i) {
+            braft::LogEntry* entry = storage->get_entry(i);
+            ASSERT_TRUE(entry != NULL);
+            ASSERT_EQ(i % 2 == 0 ? std::string("hello") : payload,
+                      entry->data.to_string());
+            entry->Release();
+        }
+        delete storage;
+    }
+}
+
+TEST_F(LogStorageTest, compact_segment_index) {
+    braft::SegmentIndex index;
+    std::vector<std::pair<int64_t, int64_t> > expected;
+    int64_t offset = 0;
+    for (int i = 0; i < 10000; ++i) {
+        // Some large entries make their blocks fall back to wide deltas
+        const int64_t len = (i % 1000 == 7) ? 100000 : 24 + i % 50;
+        const int64_t term = 1 + i / 3000;
+        index.push_back(offset, term);
+        expected.push_back(std::make_pair(offset, term));
+        offset += len;
+    }
+    ASSERT_EQ(expected.size(), index.size());
+    ASSERT_EQ(4u, index.run_count());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        ASSERT_EQ(expected[i].first, index.offset(i)) << i;
+        ASSERT_EQ(expected[i].second, index.term(i)) << i;
+    }
+    ASSERT_GT(expected.size() * 16 / 2, index.memory_usage());
+
+    // Truncate in the middle of a wide block and append again
+    index.truncate(5010);
+    expected.resize(5010);
+    offset = expected.back().first + 10;
+    for (int i = 0; i < 100; ++i) {
+        index.push_back(offset, 5);
+        expected.push_back(std::make_pair(offset, (int64_t)5));
+        offset += (i == 50) ? 200000 : 30;
+    }
+    ASSERT_EQ(expected.size(), index.size());
+    size_t runs_length = 0;
+    for (size_t i = 0; i < index.run_count(); ++i) {
+        runs_length += index.run_length(i);
+    }
+    ASSERT_EQ(index.size(), runs_length);
+    for (size_t i = 0; i < expected.size(); ++i) {
+        ASSERT_EQ(expected[i].first, index.offset(i)) << i;
+        ASSERT_EQ(expected[i].second, index.term(i)) << i;
+    }
+    // Offsets beyond 32 bits are rejected instead of being truncated
+    const size_t size = index.size();
+    ASSERT_EQ(-1, index.push_back(braft::SegmentIndex::MAX_OFFSET + 1, 5));
+    ASSERT_EQ(size, index.size());
+    index.clear();
+    ASSERT_TRUE(index.empty());
+}
+
+TEST_F(LogStorageTest, get_entries) {
+    ::system("rm -rf data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 4096;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, storage->init(&cm));
+    const int N = 1000;
+    for (int i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.index = i;
+        entry->id.term = 1 + i / 100;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i);
+        entry->data.append(data_buf);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    ASSERT_LT(1u, storage->_segments.size());
+
+    // Across closed segments and the open segment
+    std::vector<braft::LogEntry*> entries;
+    ASSERT_EQ(N, storage->get_entries(1, N * 2, SIZE_MAX, &entries));
+    ASSERT_EQ((size_t)N, entries.size());
+    for (int i = 1; i <= N; ++i) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i);
+        ASSERT_EQ(data_buf, entries[i - 1]->data.to_string());
+        ASSERT_EQ(braft::LogId(i, 1 + i / 100), entries[i - 1]->id);
+        entries[i - 1]->Release();
+    }
+    entries.clear();
+
+    // Limited by count and bytes
+    ASSERT_EQ(10, storage->get_entries(95, 10, SIZE_MAX, &entries));
+    ASSERT_EQ(95, entries.front()->id.index);
+    ASSERT_EQ(104, entries.back()->id.index);
+    ASSERT_EQ(1, storage->get_entries(200, 10, 1, &entries));
+    ASSERT_EQ(200, entries.back()->id.index);
+    ASSERT_EQ(0, storage->get_entries(N + 1, 10, SIZE_MAX, &entries));
+    ASSERT_EQ(11u, entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+    delete storage;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, reclaim_segments_in_background) {
+    ::system("rm -rf data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_reclaim_bytes_per_second = 1024 * 1024;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, storage->init(&cm));
+    const int N = 100;
+    std::string payload(4096, 'a');
+    for (int i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.index = i;
+        entry->id.term = 1;
+        entry->data.append(payload);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    const size_t segment_count = storage->_segments.size();
+    ASSERT_LT(2u, segment_count);
+    butil::Timer timer;
+    timer.start();
+    ASSERT_EQ(0, storage->truncate_prefix(N));
+    timer.stop();
+    ASSERT_TRUE(storage->_segments.empty());
+    // The segments are not reclaimed in the calling thread
+    ASSERT_LT(0, count_files_with_suffix("./data", ".tmp"));
+    ASSERT_GT(100 * 1000, timer.u_elapsed());
+    // About 1 second for the reclaiming
+    for (int i = 0; i < 100 && count_files_with_suffix("./data", ".tmp") > 0; ++i) {
+        usleep(100 * 1000);
+    }
+    ASSERT_EQ(0, count_files_with_suffix("./data", ".tmp"));
+    delete storage;
+    braft::FLAGS_raft_segment_reclaim_bytes_per_second = 0;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static size_t count_cold_segments(braft::SegmentLogStorage* storage) {
+    BAIDU_SCOPED_LOCK(storage->_mutex);
+    size_t count = 0;
+    for (braft::SegmentLogStorage::SegmentMap::iterator
+            it = storage->segments().begin(); it != storage->segments().end(); ++it) {
+        if (it->second->path() != "./data") {
+            ++count;
+        }
+    }
+    return count;
+}
+
+TEST_F(LogStorageTest, move_cold_segments) {
+    ::system("rm -rf data cold_data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    int32_t saved_hot_segments = braft::FLAGS_raft_log_hot_segments;
+    braft::FLAGS_raft_max_segment_size = 1024;
+    braft::FLAGS_raft_log_hot_segments = 2;
+    braft::SegmentLogStorage prototype;
+    braft::LogStorage* log_storage =
+            prototype.new_instance("./data?cold_path=./cold_data");
+    ASSERT_TRUE(log_storage != NULL);
+    braft::SegmentLogStorage* storage =
+            dynamic_cast<braft::SegmentLogStorage*>(log_storage);
+    ASSERT_TRUE(storage != NULL);
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, storage->init(&cm));
+    const int N = 1000;
+    for (int i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.index = i;
+        entry->id.term = 1;
+        std::string data;
+        butil::string_printf(&data, "hello_%d", i);
+        entry->data.append(data);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    const size_t segment_count = storage->segments().size();
+    ASSERT_LT(4u, segment_count);
+    for (int i = 0; i < 100 && count_cold_segments(storage) + 2 < segment_count; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_EQ(segment_count - 2, count_cold_segments(storage));
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 1; i <= N; ++i) {
+            braft::LogEntry* entry = storage->get_entry(i);
+            ASSERT_TRUE(entry != NULL) << i;
+            std::string data;
+            butil::string_printf(&data, "hello_%d", i);
+            ASSERT_EQ(data, entry->data.to_string());
+            entry->Release();
+        }
+        if (round == 0) {
+            // Segments are restored from both directories
+            delete storage;
+            storage = new braft::SegmentLogStorage("./data");
+            storage->set_cold_path("./cold_data");
+            braft::ConfigurationManager cm2;
+            ASSERT_EQ(0, storage->init(&cm2));
+            ASSERT_EQ(segment_count, storage->segments().size());
+            ASSERT_EQ(segment_count - 2, count_cold_segments(storage));
+        }
+    }
+    ASSERT_EQ(0, storage->truncate_prefix(N));
+    ASSERT_EQ(0u, count_cold_segments(storage));
+    delete storage;
+    braft::FLAGS_raft_log_hot_segments = saved_hot_segments;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, segment_fd_cache) {
+    ::system("rm -rf data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 1024;
+    braft::FLAGS_raft_segment_fd_cache_size = 2;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, storage->init(&cm));
+    const int N = 1000;
+    for (int i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.index = i;
+        entry->id.term = 1;
+        std::string data;
+        butil::string_printf(&data, "hello_%d", i);
+        entry->data.append(data);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    delete storage;
+
+    storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager cm2;
+    ASSERT_EQ(0, storage->init(&cm2));
+    const braft::SegmentLogStorage::SegmentMap& segments = storage->segments();
+    ASSERT_LT(4u, segments.size());
+    // Closed segments are not opened until being read
+    for (braft::SegmentLogStorage::SegmentMap::const_iterator
+            it = segments.begin(); it != segments.end(); ++it) {
+        ASSERT_EQ(-1, it->second->_fd);
+    }
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 1; i <= N; ++i) {
+            braft::LogEntry* entry = storage->get_entry(i);
+            ASSERT_TRUE(entry != NULL) << i;
+            std::string data;
+            butil::string_printf(&data, "hello_%d", i);
+            ASSERT_EQ(data, entry->data.to_string());
+            entry->Release();
+        }
+        size_t open_count = 0;
+        for (braft::SegmentLogStorage::SegmentMap::const_iterator
+                it = segments.begin(); it != segments.end(); ++it) {
+            if (it->second->_fd >= 0) {
+                ++open_count;
+            }
+        }
+        ASSERT_EQ(2u, open_count);
+    }
+    // Truncating reopens the evicted segment
+    const int64_t last_index_kept = segments.begin()->second->first_index();
+    ASSERT_EQ(0, storage->truncate_suffix(last_index_kept));
+    ASSERT_EQ(last_index_kept, storage->last_log_index());
+    braft::LogEntry* entry = storage->get_entry(last_index_kept);
+    ASSERT_TRUE(entry != NULL);
+    entry->Release();
+    delete storage;
+    braft::FLAGS_raft_segment_fd_cache_size = 0;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
@@ -49,3 +49,108 @@ TEST_F(TestUsageSuits, LogEntry) {
 
     entry->Release();
 }
+
+TEST_F(TestUsageSuits, meta) {
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->type = braft::ENTRY_TYPE_CONFIGURATION;
+    entry->id = braft::LogId(10, 3);
+    entry->peers = new std::vector<braft::PeerId>;
+    entry->peers->push_back(braft::PeerId("1.2.3.4:1000"));
+    entry->peers->push_back(braft::PeerId("1.2.3.4:2000"));
+    entry->old_peers = new std::vector<braft::PeerId>;
+    entry->old_peers->push_back(braft::PeerId("1.2.3.4:1000"));
+    entry->data.append("hello");
+
+    const braft::EntryMeta& meta = entry->meta();
+    ASSERT_EQ(3, meta.term());
+    ASSERT_EQ(braft::ENTRY_TYPE_CONFIGURATION, meta.type());
+    ASSERT_EQ(2, meta.peers_size());
+    ASSERT_EQ("1.2.3.4:2000:0", meta.peers(1));
+    ASSERT_EQ(1, meta.old_peers_size());
+    ASSERT_EQ(5, meta.data_len());
+    // Encoded only once
+    ASSERT_EQ(&meta, &entry->meta());
+    entry->Release();
+}
+
+TEST_F(TestUsageSuits, data_batch) {
+    std::vector<butil::IOBuf> bufs(3);
+    bufs[0].append("hello");
+    bufs[2].append("world");
+    std::vector<butil::IOBuf*> datas;
+    for (size_t i = 0; i < bufs.size(); ++i) {
+        datas.push_back(&bufs[i]);
+    }
+    butil::IOBuf data;
+    braft::serialize_data_batch(datas, &data);
+    ASSERT_TRUE(bufs[0].empty());
+
+    std::vector<butil::IOBuf> parsed;
+    ASSERT_TRUE(braft::parse_data_batch(data, &parsed).ok());
+    ASSERT_EQ(3u, parsed.size());
+    ASSERT_EQ("hello", parsed[0].to_string());
+    ASSERT_TRUE(parsed[1].empty());
+    ASSERT_EQ("world", parsed[2].to_string());
+
+    // Truncated
+    butil::IOBuf truncated;
+    data.copy_to(&truncated, data.size() - 1);
+    ASSERT_FALSE(braft::parse_data_batch(truncated, &parsed).ok());
+    data.append("x");
+    ASSERT_FALSE(braft::parse_data_batch(data, &parsed).ok());
+}
+
+TEST_F(TestUsageSuits, pooled) {
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->AddRef();
+    entry->type = braft::ENTRY_TYPE_CONFIGURATION;
+    entry->peers = new std::vector<braft::PeerId>;
+    entry->peers->push_back(braft::PeerId("1.2.3.4:1000"));
+    entry->data.append("hello");
+    void* const addr = entry;
+    entry->Release();
+
+    // The memory is reused by the next entry of this thread, which is
+    // constructed from scratch
+    entry = new braft::LogEntry();
+    entry->AddRef();
+    ASSERT_EQ(addr, (void*)entry);
+    ASSERT_EQ(braft::ENTRY_TYPE_UNKNOWN, entry->type);
+    ASSERT_TRUE(entry->peers == NULL);
+    ASSERT_TRUE(entry->data.empty());
+    entry->Release();
+}
+
+TEST_F(TestUsageSuits, packed_entry_metas) {
+    braft::AppendEntriesRequest request;
+    for (int i = 0; i < 10; ++i) {
+        braft::EntryMeta* meta = request.add_entries();
+        meta->set_term(5 + i / 4);
+        meta->set_type(i == 0 ? braft::ENTRY_TYPE_NO_OP : braft::ENTRY_TYPE_DATA);
+        meta->set_data_len(i == 0 ? 0 : i * 100);
+    }
+    std::string packed;
+    ASSERT_TRUE(braft::pack_entry_metas(request.entries(), 5, &packed));
+    ASSERT_EQ(10 * braft::PACKED_ENTRY_META_SIZE, packed.size());
+
+    google::protobuf::RepeatedPtrField<braft::EntryMeta> metas;
+    ASSERT_TRUE(braft::unpack_entry_metas(packed, 5, &metas).ok());
+    ASSERT_EQ(request.entries_size(), metas.size());
+    for (int i = 0; i < metas.size(); ++i) {
+        ASSERT_EQ(request.entries(i).SerializeAsString(),
+                  metas.Get(i).SerializeAsString());
+    }
+    request.set_packed_entries(packed);
+    request.clear_entries();
+    ASSERT_EQ(10, braft::append_entries_count(request));
+
+    // Terms older than the base and peers are not packed
+    ASSERT_FALSE(braft::pack_entry_metas(metas, 6, &packed));
+    metas.Mutable(3)->set_type(braft::ENTRY_TYPE_CONFIGURATION);
+    metas.Mutable(3)->add_peers("127.0.0.1:8000:0");
+    ASSERT_FALSE(braft::pack_entry_metas(metas, 5, &packed));
+    ASSERT_TRUE(packed.empty());
+
+    metas.Clear();
+    ASSERT_FALSE(braft::unpack_entry_metas("12345678", 5, &metas).ok());
+}
@@ -0,0 +1,119 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+
+#include <pthread.h>
+#include <gtest/gtest.h>
+#include <butil/atomicops.h>
+#include "braft/log_entry_ring.h"
+
+class LogEntryRingTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+static braft::LogEntry* new_entry(int64_t index, int64_t term) {
+    braft::LogEntry* entry = new braft::LogEntry;
+    entry->AddRef();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->id = braft::LogId(index, term);
+    return entry;
+}
+
+TEST_F(LogEntryRingTest, sanity) {
+    braft::LogEntryRing ring;
+    ASSERT_TRUE(ring.empty());
+    ASSERT_TRUE(ring.get(1) == NULL);
+    ASSERT_EQ(0, ring.get_term(1));
+    // Grow across the initial capacity
+    const int64_t N = 10000;
+    for (int64_t i = 1; i <= N; ++i) {
+        ring.push_back(new_entry(i, i / 100 + 1));
+    }
+    ASSERT_EQ((size_t)N, ring.size());
+    ASSERT_EQ(1, ring.front()->id.index);
+    ASSERT_EQ(N, ring.back()->id.index);
+    for (int64_t i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = ring.get(i);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(i, entry->id.index);
+        ASSERT_EQ(i / 100 + 1, ring.get_term(i));
+        ASSERT_EQ(entry, ring.at(i));
+        entry->Release();
+    }
+    ASSERT_TRUE(ring.get(N + 1) == NULL);
+    ASSERT_TRUE(ring.at(N + 1) == NULL);
+
+    braft::LogEntry* entry = ring.pop_front();
+    ASSERT_EQ(1, entry->id.index);
+    ASSERT_EQ(1, entry->ref_count_);
+    entry->Release();
+    ASSERT_TRUE(ring.get(1) == NULL);
+    entry = ring.pop_back();
+    ASSERT_EQ(N, entry->id.index);
+    entry->Release();
+    ASSERT_TRUE(ring.get(N) == NULL);
+    ASSERT_EQ(0, ring.get_term(N));
+    // Append again after truncating the tail
+    ring.push_back(new_entry(N, 2));
+    ASSERT_EQ(2, ring.get_term(N));
+    ASSERT_EQ((size_t)N - 1, ring.size());
+}
+
+struct ReaderArg {
+    braft::LogEntryRing* ring;
+    butil::atomic<int64_t>* last_index;
+    butil::atomic<bool>* stop;
+    int64_t hit;
+};
+
+static void* read_ring(void* arg) {
+    ReaderArg* ra = (ReaderArg*)arg;
+    while (!ra->stop->load(butil::memory_order_relaxed)) {
+        const int64_t last_index = ra->last_index->load(butil::memory_order_acquire);
+        for (int64_t i = std::max(last_index - 100, (int64_t)1); i <= last_index; ++i) {
+            braft::LogEntry* entry = ra->ring->get(i);
+            if (entry) {
+                EXPECT_EQ(i, entry->id.index);
+                entry->Release();
+                ++ra->hit;
+            }
+        }
+    }
+    return NULL;
+}
+
+TEST_F(LogEntryRingTest, read_while_modifying) {
+    braft::LogEntryRing ring;
+    butil::atomic<int64_t> last_index(0);
+    butil::atomic<bool> stop(false);
+    const int R = 8;
+    pthread_t tids[R];
+    ReaderArg args[R];
+    for (int i = 0; i < R; ++i) {
+        args[i].ring = &ring;
+        args[i].last_index = &last_index;
+        args[i].stop = &stop;
+        args[i].hit = 0;
+        ASSERT_EQ(0, pthread_create(&tids[i], NULL, read_ring, &args[i]));
+    }
+    const int64_t N = 200000;
+    for (int64_t i = 1; i <= N; ++i) {
+        ring.push_back(new_entry(i, 1));
+        last_index.store(i, butil::memory_order_release);
+        // Keep about 1000 logs and truncate the tail from time to time
+        if (ring.size() > 1000) {
+            ring.pop_front()->Release();
+        }
+        if (i % 1000 == 0) {
+            ring.pop_back()->Release();
+            ring.push_back(new_entry(i, 2));
+        }
+    }
+    stop.store(true);
+    int64_t hit = 0;
+    for (int i = 0; i < R; ++i) {
+        pthread_join(tids[i], NULL);
+        hit += args[i].hit;
+    }
+    ASSERT_LT(0, hit);
+}
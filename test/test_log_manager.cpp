@@ -13,6 +13,8 @@
 #include "braft/log_manager.h"
 #include "braft/configuration.h"
 #include "braft/log.h"
+#include "braft/log_entry_cache.h"
+#include "braft/snapshot_scheduler.h"
 
 class LogManagerTest : public testing::Test {
 protected:
@@ -681,3 +683,584 @@ TEST_F(LogManagerTest, set_snapshot_and_get_log_term) {
     ASSERT_EQ(1L, lm->get_term(N - 1));
     LOG(INFO) << "Last_index=" << lm->last_log_index();
 }
+
+namespace braft {
+DECLARE_bool(raft_pipeline_log_sync);
+}
+
+TEST_F(LogManagerTest, pipeline_log_sync) {
+    system("rm -rf ./data");
+    braft::FLAGS_raft_pipeline_log_sync = true;
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::FLAGS_raft_pipeline_log_sync = false;
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    const int N = 1000;
+    int64_t expected_next_log_index = 1;
+    for (int i = 0; i < N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        std::string buf;
+        butil::string_printf(&buf, "hello_%d", i);
+        entry->data.append(buf);
+        entry->id = braft::LogId(i + 1, 1);
+        entries.push_back(entry);
+        // Closures are expected to be run in order
+        StuckClosure* c = new StuckClosure;
+        c->_expected_next_log_index = &expected_next_log_index;
+        lm->append_entries(&entries, c);
+    }
+    // Flushing waits for the pending syncs
+    ASSERT_EQ(braft::LogId(N, 1), lm->last_log_id(true));
+    ASSERT_EQ(N + 1, expected_next_log_index);
+    ASSERT_EQ(N, storage->last_log_index());
+    lm->set_applied_id(braft::LogId(N, 1));
+    usleep(100 * 1000l);
+    ASSERT_EQ(N, lm->_disk_id.index);
+    for (int i = 0; i < N; ++i) {
+        braft::LogEntry* entry = lm->get_entry(i + 1);
+        ASSERT_TRUE(entry != NULL);
+        std::string buf;
+        butil::string_printf(&buf, "hello_%d", i);
+        ASSERT_EQ(buf, entry->data.to_string());
+        entry->Release();
+    }
+}
+
+namespace braft {
+DECLARE_int32(raft_relaxed_sync_interval_ms);
+}
+
+TEST_F(LogManagerTest, relaxed_durability) {
+    system("rm -rf ./data");
+    const int32_t saved_interval_ms = braft::FLAGS_raft_relaxed_sync_interval_ms;
+    braft::FLAGS_raft_relaxed_sync_interval_ms = 50;
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    opt.relaxed_durability = true;
+    ASSERT_EQ(0, lm->init(opt));
+    const int N = 1000;
+    int64_t expected_next_log_index = 1;
+    for (int i = 0; i < N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        std::string buf;
+        butil::string_printf(&buf, "hello_%d", i);
+        entry->data.append(buf);
+        entry->id = braft::LogId(i + 1, 1);
+        entries.push_back(entry);
+        // Closures are expected to be run in order
+        StuckClosure* c = new StuckClosure;
+        c->_expected_next_log_index = &expected_next_log_index;
+        lm->append_entries(&entries, c);
+    }
+    ASSERT_EQ(braft::LogId(N, 1), lm->last_log_id(true));
+    ASSERT_EQ(N + 1, expected_next_log_index);
+    braft::LogManagerStatus status;
+    lm->get_status(&status);
+    ASSERT_EQ(N, status.disk_index);
+    // Synced in the background
+    for (int i = 0; i < 100 && status.durable_index < N; ++i) {
+        usleep(10 * 1000l);
+        lm->get_status(&status);
+    }
+    ASSERT_EQ(N, status.durable_index);
+
+    // Truncating waits for the pending syncs
+    lm->unsafe_truncate_suffix(N - 1);
+    ASSERT_EQ(braft::LogId(N - 1, 1), lm->last_log_id(true));
+    ASSERT_EQ(N - 1, storage->last_log_index());
+    lm.reset();
+    braft::FLAGS_raft_relaxed_sync_interval_ms = saved_interval_ms;
+}
+
+namespace braft {
+DECLARE_int32(raft_log_cache_size_mb);
+}
+
+TEST_F(LogManagerTest, log_entry_cache) {
+    system("rm -rf ./data");
+    const int32_t saved_cache_size = braft::FLAGS_raft_log_cache_size_mb;
+    braft::FLAGS_raft_log_cache_size_mb = 64;
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    const int N = 100;
+    SyncClosure sc;
+    for (int i = 0; i < N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        std::string buf;
+        butil::string_printf(&buf, "hello_%d", i);
+        entry->data.append(buf);
+        entry->id = braft::LogId(i + 1, 1);
+        entries.push_back(entry);
+        sc.reset();
+        lm->append_entries(&entries, &sc);
+        sc.join();
+        ASSERT_TRUE(sc.status().ok()) << sc.status();
+    }
+    lm->set_applied_id(braft::LogId(N / 2, 1));
+    usleep(100 * 1000l);
+    ASSERT_EQ(N / 2 + 1, lm->_logs_in_memory.front()->id.index);
+    braft::LogEntryCache* cache = braft::LogEntryCache::get_instance();
+    ASSERT_TRUE(cache != NULL);
+    std::vector<braft::LogEntry*> first_read;
+    for (int i = 0; i < N / 2; ++i) {
+        braft::LogEntry* entry = lm->get_entry(i + 1);
+        ASSERT_TRUE(entry != NULL);
+        std::string buf;
+        butil::string_printf(&buf, "hello_%d", i);
+        ASSERT_EQ(buf, entry->data.to_string());
+        first_read.push_back(entry);
+    }
+    ASSERT_LT(0u, cache->size());
+    // Entries read from storage are served by the cache afterwards
+    for (int i = 0; i < N / 2; ++i) {
+        braft::LogEntry* entry = lm->get_entry(i + 1);
+        ASSERT_EQ(first_read[i], entry);
+        entry->Release();
+    }
+    // Truncating replaces the cache id, the cached entries are never hit
+    const int64_t saved_cache_id = lm->_cache_id;
+    lm->unsafe_truncate_suffix(N / 2);
+    ASSERT_NE(saved_cache_id, lm->_cache_id);
+    ASSERT_TRUE(cache->get(lm->_cache_id, 1) == NULL);
+    for (int i = 0; i < N / 2; ++i) {
+        braft::LogEntry* entry = lm->get_entry(i + 1);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_NE(first_read[i], entry);
+        entry->Release();
+        first_read[i]->Release();
+    }
+    braft::FLAGS_raft_log_cache_size_mb = saved_cache_size;
+}
+
+TEST_F(LogManagerTest, get_entries) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    const int N = 100;
+    SyncClosure sc;
+    for (int i = 0; i < N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        std::string buf;
+        butil::string_printf(&buf, "hello_%d", i);
+        entry->data.append(buf);
+        entry->id = braft::LogId(i + 1, 1);
+        entries.push_back(entry);
+        sc.reset();
+        lm->append_entries(&entries, &sc);
+        sc.join();
+        ASSERT_TRUE(sc.status().ok()) << sc.status();
+    }
+    // The first half is only in storage
+    lm->set_applied_id(braft::LogId(N / 2, 1));
+    usleep(100 * 1000l);
+    ASSERT_EQ(N / 2 + 1, lm->_logs_in_memory.front()->id.index);
+    std::vector<braft::LogEntry*> entries;
+    ASSERT_EQ(N, lm->get_entries(1, N + 10, SIZE_MAX, &entries));
+    for (int i = 0; i < N; ++i) {
+        std::string buf;
+        butil::string_printf(&buf, "hello_%d", i);
+        ASSERT_EQ(buf, entries[i]->data.to_string());
+        ASSERT_EQ(i + 1, entries[i]->id.index);
+        entries[i]->Release();
+    }
+    entries.clear();
+    ASSERT_EQ(10, lm->get_entries(N / 2 - 4, 10, SIZE_MAX, &entries));
+    ASSERT_EQ(N / 2 - 4, entries.front()->id.index);
+    ASSERT_EQ(N / 2 + 5, entries.back()->id.index);
+    ASSERT_EQ(0, lm->get_entries(N + 1, 10, SIZE_MAX, &entries));
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+}
+
+struct ReplicatorArg {
+    braft::LogManager* lm;
+    butil::atomic<bool>* stop;
+    int64_t count;
+};
+
+static void* replicate_from_memory(void* arg) {
+    ReplicatorArg* ra = (ReplicatorArg*)arg;
+    while (!ra->stop->load(butil::memory_order_relaxed)) {
+        const int64_t last_index = ra->lm->last_log_index();
+        for (int64_t i = std::max(last_index - 256, (int64_t)1);
+                i <= last_index; ++i) {
+            braft::LogEntry* entry = ra->lm->get_entry(i);
+            if (entry) {
+                ra->lm->get_term(i);
+                entry->Release();
+                ++ra->count;
+            }
+        }
+    }
+    return NULL;
+}
+
+TEST_F(LogManagerTest, get_entry_with_replicators_benchmark) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    butil::atomic<bool> stop(false);
+    const int R = 6;
+    pthread_t tids[R];
+    ReplicatorArg args[R];
+    for (int i = 0; i < R; ++i) {
+        args[i].lm = lm.get();
+        args[i].stop = &stop;
+        args[i].count = 0;
+        ASSERT_EQ(0, pthread_create(&tids[i], NULL, replicate_from_memory, &args[i]));
+    }
+    butil::Timer timer;
+    timer.start();
+    const int N = 100000;
+    for (int i = 0; i < N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append("hello");
+        entry->id = braft::LogId(i + 1, 1);
+        entries.push_back(entry);
+        lm->append_entries(&entries, new StuckClosure);
+        // Logs are applied soon after being appended
+        if (i > 1000) {
+            lm->set_applied_id(braft::LogId(i - 1000, 1));
+        }
+    }
+    lm->last_log_id(true);
+    timer.stop();
+    stop.store(true);
+    int64_t count = 0;
+    for (int i = 0; i < R; ++i) {
+        pthread_join(tids[i], NULL);
+        count += args[i].count;
+    }
+    LOG(INFO) << "replicators=" << R << " append_qps="
+              << N * 1000000L / timer.u_elapsed()
+              << " get_entry_qps=" << count * 1000000L / timer.u_elapsed();
+}
+
+namespace braft {
+DECLARE_int64(raft_max_logs_in_memory_bytes);
+}
+
+TEST_F(LogManagerTest, memory_budget) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    braft::FLAGS_raft_max_logs_in_memory_bytes = 100 * 1024;
+    const int N = 100;
+    std::string payload(1024, 'a');
+    SyncClosure sc;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_FALSE(lm->memory_budget_exceeded());
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append(payload);
+        entry->id = braft::LogId(i + 1, 1);
+        entries.push_back(entry);
+        sc.reset();
+        lm->append_entries(&entries, &sc);
+        sc.join();
+    }
+    // Logs are kept in memory until being applied
+    braft::LogManagerStatus status;
+    lm->get_status(&status);
+    ASSERT_EQ(N * 1024, status.memory_bytes);
+    ASSERT_TRUE(lm->memory_budget_exceeded());
+    ASSERT_FALSE(lm->wait_memory_budget());
+    lm->set_applied_id(braft::LogId(N, 1));
+    lm->get_status(&status);
+    ASSERT_EQ(0, status.memory_bytes);
+    ASSERT_FALSE(lm->memory_budget_exceeded());
+    braft::FLAGS_raft_max_logs_in_memory_bytes = 0;
+}
+
+namespace braft {
+DECLARE_int32(raft_append_batch_target_latency_us);
+DECLARE_int32(raft_max_adaptive_append_buffer_size);
+DECLARE_int32(raft_max_append_buffer_size);
+}
+
+TEST_F(LogManagerTest, adaptive_append_buffer_limit) {
+    braft::LogManager lm;
+    ASSERT_EQ(braft::FLAGS_raft_max_append_buffer_size,
+              lm._append_buffer_limit.load());
+    // Fixed limit by default
+    lm.adjust_append_buffer_limit(1000000, false);
+    ASSERT_EQ(braft::FLAGS_raft_max_append_buffer_size,
+              lm._append_buffer_limit.load());
+
+    braft::FLAGS_raft_append_batch_target_latency_us = 1000;
+    const int64_t saved_limit = lm._append_buffer_limit.load();
+    // Grow while the queue backs up and the latency is fine
+    lm.adjust_append_buffer_limit(500, true);
+    ASSERT_LT(saved_limit, lm._append_buffer_limit.load());
+    // Unchanged if the buffer isn't full
+    int64_t limit = lm._append_buffer_limit.load();
+    lm.adjust_append_buffer_limit(500, false);
+    ASSERT_EQ(limit, lm._append_buffer_limit.load());
+    // Shrink multiplicatively when the latency is too high
+    lm.adjust_append_buffer_limit(2000, true);
+    ASSERT_EQ(limit * 3 / 4, lm._append_buffer_limit.load());
+    for (int i = 0; i < 1000; ++i) {
+        lm.adjust_append_buffer_limit(2000, true);
+    }
+    ASSERT_LT(0, lm._append_buffer_limit.load());
+    limit = lm._append_buffer_limit.load();
+    for (int i = 0; i < 100000; ++i) {
+        lm.adjust_append_buffer_limit(100, true);
+    }
+    ASSERT_EQ(braft::FLAGS_raft_max_adaptive_append_buffer_size,
+              lm._append_buffer_limit.load());
+    braft::FLAGS_raft_append_batch_target_latency_us = 0;
+}
+
+namespace braft {
+DECLARE_bool(raft_batch_new_log_waiters);
+}
+
+TEST_F(LogManagerTest, batch_new_log_waiters) {
+    system("rm -rf ./data");
+    braft::FLAGS_raft_batch_new_log_waiters = true;
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    const int W = 5;
+    for (int round = 1; round <= 10; ++round) {
+        SyncClosure sc[W];
+        for (int i = 0; i < W; ++i) {
+            ASSERT_NE(0, lm->wait(lm->last_log_index(), on_new_log, &sc[i]));
+        }
+        ASSERT_EQ(0, append_entry(lm.get(), "hello", round));
+        for (int i = 0; i < W; ++i) {
+            sc[i].join();
+        }
+    }
+    braft::FLAGS_raft_batch_new_log_waiters = false;
+}
+
+namespace braft {
+DECLARE_int32(raft_compact_logs_in_memory_max_bytes);
+DECLARE_int32(raft_compact_logs_in_memory_age_ms);
+}
+
+TEST_F(LogManagerTest, compact_memory_logs) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    braft::FLAGS_raft_compact_logs_in_memory_max_bytes = 1024;
+    braft::FLAGS_raft_compact_logs_in_memory_age_ms = 0;
+    const int N = 100;
+    // Small logs cut from a large buffer, e.g. a batch of requests
+    butil::IOBuf buf;
+    for (int i = 0; i < N; ++i) {
+        buf.append(std::string(100, 'a' + i % 26));
+        buf.append(std::string(1000, 'z'));
+    }
+    std::vector<braft::LogEntry*> saved;
+    std::vector<butil::IOBuf> datas;
+    SyncClosure sc;
+    for (int i = 0; i < N; ++i) {
+        std::vector<braft::LogEntry*> entries;
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        buf.cutn(&entry->data, 100);
+        buf.pop_front(1000);
+        entry->id = braft::LogId(i + 1, 1);
+        datas.push_back(entry->data);
+        entry->AddRef();
+        saved.push_back(entry);
+        entries.push_back(entry);
+        sc.reset();
+        lm->append_entries(&entries, &sc);
+        sc.join();
+    }
+    // The first round marks the logs, which are compacted in the next round
+    lm->set_applied_id(braft::LogId(1, 1));
+    lm->set_applied_id(braft::LogId(2, 1));
+    for (int i = 3; i <= N; ++i) {
+        braft::LogEntry* entry = lm->get_entry(i);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_NE(saved[i - 1], entry);
+        ASSERT_EQ(braft::ENTRY_TYPE_DATA, entry->type);
+        ASSERT_EQ(braft::LogId(i, 1), entry->id);
+        ASSERT_EQ(datas[i - 1].to_string(), entry->data.to_string());
+        entry->Release();
+    }
+    braft::LogManagerStatus status;
+    lm->get_status(&status);
+    ASSERT_EQ((N - 2) * 100, status.memory_bytes);
+    for (size_t i = 0; i < saved.size(); ++i) {
+        saved[i]->Release();
+    }
+    lm->set_applied_id(braft::LogId(N, 1));
+    lm->get_status(&status);
+    ASSERT_EQ(0, status.memory_bytes);
+    braft::FLAGS_raft_compact_logs_in_memory_max_bytes = 0;
+    braft::FLAGS_raft_compact_logs_in_memory_age_ms = 1000;
+}
+
+namespace braft {
+DECLARE_bool(raft_share_disk_thread);
+}
+
+TEST_F(LogManagerTest, shared_disk_thread) {
+    system("rm -rf ./data");
+    braft::FLAGS_raft_share_disk_thread = true;
+    const int M = 3;
+    scoped_ptr<braft::ConfigurationManager> cms[M];
+    scoped_ptr<braft::SegmentLogStorage> storages[M];
+    scoped_ptr<braft::LogManager> lms[M];
+    for (int i = 0; i < M; ++i) {
+        cms[i].reset(new braft::ConfigurationManager);
+        storages[i].reset(new braft::SegmentLogStorage(
+                    butil::string_printf("./data/%d", i)));
+        lms[i].reset(new braft::LogManager());
+        braft::LogManagerOptions opt;
+        opt.log_storage = storages[i].get();
+        opt.configuration_manager = cms[i].get();
+        opt.disk = braft::SnapshotScheduler::disk_of("local://./data");
+        ASSERT_NE(0u, opt.disk);
+        ASSERT_EQ(0, lms[i]->init(opt));
+        ASSERT_TRUE(lms[i]->_shared_disk_thread != NULL);
+    }
+    // All the LogManagers on the device share one thread
+    ASSERT_EQ(lms[0]->_shared_disk_thread, lms[M - 1]->_shared_disk_thread);
+    const int N = 100;
+    SyncClosure sc[M];
+    for (int i = 0; i < N; ++i) {
+        for (int j = 0; j < M; ++j) {
+            std::vector<braft::LogEntry*> entries;
+            braft::LogEntry* entry = new braft::LogEntry;
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->data.append(butil::string_printf("hello_%d_%d", j, i));
+            entry->id = braft::LogId(i + 1, 1);
+            entries.push_back(entry);
+            sc[j].reset();
+            lms[j]->append_entries(&entries, &sc[j]);
+        }
+        for (int j = 0; j < M; ++j) {
+            sc[j].join();
+            ASSERT_TRUE(sc[j].status().ok()) << sc[j].status();
+        }
+    }
+    for (int j = 0; j < M; ++j) {
+        // Operations other than appending go through the thread in order
+        ASSERT_EQ(braft::LogId(N, 1), lms[j]->last_log_id(true));
+        ASSERT_EQ(N, storages[j]->last_log_index());
+        lms[j]->set_applied_id(braft::LogId(N, 1));
+        braft::LogEntry* entry = storages[j]->get_entry(N / 2);
+        ASSERT_EQ(butil::string_printf("hello_%d_%d", j, N / 2 - 1),
+                  entry->data.to_string());
+        entry->Release();
+    }
+    for (int j = 0; j < M; ++j) {
+        lms[j].reset();
+    }
+    braft::FLAGS_raft_share_disk_thread = false;
+}
+
+namespace braft {
+DECLARE_int64(raft_retained_log_bytes);
+}
+
+TEST_F(LogManagerTest, retained_log) {
+    system("rm -rf ./data");
+    braft::FLAGS_raft_retained_log_bytes = 1024 * 1024;
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    for (int i = 1; i <= 1000; ++i) {
+        ASSERT_EQ(0, append_entry(lm.get(), "hello", i));
+    }
+    // The slowest follower needs the logs from 201
+    lm->set_retained_index(201);
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(500);
+    meta.set_last_included_term(1);
+    lm->set_snapshot(&meta);
+    meta.set_last_included_index(800);
+    lm->set_snapshot(&meta);
+    ASSERT_EQ(201, lm->first_log_index());
+    ASSERT_EQ(1, lm->get_term(200));
+    ASSERT_NE(std::string::npos, lm->last_truncation().find("retained"))
+            << lm->last_truncation();
+
+    // The logs from 201 take more bytes than the budget
+    braft::FLAGS_raft_retained_log_bytes = 100;
+    lm->clear_bufferred_logs();
+    ASSERT_EQ(801, lm->first_log_index());
+    ASSERT_EQ(1, lm->get_term(800));
+    ASSERT_NE(std::string::npos,
+              lm->last_truncation().find("raft_retained_log_bytes"))
+            << lm->last_truncation();
+    braft::FLAGS_raft_retained_log_bytes = 0;
+}
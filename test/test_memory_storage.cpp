@@ -3,7 +3,10 @@
 // Author: qinduohao@baidu.com
 // Date: 2017/05/23
 
+#include <pthread.h>
 #include <gtest/gtest.h>
+#include <butil/atomicops.h>
+#include <butil/fast_rand.h>
 #include "braft/memory_log.h"
 
 namespace braft {
@@ -95,3 +98,119 @@ TEST_F(MemStorageTest, trunk_operation) {
     entry1->Release();
     delete log_storage;
 }
+
+TEST_F(MemStorageTest, capacity) {
+    ASSERT_FALSE(braft::LogStorage::create("memory://data/log?max_bytes="));
+    ASSERT_FALSE(braft::LogStorage::create("memory://data/log?max_bytes=1k"));
+    braft::LogStorage* log_storage = braft::LogStorage::create("memory://data/log");
+    ASSERT_TRUE(log_storage);
+    ASSERT_EQ(0, log_storage->capacity_bytes());
+    delete log_storage;
+
+    log_storage = braft::LogStorage::create("memory://data/log?max_bytes=100");
+    ASSERT_TRUE(log_storage);
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, log_storage->init(&cm));
+    ASSERT_EQ(100, log_storage->capacity_bytes());
+    std::vector<braft::LogEntry*> entries;
+    for (int i = 0; i < 10; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->AddRef();
+        entry->data.append("hello world");
+        entry->id = braft::LogId(i + 1, 1);
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entries.push_back(entry);
+    }
+    ASSERT_EQ(10, log_storage->append_entries(entries));
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+    ASSERT_EQ(110, log_storage->used_bytes());
+    ASSERT_EQ(0, log_storage->truncate_prefix(6));
+    ASSERT_EQ(55, log_storage->used_bytes());
+    ASSERT_EQ(0, log_storage->get_term(5));
+    ASSERT_TRUE(log_storage->get_entry(5) == NULL);
+    ASSERT_EQ(1, log_storage->get_term(6));
+    ASSERT_EQ(0, log_storage->truncate_suffix(7));
+    ASSERT_EQ(22, log_storage->used_bytes());
+    ASSERT_EQ(0, log_storage->reset(20));
+    ASSERT_EQ(0, log_storage->used_bytes());
+    delete log_storage;
+}
+
+struct ConcurrentReadArg {
+    braft::LogStorage* log_storage;
+    butil::atomic<bool> stop;
+    butil::atomic<int64_t> nread;
+    butil::atomic<int64_t> nmiss;
+};
+
+static void* read_while_appending(void* void_arg) {
+    ConcurrentReadArg* arg = (ConcurrentReadArg*)void_arg;
+    while (!arg->stop.load(butil::memory_order_relaxed)) {
+        const int64_t first_index = arg->log_storage->first_log_index();
+        const int64_t last_index = arg->log_storage->last_log_index();
+        if (last_index < first_index) {
+            continue;
+        }
+        // The last logs are the likeliest to be read by the replicators
+        const int64_t index = (butil::fast_rand() & 1) ? last_index
+                : butil::fast_rand_in(first_index, last_index);
+        braft::LogEntry* entry = arg->log_storage->get_entry(index);
+        if (entry == NULL) {
+            arg->nmiss.fetch_add(1, butil::memory_order_relaxed);
+        } else {
+            if (entry->id.index != index) {
+                arg->nmiss.fetch_add(1, butil::memory_order_relaxed);
+            }
+            entry->Release();
+        }
+        if (arg->log_storage->get_term(index) != 1) {
+            arg->nmiss.fetch_add(1, butil::memory_order_relaxed);
+        }
+        arg->nread.fetch_add(1, butil::memory_order_relaxed);
+    }
+    return NULL;
+}
+
+TEST_F(MemStorageTest, read_while_growing) {
+    braft::LogStorage* log_storage = braft::LogStorage::create("memory://data/log");
+    ASSERT_TRUE(log_storage);
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, log_storage->init(&cm));
+    ConcurrentReadArg arg;
+    arg.log_storage = log_storage;
+    arg.stop.store(false);
+    arg.nread.store(0);
+    arg.nmiss.store(0);
+    pthread_t tids[4];
+    for (size_t i = 0; i < 4; ++i) {
+        ASSERT_EQ(0, pthread_create(&tids[i], NULL, read_while_appending, &arg));
+    }
+    // The ring starts with 256 slots and doubles 7 times
+    const int64_t nentries = 256 << 7;
+    int64_t index = 1;
+    while (index <= nentries) {
+        std::vector<braft::LogEntry*> entries;
+        for (int i = 0; i < 16; ++i, ++index) {
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->AddRef();
+            entry->data.append("hello world");
+            entry->id = braft::LogId(index, 1);
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entries.push_back(entry);
+        }
+        ASSERT_EQ(entries.size(), (size_t)log_storage->append_entries(entries));
+        for (size_t i = 0; i < entries.size(); ++i) {
+            entries[i]->Release();
+        }
+    }
+    arg.stop.store(true);
+    for (size_t i = 0; i < 4; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    ASSERT_EQ(nentries, log_storage->last_log_index());
+    ASSERT_LT(0, arg.nread.load());
+    ASSERT_EQ(0, arg.nmiss.load());
+    delete log_storage;
+}
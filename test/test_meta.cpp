@@ -1,5 +1,8 @@
 #include <gtest/gtest.h>
+#include <unistd.h>
+#include <gflags/gflags.h>
 #include "braft/raft_meta.h"
+#include "braft/shared_meta.h"
 
 class TestUsageSuits : public testing::Test {
 protected:
@@ -60,3 +63,81 @@ TEST_F(TestUsageSuits, sanity) {
     }
     delete storage;
 }
+
+TEST_F(TestUsageSuits, shared_meta) {
+    ::system("rm -rf ./data_shared_meta");
+    braft::RaftMetaStorage* storage1 = braft::SharedRaftMetaStorage()
+            .new_instance("./data_shared_meta?group=g1");
+    braft::RaftMetaStorage* storage2 = braft::SharedRaftMetaStorage()
+            .new_instance("./data_shared_meta?group=g2");
+    ASSERT_TRUE(storage1 != NULL);
+    ASSERT_TRUE(storage2 != NULL);
+    ASSERT_TRUE(braft::SharedRaftMetaStorage()
+            .new_instance("./data_shared_meta") == NULL);
+
+    // no init
+    ASSERT_EQ(-1, storage1->set_term(10));
+    ASSERT_EQ(-1, storage1->get_term());
+
+    ASSERT_EQ(0, storage1->init());
+    ASSERT_EQ(0, storage2->init());
+    ASSERT_EQ(1, storage1->get_term());
+    braft::RaftMetaStorage* dup = braft::SharedRaftMetaStorage()
+            .new_instance("./data_shared_meta?group=g1");
+    ASSERT_NE(0, dup->init());
+    delete dup;
+
+    braft::PeerId candidate1;
+    ASSERT_EQ(0, candidate1.parse("1.1.1.1:1000:0"));
+    braft::PeerId candidate2;
+    ASSERT_EQ(0, candidate2.parse("2.2.2.2:2000:0"));
+    ASSERT_EQ(0, storage1->set_term_and_votedfor(10, candidate1));
+    ASSERT_EQ(0, storage2->set_term(20));
+    ASSERT_EQ(0, storage2->set_votedfor(candidate2));
+    delete storage1;
+    delete storage2;
+
+    storage1 = braft::SharedRaftMetaStorage()
+            .new_instance("./data_shared_meta?group=g1");
+    storage2 = braft::SharedRaftMetaStorage()
+            .new_instance("./data_shared_meta?group=g2");
+    ASSERT_EQ(0, storage1->init());
+    ASSERT_EQ(0, storage2->init());
+    braft::PeerId peer;
+    ASSERT_EQ(10, storage1->get_term());
+    ASSERT_EQ(0, storage1->get_votedfor(&peer));
+    ASSERT_EQ(candidate1, peer);
+    ASSERT_EQ(20, storage2->get_term());
+    ASSERT_EQ(0, storage2->get_votedfor(&peer));
+    ASSERT_EQ(candidate2, peer);
+    delete storage2;
+
+    // The file is compacted in background once it's large enough
+    GFLAGS_NS::SetCommandLineOption("raft_shared_meta_compact_size", "4096");
+    braft::SharedMetaLog* log = braft::SharedMetaLog::open("./data_shared_meta");
+    ASSERT_TRUE(log != NULL);
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQ(0, storage1->set_term(100 + i));
+    }
+    for (int i = 0; i < 100 && log->file_size() >= 4096; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_LT(log->file_size(), 4096);
+    delete storage1;
+    braft::SharedMetaLog::close(log);
+
+    storage1 = braft::SharedRaftMetaStorage()
+            .new_instance("./data_shared_meta?group=g1");
+    storage2 = braft::SharedRaftMetaStorage()
+            .new_instance("./data_shared_meta?group=g2");
+    ASSERT_EQ(0, storage1->init());
+    ASSERT_EQ(0, storage2->init());
+    ASSERT_EQ(1099, storage1->get_term());
+    ASSERT_EQ(0, storage1->get_votedfor(&peer));
+    ASSERT_EQ(candidate1, peer);
+    ASSERT_EQ(20, storage2->get_term());
+    delete storage1;
+    delete storage2;
+    GFLAGS_NS::SetCommandLineOption("raft_shared_meta_compact_size",
+                                    "4194304");
+}
@@ -13,21 +13,43 @@
 #include <butil/files/file_path.h>
 #include <butil/file_util.h>
 #include <butil/fast_rand.h>
+#include <brpc/channel.h>
 #include <brpc/closure_guard.h>
 #include <bthread/bthread.h>
 #include <bthread/countdown_event.h>
 #include "braft/snapshot_throttle.h"
 #include "braft/node.h"
 #include "braft/enum.pb.h"
+#include "braft/raft.pb.h"
 #include "braft/errno.pb.h"
+#include "braft/builtin_service.pb.h"
 #include <braft/snapshot_throttle.h>
 #include <braft/snapshot_executor.h> 
+#include "braft/append_entries_aggregator.h"
+#include "braft/leader_balancer.h"
 
 namespace braft {
 extern bvar::Adder<int64_t> g_num_nodes;
 DECLARE_int32(raft_max_parallel_append_entries_rpc_num);
 DECLARE_bool(raft_enable_append_entries_cache);
 DECLARE_int32(raft_max_append_entries_cache_size);
+DECLARE_int64(raft_max_append_entries_cache_bytes);
+DECLARE_int32(raft_hibernate_idle_ms);
+DECLARE_int32(raft_hibernate_heartbeat_interval_ms);
+DECLARE_int32(raft_election_heartbeat_factor);
+DECLARE_bool(raft_propagate_committed_index);
+DECLARE_bool(raft_separate_control_connection);
+DECLARE_int32(raft_replicator_connection_num);
+DECLARE_bool(raft_enable_multi_vote);
+DECLARE_int32(raft_election_start_spread_ms);
+DECLARE_int32(raft_leader_balance_interval_ms);
+DECLARE_string(raft_transport);
+DECLARE_bool(raft_enable_adaptive_election_timeout);
+DECLARE_int32(raft_adaptive_election_timeout_min_ms);
+DECLARE_bool(raft_replicator_adaptive_window);
+DECLARE_int64(raft_replicator_max_window_bytes);
+DECLARE_int64(raft_follower_backlog_limit_bytes);
+DECLARE_bool(raft_expose_replicator_bvars);
 }
 
 using braft::raft_mutex_t;
@@ -221,7 +243,8 @@ public:
     Cluster(const std::string& name, const std::vector<braft::PeerId>& peers,
             int32_t election_timeout_ms = 3000)
         : _name(name), _peers(peers) 
-        , _election_timeout_ms(election_timeout_ms) {
+        , _election_timeout_ms(election_timeout_ms)
+        , _enable_leader_lease(false) {
         int64_t throttle_throughput_bytes = 10 * 1024 * 1024;
         int64_t check_cycle = 10;
         _throttle = new braft::ThroughputSnapshotThrottle(throttle_throughput_bytes, check_cycle);
@@ -231,7 +254,7 @@ public:
     }
 
     int start(const butil::EndPoint& listen_addr, bool empty_peers = false,
-              int snapshot_interval_s = 30) {
+              int snapshot_interval_s = 30, bool witness = false) {
         if (_server_map[listen_addr] == NULL) {
             brpc::Server* server = new brpc::Server();
             if (braft::add_service(server, listen_addr) != 0 
@@ -263,8 +286,12 @@ public:
         options.snapshot_throttle = &tst;
 
         options.catchup_margin = 2;
+        options.witness = witness;
+        options.enable_leader_lease = _enable_leader_lease;
+        options.election_priority = _election_priorities[listen_addr];
 
-        braft::Node* node = new braft::Node(_name, braft::PeerId(listen_addr, 0));
+        braft::Node* node = new braft::Node(_name,
+                                            braft::PeerId(listen_addr, 0, witness));
         int ret = node->init(options);
         if (ret != 0) {
             LOG(WARNING) << "init_node failed, server: " << listen_addr;
@@ -496,6 +523,8 @@ private:
     std::vector<MockFSM*> _fsms;
     std::map<butil::EndPoint, brpc::Server*> _server_map;
     int32_t _election_timeout_ms;
+    bool _enable_leader_lease;
+    std::map<butil::EndPoint, int> _election_priorities;
     raft_mutex_t _mutex;
     braft::SnapshotThrottle* _throttle;
 };
@@ -617,6 +646,374 @@ TEST_P(NodeTest, SingleNode) {
     server.Join();
 }
 
+TEST_P(NodeTest, transport) {
+    brpc::ServerOptions server_options;
+    braft::FLAGS_raft_transport = "unknown";
+    ASSERT_EQ(-1, braft::setup_server_options(&server_options));
+    braft::FLAGS_raft_transport = "tcp";
+    ASSERT_EQ(0, braft::setup_server_options(&server_options));
+
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    // The replicas use the transport to reach each other
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        data.append("hello");
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, adaptive_election_timeout) {
+    braft::FLAGS_raft_enable_adaptive_election_timeout = true;
+    braft::FLAGS_raft_adaptive_election_timeout_min_ms = 100;
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    Cluster cluster("unittest", peers, 1000);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    // Let the leader measure the RTT and the followers learn the timeout
+    // derived from it
+    sleep(3);
+
+    // The failover takes much less than the configured election timeout on
+    // the local network
+    butil::EndPoint old_leader = leader->node_id().peer_id.addr;
+    cluster.stop(old_leader);
+    const int64_t start_ms = butil::monotonic_time_ms();
+    cluster.wait_leader();
+    const int64_t failover_ms = butil::monotonic_time_ms() - start_ms;
+    LOG(WARNING) << "failover takes " << failover_ms << "ms";
+    ASSERT_LT(failover_ms, 1000);
+
+    cluster.stop_all();
+    braft::FLAGS_raft_enable_adaptive_election_timeout = false;
+}
+
+TEST_P(NodeTest, adaptive_election_timeout_new_leader) {
+    braft::FLAGS_raft_enable_adaptive_election_timeout = true;
+    braft::FLAGS_raft_adaptive_election_timeout_min_ms = 100;
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    // The heartbeat interval of the default timeout is longer than the
+    // adapted timeout
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    sleep(4);
+
+    cluster.stop(leader->node_id().peer_id.addr);
+    cluster.wait_leader();
+    leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t term = leader->_impl->_current_term;
+
+    // The new leader doesn't advertise the timeout it learned as a follower
+    // before measuring the RTT itself, which would make the followers start
+    // elections between its heartbeats
+    usleep(2000 * 1000);
+    ASSERT_EQ(leader, cluster.leader());
+    ASSERT_EQ(term, leader->_impl->_current_term);
+
+    cluster.stop_all();
+    braft::FLAGS_raft_enable_adaptive_election_timeout = false;
+}
+
+TEST_P(NodeTest, init_nodes) {
+    brpc::Server server;
+    ASSERT_EQ(0, braft::add_service(&server, 5006));
+    ASSERT_EQ(0, server.Start(5006, NULL));
+
+    braft::PeerId peer;
+    peer.addr.ip = butil::my_ip();
+    peer.addr.port = 5006;
+    peer.idx = 0;
+    std::vector<braft::PeerId> peers;
+    peers.push_back(peer);
+
+    const int N = 8;
+    std::vector<braft::Node*> nodes;
+    std::vector<braft::NodeInitTask> tasks(N + 1);
+    bthread::CountdownEvent inited(N + 1);
+    for (int i = 0; i < N + 1; ++i) {
+        const std::string group = butil::string_printf("init_nodes_%d", i);
+        braft::Node* node = new braft::Node(group, peer);
+        nodes.push_back(node);
+        braft::NodeInitTask& task = tasks[i];
+        task.node = node;
+        task.priority = i % 3;
+        task.options.election_timeout_ms = 300;
+        task.options.initial_conf = braft::Configuration(peers);
+        task.options.fsm = new MockFSM(butil::EndPoint());
+        task.options.log_uri = "local://./data/" + group + "/log";
+        task.options.raft_meta_uri = "local://./data/" + group + "/raft_meta";
+        task.options.snapshot_uri = "local://./data/" + group + "/snapshot";
+        task.done = NEW_APPLYCLOSURE(&inited, i < N ? 0 : EINVAL);
+    }
+    // The last one fails for the invalid log storage
+    tasks[N].options.log_uri = "invalid://./data/init_nodes/log";
+
+    braft::InitNodesOptions options;
+    options.concurrency = 3;
+    options.max_concurrent_per_disk = 2;
+    ASSERT_EQ(-1, braft::init_nodes(&tasks, options));
+    inited.wait();
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, tasks[i].rc);
+    }
+    ASSERT_NE(0, tasks[N].rc);
+
+    // All the single-peer groups elect themselves
+    for (int i = 0; i < N; ++i) {
+        while (!nodes[i]->is_leader()) {
+            usleep(10 * 1000);
+        }
+    }
+    for (int i = 0; i < N + 1; ++i) {
+        delete nodes[i];
+        delete tasks[i].options.fsm;
+    }
+
+    server.Stop(200);
+    server.Join();
+}
+
+class MockLogSubscriber : public braft::LogSubscriber {
+public:
+    MockLogSubscriber() : stopped(1), max_batch_size(0) {}
+    void on_logs(const std::vector<braft::SubscribedLog>& logs,
+                 braft::Closure* done) {
+        braft::AsyncClosureGuard done_guard(done);
+        BAIDU_SCOPED_LOCK(mutex);
+        for (size_t i = 0; i < logs.size(); ++i) {
+            indexes.push_back(logs[i].index);
+            datas.push_back(logs[i].data.to_string());
+        }
+        max_batch_size = std::max(max_batch_size, logs.size());
+    }
+    void on_stop(const butil::Status& status) {
+        stop_status = status;
+        stopped.signal();
+    }
+    size_t size() {
+        BAIDU_SCOPED_LOCK(mutex);
+        return datas.size();
+    }
+
+    raft_mutex_t mutex;
+    std::vector<int64_t> indexes;
+    std::vector<std::string> datas;
+    bthread::CountdownEvent stopped;
+    butil::Status stop_status;
+    size_t max_batch_size;
+};
+
+TEST_P(NodeTest, subscribe_logs) {
+    brpc::Server server;
+    int ret = braft::add_service(&server, 5006);
+    server.Start(5006, NULL);
+    ASSERT_EQ(0, ret);
+
+    braft::PeerId peer;
+    peer.addr.ip = butil::my_ip();
+    peer.addr.port = 5006;
+    peer.idx = 0;
+    std::vector<braft::PeerId> peers;
+    peers.push_back(peer);
+
+    braft::NodeOptions options;
+    options.election_timeout_ms = 300;
+    options.initial_conf = braft::Configuration(peers);
+    options.fsm = new MockFSM(butil::EndPoint());
+    options.log_uri = "local://./data/log";
+    options.raft_meta_uri = "local://./data/raft_meta";
+    options.snapshot_uri = "local://./data/snapshot";
+
+    braft::Node node("unittest", peer);
+    ASSERT_EQ(0, node.init(options));
+
+    // Subscribe before the logs are applied
+    MockLogSubscriber subscriber1;
+    braft::LogSubscriptionOptions sub_options;
+    int64_t id1 = 0;
+    ASSERT_EQ(0, node.subscribe_logs(sub_options, &subscriber1, &id1));
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        node.apply(task);
+    }
+    cond.wait();
+    for (int i = 0; i < 100 && subscriber1.size() < 10; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_EQ(10u, subscriber1.size());
+    for (size_t i = 0; i < subscriber1.datas.size(); ++i) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", (int)i + 1);
+        ASSERT_EQ(data_buf, subscriber1.datas[i]);
+        if (i > 0) {
+            ASSERT_LT(subscriber1.indexes[i - 1], subscriber1.indexes[i]);
+        }
+    }
+    ASSERT_EQ(0, node.unsubscribe_logs(id1));
+    subscriber1.stopped.wait();
+    ASSERT_EQ(ECANCELED, subscriber1.stop_status.error_code());
+    ASSERT_NE(0, node.unsubscribe_logs(id1));
+
+    // Catch up from the middle in small batches
+    MockLogSubscriber subscriber2;
+    sub_options.start_index = subscriber1.indexes[5];
+    sub_options.max_batch_count = 2;
+    int64_t id2 = 0;
+    ASSERT_EQ(0, node.subscribe_logs(sub_options, &subscriber2, &id2));
+    ASSERT_NE(id1, id2);
+    for (int i = 0; i < 100 && subscriber2.size() < 5; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_EQ(5u, subscriber2.size());
+    ASSERT_EQ(subscriber1.datas[5], subscriber2.datas[0]);
+    ASSERT_LE(subscriber2.max_batch_size, 2u);
+
+    cond.reset(1);
+    node.shutdown(NEW_SHUTDOWNCLOSURE(&cond, 0));
+    cond.wait();
+    subscriber2.stopped.wait();
+    ASSERT_EQ(braft::ENODESHUTDOWN, subscriber2.stop_status.error_code());
+
+    server.Stop(200);
+    server.Join();
+}
+
+TEST_P(NodeTest, memory_log_capacity) {
+    brpc::Server server;
+    int ret = braft::add_service(&server, 5006);
+    server.Start(5006, NULL);
+    ASSERT_EQ(0, ret);
+
+    braft::PeerId peer;
+    peer.addr.ip = butil::my_ip();
+    peer.addr.port = 5006;
+    peer.idx = 0;
+    std::vector<braft::PeerId> peers;
+    peers.push_back(peer);
+
+    braft::NodeOptions options;
+    options.election_timeout_ms = 300;
+    options.initial_conf = braft::Configuration(peers);
+    options.fsm = new MockFSM(butil::EndPoint());
+    options.log_uri = "memory://./data/log?max_bytes=512";
+    options.raft_meta_uri = "local://./data/raft_meta";
+    options.snapshot_uri = "local://./data/snapshot";
+    options.snapshot_interval_s = 0;
+    options.snapshot_min_interval_s = 3;
+
+    braft::Node node("unittest", peer);
+    ASSERT_EQ(0, node.init(options));
+    while (!node.is_leader()) {
+        usleep(10 * 1000);
+    }
+
+    // Fill the storage with 32 tasks of 16 bytes
+    bthread::CountdownEvent cond(32);
+    for (int i = 0; i < 32; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %09d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        node.apply(task);
+    }
+    cond.wait();
+
+    // The full storage rejects new tasks until a snapshot discards the logs,
+    // which is not taken within snapshot_min_interval_s
+    butil::IOBuf data;
+    data.append("hello");
+    braft::Task task;
+    task.data = &data;
+    cond.reset(1);
+    task.done = NEW_APPLYCLOSURE(&cond, EBUSY);
+    node.apply(task);
+    cond.wait();
+    braft::NodeStatus status;
+    node.get_status(&status);
+    ASSERT_EQ(0, status.snapshot_index);
+
+    for (int i = 0; i < 50; ++i) {
+        node.get_status(&status);
+        if (status.snapshot_index > 0 && !status.saving_snapshot) {
+            break;
+        }
+        usleep(100 * 1000);
+    }
+    ASSERT_GT(status.snapshot_index, 0);
+    ASSERT_GT(status.first_index, 1);
+
+    data.append("hello");
+    cond.reset(1);
+    task.done = NEW_APPLYCLOSURE(&cond, 0);
+    node.apply(task);
+    cond.wait();
+
+    cond.reset(1);
+    node.shutdown(NEW_SHUTDOWNCLOSURE(&cond, 0));
+    cond.wait();
+
+    server.Stop(200);
+    server.Join();
+}
+
 TEST_P(NodeTest, NoLeader) {
     std::vector<braft::PeerId> peers;
     for (int i = 0; i < 3; i++) {
@@ -2010,57 +2407,1484 @@ TEST_P(NodeTest, AutoSnapshot) {
     ASSERT_EQ(0, ret);
     ASSERT_EQ(0, server.Start(5006, &server_options));
 
-    braft::PeerId peer;
-    peer.addr.ip = butil::my_ip();
-    peer.addr.port = 5006;
-    peer.idx = 0;
+    braft::PeerId peer;
+    peer.addr.ip = butil::my_ip();
+    peer.addr.port = 5006;
+    peer.idx = 0;
+    std::vector<braft::PeerId> peers;
+    peers.push_back(peer);
+
+    braft::NodeOptions options;
+    options.election_timeout_ms = 300;
+    options.initial_conf = braft::Configuration(peers);
+    options.fsm = new MockFSM(butil::EndPoint());
+    options.log_uri = "local://./data/log";
+    options.raft_meta_uri = "local://./data/raft_meta";
+    options.snapshot_uri = "local://./data/snapshot";
+    options.snapshot_interval_s = 10;
+
+    braft::Node node("unittest", peer);
+    ASSERT_EQ(0, node.init(options));
+
+    // wait node elect to leader
+    sleep(2);
+
+    // apply something
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        node.apply(task);
+    }
+    cond.wait();
+
+    sleep(10);
+    ASSERT_GT(static_cast<MockFSM*>(options.fsm)->snapshot_index, 0);
+
+    // shutdown
+    cond.reset(1);
+    node.shutdown(NEW_SHUTDOWNCLOSURE(&cond, 0));
+    cond.wait();
+
+    // stop
+    server.Stop(200);
+    server.Join();
+}
+
+TEST_P(NodeTest, snapshot_by_log_entries) {
+    brpc::Server server;
+    brpc::ServerOptions server_options;
+    int ret = braft::add_service(&server, "0.0.0.0:5006");
+    ASSERT_EQ(0, ret);
+    ASSERT_EQ(0, server.Start(5006, &server_options));
+    GFLAGS_NS::SetCommandLineOption("raft_max_concurrent_snapshots_per_disk", "1");
+
+    braft::PeerId peer;
+    peer.addr.ip = butil::my_ip();
+    peer.addr.port = 5006;
+    peer.idx = 0;
+    std::vector<braft::PeerId> peers;
+    peers.push_back(peer);
+
+    braft::NodeOptions options;
+    options.election_timeout_ms = 300;
+    options.initial_conf = braft::Configuration(peers);
+    options.fsm = new MockFSM(butil::EndPoint());
+    options.log_uri = "local://./data/log";
+    options.raft_meta_uri = "local://./data/raft_meta";
+    options.snapshot_uri = "local://./data/snapshot";
+    // Only the growth of the logs triggers snapshots
+    options.snapshot_interval_s = 0;
+    options.snapshot_log_entries = 10;
+
+    braft::Node node("unittest", peer);
+    ASSERT_EQ(0, node.init(options));
+
+    // wait node elect to leader
+    sleep(2);
+    ASSERT_EQ(0, static_cast<MockFSM*>(options.fsm)->snapshot_index);
+
+    // apply something
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        node.apply(task);
+    }
+    cond.wait();
+
+    sleep(3);
+    ASSERT_GT(static_cast<MockFSM*>(options.fsm)->snapshot_index, 0);
+
+    // shutdown
+    cond.reset(1);
+    node.shutdown(NEW_SHUTDOWNCLOSURE(&cond, 0));
+    cond.wait();
+    GFLAGS_NS::SetCommandLineOption("raft_max_concurrent_snapshots_per_disk", "0");
+
+    // stop
+    server.Stop(200);
+    server.Join();
+}
+
+TEST_P(NodeTest, witness) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peer.role = i == 2 ? braft::PeerId::WITNESS : braft::PeerId::REPLICA;
+        peers.push_back(peer);
+    }
+    const braft::PeerId witness = peers[2];
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr, false, 30,
+                                   peers[i].is_witness()));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_NE(witness, leader->node_id().peer_id);
+    ASSERT_EQ(EINVAL, leader->transfer_leadership_to(witness));
+
+    // stop the other replica so that the logs are committed with the witness
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i]->node_id().peer_id != witness) {
+            ASSERT_EQ(0, cluster.stop(nodes[i]->node_id().peer_id.addr));
+        }
+    }
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    // The witness persists the logs without applying them
+    cluster.followers(&nodes);
+    ASSERT_EQ(1u, nodes.size());
+    ASSERT_EQ(leader->_impl->_log_manager->last_log_index(),
+              nodes[0]->_impl->_log_manager->last_log_index());
+    for (size_t i = 0; i < cluster._fsms.size(); i++) {
+        MockFSM* fsm = cluster._fsms[i];
+        fsm->lock();
+        if (fsm->address == witness.addr) {
+            ASSERT_TRUE(fsm->logs.empty());
+        } else {
+            ASSERT_EQ(10u, fsm->logs.size());
+        }
+        fsm->unlock();
+    }
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, apply_batch) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+
+    // One closure for each task
+    std::vector<butil::IOBuf> datas(100);
+    std::vector<braft::Task> tasks(datas.size());
+    bthread::CountdownEvent cond(datas.size());
+    for (size_t i = 0; i < datas.size(); i++) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", (int)i + 1);
+        datas[i].append(data_buf);
+        tasks[i].data = &datas[i];
+        tasks[i].done = NEW_APPLYCLOSURE(&cond, 0);
+    }
+    leader->apply(tasks);
+    cond.wait();
+
+    // One closure for the batch
+    for (size_t i = 0; i < datas.size(); i++) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d",
+                 (int)(datas.size() + i + 1));
+        datas[i].append(data_buf);
+        tasks[i].data = &datas[i];
+        tasks[i].done = NULL;
+    }
+    cond.reset(1);
+    leader->apply(tasks, NEW_APPLYCLOSURE(&cond, 0));
+    cond.wait();
+
+    // All the tasks of the batch are read back from the log
+    braft::UserLog user_log;
+    const int64_t batch_index = leader->_impl->_log_manager->last_log_index();
+    ASSERT_TRUE(leader->read_committed_user_log(batch_index, &user_log).ok());
+    ASSERT_EQ(batch_index, user_log.log_index());
+    ASSERT_EQ(datas.size(), user_log.task_count());
+    for (size_t i = 0; i < datas.size(); i++) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d",
+                 (int)(datas.size() + i + 1));
+        ASSERT_EQ(data_buf, user_log.task_data(i).to_string());
+    }
+    ASSERT_EQ(user_log.task_data(0).to_string(),
+              user_log.log_data().to_string());
+
+    cluster.ensure_same();
+    for (size_t i = 0; i < cluster._fsms.size(); i++) {
+        MockFSM* fsm = cluster._fsms[i];
+        fsm->lock();
+        ASSERT_EQ(2 * datas.size(), fsm->logs.size());
+        for (size_t j = 0; j < fsm->logs.size(); j++) {
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello: %d", (int)j + 1);
+            ASSERT_EQ(data_buf, fsm->logs[j].to_string());
+        }
+        fsm->unlock();
+    }
+
+    // The batch fails as a whole on a follower
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    for (size_t i = 0; i < datas.size(); i++) {
+        datas[i].append("hello");
+        tasks[i].data = &datas[i];
+    }
+    cond.reset(1);
+    nodes[0]->apply(tasks, NEW_APPLYCLOSURE(&cond, EPERM));
+    cond.wait();
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, coalesce_tasks) {
+    GFLAGS_NS::SetCommandLineOption("raft_coalesce_tasks", "true");
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t last_log_index =
+            leader->_impl->_log_manager->last_log_index();
+
+    std::vector<butil::IOBuf> datas(100);
+    std::vector<braft::Task> tasks(datas.size());
+    bthread::CountdownEvent cond(datas.size());
+    for (size_t i = 0; i < datas.size(); i++) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", (int)i + 1);
+        datas[i].append(data_buf);
+        tasks[i].data = &datas[i];
+        tasks[i].done = NEW_APPLYCLOSURE(&cond, 0);
+    }
+    leader->apply(tasks);
+    cond.wait();
+    // All the tasks are packed in one log
+    ASSERT_EQ(last_log_index + 1,
+              leader->_impl->_log_manager->last_log_index());
+
+    cluster.ensure_same();
+    for (size_t i = 0; i < cluster._fsms.size(); i++) {
+        MockFSM* fsm = cluster._fsms[i];
+        fsm->lock();
+        ASSERT_EQ(datas.size(), fsm->logs.size());
+        for (size_t j = 0; j < fsm->logs.size(); j++) {
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello: %d", (int)j + 1);
+            ASSERT_EQ(data_buf, fsm->logs[j].to_string());
+        }
+        fsm->unlock();
+    }
+    cluster.stop_all();
+    GFLAGS_NS::SetCommandLineOption("raft_coalesce_tasks", "false");
+}
+
+TEST_P(NodeTest, read_index) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    // The logs committed before the reads are applied once they return
+    cond.reset(10);
+    for (int i = 0; i < 10; i++) {
+        leader->read_index(NEW_APPLYCLOSURE(&cond, 0));
+    }
+    cond.wait();
+    for (size_t i = 0; i < cluster._fsms.size(); i++) {
+        MockFSM* fsm = cluster._fsms[i];
+        if (fsm->address == leader->node_id().peer_id.addr) {
+            fsm->lock();
+            ASSERT_EQ(10u, fsm->logs.size());
+            fsm->unlock();
+        }
+    }
+
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    // A follower gets the read index from the leader and applies it itself
+    cond.reset(10);
+    for (int i = 0; i < 10; i++) {
+        nodes[0]->read_index(NEW_APPLYCLOSURE(&cond, 0));
+    }
+    cond.wait();
+    for (size_t i = 0; i < cluster._fsms.size(); i++) {
+        MockFSM* fsm = cluster._fsms[i];
+        if (fsm->address == nodes[0]->node_id().peer_id.addr) {
+            fsm->lock();
+            ASSERT_EQ(10u, fsm->logs.size());
+            fsm->unlock();
+        }
+    }
+
+    // The leadership can't be confirmed without a quorum
+    for (size_t i = 0; i < nodes.size(); i++) {
+        ASSERT_EQ(0, cluster.stop(nodes[i]->node_id().peer_id.addr));
+    }
+    cond.reset(1);
+    leader->read_index(NEW_APPLYCLOSURE(&cond, EPERM));
+    cond.wait();
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, leader_lease) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    cluster._enable_leader_lease = true;
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    // Heartbeats keep the lease valid
+    usleep(100 * 1000);
+    {
+        BAIDU_SCOPED_LOCK(leader->_impl->_mutex);
+        ASSERT_TRUE(leader->_impl->unsafe_leader_lease_valid(
+                        butil::monotonic_time_ms()));
+    }
+    cond.reset(10);
+    for (int i = 0; i < 10; i++) {
+        leader->read_index(NEW_APPLYCLOSURE(&cond, 0));
+    }
+    cond.wait();
+
+    // The followers refuse to elect a new leader while the leader is alive
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    nodes[0]->vote(50);
+    usleep(1000 * 1000);
+    ASSERT_EQ(leader->node_id().peer_id, cluster.leader()->node_id().peer_id);
+
+    // Transferring is still allowed
+    const braft::PeerId target = nodes[1]->node_id().peer_id;
+    ASSERT_EQ(0, leader->transfer_leadership_to(target));
+    cluster.wait_leader();
+    ASSERT_EQ(target, cluster.leader()->node_id().peer_id);
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, leader_lease_after_restart) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    cluster._enable_leader_lease = true;
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    ASSERT_TRUE(cluster.leader() != NULL);
+    cluster.stop_all();
+
+    // A restarted peer doesn't know the leader, whose lease granted before
+    // the restart might still be valid
+    ASSERT_EQ(0, cluster.start(peers[0].addr));
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(1u, nodes.size());
+    braft::Node* node = nodes[0];
+    {
+        BAIDU_SCOPED_LOCK(node->_impl->_mutex);
+        ASSERT_TRUE(node->_impl->_leader_id.is_empty());
+        ASSERT_TRUE(node->_impl->unsafe_in_leader_lease(
+                        butil::monotonic_time_ms()));
+    }
+    // Votes are granted once the lease expires
+    usleep(3500 * 1000);
+    {
+        BAIDU_SCOPED_LOCK(node->_impl->_mutex);
+        ASSERT_TRUE(node->_impl->_leader_id.is_empty());
+        ASSERT_FALSE(node->_impl->unsafe_in_leader_lease(
+                        butil::monotonic_time_ms()));
+    }
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, election_priority) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers, 500);
+    cluster._election_priorities[peers[2].addr] = 10;
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // The peer of the highest priority takes over the leadership eventually
+    cluster.wait_leader();
+    for (int i = 0; i < 200; ++i) {
+        braft::Node* leader = cluster.leader();
+        if (leader != NULL && leader->node_id().peer_id == peers[2]) {
+            break;
+        }
+        usleep(100 * 1000);
+    }
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_EQ(peers[2], leader->node_id().peer_id);
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    // The others are still able to elect a leader without it
+    ASSERT_EQ(0, cluster.stop(peers[2].addr));
+    cluster.wait_leader();
+    leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_NE(peers[2], leader->node_id().peer_id);
+
+    // And give the leadership back once it's caught up
+    ASSERT_EQ(0, cluster.start(peers[2].addr));
+    for (int i = 0; i < 200; ++i) {
+        leader = cluster.leader();
+        if (leader != NULL && leader->node_id().peer_id == peers[2]) {
+            break;
+        }
+        usleep(100 * 1000);
+    }
+    leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_EQ(peers[2], leader->node_id().peer_id);
+
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, hibernate) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    const int32_t saved_idle_ms = braft::FLAGS_raft_hibernate_idle_ms;
+    const int32_t saved_interval_ms =
+            braft::FLAGS_raft_hibernate_heartbeat_interval_ms;
+    braft::FLAGS_raft_hibernate_idle_ms = 500;
+    braft::FLAGS_raft_hibernate_heartbeat_interval_ms = 1000;
+
+    // start cluster
+    Cluster cluster("unittest", peers, 300);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t term = leader->_impl->_current_term;
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+
+    // The idle group hibernates
+    usleep(1500 * 1000);
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    ASSERT_TRUE(leader->_impl->hibernating());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        ASSERT_TRUE(nodes[i]->_impl->hibernating());
+    }
+
+    // And keeps the leader with the sparse heartbeats for many election
+    // timeouts
+    usleep(3000 * 1000);
+    ASSERT_EQ(leader, cluster.leader());
+    ASSERT_EQ(term, leader->_impl->_current_term);
+    ASSERT_TRUE(leader->_impl->hibernating());
+
+    // Applying wakes up the group
+    cond.reset(1);
+    {
+        butil::IOBuf data;
+        data.append("hello: 11");
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    ASSERT_FALSE(leader->_impl->hibernating());
+    usleep(100 * 1000);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        ASSERT_FALSE(nodes[i]->_impl->hibernating());
+    }
+    cluster.ensure_same();
+
+    cluster.stop_all();
+    braft::FLAGS_raft_hibernate_idle_ms = saved_idle_ms;
+    braft::FLAGS_raft_hibernate_heartbeat_interval_ms = saved_interval_ms;
+}
+
+TEST_P(NodeTest, propagate_committed_index) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    // Heartbeats every 1.5s
+    const int32_t saved_factor = braft::FLAGS_raft_election_heartbeat_factor;
+    braft::FLAGS_raft_election_heartbeat_factor = 2;
+    braft::FLAGS_raft_propagate_committed_index = true;
+
+    Cluster cluster("unittest", peers, 3000);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+
+    for (int i = 0; i < 10; i++) {
+        bthread::CountdownEvent cond(1);
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+        cond.wait();
+        // The followers learn the committed index long before the next
+        // heartbeat
+        const int64_t committed_index =
+                leader->_impl->_ballot_box->last_committed_index();
+        for (size_t j = 0; j < nodes.size(); ++j) {
+            for (int k = 0; k < 100 && nodes[j]->_impl->_ballot_box
+                    ->last_committed_index() < committed_index; ++k) {
+                usleep(1000);
+            }
+            ASSERT_EQ(committed_index,
+                      nodes[j]->_impl->_ballot_box->last_committed_index());
+        }
+    }
+    cluster.ensure_same();
+
+    cluster.stop_all();
+    braft::FLAGS_raft_propagate_committed_index = false;
+    braft::FLAGS_raft_election_heartbeat_factor = saved_factor;
+}
+
+TEST_P(NodeTest, separate_control_connection) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    braft::FLAGS_raft_separate_control_connection = true;
+
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    // Votes go through the control connection
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_EQ("braft_control", leader->_impl->_control_connection_group);
+
+    for (int i = 0; i < 10; i++) {
+        bthread::CountdownEvent cond(1);
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+        cond.wait();
+    }
+    // Heartbeats keep the leader in place
+    usleep(2 * 1000 * 1000);
+    ASSERT_EQ(leader, cluster.leader());
+
+    // So does timeout_now
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    const braft::PeerId target = nodes[0]->node_id().peer_id;
+    ASSERT_EQ(0, leader->transfer_leadership_to(target));
+    cluster.wait_leader();
+    leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_EQ(target, leader->node_id().peer_id);
+    cluster.ensure_same();
+
+    cluster.stop_all();
+    braft::FLAGS_raft_separate_control_connection = false;
+}
+
+TEST_P(NodeTest, replicator_connection_striping) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    braft::FLAGS_raft_replicator_connection_num = 4;
+
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+
+    // The requests in flight go through different connections
+    bthread::CountdownEvent cond(1000);
+    for (int i = 0; i < 1000; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+
+    cluster.stop_all();
+    braft::FLAGS_raft_replicator_connection_num = 1;
+}
+
+// Blocks the disk thread of a LogManager until |stuck| is cleared
+class StallDiskClosure : public braft::LogManager::StableClosure {
+public:
+    explicit StallDiskClosure(butil::atomic<bool>* stuck) : _stuck(stuck) {}
+    void Run() {
+        while (_stuck->load(butil::memory_order_relaxed)) {
+            bthread_usleep(1000);
+        }
+        delete this;
+    }
+private:
+    butil::atomic<bool>* _stuck;
+};
+
+TEST_P(NodeTest, commit_while_leader_disk_stalls) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+
+    butil::atomic<bool> stuck(true);
+    ASSERT_EQ(0, leader->_impl->_log_manager->submit_to_disk(
+                    new StallDiskClosure(&stuck)));
+    const int64_t disk_index = leader->_impl->_log_manager->_disk_id.index;
+    // The followers make a quorum without the leader
+    for (int i = 0; i < 10; i++) {
+        bthread::CountdownEvent cond(1);
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+        cond.wait();
+    }
+    ASSERT_EQ(disk_index, leader->_impl->_log_manager->_disk_id.index);
+    stuck.store(false, butil::memory_order_relaxed);
+    cluster.ensure_same();
+
+    cluster.stop_all();
+}
+
+// Locks the replicator of |peer| on |leader|, which must be unlocked with
+// bthread_id_unlock(r->_id). Returns NULL if there's none.
+static braft::Replicator* lock_replicator(braft::Node* leader,
+                                          const braft::PeerId& peer) {
+    std::vector<std::pair<braft::PeerId, braft::ReplicatorId> > rids;
+    leader->_impl->_replicator_group.list_replicators(&rids);
+    for (size_t i = 0; i < rids.size(); ++i) {
+        if (rids[i].first != peer) {
+            continue;
+        }
+        bthread_id_t id = { rids[i].second };
+        braft::Replicator* r = NULL;
+        if (bthread_id_lock(id, (void**)&r) != 0) {
+            return NULL;
+        }
+        return r;
+    }
+    return NULL;
+}
+
+static void apply_tasks(braft::Node* leader, int n) {
+    for (int i = 0; i < n; i++) {
+        bthread::CountdownEvent cond(1);
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+        cond.wait();
+    }
+}
+
+TEST_P(NodeTest, replicator_window_shrinks_on_timeout) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    braft::FLAGS_raft_replicator_adaptive_window = true;
+    Cluster cluster("unittest", peers, 1000);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    braft::Node* slow = nodes[0];
+
+    braft::Replicator* r = lock_replicator(leader, slow->node_id().peer_id);
+    ASSERT_TRUE(r != NULL);
+    r->_window_bytes = braft::FLAGS_raft_replicator_max_window_bytes;
+    bthread_id_unlock(r->_id);
+
+    // The follower answers the AppendEntries after the logs are flushed, so
+    // the RPCs to it time out while its disk stalls
+    butil::atomic<bool> stuck(true);
+    ASSERT_EQ(0, slow->_impl->_log_manager->submit_to_disk(
+                    new StallDiskClosure(&stuck)));
+    apply_tasks(leader, 10);
+    usleep(3 * 1000 * 1000);
+
+    r = lock_replicator(leader, slow->node_id().peer_id);
+    ASSERT_TRUE(r != NULL);
+    const int64_t window_bytes = r->_window_bytes;
+    bthread_id_unlock(r->_id);
+    ASSERT_LT(window_bytes, braft::FLAGS_raft_replicator_max_window_bytes);
+
+    stuck.store(false, butil::memory_order_relaxed);
+    cluster.ensure_same();
+    cluster.stop_all();
+    braft::FLAGS_raft_replicator_adaptive_window = false;
+}
+
+TEST_P(NodeTest, backlog_limited_follower) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    braft::FLAGS_raft_follower_backlog_limit_bytes = 1;
+    Cluster cluster("unittest", peers, 1000);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    braft::Node* slow = nodes[0];
+
+    // The logs pile up in the memory of the follower whose disk stalls, which
+    // is reported by the heartbeats
+    butil::atomic<bool> stuck(true);
+    ASSERT_EQ(0, slow->_impl->_log_manager->submit_to_disk(
+                    new StallDiskClosure(&stuck)));
+    apply_tasks(leader, 100);
+    // The RPCs sent before the backlog was known time out meanwhile
+    usleep(3 * 1000 * 1000);
+    for (int i = 0; i < 10; i++) {
+        braft::Replicator* r = lock_replicator(leader, slow->node_id().peer_id);
+        ASSERT_TRUE(r != NULL);
+        const int64_t backlog_bytes = r->_peer_backlog_bytes;
+        const size_t inflight = r->_append_entries_in_fly.size();
+        bthread_id_unlock(r->_id);
+        ASSERT_GT(backlog_bytes, 1);
+        ASSERT_LE(inflight, 1u);
+        usleep(100 * 1000);
+    }
+
+    // The other follower is not paced
+    braft::Replicator* r = lock_replicator(leader, nodes[1]->node_id().peer_id);
+    ASSERT_TRUE(r != NULL);
+    ASSERT_EQ(leader->_impl->_log_manager->last_log_index() + 1, r->_next_index);
+    bthread_id_unlock(r->_id);
+
+    stuck.store(false, butil::memory_order_relaxed);
+    cluster.ensure_same();
+    cluster.stop_all();
+    braft::FLAGS_raft_follower_backlog_limit_bytes = 0;
+}
+
+TEST_P(NodeTest, read_ahead_dropped_on_reset) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    Cluster cluster("unittest", peers, 1000);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    apply_tasks(leader, 10);
+
+    braft::Replicator* r = lock_replicator(leader, nodes[0]->node_id().peer_id);
+    ASSERT_TRUE(r != NULL);
+    braft::LogManager* log_manager = leader->_impl->_log_manager;
+    for (int64_t index = log_manager->first_log_index();
+            index <= log_manager->last_log_index(); ++index) {
+        braft::LogEntry* entry = log_manager->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        r->_read_ahead_entries.push_back(entry);
+    }
+    r->_reset_next_index();
+    ASSERT_TRUE(r->_read_ahead_entries.empty());
+    // Unlocks the replicator
+    r->_send_entries();
+
+    apply_tasks(leader, 10);
+    cluster.ensure_same();
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, replicator_metrics) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    braft::FLAGS_raft_expose_replicator_bvars = true;
+    Cluster cluster("unittest", peers, 1000);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    apply_tasks(leader, 10);
+    cluster.ensure_same();
+    usleep(100 * 1000);
+
+    braft::NodeStatus status;
+    leader->get_status(&status);
+    ASSERT_EQ(2u, status.stable_followers.size());
+    for (braft::NodeStatus::PeerStatusMap::const_iterator
+            it = status.stable_followers.begin();
+            it != status.stable_followers.end(); ++it) {
+        const braft::PeerStatus& peer = it->second;
+        ASSERT_EQ(0, peer.lag);
+        ASSERT_GE(peer.since_last_success_ms, 0);
+        ASSERT_GT(peer.append_entries_latency_us, 0);
+        ASSERT_GT(peer.bytes_per_rpc, 0);
+        const std::string name = "raft_replicator_unittest_"
+                                 + it->first.to_string() + "_lag";
+        ASSERT_EQ("0", bvar::Variable::describe_exposed(name));
+    }
+    cluster.stop_all();
+
+    // The RPCs are not tracked without the flag, while the lag still is
+    braft::FLAGS_raft_expose_replicator_bvars = false;
+    for (size_t i = 0; i < peers.size(); i++) {
+        peers[i].addr.port += peers.size();
+    }
+    Cluster cluster2("unittest", peers, 1000);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster2.start(peers[i].addr));
+    }
+    cluster2.wait_leader();
+    leader = cluster2.leader();
+    ASSERT_TRUE(leader != NULL);
+    apply_tasks(leader, 10);
+    cluster2.ensure_same();
+    usleep(100 * 1000);
+    status = braft::NodeStatus();
+    leader->get_status(&status);
+    ASSERT_EQ(2u, status.stable_followers.size());
+    for (braft::NodeStatus::PeerStatusMap::const_iterator
+            it = status.stable_followers.begin();
+            it != status.stable_followers.end(); ++it) {
+        ASSERT_EQ(0, it->second.lag);
+        ASSERT_GE(it->second.since_last_success_ms, 0);
+        ASSERT_EQ(0, it->second.append_entries_latency_us);
+        const std::string name = "raft_replicator_unittest_"
+                                 + it->first.to_string() + "_lag";
+        ASSERT_TRUE(bvar::Variable::describe_exposed(name).empty());
+    }
+    cluster2.stop_all();
+}
+
+TEST_P(NodeTest, raft_metrics) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    Cluster cluster("unittest", peers, 1000);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    apply_tasks(leader, 10);
+    cluster.ensure_same();
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(leader->node_id().peer_id.addr, NULL));
+    braft::raft_metrics_Stub stub(&channel);
+    brpc::Controller cntl;
+    braft::RaftMetricsRequest request;
+    request.set_group_prefix("unit");
+    request.set_limit(2);
+    braft::RaftMetricsResponse response;
+    stub.default_method(&cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(3, response.total());
+    ASSERT_EQ(2, response.nodes_size());
+    ASSERT_EQ(2, response.next_offset());
+    for (int i = 0; i < response.nodes_size(); ++i) {
+        ASSERT_EQ("unittest", response.nodes(i).group_id());
+        ASSERT_EQ(leader->_impl->_ballot_box->last_committed_index(),
+                  response.nodes(i).committed_index());
+    }
+    cntl.Reset();
+    request.set_group_prefix("not_exist");
+    stub.default_method(&cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(0, response.total());
+
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_HTTP;
+    brpc::Channel http_channel;
+    ASSERT_EQ(0, http_channel.Init(leader->node_id().peer_id.addr, &options));
+    cntl.Reset();
+    cntl.http_request().uri() = "/raft_metrics?group_prefix=unittest";
+    http_channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    const std::string json = cntl.response_attachment().to_string();
+    ASSERT_NE(std::string::npos, json.find("\"nodes\""));
+    ASSERT_NE(std::string::npos, json.find("\"committed_index\""));
+
+    cntl.Reset();
+    cntl.http_request().uri() = "/raft_metrics?format=prometheus";
+    http_channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    const std::string text = cntl.response_attachment().to_string();
+    const std::string labels = "{group=\"unittest\",peer=\""
+                               + leader->node_id().peer_id.to_string() + "\"";
+    const char* const names[] = {
+        "braft_node_state", "braft_node_term", "braft_node_committed_index",
+        "braft_node_applied_index", "braft_node_first_index",
+        "braft_node_last_index", "braft_node_disk_index",
+        "braft_node_durable_index", "braft_node_pending_queue_size",
+        "braft_node_logs_in_memory_bytes", "braft_node_snapshot_index",
+        "braft_node_saving_snapshot", "braft_node_installing_snapshot",
+        "braft_follower_lag", "braft_follower_next_index",
+        "braft_follower_installing_snapshot",
+        "braft_follower_consecutive_error_times",
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(names); ++i) {
+        ASSERT_NE(std::string::npos, text.find(names[i] + labels))
+                << names[i] << " is missing in " << text;
+    }
+    ASSERT_NE(std::string::npos, text.find(",state=\"LEADER\"} 1"));
+
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, relay) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(2u, nodes.size());
+    const braft::PeerId relay = nodes[0]->node_id().peer_id;
+    const braft::PeerId relayed = nodes[1]->node_id().peer_id;
+    ASSERT_FALSE(leader->set_relay(relayed, relayed).ok());
+    ASSERT_FALSE(leader->set_relay(relayed, leader->node_id().peer_id).ok());
+    ASSERT_TRUE(leader->set_relay(relayed, relay).ok());
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    ASSERT_TRUE(cluster.ensure_same());
+
+    // The logs are sent directly once the relay is down
+    ASSERT_EQ(0, cluster.stop(relay.addr));
+    cond.reset(10);
+    for (int i = 10; i < 20; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.followers(&nodes);
+    ASSERT_EQ(1u, nodes.size());
+    ASSERT_EQ(relayed, nodes[0]->node_id().peer_id);
+    ASSERT_EQ(leader->_impl->_log_manager->last_log_index(),
+              nodes[0]->_impl->_log_manager->last_log_index());
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, LeaderShouldNotChange) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader0 = cluster.leader();
+    ASSERT_TRUE(leader0 != NULL);
+    LOG(WARNING) << "leader is " << leader0->node_id();
+    const int64_t saved_term = leader0->_impl->_current_term;
+    usleep(5000 * 1000);
+    cluster.wait_leader();
+    braft::Node* leader1 = cluster.leader();
+    LOG(WARNING) << "leader is " << leader1->node_id();
+    ASSERT_EQ(leader0, leader1);
+    ASSERT_EQ(saved_term, leader1->_impl->_current_term);
+    cluster.stop_all();
+}
+
+TEST_P(NodeTest, multi_heartbeat) {
+    braft::FLAGS_raft_enable_multi_heartbeat = true;
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader0 = cluster.leader();
+    ASSERT_TRUE(leader0 != NULL);
+    LOG(WARNING) << "leader is " << leader0->node_id();
+    const int64_t saved_term = leader0->_impl->_current_term;
+    // Heartbeats in MultiHeartbeat RPCs keep the leader
+    usleep(5000 * 1000);
+    cluster.wait_leader();
+    braft::Node* leader1 = cluster.leader();
+    ASSERT_EQ(leader0, leader1);
+    ASSERT_EQ(saved_term, leader1->_impl->_current_term);
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        data.append("hello");
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader1->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+    cluster.stop_all();
+    braft::FLAGS_raft_enable_multi_heartbeat = false;
+}
+
+TEST_P(NodeTest, multi_append_entries) {
+    braft::FLAGS_raft_enable_multi_append_entries = true;
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    // elect leader
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    LOG(WARNING) << "leader is " << leader->node_id();
+
+    bthread::CountdownEvent cond(100);
+    for (int i = 0; i < 100; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    ASSERT_TRUE(cluster.ensure_same());
+    cluster.stop_all();
+    braft::FLAGS_raft_enable_multi_append_entries = false;
+}
+
+TEST_P(NodeTest, multi_vote) {
+    braft::FLAGS_raft_enable_multi_vote = true;
+    braft::FLAGS_raft_election_start_spread_ms = 500;
     std::vector<braft::PeerId> peers;
-    peers.push_back(peer);
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
 
-    braft::NodeOptions options;
-    options.election_timeout_ms = 300;
-    options.initial_conf = braft::Configuration(peers);
-    options.fsm = new MockFSM(butil::EndPoint());
-    options.log_uri = "local://./data/log";
-    options.raft_meta_uri = "local://./data/raft_meta";
-    options.snapshot_uri = "local://./data/snapshot";
-    options.snapshot_interval_s = 10;
+        peers.push_back(peer);
+    }
 
-    braft::Node node("unittest", peer);
-    ASSERT_EQ(0, node.init(options));
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
 
-    // wait node elect to leader
-    sleep(2);
+    // elect leader with votes in MultiPreVote and MultiRequestVote RPCs
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    LOG(WARNING) << "leader is " << leader->node_id();
+
+    // stop leader and elect a new one
+    const butil::EndPoint old_leader = leader->node_id().peer_id.addr;
+    LOG(WARNING) << "stop leader " << leader->node_id();
+    cluster.stop(old_leader);
+    cluster.wait_leader();
+    leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_NE(old_leader, leader->node_id().peer_id.addr);
+    LOG(WARNING) << "new leader is " << leader->node_id();
 
-    // apply something
     bthread::CountdownEvent cond(10);
     for (int i = 0; i < 10; i++) {
         butil::IOBuf data;
-        char data_buf[128];
-        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
-        data.append(data_buf);
-
+        data.append("hello");
         braft::Task task;
         task.data = &data;
         task.done = NEW_APPLYCLOSURE(&cond, 0);
-        node.apply(task);
+        leader->apply(task);
     }
     cond.wait();
 
-    sleep(10);
-    ASSERT_GT(static_cast<MockFSM*>(options.fsm)->snapshot_index, 0);
+    // restart the old leader, which votes through the aggregators as well
+    ASSERT_EQ(0, cluster.start(old_leader));
+    cluster.ensure_same();
+    cluster.stop_all();
+    braft::FLAGS_raft_election_start_spread_ms = 0;
+    braft::FLAGS_raft_enable_multi_vote = false;
+}
 
-    // shutdown
-    cond.reset(1);
-    node.shutdown(NEW_SHUTDOWNCLOSURE(&cond, 0));
-    cond.wait();
+TEST_P(NodeTest, multi_vote_unknown_group) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
 
-    // stop
-    server.Stop(200);
-    server.Join();
+        peers.push_back(peer);
+    }
+
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_FALSE(nodes.empty());
+    braft::Node* follower = nodes[0];
+
+    // batch a pre-vote of a known group with one of an unknown group
+    braft::MultiRequestVoteRequest request;
+    for (int i = 0; i < 2; i++) {
+        braft::RequestVoteRequest* sub_request = request.add_requests();
+        sub_request->set_group_id(i == 0 ? "unittest" : "no_such_group");
+        sub_request->set_server_id(leader->node_id().peer_id.to_string());
+        sub_request->set_peer_id(follower->node_id().peer_id.to_string());
+        sub_request->set_term(leader->_impl->_current_term);
+        sub_request->set_last_log_term(leader->_impl->_current_term);
+        sub_request->set_last_log_index(
+                leader->_impl->_log_manager->last_log_index());
+    }
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(follower->node_id().peer_id.addr, NULL));
+    brpc::Controller cntl;
+    braft::MultiRequestVoteResponse response;
+    braft::RaftService_Stub stub(&channel);
+    stub.multi_pre_vote(&cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(2, response.responses_size());
+    ASSERT_EQ(0, response.error_codes(0));
+    ASSERT_EQ(leader->_impl->_current_term, response.responses(0).term());
+    ASSERT_EQ(ENOENT, response.error_codes(1));
+    ASSERT_EQ(0, response.responses(1).term());
+    ASSERT_FALSE(response.responses(1).granted());
+    cluster.stop_all();
 }
 
-TEST_P(NodeTest, LeaderShouldNotChange) {
+TEST_P(NodeTest, leader_balance) {
+    braft::FLAGS_raft_enable_leader_balance = true;
+    braft::FLAGS_raft_leader_balance_interval_ms = 100;
     std::vector<braft::PeerId> peers;
     for (int i = 0; i < 3; i++) {
         braft::PeerId peer;
@@ -2079,17 +3903,47 @@ TEST_P(NodeTest, LeaderShouldNotChange) {
 
     // elect leader
     cluster.wait_leader();
-    braft::Node* leader0 = cluster.leader();
-    ASSERT_TRUE(leader0 != NULL);
-    LOG(WARNING) << "leader is " << leader0->node_id();
-    const int64_t saved_term = leader0->_impl->_current_term;
-    usleep(5000 * 1000);
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    LOG(WARNING) << "leader is " << leader->node_id();
+
+    // One leader is balanced already, which stays
+    const butil::EndPoint old_leader = leader->node_id().peer_id.addr;
+    usleep(1000 * 1000);
     cluster.wait_leader();
-    braft::Node* leader1 = cluster.leader();
-    LOG(WARNING) << "leader is " << leader1->node_id();
-    ASSERT_EQ(leader0, leader1);
-    ASSERT_EQ(saved_term, leader1->_impl->_current_term);
+    leader = cluster.leader();
+    ASSERT_EQ(old_leader, leader->node_id().peer_id.addr);
+    int leader_count = 0;
+    int weight = 0;
+    ASSERT_EQ(0, braft::LeaderBalancer::get_instance()->get_load(
+                old_leader, &leader_count, &weight));
+    ASSERT_EQ(1, leader_count);
+    ASSERT_EQ(1, weight);
+
+    // A server of weight 0 gives its leaders away
+    braft::LeaderBalancer::get_instance()->set_weight(old_leader, 0);
+    usleep(3000 * 1000);
+    cluster.wait_leader();
+    leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    ASSERT_NE(old_leader, leader->node_id().peer_id.addr);
+    LOG(WARNING) << "leader is moved to " << leader->node_id();
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        data.append("hello");
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
     cluster.stop_all();
+    braft::LeaderBalancer::get_instance()->set_weight(old_leader, 1);
+    braft::FLAGS_raft_leader_balance_interval_ms = 10000;
+    braft::FLAGS_raft_enable_leader_balance = false;
 }
 
 TEST_P(NodeTest, RecoverFollower) {
@@ -2968,6 +4822,74 @@ TEST_P(NodeTest, boostrap_without_snapshot) {
     node.join();
 }
 
+TEST_P(NodeTest, boostrap_from_local_snapshot) {
+    butil::EndPoint addr;
+    ASSERT_EQ(0, butil::str2endpoint("127.0.0.1:5006", &addr));
+    // Build the snapshot offline in the format of MockFSM
+    braft::SnapshotStorage* storage =
+            braft::SnapshotStorage::create("local://./data/snapshot");
+    ASSERT_TRUE(storage);
+    ASSERT_EQ(0, storage->init());
+    braft::SnapshotWriter* writer = storage->create();
+    ASSERT_TRUE(writer);
+    {
+        const std::string path = writer->get_path() + "/data";
+        int fd = ::creat(path.c_str(), 0644);
+        ASSERT_GE(fd, 0);
+        for (char c = 'a'; c <= 'z'; ++c) {
+            std::string data(100, c);
+            int len = data.size();
+            ASSERT_EQ(4, write(fd, &len, sizeof(int)));
+            ASSERT_EQ(len, write(fd, data.data(), len));
+        }
+        ::close(fd);
+    }
+    ASSERT_EQ(0, writer->add_file("data"));
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(26);
+    meta.set_last_included_term(1);
+    meta.add_peers(braft::PeerId(addr).to_string());
+    ASSERT_EQ(0, writer->save_meta(meta));
+    ASSERT_EQ(0, storage->close(writer));
+    delete storage;
+
+    braft::BootstrapOptions boptions;
+    boptions.last_log_index = 26;
+    boptions.log_uri = "local://./data/log";
+    boptions.raft_meta_uri = "local://./data/raft_meta";
+    boptions.snapshot_uri = "local://./data/snapshot";
+    boptions.from_local_snapshot = true;
+    // The snapshot must be at last_log_index
+    boptions.last_log_index = 25;
+    ASSERT_NE(0, braft::bootstrap(boptions));
+    boptions.last_log_index = 26;
+    ASSERT_EQ(0, braft::bootstrap(boptions));
+
+    brpc::Server server;
+    ASSERT_EQ(0, braft::add_service(&server, addr));
+    ASSERT_EQ(0, server.Start(addr, NULL));
+    braft::Node node("test", braft::PeerId(addr));
+    braft::NodeOptions options;
+    options.log_uri = "local://./data/log";
+    options.raft_meta_uri = "local://./data/raft_meta";
+    options.snapshot_uri = "local://./data/snapshot";
+    options.node_owns_fsm = false;
+    MockFSM fsm(addr);
+    options.fsm = &fsm;
+    ASSERT_EQ(0, node.init(options));
+    ASSERT_EQ(26u, fsm.logs.size());
+    for (char c = 'a'; c <= 'z'; ++c) {
+        std::string expected;
+        expected.resize(100, c);
+        ASSERT_TRUE(fsm.logs[c - 'a'].equals(expected));
+    }
+    while (!node.is_leader()) {
+        usleep(1000);
+    }
+    node.shutdown(NULL);
+    node.join();
+}
+
 TEST_P(NodeTest, change_peers) {
     std::vector<braft::PeerId> peers;
     braft::PeerId peer0;
@@ -3017,6 +4939,91 @@ TEST_P(NodeTest, change_peers) {
     ASSERT_TRUE(cluster.ensure_same());
 }
 
+TEST_P(NodeTest, learner) {
+    std::vector<braft::PeerId> peers;
+    braft::PeerId peer0;
+    peer0.addr.ip = butil::my_ip();
+    peer0.addr.port = 5006;
+    peer0.idx = 0;
+
+    // start cluster
+    peers.push_back(peer0);
+    Cluster cluster("unittest", peers);
+    ASSERT_EQ(0, cluster.start(peer0.addr));
+    LOG(NOTICE) << "start single cluster " << peer0;
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+
+    braft::PeerId peer1 = peer0;
+    peer1.addr.port += 1;
+    ASSERT_EQ(0, cluster.start(peer1.addr, true));
+    std::vector<braft::PeerId> learners;
+    learners.push_back(peer1);
+    {
+        braft::SynchronizedClosure done;
+        leader->add_learners(learners, &done);
+        done.wait();
+        ASSERT_TRUE(done.status().ok()) << done.status();
+    }
+    // A voting peer can't be a learner at the same time
+    {
+        std::vector<braft::PeerId> voters;
+        voters.push_back(peer0);
+        braft::SynchronizedClosure done;
+        leader->add_learners(voters, &done);
+        done.wait();
+        ASSERT_EQ(EINVAL, done.status().error_code());
+    }
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    ASSERT_TRUE(cluster.ensure_same());
+
+    std::vector<braft::PeerId> list;
+    ASSERT_TRUE(leader->list_peers(&list).ok());
+    ASSERT_EQ(1u, list.size());
+    ASSERT_TRUE(leader->list_learners(&list).ok());
+    ASSERT_EQ(1u, list.size());
+    ASSERT_EQ(peer1, list[0]);
+    // The learner never votes for itself
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(1u, nodes.size());
+    ASSERT_EQ(peer0, nodes[0]->leader_id());
+
+    // Promote the learner to a voting peer
+    {
+        braft::SynchronizedClosure done;
+        leader->add_peer(peer1, &done);
+        done.wait();
+        ASSERT_TRUE(done.status().ok()) << done.status();
+    }
+    ASSERT_TRUE(leader->list_peers(&list).ok());
+    ASSERT_EQ(2u, list.size());
+    ASSERT_TRUE(leader->list_learners(&list).ok());
+    ASSERT_TRUE(list.empty());
+
+    // Removing absent learners changes nothing
+    {
+        braft::SynchronizedClosure done;
+        leader->remove_learners(learners, &done);
+        done.wait();
+        ASSERT_TRUE(done.status().ok()) << done.status();
+    }
+    ASSERT_TRUE(cluster.ensure_same());
+}
+
 TEST_P(NodeTest, change_peers_add_multiple_node) {
     std::vector<braft::PeerId> peers;
     braft::PeerId peer0;
@@ -3414,7 +5421,7 @@ TEST_P(NodeTest, follower_handle_out_of_order_append_entries) {
     followers[0]->_impl->_mutex.lock();
     ASSERT_EQ(followers[0]->_impl->_log_manager->last_log_index(), local_index);
     ASSERT_TRUE(followers[0]->_impl->_append_entries_cache == NULL ||
-                followers[0]->_impl->_append_entries_cache->_rpc_map.size() ==
+                followers[0]->_impl->_append_entries_cache->size() ==
                 size_t(max_append_entries_cache_size));
     followers[0]->_impl->_mutex.unlock();
 
@@ -3455,7 +5462,7 @@ TEST_P(NodeTest, follower_handle_out_of_order_append_entries) {
             request_template, 3, local_index + 5,
             closure3, followers[0]);
     followers[0]->_impl->_mutex.lock();
-    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->_rpc_map.size(), 1);
+    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->size(), 1);
     ASSERT_EQ(followers[0]->_impl->_append_entries_cache->first_index(), local_index + 5 + 1);
     followers[0]->_impl->_mutex.unlock();
 
@@ -3464,7 +5471,7 @@ TEST_P(NodeTest, follower_handle_out_of_order_append_entries) {
             request_template, 2, local_index + 5,
             closure4, followers[0]);
     followers[0]->_impl->_mutex.lock();
-    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->_rpc_map.size(), 1);
+    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->size(), 1);
     ASSERT_EQ(followers[0]->_impl->_append_entries_cache->first_index(), local_index + 5 + 1);
     followers[0]->_impl->_mutex.unlock();
     closure3.wait();
@@ -3475,7 +5482,7 @@ TEST_P(NodeTest, follower_handle_out_of_order_append_entries) {
             request_template, 2, local_index + 6,
             closure5, followers[0]);
     followers[0]->_impl->_mutex.lock();
-    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->_rpc_map.size(), 1);
+    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->size(), 1);
     ASSERT_EQ(followers[0]->_impl->_append_entries_cache->first_index(), local_index + 6 + 1);
     followers[0]->_impl->_mutex.unlock();
     closure4.wait();
@@ -3486,7 +5493,7 @@ TEST_P(NodeTest, follower_handle_out_of_order_append_entries) {
             request_template, 3, local_index + 4,
             closure6, followers[0]);
     followers[0]->_impl->_mutex.lock();
-    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->_rpc_map.size(), 1);
+    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->size(), 1);
     ASSERT_EQ(followers[0]->_impl->_append_entries_cache->first_index(), local_index + 4 + 1);
     followers[0]->_impl->_mutex.unlock();
     closure5.wait();
@@ -3506,7 +5513,7 @@ TEST_P(NodeTest, follower_handle_out_of_order_append_entries) {
             request_template, 3, local_index + 5,
             closure7, followers[0]);
     followers[0]->_impl->_mutex.lock();
-    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->_rpc_map.size(), 1);
+    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->size(), 1);
     ASSERT_EQ(followers[0]->_impl->_append_entries_cache->first_index(), local_index + 5 + 1);
     followers[0]->_impl->_mutex.unlock();
 
@@ -3515,7 +5522,7 @@ TEST_P(NodeTest, follower_handle_out_of_order_append_entries) {
             request_template, 2, local_index + 2,
             closure8, followers[0]);
     followers[0]->_impl->_mutex.lock();
-    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->_rpc_map.size(), 2);
+    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->size(), 2);
     ASSERT_EQ(followers[0]->_impl->_append_entries_cache->first_index(), local_index + 2 + 1);
     followers[0]->_impl->_mutex.unlock();
 
@@ -3524,7 +5531,7 @@ TEST_P(NodeTest, follower_handle_out_of_order_append_entries) {
             request_template, 1, local_index + 1,
             closure9, followers[0]);
     followers[0]->_impl->_mutex.lock();
-    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->_rpc_map.size(), 3);
+    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->size(), 3);
     ASSERT_EQ(followers[0]->_impl->_append_entries_cache->first_index(), local_index + 1 + 1);
     followers[0]->_impl->_mutex.unlock();
 
@@ -3533,7 +5540,7 @@ TEST_P(NodeTest, follower_handle_out_of_order_append_entries) {
             request_template, 1, local_index,
             closure10, followers[0]);
     followers[0]->_impl->_mutex.lock();
-    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->_rpc_map.size(), 1);
+    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->size(), 1);
     ASSERT_EQ(followers[0]->_impl->_append_entries_cache->first_index(), local_index + 5 + 1);
     followers[0]->_impl->_mutex.unlock();
     
@@ -3556,10 +5563,122 @@ TEST_P(NodeTest, follower_handle_out_of_order_append_entries) {
     ASSERT_TRUE(followers[0]->_impl->_append_entries_cache == NULL);
     followers[0]->_impl->_mutex.unlock();
 
+    // The cache is limited by bytes as well
+    const int64_t saved_cache_bytes =
+            braft::FLAGS_raft_max_append_entries_cache_bytes;
+    braft::FLAGS_raft_max_append_entries_cache_bytes = 5;
+    AppendEntriesSyncClosure closure11;
+    follower_append_entries(
+            request_template, 1, local_index + 2,
+            closure11, followers[0]);
+    AppendEntriesSyncClosure closure12;
+    follower_append_entries(
+            request_template, 1, local_index + 4,
+            closure12, followers[0]);
+    closure12.wait();
+    ASSERT_FALSE(closure12.response().success());
+    followers[0]->_impl->_mutex.lock();
+    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->size(), 1);
+    ASSERT_EQ(followers[0]->_impl->_append_entries_cache->first_index(), local_index + 2 + 1);
+    followers[0]->_impl->_mutex.unlock();
+    braft::FLAGS_raft_max_append_entries_cache_bytes = saved_cache_bytes;
+    closure11.wait();
+    ASSERT_FALSE(closure11.response().success());
+
     LOG(WARNING) << "cluster stop";
     cluster.stop_all();
 }
 
+struct StatusQueryArg {
+    braft::Node* node;
+    butil::atomic<bool> stop;
+    int64_t count;
+};
+
+static void* query_status(void* arg) {
+    StatusQueryArg* a = (StatusQueryArg*)arg;
+    while (!a->stop.load()) {
+        braft::NodeStatus status;
+        a->node->get_status(&status);
+        ++a->count;
+    }
+    return NULL;
+}
+
+TEST_P(NodeTest, follower_append_entries_benchmark) {
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    GFLAGS_NS::SetCommandLineOption("raft_sync", "false");
+
+    // Only one follower is started, which receives the AppendEntries of
+    // peers[1] acting as the leader
+    Cluster cluster("unittest", peers, 60000);
+    ASSERT_EQ(0, cluster.start(peers[0].addr));
+    std::vector<braft::Node*> nodes;
+    cluster.followers(&nodes);
+    ASSERT_EQ(1u, nodes.size());
+    braft::Node* follower = nodes[0];
+
+    braft::AppendEntriesRequest request_template;
+    request_template.set_term(1);
+    request_template.set_group_id("unittest");
+    request_template.set_server_id(peers[1].to_string());
+    request_template.set_peer_id(peers[0].to_string());
+    request_template.set_committed_index(0);
+
+    // Status queries contend with the appends for the node mutex
+    StatusQueryArg arg;
+    arg.node = follower;
+    arg.stop = false;
+    arg.count = 0;
+    pthread_t tid;
+    ASSERT_EQ(0, pthread_create(&tid, NULL, query_status, &arg));
+
+    const int N = 5000;
+    const int entries_per_request = 16;
+    const size_t max_in_flight = 64;
+    std::deque<AppendEntriesSyncClosure*> closures;
+    butil::Timer timer;
+    timer.start();
+    for (int i = 0; i < N; ++i) {
+        request_template.set_prev_log_term(i == 0 ? 0 : 1);
+        closures.push_back(new AppendEntriesSyncClosure());
+        follower_append_entries(request_template, entries_per_request,
+                                (int64_t)i * entries_per_request,
+                                *closures.back(), follower);
+        while (closures.size() > max_in_flight) {
+            closures.front()->wait();
+            ASSERT_TRUE(closures.front()->response().success());
+            delete closures.front();
+            closures.pop_front();
+        }
+    }
+    while (!closures.empty()) {
+        closures.front()->wait();
+        ASSERT_TRUE(closures.front()->response().success());
+        delete closures.front();
+        closures.pop_front();
+    }
+    timer.stop();
+    arg.stop = true;
+    pthread_join(tid, NULL);
+    ASSERT_EQ((int64_t)N * entries_per_request,
+              follower->_impl->_log_manager->last_log_index());
+    LOG(INFO) << "append_entries_qps=" << N * 1000000L / timer.u_elapsed()
+              << " entries_qps="
+              << (int64_t)N * entries_per_request * 1000000L / timer.u_elapsed()
+              << " get_status_qps=" << arg.count * 1000000L / timer.u_elapsed();
+
+    cluster.stop_all();
+    GFLAGS_NS::SetCommandLineOption("raft_sync", "true");
+}
+
 TEST_P(NodeTest, readonly) {
     std::vector<braft::PeerId> peers;
     for (int i = 0; i < 3; i++) {
@@ -5,7 +5,13 @@
 // Date: 2016/11/02 21:12:26
 
 #include <gtest/gtest.h>
+#include <butil/time.h>
 #include "braft/repeated_timer_task.h"
+#include "braft/timer_wheel.h"
+
+namespace braft {
+DECLARE_int32(raft_timer_wheel_tick_ms);
+}
 
 class RepeatedTimerTaskTest : public testing::Test {
 };
@@ -113,3 +119,45 @@ TEST_F(RepeatedTimerTaskTest, restart_while_running) {
     ASSERT_EQ(1, timer._on_destroy_times);
     ASSERT_EQ(1, timer._run_times);
 }
+
+static void* add_one(void* arg) {
+    ((butil::atomic<int>*)arg)->fetch_add(1);
+    return NULL;
+}
+
+TEST_F(RepeatedTimerTaskTest, timer_wheel) {
+    braft::FLAGS_raft_timer_wheel_tick_ms = 1;
+    braft::TimerWheel* wheel = braft::TimerWheel::get_instance();
+    butil::atomic<int> counter(0);
+    braft::TimerWheel::TimerId ids[10];
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(0, wheel->schedule(&ids[i], add_one, &counter,
+                                     butil::milliseconds_from_now(10 * i)));
+    }
+    // Timers far away are kept in the rounds to come
+    braft::TimerWheel::TimerId far_id;
+    ASSERT_EQ(0, wheel->schedule(&far_id, add_one, &counter,
+                                 butil::milliseconds_from_now(10000)));
+    ASSERT_EQ(0, wheel->unschedule(ids[9]));
+    usleep(200 * 1000);
+    ASSERT_EQ(9, counter.load());
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(1, wheel->unschedule(ids[i]));
+    }
+    ASSERT_EQ(0, wheel->unschedule(far_id));
+    ASSERT_EQ(9, counter.load());
+
+    braft::FLAGS_raft_enable_timer_wheel = true;
+    MockTimer timer;
+    ASSERT_EQ(0, timer.init(10));
+    timer.start();
+    usleep(100500);
+    const int run_times = timer._run_times;
+    ASSERT_TRUE(run_times >= 7 && run_times <= 11) << run_times;
+    timer.stop();
+    usleep(10000);
+    ASSERT_LE(abs(run_times - timer._run_times), 1);
+    timer.destroy();
+    ASSERT_EQ(1, timer._on_destroy_times);
+    braft::FLAGS_raft_enable_timer_wheel = false;
+}
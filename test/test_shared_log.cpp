@@ -0,0 +1,207 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include <butil/string_printf.h>
+#include "braft/shared_log.h"
+#include "braft/configuration_manager.h"
+
+namespace braft {
+extern void global_init_once_or_die();
+DECLARE_int32(raft_shared_wal_file_size);
+};
+
+class SharedLogTest : public testing::Test {
+protected:
+    void SetUp() {
+        system("rm -rf data");
+        braft::global_init_once_or_die();
+    }
+    void TearDown() {}
+};
+
+static void append_entries(braft::LogStorage* storage, int64_t first_index,
+                           int64_t last_index, int64_t term) {
+    for (int64_t index = first_index; index <= last_index; ++index) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id = braft::LogId(index, term);
+        std::string data;
+        butil::string_printf(&data, "hello_%" PRId64, index);
+        entry->data.append(data);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+}
+
+static void check_entries(braft::LogStorage* storage, int64_t first_index,
+                          int64_t last_index) {
+    ASSERT_EQ(first_index, storage->first_log_index());
+    ASSERT_EQ(last_index, storage->last_log_index());
+    for (int64_t index = first_index; index <= last_index; ++index) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL) << index;
+        std::string data;
+        butil::string_printf(&data, "hello_%" PRId64, index);
+        ASSERT_EQ(data, entry->data.to_string());
+        ASSERT_EQ(entry->id.term, storage->get_term(index));
+        entry->Release();
+    }
+}
+
+TEST_F(SharedLogTest, uri) {
+    ASSERT_FALSE(braft::LogStorage::create("shared://data/wal"));
+    braft::LogStorage* storage =
+            braft::LogStorage::create("shared://data/wal?group=g1");
+    ASSERT_TRUE(storage);
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, storage->init(&cm));
+    // One group could not be opened twice
+    braft::LogStorage* storage2 =
+            braft::LogStorage::create("shared://data/wal?group=g1");
+    ASSERT_TRUE(storage2);
+    ASSERT_NE(0, storage2->init(&cm));
+    delete storage2;
+    delete storage;
+}
+
+TEST_F(SharedLogTest, multiple_groups) {
+    const int G = 10;
+    const int N = 100;
+    std::vector<braft::LogStorage*> storages;
+    for (int i = 0; i < G; ++i) {
+        storages.push_back(new braft::SharedLogStorage(
+                    "./data/wal", butil::string_printf("group_%d", i)));
+        braft::ConfigurationManager cm;
+        ASSERT_EQ(0, storages[i]->init(&cm));
+    }
+    for (int i = 0; i < G; ++i) {
+        append_entries(storages[i], 1, N, 1);
+    }
+    ASSERT_EQ(0, storages[0]->truncate_suffix(N / 2));
+    append_entries(storages[0], N / 2 + 1, N, 2);
+    ASSERT_EQ(0, storages[1]->truncate_prefix(N / 2));
+    ASSERT_EQ(0, storages[2]->reset(1000));
+    for (int i = 3; i < G; ++i) {
+        check_entries(storages[i], 1, N);
+    }
+    for (int i = 0; i < G; ++i) {
+        delete storages[i];
+    }
+
+    // Entries of each group are recovered from the shared files
+    for (int i = 0; i < G; ++i) {
+        storages[i] = new braft::SharedLogStorage(
+                "./data/wal", butil::string_printf("group_%d", i));
+        braft::ConfigurationManager cm;
+        ASSERT_EQ(0, storages[i]->init(&cm));
+    }
+    check_entries(storages[0], 1, N);
+    ASSERT_EQ(1, storages[0]->get_term(N / 2));
+    ASSERT_EQ(2, storages[0]->get_term(N / 2 + 1));
+    check_entries(storages[1], N / 2, N);
+    check_entries(storages[2], 1000, 999);
+    for (int i = 3; i < G; ++i) {
+        check_entries(storages[i], 1, N);
+    }
+    for (int i = 0; i < G; ++i) {
+        delete storages[i];
+    }
+}
+
+TEST_F(SharedLogTest, remove_unused_files) {
+    const int32_t saved_file_size = braft::FLAGS_raft_shared_wal_file_size;
+    braft::FLAGS_raft_shared_wal_file_size = 4096;
+    braft::SharedLogStorage* s1 = new braft::SharedLogStorage("./data/wal", "g1");
+    braft::SharedLogStorage* s2 = new braft::SharedLogStorage("./data/wal", "g2");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, s1->init(&cm));
+    ASSERT_EQ(0, s2->init(&cm));
+    const int N = 1000;
+    for (int64_t i = 1; i <= N; ++i) {
+        append_entries(s1, i, i, 1);
+        append_entries(s2, i, i, 1);
+    }
+    braft::SharedWal* wal = braft::SharedWal::open("./data/wal");
+    const size_t file_count = wal->file_count();
+    ASSERT_LT(1u, file_count);
+    // The oldest files are still referenced by g2
+    ASSERT_EQ(0, s1->truncate_prefix(N));
+    ASSERT_EQ(file_count, wal->file_count());
+    ASSERT_EQ(0, s2->truncate_prefix(N));
+    ASSERT_GT(file_count, wal->file_count());
+    braft::SharedWal::close(wal);
+    delete s1;
+    delete s2;
+
+    s1 = new braft::SharedLogStorage("./data/wal", "g1");
+    s2 = new braft::SharedLogStorage("./data/wal", "g2");
+    ASSERT_EQ(0, s1->init(&cm));
+    ASSERT_EQ(0, s2->init(&cm));
+    check_entries(s1, N, N);
+    check_entries(s2, N, N);
+    delete s1;
+    delete s2;
+    braft::FLAGS_raft_shared_wal_file_size = saved_file_size;
+}
+
+TEST_F(SharedLogTest, remove_group) {
+    const int32_t saved_file_size = braft::FLAGS_raft_shared_wal_file_size;
+    braft::FLAGS_raft_shared_wal_file_size = 4096;
+    braft::SharedLogStorage* s1 = new braft::SharedLogStorage("./data/wal", "g1");
+    braft::SharedLogStorage* s2 = new braft::SharedLogStorage("./data/wal", "g2");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, s1->init(&cm));
+    ASSERT_EQ(0, s2->init(&cm));
+    const int N = 1000;
+    for (int64_t i = 1; i <= N; ++i) {
+        append_entries(s1, i, i, 1);
+        append_entries(s2, i, i, 1);
+    }
+    braft::SharedWal* wal = braft::SharedWal::open("./data/wal");
+    const size_t file_count = wal->file_count();
+    ASSERT_LT(1u, file_count);
+    // Not while it's attached
+    ASSERT_EQ(EBUSY, braft::SharedLogStorage::remove_group("./data/wal", "g2"));
+    delete s2;
+    ASSERT_EQ(0, braft::SharedLogStorage::remove_group("./data/wal", "g2"));
+    // The files are no longer referenced by g2 which is removed
+    ASSERT_EQ(0, s1->truncate_prefix(N));
+    ASSERT_GT(file_count, wal->file_count());
+    braft::SharedWal::close(wal);
+    delete s1;
+
+    s1 = new braft::SharedLogStorage("./data/wal", "g1");
+    s2 = new braft::SharedLogStorage("./data/wal", "g2");
+    ASSERT_EQ(0, s1->init(&cm));
+    ASSERT_EQ(0, s2->init(&cm));
+    check_entries(s1, N, N);
+    ASSERT_EQ(1, s2->first_log_index());
+    ASSERT_EQ(0, s2->last_log_index());
+    delete s1;
+    delete s2;
+    braft::FLAGS_raft_shared_wal_file_size = saved_file_size;
+}
+
+TEST_F(SharedLogTest, load_configurations) {
+    braft::SharedLogStorage* s1 = new braft::SharedLogStorage("./data/wal", "g1");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, s1->init(&cm));
+    append_entries(s1, 1, 10, 1);
+    braft::LogEntry* entry = new braft::LogEntry;
+    entry->type = braft::ENTRY_TYPE_CONFIGURATION;
+    entry->id = braft::LogId(11, 1);
+    entry->peers = new std::vector<braft::PeerId>;
+    entry->peers->push_back(braft::PeerId("1.2.3.4:1000"));
+    ASSERT_EQ(0, s1->append_entry(entry));
+    entry->Release();
+    append_entries(s1, 12, 20, 1);
+    delete s1;
+
+    braft::ConfigurationManager cm2;
+    s1 = new braft::SharedLogStorage("./data/wal", "g1");
+    ASSERT_EQ(0, s1->init(&cm2));
+    ASSERT_EQ(11, cm2.last_configuration().id.index);
+    ASSERT_EQ(braft::PeerId("1.2.3.4:1000"),
+              *cm2.last_configuration().conf.begin());
+    delete s1;
+}
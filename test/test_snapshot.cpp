@@ -14,6 +14,8 @@
 #include "braft/raft.h"
 #include "braft/util.h"
 #include "braft/local_file_meta.pb.h"
+#include "braft/local_storage.pb.h"
+#include "braft/protobuf_file.h"
 #include "braft/snapshot_throttle.h"
 #include "memory_file_system_adaptor.h"
 
@@ -595,6 +597,440 @@ TEST_F(SnapshotTest, filter_before_copy) {
     FOR_EACH_FILE_SYSTEM_ADAPTOR_END;
 }
 
+TEST_F(SnapshotTest, add_file_from_last_snapshot) {
+    braft::FileSystemAdaptor* fs;
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_BEGIN(fs);
+
+    if (fs == NULL) {
+        ::system("rm -rf data");
+    } else {
+        fs->delete_file("data", true);
+    }
+    braft::SnapshotStorage* storage = new braft::LocalSnapshotStorage("./data");
+    if (fs) {
+        ASSERT_EQ(storage->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage->init());
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+
+    // nothing to reuse without the last snapshot
+    braft::SnapshotWriter* writer = storage->create();
+    ASSERT_TRUE(writer != NULL);
+    ASSERT_EQ(-1, writer->add_file_from_last_snapshot("file1"));
+    const std::string data1("aaa");
+    const std::string checksum1("1");
+    add_file_meta(fs, writer, 1, &checksum1, data1);
+    add_file_meta(fs, writer, 2, &checksum1, data1);
+    ASSERT_EQ(0, writer->save_meta(meta));
+    ASSERT_EQ(0, storage->close(writer));
+
+    meta.set_last_included_index(2000);
+    writer = storage->create();
+    ASSERT_TRUE(writer != NULL);
+    ASSERT_EQ(0, writer->add_file_from_last_snapshot("file1"));
+    ASSERT_EQ(-1, writer->add_file_from_last_snapshot("file3"));
+    const std::string data2("bbb");
+    const std::string checksum2("2");
+    add_file_meta(fs, writer, 3, &checksum2, data2);
+    ASSERT_EQ(0, writer->save_meta(meta));
+    ASSERT_EQ(0, storage->close(writer));
+
+    // snapshot 1000 is destroyed while the linked file is still there
+    ASSERT_FALSE(check_file_exist(fs, "data/snapshot_00000000000000001000", 1));
+    const std::string snapshot_path("data/snapshot_00000000000000002000");
+    ASSERT_EQ("file1: " + data1, read_from_file(fs, snapshot_path, 1));
+    ASSERT_FALSE(check_file_exist(fs, snapshot_path, 2));
+    ASSERT_EQ("file3: " + data2, read_from_file(fs, snapshot_path, 3));
+
+    braft::SnapshotReader* reader = storage->open();
+    ASSERT_TRUE(reader != NULL);
+    braft::LocalFileMeta file_meta;
+    ASSERT_EQ(0, reader->get_file_meta("file1", &file_meta));
+    ASSERT_EQ(checksum1, file_meta.checksum());
+    ASSERT_NE(0, reader->get_file_meta("file2", &file_meta));
+    ASSERT_EQ(0, storage->close(reader));
+
+    delete storage;
+
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_END;
+}
+
+TEST_F(SnapshotTest, copy_in_parallel) {
+    braft::FileSystemAdaptor* fs;
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_BEGIN(fs);
+
+    if (fs == NULL) {
+        ::system("rm -rf data");
+    } else {
+        fs->delete_file("data", true);
+    }
+    GFLAGS_NS::SetCommandLineOption("raft_max_byte_count_per_rpc", "1000");
+    GFLAGS_NS::SetCommandLineOption("raft_max_copying_files_when_install_snapshot", "3");
+    GFLAGS_NS::SetCommandLineOption("raft_max_inflight_rpcs_per_file", "4");
+
+    brpc::Server server;
+    ASSERT_EQ(0, braft::add_service(&server, "0.0.0.0:6006"));
+    ASSERT_EQ(0, server.Start(6006, NULL));
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage1 = new braft::LocalSnapshotStorage("./data");
+    if (fs) {
+        ASSERT_EQ(storage1->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage1->init());
+    storage1->set_server_addr(butil::EndPoint(butil::my_ip(), 6006));
+    braft::SnapshotWriter* writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    // sizes around the multiples of the chunk size
+    const size_t sizes[] = { 0, 1, 992, 993, 2992, 9999, 20000 };
+    const int nfiles = sizeof(sizes) / sizeof(sizes[0]);
+    std::vector<std::string> datas;
+    for (int i = 0; i < nfiles; ++i) {
+        std::string data;
+        for (size_t j = 0; j < sizes[i]; ++j) {
+            data.push_back('a' + (i + j) % 26);
+        }
+        datas.push_back(data);
+        add_file_meta(fs, writer1, i, NULL, data);
+    }
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    ASSERT_EQ(0, storage1->close(writer1));
+
+    braft::SnapshotReader* reader1 = storage1->open();
+    ASSERT_TRUE(reader1 != NULL);
+    std::string uri = reader1->generate_uri_for_copy();
+
+    if (fs == NULL) {
+        ::system("rm -rf data2");
+    } else {
+        fs->delete_file("data2", true);
+    }
+    braft::SnapshotStorage* storage2 = new braft::LocalSnapshotStorage("./data2");
+    if (fs) {
+        ASSERT_EQ(storage2->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage2->init());
+    braft::SnapshotReader* reader2 = storage2->copy_from(uri);
+    ASSERT_TRUE(reader2 != NULL);
+    std::vector<std::string> files;
+    reader2->list_files(&files);
+    ASSERT_EQ((size_t)nfiles, files.size());
+    for (int i = 0; i < nfiles; ++i) {
+        std::stringstream content;
+        content << "file" << i << ": " << datas[i];
+        ASSERT_EQ(content.str(), read_from_file(fs, reader2->get_path(), i));
+    }
+    ASSERT_EQ(0, storage1->close(reader1));
+    ASSERT_EQ(0, storage2->close(reader2));
+    delete storage2;
+    delete storage1;
+
+    GFLAGS_NS::SetCommandLineOption("raft_max_byte_count_per_rpc", "131072");
+    GFLAGS_NS::SetCommandLineOption("raft_max_copying_files_when_install_snapshot", "1");
+    GFLAGS_NS::SetCommandLineOption("raft_max_inflight_rpcs_per_file", "1");
+
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_END;
+}
+
+TEST_F(SnapshotTest, copy_with_file_stream) {
+    braft::FileSystemAdaptor* fs;
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_BEGIN(fs);
+
+    if (fs == NULL) {
+        ::system("rm -rf data");
+    } else {
+        fs->delete_file("data", true);
+    }
+    GFLAGS_NS::SetCommandLineOption("raft_max_byte_count_per_rpc", "1000");
+    GFLAGS_NS::SetCommandLineOption("raft_max_copying_files_when_install_snapshot", "3");
+    GFLAGS_NS::SetCommandLineOption("raft_enable_file_stream", "true");
+
+    brpc::Server server;
+    ASSERT_EQ(0, braft::add_service(&server, "0.0.0.0:6006"));
+    ASSERT_EQ(0, server.Start(6006, NULL));
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage1 = new braft::LocalSnapshotStorage("./data");
+    if (fs) {
+        ASSERT_EQ(storage1->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage1->init());
+    storage1->set_server_addr(butil::EndPoint(butil::my_ip(), 6006));
+    braft::SnapshotWriter* writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    // sizes around the multiples of the chunk size
+    const size_t sizes[] = { 0, 1, 992, 993, 2992, 9999, 20000 };
+    const int nfiles = sizeof(sizes) / sizeof(sizes[0]);
+    std::vector<std::string> datas;
+    for (int i = 0; i < nfiles; ++i) {
+        std::string data;
+        for (size_t j = 0; j < sizes[i]; ++j) {
+            data.push_back('a' + (i + j) % 26);
+        }
+        datas.push_back(data);
+        add_file_meta(fs, writer1, i, NULL, data);
+    }
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    ASSERT_EQ(0, storage1->close(writer1));
+
+    braft::SnapshotReader* reader1 = storage1->open();
+    ASSERT_TRUE(reader1 != NULL);
+    std::string uri = reader1->generate_uri_for_copy();
+
+    if (fs == NULL) {
+        ::system("rm -rf data2");
+    } else {
+        fs->delete_file("data2", true);
+    }
+    braft::SnapshotStorage* storage2 = new braft::LocalSnapshotStorage("./data2");
+    if (fs) {
+        ASSERT_EQ(storage2->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage2->init());
+    braft::SnapshotReader* reader2 = storage2->copy_from(uri);
+    ASSERT_TRUE(reader2 != NULL);
+    std::vector<std::string> files;
+    reader2->list_files(&files);
+    ASSERT_EQ((size_t)nfiles, files.size());
+    for (int i = 0; i < nfiles; ++i) {
+        std::stringstream content;
+        content << "file" << i << ": " << datas[i];
+        ASSERT_EQ(content.str(), read_from_file(fs, reader2->get_path(), i));
+    }
+    ASSERT_EQ(0, storage1->close(reader1));
+    ASSERT_EQ(0, storage2->close(reader2));
+    delete storage2;
+    delete storage1;
+
+    GFLAGS_NS::SetCommandLineOption("raft_max_byte_count_per_rpc", "131072");
+    GFLAGS_NS::SetCommandLineOption("raft_max_copying_files_when_install_snapshot", "1");
+    GFLAGS_NS::SetCommandLineOption("raft_enable_file_stream", "false");
+
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_END;
+}
+
+TEST_F(SnapshotTest, copy_chunks_not_found_locally) {
+    braft::FileSystemAdaptor* fs;
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_BEGIN(fs);
+
+    if (fs == NULL) {
+        ::system("rm -rf data");
+        ::system("rm -rf data2");
+    } else {
+        fs->delete_file("data", true);
+        fs->delete_file("data2", true);
+    }
+    GFLAGS_NS::SetCommandLineOption("raft_snapshot_chunk_size", "1000");
+
+    brpc::Server server;
+    ASSERT_EQ(0, braft::add_service(&server, "0.0.0.0:6006"));
+    ASSERT_EQ(0, server.Start(6006, NULL));
+
+    std::string chunks[5];
+    for (int i = 0; i < 5; ++i) {
+        chunks[i].assign(i < 4 ? 1000 : 500, 'a' + i);
+    }
+    const std::string data = chunks[0] + chunks[1] + chunks[2] + chunks[3]
+                             + chunks[4];
+
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage1 = new braft::LocalSnapshotStorage("./data");
+    if (fs) {
+        ASSERT_EQ(storage1->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage1->init());
+    storage1->set_server_addr(butil::EndPoint(butil::my_ip(), 6006));
+    braft::SnapshotWriter* writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    write_file(fs, writer1->get_path() + "/file1", data);
+    ASSERT_EQ(0, writer1->add_file("file1"));
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    ASSERT_EQ(0, storage1->close(writer1));
+
+    braft::SnapshotReader* reader1 = storage1->open();
+    ASSERT_TRUE(reader1 != NULL);
+    braft::LocalFileMeta file_meta;
+    ASSERT_EQ(0, reader1->get_file_meta("file1", &file_meta));
+    ASSERT_EQ((int64_t)data.size(), file_meta.size());
+    ASSERT_EQ(1000, file_meta.chunk_size());
+    ASSERT_EQ(5, file_meta.chunk_hashes_size());
+    std::string uri = reader1->generate_uri_for_copy();
+
+    // the last snapshot of storage2 has some of the chunks in another file
+    // at different offsets
+    braft::LocalSnapshotStorage* storage2 = new braft::LocalSnapshotStorage("./data2");
+    if (fs) {
+        ASSERT_EQ(storage2->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage2->init());
+    braft::SnapshotWriter* writer2 = storage2->create();
+    ASSERT_TRUE(writer2 != NULL);
+    write_file(fs, writer2->get_path() + "/file2",
+               chunks[3] + std::string(1000, 'z') + chunks[0] + chunks[4]);
+    ASSERT_EQ(0, writer2->add_file("file2"));
+    meta.set_last_included_index(900);
+    ASSERT_EQ(0, writer2->save_meta(meta));
+    ASSERT_EQ(0, storage2->close(writer2));
+
+    braft::SnapshotReader* reader2 = storage2->copy_from(uri);
+    ASSERT_TRUE(reader2 != NULL);
+    std::vector<std::string> files;
+    reader2->list_files(&files);
+    ASSERT_EQ(1u, files.size());
+    braft::FileSystemAdaptor* file_system = fs ? fs : braft::default_file_system();
+    braft::FileAdaptor* file = file_system->open(
+            reader2->get_path() + "/file1", O_RDONLY, NULL, NULL);
+    ASSERT_TRUE(file != NULL);
+    butil::IOPortal buf;
+    ASSERT_EQ((ssize_t)data.size(), file->read(&buf, 0, data.size() + 1));
+    delete file;
+    ASSERT_EQ(data, buf.to_string());
+    ASSERT_EQ(0, storage1->close(reader1));
+    ASSERT_EQ(0, storage2->close(reader2));
+    delete storage2;
+    delete storage1;
+
+    GFLAGS_NS::SetCommandLineOption("raft_snapshot_chunk_size", "0");
+
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_END;
+}
+
+TEST_F(SnapshotTest, resume_download) {
+    braft::FileSystemAdaptor* fs;
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_BEGIN(fs);
+
+    if (fs == NULL) {
+        ::system("rm -rf data");
+        ::system("rm -rf data2");
+    } else {
+        fs->delete_file("data", true);
+        fs->delete_file("data2", true);
+    }
+    GFLAGS_NS::SetCommandLineOption("raft_resume_snapshot_download", "true");
+
+    brpc::Server server;
+    ASSERT_EQ(0, braft::add_service(&server, "0.0.0.0:6006"));
+    ASSERT_EQ(0, server.Start(6006, NULL));
+
+    const std::string data = std::string(3000, 'a') + std::string(500, 'b');
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(1000);
+    meta.set_last_included_term(2);
+    *meta.add_peers() = braft::PeerId("1.2.3.4:1000").to_string();
+
+    braft::LocalSnapshotStorage* storage1 = new braft::LocalSnapshotStorage("./data");
+    if (fs) {
+        ASSERT_EQ(storage1->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage1->init());
+    storage1->set_server_addr(butil::EndPoint(butil::my_ip(), 6006));
+    braft::SnapshotWriter* writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    write_file(fs, writer1->get_path() + "/file1", data);
+    braft::LocalFileMeta file_meta;
+    file_meta.set_checksum("checksum1");
+    ASSERT_EQ(0, writer1->add_file("file1", &file_meta));
+    write_file(fs, writer1->get_path() + "/file2", data);
+    ASSERT_EQ(0, writer1->add_file("file2"));
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    ASSERT_EQ(0, storage1->close(writer1));
+    braft::SnapshotReader* reader1 = storage1->open();
+    ASSERT_TRUE(reader1 != NULL);
+    std::string uri = reader1->generate_uri_for_copy();
+
+    // storage2 restarted after copying the first 2000 bytes of file1 and
+    // file2, which are marked to tell whether they are copied again
+    braft::FileSystemAdaptor* file_system = fs ? fs : braft::default_file_system();
+    ASSERT_TRUE(file_system->create_directory("./data2/temp", NULL, true));
+    write_file(fs, "./data2/temp/file1", std::string(2000, 'x'));
+    write_file(fs, "./data2/temp/file2", std::string(2000, 'x'));
+    braft::LocalDownloadProgressPbMeta progress;
+    *progress.mutable_meta() = meta;
+    braft::LocalDownloadProgressPbMeta::File* f = progress.add_files();
+    f->set_name("file1");
+    f->set_offset(2000);
+    ASSERT_EQ(0, reader1->get_file_meta("file1", f->mutable_meta()));
+    f = progress.add_files();
+    f->set_name("file2");
+    f->set_offset(2000);
+    ASSERT_EQ(0, reader1->get_file_meta("file2", f->mutable_meta()));
+    braft::ProtoBufFile pb_file("./data2/temp/__raft_download_progress", fs);
+    ASSERT_EQ(0, pb_file.save(&progress, true));
+
+    braft::LocalSnapshotStorage* storage2 = new braft::LocalSnapshotStorage("./data2");
+    if (fs) {
+        ASSERT_EQ(storage2->set_file_system_adaptor(fs), 0);
+    }
+    ASSERT_EQ(0, storage2->init());
+    braft::SnapshotReader* reader2 = storage2->copy_from(uri);
+    ASSERT_TRUE(reader2 != NULL);
+    braft::FileAdaptor* file = file_system->open(
+            reader2->get_path() + "/file1", O_RDONLY, NULL, NULL);
+    ASSERT_TRUE(file != NULL);
+    butil::IOPortal buf;
+    ASSERT_EQ((ssize_t)data.size(), file->read(&buf, 0, data.size() + 1));
+    delete file;
+    ASSERT_EQ(std::string(2000, 'x') + data.substr(2000), buf.to_string());
+    // file2 can't be verified without a checksum, so it's copied again
+    file = file_system->open(
+            reader2->get_path() + "/file2", O_RDONLY, NULL, NULL);
+    ASSERT_TRUE(file != NULL);
+    buf.clear();
+    ASSERT_EQ((ssize_t)data.size(), file->read(&buf, 0, data.size() + 1));
+    delete file;
+    ASSERT_EQ(data, buf.to_string());
+    ASSERT_FALSE(file_system->path_exists(
+            reader2->get_path() + "/__raft_download_progress"));
+    ASSERT_EQ(0, storage2->close(reader2));
+
+    // The progress of another snapshot is discarded
+    meta.set_last_included_index(2000);
+    writer1 = storage1->create();
+    ASSERT_TRUE(writer1 != NULL);
+    write_file(fs, writer1->get_path() + "/file1", data);
+    ASSERT_EQ(0, writer1->add_file("file1"));
+    ASSERT_EQ(0, writer1->save_meta(meta));
+    ASSERT_EQ(0, storage1->close(writer1));
+    ASSERT_EQ(0, storage1->close(reader1));
+    reader1 = storage1->open();
+    ASSERT_TRUE(reader1 != NULL);
+    uri = reader1->generate_uri_for_copy();
+    ASSERT_TRUE(file_system->create_directory("./data2/temp", NULL, true));
+    write_file(fs, "./data2/temp/file1", std::string(2000, 'x'));
+    ASSERT_EQ(0, pb_file.save(&progress, true));
+    reader2 = storage2->copy_from(uri);
+    ASSERT_TRUE(reader2 != NULL);
+    file = file_system->open(reader2->get_path() + "/file1", O_RDONLY, NULL, NULL);
+    ASSERT_TRUE(file != NULL);
+    buf.clear();
+    ASSERT_EQ((ssize_t)data.size(), file->read(&buf, 0, data.size() + 1));
+    delete file;
+    ASSERT_EQ(data, buf.to_string());
+    ASSERT_EQ(0, storage1->close(reader1));
+    ASSERT_EQ(0, storage2->close(reader2));
+    delete storage2;
+    delete storage1;
+
+    GFLAGS_NS::SetCommandLineOption("raft_resume_snapshot_download", "false");
+
+    FOR_EACH_FILE_SYSTEM_ADAPTOR_END;
+}
+
 TEST_F(SnapshotTest, snapshot_throttle_for_reading) {
     braft::FileSystemAdaptor* fs;
     FOR_EACH_FILE_SYSTEM_ADAPTOR_BEGIN(fs);
@@ -374,6 +374,62 @@ TEST_F(SnapshotExecutorTest, interrupt_installing) {
     ASSERT_EQ(0, storage1.close(reader));
 }
 
+TEST_F(SnapshotExecutorTest, fall_back_to_leader) {
+    MockFSMCaller fsm_caller;
+    MockLogManager log_manager;
+    SnapshotExecutorOptions options;
+    options.init_term = 1;
+    options.addr = _server.listen_address();
+    options.node = NULL;
+    options.fsm_caller = &fsm_caller;
+    options.log_manager = &log_manager;
+    options.uri = "local://.data/snapshot0";
+    SnapshotExecutor executor;
+    ASSERT_EQ(0, executor.init(options));
+    SnapshotMeta donor_meta;
+    std::string donor_uri;
+    ASSERT_EQ(ENOENT, executor.get_snapshot_uri(&donor_meta, &donor_uri));
+    LocalSnapshotStorage storage1(".data/snapshot1");
+    storage1.set_server_addr(_server.listen_address());
+    ASSERT_EQ(0, storage1.init());
+    SnapshotWriter* writer = storage1.create();
+    ASSERT_TRUE(writer);
+    write_file(writer->get_path() + "/data", "leader");
+    writer->add_file("data");
+    SnapshotMeta meta;
+    meta.set_last_included_index(1);
+    meta.set_last_included_term(1);
+    ASSERT_EQ(0, writer->save_meta(meta));
+    ASSERT_EQ(0, storage1.close(writer));
+    SnapshotReader* reader = storage1.open();
+    std::string uri = reader->generate_uri_for_copy();
+    // The donor has gone
+    std::string bad_uri;
+    butil::string_printf(&bad_uri, "remote://%s/123456789",
+                         butil::endpoint2str(_server.listen_address()).c_str());
+    SnapshotMeta bad_meta(meta);
+    bad_meta.set_last_included_index(2);
+    InstallArg arg;
+    arg.e = &executor;
+    arg.request.set_group_id("test");
+    arg.request.set_term(1);
+    arg.request.mutable_meta()->CopyFrom(bad_meta);
+    arg.request.set_uri(bad_uri);
+    arg.request.mutable_fallback_meta()->CopyFrom(meta);
+    arg.request.set_fallback_uri(uri);
+    bthread_t tid;
+    bthread_start_background(&tid, NULL, install_thread, &arg);
+    bthread_join(tid, NULL);
+    ASSERT_FALSE(arg.cntl.Failed()) << arg.cntl.ErrorText();
+    ASSERT_EQ(0, storage1.close(reader));
+    ASSERT_EQ("leader", read_file(".data/snapshot0/snapshot_00000000000000000001/data"));
+
+    // Other followers could copy it from this one
+    ASSERT_EQ(0, executor.get_snapshot_uri(&donor_meta, &donor_uri));
+    ASSERT_EQ(1, donor_meta.last_included_index());
+    ASSERT_FALSE(donor_uri.empty());
+}
+
 TEST_F(SnapshotExecutorTest, retry_install_snapshot) {
     MockFSMCaller fsm_caller;
     MockLogManager log_manager;
@@ -5,11 +5,16 @@
 // Date: 2017/09/07 14:06:13
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include <butil/logging.h>
 #include "braft/raft.h"
 #include "braft/util.h"
 #include "braft/snapshot_throttle.h"
 
+namespace braft {
+DECLARE_int64(raft_adaptive_throttle_target_latency_us);
+}
+
 class TestUsageSuits : public testing::Test {
 protected:
     void SetUp() {}
@@ -131,6 +136,52 @@ TEST_F(TestUsageSuits, throttle_functioning) {
     
 }
 
+TEST_F(TestUsageSuits, adaptive_throttle) {
+    const int64_t min_throughput = 4 * 1024 * 1024;
+    const int64_t max_throughput = 100 * 1024 * 1024;
+    const int64_t cycles = 10;
+    scoped_refptr<braft::AdaptiveSnapshotThrottle> throttle(
+            new braft::AdaptiveSnapshotThrottle(min_throughput, max_throughput,
+                                                cycles));
+    ASSERT_EQ(min_throughput, throttle->get_throughput());
+
+    // There's no foreground write, the throughput goes up
+    int64_t now = butil::cpuwide_time_us();
+    throttle->_last_adjust_time_us = now - 2 * 1000 * 1000;
+    throttle->_last_refill_time_us = now - 1000 * 1000;
+    ASSERT_TRUE(throttle->add_one_more_task(false));
+    ASSERT_TRUE(throttle->add_one_more_task(true));
+    const int64_t request = 4 * 1024 * 1024;
+    const int64_t throughput = min_throughput + max_throughput / 10;
+    const int64_t share = throughput / cycles / 2;
+    // The tokens of a cycle are shared by the two tasks
+    ASSERT_EQ(share, (int64_t)throttle->throttled_by_throughput(request));
+    ASSERT_EQ(throughput, throttle->get_throughput());
+    ASSERT_EQ(share, (int64_t)throttle->throttled_by_throughput(request));
+    ASSERT_LT((int64_t)throttle->throttled_by_throughput(request), share / 2);
+    throttle->return_unused_throughput(share, 0, 0);
+    ASSERT_EQ(share, (int64_t)throttle->throttled_by_throughput(request));
+
+    // The latency of the log storages exceeds the target, the throughput is
+    // halved
+    const int64_t saved_target =
+            braft::FLAGS_raft_adaptive_throttle_target_latency_us;
+    braft::FLAGS_raft_adaptive_throttle_target_latency_us = -1;
+    now = butil::cpuwide_time_us();
+    throttle->_last_adjust_time_us = now - 2 * 1000 * 1000;
+    throttle->throttled_by_throughput(request);
+    ASSERT_EQ(throughput / 2, throttle->get_throughput());
+    throttle->_last_adjust_time_us = now - 2 * 1000 * 1000;
+    throttle->throttled_by_throughput(request);
+    ASSERT_EQ(min_throughput, throttle->get_throughput());
+    braft::FLAGS_raft_adaptive_throttle_target_latency_us = saved_target;
+
+    throttle->finish_one_task(false);
+    throttle->finish_one_task(true);
+    ASSERT_EQ(0, throttle->_task_num);
+    ASSERT_EQ(0, throttle->_snapshot_task_num);
+}
+
 
 
 
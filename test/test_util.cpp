@@ -4,7 +4,10 @@
 // Author: WangYao (fisherman), wangyao02@baidu.com
 // Date: 2015/10/08 17:00:05
 
+#include <algorithm>
+#include <unistd.h>
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include <butil/logging.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,6 +16,12 @@
 
 #include "braft/util.h"
 
+namespace braft {
+DECLARE_int32(raft_replication_compress_type);
+DECLARE_int32(raft_replication_compress_min_bytes);
+DECLARE_int32(raft_replication_compress_lan_prefix_len);
+}
+
 class TestUsageSuits : public testing::Test {
 protected:
     void SetUp() {}
@@ -262,3 +271,87 @@ TEST_F(TestUsageSuits, file_path) {
     LOG(INFO) << path.ReferencesParent();
 }
 
+
+TEST_F(TestUsageSuits, compress_replication_data) {
+    butil::IOBuf data;
+    for (int i = 0; i < 1000; ++i) {
+        data.append("hello world ");
+    }
+    const butil::IOBuf origin = data;
+    ASSERT_EQ(braft::COMPRESS_NONE,
+              braft::compress_replication_data(braft::COMPRESS_NONE, &data));
+    for (int type = braft::COMPRESS_SNAPPY; type <= braft::COMPRESS_ZLIB; ++type) {
+        data = origin;
+        ASSERT_EQ(type, braft::compress_replication_data(type, &data));
+        ASSERT_LT(data.size(), origin.size());
+        butil::IOBuf decompressed;
+        ASSERT_TRUE(braft::decompress_data(type, data, &decompressed));
+        ASSERT_EQ(origin, decompressed);
+    }
+    // Too short to compress
+    data.clear();
+    data.append("hello");
+    ASSERT_EQ(braft::COMPRESS_NONE,
+              braft::compress_replication_data(braft::COMPRESS_SNAPPY, &data));
+    ASSERT_EQ("hello", data.to_string());
+
+    // Peers in the same locality are sent uncompressed
+    braft::FLAGS_raft_replication_compress_type = braft::COMPRESS_SNAPPY;
+    butil::EndPoint local(butil::my_ip(), 8000);
+    ASSERT_EQ(braft::COMPRESS_SNAPPY, braft::replication_compress_type(local));
+    braft::FLAGS_raft_replication_compress_lan_prefix_len = 24;
+    ASSERT_EQ(braft::COMPRESS_NONE, braft::replication_compress_type(local));
+    butil::EndPoint remote;
+    ASSERT_EQ(0, butil::str2endpoint(
+            butil::my_ip_cstr()[0] == '1' ? "200.0.0.1:8000" : "100.0.0.1:8000",
+            &remote));
+    ASSERT_EQ(braft::COMPRESS_SNAPPY, braft::replication_compress_type(remote));
+    braft::FLAGS_raft_replication_compress_lan_prefix_len = 0;
+    braft::FLAGS_raft_replication_compress_type = braft::COMPRESS_NONE;
+}
+
+struct TestMutexTag {
+    static const char* name() { return "test_util"; }
+};
+
+TEST_F(TestUsageSuits, profiled_mutex) {
+    braft::ProfiledMutex<TestMutexTag> mutex;
+    // Nothing is recorded when profiling is off
+    {
+        std::unique_lock<braft::ProfiledMutex<TestMutexTag> > lck(mutex);
+    }
+    std::vector<braft::LockSite*> sites;
+    braft::LockSite::list_sites(&sites);
+    for (size_t i = 0; i < sites.size(); ++i) {
+        ASSERT_NE("test_util", sites[i]->name());
+    }
+
+    braft::FLAGS_raft_profile_locks = true;
+    for (int i = 0; i < 10; ++i) {
+        BAIDU_SCOPED_LOCK(mutex);
+        usleep(1000);
+    }
+    ASSERT_TRUE(mutex.try_lock());
+    mutex.unlock();
+    braft::FLAGS_raft_profile_locks = false;
+
+    braft::LockSite* site = braft::ProfiledMutex<TestMutexTag>::site();
+    ASSERT_EQ("test_util", site->name());
+    ASSERT_EQ(10, site->wait().count());
+    ASSERT_EQ(11, site->hold().count());
+    ASSERT_GE(site->hold().max_latency(), 1000);
+    braft::LockSite::list_sites(&sites);
+    ASSERT_TRUE(std::find(sites.begin(), sites.end(), site) != sites.end());
+}
+
+TEST_F(TestUsageSuits, bthread_attr_of_tag) {
+    bthread_attr_t attr = braft::bthread_attr_of_tag(BTHREAD_ATTR_NORMAL, -1);
+    ASSERT_EQ(BTHREAD_ATTR_NORMAL.flags, attr.flags);
+    ASSERT_EQ(BTHREAD_ATTR_NORMAL.stack_type, attr.stack_type);
+#ifdef BRAFT_WITH_BTHREAD_TAG
+    ASSERT_EQ(BTHREAD_ATTR_NORMAL.tag, attr.tag);
+    attr = braft::bthread_attr_of_tag(BTHREAD_ATTR_NORMAL, 1);
+    ASSERT_EQ(1, attr.tag);
+    ASSERT_EQ(BTHREAD_ATTR_NORMAL.flags, attr.flags);
+#endif
+}
@@ -14,9 +14,17 @@
 
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
+#include <unistd.h>             // usleep
+#include <algorithm>            // std::min
 #include <map>                  // std::map
+#include <fstream>              // std::ifstream
+#include <sstream>              // std::istringstream
 #include <gflags/gflags.h>      // google::ParseCommandLineFlags
 #include <butil/string_printf.h>
+#include <butil/atomicops.h>    // butil::atomic
+#include <bthread/bthread.h>    // bthread_start_background
+#include <bthread/mutex.h>      // bthread::Mutex
+#include <bthread/condition_variable.h>  // bthread::ConditionVariable
 #include <braft/cli.h>          // raft::cli::*
 
 namespace braft {
@@ -28,6 +36,15 @@ DEFINE_string(conf, "", "Current configuration of the raft group");
 DEFINE_string(peer, "", "Id of the operating peer");
 DEFINE_string(new_peers, "", "Peers that the group is going to consists of");
 DEFINE_string(group, "", "Id of the raft group");
+DEFINE_string(learners, "", "Learners that are going to be added or removed");
+DEFINE_string(group_list, "", "File of the groups operated by the batch "
+              "commands, each line of which is `$group_id $current_conf "
+              "[$peer]', where $peer overrides --peer");
+DEFINE_int32(concurrency, 32, "Max groups operated at the same time by the "
+             "batch commands");
+DEFINE_int32(max_ops_per_node, 4, "Max operations of the batch commands "
+             "running at the same time on each target peer, e.g. the peers "
+             "being added which install snapshots, 0 means unlimited");
 
 #define CHECK_FLAG(flagname)                                            \
     do {                                                                \
@@ -112,6 +129,60 @@ int change_peers() {
     return 0;
 }
 
+int add_learners() {
+    CHECK_FLAG(conf);
+    CHECK_FLAG(learners);
+    CHECK_FLAG(group);
+    Configuration conf;
+    if (conf.parse_from(FLAGS_conf) != 0) {
+        LOG(ERROR) << "Fail to parse --conf=`" << FLAGS_conf << '\'';
+        return -1;
+    }
+    Configuration learners;
+    if (learners.parse_from(FLAGS_learners) != 0) {
+        LOG(ERROR) << "Fail to parse --learners=`" << FLAGS_learners << '\'';
+        return -1;
+    }
+    std::vector<PeerId> peers;
+    learners.list_peers(&peers);
+    CliOptions opt;
+    opt.timeout_ms = FLAGS_timeout_ms;
+    opt.max_retry = FLAGS_max_retry;
+    butil::Status st = add_learners(FLAGS_group, conf, peers, opt);
+    if (!st.ok()) {
+        LOG(ERROR) << "Fail to add_learners : " << st;
+        return -1;
+    }
+    return 0;
+}
+
+int remove_learners() {
+    CHECK_FLAG(conf);
+    CHECK_FLAG(learners);
+    CHECK_FLAG(group);
+    Configuration conf;
+    if (conf.parse_from(FLAGS_conf) != 0) {
+        LOG(ERROR) << "Fail to parse --conf=`" << FLAGS_conf << '\'';
+        return -1;
+    }
+    Configuration learners;
+    if (learners.parse_from(FLAGS_learners) != 0) {
+        LOG(ERROR) << "Fail to parse --learners=`" << FLAGS_learners << '\'';
+        return -1;
+    }
+    std::vector<PeerId> peers;
+    learners.list_peers(&peers);
+    CliOptions opt;
+    opt.timeout_ms = FLAGS_timeout_ms;
+    opt.max_retry = FLAGS_max_retry;
+    butil::Status st = remove_learners(FLAGS_group, conf, peers, opt);
+    if (!st.ok()) {
+        LOG(ERROR) << "Fail to remove_learners : " << st;
+        return -1;
+    }
+    return 0;
+}
+
 int reset_peer() {
     CHECK_FLAG(new_peers);
     CHECK_FLAG(peer);
@@ -181,6 +252,154 @@ int transfer_leader() {
     return 0;
 }
 
+struct BatchItem {
+    GroupId group;
+    Configuration conf;
+    PeerId peer;
+};
+
+// The groups are taken in order by FLAGS_concurrency bthreads, each of which
+// blocks in the synchronous cli API without holding a pthread
+struct BatchContext {
+    std::string cmd;
+    std::vector<BatchItem> items;
+    butil::atomic<size_t> next;
+    butil::atomic<size_t> succeeded;
+    butil::atomic<size_t> failed;
+    bthread::Mutex mutex;
+    bthread::ConditionVariable cond;
+    // Operations running on each target peer
+    std::map<butil::EndPoint, int> running;
+};
+
+static int load_batch_items(const std::string& cmd,
+                            std::vector<BatchItem>* items) {
+    std::ifstream in(FLAGS_group_list.c_str());
+    if (!in) {
+        LOG(ERROR) << "Fail to open --group_list=`" << FLAGS_group_list << '\'';
+        return -1;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string conf;
+        std::string peer = FLAGS_peer;
+        BatchItem item;
+        if (!(fields >> item.group)) {
+            continue;
+        }
+        fields >> conf >> peer;
+        if (item.conf.parse_from(conf) != 0 || item.conf.empty()) {
+            LOG(ERROR) << "Fail to parse the conf of line `" << line << '\'';
+            return -1;
+        }
+        if (peer.empty() && cmd == "batch_snapshot") {
+            // Snapshot all the peers of the group
+            std::vector<PeerId> peers;
+            item.conf.list_peers(&peers);
+            for (size_t i = 0; i < peers.size(); ++i) {
+                item.peer = peers[i];
+                items->push_back(item);
+            }
+            continue;
+        }
+        if (item.peer.parse(peer) != 0) {
+            LOG(ERROR) << "Fail to parse the peer of line `" << line << '\'';
+            return -1;
+        }
+        items->push_back(item);
+    }
+    return 0;
+}
+
+static butil::Status run_batch_item(const std::string& cmd,
+                                    const BatchItem& item) {
+    CliOptions opt;
+    opt.timeout_ms = FLAGS_timeout_ms;
+    opt.max_retry = FLAGS_max_retry;
+    if (cmd == "batch_add_peer") {
+        return add_peer(item.group, item.conf, item.peer, opt);
+    }
+    if (cmd == "batch_remove_peer") {
+        return remove_peer(item.group, item.conf, item.peer, opt);
+    }
+    if (cmd == "batch_transfer_leader") {
+        return transfer_leader(item.group, item.conf, item.peer, opt);
+    }
+    return snapshot(item.group, item.peer, opt);
+}
+
+static void* run_batch_worker(void* arg) {
+    BatchContext* ctx = (BatchContext*)arg;
+    for (size_t i = ctx->next.fetch_add(1, butil::memory_order_relaxed);
+            i < ctx->items.size();
+            i = ctx->next.fetch_add(1, butil::memory_order_relaxed)) {
+        const BatchItem& item = ctx->items[i];
+        const butil::EndPoint node = item.peer.addr;
+        if (FLAGS_max_ops_per_node > 0) {
+            std::unique_lock<bthread::Mutex> lck(ctx->mutex);
+            while (ctx->running[node] >= FLAGS_max_ops_per_node) {
+                ctx->cond.wait(lck);
+            }
+            ++ctx->running[node];
+        }
+        const butil::Status st = run_batch_item(ctx->cmd, item);
+        if (FLAGS_max_ops_per_node > 0) {
+            std::unique_lock<bthread::Mutex> lck(ctx->mutex);
+            --ctx->running[node];
+            ctx->cond.notify_all();
+        }
+        if (st.ok()) {
+            ctx->succeeded.fetch_add(1, butil::memory_order_relaxed);
+        } else {
+            ctx->failed.fetch_add(1, butil::memory_order_relaxed);
+            LOG(ERROR) << "Fail to " << ctx->cmd.substr(6) << " of group "
+                       << item.group << " on " << item.peer << " : " << st;
+        }
+    }
+    return NULL;
+}
+
+int run_batch(const std::string& cmd) {
+    CHECK_FLAG(group_list);
+    BatchContext ctx;
+    ctx.cmd = cmd;
+    if (load_batch_items(cmd, &ctx.items) != 0) {
+        return -1;
+    }
+    ctx.next.store(0, butil::memory_order_relaxed);
+    ctx.succeeded.store(0, butil::memory_order_relaxed);
+    ctx.failed.store(0, butil::memory_order_relaxed);
+    const size_t total = ctx.items.size();
+    const int concurrency = std::max(
+            1, std::min(FLAGS_concurrency, (int)total));
+    std::vector<bthread_t> tids;
+    for (int i = 0; i < concurrency; ++i) {
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_batch_worker, &ctx) != 0) {
+            LOG(ERROR) << "Fail to start bthread";
+            break;
+        }
+        tids.push_back(tid);
+    }
+    if (tids.empty()) {
+        return -1;
+    }
+    for (size_t done = 0; done < total; ) {
+        usleep(1000 * 1000);
+        const size_t succeeded =
+                ctx.succeeded.load(butil::memory_order_relaxed);
+        const size_t failed = ctx.failed.load(butil::memory_order_relaxed);
+        done = succeeded + failed;
+        LOG(INFO) << cmd << ": " << done << '/' << total << " done, "
+                  << failed << " failed";
+    }
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    return ctx.failed.load(butil::memory_order_relaxed) == 0 ? 0 : -1;
+}
+
 int run_command(const std::string& cmd) {
     if (cmd == "add_peer") {
         return add_peer();
@@ -191,6 +410,12 @@ int run_command(const std::string& cmd) {
     if (cmd == "change_peers") {
         return change_peers();
     }
+    if (cmd == "add_learners") {
+        return add_learners();
+    }
+    if (cmd == "remove_learners") {
+        return remove_learners();
+    }
     if (cmd == "reset_peer") {
         return reset_peer();
     }
@@ -200,6 +425,10 @@ int run_command(const std::string& cmd) {
     if (cmd == "transfer_leader") {
         return transfer_leader();
     }
+    if (cmd == "batch_add_peer" || cmd == "batch_remove_peer" ||
+            cmd == "batch_transfer_leader" || cmd == "batch_snapshot") {
+        return run_batch(cmd);
+    }
     LOG(ERROR) << "Unknown command `" << cmd << '\'';
     return -1;
 }
@@ -224,10 +453,18 @@ int main(int argc , char* argv[]) {
                                       "--peer=$removing_peer --conf=$current_conf\n"
                         "  change_peers --group=$group_id "
                                        "--conf=$current_conf --new_peers=$new_peers\n"
+                        "  add_learners --group=$group_id "
+                                       "--conf=$current_conf --learners=$adding_learners\n"
+                        "  remove_learners --group=$group_id "
+                                          "--conf=$current_conf --learners=$removing_learners\n"
                         "  reset_peer --group=$group_id "
                                      "--peer==$target_peer --new_peers=$new_peers\n"
                         "  snapshot --group=$group_id --peer=$target_peer\n"
-                        "  transfer_leader --group=$group_id --peer=$target_leader --conf=$current_conf\n",
+                        "  transfer_leader --group=$group_id --peer=$target_leader --conf=$current_conf\n"
+                        "  batch_add_peer --group_list=$file [--peer=$adding_peer]\n"
+                        "  batch_remove_peer --group_list=$file [--peer=$removing_peer]\n"
+                        "  batch_transfer_leader --group_list=$file [--peer=$target_leader]\n"
+                        "  batch_snapshot --group_list=$file [--peer=$target_peer]\n",
                         proc_name);
     GFLAGS_NS::SetUsageMessage(help_str);
     GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
@@ -0,0 +1,237 @@
+// Copyright (c) 2018 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Builds the snapshots of groups offline from files produced by bulk loading
+// jobs, so that the groups are seeded without replaying the data through
+// Node::apply or installing snapshots from the leaders. Run it on each
+// replica, then start the nodes as usual and the state machines load the
+// snapshots in on_snapshot_load.
+//
+//   braft_snapshot_builder --source=/bulk/part_0 --last_index=1 \
+//       --snapshot_uri=local://./data/part_0/snapshot \
+//       --log_uri=local://./data/part_0/log \
+//       --raft_meta_uri=local://./data/part_0/raft_meta \
+//       --peers=10.0.0.1:8000:0,10.0.0.2:8000:0,10.0.0.3:8000:0
+//
+// --manifest builds many groups in one run, of which each line is
+//   <source> <snapshot_uri> [<log_uri> <raft_meta_uri>]
+// sharing --last_index and --peers.
+
+#include <unistd.h>
+#include <errno.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <gflags/gflags.h>
+#include <butil/file_util.h>
+#include <butil/files/file_enumerator.h>
+#include <butil/logging.h>
+#include <braft/raft.h>
+#include <braft/storage.h>
+
+DEFINE_string(source, "", "Directory of the files to put into the snapshot, "
+              "the layout is kept");
+DEFINE_string(snapshot_uri, "", "Snapshot storage of the group");
+DEFINE_string(log_uri, "", "Log storage of the group, if not empty the group "
+              "is also bootstrapped so that the node starts from the snapshot");
+DEFINE_string(raft_meta_uri, "", "Raft meta storage of the group, required "
+              "with --log_uri");
+DEFINE_string(manifest, "", "File listing the groups to build, one per line: "
+              "<source> <snapshot_uri> [<log_uri> <raft_meta_uri>]");
+DEFINE_int64(last_index, 1, "Index of the last log the snapshot includes, "
+             "which must be the same on all the replicas");
+DEFINE_string(peers, "", "Initial configuration of the groups");
+DEFINE_bool(link, true, "Hard link the source files into the snapshot "
+            "rather than copying them, which falls back to copying if they "
+            "are on different devices. The source files must not be modified "
+            "afterwards");
+
+namespace braft {
+
+struct GroupSpec {
+    std::string source;
+    std::string snapshot_uri;
+    std::string log_uri;
+    std::string raft_meta_uri;
+};
+
+static int put_file(const butil::FilePath& from, const butil::FilePath& to) {
+    if (!butil::CreateDirectory(to.DirName())) {
+        LOG(ERROR) << "Fail to create " << to.DirName().value();
+        return -1;
+    }
+    if (FLAGS_link) {
+        if (::link(from.value().c_str(), to.value().c_str()) == 0) {
+            return 0;
+        }
+        if (errno != EXDEV) {
+            PLOG(ERROR) << "Fail to link " << from.value() << " to "
+                        << to.value();
+            return -1;
+        }
+    }
+    if (!butil::CopyFile(from, to)) {
+        LOG(ERROR) << "Fail to copy " << from.value() << " to " << to.value();
+        return -1;
+    }
+    return 0;
+}
+
+static int build_snapshot(const GroupSpec& spec, const Configuration& conf) {
+    SnapshotStorage* storage = SnapshotStorage::create(spec.snapshot_uri);
+    if (!storage || storage->init() != 0) {
+        LOG(ERROR) << "Fail to init snapshot storage " << spec.snapshot_uri;
+        delete storage;
+        return -1;
+    }
+    SnapshotWriter* writer = storage->create();
+    if (writer == NULL) {
+        LOG(ERROR) << "Fail to create snapshot writer in " << spec.snapshot_uri;
+        delete storage;
+        return -1;
+    }
+    const butil::FilePath source(spec.source);
+    const butil::FilePath target(writer->get_path());
+    butil::FileEnumerator files(source, true, butil::FileEnumerator::FILES);
+    for (butil::FilePath path = files.Next(); !path.empty() && writer->ok();
+            path = files.Next()) {
+        butil::FilePath relative;
+        if (!source.AppendRelativePath(path, &relative)) {
+            writer->set_error(EINVAL, "%s is not under %s",
+                              path.value().c_str(), source.value().c_str());
+            break;
+        }
+        if (put_file(path, target.Append(relative)) != 0 ||
+                writer->add_file(relative.value()) != 0) {
+            writer->set_error(EIO, "Fail to add %s", relative.value().c_str());
+        }
+    }
+    if (writer->ok()) {
+        SnapshotMeta meta;
+        meta.set_last_included_index(FLAGS_last_index);
+        // Bootstrapped groups start at term 1
+        meta.set_last_included_term(1);
+        std::vector<PeerId> peers;
+        conf.list_peers(&peers);
+        for (size_t i = 0; i < peers.size(); ++i) {
+            *meta.add_peers() = peers[i].to_string();
+        }
+        if (writer->save_meta(meta) != 0) {
+            writer->set_error(EIO, "Fail to save meta");
+        }
+    }
+    const int rc = storage->close(writer);
+    delete storage;
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to build snapshot in " << spec.snapshot_uri
+                   << " from " << spec.source;
+        return -1;
+    }
+    return 0;
+}
+
+static int build_group(const GroupSpec& spec, const Configuration& conf) {
+    if (build_snapshot(spec, conf) != 0) {
+        return -1;
+    }
+    if (spec.log_uri.empty()) {
+        return 0;
+    }
+    BootstrapOptions options;
+    options.group_conf = conf;
+    options.last_log_index = FLAGS_last_index;
+    options.log_uri = spec.log_uri;
+    options.raft_meta_uri = spec.raft_meta_uri;
+    options.snapshot_uri = spec.snapshot_uri;
+    options.from_local_snapshot = true;
+    if (bootstrap(options) != 0) {
+        LOG(ERROR) << "Fail to bootstrap " << spec.log_uri << " from "
+                   << spec.snapshot_uri;
+        return -1;
+    }
+    return 0;
+}
+
+static int load_specs(std::vector<GroupSpec>* specs) {
+    if (FLAGS_manifest.empty()) {
+        GroupSpec spec;
+        spec.source = FLAGS_source;
+        spec.snapshot_uri = FLAGS_snapshot_uri;
+        spec.log_uri = FLAGS_log_uri;
+        spec.raft_meta_uri = FLAGS_raft_meta_uri;
+        specs->push_back(spec);
+    } else {
+        std::ifstream in(FLAGS_manifest.c_str());
+        if (!in) {
+            LOG(ERROR) << "Fail to open " << FLAGS_manifest;
+            return -1;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            GroupSpec spec;
+            if (!(fields >> spec.source)) {
+                continue;
+            }
+            fields >> spec.snapshot_uri >> spec.log_uri >> spec.raft_meta_uri;
+            specs->push_back(spec);
+        }
+    }
+    for (size_t i = 0; i < specs->size(); ++i) {
+        const GroupSpec& spec = (*specs)[i];
+        if (spec.source.empty() || spec.snapshot_uri.empty() ||
+                spec.log_uri.empty() != spec.raft_meta_uri.empty()) {
+            LOG(ERROR) << "Invalid group, source=" << spec.source
+                       << " snapshot_uri=" << spec.snapshot_uri
+                       << " log_uri=" << spec.log_uri
+                       << " raft_meta_uri=" << spec.raft_meta_uri;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int run_builder() {
+    if (FLAGS_last_index <= 0) {
+        LOG(ERROR) << "--last_index must be positive";
+        return -1;
+    }
+    Configuration conf;
+    if (conf.parse_from(FLAGS_peers) != 0 || conf.empty()) {
+        LOG(ERROR) << "Invalid --peers=" << FLAGS_peers;
+        return -1;
+    }
+    std::vector<GroupSpec> specs;
+    if (load_specs(&specs) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < specs.size(); ++i) {
+        if (build_group(specs[i], conf) != 0) {
+            return -1;
+        }
+    }
+    LOG(INFO) << "Built " << specs.size() << " snapshots at index "
+              << FLAGS_last_index;
+    return 0;
+}
+
+}  // namespace braft
+
+int main(int argc , char* argv[]) {
+    GFLAGS_NS::SetUsageMessage("braft_snapshot_builder --source=DIR "
+                               "--snapshot_uri=URI --last_index=N --peers=CONF");
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    butil::AtExitManager exit_manager;
+    return braft::run_builder() == 0 ? 0 : 1;
+}